@@ -6,6 +6,7 @@
 #include <vr_os.h>
 #include "vr_sandesh.h"
 #include "vr_message.h"
+#include "vr_hash.h"
 #include "vnsw_ip4_mtrie.h"
 
 extern struct vr_nexthop *ip4_default_nh; 
@@ -16,11 +17,45 @@ static struct vr_vrf_stats *invalid_vrf_stats;
 struct vr_nexthop *(*vr_inet_route_lookup)(unsigned int, struct vr_route_req *,
         struct vr_packet *);
 struct vr_vrf_stats *(*vr_inet_vrf_stats)(unsigned short, unsigned int);
+unsigned int (*vr_inet_vrf_gen)(unsigned int);
+void (*vr_inet_route_lookup_bulk)(struct vr_route_req *,
+        struct vr_nexthop **, unsigned int);
+
+/*
+ * per-vrf generation, moved after every change to the table of the vrf.
+ * users that cache the result of a lookup (the flow module) read the
+ * generation before the lookup and compare it with the current one before
+ * using the cached result. 0 is never a valid generation
+ */
+static unsigned int *mtrie_vrf_gen;
+static unsigned int mtrie_max_vrfs;
+
+/*
+ * leaf buckets (buckets of only nexthops) with the same contents are
+ * stored once, and shared between the entries, of any vrf, that need
+ * them. a shared bucket is copied before it is modified
+ */
+int vr_mtrie_share_buckets = 0;
+
+#define MTRIE_SHARED_HASH_SIZE  4096
+static struct ip4_bucket **mtrie_shared_buckets;
+
+/*
+ * buckets taken out of the tables, to be freed together once an update
+ * (or a batch of updates) is done and the lookups have moved on
+ */
+static struct ip4_bucket *mtrie_free_pending;
+
+/* record the depth of 1 in every vr_mtrie_depth_sample lookups */
+unsigned int vr_mtrie_depth_sample = 0;
 
 static struct ip4_mtrie *mtrie_alloc_vrf(unsigned int);
+static inline struct vr_vrf_stats *mtrie_stats(unsigned short, unsigned int);
 
 /* mtrie specific */
 #define IP4_BKT_LEVELS  4 /* 8/8/8/8 */
+/* lookups that mtrie_lookup_bulk walks together */
+#define MTRIE_LOOKUP_BULK_MAX   16
 struct mtrie_bkt_info ip4_bkt_info[IP4_BKT_LEVELS] = {
     {
         .bi_size    =   IP4BUCKET_LEVEL0_SIZE,
@@ -54,6 +89,28 @@ struct mtrie_bkt_info ip4_bkt_info[IP4_BKT_LEVELS] = {
 
 struct ip4_mtrie **vn_rtable;
 
+static unsigned int
+mtrie_gen(unsigned int vrf_id)
+{
+    if (!mtrie_vrf_gen || vrf_id >= mtrie_max_vrfs)
+        return 0;
+
+    return mtrie_vrf_gen[vrf_id];
+}
+
+/* the changes to the table have to be visible before the generation */
+static void
+mtrie_gen_bump(unsigned int vrf_id)
+{
+    if (!mtrie_vrf_gen || vrf_id >= mtrie_max_vrfs)
+        return;
+
+    if (!__sync_add_and_fetch(&mtrie_vrf_gen[vrf_id], 1))
+        mtrie_vrf_gen[vrf_id] = 1;
+
+    return;
+}
+
 /*
  * given a vrf id, get the routing table corresponding to the id
  */
@@ -150,6 +207,83 @@ entry_to_bucket(struct ip4_bucket_entry *ent)
     return NULL;
 }
 
+static inline bool
+mtrie_entries_equal(struct ip4_bucket_entry *a, struct ip4_bucket_entry *b)
+{
+    return ((a->entry_long_i == b->entry_long_i) &&
+            (a->entry_prefix_len == b->entry_prefix_len) &&
+            (a->entry_label_flags == b->entry_label_flags) &&
+            (a->entry_label == b->entry_label));
+}
+
+static unsigned int
+mtrie_bucket_hash(struct ip4_bucket *bkt)
+{
+    unsigned int i, hash = bkt->bkt_level;
+    uint64_t long_i;
+    struct ip4_bucket_entry *ent;
+
+    for (i = 0; i < ip4_bkt_info[bkt->bkt_level].bi_size; i++) {
+        ent = &bkt->bkt_data[i];
+        long_i = ent->entry_long_i;
+        hash = vr_hash_3words((unsigned int)long_i,
+                (unsigned int)(long_i >> 32),
+                (ent->entry_prefix_len << 24) |
+                (ent->entry_label_flags << 20) | ent->entry_label, hash);
+    }
+
+    return hash;
+}
+
+static bool
+mtrie_buckets_equal(struct ip4_bucket *a, struct ip4_bucket *b)
+{
+    unsigned int i;
+
+    if (a->bkt_level != b->bkt_level)
+        return false;
+
+    for (i = 0; i < ip4_bkt_info[a->bkt_level].bi_size; i++)
+        if (!mtrie_entries_equal(&a->bkt_data[i], &b->bkt_data[i]))
+            return false;
+
+    return true;
+}
+
+static void
+mtrie_bucket_unshare(struct ip4_bucket *bkt)
+{
+    struct ip4_bucket **prev;
+
+    if (!bkt->bkt_shared)
+        return;
+
+    prev = &mtrie_shared_buckets[bkt->bkt_hash % MTRIE_SHARED_HASH_SIZE];
+    while (*prev && *prev != bkt)
+        prev = &(*prev)->bkt_next;
+    if (*prev)
+        *prev = bkt->bkt_next;
+
+    bkt->bkt_next = NULL;
+    bkt->bkt_shared = 0;
+
+    return;
+}
+
+/*
+ * drop a reference to the bucket. returns true, if that was the last
+ * reference and the bucket has to be freed
+ */
+static bool
+mtrie_bucket_put(struct ip4_bucket *bkt)
+{
+    if (bkt->bkt_shared && --bkt->bkt_refcnt)
+        return false;
+
+    mtrie_bucket_unshare(bkt);
+    return true;
+}
+
 /*
  * alloc a mtrie bucket
  */
@@ -167,6 +301,8 @@ mtrie_alloc_bucket(unsigned char level, struct ip4_bucket_entry *parent)
     if (!bkt)
         return NULL;
 
+    bkt->bkt_refcnt = 1;
+    bkt->bkt_level = level;
     for (i = 0; i < bkt_size; i++) {
         ent = &bkt->bkt_data[i];
         set_entry_to_nh(ent, parent->entry_nh_p);
@@ -178,25 +314,148 @@ mtrie_alloc_bucket(unsigned char level, struct ip4_bucket_entry *parent)
     return bkt;
 }
 
+/*
+ * the bucket of 'ent', made private to 'ent' before it is modified. a
+ * bucket that other entries also point to is copied, and 'ent' is moved
+ * to the copy. only leaf buckets are shared
+ */
+static struct ip4_bucket *
+mtrie_bucket_own(struct ip4_bucket_entry *ent)
+{
+    unsigned int i;
+    struct ip4_bucket *bkt, *copy;
+
+    bkt = entry_to_bucket(ent);
+    if (!bkt || !bkt->bkt_shared)
+        return bkt;
+
+    if (bkt->bkt_refcnt == 1) {
+        mtrie_bucket_unshare(bkt);
+        return bkt;
+    }
+
+    copy = vr_zalloc(sizeof(struct ip4_bucket) +
+            sizeof(struct ip4_bucket_entry) *
+            ip4_bkt_info[bkt->bkt_level].bi_size);
+    if (!copy)
+        return NULL;
+
+    copy->bkt_refcnt = 1;
+    copy->bkt_level = bkt->bkt_level;
+    for (i = 0; i < ip4_bkt_info[bkt->bkt_level].bi_size; i++) {
+        set_entry_to_nh(&copy->bkt_data[i], bkt->bkt_data[i].entry_nh_p);
+        copy->bkt_data[i].entry_prefix_len = bkt->bkt_data[i].entry_prefix_len;
+        copy->bkt_data[i].entry_label_flags =
+            bkt->bkt_data[i].entry_label_flags;
+        copy->bkt_data[i].entry_label = bkt->bkt_data[i].entry_label;
+    }
+
+    ent->entry_long_i = (unsigned long)copy | 0x1ul;
+    bkt->bkt_refcnt--;
+
+    return copy;
+}
+
+static void ip4_bucket_sched_for_free(struct ip4_bucket *);
+
+/*
+ * called for the bucket of 'ent' once the buckets below it are done with.
+ * a leaf bucket of the same nexthop all through is folded into 'ent', and
+ * any other leaf bucket is replaced by the shared copy of the same
+ * contents, if there is one
+ */
+static void
+mtrie_share_bucket(struct ip4_bucket_entry *ent, int level)
+{
+    unsigned int i, hash;
+    bool uniform = true;
+    struct ip4_bucket *bkt, *shared;
+
+    bkt = entry_to_bucket(ent);
+    if (!bkt || bkt->bkt_shared)
+        return;
+
+    for (i = 0; i < ip4_bkt_info[level].bi_size; i++) {
+        if (ENTRY_IS_BUCKET(&bkt->bkt_data[i]))
+            return;
+        if (uniform && i &&
+                !mtrie_entries_equal(&bkt->bkt_data[i], &bkt->bkt_data[0]))
+            uniform = false;
+    }
+
+    if (uniform) {
+        set_entry_to_nh(ent, bkt->bkt_data[0].entry_nh_p);
+        ent->entry_prefix_len = bkt->bkt_data[0].entry_prefix_len;
+        ent->entry_label_flags = bkt->bkt_data[0].entry_label_flags;
+        ent->entry_label = bkt->bkt_data[0].entry_label;
+        ip4_bucket_sched_for_free(bkt);
+        return;
+    }
+
+    if (!vr_mtrie_share_buckets || !mtrie_shared_buckets)
+        return;
+
+    hash = mtrie_bucket_hash(bkt);
+    for (shared = mtrie_shared_buckets[hash % MTRIE_SHARED_HASH_SIZE];
+            shared; shared = shared->bkt_next) {
+        if (shared->bkt_hash == hash && mtrie_buckets_equal(shared, bkt)) {
+            shared->bkt_refcnt++;
+            ent->entry_long_i = (unsigned long)shared | 0x1ul;
+            ip4_bucket_sched_for_free(bkt);
+            return;
+        }
+    }
+
+    bkt->bkt_hash = hash;
+    bkt->bkt_shared = 1;
+    bkt->bkt_next = mtrie_shared_buckets[hash % MTRIE_SHARED_HASH_SIZE];
+    mtrie_shared_buckets[hash % MTRIE_SHARED_HASH_SIZE] = bkt;
+
+    return;
+}
+
+/* mtrie_share_bucket for the whole subtree under 'ent' */
 static void
+mtrie_share_entry(struct ip4_bucket_entry *ent, int level)
+{
+    unsigned int i;
+    struct ip4_bucket *bkt;
+
+    bkt = entry_to_bucket(ent);
+    if (!bkt || bkt->bkt_shared)
+        return;
+
+    if (level < IP4_BKT_LEVELS - 1)
+        for (i = 0; i < ip4_bkt_info[level].bi_size; i++)
+            mtrie_share_entry(&bkt->bkt_data[i], level + 1);
+
+    mtrie_share_bucket(ent, level);
+    return;
+}
+
+static int
 add_to_tree(struct ip4_bucket_entry *ent, int level, struct vr_route_req *rt)
 {
+    int ret;
     unsigned int i;
     struct ip4_bucket              *bkt;
 
     if (level >= IP4_BKT_LEVELS - 1)
         /* assert here ? */
-        return;
+        return 0;
 
     /* assured that the first one is a bucket */
-    bkt = entry_to_bucket(ent);
+    bkt = mtrie_bucket_own(ent);
+    if (!bkt)
+        return -ENOMEM;
     level++;
 
     for (i = 0; i < ip4_bkt_info[level].bi_size; i++) {
         ent = index_to_entry(bkt, i);
-        if (!ENTRY_IS_NEXTHOP(ent))
-            add_to_tree(ent, level, rt);
-        else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
+        if (!ENTRY_IS_NEXTHOP(ent)) {
+            if ((ret = add_to_tree(ent, level, rt)))
+                return ret;
+        } else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
             /* a less specific entry, which needs to be replaced */
             set_entry_to_nh(ent, rt->rtr_nh);
             ent->entry_prefix_len = rt->rtr_req.rtr_prefix_len;
@@ -205,7 +464,7 @@ add_to_tree(struct ip4_bucket_entry *ent, int level, struct vr_route_req *rt)
         }
     }
 
-    return;
+    return 0;
 }
 
 static void
@@ -223,6 +482,10 @@ mtrie_free_entry(struct ip4_bucket_entry *entry, unsigned int level)
     if (!bkt)
         return;
 
+    entry->entry_bkt_p = NULL;
+    if (!mtrie_bucket_put(bkt))
+        return;
+
     for (i = 0; i < ip4_bkt_info[level].bi_size; i++)
         if (ENTRY_IS_BUCKET(&bkt->bkt_data[i])) {
             mtrie_free_entry(&bkt->bkt_data[i], level + 1);
@@ -232,7 +495,6 @@ mtrie_free_entry(struct ip4_bucket_entry *entry, unsigned int level)
             }
         }
 
-    entry->entry_bkt_p = NULL;
     vr_free(bkt);
 
     return;
@@ -271,12 +533,13 @@ mtrie_reset_entry(struct ip4_bucket_entry *ent, int level,
  * covers them.
  */
 static int
-__mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt)
+__mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt, bool fold)
 {
     int                         ret, index, level, err_level = 0;
     unsigned int                i, fin;
     struct ip4_bucket          *bkt;
     struct ip4_bucket_entry    *ent, *err_ent = NULL;
+    struct ip4_bucket_entry    *path[IP4_BKT_LEVELS];
     struct vr_nexthop          *nh, *err_nh = NULL;
 
     ent = &mtrie->root;
@@ -292,7 +555,8 @@ __mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt)
             }
         }
 
-        bkt = entry_to_bucket(ent);
+        path[level] = ent;
+        bkt = mtrie_bucket_own(ent);
         if (!bkt) {
             ret = -ENOMEM;
             goto exit_ret;
@@ -327,9 +591,10 @@ __mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt)
 
              for (i = index; i < fin; i++) {
                 ent = index_to_entry(bkt, i);
-                if (ENTRY_IS_BUCKET(ent))
-                    add_to_tree(ent, level, rt);
-                else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
+                if (ENTRY_IS_BUCKET(ent)) {
+                    if ((ret = add_to_tree(ent, level, rt)))
+                        goto exit_ret;
+                } else if (ent->entry_prefix_len <= rt->rtr_req.rtr_prefix_len) {
                     /* a less specific entry, which needs to be replaced */
                     set_entry_to_nh(ent, rt->rtr_nh);
                     ent->entry_prefix_len = rt->rtr_req.rtr_prefix_len;
@@ -342,6 +607,17 @@ __mtrie_add(struct ip4_mtrie *mtrie, struct vr_route_req *rt)
         }
     }
 
+    if (!fold)
+        return 0;
+
+    /* fold and share what changed, from the bottom up */
+    if (level < IP4_BKT_LEVELS - 1)
+        for (i = index; i < fin; i++)
+            mtrie_share_entry(index_to_entry(bkt, i), level + 1);
+
+    for (; level >= 0; level--)
+        mtrie_share_bucket(path[level], level);
+
     return 0;
 
 exit_ret:
@@ -353,41 +629,49 @@ exit_ret:
 
 
 static void
-ip4_bucket_sched_for_free(struct ip4_bucket *bkt, int level)
+ip4_bucket_sched_for_free(struct ip4_bucket *bkt)
 {
-    unsigned int i;
-    struct ip4_bucket_entry *tmp_ent;
+    if (!mtrie_bucket_put(bkt))
+        return;
 
-    vr_delay_op();
-    for (i = 0; i < ip4_bkt_info[level].bi_size; i++) {
-        tmp_ent = &bkt->bkt_data[i];
-        if (tmp_ent->entry_nh_p) {
-            vrouter_put_nexthop(tmp_ent->entry_nh_p);
-        }
-    }
-    vr_free(bkt);
+    bkt->bkt_next = mtrie_free_pending;
+    mtrie_free_pending = bkt;
+
+    return;
 }
 
+/* one grace period for all the buckets freed by an update */
 static void
-free_bucket(struct ip4_bucket_entry *ent, int level, struct vr_route_req *rt)
+mtrie_free_pending_buckets(void)
 {
-    struct ip4_bucket *bkt;
+    unsigned int i;
+    struct ip4_bucket *bkt, *next;
+    struct ip4_bucket_entry *tmp_ent;
 
-    if (ENTRY_IS_NEXTHOP(ent)) {
+    bkt = mtrie_free_pending;
+    if (!bkt)
         return;
+
+    mtrie_free_pending = NULL;
+    vr_delay_op();
+
+    for (; bkt; bkt = next) {
+        next = bkt->bkt_next;
+        for (i = 0; i < ip4_bkt_info[bkt->bkt_level].bi_size; i++) {
+            tmp_ent = &bkt->bkt_data[i];
+            if (tmp_ent->entry_nh_p) {
+                vrouter_put_nexthop(tmp_ent->entry_nh_p);
+            }
+        }
+        vr_free(bkt);
     }
 
-    bkt = entry_to_bucket(ent);
-    set_entry_to_nh(ent, rt->rtr_nh);
-    ent->entry_label_flags = rt->rtr_req.rtr_label_flags;
-    ent->entry_label = rt->rtr_req.rtr_label;
-    
-    ip4_bucket_sched_for_free(bkt, level);
+    return;
 }
 
 static int
 __mtrie_delete(struct vr_route_req *rt, struct ip4_bucket_entry *ent,
-                unsigned char level)
+                unsigned char level, bool fold)
 {
     unsigned int        index, i, fin;
     struct ip4_bucket    *bkt;
@@ -396,12 +680,14 @@ __mtrie_delete(struct vr_route_req *rt, struct ip4_bucket_entry *ent,
     if (ENTRY_IS_NEXTHOP(ent))
         return -ENOENT;
 
-    bkt = entry_to_bucket(ent);
+    bkt = mtrie_bucket_own(ent);
+    if (!bkt)
+        return -ENOMEM;
     index = rt_to_index(rt, level);
 
     if (rt->rtr_req.rtr_prefix_len > ip4_bkt_info[level].bi_pfx_len) {
         tmp_ent = index_to_entry(bkt, index);
-        __mtrie_delete(rt, tmp_ent, level + 1);
+        __mtrie_delete(rt, tmp_ent, level + 1, fold);
     } else {
         if ((rt->rtr_req.rtr_prefix_len >
                 (ip4_bkt_info[level].bi_pfx_len - ip4_bkt_info[level].bi_bits)) &&
@@ -424,25 +710,13 @@ __mtrie_delete(struct vr_route_req *rt, struct ip4_bucket_entry *ent,
                 tmp_ent->entry_label = rt->rtr_req.rtr_label;
                 tmp_ent->entry_prefix_len = rt->rtr_req.rtr_replace_plen;
             } else 
-                __mtrie_delete(rt, tmp_ent, level + 1);
+                __mtrie_delete(rt, tmp_ent, level + 1, fold);
         }
     }
 
-    /* check if current bucket neds to be deleted */
-    for (i = 1; i < ip4_bkt_info[level].bi_size; i++) {
-        if ((bkt->bkt_data[i].entry_long_i == bkt->bkt_data[0].entry_long_i) &&
-                (bkt->bkt_data[i].entry_label_flags ==
-                	bkt->bkt_data[0].entry_label_flags) &&
-                (bkt->bkt_data[i].entry_label ==
-                	bkt->bkt_data[0].entry_label) && 
-                (bkt->bkt_data[i].entry_prefix_len == 
-			bkt->bkt_data[0].entry_prefix_len)) {
-            continue;
-        } else
-            return 0;
-    }
-
-    free_bucket(ent, level, rt);
+    /* check if current bucket neds to be deleted (or can be shared) */
+    if (fold)
+        mtrie_share_bucket(ent, level);
     return 0;
 }
 
@@ -464,6 +738,7 @@ mtrie_dumper_make_response(struct vr_message_dumper *dumper, vr_route_req *resp,
 {
     vr_route_req *req = (vr_route_req *)dumper->dump_req;
 
+    memset(resp, 0, sizeof(*resp));
     resp->rtr_vrf_id = req->rtr_vrf_id;
     resp->rtr_family = req->rtr_family;
     resp->rtr_prefix = prefix;
@@ -480,93 +755,107 @@ mtrie_dumper_make_response(struct vr_message_dumper *dumper, vr_route_req *resp,
     return;
 }
 
+/*
+ * the walk is iterative, with the path from the root to the current entry
+ * kept in the dumper as a cursor (the index of the next entry at every
+ * level). a dump that continues from a marker sets the cursor up straight
+ * from the prefix of the marker, and carries on from the entry after the
+ * marker. if the marker route has gone away in the meantime, the walk
+ * carries on from the entry that covers it now
+ */
 static int
-mtrie_dump_entry(struct vr_message_dumper *dumper, struct ip4_bucket_entry *ent,
-        unsigned int byte, int level)
+mtrie_walk(struct vr_message_dumper *dumper)
 {
 #ifdef VR_ROUTE_DEBUG
     unsigned char *addr;
 #endif
-    unsigned int i = 0, prefix;
-    int ret;
-    struct ip4_bucket *bkt;
-    struct ip4_bucket_entry *ent_p = ent;
+    int level, l;
+    unsigned int index, prefix;
     vr_route_req *req, resp;
+    struct ip4_mtrie *mtrie;
+    struct ip4_bucket *bkts[IP4_BKT_LEVELS];
+    struct ip4_bucket_entry *ent;
+
+    req = (vr_route_req *)dumper->dump_req;
+    mtrie = vrfid_to_mtrie(req->rtr_vrf_id);
+    if (!mtrie)
+        return -EINVAL; 
+
+    if (!ENTRY_IS_BUCKET(&mtrie->root))
+        return 0;
+
+    level = 0;
+    bkts[0] = entry_to_bucket(&mtrie->root);
+    dumper->dump_cursor[0] = 0;
 
-    req = dumper->dump_req;
     if (!dumper->dump_been_to_marker) {
-        i = PREFIX_TO_INDEX(req->rtr_marker, level);
-        bkt = entry_to_bucket(ent);
-        ent = index_to_entry(bkt, i);
+        for (level = 0; level < IP4_BKT_LEVELS - 1; level++) {
+            index = PREFIX_TO_INDEX((unsigned int)req->rtr_marker, level);
+            dumper->dump_cursor[level] = index + 1;
+            if (ip4_bkt_info[level].bi_pfx_len >= req->rtr_marker_plen)
+                break;
 
-        prefix = byte | (i << ip4_bkt_info[level].bi_shift);
-        if ((prefix == (unsigned int)req->rtr_marker &&
-                    ip4_bkt_info[level].bi_pfx_len == req->rtr_marker_plen))
-            dumper->dump_been_to_marker = 1;
+            ent = index_to_entry(bkts[level], index);
+            if (!ENTRY_IS_BUCKET(ent))
+                break;
 
-        if (ENTRY_IS_BUCKET(ent) && !dumper->dump_been_to_marker) {
-            if (mtrie_dump_entry(dumper, ent, prefix, level + 1))
-                return -1;
-            i++;
-        } else {
-            if (dumper->dump_been_to_marker)
-                i++;
-            dumper->dump_been_to_marker = 1;
+            bkts[level + 1] = entry_to_bucket(ent);
         }
+
+        if (level == IP4_BKT_LEVELS - 1)
+            dumper->dump_cursor[level] =
+                PREFIX_TO_INDEX((unsigned int)req->rtr_marker, level) + 1;
+        dumper->dump_been_to_marker = 1;
     }
 
-    if (ENTRY_IS_BUCKET(ent_p)) {
-        bkt = entry_to_bucket(ent_p);
-        for (; i < ip4_bkt_info[level].bi_size; i++) {
-            ent = &bkt->bkt_data[i];
-            prefix = byte | (i << ip4_bkt_info[level].bi_shift);
-            if (mtrie_dump_entry(dumper, ent, prefix, level + 1) < 0)
-                return -1;
+    while (level >= 0) {
+        index = dumper->dump_cursor[level];
+        if (index >= ip4_bkt_info[level].bi_size) {
+            level--;
+            continue;
         }
-    } else if (ent_p->entry_nh_p) {
-        mtrie_dumper_make_response(dumper, &resp, ent_p, byte,
-                ip4_bkt_info[level - 1].bi_pfx_len);
+
+        dumper->dump_cursor[level] = index + 1;
+        ent = index_to_entry(bkts[level], index);
+        if (ENTRY_IS_BUCKET(ent)) {
+            if (level == IP4_BKT_LEVELS - 1)
+                continue;
+
+            bkts[++level] = entry_to_bucket(ent);
+            dumper->dump_cursor[level] = 0;
+            continue;
+        }
+
+        if (!ent->entry_nh_p)
+            continue;
+
+        prefix = index << ip4_bkt_info[level].bi_shift;
+        for (l = 0; l < level; l++)
+            prefix |= (dumper->dump_cursor[l] - 1) << ip4_bkt_info[l].bi_shift;
+
+        mtrie_dumper_make_response(dumper, &resp, ent, prefix,
+                ip4_bkt_info[level].bi_pfx_len);
 
 #ifdef VR_ROUTE_DEBUG
-        addr = (unsigned char *)&byte;
+        addr = (unsigned char *)&prefix;
         vr_printf("%u.%u.%u.%u/%u\t\t", addr[3], addr[2], addr[1], addr[0],
-                        ip4_bkt_info[level - 1].bi_pfx_len);
-        if (ent_p->entry_label_flags) {
-            vr_printf("%d\t", ent_p->entry_label);
+                        ip4_bkt_info[level].bi_pfx_len);
+        if (ent->entry_label_flags) {
+            vr_printf("%d\t", ent->entry_label);
         } else {
             vr_printf("N/A\t");
         }
-        vr_printf("%d\n", ent_p->entry_nh_p->nh_id);
+        vr_printf("%d\n", ent->entry_nh_p->nh_id);
 #endif
 
-        ret = mtrie_dumper_route_encode(dumper, &resp);
-        if (ret <= 0)
+        /* the buffer is full; the next dump starts after the last route */
+        if (mtrie_dumper_route_encode(dumper, &resp) <= 0)
             return -1;
     }
 
     return 0;
 }
 
-static int
-mtrie_walk(struct vr_message_dumper *dumper)
-{
-    vr_route_req *req;
-    struct ip4_mtrie *mtrie;
-    struct ip4_bucket_entry *ent;
-
-    req = (vr_route_req *)dumper->dump_req;
-    mtrie = vrfid_to_mtrie(req->rtr_vrf_id);
-    if (!mtrie)
-        return -EINVAL; 
-
-    ent = &mtrie->root;
-    if (ENTRY_IS_BUCKET(ent)) {
-        return mtrie_dump_entry(dumper, ent, 0, 0);
-    }
-
-    return 0;
-}
-
 static int
 mtrie_dump(struct vr_rtable * __unsued, struct vr_route_req *rt)
 {
@@ -579,7 +868,8 @@ mtrie_dump(struct vr_rtable * __unsued, struct vr_route_req *rt)
         goto generate_response;
     }
 
-    if (!((vr_route_req *)(dumper->dump_req))->rtr_marker)
+    if (!((vr_route_req *)(dumper->dump_req))->rtr_marker &&
+            !((vr_route_req *)(dumper->dump_req))->rtr_marker_plen)
         dumper->dump_been_to_marker = 1;
 
     ret = mtrie_walk(dumper);
@@ -612,12 +902,15 @@ mtrie_delete(struct vr_rtable * _unused, struct vr_route_req *rt)
     if (!rtable)
         return -ENOENT;
 
-    rt->rtr_nh = vrouter_get_nexthop(rt->rtr_req.rtr_rid, rt->rtr_req.rtr_nh_id);
+    /* requests are serialized, so the nexthop cannot go away under us */
+    rt->rtr_nh = __vrouter_get_nexthop(vrouter_get(rt->rtr_req.rtr_rid),
+            rt->rtr_req.rtr_nh_id);
     if (!rt->rtr_nh)
         return -ENOENT;
 
-    __mtrie_delete(rt, &rtable->root, 0);
-    vrouter_put_nexthop(rt->rtr_nh);
+    __mtrie_delete(rt, &rtable->root, 0, true);
+    mtrie_gen_bump(vrf_id);
+    mtrie_free_pending_buckets();
 
    return 0;
 }
@@ -631,11 +924,62 @@ mtrie_stats(unsigned short vrf, unsigned int cpu)
     return &((mtrie_vrf_stats[vrf])[cpu]);
 }
 
+/*
+ * the buckets of a vrf, by level, and the memory they take. shared buckets
+ * are counted apart, and not in the memory of the vrf
+ */
+static void
+mtrie_count_buckets(struct ip4_bucket_entry *ent, int level,
+        vr_vrf_stats_req *response)
+{
+    unsigned int i;
+    struct ip4_bucket *bkt;
+
+    bkt = entry_to_bucket(ent);
+    if (!bkt)
+        return;
+
+    if (bkt->bkt_shared) {
+        response->vsr_shared_buckets++;
+        return;
+    }
+
+    switch (level) {
+    case IP4BUCKET_LEVEL0:
+        response->vsr_l0_buckets++;
+        break;
+
+    case IP4BUCKET_LEVEL1:
+        response->vsr_l1_buckets++;
+        break;
+
+    case IP4BUCKET_LEVEL2:
+        response->vsr_l2_buckets++;
+        break;
+
+    default:
+        response->vsr_l3_buckets++;
+        break;
+    }
+
+    response->vsr_bucket_bytes += sizeof(struct ip4_bucket) +
+        sizeof(struct ip4_bucket_entry) * ip4_bkt_info[level].bi_size;
+
+    if (level >= IP4_BKT_LEVELS - 1)
+        return;
+
+    for (i = 0; i < ip4_bkt_info[level].bi_size; i++)
+        mtrie_count_buckets(&bkt->bkt_data[i], level + 1, response);
+
+    return;
+}
+
 static int
 mtrie_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
 {
     unsigned int i;
     struct vr_vrf_stats *stats;
+    struct ip4_mtrie *mtrie;
 
     memset(response, 0, sizeof(*response));
 
@@ -661,9 +1005,22 @@ mtrie_stats_get(vr_vrf_stats_req *req, vr_vrf_stats_req *response)
             response->vsr_gre_mpls_tunnels  += stats->vrf_gre_mpls_tunnels;
             response->vsr_l2_encaps += stats->vrf_l2_encaps;
             response->vsr_encaps += stats->vrf_encaps;
+            response->vsr_root_hits += stats->vrf_lookup_depth[0];
+            response->vsr_l0_hits += stats->vrf_lookup_depth[1];
+            response->vsr_l1_hits += stats->vrf_lookup_depth[2];
+            response->vsr_l2_hits += stats->vrf_lookup_depth[3];
+            response->vsr_l3_hits += stats->vrf_lookup_depth[4];
+            response->vsr_rx_packets += stats->vrf_rx_packets;
+            response->vsr_rx_bytes += stats->vrf_rx_bytes;
+            response->vsr_tx_packets += stats->vrf_tx_packets;
+            response->vsr_tx_bytes += stats->vrf_tx_bytes;
         }
     }
 
+    mtrie = vrfid_to_mtrie(req->vsr_vrf);
+    if (mtrie)
+        mtrie_count_buckets(&mtrie->root, 0, response);
+
     return 0;
 }
 
@@ -675,12 +1032,74 @@ mtrie_stats_empty(vr_vrf_stats_req *r)
             r->vsr_l2_mcast_composites || r->vsr_fabric_composites ||
             r->vsr_multi_proto_composites || r->vsr_udp_tunnels || 
             r->vsr_udp_mpls_tunnels || r->vsr_gre_mpls_tunnels || 
-            r->vsr_l2_encaps || r->vsr_encaps)
+            r->vsr_l2_encaps || r->vsr_encaps ||
+            r->vsr_l0_buckets || r->vsr_shared_buckets || r->vsr_root_hits ||
+            r->vsr_l0_hits || r->vsr_l1_hits || r->vsr_l2_hits ||
+            r->vsr_l3_hits || r->vsr_rx_packets || r->vsr_tx_packets)
         return false;
 
     return true;
 }
 
+static uint64_t
+mtrie_stats_bytes(unsigned short vrf)
+{
+    unsigned int i;
+    uint64_t bytes = 0;
+    struct vr_vrf_stats *stats;
+
+    for (i = 0; i < vr_num_cpus; i++) {
+        stats = mtrie_stats(vrf, i);
+        bytes += stats->vrf_rx_bytes + stats->vrf_tx_bytes;
+    }
+
+    return bytes;
+}
+
+/*
+ * the vsr_top vrfs that moved the most bytes (in and out), busiest first,
+ * in one response
+ */
+static int
+mtrie_stats_top(struct vr_rtable *rtable, vr_vrf_stats_req *req,
+        struct vr_message_dumper *dumper)
+{
+    int len;
+    unsigned int i, j, n = 0, top = req->vsr_top;
+    uint64_t bytes, top_bytes[VR_VRF_STATS_TOP_MAX];
+    unsigned short top_vrfs[VR_VRF_STATS_TOP_MAX];
+    vr_vrf_stats_req response;
+
+    if (top > VR_VRF_STATS_TOP_MAX)
+        top = VR_VRF_STATS_TOP_MAX;
+
+    for (i = 0; i < rtable->algo_max_vrfs; i++) {
+        bytes = mtrie_stats_bytes(i);
+        if (!bytes || (n == top && bytes <= top_bytes[n - 1]))
+            continue;
+
+        if (n < top)
+            n++;
+        for (j = n - 1; j && top_bytes[j - 1] < bytes; j--) {
+            top_bytes[j] = top_bytes[j - 1];
+            top_vrfs[j] = top_vrfs[j - 1];
+        }
+        top_bytes[j] = bytes;
+        top_vrfs[j] = i;
+    }
+
+    for (i = 0; i < n; i++) {
+        req->vsr_vrf = top_vrfs[i];
+        mtrie_stats_get(req, &response);
+        len = vr_message_dump_object(dumper, VR_VRF_STATS_OBJECT_ID,
+                &response);
+        if (len <= 0)
+            return len;
+    }
+
+    return 0;
+}
+
 static int
 mtrie_stats_dump(struct vr_rtable *rtable, vr_vrf_stats_req *req)
 {
@@ -695,6 +1114,10 @@ mtrie_stats_dump(struct vr_rtable *rtable, vr_vrf_stats_req *req)
         goto generate_response;
     }
 
+    if (req->vsr_top > 0) {
+        ret = mtrie_stats_top(rtable, req, dumper);
+        goto generate_response;
+    }
 
     for (i = req->vsr_marker + 1; i < rtable->algo_max_vrfs; i++) {
         req->vsr_vrf = i;
@@ -720,6 +1143,27 @@ generate_response:
 
     return 0;
 }
+/* depth 0 is a hit at the root, and depth n + 1 a hit in a level n bucket */
+static inline void
+mtrie_sample_depth(unsigned int vrf_id, unsigned int depth)
+{
+    struct vr_vrf_stats *stats;
+
+    if (!vr_mtrie_depth_sample || !mtrie_vrf_stats)
+        return;
+
+    stats = mtrie_stats(vrf_id, vr_get_cpu());
+    if (stats->vrf_lookup_sample) {
+        stats->vrf_lookup_sample--;
+        return;
+    }
+
+    stats->vrf_lookup_sample = vr_mtrie_depth_sample - 1;
+    stats->vrf_lookup_depth[depth]++;
+
+    return;
+}
+
 /*
  * longest prefix match. go down the tree till you encounter a next-hop.
  * if no nexthop, there is something wrong with the tree which was built.
@@ -727,8 +1171,7 @@ generate_response:
  * returns the nexthop of the LPM route
  */
 static struct vr_nexthop *
-mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
-        struct vr_packet *pkt)
+__mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt)
 {
     unsigned int        level, index;
     unsigned long       ptr;
@@ -753,6 +1196,7 @@ mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
         rt->rtr_req.rtr_label_flags = ent->entry_label_flags;
         rt->rtr_req.rtr_label = ent->entry_label;
         rt->rtr_req.rtr_prefix_len = ent->entry_prefix_len;
+        mtrie_sample_depth(vrf_id, 0);
         return PTR_TO_NEXTHOP(ptr);
     }
 
@@ -768,6 +1212,7 @@ mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
             rt->rtr_req.rtr_label_flags = ent->entry_label_flags;
             rt->rtr_req.rtr_label = ent->entry_label;
             rt->rtr_req.rtr_prefix_len = ent->entry_prefix_len;
+            mtrie_sample_depth(vrf_id, level + 1);
             return PTR_TO_NEXTHOP(ptr);
         }
 
@@ -780,6 +1225,126 @@ mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
     return NULL;
 }
 
+static struct vr_nexthop *
+mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
+        struct vr_packet *pkt)
+{
+    uint64_t start = vr_perf_start();
+    struct vr_nexthop *nh;
+
+    nh = __mtrie_lookup(vrf_id, rt);
+    vr_perf_end(VR_PERF_MTRIE_LOOKUP, start, 1);
+
+    return nh;
+}
+
+static void
+__mtrie_lookup_bulk(struct vr_route_req *rts, struct vr_nexthop **nhs,
+        unsigned int num)
+{
+    unsigned int i, level, pending;
+    unsigned long ptr;
+    struct ip4_mtrie *table;
+    struct vr_route_req *rt;
+    struct ip4_bucket_entry *ent[MTRIE_LOOKUP_BULK_MAX];
+    unsigned char depth[MTRIE_LOOKUP_BULK_MAX];
+
+    /*
+     * the root entries. whatever is still a tree walk gets its level 0
+     * entry prefetched
+     */
+    pending = 0;
+    for (i = 0; i < num; i++) {
+        rt = &rts[i];
+        ent[i] = NULL;
+        nhs[i] = ip4_default_nh;
+        depth[i] = 0;
+
+        if (rt->rtr_req.rtr_prefix_len != IP4_PREFIX_LEN)
+            continue;
+
+        table = vrfid_to_mtrie(rt->rtr_req.rtr_vrf_id);
+        if (!table)
+            continue;
+
+        ptr = table->root.entry_long_i;
+        if (!ptr)
+            continue;
+
+        if (PTR_IS_NEXTHOP(ptr)) {
+            ent[i] = &table->root;
+            continue;
+        }
+
+        ent[i] = index_to_entry(PTR_TO_BUCKET(ptr), rt_to_index(rt, 0));
+        vr_prefetch(ent[i]);
+        depth[i] = 1;
+        pending++;
+    }
+
+    /*
+     * one level for all the lookups at a time, so that the loads of the
+     * different lookups overlap instead of stalling one after the other
+     */
+    for (level = 1; pending && level < IP4_BKT_LEVELS; level++) {
+        pending = 0;
+        for (i = 0; i < num; i++) {
+            if (!ent[i])
+                continue;
+
+            ptr = ent[i]->entry_long_i;
+            if (PTR_IS_NEXTHOP(ptr))
+                continue;
+
+            ent[i] = index_to_entry(PTR_TO_BUCKET(ptr),
+                    rt_to_index(&rts[i], level));
+            vr_prefetch(ent[i]);
+            depth[i]++;
+            pending++;
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        if (!ent[i])
+            continue;
+
+        ptr = ent[i]->entry_long_i;
+        /* a bucket at the last level; there is something wrong with the tree */
+        ASSERT(PTR_IS_NEXTHOP(ptr));
+
+        rt = &rts[i];
+        rt->rtr_req.rtr_label_flags = ent[i]->entry_label_flags;
+        rt->rtr_req.rtr_label = ent[i]->entry_label;
+        rt->rtr_req.rtr_prefix_len = ent[i]->entry_prefix_len;
+        nhs[i] = PTR_TO_NEXTHOP(ptr);
+        mtrie_sample_depth(rt->rtr_req.rtr_vrf_id, depth[i]);
+    }
+
+    return;
+}
+
+/*
+ * mtrie_lookup for a burst of /32 lookups, each in the vrf of its route
+ * request. the tree walks of the lookups are interleaved, with the entry
+ * of the next level prefetched for all of them before any is read
+ */
+static void
+mtrie_lookup_bulk(struct vr_route_req *rts, struct vr_nexthop **nhs,
+        unsigned int num)
+{
+    unsigned int i, count;
+
+    for (i = 0; i < num; i += count) {
+        count = num - i;
+        if (count > MTRIE_LOOKUP_BULK_MAX)
+            count = MTRIE_LOOKUP_BULK_MAX;
+
+        __mtrie_lookup_bulk(&rts[i], &nhs[i], count);
+    }
+
+    return;
+}
+
 /*
  * adds a route to the corresponding vrf table. returns 0 on
  * success and non-zero otherwise
@@ -795,21 +1360,137 @@ mtrie_add(struct vr_rtable * _unused, struct vr_route_req *rt)
     if (!mtrie)
         return -ENOMEM;
 
-    rt->rtr_nh = vrouter_get_nexthop(rt->rtr_req.rtr_rid, rt->rtr_req.rtr_nh_id);
+    /* requests are serialized, so the nexthop cannot go away under us */
+    rt->rtr_nh = __vrouter_get_nexthop(vrouter_get(rt->rtr_req.rtr_rid),
+            rt->rtr_req.rtr_nh_id);
     if (!rt->rtr_nh)
         return -ENOENT;
 
 
     if ((!(rt->rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)) &&
-                 (rt->rtr_nh->nh_type == NH_TUNNEL)) {
-        vrouter_put_nexthop(rt->rtr_nh);
+                 (rt->rtr_nh->nh_type == NH_TUNNEL))
         return -EINVAL;
-    }
-    ret = __mtrie_add(mtrie, rt);
-    vrouter_put_nexthop(rt->rtr_nh);
+
+    ret = __mtrie_add(mtrie, rt, true);
+    mtrie_gen_bump(vrf_id);
+    mtrie_free_pending_buckets();
     return ret;
 }
 
+static inline bool
+mtrie_bulk_before(struct vr_route_req *a, struct vr_route_req *b)
+{
+    if ((unsigned int)a->rtr_req.rtr_prefix !=
+            (unsigned int)b->rtr_req.rtr_prefix)
+        return (unsigned int)a->rtr_req.rtr_prefix <
+            (unsigned int)b->rtr_req.rtr_prefix;
+
+    return a->rtr_req.rtr_prefix_len < b->rtr_req.rtr_prefix_len;
+}
+
+/*
+ * a batch of route adds and deletes (as per rtr_req.h_op) to the table of
+ * one vrf. the routes are applied in prefix order, so that the routes of a
+ * subtree are applied one after the other. the folding and sharing of the
+ * buckets is done once for every subtree (of the root bucket) that the
+ * batch touched rather than once per route, and all the buckets freed by
+ * the batch wait out a single grace period. the result of every route is
+ * returned in 'errors'; routes with an error already set are skipped
+ */
+static int
+mtrie_bulk(struct vr_rtable * _unused, struct vr_route_req *rts,
+        unsigned int count, int *errors)
+{
+    int ret;
+    bool touched_all = false;
+    unsigned int i, j, tmp, vrf_id;
+    unsigned int *order;
+    unsigned char touched[IP4BUCKET_LEVEL0_SIZE / 8];
+    struct ip4_mtrie *mtrie;
+    struct ip4_bucket *bkt;
+    struct vr_route_req *rt;
+
+    if (!count)
+        return 0;
+
+    vrf_id = rts[0].rtr_req.rtr_vrf_id;
+    mtrie = vrfid_to_mtrie(vrf_id);
+    mtrie = (mtrie ? : mtrie_alloc_vrf(vrf_id));
+    if (!mtrie)
+        return -ENOMEM;
+
+    order = vr_malloc(count * sizeof(unsigned int));
+    if (!order)
+        return -ENOMEM;
+
+    /*
+     * a stable insertion sort, that does not reorder the updates of a
+     * prefix. batches from the agent usually come sorted already
+     */
+    for (i = 0; i < count; i++) {
+        tmp = i;
+        for (j = i; j && mtrie_bulk_before(&rts[tmp], &rts[order[j - 1]]); j--)
+            order[j] = order[j - 1];
+        order[j] = tmp;
+    }
+
+    memset(touched, 0, sizeof(touched));
+    for (i = 0; i < count; i++) {
+        rt = &rts[order[i]];
+        if (errors[order[i]])
+            continue;
+
+        if ((unsigned int)rt->rtr_req.rtr_vrf_id != vrf_id) {
+            errors[order[i]] = -EINVAL;
+            continue;
+        }
+
+        rt->rtr_nh = __vrouter_get_nexthop(vrouter_get(rt->rtr_req.rtr_rid),
+                rt->rtr_req.rtr_nh_id);
+        if (!rt->rtr_nh) {
+            errors[order[i]] = -ENOENT;
+            continue;
+        }
+
+        if (rt->rtr_req.h_op == SANDESH_OP_DELETE) {
+            __mtrie_delete(rt, &mtrie->root, 0, false);
+            ret = 0;
+        } else if ((!(rt->rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)) &&
+                (rt->rtr_nh->nh_type == NH_TUNNEL)) {
+            ret = -EINVAL;
+        } else {
+            ret = __mtrie_add(mtrie, rt, false);
+        }
+
+        rt->rtr_nh = NULL;
+        errors[order[i]] = ret;
+
+        if (rt->rtr_req.rtr_prefix_len < IP4BUCKET_LEVEL0_PFX_LEN)
+            touched_all = true;
+        else
+            touched[PREFIX_TO_INDEX(rt->rtr_req.rtr_prefix, 0) / 8] |=
+                1 << (PREFIX_TO_INDEX(rt->rtr_req.rtr_prefix, 0) % 8);
+    }
+
+    if (touched_all) {
+        mtrie_share_entry(&mtrie->root, 0);
+    } else {
+        bkt = entry_to_bucket(&mtrie->root);
+        if (bkt && !bkt->bkt_shared) {
+            for (i = 0; i < IP4BUCKET_LEVEL0_SIZE; i++)
+                if (touched[i / 8] & (1 << (i % 8)))
+                    mtrie_share_entry(&bkt->bkt_data[i], 1);
+        }
+        mtrie_share_bucket(&mtrie->root, 0);
+    }
+
+    mtrie_gen_bump(vrf_id);
+    mtrie_free_pending_buckets();
+    vr_free(order);
+
+    return 0;
+}
+
 /*
  * Exact-match
  * returns the next-hop on exact match. NULL otherwise
@@ -854,6 +1535,7 @@ mtrie_free_vrf(struct vr_rtable *rtable, unsigned int vrf_id)
 
     mtrie_free_entry(&mtrie->root, 0);
     vrf_tables[vrf_id] = NULL;
+    mtrie_gen_bump(vrf_id);
     vr_free(mtrie);
 
     return;
@@ -899,6 +1581,16 @@ mtrie4_algo_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
     vr_free(rtable->algo_data);
     rtable->algo_data = NULL;
 
+    if (mtrie_vrf_gen) {
+        vr_free(mtrie_vrf_gen);
+        mtrie_vrf_gen = NULL;
+    }
+
+    if (mtrie_shared_buckets) {
+        vr_free(mtrie_shared_buckets);
+        mtrie_shared_buckets = NULL;
+    }
+
     return;
 }
 
@@ -957,7 +1649,7 @@ int
 mtrie4_algo_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
 {
     int ret = 0;
-    unsigned int table_memory;
+    unsigned int i, table_memory;
 
     table_memory = sizeof(void *) * fs->rtb_max_vrfs;
     rtable->algo_data = vr_zalloc(table_memory);
@@ -970,8 +1662,34 @@ mtrie4_algo_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
         goto init_fail;
     }
 
+    mtrie_vrf_gen = vr_malloc(sizeof(unsigned int) * fs->rtb_max_vrfs);
+    if (!mtrie_vrf_gen) {
+        ret = vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                fs->rtb_max_vrfs);
+        mtrie_stats_cleanup(rtable);
+        goto init_fail;
+    }
+
+    for (i = 0; i < fs->rtb_max_vrfs; i++)
+        mtrie_vrf_gen[i] = 1;
+    mtrie_max_vrfs = fs->rtb_max_vrfs;
+
+    if (vr_mtrie_share_buckets) {
+        mtrie_shared_buckets = vr_zalloc(sizeof(struct ip4_bucket *) *
+                MTRIE_SHARED_HASH_SIZE);
+        if (!mtrie_shared_buckets) {
+            ret = vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                    MTRIE_SHARED_HASH_SIZE);
+            mtrie_stats_cleanup(rtable);
+            vr_free(mtrie_vrf_gen);
+            mtrie_vrf_gen = NULL;
+            goto init_fail;
+        }
+    }
+
     rtable->algo_add = mtrie_add;
     rtable->algo_del = mtrie_delete;
+    rtable->algo_bulk = mtrie_bulk;
     rtable->algo_lookup = mtrie_lookup;
     rtable->algo_get = mtrie_get;
     rtable->algo_dump = mtrie_dump;
@@ -979,7 +1697,9 @@ mtrie4_algo_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
     rtable->algo_stats_dump = mtrie_stats_dump;
 
     vr_inet_route_lookup = mtrie_lookup;
+    vr_inet_route_lookup_bulk = mtrie_lookup_bulk;
     vr_inet_vrf_stats = mtrie_stats;
+    vr_inet_vrf_gen = mtrie_gen;
     /* local cache */
     vn_rtable = (struct ip4_mtrie **)rtable->algo_data;
 
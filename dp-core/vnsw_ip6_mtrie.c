@@ -0,0 +1,608 @@
+/*
+ * vnsw_ip6_mtrie.c -- VRF mtrie management, of ipv6 routes
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#include <vr_os.h>
+#include "vr_sandesh.h"
+#include "vr_message.h"
+#include "vnsw_ip6_mtrie.h"
+
+struct vr_nexthop *(*vr_inet6_route_lookup)(unsigned int,
+        struct vr_route_req *, struct vr_packet *);
+
+static struct ip6_mtrie **ip6_rtable;
+static unsigned int ip6_max_vrfs;
+
+static inline struct ip6_mtrie *
+ip6_vrf_mtrie(unsigned int vrf_id)
+{
+    if (!ip6_rtable || vrf_id >= ip6_max_vrfs)
+        return NULL;
+
+    return ip6_rtable[vrf_id];
+}
+
+static inline bool
+ip6_entry_is_bucket(struct ip6_bucket_entry *ent)
+{
+    return ent->ip6e_long_i & 0x1ul;
+}
+
+static inline struct ip6_bucket *
+ip6_entry_bucket(struct ip6_bucket_entry *ent)
+{
+    return (struct ip6_bucket *)(ent->ip6e_long_i ^ 0x1ul);
+}
+
+static inline bool
+ip6_entries_equal(struct ip6_bucket_entry *a, struct ip6_bucket_entry *b)
+{
+    return a->ip6e_long_i == b->ip6e_long_i &&
+        a->ip6e_prefix_len == b->ip6e_prefix_len &&
+        a->ip6e_label_flags == b->ip6e_label_flags &&
+        a->ip6e_label == b->ip6e_label;
+}
+
+/* the entry takes a reference of its own on nh */
+static void
+ip6_entry_set_nh(struct ip6_bucket_entry *ent, struct vr_nexthop *nh,
+        unsigned int prefix_len, unsigned int label_flags, unsigned int label)
+{
+    struct vr_nexthop *tmp_nh;
+
+    tmp_nh = vrouter_get_nexthop(nh->nh_rid, nh->nh_id);
+    if (tmp_nh != nh) {
+        /* the nexthop went away, and maybe another took its id */
+        if (tmp_nh)
+            vrouter_put_nexthop(tmp_nh);
+        nh = vrouter_get_nexthop(nh->nh_rid, NH_DISCARD_ID);
+    }
+
+    tmp_nh = ip6_entry_is_bucket(ent) ? NULL : ent->ip6e_nh_p;
+    ent->ip6e_prefix_len = prefix_len;
+    ent->ip6e_label_flags = label_flags;
+    ent->ip6e_label = label;
+    ent->ip6e_nh_p = nh;
+
+    if (tmp_nh)
+        vrouter_put_nexthop(tmp_nh);
+
+    return;
+}
+
+static void
+ip6_bucket_free(struct vr_deferred *deferred)
+{
+    unsigned int i;
+    struct ip6_bucket_entry *ent;
+    struct ip6_bucket *bkt = CONTAINER_OF(bkt_deferred, struct ip6_bucket,
+            deferred);
+
+    for (i = 0; i < IP6_BUCKET_SIZE; i++) {
+        ent = &bkt->bkt_data[i];
+        if (ip6_entry_is_bucket(ent))
+            ip6_bucket_free(&ip6_entry_bucket(ent)->bkt_deferred);
+        else if (ent->ip6e_nh_p)
+            vrouter_put_nexthop(ent->ip6e_nh_p);
+    }
+
+    vr_free(bkt);
+    return;
+}
+
+/*
+ * the entry becomes what 'to' is, and whatever it pointed to, out of the
+ * table now, goes once the lookups are done with it
+ */
+static void
+ip6_entry_replace(struct ip6_bucket_entry *ent, struct ip6_bucket_entry *to)
+{
+    struct ip6_bucket *bkt = NULL;
+
+    if (ip6_entry_is_bucket(ent))
+        bkt = ip6_entry_bucket(ent);
+
+    if (ip6_entry_is_bucket(to)) {
+        if (!bkt && ent->ip6e_nh_p)
+            vrouter_put_nexthop(ent->ip6e_nh_p);
+        /* the bucket has to be seen whole before it is seen at all */
+        __sync_synchronize();
+        *ent = *to;
+    } else {
+        ip6_entry_set_nh(ent, to->ip6e_nh_p, to->ip6e_prefix_len,
+                to->ip6e_label_flags, to->ip6e_label);
+    }
+
+    if (bkt)
+        vr_free_deferred(&bkt->bkt_deferred, ip6_bucket_free);
+
+    return;
+}
+
+/* a bucket of entries that are all what the parent entry was */
+static struct ip6_bucket *
+ip6_bucket_alloc(struct ip6_bucket_entry *parent)
+{
+    unsigned int i;
+    struct ip6_bucket *bkt;
+
+    bkt = vr_zalloc(sizeof(*bkt));
+    if (!bkt)
+        return NULL;
+
+    for (i = 0; i < IP6_BUCKET_SIZE; i++) {
+        if (parent->ip6e_nh_p)
+            ip6_entry_set_nh(&bkt->bkt_data[i], parent->ip6e_nh_p,
+                    parent->ip6e_prefix_len, parent->ip6e_label_flags,
+                    parent->ip6e_label);
+    }
+
+    return bkt;
+}
+
+/* the route, in all the entries under ent that it is the best match of */
+static void
+ip6_entry_cover(struct ip6_bucket_entry *ent, struct vr_route_req *rt)
+{
+    unsigned int i;
+    struct ip6_bucket *bkt;
+
+    if (ip6_entry_is_bucket(ent)) {
+        bkt = ip6_entry_bucket(ent);
+        for (i = 0; i < IP6_BUCKET_SIZE; i++)
+            ip6_entry_cover(&bkt->bkt_data[i], rt);
+        return;
+    }
+
+    if (ent->ip6e_prefix_len <= (unsigned int)rt->rtr_req.rtr_prefix_len)
+        ip6_entry_set_nh(ent, rt->rtr_nh, rt->rtr_req.rtr_prefix_len,
+                rt->rtr_req.rtr_label_flags, rt->rtr_req.rtr_label);
+
+    return;
+}
+
+/*
+ * a bucket whose entries all say the same thing is of no use, and the
+ * entry that points to it can say that thing itself
+ */
+static void
+ip6_entry_fold(struct ip6_bucket_entry *ent)
+{
+    unsigned int i;
+    struct ip6_bucket *bkt;
+    struct ip6_bucket_entry *first;
+
+    if (!ip6_entry_is_bucket(ent))
+        return;
+
+    bkt = ip6_entry_bucket(ent);
+    first = &bkt->bkt_data[0];
+    if (ip6_entry_is_bucket(first))
+        return;
+
+    for (i = 1; i < IP6_BUCKET_SIZE; i++)
+        if (!ip6_entries_equal(first, &bkt->bkt_data[i]))
+            return;
+
+    ip6_entry_replace(ent, first);
+    return;
+}
+
+/*
+ * the replacement of the route (the nexthop and label of the request, with
+ * rtr_replace_plen) in all the entries under ent that the route is in
+ */
+static void
+ip6_entry_reset(struct ip6_bucket_entry *ent, struct vr_route_req *rt)
+{
+    unsigned int i;
+    struct ip6_bucket *bkt;
+
+    if (ip6_entry_is_bucket(ent)) {
+        bkt = ip6_entry_bucket(ent);
+        for (i = 0; i < IP6_BUCKET_SIZE; i++)
+            ip6_entry_reset(&bkt->bkt_data[i], rt);
+        ip6_entry_fold(ent);
+        return;
+    }
+
+    if (ent->ip6e_prefix_len == (unsigned int)rt->rtr_req.rtr_prefix_len)
+        ip6_entry_set_nh(ent, rt->rtr_nh, rt->rtr_req.rtr_replace_plen,
+                rt->rtr_req.rtr_label_flags, rt->rtr_req.rtr_label);
+
+    return;
+}
+
+/*
+ * descend to the level at which the route ends, making buckets on the
+ * way, and call fn on the entries of that level that the route spans.
+ * the entries on the way are left in path
+ */
+static int
+ip6_mtrie_walk_to(struct ip6_mtrie *mtrie, struct vr_route_req *rt,
+        bool make, struct ip6_bucket_entry **path,
+        void (*fn)(struct ip6_bucket_entry *, struct vr_route_req *))
+{
+    int level;
+    unsigned int i, fin, bits, plen = rt->rtr_req.rtr_prefix_len;
+    uint8_t *prefix = (uint8_t *)rt->rtr_req.rtr_prefix6;
+    struct ip6_bucket *bkt;
+    struct ip6_bucket_entry *ent = &mtrie->root, new;
+
+    if (!plen) {
+        fn(ent, rt);
+        return 0;
+    }
+
+    for (level = 0; level < IP6_BUCKET_LEVELS; level++) {
+        path[level] = ent;
+        if (!ip6_entry_is_bucket(ent)) {
+            if (!make)
+                return -ENOENT;
+
+            bkt = ip6_bucket_alloc(ent);
+            if (!bkt)
+                return -ENOMEM;
+            memset(&new, 0, sizeof(new));
+            new.ip6e_long_i = (unsigned long)bkt | 0x1ul;
+            ip6_entry_replace(ent, &new);
+        }
+
+        bkt = ip6_entry_bucket(ent);
+        bits = (level + 1) * IP6_BUCKET_BITS;
+        if (plen > bits) {
+            ent = &bkt->bkt_data[prefix[level]];
+            continue;
+        }
+
+        i = prefix[level];
+        fin = i + (1 << (bits - plen));
+        for (; i < fin; i++)
+            fn(&bkt->bkt_data[i], rt);
+        break;
+    }
+
+    return level;
+}
+
+static int
+ip6_mtrie_route_nh(struct vr_route_req *rt)
+{
+    /* requests are serialized, so the nexthop cannot go away under us */
+    rt->rtr_nh = __vrouter_get_nexthop(vrouter_get(rt->rtr_req.rtr_rid),
+            rt->rtr_req.rtr_nh_id);
+    if (!rt->rtr_nh)
+        return -ENOENT;
+
+    if (!(rt->rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG) &&
+            rt->rtr_nh->nh_type == NH_TUNNEL)
+        return -EINVAL;
+
+    return 0;
+}
+
+static struct ip6_mtrie *
+ip6_mtrie_alloc_vrf(unsigned int vrf_id)
+{
+    struct ip6_mtrie *mtrie;
+
+    mtrie = vr_zalloc(sizeof(*mtrie));
+    if (mtrie) {
+        mtrie->root.ip6e_nh_p = vrouter_get_nexthop(0, NH_DISCARD_ID);
+        ip6_rtable[vrf_id] = mtrie;
+    }
+
+    return mtrie;
+}
+
+static int
+ip6_mtrie_add(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    int ret;
+    unsigned int vrf_id = rt->rtr_req.rtr_vrf_id;
+    struct ip6_mtrie *mtrie;
+    struct ip6_bucket_entry *path[IP6_BUCKET_LEVELS];
+
+    if (vrf_id >= ip6_max_vrfs)
+        return -EINVAL;
+
+    if ((ret = ip6_mtrie_route_nh(rt)))
+        return ret;
+
+    mtrie = ip6_vrf_mtrie(vrf_id);
+    mtrie = (mtrie ? : ip6_mtrie_alloc_vrf(vrf_id));
+    if (!mtrie)
+        return -ENOMEM;
+
+    ret = ip6_mtrie_walk_to(mtrie, rt, true, path, ip6_entry_cover);
+    return ret < 0 ? ret : 0;
+}
+
+static int
+ip6_mtrie_delete(struct vr_rtable * _unused, struct vr_route_req *rt)
+{
+    int level;
+    struct ip6_mtrie *mtrie;
+    struct ip6_bucket_entry *path[IP6_BUCKET_LEVELS];
+
+    mtrie = ip6_vrf_mtrie(rt->rtr_req.rtr_vrf_id);
+    if (!mtrie)
+        return -ENOENT;
+
+    rt->rtr_nh = __vrouter_get_nexthop(vrouter_get(rt->rtr_req.rtr_rid),
+            rt->rtr_req.rtr_nh_id);
+    if (!rt->rtr_nh)
+        return -ENOENT;
+
+    level = ip6_mtrie_walk_to(mtrie, rt, false, path, ip6_entry_reset);
+    if (level < 0)
+        return level;
+
+    /* and then the buckets on the way that have nothing left to tell */
+    if (rt->rtr_req.rtr_prefix_len) {
+        for (; level >= 0; level--)
+            ip6_entry_fold(path[level]);
+    }
+
+    return 0;
+}
+
+/* rtr_prefix6, the address to look up, is of IP6_ADDR_LEN bytes */
+static struct vr_nexthop *
+ip6_mtrie_lookup(unsigned int vrf_id, struct vr_route_req *rt,
+        struct vr_packet *pkt)
+{
+    unsigned int level = 0;
+    uint8_t *addr = (uint8_t *)rt->rtr_req.rtr_prefix6;
+    struct ip6_mtrie *mtrie;
+    struct ip6_bucket_entry *ent;
+
+    mtrie = ip6_vrf_mtrie(vrf_id);
+    if (!mtrie)
+        return NULL;
+
+    ent = &mtrie->root;
+    while (ip6_entry_is_bucket(ent) && level < IP6_BUCKET_LEVELS)
+        ent = &ip6_entry_bucket(ent)->bkt_data[addr[level++]];
+
+    rt->rtr_req.rtr_label_flags = ent->ip6e_label_flags;
+    rt->rtr_req.rtr_label = ent->ip6e_label;
+    rt->rtr_req.rtr_prefix_len = ent->ip6e_prefix_len;
+
+    return ent->ip6e_nh_p;
+}
+
+static int
+ip6_mtrie_get(unsigned int vrf_id, struct vr_route_req *rt)
+{
+    struct vr_nexthop *nh = NULL;
+
+    if (rt->rtr_req.rtr_prefix6_size == IP6_ADDR_LEN)
+        nh = ip6_mtrie_lookup(vrf_id, rt, NULL);
+
+    rt->rtr_req.rtr_nh_id = nh ? nh->nh_id : -1;
+    return 0;
+}
+
+/*
+ * of the entries that a route spans at the level at which it ends, only
+ * the first one that still has it counts as the route in a dump. entries
+ * of a route that ends at a level above are not routes there
+ */
+static bool
+ip6_entry_is_route(struct ip6_bucket *bkt, unsigned int level,
+        unsigned int index)
+{
+    unsigned int i, start, plen = bkt->bkt_data[index].ip6e_prefix_len;
+    unsigned int bits = (level + 1) * IP6_BUCKET_BITS;
+
+    if (plen <= level * IP6_BUCKET_BITS && (level || plen))
+        return false;
+
+    start = index & ~((1 << (bits - plen)) - 1);
+    for (i = start; i < index; i++)
+        if (!ip6_entry_is_bucket(&bkt->bkt_data[i]) &&
+                bkt->bkt_data[i].ip6e_prefix_len == plen)
+            return false;
+
+    return true;
+}
+
+static int
+ip6_mtrie_dump_entry(struct vr_message_dumper *dumper,
+        struct ip6_bucket_entry *ent, uint8_t *path, unsigned int level)
+{
+    unsigned int i, plen = ent->ip6e_prefix_len;
+    uint8_t prefix[IP6_ADDR_LEN], marker[IP6_ADDR_LEN];
+    vr_route_req *req = (vr_route_req *)dumper->dump_req, resp;
+
+    memset(prefix, 0, sizeof(prefix));
+    memset(marker, 0, sizeof(marker));
+    memcpy(marker, path, level + 1);
+    for (i = 0; i < plen / 8; i++)
+        prefix[i] = path[i];
+    if (plen % 8)
+        prefix[i] = path[i] & (0xff << (8 - (plen % 8)));
+
+    memset(&resp, 0, sizeof(resp));
+    resp.rtr_vrf_id = req->rtr_vrf_id;
+    resp.rtr_family = req->rtr_family;
+    resp.rtr_rid = req->rtr_rid;
+    resp.rtr_rt_type = RT_UCAST;
+    resp.rtr_prefix6 = (int8_t *)prefix;
+    resp.rtr_prefix6_size = IP6_ADDR_LEN;
+    resp.rtr_prefix_len = plen;
+    resp.rtr_label_flags = ent->ip6e_label_flags;
+    resp.rtr_label = ent->ip6e_label;
+    resp.rtr_nh_id = ent->ip6e_nh_p->nh_id;
+    /* where the walk is, to be sent back as is for the rest of the dump */
+    resp.rtr_marker6 = (int8_t *)marker;
+    resp.rtr_marker6_size = IP6_ADDR_LEN;
+    resp.rtr_marker_plen = (level + 1) * IP6_BUCKET_BITS;
+
+    return vr_message_dump_object(dumper, VR_ROUTE_OBJECT_ID, &resp);
+}
+
+/*
+ * the walk is that of the ipv4 mtrie: iterative, with a cursor of the next
+ * index at every level. a dump that goes on from a marker sets the
+ * cursor up from the path in the marker
+ */
+static int
+ip6_mtrie_walk(struct vr_message_dumper *dumper)
+{
+    int level = 0, l;
+    unsigned int index, marker_levels = 0;
+    uint8_t path[IP6_ADDR_LEN], *marker = NULL;
+    vr_route_req *req = (vr_route_req *)dumper->dump_req;
+    struct ip6_mtrie *mtrie;
+    struct ip6_bucket *bkts[IP6_BUCKET_LEVELS];
+    struct ip6_bucket_entry *ent;
+    unsigned int *cursor = dumper->dump_cursor;
+
+    mtrie = ip6_vrf_mtrie(req->rtr_vrf_id);
+    if (!mtrie)
+        return 0;
+
+    if (req->rtr_marker6_size == IP6_ADDR_LEN) {
+        marker = (uint8_t *)req->rtr_marker6;
+        marker_levels = req->rtr_marker_plen / IP6_BUCKET_BITS;
+    }
+
+    if (!ip6_entry_is_bucket(&mtrie->root)) {
+        if (marker || !mtrie->root.ip6e_nh_p)
+            return 0;
+        memset(path, 0, sizeof(path));
+        return ip6_mtrie_dump_entry(dumper, &mtrie->root, path, 0) <= 0 ?
+            -1 : 0;
+    }
+
+    bkts[0] = ip6_entry_bucket(&mtrie->root);
+    cursor[0] = 0;
+    if (marker && marker_levels) {
+        /* the marker itself has been dumped, and so has all before it */
+        for (level = 0; level < IP6_BUCKET_LEVELS - 1; level++) {
+            cursor[level] = marker[level] + 1;
+            if (level + 1 >= (int)marker_levels)
+                break;
+
+            ent = &bkts[level]->bkt_data[marker[level]];
+            if (!ip6_entry_is_bucket(ent))
+                break;
+
+            bkts[level + 1] = ip6_entry_bucket(ent);
+        }
+        if (level == IP6_BUCKET_LEVELS - 1)
+            cursor[level] = marker[level] + 1;
+    }
+
+    while (level >= 0) {
+        index = cursor[level];
+        if (index >= IP6_BUCKET_SIZE) {
+            level--;
+            continue;
+        }
+
+        cursor[level] = index + 1;
+        ent = &bkts[level]->bkt_data[index];
+        if (ip6_entry_is_bucket(ent)) {
+            if (level == IP6_BUCKET_LEVELS - 1)
+                continue;
+
+            bkts[++level] = ip6_entry_bucket(ent);
+            cursor[level] = 0;
+            continue;
+        }
+
+        if (!ent->ip6e_nh_p || !ip6_entry_is_route(bkts[level], level, index))
+            continue;
+
+        memset(path, 0, sizeof(path));
+        for (l = 0; l <= level; l++)
+            path[l] = cursor[l] - 1;
+
+        /* the buffer is full; the next dump starts after the last route */
+        if (ip6_mtrie_dump_entry(dumper, ent, path, level) <= 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+ip6_mtrie_dump(struct vr_rtable * __unused, struct vr_route_req *rt)
+{
+    int ret = 0;
+    struct vr_message_dumper *dumper;
+
+    dumper = vr_message_dump_init(&rt->rtr_req);
+    if (!dumper) {
+        ret = -ENOMEM;
+        goto generate_response;
+    }
+
+    ret = ip6_mtrie_walk(dumper);
+
+generate_response:
+    vr_message_dump_exit(dumper, ret);
+
+    return 0;
+}
+
+void
+mtrie6_algo_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
+{
+    unsigned int i;
+    struct ip6_mtrie *mtrie, **tables = rtable->algo_data;
+
+    if (!tables)
+        return;
+
+    /* no lookup can start now, and the ones that had are done after this */
+    vr_inet6_route_lookup = NULL;
+    ip6_rtable = NULL;
+    vr_delay_op();
+
+    for (i = 0; i < ip6_max_vrfs; i++) {
+        mtrie = tables[i];
+        if (!mtrie)
+            continue;
+
+        if (ip6_entry_is_bucket(&mtrie->root))
+            ip6_bucket_free(&ip6_entry_bucket(&mtrie->root)->bkt_deferred);
+        else if (mtrie->root.ip6e_nh_p)
+            vrouter_put_nexthop(mtrie->root.ip6e_nh_p);
+        vr_free(mtrie);
+    }
+
+    vr_free(tables);
+    rtable->algo_data = NULL;
+    ip6_max_vrfs = 0;
+
+    return;
+}
+
+int
+mtrie6_algo_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
+{
+    unsigned int table_memory;
+
+    table_memory = sizeof(void *) * fs->rtb_max_vrfs;
+    rtable->algo_data = vr_zalloc(table_memory);
+    if (!rtable->algo_data)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, table_memory);
+
+    rtable->algo_max_vrfs = fs->rtb_max_vrfs;
+    rtable->algo_add = ip6_mtrie_add;
+    rtable->algo_del = ip6_mtrie_delete;
+    rtable->algo_lookup = ip6_mtrie_lookup;
+    rtable->algo_get = ip6_mtrie_get;
+    rtable->algo_dump = ip6_mtrie_dump;
+
+    ip6_rtable = (struct ip6_mtrie **)rtable->algo_data;
+    ip6_max_vrfs = fs->rtb_max_vrfs;
+    vr_inet6_route_lookup = ip6_mtrie_lookup;
+
+    return 0;
+}
@@ -18,6 +18,7 @@ struct vr_dummy_bridge_entry {
     uint32_t be_label;
     struct vr_nexthop *be_nh;
     unsigned short be_flags;
+    uint32_t be_stamp;
 } __attribute__((packed));
 
 #define VR_BRIDGE_ENTRY_PACK (32 - sizeof(struct vr_dummy_bridge_entry))
@@ -27,15 +28,84 @@ struct vr_bridge_entry {
     uint32_t be_label;
     struct vr_nexthop *be_nh;
     unsigned short be_flags;
+    /* when a learnt entry was last seen, in vn_learn->bl_clock */
+    uint32_t be_stamp;
     unsigned char be_pack[VR_BRIDGE_ENTRY_PACK];
 } __attribute__((packed));
 
 #define VR_DEF_BRIDGE_ENTRIES          (64 * 1024)
 #define VR_DEF_BRIDGE_OENTRIES         (4 * 1024)
+#define VR_BRIDGE_DUMP_BATCH           16
 
 unsigned int vr_bridge_entries = VR_DEF_BRIDGE_ENTRIES;
 unsigned int vr_bridge_oentries = VR_DEF_BRIDGE_OENTRIES;
 static vr_htable_t vn_rtable;
+
+/*
+ * with vr_bridge_vrf_entries set, every vrf gets a bridge table of its
+ * own, of that many entries (and an overflow table of a sixteenth of
+ * that), when the first entry of the vrf is added. that is in place of
+ * the one table of vr_bridge_entries that all the vrfs share, so that a
+ * vrf with many macs does not take the buckets of the others
+ */
+unsigned int vr_bridge_vrf_entries = 0;
+static vr_htable_t *vn_vrf_rtables;
+static unsigned int vn_max_vrfs;
+
+/*
+ * datapath mac learning. with vr_bridge_learning set, the source mac of
+ * the frames that come from an interface with a learn nexthop is looked
+ * up in the bridge table. macs that are not there, or that are learnt on
+ * another interface, are put in bl_slots and added to the table from the
+ * learn timer, which also ages the learnt entries that were not seen for
+ * vr_bridge_aging_secs, a few entries at a time. the agent is told about
+ * the macs that the timer learnt and aged in one AGENT_TRAP_MAC_LEARN_BATCH
+ * per run. entries that the agent adds are never learnt over or aged
+ */
+unsigned int vr_bridge_learning = 0;
+unsigned int vr_bridge_aging_secs = 300;
+
+#define VR_BRIDGE_LEARN_SLOTS           256
+#define VR_BRIDGE_LEARN_MSECS           100
+#define VR_BRIDGE_AGE_SCAN_ENTRIES      1024
+#define VR_BRIDGE_MAC_EVENTS            256
+
+#define VR_BRIDGE_LEARN_FREE            0
+#define VR_BRIDGE_LEARN_BUSY            1
+#define VR_BRIDGE_LEARN_READY           2
+
+struct vr_bridge_learn_slot {
+    unsigned int bls_state;
+    unsigned int bls_nh_id;
+    unsigned short bls_vrf;
+    unsigned short bls_ifindex;
+    unsigned char bls_mac[VR_ETHER_ALEN];
+};
+
+struct vr_bridge_learn {
+    unsigned int bl_head;
+    /* seconds, maintained by the timer */
+    unsigned int bl_clock;
+    unsigned int bl_cursor;
+    unsigned int bl_age_vrf;
+    struct vrouter *bl_router;
+    struct vr_timer *bl_timer;
+    /* the message to the agent, that the current run is filling */
+    struct vr_packet *bl_pkt;
+    unsigned int bl_events;
+    struct vr_bridge_learn_slot bl_slots[VR_BRIDGE_LEARN_SLOTS];
+};
+
+static struct vr_bridge_learn *vn_learn;
+static int vr_bridge_learn_init(void);
+
+/* whether the source mac of the frame gets learnt */
+static inline bool
+vr_bridge_learns(struct vr_packet *pkt, char *smac)
+{
+    return vn_learn && pkt->vp_if && pkt->vp_if->vif_learn_nh_id &&
+        !IS_MAC_BMCAST(smac) && !IS_MAC_ZERO(smac);
+}
 struct vr_nexthop *(*vr_bridge_lookup)(unsigned int, struct vr_route_req *, 
         struct vr_packet *);
 
@@ -53,26 +123,78 @@ bridge_entry_valid(vr_htable_t htable, vr_hentry_t hentry,
     return false;
 }
 
+static inline bool
+bridge_table_ready(void)
+{
+    return vn_rtable || vn_vrf_rtables;
+}
+
+/* the table that the entries of the vrf are in */
+static inline vr_htable_t
+bridge_htable(unsigned int vrf)
+{
+    if (!vn_vrf_rtables)
+        return vn_rtable;
+
+    if (vrf >= vn_max_vrfs)
+        return NULL;
+
+    return vn_vrf_rtables[vrf];
+}
+
+static vr_htable_t
+bridge_htable_create(unsigned int vrf)
+{
+    unsigned int oentries;
+
+    if (!vn_vrf_rtables || vrf >= vn_max_vrfs)
+        return bridge_htable(vrf);
+
+    if (!vn_vrf_rtables[vrf]) {
+        oentries = (vr_bridge_vrf_entries / 16) & ~3U;
+        if (oentries < 4)
+            oentries = 4;
+        vn_vrf_rtables[vrf] = vr_htable_create(vr_bridge_vrf_entries,
+                oentries, sizeof(struct vr_bridge_entry),
+                sizeof(struct vr_bridge_entry_key), bridge_entry_valid);
+    }
+
+    return vn_vrf_rtables[vrf];
+}
+
 struct vr_bridge_entry *
 vr_find_bridge_entry(struct vr_bridge_entry_key *key) 
 {
-    if (!vn_rtable || !key)
+    vr_htable_t table;
+
+    if (!key)
         return NULL;
 
-    return vr_find_hentry(vn_rtable, key, NULL);
+    table = bridge_htable(key->be_vrf_id);
+    if (!table)
+        return NULL;
+
+    return vr_find_hentry(table, key, NULL);
 }
 
 struct vr_bridge_entry *
 vr_find_free_bridge_entry(unsigned int vrf_id, char *mac)
 {
     struct vr_bridge_entry_key key;
+    struct vr_bridge_entry *be;
+    vr_htable_t table;
 
-    if (!vn_rtable || !mac)
+    table = bridge_htable(vrf_id);
+    if (!table || !mac)
         return NULL;
 
     key.be_vrf_id = vrf_id;
     VR_MAC_CPY(key.be_mac, mac);
-    return vr_find_free_hentry(vn_rtable, &key, NULL);
+    be = vr_find_free_hentry(table, &key, NULL);
+    if (!be)
+        vr_notify_table_full(vrouter_get(0), VR_NOTIFY_TABLE_BRIDGE);
+
+    return be;
 }
 
 static int
@@ -88,6 +210,9 @@ __bridge_table_add(struct vr_route_req *rt)
     be = vr_find_bridge_entry(&key);
 
     if (!be) {
+        if (!bridge_htable_create(key.be_vrf_id))
+            return -ENOMEM;
+
         be = vr_find_free_bridge_entry(rt->rtr_req.rtr_vrf_id,
                                         (char *)rt->rtr_req.rtr_mac);
         if (!be)
@@ -98,6 +223,9 @@ __bridge_table_add(struct vr_route_req *rt)
         be->be_flags |= VR_BE_FLAG_VALID;
     }
 
+    /* the agent owns the entry from now */
+    be->be_flags &= ~VR_BE_FLAG_LEARNT;
+
     if (be->be_nh != rt->rtr_nh) {
 
         /* Un ref the old nexthop */
@@ -121,7 +249,7 @@ bridge_table_add(struct vr_rtable * _unused, struct vr_route_req *rt)
 {
     int ret;
     
-    if (!vn_rtable)
+    if (!bridge_table_ready())
         return -EINVAL;
 
     if (IS_MAC_ZERO(rt->rtr_req.rtr_mac))
@@ -149,7 +277,7 @@ bridge_table_delete(struct vr_rtable * _unused, struct vr_route_req *rt)
     struct vr_bridge_entry_key key;
     struct vr_bridge_entry *be;
 
-    if (!vn_rtable)
+    if (!bridge_table_ready())
         return -EINVAL;
 
     VR_MAC_CPY(key.be_mac, rt->rtr_req.rtr_mac); 
@@ -234,29 +362,49 @@ __bridge_table_dump(struct vr_message_dumper *dumper)
 {
     struct vr_route_req *req = (struct vr_route_req *)(dumper->dump_req);
     struct vr_route_req resp;
+    struct vr_bridge_entry_key key;
     int ret;
-    unsigned int i;
+    unsigned int i, n, index, cursor = 0;
+    unsigned int indices[VR_BRIDGE_DUMP_BATCH];
+    vr_hentry_t ents[VR_BRIDGE_DUMP_BATCH];
     struct vr_bridge_entry *be;
+    vr_htable_t table;
 
-    for(i = 0; i < (vr_bridge_entries + vr_bridge_oentries); i++) {
-        be = (struct vr_bridge_entry *) vr_get_hentry_by_index(vn_rtable, i);
-        if (!be) 
-            continue;
-        if (be->be_flags & VR_BE_FLAG_VALID) {
+    table = bridge_htable(req->rtr_req.rtr_vrf_id);
+    if (!table)
+        return 0;
+
+    /*
+     * resume right after the marker. if the marker went away since the
+     * last response, the index that was sent along with it (+1, in
+     * rtr_prefix, which comes back to us as the marker) is as good
+     */
+    if (!dumper->dump_been_to_marker) {
+        memset(&key, 0, sizeof(key));
+        VR_MAC_CPY(key.be_mac, req->rtr_req.rtr_mac);
+        key.be_vrf_id = req->rtr_req.rtr_vrf_id;
+        if (vr_find_hentry(table, &key, &index))
+            cursor = index + 1;
+        else if (req->rtr_req.rtr_marker > 0)
+            cursor = req->rtr_req.rtr_marker;
+        else
+            return 0;
+        dumper->dump_been_to_marker = 1;
+    }
+
+    while ((n = vr_htable_iter(table, &cursor, ents, indices,
+                    VR_BRIDGE_DUMP_BATCH))) {
+        for (i = 0; i < n; i++) {
+            be = (struct vr_bridge_entry *)ents[i];
             if (be->be_key.be_vrf_id != req->rtr_req.rtr_vrf_id)
                 continue;
-            if (dumper->dump_been_to_marker == 0) {
-                if (VR_MAC_CMP(be->be_key.be_mac, req->rtr_req.rtr_mac)
-                        && (be->be_key.be_vrf_id == req->rtr_req.rtr_vrf_id)) {
-                    dumper->dump_been_to_marker = 1;
-                }
-            } else {
-                if (!bridge_entry_make_req(&resp, be)) {
-                    ret = vr_message_dump_object(dumper, VR_ROUTE_OBJECT_ID, &resp);
-                    bridge_entry_req_destroy(&resp);
-                    if (ret <= 0) {
-                        return ret;
-                    }
+
+            if (!bridge_entry_make_req(&resp, be)) {
+                resp.rtr_req.rtr_prefix = indices[i] + 1;
+                ret = vr_message_dump_object(dumper, VR_ROUTE_OBJECT_ID, &resp);
+                bridge_entry_req_destroy(&resp);
+                if (ret <= 0) {
+                    return ret;
                 }
             }
         }
@@ -293,13 +441,25 @@ generate_response:
 int
 bridge_table_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
 {
-    rtable->algo_data = vr_htable_create(vr_bridge_entries,
-            vr_bridge_oentries, sizeof(struct vr_bridge_entry),
-            sizeof(struct vr_bridge_entry_key), bridge_entry_valid);  
-
-    if (!rtable->algo_data)
-        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 
-                vr_bridge_entries);
+    if (vr_bridge_vrf_entries) {
+        vr_bridge_vrf_entries = (vr_bridge_vrf_entries + 3) & ~3U;
+        vn_vrf_rtables = vr_zalloc(fs->rtb_max_vrfs * sizeof(vr_htable_t));
+        if (!vn_vrf_rtables)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                    fs->rtb_max_vrfs);
+        vn_max_vrfs = fs->rtb_max_vrfs;
+        /* there is no one table to hand out */
+        rtable->algo_data = vn_vrf_rtables;
+    } else {
+        rtable->algo_data = vr_htable_create(vr_bridge_entries,
+                vr_bridge_oentries, sizeof(struct vr_bridge_entry),
+                sizeof(struct vr_bridge_entry_key), bridge_entry_valid);
+
+        if (!rtable->algo_data)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                    vr_bridge_entries);
+        vn_rtable = rtable->algo_data;
+    }
 
     /* Max VRF's does not matter as Bridge table is not per VRF. But
      * still this can be maintained in table 
@@ -313,18 +473,317 @@ bridge_table_init(struct vr_rtable *rtable, struct rtable_fspec *fs)
 
     /* Add the shortcut to lookup routine */
     vr_bridge_lookup = bridge_table_lookup;
-    vn_rtable = rtable->algo_data;
 
+    return vr_bridge_learn_init();
+}
+
+static void
+vr_bridge_learn_post(struct vr_bridge_learn *learn, struct vr_bridge_entry *be,
+        unsigned short ifindex, unsigned short event)
+{
+    unsigned int head_space;
+    struct vr_bridge_mac_event *bme;
+
+    if (!learn->bl_pkt) {
+        head_space = sizeof(struct vr_eth) + sizeof(struct agent_hdr);
+        learn->bl_pkt = vr_palloc(head_space +
+                VR_BRIDGE_MAC_EVENTS * sizeof(struct vr_bridge_mac_event));
+        if (!learn->bl_pkt)
+            return;
+
+        learn->bl_pkt->vp_data += head_space;
+        learn->bl_pkt->vp_tail += head_space;
+        learn->bl_events = 0;
+    }
+
+    bme = (struct vr_bridge_mac_event *)pkt_data(learn->bl_pkt) +
+        learn->bl_events++;
+    VR_MAC_CPY(bme->bme_mac, be->be_key.be_mac);
+    bme->bme_vrf = htons(be->be_key.be_vrf_id);
+    bme->bme_ifindex = htons(ifindex);
+    bme->bme_event = htons(event);
+
+    return;
+}
+
+static void
+vr_bridge_learn_flush(struct vr_bridge_learn *learn)
+{
+    struct vr_packet *pkt = learn->bl_pkt;
+    struct vrouter *router = learn->bl_router;
+
+    if (!pkt)
+        return;
+
+    learn->bl_pkt = NULL;
+    if (!learn->bl_events || !router->vr_agent_if) {
+        vr_pfree(pkt, VP_DROP_MISC);
+        return;
+    }
+
+    pkt_pull_tail(pkt, learn->bl_events * sizeof(struct vr_bridge_mac_event));
+    pkt->vp_if = router->vr_agent_if;
+    vr_trap(pkt, 0, AGENT_TRAP_MAC_LEARN_BATCH, &learn->bl_events);
+
+    return;
+}
+
+/* whether the agent needs to hear about the entry */
+static bool
+vr_bridge_learn_add(struct vr_bridge_learn *learn,
+        struct vr_bridge_learn_slot *slot)
+{
+    struct vr_bridge_entry *be;
+    struct vr_bridge_entry_key key;
+    struct vr_nexthop *nh, *old_nh;
+
+    VR_MAC_CPY(key.be_mac, slot->bls_mac);
+    key.be_vrf_id = slot->bls_vrf;
+
+    be = vr_find_bridge_entry(&key);
+    if (be && !(be->be_flags & VR_BE_FLAG_LEARNT))
+        return false;
+
+    nh = vrouter_get_nexthop(0, slot->bls_nh_id);
+    if (!nh)
+        return false;
+
+    /* tunnels need a label, that only the agent knows */
+    if (nh->nh_type == NH_TUNNEL)
+        goto put_nh;
+
+    if (be) {
+        be->be_stamp = learn->bl_clock;
+        if (be->be_nh == nh)
+            goto put_nh;
+
+        old_nh = be->be_nh;
+        be->be_nh = nh;
+        if (old_nh)
+            vrouter_put_nexthop(old_nh);
+        return true;
+    }
+
+    be = vr_find_free_bridge_entry(slot->bls_vrf, (char *)slot->bls_mac);
+    if (!be)
+        goto put_nh;
+
+    be->be_key = key;
+    be->be_nh = nh;
+    be->be_label = 0;
+    be->be_stamp = learn->bl_clock;
+    /* the entry is complete before lookups find it */
+    __sync_synchronize();
+    be->be_flags = VR_BE_FLAG_VALID | VR_BE_FLAG_LEARNT;
+
+    return true;
+
+put_nh:
+    vrouter_put_nexthop(nh);
+    return false;
+}
+
+static void
+vr_bridge_learn_age(struct vr_bridge_learn *learn)
+{
+    unsigned int i;
+    unsigned short ifindex;
+    struct vr_bridge_entry *be;
+    vr_htable_t table;
+
+    for (i = 0; i < VR_BRIDGE_AGE_SCAN_ENTRIES; i++) {
+        table = bridge_htable(learn->bl_age_vrf);
+        be = NULL;
+        if (table)
+            be = (struct vr_bridge_entry *)vr_get_hentry_by_index(table,
+                    learn->bl_cursor++);
+        if (!be) {
+            /* the end of the table, and on to that of the next vrf */
+            learn->bl_cursor = 0;
+            if (vn_vrf_rtables)
+                learn->bl_age_vrf = (learn->bl_age_vrf + 1) % vn_max_vrfs;
+            continue;
+        }
+
+        if ((be->be_flags & (VR_BE_FLAG_VALID | VR_BE_FLAG_LEARNT)) !=
+                (VR_BE_FLAG_VALID | VR_BE_FLAG_LEARNT))
+            continue;
+
+        if (learn->bl_clock - be->be_stamp < vr_bridge_aging_secs)
+            continue;
+
+        ifindex = 0;
+        if (be->be_nh && be->be_nh->nh_dev)
+            ifindex = be->be_nh->nh_dev->vif_idx;
+        if (learn->bl_events < VR_BRIDGE_MAC_EVENTS)
+            vr_bridge_learn_post(learn, be, ifindex, VR_BRIDGE_MAC_AGED);
+
+        be->be_flags = 0;
+        if (be->be_nh)
+            vrouter_put_nexthop(be->be_nh);
+        be->be_nh = NULL;
+
+        if (learn->bl_pkt && learn->bl_events >= VR_BRIDGE_MAC_EVENTS)
+            vr_bridge_learn_flush(learn);
+    }
+
+    return;
+}
+
+static void
+vr_bridge_learn_run(void *arg)
+{
+    unsigned int i, sec, nsec;
+    struct vr_bridge_learn *learn = (struct vr_bridge_learn *)arg;
+    struct vr_bridge_learn_slot *slot;
+    struct vr_bridge_entry_key key;
+    struct vr_bridge_entry *be;
+
+    if (!bridge_table_ready())
+        return;
+
+    vr_get_mono_time(&sec, &nsec);
+    learn->bl_clock = sec;
+
+    for (i = 0; i < VR_BRIDGE_LEARN_SLOTS; i++) {
+        slot = &learn->bl_slots[i];
+        if (slot->bls_state != VR_BRIDGE_LEARN_READY)
+            continue;
+
+        if (vr_bridge_learn_add(learn, slot)) {
+            VR_MAC_CPY(key.be_mac, slot->bls_mac);
+            key.be_vrf_id = slot->bls_vrf;
+            be = vr_find_bridge_entry(&key);
+            if (be)
+                vr_bridge_learn_post(learn, be, slot->bls_ifindex,
+                        VR_BRIDGE_MAC_LEARNT);
+            if (learn->bl_pkt && learn->bl_events >= VR_BRIDGE_MAC_EVENTS)
+                vr_bridge_learn_flush(learn);
+        }
+
+        slot->bls_state = VR_BRIDGE_LEARN_FREE;
+    }
+
+    vr_bridge_learn_age(learn);
+    vr_bridge_learn_flush(learn);
+
+    return;
+}
+
+/*
+ * from the datapath, on any cpu, with 'be' the entry of the source mac.
+ * a mac that does not get a slot (all of them are taken till the next
+ * run) is learnt from a later frame
+ */
+static void
+vr_bridge_learn(struct vr_interface *vif, unsigned short vrf,
+        unsigned char *mac, struct vr_bridge_entry *be)
+{
+    struct vr_bridge_learn *learn = vn_learn;
+    struct vr_bridge_learn_slot *slot;
+
+    if (be) {
+        if (!(be->be_flags & VR_BE_FLAG_LEARNT))
+            return;
+
+        if (be->be_nh && be->be_nh->nh_id == vif->vif_learn_nh_id) {
+            if (be->be_stamp != learn->bl_clock)
+                be->be_stamp = learn->bl_clock;
+            return;
+        }
+    }
+
+    slot = &learn->bl_slots[__sync_fetch_and_add(&learn->bl_head, 1) %
+        VR_BRIDGE_LEARN_SLOTS];
+    if (!__sync_bool_compare_and_swap(&slot->bls_state,
+                VR_BRIDGE_LEARN_FREE, VR_BRIDGE_LEARN_BUSY))
+        return;
+
+    VR_MAC_CPY(slot->bls_mac, mac);
+    slot->bls_vrf = vrf;
+    slot->bls_ifindex = vif->vif_idx;
+    slot->bls_nh_id = vif->vif_learn_nh_id;
+    __sync_synchronize();
+    slot->bls_state = VR_BRIDGE_LEARN_READY;
+
+    return;
+}
+
+static void
+vr_bridge_learn_exit(void)
+{
+    struct vr_bridge_learn *learn = vn_learn;
+
+    if (!learn)
+        return;
+
+    if (learn->bl_timer) {
+        vr_delete_timer(learn->bl_timer);
+        vr_free(learn->bl_timer);
+    }
+
+    vn_learn = NULL;
+    vr_delay_op();
+    if (learn->bl_pkt)
+        vr_pfree(learn->bl_pkt, VP_DROP_MISC);
+    vr_free(learn);
+
+    return;
+}
+
+static int
+vr_bridge_learn_init(void)
+{
+    struct vr_bridge_learn *learn;
+
+    if (vn_learn || !vr_bridge_learning)
+        return 0;
+
+    learn = vr_zalloc(sizeof(*learn));
+    if (!learn)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                sizeof(*learn));
+
+    learn->bl_router = vrouter_get(0);
+    learn->bl_timer = vr_zalloc(sizeof(*learn->bl_timer));
+    if (!learn->bl_timer) {
+        vr_free(learn);
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    learn->bl_timer->vt_timer = vr_bridge_learn_run;
+    learn->bl_timer->vt_vr_arg = learn;
+    learn->bl_timer->vt_msecs = VR_BRIDGE_LEARN_MSECS;
+    if (vr_create_timer(learn->bl_timer)) {
+        vr_free(learn->bl_timer);
+        vr_free(learn);
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    vn_learn = learn;
     return 0;
 }
 
 void
 bridge_table_deinit(struct vr_rtable *rtable, struct rtable_fspec *fs)
 {
+    unsigned int i;
+
+    vr_bridge_learn_exit();
+
     if (vn_rtable) {
         vr_htable_delete(vn_rtable);
     }
 
+    if (vn_vrf_rtables) {
+        for (i = 0; i < vn_max_vrfs; i++)
+            if (vn_vrf_rtables[i])
+                vr_htable_delete(vn_vrf_rtables[i]);
+        vr_free(vn_vrf_rtables);
+        vn_vrf_rtables = NULL;
+        vn_max_vrfs = 0;
+    }
+
     rtable->algo_data = NULL;
     vn_rtable = NULL;
 }
@@ -336,6 +795,7 @@ vr_bridge_input(struct vrouter *router, unsigned short vrf,
     struct vr_route_req rt;
     struct vr_nexthop *nh;
     struct vr_forwarding_md cmd;
+    struct vr_bridge_entry_key key;
     char bcast_mac[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     char *mac;
 
@@ -351,6 +811,13 @@ vr_bridge_input(struct vrouter *router, unsigned short vrf,
         pkt->vp_flags |= VP_FLAG_MULTICAST;
     }
 
+    if (vr_bridge_learns(pkt, mac + VR_ETHER_ALEN)) {
+        VR_MAC_CPY(key.be_mac, mac + VR_ETHER_ALEN);
+        key.be_vrf_id = vrf;
+        vr_bridge_learn(pkt->vp_if, vrf, (unsigned char *)mac + VR_ETHER_ALEN,
+                vr_find_bridge_entry(&key));
+    }
+
     rt.rtr_req.rtr_vrf_id = vrf;
     nh = vr_bridge_lookup(vrf, &rt, pkt);
     if (nh) {
@@ -374,6 +841,86 @@ vr_bridge_input(struct vrouter *router, unsigned short vrf,
     return 0;
 }
 
+/*
+ * vr_bridge_input for a burst of frames. the buckets of the destination
+ * macs, and of the source macs when the frames are learnt from, are
+ * hashed and prefetched for all the frames before the first one is
+ * looked up
+ */
+unsigned int
+vr_bridge_input_batch(struct vrouter *router, unsigned short *vrfs,
+        struct vr_packet **pkts, unsigned int num_pkts,
+        struct vr_forwarding_md *fmds)
+{
+    unsigned int i, buckets[VR_FLOW_BATCH_MAX], sbuckets[VR_FLOW_BATCH_MAX];
+    bool learns[VR_FLOW_BATCH_MAX];
+    unsigned char *mac;
+    struct vr_bridge_entry_key keys[VR_FLOW_BATCH_MAX];
+    struct vr_bridge_entry_key skeys[VR_FLOW_BATCH_MAX];
+    struct vr_bridge_entry *be;
+    vr_htable_t tables[VR_FLOW_BATCH_MAX];
+    struct vr_packet *pkt;
+
+    if (num_pkts > VR_FLOW_BATCH_MAX) {
+        vr_bridge_input_batch(router, vrfs, pkts, VR_FLOW_BATCH_MAX, fmds);
+        vr_bridge_input_batch(router, vrfs + VR_FLOW_BATCH_MAX,
+                pkts + VR_FLOW_BATCH_MAX, num_pkts - VR_FLOW_BATCH_MAX,
+                fmds + VR_FLOW_BATCH_MAX);
+        return num_pkts;
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        pkt = pkts[i];
+        pkt->vp_type = VP_TYPE_L2;
+        mac = pkt_data(pkt);
+
+        keys[i].be_vrf_id = vrfs[i];
+        if (IS_MAC_BMCAST(mac)) {
+            memset(keys[i].be_mac, 0xff, VR_ETHER_ALEN);
+            pkt->vp_flags |= VP_FLAG_MULTICAST;
+        } else {
+            VR_MAC_CPY(keys[i].be_mac, mac);
+        }
+
+        tables[i] = bridge_htable(vrfs[i]);
+        if (!tables[i])
+            continue;
+        buckets[i] = vr_htable_prefetch(tables[i], &keys[i]);
+
+        learns[i] = vr_bridge_learns(pkt, (char *)mac + VR_ETHER_ALEN);
+        if (learns[i]) {
+            skeys[i].be_vrf_id = vrfs[i];
+            VR_MAC_CPY(skeys[i].be_mac, mac + VR_ETHER_ALEN);
+            sbuckets[i] = vr_htable_prefetch(tables[i], &skeys[i]);
+        }
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        pkt = pkts[i];
+        if (!tables[i]) {
+            vr_pfree(pkt, VP_DROP_INVALID_NH);
+            continue;
+        }
+
+        if (learns[i])
+            vr_bridge_learn(pkt->vp_if, vrfs[i], skeys[i].be_mac,
+                    vr_find_hentry_in_bucket(tables[i], &skeys[i],
+                        sbuckets[i]));
+
+        be = vr_find_hentry_in_bucket(tables[i], &keys[i], buckets[i]);
+        if (!be || !be->be_nh) {
+            vr_pfree(pkt, VP_DROP_INVALID_NH);
+            continue;
+        }
+
+        if (be->be_flags & VR_BE_FLAG_LABEL_VALID)
+            fmds[i].fmd_label = be->be_label;
+        nh_output(vrfs[i], pkt, be->be_nh, &fmds[i]);
+    }
+
+    return num_pkts;
+}
+
 unsigned int
 vr_l2_input(unsigned short vrf, struct vr_packet *pkt, 
                               struct vr_forwarding_md *fmd)
@@ -34,33 +34,90 @@
 struct vr_btable_partition *
 vr_btable_get_partition(struct vr_btable *table, unsigned int partition)
 {
-    if (partition >= VR_MAX_BTABLE_ENTRIES)
+    if (partition >= table->vb_partitions)
         return NULL;
 
     return &table->vb_table_info[partition];
 }
 
 /*
- * given an offset into the total memory managed by the btable (i.e memory
- * across all partitions), return the corresponding virtual address
+ * a lazy table gets the memory of a partition when an entry in it is first
+ * written to (or mapped to user space), and not at alloc time. two cpus
+ * could race for the same partition, and the one that loses frees its copy
  */
+static void *
+vr_btable_fill_partition(struct vr_btable *table, unsigned int i)
+{
+    void *mem;
+    unsigned int size = table->vb_table_info[i].vb_mem_size;
+
+    if (table->vb_mem[i])
+        return table->vb_mem[i];
+
+    if (table->vb_nodes > 1 && vr_node_page_alloc)
+        mem = vr_node_page_alloc(size,
+                (uint64_t)i * table->vb_nodes / table->vb_partitions);
+    else
+        mem = vr_page_alloc(size);
+    if (!mem)
+        return NULL;
+
+    if (!__sync_bool_compare_and_swap(&table->vb_mem[i], NULL, mem))
+        vr_page_free(mem, size);
+
+    return table->vb_mem[i];
+}
+
+/* as vr_btable_get, for when the entry is going to be written to */
 void *
-vr_btable_get_address(struct vr_btable *table, unsigned int offset)
+vr_btable_fill(struct vr_btable *table, unsigned int entry)
+{
+    if (entry >= table->vb_entries)
+        return NULL;
+
+    if (!vr_btable_fill_partition(table, entry >> table->vb_shift))
+        return NULL;
+
+    return vr_btable_get(table, entry);
+}
+
+int
+vr_btable_prefault(struct vr_btable *table)
 {
     unsigned int i;
-    struct vr_btable_partition *partition;
 
     for (i = 0; i < table->vb_partitions; i++) {
-        partition = vr_btable_get_partition(table, i);
-        if (!partition)
-            break;
-
-        if (offset >= partition->vb_offset && 
-                offset < partition->vb_offset + partition->vb_mem_size)
-            return table->vb_mem[i] + (offset - partition->vb_offset);
+        if (!vr_btable_fill_partition(table, i))
+            return -ENOMEM;
     }
 
-    return NULL;
+    return 0;
+}
+
+/*
+ * given an offset into the total memory managed by the btable (i.e memory
+ * across all partitions), return the corresponding virtual address. this
+ * is for the mapping to user space, which gets the memory of a lazy table
+ * filled in
+ */
+void *
+vr_btable_get_address(struct vr_btable *table, uint64_t offset)
+{
+    void *mem;
+    struct vr_btable_partition *partition;
+
+    /* all partitions but the last are of VR_SINGLE_ALLOC_LIMIT */
+    partition = vr_btable_get_partition(table,
+            offset >> VR_SINGLE_ALLOC_SHIFT);
+    if (!partition ||
+            offset >= partition->vb_offset + partition->vb_mem_size)
+        return NULL;
+
+    mem = vr_btable_fill_partition(table, offset >> VR_SINGLE_ALLOC_SHIFT);
+    if (!mem)
+        return NULL;
+
+    return mem + (offset - partition->vb_offset);
 }
 
 void
@@ -71,7 +128,7 @@ vr_btable_free(struct vr_btable *table)
     if (!table)
         return;
 
-    for (i = 0; i < VR_MAX_BTABLE_ENTRIES; i++) {
+    for (i = 0; i < table->vb_partitions; i++) {
         if (table->vb_mem[i])
             vr_page_free(table->vb_mem[i], table->vb_table_info[i].vb_mem_size);
     }
@@ -80,25 +137,20 @@ vr_btable_free(struct vr_btable *table)
     return;
 }
 
-struct vr_btable *
-vr_btable_alloc(unsigned int num_entries, unsigned int entry_size)
+static struct vr_btable *
+__vr_btable_alloc(unsigned int num_entries, unsigned int entry_size,
+        bool lazy)
 {
-    unsigned int i = 0, num_parts, remainder;
-    uint64_t total_mem;
+    unsigned int i = 0, num_parts, remainder, size;
+    uint64_t total_mem, offset = 0;
     struct vr_btable *table;
-    unsigned int offset = 0;
 
-    total_mem = num_entries * entry_size;
-    /* need more testing. that's all */
-    if (total_mem > VR_KNOWN_BIG_MEM_LIMIT)
+    if (!entry_size || entry_size > VR_SINGLE_ALLOC_LIMIT)
         return NULL;
 
-    table = vr_zalloc(sizeof(*table));
-    if (!table)
-        return NULL;
-
-    num_parts = total_mem / VR_SINGLE_ALLOC_LIMIT;
-    remainder = total_mem % VR_SINGLE_ALLOC_LIMIT;
+    total_mem = (uint64_t)num_entries * entry_size;
+    num_parts = total_mem >> VR_SINGLE_ALLOC_SHIFT;
+    remainder = total_mem & (VR_SINGLE_ALLOC_LIMIT - 1);
     if (num_parts + !!remainder > VR_MAX_BTABLE_ENTRIES)
         return NULL;
 
@@ -106,35 +158,64 @@ vr_btable_alloc(unsigned int num_entries, unsigned int entry_size)
         /*
          * the entry size has to be a factor of VR_SINGLE_ALLOC limit.
          * otherwise, we might access memory beyond the allocated chunk
-         * while accessing the last entry
+         * while accessing the last entry. being a factor of a power of
+         * two, the number of entries in a partition is one too
          */
         if (VR_SINGLE_ALLOC_LIMIT % entry_size)
             return NULL;
     }
 
+    /* the partition arrays follow the table, in the same allocation */
+    size = sizeof(*table) + (num_parts + !!remainder) *
+        (sizeof(void *) + sizeof(struct vr_btable_partition));
+    table = vr_zalloc(size);
+    if (!table)
+        return NULL;
+
+    table->vb_mem = (void **)(table + 1);
+    table->vb_table_info = (struct vr_btable_partition *)
+        (table->vb_mem + num_parts + !!remainder);
+
+    if (num_parts) {
+        table->vb_shift = VR_SINGLE_ALLOC_SHIFT;
+        while (((uint64_t)1 << table->vb_shift) * entry_size >
+                VR_SINGLE_ALLOC_LIMIT)
+            table->vb_shift--;
+    } else {
+        /* one partition, that any entry index falls in */
+        table->vb_shift = 31;
+    }
+
     if (num_parts) {
         for (i = 0; i < num_parts; i++) {
-            table->vb_mem[i] = vr_page_alloc(VR_SINGLE_ALLOC_LIMIT);
-            if (!table->vb_mem[i])
-                goto exit_alloc;
             table->vb_table_info[i].vb_mem_size = VR_SINGLE_ALLOC_LIMIT;
             table->vb_table_info[i].vb_offset = offset;
             offset += table->vb_table_info[i].vb_mem_size;
+            /* so that the free of a failed alloc sees what is in there */
+            table->vb_partitions = i + 1;
+            if (!lazy) {
+                table->vb_mem[i] = vr_page_alloc(VR_SINGLE_ALLOC_LIMIT);
+                if (!table->vb_mem[i])
+                    goto exit_alloc;
+            }
         }
-        table->vb_partitions = num_parts;
     }
 
     if (remainder) {
-        table->vb_mem[i] = vr_page_alloc(remainder);
-        if (!table->vb_mem[i])
-            goto exit_alloc;
         table->vb_table_info[i].vb_mem_size = remainder;
         table->vb_table_info[i].vb_offset = offset;
         table->vb_partitions++;
+        if (!lazy) {
+            table->vb_mem[i] = vr_page_alloc(remainder);
+            if (!table->vb_mem[i])
+                goto exit_alloc;
+        }
     }
 
     table->vb_entries = num_entries;
     table->vb_esize = entry_size;
+    if (lazy)
+        table->vb_flags |= VR_BTABLE_FLAG_LAZY;
 
     return table;
 
@@ -142,3 +223,33 @@ exit_alloc:
     vr_btable_free(table);
     return NULL;
 }
+
+struct vr_btable *
+vr_btable_alloc(unsigned int num_entries, unsigned int entry_size)
+{
+    return __vr_btable_alloc(num_entries, entry_size, false);
+}
+
+struct vr_btable *
+vr_btable_alloc_lazy(unsigned int num_entries, unsigned int entry_size)
+{
+    return __vr_btable_alloc(num_entries, entry_size, true);
+}
+
+/*
+ * a lazy table, the consecutive partitions of which are in the memory of
+ * consecutive nodes, i.e the first 1/nodes of the table is on node 0 and
+ * so on. with a host that cannot allocate on a node, a plain lazy table
+ */
+struct vr_btable *
+vr_btable_alloc_lazy_nodes(unsigned int num_entries, unsigned int entry_size,
+        unsigned int nodes)
+{
+    struct vr_btable *table;
+
+    table = __vr_btable_alloc(num_entries, entry_size, true);
+    if (table)
+        table->vb_nodes = nodes;
+
+    return table;
+}
@@ -5,6 +5,9 @@
  */
 #include <vr_os.h>
 
+extern int vr_inet6_forward(struct vrouter *, unsigned short,
+        struct vr_packet *, struct vr_forwarding_md *);
+
 unsigned char vr_bcast_mac[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 unsigned char vr_well_known_mac_infix[] = { 0x80, 0xc2 };
 
@@ -195,8 +198,8 @@ vr_l3_input(unsigned short vrf, struct vr_packet *pkt,
     struct vr_interface *vif = pkt->vp_if;
     struct vrouter *router = vif->vif_router;
     /*
-     * we will optimise for the most likely case i.e that of IPv4. need
-     * to see what needs to happen for v6 when it comes
+     * we will optimise for the most likely case i.e that of IPv4. v6 is
+     * routed in vrfs that have v6 routes, and bridged otherwise
      */
     data = pkt_pull(pkt, VR_ETHER_HLEN);
     if (!data) {
@@ -228,8 +231,12 @@ vr_l3_input(unsigned short vrf, struct vr_packet *pkt,
             }
          }
          return vr_flow_inet_input(router, vrf, pkt, eth_proto, fmd);
-    } else if (eth_proto == VR_ETH_PROTO_ARP)
+    } else if (eth_proto == VR_ETH_PROTO_ARP) {
         return vr_arp_input(router, vrf, pkt);
+    } else if (eth_proto == VR_ETH_PROTO_IP6) {
+        if (!vr_inet6_forward(router, vrf, pkt, fmd))
+            return 0;
+    }
 
     /* rest of the stuff is for slow path and we should be ok doing this */
     if (well_known_mac(dmac))
@@ -244,3 +251,33 @@ vr_l3_input(unsigned short vrf, struct vr_packet *pkt,
     /* The packets is not handled. Might need to be bridged ..*/
     return PKT_RET_FALLBACK_BRIDGING;
 }
+
+/*
+ * the per packet part of vr_l3_input, for packets received in a burst.
+ * untagged ipv4 frames are stripped of the ethernet header and are then
+ * ready to go to the flow lookup as a batch. everything else is left
+ * untouched and has to take vr_l3_input
+ */
+bool
+vr_l3_input_prepare(struct vr_packet *pkt)
+{
+    unsigned char *eth = pkt_data(pkt);
+    struct vr_interface *vif = pkt->vp_if;
+
+    if (pkt_head_len(pkt) < VR_ETHER_HLEN)
+        return false;
+
+    if (ntohs(*(unsigned short *)(eth + VR_ETHER_PROTO_OFF)) !=
+            VR_ETH_PROTO_IP)
+        return false;
+
+    if (vr_from_vm_mss_adj && vr_pkt_from_vm_tcp_mss_adj &&
+            (vif->vif_type == VIF_TYPE_VIRTUAL))
+        return false;
+
+    pkt_pull(pkt, VR_ETHER_HLEN);
+    pkt_set_network_header(pkt, pkt->vp_data);
+    pkt_set_inner_network_header(pkt, pkt->vp_data);
+
+    return true;
+}
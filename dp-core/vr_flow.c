@@ -21,14 +21,319 @@
         sizeof(struct vr_flow_entry))
 
 #define VR_FLOW_ENTRIES_PER_BUCKET  4U
+#define VR_OFLOW_PROBE_LIMIT        8U
+#define VR_FLOW_ALT_HASH_SEED       0x9e3779b9
+
+#define VR_FLOW_TAG_LANES           0x0001000100010001ULL
+#define VR_FLOW_TAG_HIGH_BITS       0x8000800080008000ULL
 
 #define VR_MAX_FLOW_QUEUE_ENTRIES   3U
 
+#define VR_FLOW_RESIZE_ENTRIES_PER_SCAN     4096
+#define VR_FLOW_RESIZE_SCAN_MSECS           10
+
+#define VR_FLOW_AGING_ENTRIES_PER_SCAN      8192
+#define VR_FLOW_AGING_SCAN_MSECS            100
+/* aged flows that the agent has not yet collected */
+#define VR_FLOW_AGED_RING_SIZE              4096
+
+#define VR_FLOW_OFFLOAD_ENTRIES_PER_SCAN    4096
+#define VR_FLOW_OFFLOAD_SCAN_MSECS          1000
+
 #define VR_MAX_FLOW_TABLE_HOLD_COUNT \
                                     4096
 
+/* flow misses that can wait for the next coalesced trap */
+#define VR_FLOW_MISS_BATCH_SLOTS            256
+/* token bucket credit is kept in 1/1000 of a trap, earned every msec */
+#define VR_FLOW_MISS_CREDIT_UNIT            1000
+
 unsigned int vr_flow_entries = VR_DEF_FLOW_ENTRIES;
 unsigned int vr_oflow_entries = VR_DEF_OFLOW_ENTRIES;
+/* keep the flow statistics out of the flow entries (SPLIT format) */
+unsigned int vr_flow_stats_split = 0;
+/* report flow misses in the event rings. see struct vr_flow_event */
+unsigned int vr_flow_events = 0;
+/* look up recently hit flows in a per-cpu cache first */
+unsigned int vr_flow_cache_enable = 0;
+/* packets a flow has to have seen before it is offloaded */
+unsigned int vr_flow_offload_packets = 1000;
+/*
+ * allocate all of the flow table at init. otherwise, a part of the table
+ * gets its memory when the first flow goes in there, or when it is mapped
+ */
+unsigned int vr_flow_prefault = 0;
+/*
+ * hash a flow by its canonical 5-tuple, so that a flow and its reverse go
+ * to the same bucket, and are looked up, aged and freed together
+ */
+unsigned int vr_flow_paired = 0;
+/*
+ * split the flow table into a part (shard) per numa node. the shard of a
+ * flow is the same for both of its directions, and flow indices stay as
+ * they are, i.e shard n is the n'th 1/vr_flow_nshards of the table
+ */
+unsigned int vr_flow_shards = 0;
+static unsigned int vr_flow_nshards = 1;
+/*
+ * bytes per second, over which a flow is an elephant. the rate is sampled
+ * every VR_FLOW_RATE_SAMPLE packets of a flow (on a cpu), and the host
+ * can steer the packets of elephants away from the cores of the rest
+ * (see vr_flow_is_elephant). 0 to not track the rate
+ */
+unsigned int vr_flow_elephant_rate = 0;
+
+#define VR_FLOW_RATE_SAMPLE         16
+
+/*
+ * the elephants, by their shard hash (same for both the directions, and
+ * what the host can tell from a packet), in a direct mapped table. two
+ * elephants in a slot means that one of them goes as a mouse
+ */
+#define VR_FLOW_ELEPHANT_SLOTS      1024
+
+static unsigned int vr_flow_elephants[VR_FLOW_ELEPHANT_SLOTS];
+
+/*
+ * the per-cpu cache of recently hit flows. slots are picked by a fold of
+ * the key (cheaper than vr_flow_hash) and hold the index of the flow and
+ * the value of vr_flow_cache_gen when the slot was filled. the generation
+ * moves whenever a flow entry is reset (delete, aging, flush) or the
+ * indices are renumbered (resize), which invalidates all the slots. a hit
+ * is still checked against the key of the entry.
+ */
+#define VR_FLOW_CACHE_SLOTS                 16
+
+struct vr_flow_cache_entry {
+    unsigned int fce_gen;
+    int fce_index;
+};
+
+struct vr_flow_cache {
+    uint64_t fc_hits;
+    uint64_t fc_misses;
+    struct vr_flow_cache_entry fc_entry[VR_FLOW_CACHE_SLOTS];
+    /* keep the caches of two cpus out of a cache line */
+    uint8_t fc_pad[48];
+};
+
+/*
+ * per-cpu. the latency of a flow is accounted when the agent moves it out
+ * of HOLD, on the cpu of the agent's request
+ */
+struct vr_flow_setup_stats {
+    uint64_t fss_latency[VR_FLOW_SETUP_BUCKETS];
+    /* packets dropped for want of room in the hold queue of their flow */
+    uint64_t fss_queue_overflows;
+    uint8_t fss_pad[56];
+};
+
+/*
+ * per-cpu. the probe lengths (VR_FLOW_PROBE_BUCKETS) of the lookups that
+ * found the flow and of the inserts, the inserts that found both of the
+ * candidate buckets full and went to the overflow table, and the ones
+ * that found no room at all
+ */
+struct vr_flow_probe_stats {
+    uint64_t fps_lookups[VR_FLOW_PROBE_BUCKETS];
+    uint64_t fps_inserts[VR_FLOW_PROBE_BUCKETS];
+    uint64_t fps_oflow_inserts;
+    uint64_t fps_insert_fails;
+    uint8_t fps_pad[16];
+};
+
+/* remember the route lookup result of forwarded flows */
+unsigned int vr_flow_nh_cache_enable = 0;
+
+/*
+ * the route lookup result of a flow, one per flow index. the result is
+ * valid as long as fnc_gen matches the generation of the route table of
+ * fnc_vrf. a writer owns the entry while fnc_gen is
+ * VR_FLOW_NH_CACHE_BUSY, and readers read the generation before and
+ * after the rest of the entry. an entry is written only once for a
+ * generation.
+ */
+#define VR_FLOW_NH_CACHE_BUSY               0xffffffffU
+
+struct vr_flow_nh_cache {
+    uint32_t fnc_gen;
+    uint32_t fnc_nh_id;
+    int32_t fnc_label;
+    uint32_t fnc_vrf;
+};
+
+#define VR_FLOW_EVENT_RING_HDR_RECORDS \
+    (VR_FLOW_EVENT_RING_HDR_SIZE / sizeof(struct vr_flow_event))
+
+/*
+ * the per-cpu statistics tables are mmap-ed one after the other, and hence
+ * each of them should span a whole number of pages
+ */
+#define VR_FLOW_STATS_PAGE_SIZE         4096
+#define VR_FLOW_STATS_SLOTS \
+    ((vr_flow_entries + vr_oflow_entries + \
+      (VR_FLOW_STATS_PAGE_SIZE / VR_FLOW_STATS_SLOT_SIZE) - 1) & \
+     ~((VR_FLOW_STATS_PAGE_SIZE / VR_FLOW_STATS_SLOT_SIZE) - 1))
+
+/*
+ * online resize of the flow table. a new (bigger) flow table is allocated
+ * and, while the old entries are moved to it a few at a time from a timer,
+ * the index space is
+ *
+ *  [0, vfr_old_entries)                    old flow table
+ *  [vfr_old_entries, vfr_base)             overflow table (not resized)
+ *  [vfr_base, vfr_base + vfr_entries)      new flow table
+ *
+ * lookups look in the new table first and new flows are added only to
+ * the new table (or to the overflow table). the index of a moved entry is
+ * remembered in vfr_remap, so that the old index still resolves to the
+ * entry. once all entries are moved, the new table takes the place of the
+ * old one and the indices are renumbered to the usual layout, which is
+ * when the agent is expected to read the flow table again. requests with
+ * stale indices fail the key check in vr_flow_req_is_invalid.
+ */
+struct vr_flow_resize {
+    struct vr_btable *vfr_table;
+    struct vr_btable *vfr_tags;
+    struct vr_btable *vfr_remap;
+    unsigned int vfr_entries;
+    unsigned int vfr_old_entries;
+    unsigned int vfr_base;
+    unsigned int vfr_cursor;
+    bool vfr_done;
+    struct vr_timer *vfr_timer;
+};
+
+/*
+ * idle timeouts (in seconds) of flows, when the kernel ages them. 0 leaves
+ * the aging of the flows of that protocol to the agent
+ */
+unsigned int vr_flow_tcp_idle_timeout = 0;
+unsigned int vr_flow_udp_idle_timeout = 0;
+unsigned int vr_flow_other_idle_timeout = 0;
+/*
+ * seconds after which tcp flows that have closed (a reset in either
+ * direction, or a fin in both) are removed, whatever their idle timeout.
+ * 0 for them to be aged as any other tcp flow
+ */
+unsigned int vr_flow_tcp_closed_timeout = 0;
+
+/*
+ * flow-miss traps per second that each interface can send to the agent
+ * (0 for no limit), and how many of them can go in a burst. a miss over
+ * the limit is dropped and the flow stays in hold, so that a later packet
+ * of the flow traps again
+ */
+unsigned int vr_flow_miss_trap_rate = 0;
+unsigned int vr_flow_miss_trap_burst = 32;
+
+/*
+ * when set, flow misses are not trapped one packet at a time. instead,
+ * the indices of the new flows are collected in vr_flow_miss_batch and
+ * sent every vr_flow_miss_coalesce_msecs as one AGENT_TRAP_FLOW_MISS_BATCH
+ * message, whose payload is the list of indices (in network order) and
+ * whose hdr_cmd_param is the number of indices. the agent reads the keys
+ * from the flow table. misses that do not fit in the batch are trapped
+ * the usual way
+ */
+unsigned int vr_flow_miss_coalesce_msecs = 0;
+
+struct vr_flow_miss_batch {
+    unsigned int fmb_head;
+    struct vr_timer *fmb_timer;
+    int fmb_index[VR_FLOW_MISS_BATCH_SLOTS];
+};
+
+/*
+ * in-kernel aging. the datapath stamps vr_flow_hits with a coarse clock
+ * (maintained by the scanner) on every hit, and the scanner walks the
+ * table a few entries at a time, removing flows that were idle for
+ * longer than the timeout of their protocol. a flow and its reverse flow
+ * are removed together, and only when both are idle. the indices of
+ * removed flows are kept in a ring, from where the agent collects them
+ * with FLOW_OP_FLOW_AGED_GET. aging stops while the ring is full, so
+ * that the agent gets to know about every flow that was removed.
+ */
+struct vr_flow_aging {
+    unsigned int vfa_clock;
+    unsigned int vfa_cursor;
+    unsigned int vfa_head;
+    unsigned int vfa_tail;
+    struct vr_timer *vfa_timer;
+    unsigned int vfa_ring[VR_FLOW_AGED_RING_SIZE];
+};
+
+/*
+ * offload of established flows to an engine that forwards them without the
+ * datapath. a scanner walks the table a few entries at a time, hands the
+ * engine flows that are forwarded or natted, without mirroring, traps or
+ * ecmp, whose route resolves to a tunnel or an interface, and that have
+ * seen vr_flow_offload_packets packets, and brings the statistics of the
+ * offloaded flows back into the flow table. a flow is taken back when the
+ * agent changes it, when it is reset (delete, aging, flush), when it stops
+ * qualifying, and when the routes of its vrf change: fe_offload holds a
+ * few bits of the route table generation the flow was offloaded in. the
+ * scanner owns an entry while it is VR_FLOW_OFFLOAD_BUSY. the index space
+ * is renumbered while resizing, and hence all flows are taken back first
+ */
+#define VR_FLOW_OFFLOAD_BUSY                0xff
+#define VR_FLOW_OFFLOAD_TAG(gen)            (((gen) % 254) + 1)
+
+struct vr_flow_offload_state {
+    struct vr_flow_offload_ops *fos_ops;
+    struct vr_timer *fos_timer;
+    unsigned int fos_cursor;
+};
+
+/*
+ * source nat in the datapath. for a vm (vrf and source ip) that has a
+ * rule (FLOW_OP_FLOW_SNAT_SET), the first packet of a tcp or udp flow does
+ * not wait for the agent: the datapath picks a port from the range of the
+ * rule, sets up the flow and its reverse flow, and reports the binding with
+ * a VR_FLOW_EVENT_SNAT_BIND. the range is split in one block per cpu, so
+ * that the cpus do not contend for ports. a port is free as long as no
+ * flow has it in its reverse key, and hence goes back to the block as
+ * soon as the flow is deleted or aged. rules sit in buckets of
+ * VR_FLOW_SNAT_BUCKET slots and are replaced, never changed in place
+ */
+#define VR_FLOW_SNAT_SLOTS          1024
+#define VR_FLOW_SNAT_BUCKET         4
+/* ports tried before the packet goes to the agent */
+#define VR_FLOW_SNAT_PROBES         16
+
+struct vr_flow_snat {
+    unsigned int fsn_sip;
+    unsigned int fsn_snat_ip;
+    unsigned short fsn_vrf;
+    unsigned short fsn_dvrf;
+    unsigned int fsn_src_nh;
+    unsigned short fsn_port;
+    unsigned int fsn_block;
+    /* next port of every cpu, relative to its block */
+    unsigned short fsn_cursor[0];
+};
+
+/*
+ * packets of flows in HOLD state are queued using nodes from a per-cpu
+ * pool, preallocated to accommodate the maximum number of held packets,
+ * so that a flow setup storm does not get to the allocator. a node goes
+ * back to the pool of the cpu it came from (the flush could run on a
+ * different cpu). only the owner cpu takes nodes out of a pool, and hence
+ * the lock-free free list does not suffer from ABA.
+ */
+#define VR_FLOW_HOLD_POOL_NODES     (VR_MAX_FLOW_QUEUE_ENTRIES * \
+        VR_MAX_FLOW_TABLE_HOLD_COUNT)
+
+struct vr_flow_hold_node {
+    struct vr_packet_node fhn_pnode;
+    struct vr_flow_hold_node *fhn_next;
+    unsigned int fhn_cpu;
+};
+
+struct vr_flow_hold_pool {
+    struct vr_flow_hold_node *fhp_free;
+    struct vr_btable *fhp_nodes;
+};
 
 #ifdef __KERNEL__
 extern unsigned short vr_flow_major;
@@ -36,11 +341,19 @@ extern unsigned short vr_flow_major;
 
 extern int vr_ip_input(struct vrouter *, unsigned short,
         struct vr_packet *, struct vr_forwarding_md *);
+extern void vr_ip_input_bulk(struct vrouter *, unsigned short *,
+        struct vr_packet **, unsigned int, struct vr_forwarding_md *);
+extern struct vr_nexthop *(*vr_inet_route_lookup)(unsigned int,
+                struct vr_route_req *, struct vr_packet *);
+extern unsigned int (*vr_inet_vrf_gen)(unsigned int);
 extern void vr_ip_update_csum(struct vr_packet *, unsigned int,
         unsigned int);
 
 static void vr_flush_entry(struct vrouter *, struct vr_flow_entry *,
         struct vr_flow_md *, struct vr_forwarding_md *);
+static void vr_flow_offload_takeback(struct vrouter *, struct vr_flow_entry *,
+        unsigned int);
+static void vr_flow_elephant_set(struct vr_flow_entry *, bool);
 
 static void
 vr_flow_reset_mirror(struct vrouter *router, struct vr_flow_entry *fe, 
@@ -72,21 +385,141 @@ vr_init_flow_entry(struct vr_flow_entry *fe)
 }
 
 
+static uint16_t *
+vr_flow_tag_get(struct vrouter *router, unsigned int index)
+{
+    struct vr_btable *table = router->vr_flow_tags;
+    struct vr_flow_resize *resize = router->vr_flow_resize;
+
+    if (resize && index >= resize->vfr_base) {
+        table = resize->vfr_tags;
+        index -= resize->vfr_base;
+    } else if (index >= vr_flow_entries) {
+        table = router->vr_oflow_tags;
+        index -= vr_flow_entries;
+        if (index >= vr_oflow_entries)
+            return NULL;
+    }
+
+    if (!table)
+        return NULL;
+
+    return (uint16_t *)vr_btable_get(table, index);
+}
+
+static inline struct vr_flow_cpu_stats *
+vr_flow_cpu_stats_get(struct vrouter *router, unsigned int cpu,
+        unsigned int index)
+{
+    if (!router->vr_flow_stats_table || !router->vr_flow_stats_table[cpu])
+        return NULL;
+
+    return (struct vr_flow_cpu_stats *)
+        vr_btable_get(router->vr_flow_stats_table[cpu], index);
+}
+
+static void
+vr_flow_reset_cpu_stats(struct vrouter *router, unsigned int index)
+{
+    unsigned int cpu;
+    struct vr_flow_cpu_stats *stats;
+
+    if (!router->vr_flow_stats_table)
+        return;
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        stats = vr_flow_cpu_stats_get(router, cpu, index);
+        if (stats)
+            memset(stats, 0, sizeof(*stats));
+    }
+
+    return;
+}
+
+static struct vr_btable *
+vr_flow_changes_alloc(unsigned int entries)
+{
+    unsigned int i, groups;
+    struct vr_btable *table;
+
+    /* whole pages of the mmap-ed memory */
+    groups = (entries + VR_FLOW_CHANGE_GROUP - 1) / VR_FLOW_CHANGE_GROUP;
+    groups = (groups + 1023) & ~1023U;
+    table = vr_btable_alloc(groups, sizeof(uint32_t));
+    /* not what a reader of an older table read, for any of the groups */
+    for (i = 0; table && i < vr_btable_entries(table); i++)
+        *(uint32_t *)vr_btable_get(table, i) = 1;
+
+    return table;
+}
+
+unsigned int
+vr_flow_changes_table_size(struct vrouter *router)
+{
+    if (!router->vr_flow_changes)
+        return 0;
+
+    return vr_btable_size(router->vr_flow_changes);
+}
+
+/* after the change of the entry is visible */
+static inline void
+vr_flow_changed(struct vrouter *router, unsigned int index)
+{
+    unsigned int group = index / VR_FLOW_CHANGE_GROUP;
+    struct vr_btable *table = router->vr_flow_changes;
+
+    /* the new entries of a resize are in the table that comes after it */
+    if (!table || group >= vr_btable_entries(table))
+        return;
+
+    (void)__sync_add_and_fetch((uint32_t *)vr_btable_get(table, group), 1);
+
+    return;
+}
+
 static void
 vr_reset_flow_entry(struct vrouter *router, struct vr_flow_entry *fe,
         unsigned int index)
 {
+    uint16_t *tag;
+    struct vr_flow_nh_cache *nh_cache;
+
+    vr_flow_offload_takeback(router, fe, index);
+
+    tag = vr_flow_tag_get(router, index);
+    if (tag)
+        *tag = 0;
+
+    vr_flow_reset_cpu_stats(router, index);
     memset(&fe->fe_stats, 0, sizeof(fe->fe_stats));
     memset(&fe->fe_hold_list, 0, sizeof(fe->fe_hold_list));;
+
+    vr_flow_elephant_set(fe, false);
+    fe->fe_rate_window = 0;
+    fe->fe_rate_bytes = 0;
     memset(&fe->fe_key, 0, sizeof(fe->fe_key));
 
     vr_flow_reset_mirror(router, fe, index);
+    fe->fe_tcp_flags = 0;
     fe->fe_ecmp_nh_index = -1;
     fe->fe_src_nh_index = NH_DISCARD_ID;
     fe->fe_rflow = -1;
     fe->fe_action = VR_FLOW_ACTION_DROP;
     fe->fe_flags = 0;
 
+    if (router->vr_flow_cache)
+        (void)__sync_add_and_fetch(&router->vr_flow_cache_gen, 1);
+
+    if (router->vr_flow_nh_cache) {
+        nh_cache = (struct vr_flow_nh_cache *)
+            vr_btable_get(router->vr_flow_nh_cache, index);
+        if (nh_cache)
+            nh_cache->fnc_gen = 0;
+    }
+
+    vr_flow_changed(router, index);
+
     return;
 }
 
@@ -122,26 +555,234 @@ vr_oflow_table_size(struct vrouter *router)
     return vr_btable_size(router->vr_oflow_table);
 }
 
+unsigned int
+vr_flow_resize_table_size(struct vrouter *router)
+{
+    if (!router->vr_flow_resize)
+        return 0;
+
+    return vr_btable_size(router->vr_flow_resize->vfr_table);
+}
+
+unsigned int
+vr_flow_stats_table_size(struct vrouter *router)
+{
+    if (!router->vr_flow_stats_table)
+        return 0;
+
+    return vr_btable_size(router->vr_flow_stats_table[0]) * vr_num_cpus;
+}
+
+unsigned int
+vr_flow_event_table_size(struct vrouter *router)
+{
+    if (!router->vr_flow_event_table)
+        return 0;
+
+    return vr_btable_size(router->vr_flow_event_table[0]) * vr_num_cpus;
+}
+
+/* only the current cpu writes to its ring */
+static bool
+vr_flow_event_post(struct vrouter *router, unsigned short type,
+        unsigned int index, unsigned short vrf, unsigned int ifindex,
+        unsigned int param)
+{
+    uint32_t head;
+    struct vr_btable *table;
+    struct vr_flow_event_ring *ring;
+    struct vr_flow_event *event;
+
+    if (!router->vr_flow_event_table)
+        return false;
+
+    table = router->vr_flow_event_table[vr_get_cpu()];
+    ring = (struct vr_flow_event_ring *)vr_btable_get(table, 0);
+
+    head = ring->fer_head;
+    if (head - ring->fer_tail >= VR_FLOW_EVENT_RING_RECORDS) {
+        ring->fer_overflows++;
+        return false;
+    }
+
+    event = (struct vr_flow_event *)vr_btable_get(table,
+            VR_FLOW_EVENT_RING_HDR_RECORDS +
+            (head % VR_FLOW_EVENT_RING_RECORDS));
+    event->fev_type = type;
+    event->fev_vrf = vrf;
+    event->fev_index = index;
+    event->fev_ifindex = ifindex;
+    event->fev_param = param;
+
+    /* the record has to be visible before the head moves */
+    __sync_synchronize();
+    ring->fer_head = head + 1;
+
+    return true;
+}
+
+/*
+ * statistics of a flow entry, in the layout of fe_stats. in the SPLIT
+ * format, this is the sum of the per-cpu counters
+ */
+void
+vr_flow_get_stats(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index, struct vr_flow_stats *stats)
+{
+    unsigned int cpu;
+    uint64_t bytes = 0, packets = 0;
+    struct vr_flow_cpu_stats *cpu_stats;
+
+    if (!router->vr_flow_stats_table) {
+        memcpy(stats, &fe->fe_stats, sizeof(*stats));
+        return;
+    }
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        cpu_stats = vr_flow_cpu_stats_get(router, cpu, index);
+        if (!cpu_stats)
+            continue;
+
+        bytes += cpu_stats->fcs_bytes;
+        packets += cpu_stats->fcs_packets;
+    }
+
+    stats->flow_bytes = (uint32_t)bytes;
+    stats->flow_bytes_oflow = (uint16_t)(bytes >> 32);
+    stats->flow_packets = (uint32_t)packets;
+    stats->flow_packets_oflow = (uint8_t)(packets >> 32);
+
+    return;
+}
+
 /*
  * this is used by the mmap code. mmap sees the whole flow table
- * (including the overflow table) as one large table. so, given
- * an offset into that large memory, we should return the correct
- * virtual address
+ * (including the overflow table, the new flow table while resizing, the
+ * statistics table in the SPLIT format, the event rings, the agent
+ * packet rings, the counters and the changes) as one large table. so, given
+ * an offset into that large memory, we should return the correct virtual
+ * address
  */
 void *
 vr_flow_get_va(struct vrouter *router, uint64_t offset)
 {
     struct vr_btable *table = router->vr_flow_table;
-    unsigned int size = vr_flow_table_size(router);
-
-    if (offset >= vr_flow_table_size(router)) {
-        table = router->vr_oflow_table;
+    struct vr_btable **cpu_tables;
+    uint64_t size = vr_flow_table_size(router);
+
+    if (offset < size)
+        return vr_btable_get_address(table, offset);
+    offset -= size;
+
+    size = vr_oflow_table_size(router);
+    if (offset < size)
+        return vr_btable_get_address(router->vr_oflow_table, offset);
+    offset -= size;
+
+    size = vr_flow_resize_table_size(router);
+    if (offset < size)
+        return vr_btable_get_address(router->vr_flow_resize->vfr_table,
+                offset);
+    offset -= size;
+
+    /* the per-cpu tables follow, one after the other */
+    cpu_tables = router->vr_flow_stats_table;
+    size = vr_flow_stats_table_size(router);
+    if (offset >= size) {
         offset -= size;
+        cpu_tables = router->vr_flow_event_table;
+        size = vr_flow_event_table_size(router);
+        if (offset >= size) {
+            offset -= size;
+            cpu_tables = router->vr_agent_ring_table;
+            size = vr_agent_ring_table_size(router);
+            if (offset >= size) {
+                offset -= size;
+                size = vr_counters_table_size(router);
+                if (offset < size)
+                    return vr_btable_get_address(router->vr_counters_table,
+                            offset);
+                offset -= size;
+                if (offset >= vr_flow_changes_table_size(router))
+                    return NULL;
+                return vr_btable_get_address(router->vr_flow_changes,
+                        offset);
+            }
+        }
     }
 
+    size = vr_btable_size(cpu_tables[0]);
+    table = cpu_tables[offset / size];
+    offset %= size;
+
     return vr_btable_get_address(table, offset);
 }
 
+static inline uint32_t *
+vr_flow_hit_get(struct vrouter *router, unsigned int index)
+{
+    if (!router->vr_flow_hits)
+        return NULL;
+
+    return (uint32_t *)vr_btable_get(router->vr_flow_hits, index);
+}
+
+/* written only when the clock has moved, to keep the cache line clean */
+static inline void
+vr_flow_hit(struct vrouter *router, unsigned int index)
+{
+    uint32_t *hit = vr_flow_hit_get(router, index);
+
+    if (hit && *hit != router->vr_flow_aging->vfa_clock)
+        *hit = router->vr_flow_aging->vfa_clock;
+
+    return;
+}
+
+/* index space while resizing. see struct vr_flow_resize */
+static struct vr_flow_entry *
+vr_flow_resize_get_entry(struct vrouter *router, unsigned int index)
+{
+    uint32_t *remap;
+    struct vr_flow_resize *resize = router->vr_flow_resize;
+
+    if (index < resize->vfr_old_entries) {
+        remap = (uint32_t *)vr_btable_get(resize->vfr_remap, index);
+        if (!remap || !*remap)
+            return (struct vr_flow_entry *)
+                vr_btable_get(router->vr_flow_table, index);
+        index = *remap;
+    }
+
+    if (index >= resize->vfr_base)
+        return (struct vr_flow_entry *)vr_btable_get(resize->vfr_table,
+                index - resize->vfr_base);
+
+    index -= resize->vfr_old_entries;
+    if (index >= vr_oflow_entries)
+        return NULL;
+
+    return (struct vr_flow_entry *)vr_btable_get(router->vr_oflow_table,
+            index);
+}
+
+/* the current index of an entry that could have been moved by a resize */
+static int
+vr_flow_resize_index(struct vrouter *router, int index)
+{
+    uint32_t *remap;
+    struct vr_flow_resize *resize = router->vr_flow_resize;
+
+    if (!resize || index < 0 || (unsigned int)index >= resize->vfr_old_entries)
+        return index;
+
+    remap = (uint32_t *)vr_btable_get(resize->vfr_remap, index);
+    if (!remap || !*remap)
+        return index;
+
+    return *remap;
+}
+
 static struct vr_flow_entry *
 vr_get_flow_entry(struct vrouter *router, int index)
 {
@@ -150,6 +791,9 @@ vr_get_flow_entry(struct vrouter *router, int index)
     if (index < 0)
         return NULL;
 
+    if (router->vr_flow_resize)
+        return vr_flow_resize_get_entry(router, index);
+
     if ((unsigned int)index < vr_flow_entries)
         table = router->vr_flow_table;
     else {
@@ -206,865 +850,3336 @@ vr_get_flow_key(struct vr_flow_key *key, unsigned short vrf, struct vr_ip *ip,
     return;
 }
 
-static struct vr_flow_entry *
-vr_find_free_entry(struct vrouter *router, struct vr_flow_key *key,
-        unsigned int *fe_index)
-{
-    unsigned int i, index, hash;
-    struct vr_flow_entry *tmp_fe, *fe = NULL;
-
-    *fe_index = 0;
-
-    hash = vr_hash(key, sizeof(*key), 0);
-
-    index = (hash % vr_flow_entries) & ~(VR_FLOW_ENTRIES_PER_BUCKET - 1);
-    for (i = 0; i < VR_FLOW_ENTRIES_PER_BUCKET; i++) {
-        tmp_fe = vr_flow_table_entry_get(router, index);
-        if (tmp_fe && !(tmp_fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
-            if (vr_set_flow_active(tmp_fe)) {
-                vr_init_flow_entry(tmp_fe);
-                fe = tmp_fe;
-                break;
-            }
-        }
-        index++;
-    }
-        
-    if (!fe) {
-        index = hash % vr_oflow_entries;
-        for (i = 0; i < vr_oflow_entries; i++) {
-            tmp_fe = vr_oflow_table_entry_get(router, index);
-            if (tmp_fe && !(tmp_fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
-                if (vr_set_flow_active(tmp_fe)) {
-                    vr_init_flow_entry(tmp_fe);
-                    fe = tmp_fe;
-                    break;
-                }
-            }
-            index = (index + 1) % vr_oflow_entries;
-        }
+/*
+ * in the paired mode, the hash is that of the key with the lower of the two
+ * (ip, port) ends first, and thus the same for both the directions of a
+ * flow. the direction (whether the ends were swapped) goes to the lowest
+ * bit of the tag, so that the tags of the two entries still differ. the
+ * vrf is part of the hash, since the same addresses are in use in many
+ * vrfs, which means that flows that change vrfs are not paired, and nor
+ * are the nat-ed ones.
+ */
+#define VR_FLOW_PAIR_DIR            (1 << 16)
 
-        if (fe)
-            *fe_index += vr_flow_entries;
+static inline unsigned int
+vr_flow_pair_hash(struct vr_flow_key *key)
+{
+    unsigned int lo_ip = key->key_src_ip, hi_ip = key->key_dest_ip;
+    unsigned short lo_port = key->key_src_port, hi_port = key->key_dst_port;
+    unsigned int hash, dir = 0;
+
+    if ((lo_ip > hi_ip) || ((lo_ip == hi_ip) && (lo_port > hi_port))) {
+        lo_ip = key->key_dest_ip;
+        hi_ip = key->key_src_ip;
+        lo_port = key->key_dst_port;
+        hi_port = key->key_src_port;
+        dir = VR_FLOW_PAIR_DIR;
     }
 
-    if (fe) {
-        *fe_index += index;
-        memcpy(&fe->fe_key, key, sizeof(*key));
-    }
+    hash = vr_hash_3words(lo_ip, hi_ip, (lo_port << 16) | hi_port,
+            (key->key_vrf_id << 8) | key->key_proto);
 
-    return fe;
+    return (hash & ~VR_FLOW_PAIR_DIR) | dir;
 }
 
-static inline struct vr_flow_entry *
-vr_flow_table_lookup(struct vr_flow_key *key, struct vr_btable *table,
-                unsigned int table_size, unsigned int bucket_size,
-                unsigned int hash, unsigned int *fe_index)
+static inline unsigned int
+vr_flow_hash(struct vr_flow_key *key)
 {
-    unsigned int i;
-    struct vr_flow_entry *flow_e;
+    if (vr_flow_paired)
+        return vr_flow_pair_hash(key);
 
-    hash %= table_size;
+    return vr_keyed_hash(key, sizeof(*key));
+}
 
-    if (!bucket_size) {
-        bucket_size = table_size;
-    } else {
-        hash &= ~(bucket_size - 1);
-    }
+/*
+ * the hash that places an entry in the tables. in the paired mode, the
+ * direction bit is replaced by the lowest bit, which the bucket index
+ * leaves out anyway (for tables of a power of two entries)
+ */
+static inline unsigned int
+vr_flow_place_hash(unsigned int hash)
+{
+    if (!vr_flow_paired)
+        return hash;
 
-    for (i = 0; i < bucket_size; i++) {
-        flow_e = (struct vr_flow_entry *)vr_btable_get(table,
-                (hash + i) % table_size);
-        if (flow_e && flow_e->fe_flags & VR_FLOW_FLAG_ACTIVE) {
-            if (!memcmp(&flow_e->fe_key, key, sizeof(*key))) {
-                *fe_index = (hash + i) % table_size;
-                return flow_e;
-            }
-        }
-    }
+    return (hash & ~VR_FLOW_PAIR_DIR) | ((hash & 1) << 16);
+}
 
-    return NULL;
+/*
+ * every key has two candidate buckets in the flow table and two probe
+ * windows in the overflow table, one derived from the key hash and the
+ * other from an alternate hash (derived from the first). the number of
+ * entries examined for a lookup or an insert is thus bounded by
+ * 2 * (VR_FLOW_ENTRIES_PER_BUCKET + VR_OFLOW_PROBE_LIMIT), irrespective of
+ * how full the tables are. entries are not moved once allocated, since
+ * the agent refers to flows by their index (an online resize is the only
+ * exception, see struct vr_flow_resize).
+ */
+static inline unsigned int
+vr_flow_alt_hash(unsigned int hash)
+{
+    return vr_hash_1word(hash, VR_FLOW_ALT_HASH_SEED);
 }
 
+static inline unsigned int
+__vr_flow_bucket_index(unsigned int hash, unsigned int entries)
+{
+    return (hash % entries) & ~(VR_FLOW_ENTRIES_PER_BUCKET - 1);
+}
 
-struct vr_flow_entry *
-vr_find_flow(struct vrouter *router, struct vr_flow_key *key,
-        unsigned int *fe_index)
+/*
+ * of the sharded flow table, the bucket in the shard of the key. the
+ * shard hash leaves out the vrf and orders nothing, so that the forward
+ * and the reverse keys of a flow get the same shard
+ */
+static inline unsigned int
+vr_flow_shard_hash(unsigned int sip, unsigned int dip, unsigned short sport,
+        unsigned short dport, unsigned char proto)
 {
-    unsigned int hash;
-    struct vr_flow_entry *flow_e;
+    /* what the host can tell from the packet alone */
+    if (proto != VR_IP_PROTO_TCP && proto != VR_IP_PROTO_UDP)
+        sport = dport = 0;
 
-    hash = vr_hash(key, sizeof(*key), 0);
+    return vr_hash_2words(sip ^ dip, (sport ^ dport) | (proto << 16), 0);
+}
 
-    /* first look in the regular flow table */
-    flow_e = vr_flow_table_lookup(key, router->vr_flow_table, vr_flow_entries,
-                    VR_FLOW_ENTRIES_PER_BUCKET, hash, fe_index);
-    /* if not in the regular flow table, lookup in the overflow flow table */
-    if (!flow_e) {
-        flow_e = vr_flow_table_lookup(key, router->vr_oflow_table, vr_oflow_entries,
-                        0, hash, fe_index);
-        *fe_index += vr_flow_entries;
-    }
+static inline unsigned int
+vr_flow_key_shard(struct vr_flow_key *key, unsigned int shards)
+{
+    if (shards <= 1)
+        return 0;
 
-    return flow_e;
+    return vr_flow_shard_hash(key->key_src_ip, key->key_dest_ip,
+            key->key_src_port, key->key_dst_port, key->key_proto) % shards;
 }
 
-static inline bool
-vr_flow_queue_is_empty(struct vrouter *router, struct vr_flow_entry *fe)
+static inline unsigned int
+vr_flow_shard_bucket_index(unsigned int hash, unsigned int shard,
+        unsigned int entries, unsigned int shards)
 {
-    if (fe->fe_hold_list.node_p)
-        return false;
-    return true;
+    entries /= shards;
+    return (shard * entries) + __vr_flow_bucket_index(hash, entries);
 }
 
-
-static int
-vr_enqueue_flow(struct vr_flow_entry *fe, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+/*
+ * the numa node that the flow of the given (network order) header fields
+ * is kept in, or -1 when the flow table is not sharded. the host steers
+ * the packets of a flow to that node
+ */
+int
+vr_flow_shard_node(unsigned int sip, unsigned int dip, unsigned short sport,
+        unsigned short dport, unsigned char proto)
 {
-    unsigned int i = 0;
-    unsigned short drop_reason = 0;
-    struct vr_list_node **head = &fe->fe_hold_list.node_p;
-    struct vr_packet_node *pnode;
+    if (vr_flow_nshards <= 1)
+        return -1;
 
-    while (*head && ++i) {
-        head = &(*head)->node_n;
-    }
+    return vr_flow_shard_hash(sip, dip, sport, dport, proto) %
+        vr_flow_nshards;
+}
 
-    if (i >= VR_MAX_FLOW_QUEUE_ENTRIES) {
-        drop_reason = VP_DROP_FLOW_QUEUE_LIMIT_EXCEEDED;
-        goto drop;
-    }
+static inline unsigned int
+vr_flow_elephant_hash(unsigned int sip, unsigned int dip, unsigned short sport,
+        unsigned short dport, unsigned char proto)
+{
+    unsigned int hash = vr_flow_shard_hash(sip, dip, sport, dport, proto);
 
-    pnode = (struct vr_packet_node *)vr_zalloc(sizeof(struct vr_packet_node));
-    if (!pnode) {
-        drop_reason = VP_DROP_FLOW_NO_MEMORY;
-        goto drop;
-    }
+    /* 0 is a free slot */
+    return hash ? hash : 1;
+}
 
-    pnode->pl_packet = pkt;
-    pnode->pl_proto = proto;
-    if (fmd)
-        pnode->pl_outer_src_ip = fmd->fmd_outer_src_ip;
-    *head = &pnode->pl_node;
+/*
+ * whether the flow of the given (network order) header fields is an
+ * elephant, for the host to steer its packets by
+ */
+bool
+vr_flow_is_elephant(unsigned int sip, unsigned int dip, unsigned short sport,
+        unsigned short dport, unsigned char proto)
+{
+    unsigned int hash;
 
-    return 0;
+    if (!vr_flow_elephant_rate)
+        return false;
 
-drop:
-    vr_pfree(pkt, drop_reason);
-    return 0;
+    hash = vr_flow_elephant_hash(sip, dip, sport, dport, proto);
+    return vr_flow_elephants[hash % VR_FLOW_ELEPHANT_SLOTS] == hash;
 }
 
-static int
-vr_flow_forward(unsigned short vrf, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+static void
+vr_flow_elephant_set(struct vr_flow_entry *fe, bool elephant)
 {
-    struct vr_interface *vif = pkt->vp_if;
-    struct vrouter *router = vif->vif_router;
+    unsigned int hash, *slot;
 
-    if (proto != VR_ETH_PROTO_IP) {
-        vr_pfree(pkt, VP_DROP_FLOW_INVALID_PROTOCOL);
-        return 0;
+    if (elephant == !!(fe->fe_rate_flags & VR_FLOW_RATE_ELEPHANT))
+        return;
+
+    hash = vr_flow_elephant_hash(fe->fe_key.key_src_ip,
+            fe->fe_key.key_dest_ip, fe->fe_key.key_src_port,
+            fe->fe_key.key_dst_port, fe->fe_key.key_proto);
+    slot = &vr_flow_elephants[hash % VR_FLOW_ELEPHANT_SLOTS];
+
+    if (elephant) {
+        fe->fe_rate_flags |= VR_FLOW_RATE_ELEPHANT;
+        *slot = hash;
+    } else {
+        fe->fe_rate_flags &= ~VR_FLOW_RATE_ELEPHANT;
+        /* the reverse flow, or another elephant, might still be there */
+        (void)__sync_bool_compare_and_swap(slot, hash, 0);
     }
 
-    if (pkt->vp_nh)
-        return nh_output(vrf, pkt, pkt->vp_nh, fmd);
+    return;
+}
 
-    pkt_set_data(pkt, pkt->vp_network_h);
-    return vr_ip_input(router, vrf, pkt, fmd);
+/*
+ * account a sample of bytes to the flow. the bytes of a second are
+ * compared against the rate at the first sample of the next second, and a
+ * flow that had no samples for a second is not an elephant any more.
+ * the field is not aligned and the samples of cpus that race can be lost,
+ * which is fine for an estimate
+ */
+static void
+vr_flow_rate_sample(struct vr_flow_entry *fe, unsigned int bytes)
+{
+    uint16_t window;
+    unsigned int sec, nsec, rate;
+
+    vr_get_mono_time(&sec, &nsec);
+    window = sec;
+    if (fe->fe_rate_window != window) {
+        rate = fe->fe_rate_bytes;
+        if ((uint16_t)(window - fe->fe_rate_window) != 1)
+            rate = 0;
+
+        fe->fe_rate_window = window;
+        fe->fe_rate_bytes = 0;
+        vr_flow_elephant_set(fe, rate >= vr_flow_elephant_rate);
+    }
+
+    fe->fe_rate_bytes += bytes;
+
+    return;
 }
 
-static int
-vr_flow_nat(unsigned short vrf, struct vr_flow_entry *fe, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+/*
+ * every flow entry has a 16 bit tag, derived from the key hash, in a
+ * separate array (vr_flow_tags/vr_oflow_tags). the tags of a bucket sit
+ * together in 8 bytes, and hence the tags of 8 buckets in a cache line.
+ * a lookup compares the full key only for entries whose tag matches, and
+ * a miss mostly gets resolved without touching the flow entries at all.
+ * tag 0 means that the entry is free.
+ */
+static inline uint16_t
+vr_flow_tag(unsigned int hash)
 {
-    unsigned int ip_inc, inc = 0; 
-    unsigned short *t_sport, *t_dport;
-    struct vrouter *router = pkt->vp_if->vif_router;
-    struct vr_flow_entry *rfe;
-    struct vr_ip *ip;
+    uint16_t tag = hash >> 16;
 
-    if (fe->fe_rflow < 0)
-        goto drop;
+    return tag ? tag : 1;
+}
 
-    rfe = vr_get_flow_entry(router, fe->fe_rflow);
-    if (!rfe)
-        goto drop;
+/*
+ * compare all the four tags of a bucket with one 64 bit operation. we
+ * stay away from SSE, since using the vector unit in the kernel needs
+ * the fpu state to be saved. false positives are possible (they are
+ * resolved by the key compare), false negatives are not.
+ */
+static inline bool
+vr_flow_bucket_has_tag(struct vr_btable *table, unsigned int index,
+        uint16_t tag)
+{
+    uint64_t word;
+    uint16_t *tags;
 
-    ip = (struct vr_ip *)pkt_data(pkt);
+    tags = (uint16_t *)vr_btable_get(table, index);
+    if (!tags)
+        return true;
 
-    if (fe->fe_flags & VR_FLOW_FLAG_SNAT) {
-        vr_incremental_diff(ip->ip_saddr, rfe->fe_key.key_dest_ip, &inc);
-        ip->ip_saddr = rfe->fe_key.key_dest_ip;
-    }
+    memcpy(&word, tags, sizeof(word));
+    word ^= VR_FLOW_TAG_LANES * tag;
 
-    if (fe->fe_flags & VR_FLOW_FLAG_DNAT) {
-        vr_incremental_diff(ip->ip_daddr, rfe->fe_key.key_src_ip, &inc);
-        ip->ip_daddr = rfe->fe_key.key_src_ip;
-    }
+    return ((word - VR_FLOW_TAG_LANES) & ~word & VR_FLOW_TAG_HIGH_BITS) != 0;
+}
 
-    ip_inc = inc;
+/* probed is 0 for an insert that found no room */
+static void
+vr_flow_probe_account(struct vrouter *router, bool insert, unsigned int probed)
+{
+    unsigned int bucket = 0;
+    struct vr_flow_probe_stats *stats;
 
-    if (vr_ip_transport_header_valid(ip)) {
-        t_sport = (unsigned short *)((unsigned char *)ip +
-                (ip->ip_hl * 4));
-        t_dport = t_sport + 1;
+    if (!router->vr_flow_probe_stats)
+        return;
 
-        if (fe->fe_flags & VR_FLOW_FLAG_SPAT) {
-            vr_incremental_diff(*t_sport, rfe->fe_key.key_dst_port, &inc);
-            *t_sport = rfe->fe_key.key_dst_port;
-        }
+    stats = &router->vr_flow_probe_stats[vr_get_cpu()];
+    if (!insert) {
+        while ((probed >>= 1) && (bucket < VR_FLOW_PROBE_BUCKETS - 1))
+            bucket++;
+        stats->fps_lookups[bucket]++;
+        return;
+    }
 
-        if (fe->fe_flags & VR_FLOW_FLAG_DPAT) {
-            vr_incremental_diff(*t_dport, rfe->fe_key.key_src_port, &inc);
-            *t_dport = rfe->fe_key.key_src_port;
-        }
+    if (!probed) {
+        stats->fps_insert_fails++;
+        return;
     }
 
-    if (ip->ip_csum != VR_DIAG_IP_CSUM)
-        vr_ip_update_csum(pkt, ip_inc, inc);
+    if (probed > 2 * VR_FLOW_ENTRIES_PER_BUCKET)
+        stats->fps_oflow_inserts++;
 
-    return vr_flow_forward(vrf, pkt, proto, fmd);
+    while ((probed >>= 1) && (bucket < VR_FLOW_PROBE_BUCKETS - 1))
+        bucket++;
+    stats->fps_inserts[bucket]++;
 
-drop:
-    vr_pfree(pkt, VP_DROP_FLOW_NAT_NO_RFLOW);
-    return 0;
+    return;
 }
 
-static void
-vr_flow_set_forwarding_md(struct vrouter *router, struct vr_flow_entry *fe,
-        unsigned int index, struct vr_forwarding_md *md)
+static struct vr_flow_entry *
+vr_flow_table_get_free(struct vr_btable *table, struct vr_btable *tags,
+        unsigned int table_size, unsigned int start, unsigned int probes,
+        uint16_t tag, unsigned int *fe_index, unsigned int *probed)
 {
-    struct vr_flow_entry *rfe;
+    unsigned int i, index;
+    uint16_t *fe_tag;
+    struct vr_flow_entry *fe;
 
-    md->fmd_flow_index = index;
-    md->fmd_ecmp_nh_index = fe->fe_ecmp_nh_index;
-    if (fe->fe_flags & VR_RFLOW_VALID) {
-        rfe = vr_get_flow_entry(router, fe->fe_rflow);
-        if (rfe)
-            md->fmd_ecmp_src_nh_index = rfe->fe_ecmp_nh_index;
+    for (i = 0; i < probes; i++) {
+        index = (start + i) % table_size;
+        fe = (struct vr_flow_entry *)vr_btable_fill(table, index);
+        if (fe && !(fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
+            if (vr_set_flow_active(fe)) {
+                vr_init_flow_entry(fe);
+                fe_tag = (uint16_t *)vr_btable_get(tags, index);
+                if (fe_tag)
+                    *fe_tag = tag;
+                *fe_index = index;
+                *probed += i + 1;
+                return fe;
+            }
+        }
     }
 
-    return;
+    *probed += probes;
+    return NULL;
 }
 
-static int
-vr_flow_action(struct vrouter *router, struct vr_flow_entry *fe, 
-        unsigned int index, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+static struct vr_flow_entry *
+vr_flow_main_table_get_free(struct vr_btable *table, struct vr_btable *tags,
+        unsigned int entries, unsigned int shard, unsigned int shards,
+        unsigned int hash, unsigned int alt_hash, uint16_t tag,
+        unsigned int *index, unsigned int *probed)
 {
-    int ret = 0, valid_src;
-    unsigned short vrf;
-    struct vr_forwarding_md mirror_fmd;
-    struct vr_nexthop *src_nh;
+    struct vr_flow_entry *fe;
 
-    vrf = fe->fe_key.key_vrf_id;
-    if (fe->fe_flags & VR_FLOW_FLAG_VRFT)
-        vrf = fe->fe_dvrf;
+    fe = vr_flow_table_get_free(table, tags, entries,
+            vr_flow_shard_bucket_index(hash, shard, entries, shards),
+            VR_FLOW_ENTRIES_PER_BUCKET, tag, index, probed);
+    if (!fe)
+        fe = vr_flow_table_get_free(table, tags, entries,
+                vr_flow_shard_bucket_index(alt_hash, shard, entries, shards),
+                VR_FLOW_ENTRIES_PER_BUCKET, tag, index, probed);
 
-    vr_flow_set_forwarding_md(router, fe, index, fmd);
-    src_nh = __vrouter_get_nexthop(router, fe->fe_src_nh_index);
-    if (!src_nh) {
-        vr_pfree(pkt, VP_DROP_INVALID_NH);
-        return 0;
-    }
+    return fe;
+}
 
-    if (src_nh->nh_validate_src) {
-        valid_src = src_nh->nh_validate_src(vrf, pkt, src_nh, fmd);
-        if (valid_src == NH_SOURCE_INVALID) {
-            vr_pfree(pkt, VP_DROP_INVALID_SOURCE);
-            return 0;
-        }
+static struct vr_flow_entry *
+vr_find_free_entry(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int hash, unsigned int *fe_index)
+{
+    unsigned int index = 0, alt_hash, probed = 0;
+    uint16_t tag;
+    struct vr_flow_entry *fe;
+    struct vr_flow_resize *resize;
 
-#if 0
-        if (valid_src == NH_SOURCE_MISMATCH)
-            return vr_trap(pkt, vrf,
-                    AGENT_TRAP_SOURCE_MISMATCH, &fmd->fmd_flow_index);
-#else
-        if (valid_src == NH_SOURCE_MISMATCH)
-            return vr_trap(pkt, vrf,
-                    AGENT_TRAP_ECMP_RESOLVE, &fmd->fmd_flow_index);
-#endif
+    *fe_index = 0;
+    tag = vr_flow_tag(hash);
+    hash = vr_flow_place_hash(hash);
+    alt_hash = vr_flow_alt_hash(hash);
+
+    /* while resizing, new entries go only to the new table */
+    resize = router->vr_flow_resize;
+    if (resize) {
+        fe = vr_flow_main_table_get_free(resize->vfr_table, resize->vfr_tags,
+                resize->vfr_entries, 0, 1, hash, alt_hash, tag, &index,
+                &probed);
+        if (fe)
+            *fe_index = resize->vfr_base;
+    } else {
+        fe = vr_flow_main_table_get_free(router->vr_flow_table,
+                router->vr_flow_tags, vr_flow_entries,
+                vr_flow_key_shard(key, vr_flow_nshards), vr_flow_nshards,
+                hash, alt_hash, tag, &index, &probed);
     }
 
+    if (!fe) {
+        fe = vr_flow_table_get_free(router->vr_oflow_table,
+                router->vr_oflow_tags, vr_oflow_entries,
+                hash % vr_oflow_entries, VR_OFLOW_PROBE_LIMIT, tag, &index,
+                &probed);
+        if (!fe)
+            fe = vr_flow_table_get_free(router->vr_oflow_table,
+                    router->vr_oflow_tags, vr_oflow_entries,
+                    alt_hash % vr_oflow_entries, VR_OFLOW_PROBE_LIMIT,
+                    tag, &index, &probed);
+        if (fe)
+            *fe_index += vr_flow_entries;
+    }
 
-    if (fe->fe_flags & VR_FLOW_FLAG_MIRROR) {
-        if (fe->fe_mirror_id < VR_MAX_MIRROR_INDICES) {
-            mirror_fmd = *fmd;
-            mirror_fmd.fmd_ecmp_nh_index = -1;
-            vr_mirror(router, fe->fe_mirror_id, pkt, &mirror_fmd);
-        }
-        if (fe->fe_sec_mirror_id < VR_MAX_MIRROR_INDICES) {
-            mirror_fmd = *fmd;
-            mirror_fmd.fmd_ecmp_nh_index = -1;
-            vr_mirror(router, fe->fe_sec_mirror_id, pkt, &mirror_fmd);
-        }
+    if (fe) {
+        *fe_index += index;
+        memcpy(&fe->fe_key, key, sizeof(*key));
+        vr_flow_hit(router, *fe_index);
     }
 
-    switch (fe->fe_action) {
-    case VR_FLOW_ACTION_DROP:
-        vr_pfree(pkt, VP_DROP_FLOW_ACTION_DROP);
-        break;
+    vr_flow_probe_account(router, true, fe ? probed : 0);
 
-    case VR_FLOW_ACTION_FORWARD:
-        ret = vr_flow_forward(vrf, pkt, proto, fmd);
-        break;
+    return fe;
+}
 
-    case VR_FLOW_ACTION_NAT:
-        ret = vr_flow_nat(vrf, fe, pkt, proto, fmd);
-        break;
+static inline struct vr_flow_entry *
+vr_flow_table_lookup(struct vr_flow_key *key, struct vr_btable *table,
+                struct vr_btable *tags, unsigned int table_size,
+                unsigned int start, unsigned int probes, uint16_t tag,
+                unsigned int *fe_index, unsigned int *probed)
+{
+    unsigned int i, index;
+    uint16_t *fe_tag;
+    struct vr_flow_entry *flow_e;
 
-    default:
-        vr_pfree(pkt, VP_DROP_FLOW_ACTION_INVALID);
-        break;
+    for (i = 0; i < probes; i++) {
+        index = (start + i) % table_size;
+        fe_tag = (uint16_t *)vr_btable_get(tags, index);
+        if (fe_tag && *fe_tag != tag)
+            continue;
+
+        flow_e = (struct vr_flow_entry *)vr_btable_get(table, index);
+        if (flow_e && flow_e->fe_flags & VR_FLOW_FLAG_ACTIVE) {
+            if (!memcmp(&flow_e->fe_key, key, sizeof(*key))) {
+                *fe_index = index;
+                *probed += i + 1;
+                return flow_e;
+            }
+        }
     }
 
-    return ret;
+    *probed += probes;
+    return NULL;
 }
 
-
-unsigned int
-vr_trap_flow(struct vrouter *router, struct vr_flow_entry *fe,
-        struct vr_packet *pkt, unsigned int index)
+/*
+ * bring in the bucket that a hash maps to, so that by the time the actual
+ * lookup happens (for a batch of packets), the entries are in the cache
+ */
+static inline void
+vr_flow_prefetch_bucket(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int hash)
 {
-    unsigned int trap_reason;
-    struct vr_packet *npkt;
+    unsigned int index;
+    uint16_t *tags;
+    struct vr_flow_entry *fe;
 
-    npkt = vr_pclone(pkt);
-    if (!npkt)
-        return -ENOMEM;
+    index = vr_flow_shard_bucket_index(vr_flow_place_hash(hash),
+            vr_flow_key_shard(key, vr_flow_nshards), vr_flow_entries,
+            vr_flow_nshards);
+    tags = (uint16_t *)vr_btable_get(router->vr_flow_tags, index);
+    if (tags)
+        vr_prefetch(tags);
 
-    vr_preset(npkt);
+    fe = vr_flow_table_entry_get(router, index);
+    if (fe)
+        vr_prefetch(fe);
 
-    switch (fe->fe_flags & VR_FLOW_FLAG_TRAP_MASK) {
-    case VR_FLOW_FLAG_TRAP_ECMP:
-        trap_reason = AGENT_TRAP_ECMP_RESOLVE;
-        break;
+    return;
+}
+
+static struct vr_flow_entry *
+vr_flow_main_table_lookup(struct vr_flow_key *key, struct vr_btable *table,
+        struct vr_btable *tags, unsigned int entries, unsigned int shards,
+        unsigned int hash, unsigned int alt_hash, uint16_t tag,
+        unsigned int *fe_index, unsigned int *probed)
+{
+    unsigned int index, shard;
+    struct vr_flow_entry *flow_e = NULL;
+
+    shard = vr_flow_key_shard(key, shards);
+    index = vr_flow_shard_bucket_index(hash, shard, entries, shards);
+    if (vr_flow_bucket_has_tag(tags, index, tag))
+        flow_e = vr_flow_table_lookup(key, table, tags, entries, index,
+                VR_FLOW_ENTRIES_PER_BUCKET, tag, fe_index, probed);
+    else
+        *probed += VR_FLOW_ENTRIES_PER_BUCKET;
+
+    if (!flow_e) {
+        index = vr_flow_shard_bucket_index(alt_hash, shard, entries, shards);
+        if (vr_flow_bucket_has_tag(tags, index, tag))
+            flow_e = vr_flow_table_lookup(key, table, tags, entries, index,
+                    VR_FLOW_ENTRIES_PER_BUCKET, tag, fe_index, probed);
+        else
+            *probed += VR_FLOW_ENTRIES_PER_BUCKET;
+    }
+
+    return flow_e;
+}
+
+static struct vr_flow_entry *
+__vr_find_flow(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int hash, unsigned int *fe_index)
+{
+    unsigned int alt_hash, probed = 0;
+    uint16_t tag;
+    struct vr_flow_entry *flow_e = NULL;
+    struct vr_flow_resize *resize = router->vr_flow_resize;
+
+    tag = vr_flow_tag(hash);
+    hash = vr_flow_place_hash(hash);
+    alt_hash = vr_flow_alt_hash(hash);
+
+    /* while resizing, the new table has the most recent entries */
+    if (resize) {
+        flow_e = vr_flow_main_table_lookup(key, resize->vfr_table,
+                resize->vfr_tags, resize->vfr_entries, 1, hash, alt_hash,
+                tag, fe_index, &probed);
+        if (flow_e) {
+            *fe_index += resize->vfr_base;
+            vr_flow_probe_account(router, false, probed);
+            return flow_e;
+        }
+        probed = 0;
+    }
+
+    /* first look in the two candidate buckets of the regular flow table */
+    flow_e = vr_flow_main_table_lookup(key, router->vr_flow_table,
+            router->vr_flow_tags, vr_flow_entries, vr_flow_nshards, hash,
+            alt_hash, tag, fe_index, &probed);
+
+    /* if not in the regular flow table, lookup in the overflow flow table */
+    if (!flow_e) {
+        flow_e = vr_flow_table_lookup(key, router->vr_oflow_table,
+                router->vr_oflow_tags, vr_oflow_entries,
+                hash % vr_oflow_entries, VR_OFLOW_PROBE_LIMIT, tag, fe_index,
+                &probed);
+        if (!flow_e)
+            flow_e = vr_flow_table_lookup(key, router->vr_oflow_table,
+                    router->vr_oflow_tags, vr_oflow_entries,
+                    alt_hash % vr_oflow_entries, VR_OFLOW_PROBE_LIMIT,
+                    tag, fe_index, &probed);
+        *fe_index += vr_flow_entries;
+    }
+
+    if (flow_e)
+        vr_flow_probe_account(router, false, probed);
+
+    return flow_e;
+}
+
+struct vr_flow_entry *
+vr_find_flow(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int *fe_index)
+{
+    return __vr_find_flow(router, key, vr_flow_hash(key), fe_index);
+}
+
+static inline struct vr_flow_cache_entry *
+vr_flow_cache_slot(struct vrouter *router, struct vr_flow_key *key)
+{
+    uint32_t words[sizeof(*key) / sizeof(uint32_t)], fold;
+
+    memcpy(words, key, sizeof(words));
+    fold = words[0] ^ words[1] ^ words[2] ^ words[3];
+    fold ^= fold >> 16;
+    fold ^= fold >> 8;
+
+    return &router->vr_flow_cache[vr_get_cpu()].fc_entry[fold %
+        VR_FLOW_CACHE_SLOTS];
+}
+
+static struct vr_flow_entry *
+vr_flow_cache_lookup(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int *fe_index)
+{
+    struct vr_flow_cache *cache;
+    struct vr_flow_cache_entry *entry;
+    struct vr_flow_entry *fe = NULL;
+
+    if (!router->vr_flow_cache)
+        return NULL;
+
+    cache = &router->vr_flow_cache[vr_get_cpu()];
+    entry = vr_flow_cache_slot(router, key);
+    if (entry->fce_gen == router->vr_flow_cache_gen)
+        fe = vr_get_flow_entry(router, entry->fce_index);
+
+    if (fe && (fe->fe_flags & VR_FLOW_FLAG_ACTIVE) &&
+            !memcmp(&fe->fe_key, key, sizeof(*key))) {
+        cache->fc_hits++;
+        *fe_index = entry->fce_index;
+        return fe;
+    }
+
+    cache->fc_misses++;
+    return NULL;
+}
+
+static inline void
+vr_flow_cache_update(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int index)
+{
+    struct vr_flow_cache_entry *entry;
+
+    if (!router->vr_flow_cache)
+        return;
+
+    entry = vr_flow_cache_slot(router, key);
+    entry->fce_index = index;
+    entry->fce_gen = router->vr_flow_cache_gen;
+
+    return;
+}
+
+static void
+vr_flow_cache_stats(struct vrouter *router, vr_flow_req *req)
+{
+    unsigned int cpu;
+
+    if (!router->vr_flow_cache)
+        return;
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        req->fr_cache_hits += router->vr_flow_cache[cpu].fc_hits;
+        req->fr_cache_misses += router->vr_flow_cache[cpu].fc_misses;
+    }
+
+    return;
+}
+
+static inline uint32_t
+vr_flow_usecs(void)
+{
+    unsigned int sec, nsec;
+
+    vr_get_time(&sec, &nsec);
+    return sec * 1000000 + nsec / 1000;
+}
+
+static void
+vr_flow_setup_account(struct vrouter *router, struct vr_flow_entry *fe)
+{
+    unsigned int bucket = 0;
+    uint32_t latency;
+
+    if (!router->vr_flow_setup_stats)
+        return;
+
+    latency = vr_flow_usecs() - fe->fe_hold_stamp;
+    while ((latency >>= 1) && (bucket < VR_FLOW_SETUP_BUCKETS - 1))
+        bucket++;
+
+    router->vr_flow_setup_stats[vr_get_cpu()].fss_latency[bucket]++;
+    return;
+}
+
+static int
+vr_flow_setup_stats_get(struct vrouter *router, vr_flow_req *req)
+{
+    unsigned int cpu, i;
+    struct vr_flow_setup_stats *stats;
+
+    if (!router->vr_flow_setup_stats)
+        return 0;
+
+    req->fr_hold_latency = vr_zalloc(VR_FLOW_SETUP_BUCKETS *
+            sizeof(*req->fr_hold_latency));
+    if (!req->fr_hold_latency)
+        return -ENOMEM;
+    req->fr_hold_latency_size = VR_FLOW_SETUP_BUCKETS;
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        stats = &router->vr_flow_setup_stats[cpu];
+        for (i = 0; i < VR_FLOW_SETUP_BUCKETS; i++)
+            req->fr_hold_latency[i] += stats->fss_latency[i];
+        req->fr_hold_queue_overflows += stats->fss_queue_overflows;
+    }
+
+    return 0;
+}
+
+/* the entries in use of a table, by its tags */
+static unsigned int
+vr_flow_tags_used(struct vr_btable *tags, unsigned int entries)
+{
+    unsigned int i, used = 0;
+    uint16_t *tag;
+
+    if (!tags)
+        return 0;
+
+    for (i = 0; i < entries; i++) {
+        tag = (uint16_t *)vr_btable_get(tags, i);
+        if (tag && *tag)
+            used++;
+    }
+
+    return used;
+}
+
+static int
+vr_flow_probe_stats_get(struct vrouter *router, vr_flow_req *req)
+{
+    unsigned int cpu, i;
+    struct vr_flow_probe_stats *stats;
+
+    req->fr_ftable_entries = vr_flow_entries;
+    req->fr_oflow_entries = vr_oflow_entries;
+    /* while resizing, the entries are on their way to the new table */
+    if (!router->vr_flow_resize) {
+        req->fr_ftable_used = vr_flow_tags_used(router->vr_flow_tags,
+                vr_flow_entries);
+        req->fr_oflow_used = vr_flow_tags_used(router->vr_oflow_tags,
+                vr_oflow_entries);
+    }
+
+    if (!router->vr_flow_probe_stats)
+        return 0;
+
+    req->fr_lookup_probes = vr_zalloc(VR_FLOW_PROBE_BUCKETS *
+            sizeof(*req->fr_lookup_probes));
+    req->fr_insert_probes = vr_zalloc(VR_FLOW_PROBE_BUCKETS *
+            sizeof(*req->fr_insert_probes));
+    if (!req->fr_lookup_probes || !req->fr_insert_probes)
+        return -ENOMEM;
+    req->fr_lookup_probes_size = VR_FLOW_PROBE_BUCKETS;
+    req->fr_insert_probes_size = VR_FLOW_PROBE_BUCKETS;
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        stats = &router->vr_flow_probe_stats[cpu];
+        for (i = 0; i < VR_FLOW_PROBE_BUCKETS; i++) {
+            req->fr_lookup_probes[i] += stats->fps_lookups[i];
+            req->fr_insert_probes[i] += stats->fps_inserts[i];
+        }
+        req->fr_oflow_inserts += stats->fps_oflow_inserts;
+        req->fr_insert_fails += stats->fps_insert_fails;
+    }
+
+    return 0;
+}
+
+static inline bool
+vr_flow_queue_is_empty(struct vrouter *router, struct vr_flow_entry *fe)
+{
+    if (fe->fe_hold_list.node_p)
+        return false;
+    return true;
+}
+
+
+static struct vr_packet_node *
+vr_flow_hold_node_alloc(struct vrouter *router)
+{
+    struct vr_flow_hold_pool *pool;
+    struct vr_flow_hold_node *node;
+
+    if (!router->vr_flow_hold_pool)
+        return NULL;
+
+    pool = &router->vr_flow_hold_pool[vr_get_cpu()];
+    do {
+        node = pool->fhp_free;
+        if (!node)
+            return NULL;
+    } while (!__sync_bool_compare_and_swap(&pool->fhp_free, node,
+                node->fhn_next));
+
+    memset(&node->fhn_pnode, 0, sizeof(node->fhn_pnode));
+    return &node->fhn_pnode;
+}
+
+static void
+vr_flow_hold_node_free(struct vrouter *router, struct vr_packet_node *pnode)
+{
+    struct vr_flow_hold_pool *pool;
+    struct vr_flow_hold_node *head, *node = (struct vr_flow_hold_node *)pnode;
+
+    pool = &router->vr_flow_hold_pool[node->fhn_cpu];
+    do {
+        head = pool->fhp_free;
+        node->fhn_next = head;
+    } while (!__sync_bool_compare_and_swap(&pool->fhp_free, head, node));
+
+    return;
+}
+
+static int
+vr_enqueue_flow(struct vr_flow_entry *fe, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    unsigned int i = 0;
+    unsigned short drop_reason = 0;
+    struct vrouter *router;
+    struct vr_list_node **head = &fe->fe_hold_list.node_p;
+    struct vr_packet_node *pnode;
+
+    while (*head && ++i) {
+        head = &(*head)->node_n;
+    }
+
+    if (i >= VR_MAX_FLOW_QUEUE_ENTRIES) {
+        router = pkt->vp_if->vif_router;
+        if (router->vr_flow_setup_stats)
+            router->vr_flow_setup_stats[vr_get_cpu()].fss_queue_overflows++;
+        drop_reason = VP_DROP_FLOW_QUEUE_LIMIT_EXCEEDED;
+        goto drop;
+    }
+
+    pnode = vr_flow_hold_node_alloc(pkt->vp_if->vif_router);
+    if (!pnode) {
+        drop_reason = VP_DROP_FLOW_QUEUE_POOL_EMPTY;
+        goto drop;
+    }
+
+    pnode->pl_packet = pkt;
+    pnode->pl_proto = proto;
+    if (fmd)
+        pnode->pl_outer_src_ip = vr_fmd_outer_src_ip(fmd);
+    *head = &pnode->pl_node;
+
+    return 0;
+
+drop:
+    vr_pfree(pkt, drop_reason);
+    return 0;
+}
+
+static int
+vr_flow_forward(unsigned short vrf, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    struct vr_interface *vif = pkt->vp_if;
+    struct vrouter *router = vif->vif_router;
+
+    if (proto != VR_ETH_PROTO_IP) {
+        vr_pfree(pkt, VP_DROP_FLOW_INVALID_PROTOCOL);
+        return 0;
+    }
+
+    if (pkt->vp_nh)
+        return nh_output(vrf, pkt, pkt->vp_nh, fmd);
+
+    pkt_set_data(pkt, pkt->vp_network_h);
+    return vr_ip_input(router, vrf, pkt, fmd);
+}
+
+static struct vr_btable *
+vr_flow_nh_cache_alloc(unsigned int entries)
+{
+    unsigned int i;
+    struct vr_btable *table;
+    struct vr_flow_nh_cache *cache;
+
+    table = vr_btable_alloc(entries, sizeof(struct vr_flow_nh_cache));
+    if (!table)
+        return NULL;
+
+    for (i = 0; i < entries; i++) {
+        cache = (struct vr_flow_nh_cache *)vr_btable_get(table, i);
+        cache->fnc_gen = 0;
+    }
+
+    return table;
+}
+
+/*
+ * vr_flow_forward for packets of a flow, with the route lookup result
+ * remembered in vr_flow_nh_cache (see struct vr_flow_nh_cache)
+ */
+static int
+vr_flow_forward_cached(struct vrouter *router, unsigned short vrf,
+        struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    uint32_t gen, cache_gen, nh_id, cache_vrf;
+    int32_t label;
+    struct vr_ip *ip;
+    struct vr_nexthop *nh = NULL;
+    struct vr_route_req rt;
+    struct vr_flow_nh_cache *cache = NULL;
+
+    if (router->vr_flow_nh_cache && vr_inet_vrf_gen &&
+            proto == VR_ETH_PROTO_IP && !pkt->vp_nh &&
+            !(pkt->vp_flags & VP_FLAG_MULTICAST) && fmd->fmd_flow_index >= 0)
+        cache = (struct vr_flow_nh_cache *)
+            vr_btable_get(router->vr_flow_nh_cache, fmd->fmd_flow_index);
+
+    if (!cache)
+        return vr_flow_forward(vrf, pkt, proto, fmd);
+
+    pkt_set_data(pkt, pkt->vp_network_h);
+    ip = (struct vr_ip *)pkt_data(pkt);
+    if (ip->ip_version != 4 || ip->ip_hl < 5) {
+        vr_pfree(pkt, VP_DROP_INVALID_PROTOCOL);
+        return 0;
+    }
+
+    gen = vr_inet_vrf_gen(vrf);
+    if (!gen)
+        return vr_ip_input(router, vrf, pkt, fmd);
+
+    cache_gen = cache->fnc_gen;
+    if (cache_gen == gen) {
+        __sync_synchronize();
+        nh_id = cache->fnc_nh_id;
+        label = cache->fnc_label;
+        cache_vrf = cache->fnc_vrf;
+        __sync_synchronize();
+        if (cache->fnc_gen == cache_gen && cache_vrf == vrf) {
+            nh = __vrouter_get_nexthop(router, nh_id);
+            if (nh && label >= 0)
+                fmd->fmd_label = label;
+        }
+    }
+
+    if (!nh) {
+        rt.rtr_req.rtr_vrf_id = vrf;
+        rt.rtr_req.rtr_prefix = ntohl(ip->ip_daddr);
+        rt.rtr_req.rtr_prefix_len = 32;
+        rt.rtr_req.rtr_nh_id = 0;
+        rt.rtr_req.rtr_label_flags = 0;
+
+        nh = vr_inet_route_lookup(vrf, &rt, pkt);
+        if (!nh)
+            return vr_ip_input(router, vrf, pkt, fmd);
+
+        label = -1;
+        if (rt.rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG) {
+            label = rt.rtr_req.rtr_label;
+            fmd->fmd_label = label;
+        }
+
+        if (cache_gen != VR_FLOW_NH_CACHE_BUSY &&
+                __sync_bool_compare_and_swap(&cache->fnc_gen, cache_gen,
+                    VR_FLOW_NH_CACHE_BUSY)) {
+            cache->fnc_nh_id = nh->nh_id;
+            cache->fnc_label = label;
+            cache->fnc_vrf = vrf;
+            __sync_synchronize();
+            cache->fnc_gen = gen;
+        }
+    }
+
+    pkt->vp_type = VP_TYPE_IP;
+    return nh_output(vrf, pkt, nh, fmd);
+}
+
+static int
+vr_flow_nat(unsigned short vrf, struct vr_flow_entry *fe, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    unsigned int ip_inc, inc = 0; 
+    unsigned short *t_sport, *t_dport;
+    struct vrouter *router = pkt->vp_if->vif_router;
+    struct vr_flow_entry *rfe;
+    struct vr_ip *ip;
+
+    if (fe->fe_rflow < 0)
+        goto drop;
+
+    rfe = vr_get_flow_entry(router, fe->fe_rflow);
+    if (!rfe)
+        goto drop;
+
+    ip = (struct vr_ip *)pkt_data(pkt);
+
+    if (fe->fe_flags & VR_FLOW_FLAG_SNAT) {
+        vr_incremental_diff(ip->ip_saddr, rfe->fe_key.key_dest_ip, &inc);
+        ip->ip_saddr = rfe->fe_key.key_dest_ip;
+    }
+
+    if (fe->fe_flags & VR_FLOW_FLAG_DNAT) {
+        vr_incremental_diff(ip->ip_daddr, rfe->fe_key.key_src_ip, &inc);
+        ip->ip_daddr = rfe->fe_key.key_src_ip;
+    }
+
+    ip_inc = inc;
+
+    if (vr_ip_transport_header_valid(ip)) {
+        t_sport = (unsigned short *)pkt_transport_header(pkt, ip);
+        t_dport = t_sport + 1;
+
+        if (fe->fe_flags & VR_FLOW_FLAG_SPAT) {
+            vr_incremental_diff(*t_sport, rfe->fe_key.key_dst_port, &inc);
+            *t_sport = rfe->fe_key.key_dst_port;
+        }
+
+        if (fe->fe_flags & VR_FLOW_FLAG_DPAT) {
+            vr_incremental_diff(*t_dport, rfe->fe_key.key_src_port, &inc);
+            *t_dport = rfe->fe_key.key_src_port;
+        }
+    }
+
+    if (ip->ip_csum != VR_DIAG_IP_CSUM)
+        vr_ip_update_csum(pkt, ip_inc, inc);
+
+    return vr_flow_forward_cached(router, vrf, pkt, proto, fmd);
+
+drop:
+    vr_pfree(pkt, VP_DROP_FLOW_NAT_NO_RFLOW);
+    return 0;
+}
+
+static void
+vr_flow_set_forwarding_md(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index, struct vr_forwarding_md *md)
+{
+    struct vr_flow_entry *rfe;
+
+    md->fmd_flow_index = index;
+    vr_fmd_set_ecmp_nh_index(md, fe->fe_ecmp_nh_index);
+    if (fe->fe_flags & VR_RFLOW_VALID) {
+        rfe = vr_get_flow_entry(router, fe->fe_rflow);
+        if (rfe)
+            vr_fmd_set_ecmp_src_nh_index(md, rfe->fe_ecmp_nh_index);
+    }
+
+    return;
+}
+
+static int
+vr_flow_action(struct vrouter *router, struct vr_flow_entry *fe, 
+        unsigned int index, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    int ret = 0, valid_src;
+    unsigned short vrf;
+    struct vr_forwarding_md mirror_fmd;
+    struct vr_nexthop *src_nh;
+
+    vrf = fe->fe_key.key_vrf_id;
+    if (fe->fe_flags & VR_FLOW_FLAG_VRFT)
+        vrf = fe->fe_dvrf;
+
+    vr_flow_set_forwarding_md(router, fe, index, fmd);
+    src_nh = __vrouter_get_nexthop(router, fe->fe_src_nh_index);
+    if (!src_nh) {
+        vr_pfree(pkt, VP_DROP_INVALID_NH);
+        return 0;
+    }
+
+    if (src_nh->nh_validate_src) {
+        valid_src = src_nh->nh_validate_src(vrf, pkt, src_nh, fmd);
+        if (valid_src == NH_SOURCE_INVALID) {
+            vr_pfree(pkt, VP_DROP_INVALID_SOURCE);
+            return 0;
+        }
+
+#if 0
+        if (valid_src == NH_SOURCE_MISMATCH)
+            return vr_trap(pkt, vrf,
+                    AGENT_TRAP_SOURCE_MISMATCH, &fmd->fmd_flow_index);
+#else
+        if (valid_src == NH_SOURCE_MISMATCH)
+            return vr_trap(pkt, vrf,
+                    AGENT_TRAP_ECMP_RESOLVE, &fmd->fmd_flow_index);
+#endif
+    }
+
+
+    if (fe->fe_flags & VR_FLOW_FLAG_MIRROR) {
+        if (fe->fe_mirror_id < VR_MAX_MIRROR_INDICES) {
+            mirror_fmd = *fmd;
+            vr_fmd_set_ecmp_nh_index(&mirror_fmd, -1);
+            vr_mirror(router, fe->fe_mirror_id, pkt, &mirror_fmd);
+        }
+        if (fe->fe_sec_mirror_id < VR_MAX_MIRROR_INDICES) {
+            mirror_fmd = *fmd;
+            vr_fmd_set_ecmp_nh_index(&mirror_fmd, -1);
+            vr_mirror(router, fe->fe_sec_mirror_id, pkt, &mirror_fmd);
+        }
+    }
+
+    switch (fe->fe_action) {
+    case VR_FLOW_ACTION_DROP:
+        vr_pfree(pkt, VP_DROP_FLOW_ACTION_DROP);
+        break;
+
+    case VR_FLOW_ACTION_FORWARD:
+        ret = vr_flow_forward_cached(router, vrf, pkt, proto, fmd);
+        break;
+
+    case VR_FLOW_ACTION_NAT:
+        ret = vr_flow_nat(vrf, fe, pkt, proto, fmd);
+        break;
+
+    default:
+        vr_pfree(pkt, VP_DROP_FLOW_ACTION_INVALID);
+        break;
+    }
+
+    return ret;
+}
+
+static bool
+vr_flow_miss_trap_allowed(struct vr_interface *vif)
+{
+    unsigned int sec, nsec, credit, new_credit, max_credit;
+    uint64_t now, stamp, earned;
+
+    if (!vr_flow_miss_trap_rate || !vif)
+        return true;
+
+    vr_get_mono_time(&sec, &nsec);
+    now = (uint64_t)sec * 1000 + nsec / 1000000;
+    max_credit = (vr_flow_miss_trap_burst ? vr_flow_miss_trap_burst : 1) *
+        VR_FLOW_MISS_CREDIT_UNIT;
+
+    /* only the cpu that moves the stamp forward adds the earned credit */
+    stamp = vif->vif_miss_stamp;
+    if (now != stamp &&
+            __sync_bool_compare_and_swap(&vif->vif_miss_stamp, stamp, now)) {
+        earned = (now - stamp) * vr_flow_miss_trap_rate;
+        do {
+            credit = vif->vif_miss_credit;
+            if (earned >= max_credit - credit)
+                new_credit = max_credit;
+            else
+                new_credit = credit + earned;
+        } while (!__sync_bool_compare_and_swap(&vif->vif_miss_credit,
+                    credit, new_credit));
+    }
+
+    do {
+        credit = vif->vif_miss_credit;
+        if (credit < VR_FLOW_MISS_CREDIT_UNIT)
+            return false;
+    } while (!__sync_bool_compare_and_swap(&vif->vif_miss_credit,
+                credit, credit - VR_FLOW_MISS_CREDIT_UNIT));
+
+    return true;
+}
+
+static bool
+vr_flow_miss_batch_add(struct vr_flow_miss_batch *batch, unsigned int index)
+{
+    unsigned int slot;
+
+    slot = __sync_fetch_and_add(&batch->fmb_head, 1) %
+        VR_FLOW_MISS_BATCH_SLOTS;
+    return __sync_bool_compare_and_swap(&batch->fmb_index[slot], -1,
+            (int)index);
+}
+
+static void
+vr_flow_miss_batch_flush(void *arg)
+{
+    int index;
+    unsigned int i, count = 0, head_space;
+    uint32_t *indices = NULL;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_flow_miss_batch *batch = router->vr_flow_miss_batch;
+    struct vr_packet *pkt = NULL;
+
+    if (!batch || !router->vr_agent_if)
+        return;
+
+    head_space = sizeof(struct vr_eth) + sizeof(struct agent_hdr);
+    for (i = 0; i < VR_FLOW_MISS_BATCH_SLOTS; i++) {
+        if (batch->fmb_index[i] < 0)
+            continue;
+
+        if (!pkt) {
+            pkt = vr_palloc(head_space +
+                    VR_FLOW_MISS_BATCH_SLOTS * sizeof(uint32_t));
+            /* try again on the next run */
+            if (!pkt)
+                return;
+
+            pkt->vp_data += head_space;
+            pkt->vp_tail += head_space;
+            indices = (uint32_t *)pkt_data(pkt);
+        }
+
+        index = __sync_lock_test_and_set(&batch->fmb_index[i], -1);
+        if (index >= 0)
+            indices[count++] = htonl(index);
+    }
+
+    if (!pkt)
+        return;
+
+    if (!count) {
+        vr_pfree(pkt, VP_DROP_MISC);
+        return;
+    }
+
+    pkt_pull_tail(pkt, count * sizeof(uint32_t));
+    pkt->vp_if = router->vr_agent_if;
+    vr_trap(pkt, 0, AGENT_TRAP_FLOW_MISS_BATCH, &count);
+
+    return;
+}
+
+static void
+vr_flow_miss_batch_exit(struct vrouter *router)
+{
+    struct vr_flow_miss_batch *batch = router->vr_flow_miss_batch;
+
+    if (!batch)
+        return;
+
+    if (batch->fmb_timer) {
+        vr_delete_timer(batch->fmb_timer);
+        vr_free(batch->fmb_timer);
+    }
+
+    router->vr_flow_miss_batch = NULL;
+    vr_free(batch);
+
+    return;
+}
+
+static int
+vr_flow_miss_batch_init(struct vrouter *router)
+{
+    unsigned int i;
+    struct vr_flow_miss_batch *batch;
+
+    if (router->vr_flow_miss_batch || !vr_flow_miss_coalesce_msecs)
+        return 0;
+
+    batch = vr_zalloc(sizeof(*batch));
+    if (!batch)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                sizeof(*batch));
+
+    for (i = 0; i < VR_FLOW_MISS_BATCH_SLOTS; i++)
+        batch->fmb_index[i] = -1;
+    router->vr_flow_miss_batch = batch;
+
+    batch->fmb_timer = vr_zalloc(sizeof(*batch->fmb_timer));
+    if (!batch->fmb_timer)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+
+    batch->fmb_timer->vt_timer = vr_flow_miss_batch_flush;
+    batch->fmb_timer->vt_vr_arg = router;
+    batch->fmb_timer->vt_msecs = vr_flow_miss_coalesce_msecs;
+    if (vr_create_timer(batch->fmb_timer)) {
+        vr_free(batch->fmb_timer);
+        batch->fmb_timer = NULL;
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * a hashing ecmp nexthop picked the member of the flow. keep it in the
+ * flow so that the next packets take it directly, and tell the agent
+ */
+void
+vr_flow_ecmp_select(struct vrouter *router, int index, unsigned int member)
+{
+    struct vr_flow_entry *fe;
+
+    fe = vr_get_flow_entry(router, index);
+    if (!fe || !(fe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+        return;
+
+    if (fe->fe_ecmp_nh_index == (int8_t)member)
+        return;
+
+    fe->fe_ecmp_nh_index = member;
+    vr_flow_changed(router, index);
+    vr_flow_event_post(router, VR_FLOW_EVENT_ECMP_SELECT, index,
+            fe->fe_key.key_vrf_id, 0, member);
+
+    return;
+}
+
+unsigned int
+vr_trap_flow(struct vrouter *router, struct vr_flow_entry *fe,
+        struct vr_packet *pkt, unsigned int index)
+{
+    unsigned int trap_reason, event;
+    struct vr_packet *npkt;
+
+    if (router->vr_flow_event_table) {
+        if (fe->fe_flags & VR_FLOW_FLAG_TRAP_ECMP)
+            event = VR_FLOW_EVENT_ECMP_RESOLVE;
+        else
+            event = VR_FLOW_EVENT_MISS;
+
+        if (vr_flow_event_post(router, event, index, fe->fe_key.key_vrf_id,
+                    pkt->vp_if ? pkt->vp_if->vif_idx : 0, 0))
+            return 0;
+    }
+
+    if (router->vr_flow_miss_batch &&
+            !(fe->fe_flags & VR_FLOW_FLAG_TRAP_ECMP) &&
+            vr_flow_miss_batch_add(router->vr_flow_miss_batch, index))
+        return 0;
+
+    npkt = vr_pclone(pkt);
+    if (!npkt)
+        return -ENOMEM;
+
+    vr_preset(npkt);
+
+    switch (fe->fe_flags & VR_FLOW_FLAG_TRAP_MASK) {
+    case VR_FLOW_FLAG_TRAP_ECMP:
+        trap_reason = AGENT_TRAP_ECMP_RESOLVE;
+        break;
+
+    default:
+        trap_reason = AGENT_TRAP_FLOW_MISS;
+        break;
+    }
+
+
+    return vr_trap(npkt, fe->fe_key.key_vrf_id, trap_reason, &index);
+}
+
+/*
+ * the syn, fin and rst a direction of a tcp flow has seen, for the aging to
+ * remove closed flows early. a syn on a closed flow is a new connection
+ */
+static void
+vr_flow_tcp_track(struct vr_flow_entry *fe, struct vr_packet *pkt)
+{
+    uint8_t tcp_flags, flags = 0;
+    unsigned char *tcp;
+    struct vr_ip *ip;
+
+    ip = (struct vr_ip *)pkt_network_header(pkt);
+    if (!ip || ip->ip_proto != VR_IP_PROTO_TCP ||
+            !vr_ip_transport_header_valid(ip))
+        return;
+
+    tcp = pkt_transport_header(pkt, ip);
+    if (tcp + VR_TCP_FLAGS_OFFSET >= pkt->vp_head + pkt->vp_tail)
+        return;
+
+    tcp_flags = tcp[VR_TCP_FLAGS_OFFSET];
+    if (tcp_flags & VR_TCP_FLAG_SYN)
+        flags |= VR_FLOW_TCP_SYN;
+    if (tcp_flags & VR_TCP_FLAG_FIN)
+        flags |= VR_FLOW_TCP_FIN;
+    if (tcp_flags & VR_TCP_FLAG_RST)
+        flags |= VR_FLOW_TCP_RST;
+
+    if (!flags)
+        return;
+
+    if ((flags & VR_FLOW_TCP_SYN) && !(tcp_flags & VR_TCP_FLAG_ACK) &&
+            (fe->fe_tcp_flags & (VR_FLOW_TCP_FIN | VR_FLOW_TCP_RST))) {
+        fe->fe_tcp_flags = flags;
+        return;
+    }
+
+    /* keep the cache line clean for the packets that change nothing */
+    if ((fe->fe_tcp_flags & flags) != flags)
+        (void)__sync_fetch_and_or(&fe->fe_tcp_flags, flags);
+
+    return;
+}
+
+static int
+vr_do_flow_action(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index, struct vr_packet *pkt,
+        unsigned short proto, struct vr_forwarding_md *fmd)
+{
+    uint32_t new_stats;
+    uint64_t packets;
+    struct vr_flow_cpu_stats *stats;
+
+    vr_flow_hit(router, index);
+
+    if (vr_flow_tcp_closed_timeout && router->vr_flow_aging &&
+            fe->fe_key.key_proto == VR_IP_PROTO_TCP &&
+            proto == VR_ETH_PROTO_IP)
+        vr_flow_tcp_track(fe, pkt);
+
+    stats = vr_flow_cpu_stats_get(router, vr_get_cpu(), index);
+    if (stats) {
+        /* only this cpu writes to this slot */
+        stats->fcs_bytes += pkt_len(pkt);
+        packets = ++stats->fcs_packets;
+    } else {
+        new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_bytes,
+                pkt_len(pkt));
+        if (new_stats < pkt_len(pkt))
+            fe->fe_stats.flow_bytes_oflow++;
+
+        new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_packets, 1);
+        if (!new_stats) 
+            fe->fe_stats.flow_packets_oflow++;
+        packets = new_stats;
+    }
+
+    if (vr_flow_elephant_rate && !(packets & (VR_FLOW_RATE_SAMPLE - 1)))
+        vr_flow_rate_sample(fe, pkt_len(pkt) * VR_FLOW_RATE_SAMPLE);
+
+    if (fe->fe_action == VR_FLOW_ACTION_HOLD) {
+        if (vr_flow_queue_is_empty(router, fe)) {
+            if (!(fe->fe_flags & VR_FLOW_FLAG_TRAP_ECMP) &&
+                    !vr_flow_miss_trap_allowed(pkt->vp_if)) {
+                vr_pfree(pkt, VP_DROP_FLOW_MISS_RATE_LIMIT);
+                return 0;
+            }
+
+            vr_trap_flow(router, fe, pkt, index);
+            return vr_enqueue_flow(fe, pkt, proto, fmd);
+        } else {
+            vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
+            return 0;
+        }
+    }
+
+    return vr_flow_action(router, fe, index, pkt, proto, fmd);
+}
+
+static unsigned int
+vr_flow_table_hold_count(struct vrouter *router)
+{
+    unsigned int i, num_cpus;
+    uint64_t hcount = 0, act_count;
+    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+
+    num_cpus = vr_num_cpus;
+    for (i = 0; i < num_cpus; i++)
+        hcount += infop->vfti_hold_count[i];
+
+    act_count = infop->vfti_action_count;
+    if (hcount >= act_count)
+        return hcount - act_count;
+
+    return 0;
+}
+
+static void
+vr_flow_entry_set_hold(struct vrouter *router, struct vr_flow_entry *flow_e)
+{
+    unsigned int cpu;
+    uint64_t act_count;
+    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+
+    cpu = vr_get_cpu();
+    flow_e->fe_action = VR_FLOW_ACTION_HOLD;
+    flow_e->fe_hold_stamp = vr_flow_usecs();
+
+    if (infop->vfti_hold_count[cpu] + 1 < infop->vfti_hold_count[cpu]) {
+        act_count = infop->vfti_action_count;
+        if (act_count > infop->vfti_hold_count[cpu]) {
+           (void)__sync_sub_and_fetch(&infop->vfti_action_count,
+                    infop->vfti_hold_count[cpu]);
+            infop->vfti_hold_count[cpu] = 0;
+        } else {
+            infop->vfti_hold_count[cpu] -= act_count;
+            (void)__sync_sub_and_fetch(&infop->vfti_action_count,
+                    act_count);
+        }
+    }
+
+    infop->vfti_hold_count[cpu]++;
+
+    return;
+}
+
+static inline struct vr_flow_snat **
+vr_flow_snat_bucket(struct vrouter *router, unsigned short vrf,
+        unsigned int sip)
+{
+    unsigned int bucket;
+
+    bucket = vr_hash_2words(sip, vrf, 0) %
+        (VR_FLOW_SNAT_SLOTS / VR_FLOW_SNAT_BUCKET);
+    return &router->vr_flow_snat[bucket * VR_FLOW_SNAT_BUCKET];
+}
+
+static struct vr_flow_snat *
+vr_flow_snat_find(struct vrouter *router, unsigned short vrf,
+        unsigned int sip)
+{
+    unsigned int i;
+    struct vr_flow_snat **slots, *snat;
+
+    if (!router->vr_flow_snat)
+        return NULL;
+
+    slots = vr_flow_snat_bucket(router, vrf, sip);
+    for (i = 0; i < VR_FLOW_SNAT_BUCKET; i++) {
+        snat = slots[i];
+        if (snat && snat->fsn_sip == sip && snat->fsn_vrf == vrf)
+            return snat;
+    }
+
+    return NULL;
+}
+
+static bool
+vr_flow_event_ring_full(struct vrouter *router)
+{
+    struct vr_flow_event_ring *ring;
+
+    if (!router->vr_flow_event_table)
+        return true;
+
+    ring = (struct vr_flow_event_ring *)
+        vr_btable_get(router->vr_flow_event_table[vr_get_cpu()], 0);
+    return ring->fer_head - ring->fer_tail >= VR_FLOW_EVENT_RING_RECORDS;
+}
+
+/*
+ * sets up a new flow (fe, just claimed by the miss) and its reverse flow
+ * if the vm has a source nat rule. returns false if the packet has to go
+ * the usual way, through the agent
+ */
+static bool
+vr_flow_snat_setup(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index, struct vr_packet *pkt)
+{
+    unsigned int i, cpu, hash, rindex;
+    unsigned short port, *cursor;
+    struct vr_flow_key rkey;
+    struct vr_flow_entry *rfe = NULL;
+    struct vr_flow_snat *snat;
+
+    if (!router->vr_flow_snat || !pkt->vp_if ||
+            pkt->vp_if->vif_type != VIF_TYPE_VIRTUAL)
+        return false;
+
+    if (fe->fe_key.key_proto != VR_IP_PROTO_TCP &&
+            fe->fe_key.key_proto != VR_IP_PROTO_UDP)
+        return false;
+
+    snat = vr_flow_snat_find(router, fe->fe_key.key_vrf_id,
+            fe->fe_key.key_src_ip);
+    if (!snat)
+        return false;
+
+    /* the binding has to reach the agent */
+    if (vr_flow_event_ring_full(router))
+        return false;
+
+    memset(&rkey, 0, sizeof(rkey));
+    rkey.key_src_ip = fe->fe_key.key_dest_ip;
+    rkey.key_dest_ip = snat->fsn_snat_ip;
+    rkey.key_src_port = fe->fe_key.key_dst_port;
+    rkey.key_vrf_id = snat->fsn_dvrf;
+    rkey.key_proto = fe->fe_key.key_proto;
+
+    cpu = vr_get_cpu();
+    cursor = &snat->fsn_cursor[cpu];
+    for (i = 0; i < snat->fsn_block && i < VR_FLOW_SNAT_PROBES; i++) {
+        port = snat->fsn_port + cpu * snat->fsn_block + *cursor;
+        *cursor = (*cursor + 1) % snat->fsn_block;
+
+        rkey.key_dst_port = htons(port);
+        hash = vr_flow_hash(&rkey);
+        if (__vr_find_flow(router, &rkey, hash, &rindex))
+            continue;
+
+        rfe = vr_find_free_entry(router, &rkey, hash, &rindex);
+        break;
+    }
+
+    if (!rfe)
+        return false;
+
+    rfe->fe_rflow = index;
+    rfe->fe_dvrf = fe->fe_key.key_vrf_id;
+    rfe->fe_src_nh_index = NH_DISCARD_ID;
+    rfe->fe_action = VR_FLOW_ACTION_NAT;
+    rfe->fe_flags |= VR_RFLOW_VALID | VR_FLOW_FLAG_DNAT | VR_FLOW_FLAG_DPAT;
+
+    fe->fe_rflow = rindex;
+    fe->fe_dvrf = snat->fsn_dvrf;
+    fe->fe_src_nh_index = snat->fsn_src_nh;
+    fe->fe_flags |= VR_RFLOW_VALID | VR_FLOW_FLAG_SNAT | VR_FLOW_FLAG_SPAT;
+    if (snat->fsn_dvrf != fe->fe_key.key_vrf_id) {
+        rfe->fe_flags |= VR_FLOW_FLAG_VRFT;
+        fe->fe_flags |= VR_FLOW_FLAG_VRFT;
+    }
+
+    /* the entries are complete before the action lets packets through */
+    __sync_synchronize();
+    fe->fe_action = VR_FLOW_ACTION_NAT;
+    vr_flow_changed(router, index);
+    vr_flow_changed(router, rindex);
+
+    vr_flow_event_post(router, VR_FLOW_EVENT_SNAT_BIND, index,
+            fe->fe_key.key_vrf_id, pkt->vp_if->vif_idx, rindex);
+
+    return true;
+}
+
+static int
+vr_flow_snat_set(struct vrouter *router, vr_flow_req *req)
+{
+    unsigned int i, ports;
+    unsigned short vrf = (uint16_t)req->fr_flow_vrf;
+    unsigned int sip = req->fr_flow_sip;
+    struct vr_flow_snat **slots, **slot = NULL, *snat = NULL, *old;
+
+    if (!router || vrf >= VR_MAX_VRFS)
+        return -EINVAL;
+
+    ports = req->fr_snat_ports;
+    if (ports) {
+        if (!router->vr_flow_event_table)
+            return -EOPNOTSUPP;
+
+        if (ports < vr_num_cpus ||
+                (uint16_t)req->fr_flow_dvrf >= VR_MAX_VRFS ||
+                (uint16_t)req->fr_snat_port + ports > 65536)
+            return -EINVAL;
+
+        if (!router->vr_flow_snat) {
+            router->vr_flow_snat = vr_zalloc(VR_FLOW_SNAT_SLOTS *
+                    sizeof(struct vr_flow_snat *));
+            if (!router->vr_flow_snat)
+                return -ENOMEM;
+        }
+
+        snat = vr_zalloc(sizeof(*snat) + vr_num_cpus * sizeof(uint16_t));
+        if (!snat)
+            return -ENOMEM;
+
+        snat->fsn_sip = sip;
+        snat->fsn_vrf = vrf;
+        snat->fsn_dvrf = req->fr_flow_dvrf;
+        snat->fsn_snat_ip = req->fr_snat_ip;
+        snat->fsn_src_nh = req->fr_src_nh_index;
+        snat->fsn_port = (uint16_t)req->fr_snat_port;
+        snat->fsn_block = ports / vr_num_cpus;
+    } else if (!router->vr_flow_snat) {
+        return -ENOENT;
+    }
+
+    slots = vr_flow_snat_bucket(router, vrf, sip);
+    for (i = 0; i < VR_FLOW_SNAT_BUCKET; i++) {
+        old = slots[i];
+        if (old && old->fsn_sip == sip && old->fsn_vrf == vrf) {
+            slot = &slots[i];
+            break;
+        }
+
+        if (!old && !slot)
+            slot = &slots[i];
+    }
+
+    if (!slot || (!*slot && !snat)) {
+        if (snat)
+            vr_free(snat);
+        return snat ? -ENOSPC : -ENOENT;
+    }
+
+    old = *slot;
+    __sync_synchronize();
+    *slot = snat;
+    if (old) {
+        vr_delay_op();
+        vr_free(old);
+    }
+
+    return 0;
+}
+
+static void
+vr_flow_snat_exit(struct vrouter *router)
+{
+    unsigned int i;
+
+    if (!router->vr_flow_snat)
+        return;
+
+    for (i = 0; i < VR_FLOW_SNAT_SLOTS; i++) {
+        if (router->vr_flow_snat[i])
+            vr_free(router->vr_flow_snat[i]);
+    }
+
+    vr_free(router->vr_flow_snat);
+    router->vr_flow_snat = NULL;
+
+    return;
+}
+
+static int
+__vr_flow_lookup(struct vrouter *router, struct vr_flow_key *key,
+        unsigned int hash, struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    unsigned int fe_index;
+    uint64_t start;
+    struct vr_flow_entry *flow_e;
+
+    pkt->vp_flags |= VP_FLAG_FLOW_SET;
+
+    start = vr_perf_start();
+    flow_e = __vr_find_flow(router, key, hash, &fe_index);
+    vr_perf_end(VR_PERF_FLOW_LOOKUP, start, 1);
+    if (!flow_e) {
+        if (vr_flow_table_hold_count(router) > VR_MAX_FLOW_TABLE_HOLD_COUNT) {
+            vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
+            return 0;
+        }
+
+        flow_e = vr_find_free_entry(router, key, hash, &fe_index);
+        if (!flow_e) {
+            vr_notify_table_full(router, VR_NOTIFY_TABLE_FLOW);
+            vr_pfree(pkt, VP_DROP_FLOW_TABLE_FULL);
+            return 0;
+        }
+
+        if (vr_flow_snat_setup(router, flow_e, fe_index, pkt)) {
+            vr_flow_cache_update(router, key, fe_index);
+            return vr_do_flow_action(router, flow_e, fe_index, pkt,
+                    proto, fmd);
+        }
+
+        /* mark as hold */
+        vr_flow_entry_set_hold(router, flow_e);
+        vr_flow_changed(router, fe_index);
+        vr_flow_cache_update(router, key, fe_index);
+        vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+        return 0;
+    } 
+    
+    vr_flow_cache_update(router, key, fe_index);
+
+    return vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+}
+
+static int
+vr_flow_lookup(struct vrouter *router, struct vr_flow_key *key,
+        struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    unsigned int fe_index;
+    struct vr_flow_entry *flow_e;
+
+    flow_e = vr_flow_cache_lookup(router, key, &fe_index);
+    if (flow_e) {
+        pkt->vp_flags |= VP_FLAG_FLOW_SET;
+        return vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+    }
+
+    return __vr_flow_lookup(router, key, vr_flow_hash(key), pkt, proto, fmd);
+}
+
+/*
+ * This inline function decides whether to trap the packet, or bypass 
+ * flow table or not. 
+ */
+inline unsigned int
+vr_flow_parse(struct vrouter *router, struct vr_flow_key *key,
+        struct vr_packet *pkt, unsigned int *trap_res)
+{
+   unsigned int proto_port;
+   /* without any data, the result has to be BYPASS, right? */
+   unsigned int res = VR_FLOW_BYPASS;
+
+    /* 
+     * if the packet has already done one round of flow lookup, there
+     * is no point in doing it again, eh?
+     */
+    if (pkt->vp_flags & VP_FLAG_FLOW_SET)
+        return res;
+
+    /*
+     * if the interface is policy enabled, or if somebody else (eg:nexthop)
+     * has requested for a policy lookup, packet has to go through a lookup
+     */
+    if (pkt->vp_if->vif_flags & VIF_FLAG_POLICY_ENABLED ||
+            pkt->vp_flags & VP_FLAG_FLOW_GET)
+        res = VR_FLOW_LOOKUP;
+
+    /*
+     * ..., but then there are some exceptions, as checked below.
+     * please note that these conditions also need to work when policy is
+     * really not enabled
+     */
+    if (key) {
+        if (IS_BMCAST_IP(key->key_dest_ip)) {
+           /* no flow lookup for multicast or broadcast ip */
+           res = VR_FLOW_BYPASS;
+           pkt->vp_flags |= VP_FLAG_MULTICAST | VP_FLAG_FLOW_SET;
+        }
+
+        proto_port = (key->key_proto << VR_FLOW_PROTO_SHIFT) |
+                                                key->key_dst_port;
+        if (proto_port == VR_UDP_DHCP_SPORT ||
+                proto_port == VR_UDP_DHCP_CPORT) {
+            res = VR_FLOW_TRAP;
+            pkt->vp_flags |= VP_FLAG_FLOW_SET;
+            if (trap_res)
+                *trap_res = AGENT_TRAP_L3_PROTOCOLS;
+        }
+    }
+
+    return res;
+}
+
+unsigned int
+vr_flow_inet_input(struct vrouter *router, unsigned short vrf,
+        struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    struct vr_flow_key key, *key_p = &key;
+    struct vr_ip *ip;
+    struct vr_fragment *frag;
+    unsigned int flow_parse_res;
+    unsigned int trap_res  = 0;
+    unsigned short *t_hdr, sport, dport;
+
+    /*
+     * interface is in a mode where it wants all packets to be received
+     * without doing lookups to figure out whether packets were destined
+     * to me or not
+     */
+    if (pkt->vp_flags & VP_FLAG_TO_ME)
+        return vr_ip_rcv(router, pkt, fmd);
+
+    ip = (struct vr_ip *)pkt_network_header(pkt);
+    /* if the packet is not a fragment, we easily know the sport, and dport */
+    if (vr_ip_transport_header_valid(ip)) {
+        pkt_set_transport_header(pkt, ip);
+        t_hdr = (unsigned short *)pkt_transport_header(pkt, ip);
+        sport = *t_hdr;
+        dport = *(t_hdr + 1);
+    } else {
+        /* ...else, we need to get it from somewhere */
+        flow_parse_res = vr_flow_parse(router, NULL, pkt, &trap_res);
+        /* ...and it really matters only if we need to do a flow lookup */
+        if (flow_parse_res == VR_FLOW_LOOKUP) {
+            frag = vr_fragment_get(router, vrf, ip);
+            if (!frag) {
+                /* the head may yet come, out of order */
+                if (!vr_fragment_enqueue(router, vrf, pkt, proto, fmd))
+                    return 0;
+
+                vr_pfree(pkt, VP_DROP_FRAGMENTS);
+                return 0;
+            }
+            sport = frag->f_sport;
+            dport = frag->f_dport;
+            if (vr_ip_fragment_tail(ip))
+                vr_fragment_del(frag);
+        } else {
+            /* 
+             * since there is no other way of deriving a key, set the
+             * key_p to NULL, indicating to code below that there is
+             * indeed no need for flow lookup
+             */
+            key_p = NULL;
+        }
+    }
+
+    if (key_p) {
+        /* we have everything to make a key */
+        vr_get_flow_key(key_p, vrf, ip, sport, dport);
+        flow_parse_res = vr_flow_parse(router, key_p, pkt, &trap_res);
+        if (flow_parse_res == VR_FLOW_LOOKUP && vr_ip_fragment_head(ip))
+            vr_fragment_add(router, vrf, ip, key_p->key_src_port,
+                    key_p->key_dst_port);
+
+        if (flow_parse_res == VR_FLOW_BYPASS) {
+            return vr_flow_forward(vrf, pkt, proto, fmd);
+        } else if (flow_parse_res == VR_FLOW_TRAP) {
+            return vr_trap(pkt, vrf, trap_res, NULL);
+        }
+
+        return vr_flow_lookup(router, key_p, pkt, proto, fmd);
+    }
+
+    /* 
+     * ...come here, when there is not enough information to do a
+     * flow lookup
+     */
+    return vr_flow_forward(vrf, pkt, proto, fmd);
+}
+
+/*
+ * batch version of vr_flow_inet_input. the idea is to take the memory
+ * stalls of the flow table out of the per packet path: in the first pass,
+ * we make the keys and hashes for all the packets in the batch and prefetch
+ * the corresponding buckets. by the time the second pass does the actual
+ * lookups, hopefully, the buckets are already in the cache.
+ *
+ * packets that need anything other than a plain flow lookup (packets for
+ * me, fragments, bypass and trap cases) are handed over to the regular
+ * vr_flow_inet_input in the first pass itself. the order of processing of
+ * packets within a flow is maintained, since all packets of a flow take
+ * the same path.
+ */
+unsigned int
+vr_flow_inet_input_batch(struct vrouter *router, unsigned short *vrfs,
+        struct vr_packet **pkts, unsigned int num_pkts, unsigned short proto,
+        struct vr_forwarding_md *fmds)
+{
+    unsigned int i, num_lookups = 0, num_bypass = 0;
+    unsigned int flow_parse_res, trap_res;
+    unsigned short *t_hdr;
+    struct vr_ip *ip;
+    struct vr_packet *pkt;
+    /* bypass packets, whose route lookups are done as one burst */
+    unsigned short bypass_vrfs[VR_FLOW_BATCH_MAX];
+    struct vr_packet *bypass_pkts[VR_FLOW_BATCH_MAX];
+    struct vr_forwarding_md bypass_fmds[VR_FLOW_BATCH_MAX];
+    struct vr_flow_key keys[VR_FLOW_BATCH_MAX];
+    unsigned int hashes[VR_FLOW_BATCH_MAX];
+    unsigned char lookup_index[VR_FLOW_BATCH_MAX];
+    /* entries found in the flow cache need neither a hash nor a lookup */
+    struct vr_flow_entry *cached[VR_FLOW_BATCH_MAX];
+    unsigned int cached_index[VR_FLOW_BATCH_MAX];
+
+    if (num_pkts > VR_FLOW_BATCH_MAX)
+        num_pkts = VR_FLOW_BATCH_MAX;
+
+    for (i = 0; i < num_pkts; i++) {
+        pkt = pkts[i];
+        if (pkt->vp_flags & VP_FLAG_TO_ME)
+            goto slow_path;
+
+        ip = (struct vr_ip *)pkt_network_header(pkt);
+        if (vr_ip_fragment(ip))
+            goto slow_path;
+
+        pkt_set_transport_header(pkt, ip);
+        t_hdr = (unsigned short *)pkt_transport_header(pkt, ip);
+        vr_get_flow_key(&keys[num_lookups], vrfs[i], ip, *t_hdr, *(t_hdr + 1));
+
+        trap_res = 0;
+        flow_parse_res = vr_flow_parse(router, &keys[num_lookups], pkt,
+                &trap_res);
+        if (flow_parse_res == VR_FLOW_BYPASS) {
+            if (proto != VR_ETH_PROTO_IP || pkt->vp_nh) {
+                vr_flow_forward(vrfs[i], pkt, proto, &fmds[i]);
+            } else {
+                pkt_set_data(pkt, pkt->vp_network_h);
+                bypass_vrfs[num_bypass] = vrfs[i];
+                bypass_pkts[num_bypass] = pkt;
+                bypass_fmds[num_bypass++] = fmds[i];
+            }
+            continue;
+        } else if (flow_parse_res == VR_FLOW_TRAP) {
+            vr_trap(pkt, vrfs[i], trap_res, NULL);
+            continue;
+        }
+
+        cached[num_lookups] = vr_flow_cache_lookup(router,
+                &keys[num_lookups], &cached_index[num_lookups]);
+        if (!cached[num_lookups]) {
+            hashes[num_lookups] = vr_flow_hash(&keys[num_lookups]);
+            vr_flow_prefetch_bucket(router, &keys[num_lookups],
+                    hashes[num_lookups]);
+        }
+        lookup_index[num_lookups++] = i;
+        continue;
+
+slow_path:
+        vr_flow_inet_input(router, vrfs[i], pkt, proto, &fmds[i]);
+    }
+
+    if (num_bypass)
+        vr_ip_input_bulk(router, bypass_vrfs, bypass_pkts, num_bypass,
+                bypass_fmds);
+
+    for (i = 0; i < num_lookups; i++) {
+        if (cached[i]) {
+            pkts[lookup_index[i]]->vp_flags |= VP_FLAG_FLOW_SET;
+            vr_do_flow_action(router, cached[i], cached_index[i],
+                    pkts[lookup_index[i]], proto, &fmds[lookup_index[i]]);
+            continue;
+        }
+
+        __vr_flow_lookup(router, &keys[i], hashes[i], pkts[lookup_index[i]],
+                proto, &fmds[lookup_index[i]]);
+    }
+
+    return num_pkts;
+}
+
+static void
+vr_flush_entry(struct vrouter *router, struct vr_flow_entry *fe,
+        struct vr_flow_md *flmd, struct vr_forwarding_md *fmd)
+{
+    struct vr_list_node *head;
+    struct vr_packet_node *pnode;
+
+    head = fe->fe_hold_list.node_p;
+    fe->fe_hold_list.node_p = NULL;
+
+    while (head) {
+        pnode = (struct vr_packet_node *)head;
+        if (fmd)
+            vr_fmd_set_outer_src_ip(fmd, pnode->pl_outer_src_ip);
+
+        vr_flow_action(router, fe, flmd->flmd_index, pnode->pl_packet,
+                pnode->pl_proto, fmd);
+
+        head = pnode->pl_node.node_n;
+        vr_flow_hold_node_free(router, pnode);
+    }
+
+    return;
+}
+
+static void
+vr_flow_flush(void *arg)
+{
+    struct vrouter *router;
+    struct vr_flow_entry *fe;
+    struct vr_forwarding_md fmd;
+    struct vr_flow_md *flmd = 
+                (struct vr_flow_md *)arg;
+
+    router = flmd->flmd_router;
+    if (!router)
+        return;
+
+    fe = vr_get_flow_entry(router, flmd->flmd_index);
+    if (!fe)
+        return;
+
+    vr_init_forwarding_md(&fmd);
+    vr_flow_set_forwarding_md(router, fe, flmd->flmd_index, &fmd);
+
+    vr_flush_entry(router, fe, flmd, &fmd);
+
+    if (!(flmd->flmd_flags & VR_FLOW_FLAG_ACTIVE)) {
+        vr_reset_flow_entry(router, fe, flmd->flmd_index);
+    } 
+
+    return;
+}
+
+static void
+vr_flow_set_mirror(struct vrouter *router, vr_flow_req *req,
+        struct vr_flow_entry *fe)
+{
+    struct vr_mirror_entry *mirror = NULL, *sec_mirror = NULL;
+
+    if (!(req->fr_flags & VR_FLOW_FLAG_MIRROR) &&
+            (fe->fe_flags & VR_FLOW_FLAG_MIRROR)) {
+    	vr_flow_reset_mirror(router, fe, req->fr_index);
+        return;
+    }
+
+    if (!(req->fr_flags & VR_FLOW_FLAG_MIRROR))
+        return;
+
+    if (fe->fe_mirror_id != req->fr_mir_id) {
+        if (fe->fe_mirror_id < router->vr_max_mirror_indices) {
+            vrouter_put_mirror(router, fe->fe_mirror_id);
+            fe->fe_mirror_id = router->vr_max_mirror_indices;
+        }
+
+        if ((unsigned int)req->fr_mir_id < router->vr_max_mirror_indices) {
+            mirror = vrouter_get_mirror(req->fr_rid, req->fr_mir_id);
+            if (mirror)
+                fe->fe_mirror_id = req->fr_mir_id;
+
+            /* when we reached this point, we had already done all the
+             * sanity checks we could do. failing here will add only
+             * complexity to code here. so !mirror case, we will not
+             * handle
+             */
+        }
+    }
+
+    if (fe->fe_sec_mirror_id != req->fr_sec_mir_id) {
+        if (fe->fe_sec_mirror_id < router->vr_max_mirror_indices) {
+            vrouter_put_mirror(router, fe->fe_sec_mirror_id);
+            fe->fe_sec_mirror_id = router->vr_max_mirror_indices;
+        }
+
+        if ((unsigned int)req->fr_sec_mir_id < router->vr_max_mirror_indices) {
+            sec_mirror = vrouter_get_mirror(req->fr_rid, req->fr_sec_mir_id);
+            if (sec_mirror)
+                fe->fe_sec_mirror_id = req->fr_sec_mir_id;
+        }
+    }
+
+    if (req->fr_pcap_meta_data_size && req->fr_pcap_meta_data)
+        vr_mirror_meta_entry_set(router, req->fr_index,
+                req->fr_mir_sip, req->fr_mir_sport,
+                req->fr_pcap_meta_data, req->fr_pcap_meta_data_size,
+                req->fr_mir_vrf);
+
+    return;
+}
+
+static struct vr_flow_entry *
+vr_add_flow(unsigned int rid, struct vr_flow_key *key,
+        unsigned int *fe_index)
+{
+    unsigned int hash;
+    struct vr_flow_entry *flow_e;
+    struct vrouter *router = vrouter_get(rid);
+
+    hash = vr_flow_hash(key);
+    flow_e = __vr_find_flow(router, key, hash, fe_index);
+    if (!flow_e)
+        flow_e = vr_find_free_entry(router, key, hash, fe_index);
+
+    return flow_e;
+}
+
+static struct vr_flow_entry *
+vr_add_flow_req(vr_flow_req *req, unsigned int *fe_index)
+{
+    struct vr_flow_key key;
+    struct vr_flow_entry *fe;
+
+    key.key_src_port = req->fr_flow_sport;
+    key.key_dst_port = req->fr_flow_dport;
+    key.key_src_ip = req->fr_flow_sip;
+    key.key_dest_ip = req->fr_flow_dip;
+    key.key_vrf_id = req->fr_flow_vrf;
+    key.key_proto = req->fr_flow_proto;
+    key.key_zero = 0;
+
+    fe = vr_add_flow(req->fr_rid, &key, fe_index);
+    if (fe)
+        req->fr_index = *fe_index;
+
+    return fe;
+}
+
+/*
+ * can be called with 'fe' as null (specifically when flow is added from
+ * agent), in which case we should be checking only the request
+ */
+static int
+vr_flow_req_is_invalid(struct vrouter *router, vr_flow_req *req,
+        struct vr_flow_entry *fe)
+{
+    struct vr_flow_entry *rfe;
+
+    if (fe) {
+        if ((unsigned int)req->fr_flow_sip != fe->fe_key.key_src_ip ||
+                (unsigned int)req->fr_flow_dip != fe->fe_key.key_dest_ip ||
+                (unsigned short)req->fr_flow_sport != fe->fe_key.key_src_port ||
+                (unsigned short)req->fr_flow_dport != fe->fe_key.key_dst_port||
+                (unsigned short)req->fr_flow_vrf != fe->fe_key.key_vrf_id ||
+                (unsigned char)req->fr_flow_proto != fe->fe_key.key_proto) {
+            return -EBADF;
+        }
+    }
+
+    if (req->fr_flags & VR_FLOW_FLAG_VRFT) {
+        if ((unsigned short)req->fr_flow_dvrf >= VR_MAX_VRFS)
+            return -EINVAL;
+    }
+
+    if (req->fr_flags & VR_FLOW_FLAG_MIRROR) {
+        if (((unsigned int)req->fr_mir_id >= router->vr_max_mirror_indices) &&
+                (unsigned int)req->fr_sec_mir_id >= router->vr_max_mirror_indices)
+            return -EINVAL;
+    }
+
+    if (req->fr_flags & VR_RFLOW_VALID) {
+        rfe = vr_get_flow_entry(router, req->fr_rindex);
+        if (!rfe)
+            return -EINVAL;
+    }
+
+    if (!__vrouter_get_nexthop(router, req->fr_src_nh_index))
+        return -EINVAL;
+
+    return 0;
+}
+
+static int
+vr_flow_schedule_transition(struct vrouter *router, vr_flow_req *req,
+        struct vr_flow_entry *fe)
+{
+    struct vr_flow_md *flmd = NULL;
+
+    flmd = (struct vr_flow_md *)vr_malloc(sizeof(*flmd));
+    if (!flmd)
+        return -ENOMEM;
+
+    flmd->flmd_router = router;
+    flmd->flmd_index = req->fr_index;
+    flmd->flmd_action = req->fr_action;
+    flmd->flmd_flags = req->fr_flags;
+
+    vr_schedule_work(vr_get_cpu(), vr_flow_flush, (void *)flmd);
+    return 0;
+}
+
+static int
+vr_flow_delete(struct vrouter *router, vr_flow_req *req,
+        struct vr_flow_entry *fe)
+{
+    vr_flow_offload_takeback(router, fe, req->fr_index);
+    fe->fe_action = VR_FLOW_ACTION_DROP;
+    vr_flow_reset_mirror(router, fe, req->fr_index);
+    vr_notify(router, VR_NOTIFY_FLOW_DELETE, req->fr_index, 0);
+
+    return 0;
+}
+
+
+/*
+ * command from agent. updates the entry, leaving the transition (flush of
+ * the held packets, reset of deleted entries) to the caller
+ */
+static int
+__vr_flow_set(struct vrouter *router, vr_flow_req *req)
+{
+    int ret;
+    unsigned int fe_index;
+    struct vr_flow_entry *fe = NULL;
+    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+
+    router = vrouter_get(req->fr_rid);
+    if (!router)
+        return -EINVAL;
+
+    req->fr_index = vr_flow_resize_index(router, req->fr_index);
+    if (req->fr_flags & VR_RFLOW_VALID)
+        req->fr_rindex = vr_flow_resize_index(router, req->fr_rindex);
+
+    fe = vr_get_flow_entry(router, req->fr_index);
+
+    if ((ret = vr_flow_req_is_invalid(router, req, fe)))
+        return ret;
+
+    if (fe && (fe->fe_action == VR_FLOW_ACTION_HOLD) &&
+            ((req->fr_action != fe->fe_action) ||
+             !(req->fr_flags & VR_FLOW_FLAG_ACTIVE))) {
+        __sync_fetch_and_add(&infop->vfti_action_count, 1);
+        vr_flow_setup_account(router, fe);
+    }
+
+    /* 
+     * for delete, absence of the requested flow entry is caustic. so
+     * handle that case first
+     */
+    if (!(req->fr_flags & VR_FLOW_FLAG_ACTIVE)) {
+        if (!fe)
+            return -EINVAL;
+        return vr_flow_delete(router, req, fe);
+    }
+
+
+    /*
+     * for non-delete cases, absence of flow entry means addition of a
+     * new flow entry with the key specified in the request
+     */
+    if (!fe) {
+        fe = vr_add_flow_req(req, &fe_index);
+        if (!fe)
+            return -ENOSPC;
+    } else {
+        /* the scanner offloads it again if it still qualifies */
+        vr_flow_offload_takeback(router, fe, req->fr_index);
+    }
+
+    vr_flow_set_mirror(router, req, fe);
 
-    default:
-        trap_reason = AGENT_TRAP_FLOW_MISS;
-        break;
+    if (req->fr_flags & VR_RFLOW_VALID) {
+        fe->fe_rflow = req->fr_rindex;
+    } else {
+        if (fe->fe_rflow >= 0)
+            fe->fe_rflow = -1;
     }
 
+    if (req->fr_flags & VR_FLOW_FLAG_VRFT) 
+        fe->fe_dvrf = req->fr_flow_dvrf;
 
-    return vr_trap(npkt, fe->fe_key.key_vrf_id, trap_reason, &index);
+    fe->fe_ecmp_nh_index = req->fr_ecmp_nh_index;
+    fe->fe_src_nh_index = req->fr_src_nh_index;
+    fe->fe_action = req->fr_action;
+    fe->fe_flags = req->fr_flags; 
+    vr_flow_changed(router, req->fr_index);
+
+    return 0;
 }
 
 static int
-vr_do_flow_action(struct vrouter *router, struct vr_flow_entry *fe,
-        unsigned int index, struct vr_packet *pkt,
-        unsigned short proto, struct vr_forwarding_md *fmd)
+vr_flow_set(struct vrouter *router, vr_flow_req *req)
 {
-    uint32_t new_stats;
+    int ret;
 
-    new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_bytes, pkt_len(pkt));
-    if (new_stats < pkt_len(pkt))
-        fe->fe_stats.flow_bytes_oflow++;
+    if ((ret = __vr_flow_set(router, req)))
+        return ret;
 
-    new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_packets, 1);
-    if (!new_stats) 
-        fe->fe_stats.flow_packets_oflow++;
+    return vr_flow_schedule_transition(router, req, NULL);
+}
 
-    if (fe->fe_action == VR_FLOW_ACTION_HOLD) {
-        if (vr_flow_queue_is_empty(router, fe)) {
-            vr_trap_flow(router, fe, pkt, index);
-            return vr_enqueue_flow(fe, pkt, proto, fmd);
-        } else {
-            vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
-            return 0;
+struct vr_flow_bulk_md {
+    unsigned int fbmd_count;
+    struct vr_flow_md fbmd_flmd[0];
+};
+
+static void
+vr_flow_flush_bulk(void *arg)
+{
+    unsigned int i;
+    struct vr_flow_bulk_md *fbmd = (struct vr_flow_bulk_md *)arg;
+
+    for (i = 0; i < fbmd->fbmd_count; i++)
+        vr_flow_flush(&fbmd->fbmd_flmd[i]);
+
+    vr_free(fbmd);
+    return;
+}
+
+/*
+ * bulk update of existing flows (typically, new actions after a policy
+ * change). entry 'i' sets the action and the flags of the flow at
+ * fr_bulk_index[i], keeping the rest of the entry as it is. the result of
+ * every entry is returned in fr_bulk_error, and all the transitions are
+ * done in one work item
+ */
+static int
+vr_flow_set_bulk(struct vrouter *router, vr_flow_req *req,
+        vr_flow_req *resp)
+{
+    int ret;
+    unsigned int i, count;
+    struct vr_flow_entry *fe;
+    struct vr_flow_bulk_md *fbmd;
+    struct vr_flow_md *flmd;
+    vr_flow_req sreq;
+
+    if (!router)
+        return -EINVAL;
+
+    count = req->fr_bulk_index_size;
+    if (!count)
+        return 0;
+
+    if (count > VR_FLOW_MAX_BULK_ENTRIES ||
+            req->fr_bulk_action_size != count ||
+            req->fr_bulk_flags_size != count)
+        return -EINVAL;
+
+    resp->fr_bulk_error = vr_zalloc(count * sizeof(int));
+    if (!resp->fr_bulk_error)
+        return -ENOMEM;
+    resp->fr_bulk_error_size = count;
+
+    fbmd = vr_zalloc(sizeof(*fbmd) + count * sizeof(struct vr_flow_md));
+    if (!fbmd)
+        return -ENOMEM;
+
+    for (i = 0; i < count; i++) {
+        fe = vr_get_flow_entry(router, req->fr_bulk_index[i]);
+        if (!fe || !(fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
+            resp->fr_bulk_error[i] = -ENOENT;
+            continue;
         }
+
+        memset(&sreq, 0, sizeof(sreq));
+        sreq.fr_op = FLOW_OP_FLOW_SET;
+        sreq.fr_rid = req->fr_rid;
+        sreq.fr_index = req->fr_bulk_index[i];
+        sreq.fr_action = req->fr_bulk_action[i];
+        sreq.fr_flags = req->fr_bulk_flags[i];
+        sreq.fr_flow_sip = fe->fe_key.key_src_ip;
+        sreq.fr_flow_dip = fe->fe_key.key_dest_ip;
+        sreq.fr_flow_sport = fe->fe_key.key_src_port;
+        sreq.fr_flow_dport = fe->fe_key.key_dst_port;
+        sreq.fr_flow_vrf = fe->fe_key.key_vrf_id;
+        sreq.fr_flow_proto = fe->fe_key.key_proto;
+        sreq.fr_rindex = fe->fe_rflow;
+        sreq.fr_flow_dvrf = fe->fe_dvrf;
+        sreq.fr_mir_id = fe->fe_mirror_id;
+        sreq.fr_sec_mir_id = fe->fe_sec_mirror_id;
+        sreq.fr_ecmp_nh_index = fe->fe_ecmp_nh_index;
+        sreq.fr_src_nh_index = fe->fe_src_nh_index;
+
+        ret = __vr_flow_set(router, &sreq);
+        resp->fr_bulk_error[i] = ret;
+        if (ret)
+            continue;
+
+        flmd = &fbmd->fbmd_flmd[fbmd->fbmd_count++];
+        flmd->flmd_router = router;
+        flmd->flmd_index = sreq.fr_index;
+        flmd->flmd_action = sreq.fr_action;
+        flmd->flmd_flags = sreq.fr_flags;
     }
 
-    return vr_flow_action(router, fe, index, pkt, proto, fmd);
+    if (!fbmd->fbmd_count) {
+        vr_free(fbmd);
+        return 0;
+    }
+
+    vr_schedule_work(vr_get_cpu(), vr_flow_flush_bulk, (void *)fbmd);
+    return 0;
 }
 
 static unsigned int
-vr_flow_table_hold_count(struct vrouter *router)
+vr_flow_idle_timeout(struct vr_flow_entry *fe)
 {
-    unsigned int i, num_cpus;
-    uint64_t hcount = 0, act_count;
-    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+    switch (fe->fe_key.key_proto) {
+    case VR_IP_PROTO_TCP:
+        return vr_flow_tcp_idle_timeout;
 
-    num_cpus = vr_num_cpus;
-    for (i = 0; i < num_cpus; i++)
-        hcount += infop->vfti_hold_count[i];
+    case VR_IP_PROTO_UDP:
+        return vr_flow_udp_idle_timeout;
 
-    act_count = infop->vfti_action_count;
-    if (hcount >= act_count)
-        return hcount - act_count;
+    default:
+        return vr_flow_other_idle_timeout;
+    }
+}
 
-    return 0;
+/* a reset in either direction, or a fin in both */
+static bool
+vr_flow_tcp_closed(struct vrouter *router, struct vr_flow_entry *fe)
+{
+    uint8_t flags, rflags = 0;
+    struct vr_flow_entry *rfe;
+
+    flags = fe->fe_tcp_flags;
+    if (!flags)
+        return false;
+
+    if ((fe->fe_flags & VR_RFLOW_VALID) && fe->fe_rflow >= 0) {
+        rfe = vr_get_flow_entry(router, fe->fe_rflow);
+        if (rfe && (rfe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+            rflags = rfe->fe_tcp_flags;
+    }
+
+    if ((flags | rflags) & VR_FLOW_TCP_RST)
+        return true;
+
+    return (flags & rflags & VR_FLOW_TCP_FIN) != 0;
+}
+
+static bool
+vr_flow_is_idle(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index)
+{
+    unsigned int timeout;
+    uint32_t *hit;
+
+    if (!(fe->fe_flags & VR_FLOW_FLAG_ACTIVE) ||
+            (fe->fe_action == VR_FLOW_ACTION_HOLD) ||
+            !vr_flow_queue_is_empty(router, fe))
+        return false;
+
+    timeout = vr_flow_idle_timeout(fe);
+    if (vr_flow_tcp_closed_timeout &&
+            fe->fe_key.key_proto == VR_IP_PROTO_TCP &&
+            (!timeout || timeout > vr_flow_tcp_closed_timeout) &&
+            vr_flow_tcp_closed(router, fe))
+        timeout = vr_flow_tcp_closed_timeout;
+    if (!timeout)
+        return false;
+
+    hit = vr_flow_hit_get(router, index);
+    if (!hit)
+        return false;
+
+    return (router->vr_flow_aging->vfa_clock - *hit) >= timeout;
 }
 
 static void
-vr_flow_entry_set_hold(struct vrouter *router, struct vr_flow_entry *flow_e)
+vr_flow_age_entry(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index)
 {
-    unsigned int cpu;
-    uint64_t act_count;
-    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+    struct vr_flow_md flmd;
+    struct vr_forwarding_md fmd;
+    struct vr_flow_aging *aging = router->vr_flow_aging;
 
-    cpu = vr_get_cpu();
-    flow_e->fe_action = VR_FLOW_ACTION_HOLD;
+    vr_flow_event_post(router, VR_FLOW_EVENT_EVICT, index,
+            fe->fe_key.key_vrf_id, 0, fe->fe_rflow);
+    vr_notify(router, VR_NOTIFY_FLOW_EVICT, index, 0);
 
-    if (infop->vfti_hold_count[cpu] + 1 < infop->vfti_hold_count[cpu]) {
-        act_count = infop->vfti_action_count;
-        if (act_count > infop->vfti_hold_count[cpu]) {
-           (void)__sync_sub_and_fetch(&infop->vfti_action_count,
-                    infop->vfti_hold_count[cpu]);
-            infop->vfti_hold_count[cpu] = 0;
-        } else {
-            infop->vfti_hold_count[cpu] -= act_count;
-            (void)__sync_sub_and_fetch(&infop->vfti_action_count,
-                    act_count);
-        }
-    }
+    fe->fe_action = VR_FLOW_ACTION_DROP;
+    vr_flow_reset_mirror(router, fe, index);
 
-    infop->vfti_hold_count[cpu]++;
+    flmd.flmd_router = router;
+    flmd.flmd_index = index;
+    flmd.flmd_action = VR_FLOW_ACTION_DROP;
+    flmd.flmd_flags = fe->fe_flags & ~VR_FLOW_FLAG_ACTIVE;
+
+    vr_init_forwarding_md(&fmd);
+    vr_flush_entry(router, fe, &flmd, &fmd);
+    vr_reset_flow_entry(router, fe, index);
+
+    aging->vfa_ring[aging->vfa_head % VR_FLOW_AGED_RING_SIZE] = index;
+    __sync_synchronize();
+    aging->vfa_head++;
 
     return;
 }
 
-static int
-vr_flow_lookup(struct vrouter *router, struct vr_flow_key *key,
-        struct vr_packet *pkt, unsigned short proto,
-        struct vr_forwarding_md *fmd)
+static void
+vr_flow_aging_scan(void *arg)
 {
-    unsigned int fe_index;
-    struct vr_flow_entry *flow_e;
+    int rindex;
+    unsigned int i, index, total, sec, nsec;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_flow_aging *aging = router->vr_flow_aging;
+    struct vr_flow_entry *fe, *rfe;
 
-    pkt->vp_flags |= VP_FLAG_FLOW_SET;
+    if (!aging)
+        return;
 
-    flow_e = vr_find_flow(router, key, &fe_index);
-    if (!flow_e) {
-        if (vr_flow_table_hold_count(router) > VR_MAX_FLOW_TABLE_HOLD_COUNT) {
-            vr_pfree(pkt, VP_DROP_FLOW_UNUSABLE);
-            return 0;
-        }
+    vr_get_mono_time(&sec, &nsec);
+    aging->vfa_clock = sec;
 
-        flow_e = vr_find_free_entry(router, key, &fe_index);
-        if (!flow_e) {
-            vr_pfree(pkt, VP_DROP_FLOW_TABLE_FULL);
-            return 0;
+    /* the index space is in flux */
+    if (router->vr_flow_resize)
+        return;
+
+    total = vr_flow_entries + vr_oflow_entries;
+    for (i = 0; i < VR_FLOW_AGING_ENTRIES_PER_SCAN; i++) {
+        /* room for a flow and its reverse flow */
+        if (VR_FLOW_AGED_RING_SIZE - (aging->vfa_head - aging->vfa_tail) < 2)
+            break;
+
+        index = aging->vfa_cursor;
+        aging->vfa_cursor = (index + 1) % total;
+
+        fe = vr_get_flow_entry(router, index);
+        if (!fe || !vr_flow_is_idle(router, fe, index))
+            continue;
+
+        rfe = NULL;
+        rindex = fe->fe_rflow;
+        if ((fe->fe_flags & VR_RFLOW_VALID) && (rindex >= 0) &&
+                ((unsigned int)rindex != index)) {
+            rfe = vr_get_flow_entry(router, rindex);
+            if (rfe && (rfe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
+                if (!vr_flow_is_idle(router, rfe, rindex))
+                    continue;
+            } else {
+                rfe = NULL;
+            }
         }
 
-        /* mark as hold */
-        vr_flow_entry_set_hold(router, flow_e);
-        vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+        vr_flow_age_entry(router, fe, index);
+        if (rfe)
+            vr_flow_age_entry(router, rfe, rindex);
+    }
+
+    return;
+}
+
+/* hand over (a batch of) the indices of the aged flows to the agent */
+static int
+vr_flow_aged_get(struct vrouter *router, vr_flow_req *resp)
+{
+    unsigned int i, count;
+    struct vr_flow_aging *aging;
+
+    if (!router)
+        return -EINVAL;
+
+    aging = router->vr_flow_aging;
+    if (!aging)
+        return -EOPNOTSUPP;
+
+    count = aging->vfa_head - aging->vfa_tail;
+    if (count > VR_FLOW_MAX_BULK_ENTRIES)
+        count = VR_FLOW_MAX_BULK_ENTRIES;
+    if (!count)
         return 0;
-    } 
-    
 
-    return vr_do_flow_action(router, flow_e, fe_index, pkt, proto, fmd);
+    resp->fr_aged_index = vr_zalloc(count * sizeof(int));
+    if (!resp->fr_aged_index)
+        return -ENOMEM;
+
+    for (i = 0; i < count; i++)
+        resp->fr_aged_index[i] =
+            aging->vfa_ring[(aging->vfa_tail + i) % VR_FLOW_AGED_RING_SIZE];
+    resp->fr_aged_index_size = count;
+
+    __sync_synchronize();
+    aging->vfa_tail += count;
+
+    return 0;
 }
 
-/*
- * This inline function decides whether to trap the packet, or bypass 
- * flow table or not. 
- */
-inline unsigned int
-vr_flow_parse(struct vrouter *router, struct vr_flow_key *key,
-        struct vr_packet *pkt, unsigned int *trap_res)
+static void
+vr_flow_aging_exit(struct vrouter *router)
 {
-   unsigned int proto_port;
-   /* without any data, the result has to be BYPASS, right? */
-   unsigned int res = VR_FLOW_BYPASS;
+    struct vr_flow_aging *aging = router->vr_flow_aging;
 
-    /* 
-     * if the packet has already done one round of flow lookup, there
-     * is no point in doing it again, eh?
-     */
-    if (pkt->vp_flags & VP_FLAG_FLOW_SET)
-        return res;
+    if (!aging)
+        return;
 
-    /*
-     * if the interface is policy enabled, or if somebody else (eg:nexthop)
-     * has requested for a policy lookup, packet has to go through a lookup
-     */
-    if (pkt->vp_if->vif_flags & VIF_FLAG_POLICY_ENABLED ||
-            pkt->vp_flags & VP_FLAG_FLOW_GET)
-        res = VR_FLOW_LOOKUP;
+    if (aging->vfa_timer) {
+        vr_delete_timer(aging->vfa_timer);
+        vr_free(aging->vfa_timer);
+    }
 
-    /*
-     * ..., but then there are some exceptions, as checked below.
-     * please note that these conditions also need to work when policy is
-     * really not enabled
-     */
-    if (key) {
-        if (IS_BMCAST_IP(key->key_dest_ip)) {
-           /* no flow lookup for multicast or broadcast ip */
-           res = VR_FLOW_BYPASS;
-           pkt->vp_flags |= VP_FLAG_MULTICAST | VP_FLAG_FLOW_SET;
-        }
+    if (router->vr_flow_hits) {
+        vr_btable_free(router->vr_flow_hits);
+        router->vr_flow_hits = NULL;
+    }
 
-        proto_port = (key->key_proto << VR_FLOW_PROTO_SHIFT) |
-                                                key->key_dst_port;
-        if (proto_port == VR_UDP_DHCP_SPORT ||
-                proto_port == VR_UDP_DHCP_CPORT) {
-            res = VR_FLOW_TRAP;
-            pkt->vp_flags |= VP_FLAG_FLOW_SET;
-            if (trap_res)
-                *trap_res = AGENT_TRAP_L3_PROTOCOLS;
-        }
+    router->vr_flow_aging = NULL;
+    vr_free(aging);
+
+    return;
+}
+
+static int
+vr_flow_aging_init(struct vrouter *router)
+{
+    unsigned int nsec;
+    struct vr_flow_aging *aging;
+
+    if (router->vr_flow_aging)
+        return 0;
+
+    if (!vr_flow_tcp_idle_timeout && !vr_flow_udp_idle_timeout &&
+            !vr_flow_other_idle_timeout && !vr_flow_tcp_closed_timeout)
+        return 0;
+
+    aging = vr_zalloc(sizeof(*aging));
+    if (!aging)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                sizeof(*aging));
+
+    vr_get_mono_time(&aging->vfa_clock, &nsec);
+    router->vr_flow_aging = aging;
+
+    router->vr_flow_hits = vr_btable_alloc(vr_flow_entries + vr_oflow_entries,
+            sizeof(uint32_t));
+    if (!router->vr_flow_hits)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                vr_flow_entries + vr_oflow_entries);
+
+    aging->vfa_timer = vr_zalloc(sizeof(*aging->vfa_timer));
+    if (!aging->vfa_timer)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+
+    aging->vfa_timer->vt_timer = vr_flow_aging_scan;
+    aging->vfa_timer->vt_vr_arg = router;
+    aging->vfa_timer->vt_msecs = VR_FLOW_AGING_SCAN_MSECS;
+    if (vr_create_timer(aging->vfa_timer)) {
+        vr_free(aging->vfa_timer);
+        aging->vfa_timer = NULL;
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    return 0;
+}
+
+/* in the scanner, which is not the only writer of the per-cpu slots */
+static void
+vr_flow_offload_stats_add(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index, uint64_t bytes, uint64_t packets)
+{
+    uint32_t new_stats;
+    struct vr_flow_cpu_stats *stats;
+
+    if (!packets)
+        return;
+
+    vr_flow_hit(router, index);
+
+    stats = vr_flow_cpu_stats_get(router, vr_get_cpu(), index);
+    if (stats) {
+        (void)__sync_add_and_fetch(&stats->fcs_bytes, bytes);
+        (void)__sync_add_and_fetch(&stats->fcs_packets, packets);
+        return;
     }
 
-    return res;
+    new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_bytes,
+            (uint32_t)bytes);
+    fe->fe_stats.flow_bytes_oflow += (bytes >> 32);
+    if (new_stats < (uint32_t)bytes)
+        fe->fe_stats.flow_bytes_oflow++;
+
+    new_stats = __sync_add_and_fetch(&fe->fe_stats.flow_packets,
+            (uint32_t)packets);
+    fe->fe_stats.flow_packets_oflow += (packets >> 32);
+    if (new_stats < (uint32_t)packets)
+        fe->fe_stats.flow_packets_oflow++;
+
+    return;
+}
+
+static void
+vr_flow_offload_takeback(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index)
+{
+    uint8_t tag;
+    uint64_t bytes = 0, packets = 0;
+    struct vr_flow_offload_state *state = router->vr_flow_offload;
+
+    if (!fe->fe_offload)
+        return;
+
+    /* a busy entry is being offloaded. the scanner undoes it */
+    tag = __sync_lock_test_and_set(&fe->fe_offload, 0);
+    if (!tag || tag == VR_FLOW_OFFLOAD_BUSY || !state)
+        return;
+
+    state->fos_ops->foo_del(router, index, &bytes, &packets);
+    vr_flow_offload_stats_add(router, fe, index, bytes, packets);
+
+    return;
 }
 
-unsigned int
-vr_flow_inet_input(struct vrouter *router, unsigned short vrf,
-        struct vr_packet *pkt, unsigned short proto,
-        struct vr_forwarding_md *fmd)
+/*
+ * what the engine needs to forward the flow, and the generation of the
+ * route table the nexthop was looked up in. fails for flows that need
+ * the datapath
+ */
+static int
+vr_flow_offload_fill(struct vrouter *router, struct vr_flow_entry *fe,
+        struct vr_flow_offload *fo, unsigned int *gen)
 {
-    struct vr_flow_key key, *key_p = &key;
-    struct vr_ip *ip;
-    struct vr_fragment *frag;
-    unsigned int flow_parse_res;
-    unsigned int trap_res  = 0;
-    unsigned short *t_hdr, sport, dport;
+    unsigned int dip;
+    unsigned short vrf;
+    struct vr_flow_entry *rfe;
+    struct vr_nexthop *nh;
+    struct vr_route_req rt;
 
-    /*
-     * interface is in a mode where it wants all packets to be received
-     * without doing lookups to figure out whether packets were destined
-     * to me or not
-     */
-    if (pkt->vp_flags & VP_FLAG_TO_ME)
-        return vr_ip_rcv(router, pkt, fmd);
+    if (!(fe->fe_flags & VR_FLOW_FLAG_ACTIVE) ||
+            (fe->fe_flags & (VR_FLOW_FLAG_MIRROR | VR_FLOW_FLAG_TRAP_MASK)) ||
+            fe->fe_ecmp_nh_index >= 0)
+        return -EINVAL;
 
-    ip = (struct vr_ip *)pkt_network_header(pkt);
-    /* if the packet is not a fragment, we easily know the sport, and dport */
-    if (vr_ip_transport_header_valid(ip)) {
-        t_hdr = (unsigned short *)((char *)ip + (ip->ip_hl * 4));
-        sport = *t_hdr;
-        dport = *(t_hdr + 1);
-    } else {
-        /* ...else, we need to get it from somewhere */
-        flow_parse_res = vr_flow_parse(router, NULL, pkt, &trap_res);
-        /* ...and it really matters only if we need to do a flow lookup */
-        if (flow_parse_res == VR_FLOW_LOOKUP) {
-            frag = vr_fragment_get(router, vrf, ip);
-            if (!frag) {
-                vr_pfree(pkt, VP_DROP_FRAGMENTS);
-                return 0;
-            }
-            sport = frag->f_sport;
-            dport = frag->f_dport;
-            if (vr_ip_fragment_tail(ip))
-                vr_fragment_del(frag);
-        } else {
-            /* 
-             * since there is no other way of deriving a key, set the
-             * key_p to NULL, indicating to code below that there is
-             * indeed no need for flow lookup
-             */
-            key_p = NULL;
+    if (fe->fe_action != VR_FLOW_ACTION_FORWARD &&
+            fe->fe_action != VR_FLOW_ACTION_NAT)
+        return -EINVAL;
+
+    vrf = fe->fe_key.key_vrf_id;
+    if (fe->fe_flags & VR_FLOW_FLAG_VRFT)
+        vrf = fe->fe_dvrf;
+
+    memset(fo, 0, sizeof(*fo));
+    memcpy(&fo->fo_key, &fe->fe_key, sizeof(fo->fo_key));
+    fo->fo_action = fe->fe_action;
+    fo->fo_vrf = vrf;
+    dip = fe->fe_key.key_dest_ip;
+
+    /* as vr_flow_nat, the rewrite is the key of the reverse flow */
+    if (fe->fe_action == VR_FLOW_ACTION_NAT) {
+        if (fe->fe_rflow < 0)
+            return -EINVAL;
+        rfe = vr_get_flow_entry(router, fe->fe_rflow);
+        if (!rfe || !(rfe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+            return -EINVAL;
+
+        fo->fo_flags = fe->fe_flags & VR_FLOW_FLAG_NAT_MASK;
+        if (fe->fe_flags & VR_FLOW_FLAG_SNAT)
+            fo->fo_nat_sip = rfe->fe_key.key_dest_ip;
+        if (fe->fe_flags & VR_FLOW_FLAG_DNAT) {
+            fo->fo_nat_dip = rfe->fe_key.key_src_ip;
+            dip = fo->fo_nat_dip;
         }
+        if (fe->fe_flags & VR_FLOW_FLAG_SPAT)
+            fo->fo_nat_sport = rfe->fe_key.key_dst_port;
+        if (fe->fe_flags & VR_FLOW_FLAG_DPAT)
+            fo->fo_nat_dport = rfe->fe_key.key_src_port;
     }
 
-    if (key_p) {
-        /* we have everything to make a key */
-        vr_get_flow_key(key_p, vrf, ip, sport, dport);
-        flow_parse_res = vr_flow_parse(router, key_p, pkt, &trap_res);
-        if (flow_parse_res == VR_FLOW_LOOKUP && vr_ip_fragment_head(ip))
-            vr_fragment_add(router, vrf, ip, key_p->key_src_port,
-                    key_p->key_dst_port);
+    if (!vr_inet_vrf_gen)
+        return -EOPNOTSUPP;
+    *gen = vr_inet_vrf_gen(vrf);
+    if (!*gen)
+        return -EINVAL;
 
-        if (flow_parse_res == VR_FLOW_BYPASS) {
-            return vr_flow_forward(vrf, pkt, proto, fmd);
-        } else if (flow_parse_res == VR_FLOW_TRAP) {
-            return vr_trap(pkt, vrf, trap_res, NULL);
-        }
+    rt.rtr_req.rtr_vrf_id = vrf;
+    rt.rtr_req.rtr_prefix = ntohl(dip);
+    rt.rtr_req.rtr_prefix_len = 32;
+    rt.rtr_req.rtr_nh_id = 0;
+    rt.rtr_req.rtr_label_flags = 0;
 
-        return vr_flow_lookup(router, key_p, pkt, proto, fmd);
-    }
+    nh = vr_inet_route_lookup(vrf, &rt, NULL);
+    if (!nh || (nh->nh_type != NH_TUNNEL && nh->nh_type != NH_ENCAP))
+        return -EOPNOTSUPP;
 
-    /* 
-     * ...come here, when there is not enough information to do a
-     * flow lookup
-     */
-    return vr_flow_forward(vrf, pkt, proto, fmd);
+    fo->fo_nh_id = nh->nh_id;
+    fo->fo_label = -1;
+    if (rt.rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)
+        fo->fo_label = rt.rtr_req.rtr_label;
+
+    return 0;
 }
 
 static void
-vr_flush_entry(struct vrouter *router, struct vr_flow_entry *fe,
-        struct vr_flow_md *flmd, struct vr_forwarding_md *fmd)
+vr_flow_offload_entry(struct vrouter *router, struct vr_flow_entry *fe,
+        unsigned int index)
 {
-    struct vr_list_node *head;
-    struct vr_packet_node *pnode;
+    uint8_t tag;
+    unsigned int gen;
+    uint64_t bytes = 0, packets = 0;
+    struct vr_flow_offload fo;
+    struct vr_flow_stats stats;
+    struct vr_flow_offload_ops *ops = router->vr_flow_offload->fos_ops;
+
+    tag = fe->fe_offload;
+    if (tag == VR_FLOW_OFFLOAD_BUSY)
+        return;
 
-    head = fe->fe_hold_list.node_p;
-    fe->fe_hold_list.node_p = NULL;
+    if (tag) {
+        if (vr_flow_offload_fill(router, fe, &fo, &gen) ||
+                VR_FLOW_OFFLOAD_TAG(gen) != tag) {
+            vr_flow_offload_takeback(router, fe, index);
+            return;
+        }
 
-    while (head) {
-        pnode = (struct vr_packet_node *)head;
-        if (fmd)
-            fmd->fmd_outer_src_ip = pnode->pl_outer_src_ip;
+        if (!ops->foo_stats(router, index, &bytes, &packets))
+            vr_flow_offload_stats_add(router, fe, index, bytes, packets);
+        return;
+    }
 
-        vr_flow_action(router, fe, flmd->flmd_index, pnode->pl_packet,
-                pnode->pl_proto, fmd);
+    if (!(fe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+        return;
 
-        head = pnode->pl_node.node_n;
-        vr_free(pnode);
+    vr_flow_get_stats(router, fe, index, &stats);
+    if ((((uint64_t)stats.flow_packets_oflow << 32) | stats.flow_packets) <
+            vr_flow_offload_packets)
+        return;
+
+    if (vr_flow_offload_fill(router, fe, &fo, &gen))
+        return;
+
+    if (!__sync_bool_compare_and_swap(&fe->fe_offload, 0,
+                VR_FLOW_OFFLOAD_BUSY))
+        return;
+
+    if (ops->foo_add(router, index, &fo)) {
+        (void)__sync_bool_compare_and_swap(&fe->fe_offload,
+                VR_FLOW_OFFLOAD_BUSY, 0);
+        return;
     }
 
+    /* taken back while being offloaded */
+    if (!__sync_bool_compare_and_swap(&fe->fe_offload, VR_FLOW_OFFLOAD_BUSY,
+                VR_FLOW_OFFLOAD_TAG(gen)))
+        ops->foo_del(router, index, &bytes, &packets);
+
     return;
 }
 
 static void
-vr_flow_flush(void *arg)
+vr_flow_offload_scan(void *arg)
 {
-    struct vrouter *router;
+    unsigned int i, index, total;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_flow_offload_state *state = router->vr_flow_offload;
     struct vr_flow_entry *fe;
-    struct vr_forwarding_md fmd;
-    struct vr_flow_md *flmd = 
-                (struct vr_flow_md *)arg;
 
-    router = flmd->flmd_router;
-    if (!router)
+    /* the index space is in flux */
+    if (!state || router->vr_flow_resize)
         return;
 
-    fe = vr_get_flow_entry(router, flmd->flmd_index);
-    if (!fe)
-        return;
+    total = vr_flow_entries + vr_oflow_entries;
+    for (i = 0; i < VR_FLOW_OFFLOAD_ENTRIES_PER_SCAN; i++) {
+        index = state->fos_cursor;
+        state->fos_cursor = (index + 1) % total;
 
-    vr_init_forwarding_md(&fmd);
-    vr_flow_set_forwarding_md(router, fe, flmd->flmd_index, &fmd);
+        fe = vr_get_flow_entry(router, index);
+        if (fe)
+            vr_flow_offload_entry(router, fe, index);
+    }
 
-    vr_flush_entry(router, fe, flmd, &fmd);
+    return;
+}
 
-    if (!(flmd->flmd_flags & VR_FLOW_FLAG_ACTIVE)) {
-        vr_reset_flow_entry(router, fe, flmd->flmd_index);
-    } 
+/* take all the flows back from the engine */
+static void
+vr_flow_offload_flush(struct vrouter *router)
+{
+    unsigned int i, total;
+    struct vr_flow_entry *fe;
+
+    if (!router->vr_flow_offload)
+        return;
+
+    total = vr_flow_entries + vr_oflow_entries;
+    for (i = 0; i < total; i++) {
+        fe = vr_get_flow_entry(router, i);
+        if (fe && fe->fe_offload)
+            vr_flow_offload_takeback(router, fe, i);
+    }
 
     return;
 }
 
 static void
-vr_flow_set_mirror(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+vr_flow_offload_exit(struct vrouter *router)
 {
-    struct vr_mirror_entry *mirror = NULL, *sec_mirror = NULL;
+    struct vr_flow_offload_state *state = router->vr_flow_offload;
 
-    if (!(req->fr_flags & VR_FLOW_FLAG_MIRROR) &&
-            (fe->fe_flags & VR_FLOW_FLAG_MIRROR)) {
-    	vr_flow_reset_mirror(router, fe, req->fr_index);
+    if (!state)
         return;
+
+    if (state->fos_timer) {
+        vr_delete_timer(state->fos_timer);
+        vr_free(state->fos_timer);
+        state->fos_timer = NULL;
     }
 
-    if (!(req->fr_flags & VR_FLOW_FLAG_MIRROR))
-        return;
+    vr_flow_offload_flush(router);
+    router->vr_flow_offload = NULL;
+    vr_delay_op();
+    vr_free(state);
 
-    if (fe->fe_mirror_id != req->fr_mir_id) {
-        if (fe->fe_mirror_id < router->vr_max_mirror_indices) {
-            vrouter_put_mirror(router, fe->fe_mirror_id);
-            fe->fe_mirror_id = router->vr_max_mirror_indices;
-        }
+    return;
+}
 
-        if ((unsigned int)req->fr_mir_id < router->vr_max_mirror_indices) {
-            mirror = vrouter_get_mirror(req->fr_rid, req->fr_mir_id);
-            if (mirror)
-                fe->fe_mirror_id = req->fr_mir_id;
+/*
+ * an engine registers with the router to be handed flows, and has to
+ * unregister before it goes away. one engine at a time
+ */
+int
+vr_flow_offload_register(struct vrouter *router,
+        struct vr_flow_offload_ops *ops)
+{
+    struct vr_flow_offload_state *state;
 
-            /* when we reached this point, we had already done all the
-             * sanity checks we could do. failing here will add only
-             * complexity to code here. so !mirror case, we will not
-             * handle
-             */
-        }
-    }
+    if (!router || !ops || !ops->foo_add || !ops->foo_del ||
+            !ops->foo_stats)
+        return -EINVAL;
 
-    if (fe->fe_sec_mirror_id != req->fr_sec_mir_id) {
-        if (fe->fe_sec_mirror_id < router->vr_max_mirror_indices) {
-            vrouter_put_mirror(router, fe->fe_sec_mirror_id);
-            fe->fe_sec_mirror_id = router->vr_max_mirror_indices;
-        }
+    if (router->vr_flow_offload)
+        return -EEXIST;
 
-        if ((unsigned int)req->fr_sec_mir_id < router->vr_max_mirror_indices) {
-            sec_mirror = vrouter_get_mirror(req->fr_rid, req->fr_sec_mir_id);
-            if (sec_mirror)
-                fe->fe_sec_mirror_id = req->fr_sec_mir_id;
-        }
+    if (!vr_flow_offload_packets)
+        return -EOPNOTSUPP;
+
+    state = vr_zalloc(sizeof(*state));
+    if (!state)
+        return -ENOMEM;
+    state->fos_ops = ops;
+
+    state->fos_timer = vr_zalloc(sizeof(*state->fos_timer));
+    if (!state->fos_timer)
+        goto fail;
+
+    state->fos_timer->vt_timer = vr_flow_offload_scan;
+    state->fos_timer->vt_vr_arg = router;
+    state->fos_timer->vt_msecs = VR_FLOW_OFFLOAD_SCAN_MSECS;
+
+    router->vr_flow_offload = state;
+    if (vr_create_timer(state->fos_timer)) {
+        router->vr_flow_offload = NULL;
+        goto fail;
     }
 
-    if (req->fr_pcap_meta_data_size && req->fr_pcap_meta_data)
-        vr_mirror_meta_entry_set(router, req->fr_index,
-                req->fr_mir_sip, req->fr_mir_sport,
-                req->fr_pcap_meta_data, req->fr_pcap_meta_data_size,
-                req->fr_mir_vrf);
+    return 0;
+
+fail:
+    if (state->fos_timer)
+        vr_free(state->fos_timer);
+    vr_free(state);
+
+    return -ENOMEM;
+}
+
+void
+vr_flow_offload_unregister(struct vrouter *router)
+{
+    if (router)
+        vr_flow_offload_exit(router);
 
     return;
 }
 
-static struct vr_flow_entry *
-vr_add_flow(unsigned int rid, struct vr_flow_key *key,
-        unsigned int *fe_index)
+/*
+ * online resize of the flow table. see struct vr_flow_resize for how the
+ * index space looks like while the entries are being moved
+ */
+#define VR_FLOW_RESIZE_MIRROR_TMP   0x80000000U
+
+static void
+vr_flow_resize_free(struct vr_flow_resize *resize)
 {
-    struct vr_flow_entry *flow_e;
-    struct vrouter *router = vrouter_get(rid);
+    if (!resize)
+        return;
 
-    flow_e = vr_find_flow(router, key, fe_index);
-    if (!flow_e)
-        flow_e = vr_find_free_entry(router, key, fe_index);
+    if (resize->vfr_table)
+        vr_btable_free(resize->vfr_table);
+    if (resize->vfr_tags)
+        vr_btable_free(resize->vfr_tags);
+    if (resize->vfr_remap)
+        vr_btable_free(resize->vfr_remap);
+    if (resize->vfr_timer)
+        vr_free(resize->vfr_timer);
+    vr_free(resize);
 
-    return flow_e;
+    return;
 }
 
-static struct vr_flow_entry *
-vr_add_flow_req(vr_flow_req *req, unsigned int *fe_index)
+/* index of an entry, once the resize is complete */
+static int
+vr_flow_resize_final_index(struct vr_flow_resize *resize, int index)
 {
-    struct vr_flow_key key;
+    uint32_t *remap;
+
+    if (index < 0)
+        return -1;
+
+    if ((unsigned int)index < resize->vfr_old_entries) {
+        remap = (uint32_t *)vr_btable_get(resize->vfr_remap, index);
+        if (!remap || !*remap)
+            return -1;
+        index = *remap;
+    }
+
+    if ((unsigned int)index >= resize->vfr_base)
+        return index - resize->vfr_base;
+
+    return index - resize->vfr_old_entries + resize->vfr_entries;
+}
+
+/*
+ * all the entries are in the new table and the overflow table. make the
+ * new table the flow table, and renumber the reverse flow indices and the
+ * mirror meta data (which is keyed by the flow index). runs from a work
+ * queue, since we need to wait for the datapath to let go of the old table
+ */
+static void
+vr_flow_resize_complete(void *arg)
+{
+    int index;
+    unsigned int i, old_index;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_flow_resize *resize = router->vr_flow_resize;
+    struct vr_btable *old_table, *old_tags, *old_hits, *new_hits;
+    struct vr_btable *old_nh_cache, *old_changes;
     struct vr_flow_entry *fe;
 
-    key.key_src_port = req->fr_flow_sport;
-    key.key_dst_port = req->fr_flow_dport;
-    key.key_src_ip = req->fr_flow_sip;
-    key.key_dest_ip = req->fr_flow_dip;
-    key.key_vrf_id = req->fr_flow_vrf;
-    key.key_proto = req->fr_flow_proto;
-    key.key_zero = 0;
+    if (!resize)
+        return;
+
+    vr_delete_timer(resize->vfr_timer);
+
+    /* park the meta data out of the index space, to avoid collisions */
+    for (i = resize->vfr_old_entries;
+            i < resize->vfr_base + resize->vfr_entries; i++) {
+        fe = vr_get_flow_entry(router, i);
+        if (fe && (fe->fe_flags & VR_FLOW_FLAG_ACTIVE) &&
+                (fe->fe_flags & VR_FLOW_FLAG_MIRROR))
+            vr_mirror_meta_entry_attach(router, i | VR_FLOW_RESIZE_MIRROR_TMP,
+                    vr_mirror_meta_entry_detach(router, i));
+    }
+
+    /* the hit times cover the new index space, and start afresh */
+    old_hits = router->vr_flow_hits;
+    new_hits = NULL;
+    if (old_hits) {
+        new_hits = vr_btable_alloc(resize->vfr_entries + vr_oflow_entries,
+                sizeof(uint32_t));
+        for (i = 0; new_hits && i < vr_btable_entries(new_hits); i++)
+            *(uint32_t *)vr_btable_get(new_hits, i) =
+                router->vr_flow_aging->vfa_clock;
+    }
+
+    /* the remembered route lookup results were for the old indices */
+    old_nh_cache = router->vr_flow_nh_cache;
+    if (old_nh_cache)
+        router->vr_flow_nh_cache =
+            vr_flow_nh_cache_alloc(resize->vfr_entries + vr_oflow_entries);
+
+    /* and so do the changes. readers see a new size, and start over */
+    old_changes = router->vr_flow_changes;
+    if (old_changes)
+        router->vr_flow_changes =
+            vr_flow_changes_alloc(resize->vfr_entries + vr_oflow_entries);
+
+    old_table = router->vr_flow_table;
+    old_tags = router->vr_flow_tags;
+    router->vr_flow_table = resize->vfr_table;
+    router->vr_flow_tags = resize->vfr_tags;
+    if (new_hits)
+        router->vr_flow_hits = new_hits;
+    vr_flow_entries = resize->vfr_entries;
+    /* the new table was not sharded */
+    vr_flow_nshards = 1;
+    router->vr_flow_resize = NULL;
+    (void)__sync_add_and_fetch(&router->vr_flow_cache_gen, 1);
+    vr_delay_op();
+
+    if (new_hits)
+        vr_btable_free(old_hits);
+    if (old_nh_cache)
+        vr_btable_free(old_nh_cache);
+    if (old_changes)
+        vr_btable_free(old_changes);
+
+    vr_mirror_meta_resize(router, vr_flow_entries + vr_oflow_entries);
+    for (i = 0; i < vr_flow_entries + vr_oflow_entries; i++) {
+        fe = vr_get_flow_entry(router, i);
+        if (!fe || !(fe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+            continue;
+
+        if (fe->fe_rflow >= 0) {
+            index = vr_flow_resize_final_index(resize, fe->fe_rflow);
+            fe->fe_rflow = index;
+            if (index < 0)
+                fe->fe_flags &= ~VR_RFLOW_VALID;
+        }
+
+        if (fe->fe_flags & VR_FLOW_FLAG_MIRROR) {
+            if (i < vr_flow_entries)
+                old_index = i + resize->vfr_base;
+            else
+                old_index = i - vr_flow_entries + resize->vfr_old_entries;
+            vr_mirror_meta_entry_attach(router, i,
+                    vr_mirror_meta_entry_detach(router,
+                        old_index | VR_FLOW_RESIZE_MIRROR_TMP));
+        }
+    }
+
+    vr_btable_free(old_table);
+    vr_btable_free(old_tags);
+    resize->vfr_table = NULL;
+    resize->vfr_tags = NULL;
+    vr_flow_resize_free(resize);
+
+    return;
+}
+
+static int
+vr_flow_resize_move_entry(struct vrouter *router,
+        struct vr_flow_resize *resize, struct vr_flow_entry *fe,
+        unsigned int index)
+{
+    unsigned int new_index;
+    uint16_t *tag;
+    uint32_t *remap;
+    struct vr_flow_entry *new_fe;
+
+    /* entries that hold packets are moved once they are resolved */
+    if (fe->fe_action == VR_FLOW_ACTION_HOLD ||
+            !vr_flow_queue_is_empty(router, fe))
+        return -EAGAIN;
+
+    new_fe = vr_find_free_entry(router, &fe->fe_key,
+            vr_flow_hash(&fe->fe_key), &new_index);
+    if (!new_fe)
+        return -ENOSPC;
+
+    /* the engine knows the flow by its old index */
+    vr_flow_offload_takeback(router, fe, index);
+    memcpy(new_fe, fe, sizeof(*fe));
+    new_fe->fe_rflow = vr_flow_resize_index(router, fe->fe_rflow);
+    if (fe->fe_flags & VR_FLOW_FLAG_MIRROR)
+        vr_mirror_meta_entry_attach(router, new_index,
+                vr_mirror_meta_entry_detach(router, index));
+
+    remap = (uint32_t *)vr_btable_get(resize->vfr_remap, index);
+    if (remap)
+        *remap = new_index;
 
-    fe = vr_add_flow(req->fr_rid, &key, fe_index);
-    if (fe)
-        req->fr_index = *fe_index;
+    /*
+     * the old entry is not reachable by lookups anymore. entries that
+     * point to it as the reverse flow get renumbered at the end
+     */
+    tag = vr_flow_tag_get(router, index);
+    if (tag)
+        *tag = 0;
+    fe->fe_flags &= ~VR_FLOW_FLAG_ACTIVE;
 
-    return fe;
+    return 0;
 }
 
-/*
- * can be called with 'fe' as null (specifically when flow is added from
- * agent), in which case we should be checking only the request
- */
-static int
-vr_flow_req_is_invalid(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+static void
+vr_flow_resize_scan(void *arg)
 {
-    struct vr_flow_entry *rfe;
+    unsigned int i;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_flow_resize *resize = router->vr_flow_resize;
+    struct vr_flow_entry *fe;
 
-    if (fe) {
-        if ((unsigned int)req->fr_flow_sip != fe->fe_key.key_src_ip ||
-                (unsigned int)req->fr_flow_dip != fe->fe_key.key_dest_ip ||
-                (unsigned short)req->fr_flow_sport != fe->fe_key.key_src_port ||
-                (unsigned short)req->fr_flow_dport != fe->fe_key.key_dst_port||
-                (unsigned short)req->fr_flow_vrf != fe->fe_key.key_vrf_id ||
-                (unsigned char)req->fr_flow_proto != fe->fe_key.key_proto) {
-            return -EBADF;
-        }
-    }
+    if (!resize || resize->vfr_done)
+        return;
 
-    if (req->fr_flags & VR_FLOW_FLAG_VRFT) {
-        if ((unsigned short)req->fr_flow_dvrf >= VR_MAX_VRFS)
-            return -EINVAL;
-    }
+    for (i = 0; i < VR_FLOW_RESIZE_ENTRIES_PER_SCAN &&
+            resize->vfr_cursor < resize->vfr_old_entries; i++) {
+        fe = vr_flow_table_entry_get(router, resize->vfr_cursor);
+        if (fe && (fe->fe_flags & VR_FLOW_FLAG_ACTIVE)) {
+            if (vr_flow_resize_move_entry(router, resize, fe,
+                        resize->vfr_cursor))
+                return;
+        }
 
-    if (req->fr_flags & VR_FLOW_FLAG_MIRROR) {
-        if (((unsigned int)req->fr_mir_id >= router->vr_max_mirror_indices) &&
-                (unsigned int)req->fr_sec_mir_id >= router->vr_max_mirror_indices)
-            return -EINVAL;
+        resize->vfr_cursor++;
     }
 
-    if (req->fr_flags & VR_RFLOW_VALID) {
-        rfe = vr_get_flow_entry(router, req->fr_rindex);
-        if (!rfe)
-            return -EINVAL;
+    if (resize->vfr_cursor >= resize->vfr_old_entries) {
+        resize->vfr_done = true;
+        vr_schedule_work(vr_get_cpu(), vr_flow_resize_complete,
+                (void *)router);
     }
 
-    if (!__vrouter_get_nexthop(router, req->fr_src_nh_index))
-        return -EINVAL;
-
-    return 0;
+    return;
 }
 
 static int
-vr_flow_schedule_transition(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+vr_flow_table_resize(struct vrouter *router, vr_flow_req *req)
 {
-    struct vr_flow_md *flmd = NULL;
+    int ret = -ENOMEM;
+    unsigned int entries = (unsigned int)req->fr_ftable_entries;
+    struct vr_flow_resize *resize;
 
-    flmd = (struct vr_flow_md *)vr_malloc(sizeof(*flmd));
-    if (!flmd)
+    if (!router)
+        return -EINVAL;
+
+    if (router->vr_flow_resize)
+        return -EBUSY;
+
+    /* the statistics tables are sized by the number of entries */
+    if (router->vr_flow_stats_table)
+        return -EOPNOTSUPP;
+
+    if (entries <= vr_flow_entries || (entries % VR_FLOW_ENTRIES_PER_BUCKET))
+        return -EINVAL;
+
+    resize = vr_zalloc(sizeof(*resize));
+    if (!resize)
         return -ENOMEM;
 
-    flmd->flmd_router = router;
-    flmd->flmd_index = req->fr_index;
-    flmd->flmd_action = req->fr_action;
-    flmd->flmd_flags = req->fr_flags;
+    resize->vfr_table = vr_btable_alloc(entries, sizeof(struct vr_flow_entry));
+    if (!resize->vfr_table)
+        goto exit_resize;
+
+    resize->vfr_tags = vr_btable_alloc(entries, sizeof(uint16_t));
+    if (!resize->vfr_tags)
+        goto exit_resize;
+
+    resize->vfr_remap = vr_btable_alloc(vr_flow_entries, sizeof(uint32_t));
+    if (!resize->vfr_remap)
+        goto exit_resize;
+
+    resize->vfr_timer = vr_zalloc(sizeof(*resize->vfr_timer));
+    if (!resize->vfr_timer)
+        goto exit_resize;
+
+    resize->vfr_entries = entries;
+    resize->vfr_old_entries = vr_flow_entries;
+    resize->vfr_base = vr_flow_entries + vr_oflow_entries;
+
+    resize->vfr_timer->vt_timer = vr_flow_resize_scan;
+    resize->vfr_timer->vt_vr_arg = router;
+    resize->vfr_timer->vt_msecs = VR_FLOW_RESIZE_SCAN_MSECS;
+
+    vr_flow_offload_flush(router);
+    router->vr_flow_resize = resize;
+    if (vr_create_timer(resize->vfr_timer)) {
+        router->vr_flow_resize = NULL;
+        goto exit_resize;
+    }
 
-    vr_schedule_work(vr_get_cpu(), vr_flow_flush, (void *)flmd);
     return 0;
+
+exit_resize:
+    vr_flow_resize_free(resize);
+    return ret;
 }
 
-static int
-vr_flow_delete(struct vrouter *router, vr_flow_req *req,
-        struct vr_flow_entry *fe)
+/* an unfinished resize is abandoned. the entries are flushed by now */
+static void
+vr_flow_resize_exit(struct vrouter *router)
 {
-    fe->fe_action = VR_FLOW_ACTION_DROP;
-    vr_flow_reset_mirror(router, fe, req->fr_index);
+    struct vr_flow_resize *resize = router->vr_flow_resize;
 
-    return vr_flow_schedule_transition(router, req, fe);
-}
+    if (!resize)
+        return;
 
+    vr_delete_timer(resize->vfr_timer);
+    router->vr_flow_resize = NULL;
+    vr_delay_op();
+    vr_flow_resize_free(resize);
 
-/* command from agent */
-static int
-vr_flow_set(struct vrouter *router, vr_flow_req *req)
+    return;
+}
+
+/* the entry is set up, except for the action and the reverse flow */
+static struct vr_flow_entry *
+vr_flow_restore_entry(struct vrouter *router, struct vr_flow_saved *saved,
+        unsigned int *index)
 {
-    int ret;
-    unsigned int fe_index;
-    struct vr_flow_entry *fe = NULL;
-    struct vr_flow_table_info *infop = router->vr_flow_table_info;
+    unsigned int hash;
+    struct vr_flow_entry *fe;
 
-    router = vrouter_get(req->fr_rid);
-    if (!router)
-        return -EINVAL;
+    if (saved->fsv_key.key_vrf_id >= VR_MAX_VRFS ||
+            saved->fsv_dvrf >= VR_MAX_VRFS ||
+            (saved->fsv_action != VR_FLOW_ACTION_DROP &&
+             saved->fsv_action != VR_FLOW_ACTION_FORWARD &&
+             saved->fsv_action != VR_FLOW_ACTION_NAT))
+        return NULL;
 
-    fe = vr_get_flow_entry(router, req->fr_index);
+    /* the agent was there first */
+    hash = vr_flow_hash(&saved->fsv_key);
+    if (__vr_find_flow(router, &saved->fsv_key, hash, index))
+        return NULL;
 
-    if ((ret = vr_flow_req_is_invalid(router, req, fe)))
-        return ret;
+    fe = vr_find_free_entry(router, &saved->fsv_key, hash, index);
+    if (!fe)
+        return NULL;
 
-    if (fe && (fe->fe_action == VR_FLOW_ACTION_HOLD) &&
-            ((req->fr_action != fe->fe_action) ||
-             !(req->fr_flags & VR_FLOW_FLAG_ACTIVE)))
-        __sync_fetch_and_add(&infop->vfti_action_count, 1);
-    /* 
-     * for delete, absence of the requested flow entry is caustic. so
-     * handle that case first
-     */
-    if (!(req->fr_flags & VR_FLOW_FLAG_ACTIVE)) {
-        if (!fe)
-            return -EINVAL;
-        return vr_flow_delete(router, req, fe);
-    }
+    fe->fe_dvrf = saved->fsv_dvrf;
+    fe->fe_src_nh_index = saved->fsv_src_nh_index;
+    fe->fe_ecmp_nh_index = saved->fsv_ecmp_nh_index;
+    fe->fe_tcp_flags = saved->fsv_tcp_flags;
+    fe->fe_flags |= saved->fsv_flags & ~(VR_FLOW_FLAG_ACTIVE |
+            VR_RFLOW_VALID | VR_FLOW_FLAG_MIRROR);
+    vr_flow_hit(router, *index);
 
+    return fe;
+}
 
-    /*
-     * for non-delete cases, absence of flow entry means addition of a
-     * new flow entry with the key specified in the request
-     */
-    if (!fe) {
-        fe = vr_add_flow_req(req, &fe_index);
-        if (!fe)
-            return -ENOSPC;
-    }
+static int
+vr_flow_table_restore(struct vrouter *router, vr_flow_req *req)
+{
+    unsigned int i, num, index, rindex;
+    struct vr_flow_saved *saved, *fsv, *rfsv;
+    struct vr_flow_entry *fe, *rfe;
 
-    vr_flow_set_mirror(router, req, fe);
+    if (!router || !router->vr_flow_table)
+        return -EINVAL;
 
-    if (req->fr_flags & VR_RFLOW_VALID) {
-        fe->fe_rflow = req->fr_rindex;
-    } else {
-        if (fe->fe_rflow >= 0)
-            fe->fe_rflow = -1;
-    }
+    if (!req->fr_restore ||
+            req->fr_restore_size % sizeof(struct vr_flow_saved))
+        return -EINVAL;
 
-    if (req->fr_flags & VR_FLOW_FLAG_VRFT) 
-        fe->fe_dvrf = req->fr_flow_dvrf;
+    saved = (struct vr_flow_saved *)req->fr_restore;
+    num = req->fr_restore_size / sizeof(struct vr_flow_saved);
+    for (i = 0; i < num; i++) {
+        fsv = &saved[i];
+        rfsv = NULL;
+        rfe = NULL;
+        if (fsv->fsv_saved_flags & VR_FLOW_SAVED_PAIR) {
+            if (++i >= num)
+                return -EINVAL;
+            rfsv = &saved[i];
+        }
 
-    fe->fe_ecmp_nh_index = req->fr_ecmp_nh_index;
-    fe->fe_src_nh_index = req->fr_src_nh_index;
-    fe->fe_action = req->fr_action;
-    fe->fe_flags = req->fr_flags; 
+        fe = vr_flow_restore_entry(router, fsv, &index);
+        if (!fe)
+            continue;
+
+        if (rfsv) {
+            rfe = vr_flow_restore_entry(router, rfsv, &rindex);
+            /* nat needs the reverse flow, let the agent set it up again */
+            if (!rfe && fsv->fsv_action == VR_FLOW_ACTION_NAT) {
+                vr_reset_flow_entry(router, fe, index);
+                continue;
+            }
+        }
+
+        if (rfe) {
+            fe->fe_rflow = rindex;
+            fe->fe_flags |= VR_RFLOW_VALID;
+            rfe->fe_rflow = index;
+            rfe->fe_flags |= VR_RFLOW_VALID;
+        }
 
+        /* the entries are complete before packets use them */
+        __sync_synchronize();
+        fe->fe_action = fsv->fsv_action;
+        vr_flow_changed(router, index);
+        if (rfe) {
+            rfe->fe_action = rfsv->fsv_action;
+            vr_flow_changed(router, rindex);
+        }
+    }
 
-    return vr_flow_schedule_transition(router, req, fe);
+    return 0;
 }
 
 /*
@@ -1075,22 +4190,89 @@ vr_flow_req_process(void *s_req)
 {
     int ret = 0;
     struct vrouter *router;
-    vr_flow_req *req = (vr_flow_req *)s_req;
+    vr_flow_req *req = (vr_flow_req *)s_req, *resp;
 
     router = vrouter_get(req->fr_rid);
     switch (req->fr_op) {
     case FLOW_OP_FLOW_TABLE_GET:
         req->fr_ftable_size = vr_flow_table_size(router) +
-            vr_oflow_table_size(router);
+            vr_oflow_table_size(router) + vr_flow_resize_table_size(router);
+        req->fr_ftable_stats_size = vr_flow_stats_table_size(router);
+        req->fr_ftable_event_size = vr_flow_event_table_size(router);
+        req->fr_ftable_agent_ring_size = vr_agent_ring_table_size(router);
+        req->fr_ftable_counters_size = vr_counters_table_size(router);
+        req->fr_ftable_changes_size = vr_flow_changes_table_size(router);
+        req->fr_ftable_shards = vr_flow_nshards;
+        vr_flow_cache_stats(router, req);
+        if (router->vr_flow_stats_table) {
+            req->fr_ftable_version = VR_FLOW_TABLE_FORMAT_SPLIT;
+            req->fr_ftable_stats_cpus = vr_num_cpus;
+        } else {
+            req->fr_ftable_version = VR_FLOW_TABLE_FORMAT_INLINE;
+        }
 #ifdef __KERNEL__
         req->fr_ftable_dev = vr_flow_major;
 #endif
+        ret = vr_flow_setup_stats_get(router, req);
+        if (!ret)
+            ret = vr_flow_probe_stats_get(router, req);
+        vr_message_response(VR_FLOW_OBJECT_ID, req, ret);
+        if (req->fr_hold_latency) {
+            vr_free(req->fr_hold_latency);
+            req->fr_hold_latency = NULL;
+            req->fr_hold_latency_size = 0;
+        }
+        if (req->fr_lookup_probes) {
+            vr_free(req->fr_lookup_probes);
+            req->fr_lookup_probes = NULL;
+            req->fr_lookup_probes_size = 0;
+        }
+        if (req->fr_insert_probes) {
+            vr_free(req->fr_insert_probes);
+            req->fr_insert_probes = NULL;
+            req->fr_insert_probes_size = 0;
+        }
+        return;
+
+    case FLOW_OP_FLOW_TABLE_RESIZE:
+        ret = vr_flow_table_resize(router, req);
         break;
 
     case FLOW_OP_FLOW_SET:
         ret = vr_flow_set(router, req);
         break;
 
+    case FLOW_OP_FLOW_SNAT_SET:
+        ret = vr_flow_snat_set(router, req);
+        break;
+
+    case FLOW_OP_FLOW_TABLE_RESTORE:
+        ret = vr_flow_table_restore(router, req);
+        break;
+
+    case FLOW_OP_FLOW_BULK_SET:
+    case FLOW_OP_FLOW_AGED_GET:
+        resp = vr_zalloc(sizeof(*resp));
+        if (!resp) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        resp->fr_op = req->fr_op;
+        resp->fr_rid = req->fr_rid;
+        if (req->fr_op == FLOW_OP_FLOW_BULK_SET)
+            ret = vr_flow_set_bulk(router, req, resp);
+        else
+            ret = vr_flow_aged_get(router, resp);
+
+        vr_message_response(VR_FLOW_OBJECT_ID, resp, ret);
+        if (resp->fr_bulk_error)
+            vr_free(resp->fr_bulk_error);
+        if (resp->fr_aged_index)
+            vr_free(resp->fr_aged_index);
+        vr_free(resp);
+        return;
+
     default:
         ret = -EINVAL;
     }
@@ -1142,9 +4324,87 @@ vr_flow_table_info_init(struct vrouter *router)
     return 0;
 }
 
+static void
+vr_flow_hold_pool_exit(struct vrouter *router)
+{
+    unsigned int i;
+
+    if (!router->vr_flow_hold_pool)
+        return;
+
+    for (i = 0; i < vr_num_cpus; i++)
+        if (router->vr_flow_hold_pool[i].fhp_nodes)
+            vr_btable_free(router->vr_flow_hold_pool[i].fhp_nodes);
+
+    vr_free(router->vr_flow_hold_pool);
+    router->vr_flow_hold_pool = NULL;
+
+    return;
+}
+
+static int
+vr_flow_hold_pool_init(struct vrouter *router)
+{
+    unsigned int i, j;
+    struct vr_flow_hold_pool *pool;
+    struct vr_flow_hold_node *node;
+
+    if (router->vr_flow_hold_pool)
+        return 0;
+
+    router->vr_flow_hold_pool = vr_zalloc(vr_num_cpus * sizeof(*pool));
+    if (!router->vr_flow_hold_pool)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, vr_num_cpus);
+
+    for (i = 0; i < vr_num_cpus; i++) {
+        pool = &router->vr_flow_hold_pool[i];
+        pool->fhp_nodes = vr_btable_alloc(VR_FLOW_HOLD_POOL_NODES,
+                sizeof(struct vr_flow_hold_node));
+        if (!pool->fhp_nodes)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, i);
+
+        for (j = 0; j < VR_FLOW_HOLD_POOL_NODES; j++) {
+            node = (struct vr_flow_hold_node *)vr_btable_get(pool->fhp_nodes, j);
+            node->fhn_cpu = i;
+            node->fhn_next = pool->fhp_free;
+            pool->fhp_free = node;
+        }
+    }
+
+    return 0;
+}
+
 static void
 vr_flow_table_destroy(struct vrouter *router)
 {
+    unsigned int i;
+
+    vr_flow_offload_exit(router);
+    vr_flow_snat_exit(router);
+    vr_flow_aging_exit(router);
+    vr_flow_hold_pool_exit(router);
+    vr_flow_miss_batch_exit(router);
+
+    if (router->vr_flow_cache) {
+        vr_free(router->vr_flow_cache);
+        router->vr_flow_cache = NULL;
+    }
+
+    if (router->vr_flow_setup_stats) {
+        vr_free(router->vr_flow_setup_stats);
+        router->vr_flow_setup_stats = NULL;
+    }
+
+    if (router->vr_flow_probe_stats) {
+        vr_free(router->vr_flow_probe_stats);
+        router->vr_flow_probe_stats = NULL;
+    }
+
+    if (router->vr_flow_nh_cache) {
+        vr_btable_free(router->vr_flow_nh_cache);
+        router->vr_flow_nh_cache = NULL;
+    }
+
     if (router->vr_flow_table) {
         vr_btable_free(router->vr_flow_table);
         router->vr_flow_table = NULL;
@@ -1155,6 +4415,35 @@ vr_flow_table_destroy(struct vrouter *router)
         router->vr_oflow_table = NULL;
     }
 
+    if (router->vr_flow_stats_table) {
+        for (i = 0; i < vr_num_cpus; i++)
+            vr_btable_free(router->vr_flow_stats_table[i]);
+        vr_free(router->vr_flow_stats_table);
+        router->vr_flow_stats_table = NULL;
+    }
+
+    if (router->vr_flow_event_table) {
+        for (i = 0; i < vr_num_cpus; i++)
+            vr_btable_free(router->vr_flow_event_table[i]);
+        vr_free(router->vr_flow_event_table);
+        router->vr_flow_event_table = NULL;
+    }
+
+    if (router->vr_flow_tags) {
+        vr_btable_free(router->vr_flow_tags);
+        router->vr_flow_tags = NULL;
+    }
+
+    if (router->vr_oflow_tags) {
+        vr_btable_free(router->vr_oflow_tags);
+        router->vr_oflow_tags = NULL;
+    }
+
+    if (router->vr_flow_changes) {
+        vr_btable_free(router->vr_flow_changes);
+        router->vr_flow_changes = NULL;
+    }
+
     vr_flow_table_info_destroy(router);
 
     return;
@@ -1178,6 +4467,10 @@ vr_flow_table_reset(struct vrouter *router)
         end += vr_btable_entries(router->vr_oflow_table);
     }
 
+    if (router->vr_flow_resize)
+        end = router->vr_flow_resize->vfr_base +
+            router->vr_flow_resize->vfr_entries;
+
     if (end) {
         vr_init_forwarding_md(&fmd);
         flmd.flmd_action = VR_FLOW_ACTION_DROP;
@@ -1199,31 +4492,165 @@ vr_flow_table_reset(struct vrouter *router)
 }
 
 
+/*
+ * a shard per numa node, if the host can allocate on a node, and if every
+ * shard is a whole number of btable partitions (so that none of it is on
+ * the memory of another node) and of buckets
+ */
+static unsigned int
+vr_flow_shard_count(void)
+{
+    int nodes;
+    unsigned int part_entries;
+
+    if (!vr_flow_shards || !vr_num_nodes || !vr_node_page_alloc)
+        return 1;
+
+    nodes = vr_num_nodes();
+    if (nodes > VR_MAX_NUMA_NODES)
+        nodes = VR_MAX_NUMA_NODES;
+    if (nodes <= 1)
+        return 1;
+
+    part_entries = VR_SINGLE_ALLOC_LIMIT / sizeof(struct vr_flow_entry);
+    if (vr_flow_entries % (nodes * part_entries)) {
+        vr_printf("vrouter: %u flow entries do not split into %d shards "
+                "of %u entries\n", vr_flow_entries, nodes, part_entries);
+        return 1;
+    }
+
+    return nodes;
+}
+
 static int
 vr_flow_table_init(struct vrouter *router)
 {
+    int ret;
+    unsigned int i;
+
     if (!router->vr_flow_table) {
         if (vr_flow_entries % VR_FLOW_ENTRIES_PER_BUCKET)
             return vr_module_error(-EINVAL, __FUNCTION__,
                     __LINE__, vr_flow_entries);
 
-        router->vr_flow_table = vr_btable_alloc(vr_flow_entries,
-                sizeof(struct vr_flow_entry));
-        if (!router->vr_flow_table) {
+        vr_flow_nshards = vr_flow_shard_count();
+        router->vr_flow_table = vr_btable_alloc_lazy_nodes(vr_flow_entries,
+                sizeof(struct vr_flow_entry), vr_flow_nshards);
+        if (!router->vr_flow_table || (vr_flow_prefault &&
+                    vr_btable_prefault(router->vr_flow_table))) {
             return vr_module_error(-ENOMEM, __FUNCTION__,
                     __LINE__, VR_DEF_FLOW_ENTRIES);
         }
     }
 
     if (!router->vr_oflow_table) {
-        router->vr_oflow_table = vr_btable_alloc(vr_oflow_entries,
+        router->vr_oflow_table = vr_btable_alloc_lazy(vr_oflow_entries,
                 sizeof(struct vr_flow_entry));
-        if (!router->vr_oflow_table) {
+        if (!router->vr_oflow_table || (vr_flow_prefault &&
+                    vr_btable_prefault(router->vr_oflow_table))) {
             return vr_module_error(-ENOMEM, __FUNCTION__,
                     __LINE__, VR_DEF_OFLOW_ENTRIES);
         }
     }
 
+    if (vr_flow_stats_split && !router->vr_flow_stats_table) {
+        router->vr_flow_stats_table = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_btable *));
+        if (!router->vr_flow_stats_table)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+
+        for (i = 0; i < vr_num_cpus; i++) {
+            router->vr_flow_stats_table[i] =
+                vr_btable_alloc(VR_FLOW_STATS_SLOTS, VR_FLOW_STATS_SLOT_SIZE);
+            if (!router->vr_flow_stats_table[i]) {
+                return vr_module_error(-ENOMEM, __FUNCTION__,
+                        __LINE__, i);
+            }
+        }
+    }
+
+    if (vr_flow_events && !router->vr_flow_event_table) {
+        router->vr_flow_event_table = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_btable *));
+        if (!router->vr_flow_event_table)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+
+        for (i = 0; i < vr_num_cpus; i++) {
+            router->vr_flow_event_table[i] =
+                vr_btable_alloc(VR_FLOW_EVENT_RING_SPAN /
+                        sizeof(struct vr_flow_event),
+                        sizeof(struct vr_flow_event));
+            if (!router->vr_flow_event_table[i]) {
+                return vr_module_error(-ENOMEM, __FUNCTION__,
+                        __LINE__, i);
+            }
+        }
+    }
+
+    if (!router->vr_flow_tags) {
+        router->vr_flow_tags = vr_btable_alloc(vr_flow_entries,
+                sizeof(uint16_t));
+        if (!router->vr_flow_tags) {
+            return vr_module_error(-ENOMEM, __FUNCTION__,
+                    __LINE__, vr_flow_entries);
+        }
+    }
+
+    if (!router->vr_oflow_tags) {
+        router->vr_oflow_tags = vr_btable_alloc(vr_oflow_entries,
+                sizeof(uint16_t));
+        if (!router->vr_oflow_tags) {
+            return vr_module_error(-ENOMEM, __FUNCTION__,
+                    __LINE__, vr_oflow_entries);
+        }
+    }
+
+    if (!router->vr_flow_changes) {
+        router->vr_flow_changes = vr_flow_changes_alloc(vr_flow_entries +
+                vr_oflow_entries);
+        if (!router->vr_flow_changes)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                    vr_flow_entries + vr_oflow_entries);
+    }
+
+    if ((ret = vr_flow_aging_init(router)))
+        return ret;
+
+    if ((ret = vr_flow_hold_pool_init(router)))
+        return ret;
+
+    if ((ret = vr_flow_miss_batch_init(router)))
+        return ret;
+
+    if (vr_flow_cache_enable && !router->vr_flow_cache) {
+        router->vr_flow_cache = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_flow_cache));
+        if (!router->vr_flow_cache)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    if (!router->vr_flow_setup_stats) {
+        router->vr_flow_setup_stats = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_flow_setup_stats));
+        if (!router->vr_flow_setup_stats)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    if (!router->vr_flow_probe_stats) {
+        router->vr_flow_probe_stats = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_flow_probe_stats));
+        if (!router->vr_flow_probe_stats)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    if (vr_flow_nh_cache_enable && !router->vr_flow_nh_cache) {
+        router->vr_flow_nh_cache = vr_flow_nh_cache_alloc(vr_flow_entries +
+                vr_oflow_entries);
+        if (!router->vr_flow_nh_cache)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                    vr_flow_entries + vr_oflow_entries);
+    }
+
     return vr_flow_table_info_init(router);
 }
 
@@ -1233,6 +4660,7 @@ void
 vr_flow_exit(struct vrouter *router, bool soft_reset)
 {
     vr_flow_table_reset(router);
+    vr_flow_resize_exit(router);
     if (!soft_reset) {
         vr_flow_table_destroy(router);
         vr_fragment_table_exit(router);
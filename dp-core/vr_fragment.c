@@ -11,6 +11,8 @@
 #define FRAG_TABLE_ENTRIES  1024
 #define FRAG_TABLE_BUCKETS  4
 #define FRAG_OTABLE_ENTRIES 512
+/* overflow entries looked at, from the hashed one, before giving up */
+#define FRAG_OTABLE_PROBES  16
 
 static inline void
 fragment_key(struct vr_fragment_key *key, unsigned short vrf,
@@ -25,20 +27,21 @@ fragment_key(struct vr_fragment_key *key, unsigned short vrf,
 }
 
 static inline void
-fragment_entry_set(struct vr_fragment *fe, unsigned short vrf, struct vr_ip *iph,
+fragment_entry_set(struct vr_fragment *fe, struct vr_fragment_key *key,
         unsigned short sport, unsigned short dport)
 {
     unsigned int sec, nsec;
 
-    fe->f_sip = iph->ip_saddr;
-    fe->f_dip = iph->ip_daddr;
-    fe->f_id = iph->ip_id;
-    fe->f_vrf = vrf;
+    memcpy(&fe->f_key, key, sizeof(*key));
     fe->f_sport = sport;
     fe->f_dport = dport;
     vr_get_mono_time(&sec, &nsec);
     fe->f_time = sec;
 
+    /* the entry has to be complete before the lookups can see it */
+    __sync_synchronize();
+    fe->f_state = VR_FRAG_STATE_ACTIVE;
+
     return;
 }
 
@@ -57,137 +60,381 @@ fragment_entry_get(struct vrouter *router, unsigned int index)
 static inline bool
 fragment_entry_alloc(struct vr_fragment *fe)
 {
-    return __sync_bool_compare_and_swap(&fe->f_dip, 0, 1);
+    return __sync_bool_compare_and_swap(&fe->f_state, VR_FRAG_STATE_FREE,
+            VR_FRAG_STATE_BUSY);
 }
 
 void
 vr_fragment_del(struct vr_fragment *fe)
 {
-    fe->f_dip = 0;
+    (void)__sync_bool_compare_and_swap(&fe->f_state, VR_FRAG_STATE_ACTIVE,
+            VR_FRAG_STATE_FREE);
 }
 
-int
-vr_fragment_add(struct vrouter *router, unsigned short vrf, struct vr_ip *iph,
-        unsigned short sport, unsigned short dport)
+/*
+ * expiry of the fragment entries. every table has a wheel of one second
+ * slots, and an entry is linked in the slot of the second it will expire
+ * in. the datapath pushes entries on to the slots without a lock and the
+ * scanner takes a whole slot at a time, so that a tick costs only the
+ * entries of the slots that are due. entries whose time was refreshed by
+ * a later fragment, or that expire more than a turn of the wheel away, are
+ * linked again in the slot of their new expiry
+ */
+#define FRAG_WHEEL_SLOTS    64
+
+/* seconds a fragment entry is held after the last fragment was seen */
+int vr_fragment_timeout = 1;
+
+struct scanner_params {
+    struct vrouter *sp_router;
+    struct vr_btable *sp_fragment_table;
+    unsigned int sp_num_entries;
+    uint64_t sp_last_tick;
+    unsigned int sp_wheel[FRAG_WHEEL_SLOTS];
+};
+
+static inline uint64_t
+fragment_expiry(struct vr_fragment *fe)
 {
-    unsigned int hash, index, i;
-    struct vr_fragment_key key;
+    unsigned int timeout = vr_fragment_timeout;
+
+    if (!timeout)
+        timeout = 1;
+
+    return fe->f_time + timeout + 1;
+}
+
+static void
+fragment_wheel_link(struct scanner_params *sp, struct vr_fragment *fe,
+        unsigned int index)
+{
+    unsigned int head, *slot;
+
+    slot = &sp->sp_wheel[fragment_expiry(fe) % FRAG_WHEEL_SLOTS];
+    do {
+        head = *slot;
+        fe->f_next = head;
+    } while (!__sync_bool_compare_and_swap(slot, head, index + 1));
+
+    return;
+}
+
+/* the entry is linked by whoever sets f_wheel, the datapath or the scanner */
+static void
+fragment_wheel_add(struct vr_timer *vtimer, struct vr_fragment *fe,
+        unsigned int index)
+{
+    if (!vtimer)
+        return;
+
+    if (__sync_bool_compare_and_swap(&fe->f_wheel, 0, 1))
+        fragment_wheel_link((struct scanner_params *)vtimer->vt_vr_arg,
+                fe, index);
+
+    return;
+}
+
+static void
+fragment_wheel_expire(struct scanner_params *sp, uint64_t tick)
+{
+    unsigned int index, next;
+    unsigned char state;
     struct vr_fragment *fe;
 
-    fragment_key(&key, vrf, iph);
-    hash = vr_hash(&key, sizeof(key), 0);
-    index = (hash % FRAG_TABLE_ENTRIES) * FRAG_TABLE_BUCKETS;
-    for (i = 0; i < FRAG_TABLE_BUCKETS; i++) {
-        fe = fragment_entry_get(router, index + i);
-        if (fe && !fe->f_dip  && fragment_entry_alloc(fe)) {
-            fragment_entry_set(fe, vrf, iph, sport, dport);
+    next = __sync_lock_test_and_set(&sp->sp_wheel[tick % FRAG_WHEEL_SLOTS], 0);
+    while (next) {
+        index = next - 1;
+        fe = vr_btable_get(sp->sp_fragment_table, index);
+        if (!fe)
             break;
-        } else {
-            fe = NULL;
+        next = fe->f_next;
+
+        state = fe->f_state;
+        if (state == VR_FRAG_STATE_ACTIVE && fragment_expiry(fe) > tick) {
+            fragment_wheel_link(sp, fe, index);
             continue;
         }
+
+        if (state == VR_FRAG_STATE_ACTIVE)
+            vr_fragment_del(fe);
+
+        /*
+         * an entry that the datapath allocated again while it was still
+         * linked here, has to be linked afresh
+         */
+        fe->f_wheel = 0;
+        __sync_synchronize();
+        if (fe->f_state == VR_FRAG_STATE_ACTIVE &&
+                __sync_bool_compare_and_swap(&fe->f_wheel, 0, 1))
+            fragment_wheel_link(sp, fe, index);
+    }
+
+    return;
+}
+
+static void
+fragment_hold_release(struct vrouter *router, struct vr_fragment_hold *fh)
+{
+    fh->fh_pkt = NULL;
+    (void)__sync_sub_and_fetch(&router->vr_fragment_held, 1);
+    __sync_synchronize();
+    fh->fh_state = VR_FRAG_HOLD_FREE;
+
+    return;
+}
+
+/*
+ * hold a non-head fragment whose head fragment is yet to come. returns 0 if
+ * the packet was held, and an error if the queue of this cpu is full
+ */
+int
+vr_fragment_enqueue(struct vrouter *router, unsigned short vrf,
+        struct vr_packet *pkt, unsigned short proto,
+        struct vr_forwarding_md *fmd)
+{
+    unsigned int i, sec, nsec;
+    struct vr_ip *iph = (struct vr_ip *)pkt_network_header(pkt);
+    struct vr_fragment_queue *vfq;
+    struct vr_fragment_hold *fh = NULL;
+
+    if (!router->vr_fragment_queue)
+        return -EINVAL;
+
+    vfq = &router->vr_fragment_queue[vr_get_cpu()];
+    for (i = 0; i < VR_FRAG_HOLD_ENTRIES; i++) {
+        fh = &vfq->vfq_holds[i];
+        if (fh->fh_state == VR_FRAG_HOLD_FREE &&
+                __sync_bool_compare_and_swap(&fh->fh_state,
+                    VR_FRAG_HOLD_FREE, VR_FRAG_HOLD_BUSY))
+            break;
     }
 
-    if (!fe) {
-        index = (hash % FRAG_OTABLE_ENTRIES);
-        for (i = 0; i < FRAG_OTABLE_ENTRIES; i++) {
-            fe = fragment_oentry_get(router, (index + i) % FRAG_OTABLE_ENTRIES);
-            if (fe && !fe->f_dip && fragment_entry_alloc(fe)) {
-                fragment_entry_set(fe, vrf, iph, sport, dport);
-                break;
-            } else {
-                fe = NULL;
+    if (i == VR_FRAG_HOLD_ENTRIES)
+        return -ENOSPC;
+
+    vr_get_mono_time(&sec, &nsec);
+    fragment_key(&fh->fh_key, vrf, iph);
+    fh->fh_pkt = pkt;
+    fh->fh_proto = proto;
+    fh->fh_time = sec;
+    if (fmd)
+        fh->fh_fmd = *fmd;
+    else
+        vr_init_forwarding_md(&fh->fh_fmd);
+
+    (void)__sync_add_and_fetch(&router->vr_fragment_held, 1);
+    __sync_synchronize();
+    fh->fh_state = VR_FRAG_HOLD_READY;
+
+    return 0;
+}
+
+/* the head of the held fragments has been seen. send them on their way */
+static void
+fragment_hold_flush(struct vrouter *router, struct vr_fragment_key *key)
+{
+    unsigned int cpu, i;
+    unsigned short proto;
+    struct vr_packet *pkt;
+    struct vr_fragment_hold *fh;
+    struct vr_forwarding_md fmd;
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        for (i = 0; i < VR_FRAG_HOLD_ENTRIES; i++) {
+            fh = &router->vr_fragment_queue[cpu].vfq_holds[i];
+            if (fh->fh_state != VR_FRAG_HOLD_READY ||
+                    memcmp(&fh->fh_key, key, sizeof(*key)))
                 continue;
-            }
+
+            if (!__sync_bool_compare_and_swap(&fh->fh_state,
+                        VR_FRAG_HOLD_READY, VR_FRAG_HOLD_BUSY))
+                continue;
+
+            pkt = fh->fh_pkt;
+            proto = fh->fh_proto;
+            fmd = fh->fh_fmd;
+            fragment_hold_release(router, fh);
+
+            vr_flow_inet_input(router, key->fk_vrf, pkt, proto, &fmd);
         }
     }
 
-    if (!fe)
-        return -ENOMEM;
+    return;
+}
 
-    return 0;
+/* drop the fragments held for longer than the timeout, or all of them */
+static void
+fragment_hold_expire(struct vrouter *router, bool all)
+{
+    unsigned int cpu, i, sec, nsec;
+    struct vr_packet *pkt;
+    struct vr_fragment_hold *fh;
+
+    if (!router->vr_fragment_queue || !router->vr_fragment_held)
+        return;
+
+    vr_get_mono_time(&sec, &nsec);
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        for (i = 0; i < VR_FRAG_HOLD_ENTRIES; i++) {
+            fh = &router->vr_fragment_queue[cpu].vfq_holds[i];
+            if (fh->fh_state != VR_FRAG_HOLD_READY)
+                continue;
+
+            if (!all && sec <= fh->fh_time + vr_fragment_timeout)
+                continue;
+
+            if (!__sync_bool_compare_and_swap(&fh->fh_state,
+                        VR_FRAG_HOLD_READY, VR_FRAG_HOLD_BUSY))
+                continue;
+
+            pkt = fh->fh_pkt;
+            fragment_hold_release(router, fh);
+            vr_pfree(pkt, VP_DROP_FRAGMENTS);
+        }
+    }
+
+    return;
 }
 
-struct vr_fragment *
-vr_fragment_get(struct vrouter *router, unsigned short vrf, struct vr_ip *iph)
-{   
-    unsigned int hash, index, i;
-    struct vr_fragment_key key;
+/* only active entries, with the whole key written, are matched */
+static struct vr_fragment *
+fragment_lookup(struct vrouter *router, struct vr_fragment_key *key,
+        unsigned int hash)
+{
+    unsigned int index, i;
     struct vr_fragment *fe;
-    unsigned int sec, nsec;
 
-    fragment_key(&key, vrf, iph);
-    hash = vr_hash(&key, sizeof(key), 0);
     index = (hash % FRAG_TABLE_ENTRIES) * FRAG_TABLE_BUCKETS;
     for (i = 0; i < FRAG_TABLE_BUCKETS; i++) {
         fe = fragment_entry_get(router, index + i);
-        if (fe && !memcmp((const void *)&key, (const void *)&(fe->f_key),
-                    sizeof(key)))
-            break;
+        if (fe && fe->f_state == VR_FRAG_STATE_ACTIVE &&
+                !memcmp((const void *)key, (const void *)&(fe->f_key),
+                    sizeof(*key)))
+            return fe;
+    }
+
+    index = (hash % FRAG_OTABLE_ENTRIES);
+    for (i = 0; i < FRAG_OTABLE_PROBES; i++) {
+        fe = fragment_oentry_get(router, (index + i) % FRAG_OTABLE_ENTRIES);
+        if (fe && fe->f_state == VR_FRAG_STATE_ACTIVE &&
+                !memcmp((const void *)key, (const void *)&(fe->f_key),
+                    sizeof(*key)))
+            return fe;
     }
 
-    if (i == FRAG_TABLE_BUCKETS) {
-        index = (hash % FRAG_OTABLE_ENTRIES);
-        for (i = 0; i < FRAG_OTABLE_ENTRIES; i++) {
-            fe = fragment_oentry_get(router, (index + i) % FRAG_OTABLE_ENTRIES);
-            if (fe && !memcmp((const void *)&key, (const void *)&(fe->f_key),
-                        sizeof(key)))
-                break;
+    return NULL;
+}
+
+/*
+ * an entry is claimed with a compare and swap of its state, written, and
+ * only then made active for the lookups to see
+ */
+static struct vr_fragment *
+fragment_insert(struct vrouter *router, struct vr_fragment_key *key,
+        unsigned int hash, unsigned short sport, unsigned short dport)
+{
+    unsigned int index, i;
+    struct vr_fragment *fe;
+
+    index = (hash % FRAG_TABLE_ENTRIES) * FRAG_TABLE_BUCKETS;
+    for (i = 0; i < FRAG_TABLE_BUCKETS; i++) {
+        fe = fragment_entry_get(router, index + i);
+        if (fe && fe->f_state == VR_FRAG_STATE_FREE &&
+                fragment_entry_alloc(fe)) {
+            fragment_entry_set(fe, key, sport, dport);
+            fragment_wheel_add(router->vr_fragment_table_scanner, fe,
+                    index + i);
+            return fe;
         }
+    }
 
-        if (i == FRAG_OTABLE_ENTRIES)
-            fe = NULL;
+    index = (hash % FRAG_OTABLE_ENTRIES);
+    for (i = 0; i < FRAG_OTABLE_PROBES; i++) {
+        fe = fragment_oentry_get(router, (index + i) % FRAG_OTABLE_ENTRIES);
+        if (fe && fe->f_state == VR_FRAG_STATE_FREE &&
+                fragment_entry_alloc(fe)) {
+            fragment_entry_set(fe, key, sport, dport);
+            fragment_wheel_add(router->vr_fragment_otable_scanner, fe,
+                    (index + i) % FRAG_OTABLE_ENTRIES);
+            return fe;
+        }
     }
 
+    return NULL;
+}
+
+int
+vr_fragment_add(struct vrouter *router, unsigned short vrf, struct vr_ip *iph,
+        unsigned short sport, unsigned short dport)
+{
+    unsigned int hash, sec, nsec;
+    struct vr_fragment_key key;
+    struct vr_fragment *fe;
+
+    fragment_key(&key, vrf, iph);
+    hash = vr_keyed_hash(&key, sizeof(key));
+
+    /* a head that is seen again, only refreshes the entry */
+    fe = fragment_lookup(router, &key, hash);
     if (fe) {
+        fe->f_sport = sport;
+        fe->f_dport = dport;
         vr_get_mono_time(&sec, &nsec);
         fe->f_time = sec;
+    } else {
+        fe = fragment_insert(router, &key, hash, sport, dport);
+        if (!fe)
+            return -ENOMEM;
     }
 
-    return fe;;
-}
-
-#define ENTRIES_PER_SCAN    64
+    if (router->vr_fragment_held)
+        fragment_hold_flush(router, &key);
 
-struct scanner_params {
-    struct vrouter *sp_router;
-    struct vr_btable *sp_fragment_table;
-    unsigned int sp_num_entries;
-    int sp_last_scanned_entry;
-};
+    return 0;
+}
 
-static void
-fragment_reap(struct vr_btable *table, int start,
-        unsigned int num_entries)
-{
-    unsigned int i;
+struct vr_fragment *
+vr_fragment_get(struct vrouter *router, unsigned short vrf, struct vr_ip *iph)
+{   
+    struct vr_fragment_key key;
     struct vr_fragment *fe;
     unsigned int sec, nsec;
 
-    vr_get_mono_time(&sec, &nsec);
-
-    for (i = 0; i < ENTRIES_PER_SCAN; i++) {
-        fe = vr_btable_get(table, (start + i) % num_entries);
-        if (fe && fe->f_dip) {
-            if (sec > fe->f_time + 1)
-                vr_fragment_del(fe);
-        }
+    fragment_key(&key, vrf, iph);
+    fe = fragment_lookup(router, &key, vr_keyed_hash(&key, sizeof(key)));
+    if (fe) {
+        vr_get_mono_time(&sec, &nsec);
+        fe->f_time = sec;
     }
 
-
-    return;
+    return fe;
 }
 
 static void
 fragment_table_scanner(void *arg)
 {
+    uint64_t tick;
+    unsigned int sec, nsec;
     struct scanner_params *sp = (struct scanner_params *)arg;
 
-    fragment_reap(sp->sp_fragment_table, sp->sp_last_scanned_entry + 1,
-            sp->sp_num_entries);
+    vr_get_mono_time(&sec, &nsec);
+    if (!sp->sp_last_tick)
+        sp->sp_last_tick = sec;
+
+    /* catch up on the seconds that a late timer skipped, a turn at most */
+    tick = sp->sp_last_tick;
+    if (tick > sec)
+        return;
+
+    if (sec - tick > FRAG_WHEEL_SLOTS)
+        tick = sec - FRAG_WHEEL_SLOTS;
+
+    for (; tick <= sec; tick++)
+        fragment_wheel_expire(sp, tick);
+
+    sp->sp_last_tick = sec + 1;
 
-    sp->sp_last_scanned_entry += ENTRIES_PER_SCAN;
-    sp->sp_last_scanned_entry %= sp->sp_num_entries;
+    fragment_hold_expire(sp->sp_router, false);
 
     return;
 }
@@ -213,7 +460,6 @@ fragment_table_scanner_init(struct vrouter *router, struct vr_btable *table)
     scanner->sp_router = router;
     scanner->sp_fragment_table = table;
     scanner->sp_num_entries = num_entries;
-    scanner->sp_last_scanned_entry = -1;
 
     vtimer = vr_malloc(sizeof(*vtimer));
     if (!vtimer) {
@@ -264,6 +510,12 @@ vr_fragment_table_exit(struct vrouter *router)
 {   
     vr_fragment_table_scanner_exit(router);
 
+    if (router->vr_fragment_queue) {
+        fragment_hold_expire(router, true);
+        vr_free(router->vr_fragment_queue);
+        router->vr_fragment_queue = NULL;
+    }
+
     if (router->vr_fragment_table)
         vr_btable_free(router->vr_fragment_table);
     if (router->vr_fragment_otable)
@@ -315,6 +567,14 @@ vr_fragment_table_init(struct vrouter *router)
                     __LINE__, num_entries);
     }
 
+    if (!router->vr_fragment_queue) {
+        router->vr_fragment_queue = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_fragment_queue));
+        if (!router->vr_fragment_queue)
+            return vr_module_error(-ENOMEM, __FUNCTION__,
+                    __LINE__, vr_num_cpus);
+    }
+
     if ((ret = vr_fragment_table_scanner_init(router)))
         return ret;
 
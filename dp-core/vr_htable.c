@@ -6,16 +6,202 @@
 #include <vr_btable.h>
 
 #define VR_HENTRIES_PER_BUCKET 4
+/* overflow buckets that a bucket of the hash table chains, at most */
+#define VR_HTABLE_MAX_CHAIN    8
+
+/*
+ * the overflow table is made of buckets too, that are chained to the
+ * bucket of the hash table that ran out of entries. a lookup looks at
+ * the bucket and its chain, and not at the whole of the overflow table.
+ * entries are marked in use by the users of the table (is_valid_entry),
+ * so overflow buckets are taken back lazily, when they are at the end
+ * of a chain and none of their entries are in use
+ */
+struct vr_htable_olink {
+    /* the next overflow bucket in the chain, + 1 */
+    unsigned int ol_next;
+    /* the bucket of the hash table that this is chained to, + 1 */
+    unsigned int ol_owner;
+};
+
 struct vr_htable {
     unsigned int hentries;
     unsigned int oentries;
+    unsigned int obuckets;
+    /* where the search for a free overflow bucket starts */
+    unsigned int ocursor;
     unsigned int entry_size;
     unsigned int key_size;
     struct vr_btable *htable;
     struct vr_btable *otable;
+    /* the first overflow bucket, + 1, of every bucket of the hash table */
+    struct vr_btable *ochain;
+    struct vr_btable *olinks;
+    /* a bit per entry that may be in use. see vr_htable_iter */
+    struct vr_btable *used;
     is_hentry_valid is_valid_entry;
 };
 
+#define VR_HTABLE_USED_BITS     64
+
+static vr_hentry_t
+vr_htable_entry(struct vr_htable *table, unsigned int index)
+{
+    if (index < table->hentries)
+        return vr_btable_get(table->htable, index);
+
+    index -= table->hentries;
+    if (index < table->oentries)
+        return vr_btable_get(table->otable, index);
+
+    return NULL;
+}
+
+static inline struct vr_htable_olink *
+vr_htable_olink(struct vr_htable *table, unsigned int obucket)
+{
+    return (struct vr_htable_olink *)vr_btable_get(table->olinks, obucket);
+}
+
+static inline unsigned int *
+vr_htable_ochain(struct vr_htable *table, unsigned int bucket)
+{
+    return (unsigned int *)vr_btable_get(table->ochain, bucket);
+}
+
+static inline unsigned int
+vr_htable_bucket(struct vr_htable *table, void *key)
+{
+    unsigned int hash;
+
+    hash = vr_keyed_hash(key, table->key_size);
+    return (hash % table->hentries) / VR_HENTRIES_PER_BUCKET;
+}
+
+/* index of the first entry of an overflow bucket */
+static inline unsigned int
+vr_htable_obucket_start(struct vr_htable *table, unsigned int obucket)
+{
+    return table->hentries + obucket * VR_HENTRIES_PER_BUCKET;
+}
+
+/*
+ * the entry with the key, in the bucket of the key or in its chain.
+ * 'skip' is an entry that should not be matched
+ */
+static vr_hentry_t
+__vr_find_hentry(struct vr_htable *table, void *key, unsigned int bucket,
+        vr_hentry_t skip, unsigned int *index)
+{
+    unsigned int i, ind, start, next, depth;
+    vr_hentry_t ent;
+
+    start = bucket;
+    next = *vr_htable_ochain(table, start);
+    start *= VR_HENTRIES_PER_BUCKET;
+
+    for (depth = 0; ; depth++) {
+        for (i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
+            ind = start + i;
+            ent = vr_htable_entry(table, ind);
+            if (table->is_valid_entry((vr_htable_t)table, ent, ind) == false)
+                continue;
+            if (ent == skip || memcmp(ent, key, table->key_size))
+                continue;
+
+            if (index)
+                *index = ind;
+            return ent;
+        }
+
+        if (!next || depth >= VR_HTABLE_MAX_CHAIN)
+            break;
+
+        start = vr_htable_obucket_start(table, next - 1);
+        next = vr_htable_olink(table, next - 1)->ol_next;
+    }
+
+    return NULL;
+}
+
+static inline void
+vr_htable_mark_used(struct vr_htable *table, unsigned int index)
+{
+    uint64_t *word;
+
+    word = (uint64_t *)vr_btable_get(table->used,
+            index / VR_HTABLE_USED_BITS);
+    if (word)
+        (void)__sync_fetch_and_or(word,
+                1ULL << (index % VR_HTABLE_USED_BITS));
+
+    return;
+}
+
+static bool
+vr_htable_obucket_free(struct vr_htable *table, unsigned int obucket)
+{
+    unsigned int i, ind;
+
+    for (i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
+        ind = vr_htable_obucket_start(table, obucket) + i;
+        if (table->is_valid_entry((vr_htable_t)table,
+                    vr_htable_entry(table, ind), ind) == true)
+            return false;
+    }
+
+    return true;
+}
+
+/* take the overflow bucket out of the chain it is at the end of */
+static void
+vr_htable_obucket_unlink(struct vr_htable *table, unsigned int obucket)
+{
+    unsigned int depth, *next;
+    struct vr_htable_olink *link = vr_htable_olink(table, obucket);
+
+    next = vr_htable_ochain(table, link->ol_owner - 1);
+    for (depth = 0; *next && depth <= VR_HTABLE_MAX_CHAIN; depth++) {
+        if (*next == obucket + 1) {
+            *next = 0;
+            break;
+        }
+        next = &vr_htable_olink(table, *next - 1)->ol_next;
+    }
+
+    link->ol_owner = 0;
+    return;
+}
+
+/*
+ * an overflow bucket that is not chained, or one that no entries are in
+ * use in and that is at the end of its chain. lookups that are on the
+ * latter will at most walk into the chain it goes to next
+ */
+static int
+vr_htable_obucket_alloc(struct vr_htable *table, unsigned int bucket)
+{
+    unsigned int i, obucket;
+    struct vr_htable_olink *link;
+
+    for (i = 0; i < table->obuckets; i++) {
+        obucket = (table->ocursor + i) % table->obuckets;
+        link = vr_htable_olink(table, obucket);
+        if (link->ol_owner) {
+            if (link->ol_next || !vr_htable_obucket_free(table, obucket))
+                continue;
+            vr_htable_obucket_unlink(table, obucket);
+        }
+
+        link->ol_next = 0;
+        link->ol_owner = bucket + 1;
+        table->ocursor = obucket + 1;
+        return obucket;
+    }
+
+    return -1;
+}
+
 void 
 vr_htable_trav(vr_htable_t htable, unsigned int marker, htable_trav_cb cb, 
                                                                 void *data)
@@ -27,22 +213,10 @@ vr_htable_trav(vr_htable_t htable, unsigned int marker, htable_trav_cb cb,
     if (!table || !cb)
         return;
 
-    if (marker < table->hentries) {
-        for (i = marker; i < table->hentries; i++) {
-            ent = vr_btable_get(table->htable, i);
-            if(ent && table->is_valid_entry(htable, ent, i) == true) 
-                cb(htable, ent, i, data);
-        }
-    }
-
-    marker -= table->hentries;
-    if (marker < table->oentries) {
-        for (i = marker; i < table->oentries; i++) {
-            ent = vr_btable_get(table->htable, i);
-            if(ent && table->is_valid_entry(htable, ent, 
-                        (i + table->hentries)) == true) 
-                cb(htable, ent, (i + table->hentries), data);
-        }
+    for (i = marker; i < table->hentries + table->oentries; i++) {
+        ent = vr_htable_entry(table, i);
+        if (ent && table->is_valid_entry(htable, ent, i) == true)
+            cb(htable, ent, i, data);
     }
 }
 
@@ -50,37 +224,112 @@ vr_hentry_t
 vr_find_free_hentry(vr_htable_t htable, void *key, unsigned int *index)
 {
     struct vr_htable *table = (struct vr_htable *)htable;
-    unsigned int hash, tmp_hash, i, ind;
+    unsigned int bucket, start, depth, i, ind, *next;
+    int obucket;
     vr_hentry_t ent;
 
     if (!table || !key)
         return NULL;
 
-    hash = vr_hash(key, table->key_size, 0);
-    tmp_hash = hash % table->hentries;
-    tmp_hash &= ~(VR_HENTRIES_PER_BUCKET - 1);
-    for(i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
-        ind = tmp_hash + i;
-        ent = vr_btable_get(table->htable, ind);
-        if (table->is_valid_entry(htable, ent, ind) == false) {
-            if (index)
-                *index = ind;
-            return ent;
+    bucket = vr_htable_bucket(table, key);
+    start = bucket * VR_HENTRIES_PER_BUCKET;
+    next = vr_htable_ochain(table, bucket);
+
+    for (depth = 0; ; depth++) {
+        for (i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
+            ind = start + i;
+            ent = vr_htable_entry(table, ind);
+            if (table->is_valid_entry(htable, ent, ind) == false) {
+                vr_htable_mark_used(table, ind);
+                if (index)
+                    *index = ind;
+                return ent;
+            }
         }
+
+        if (!*next)
+            break;
+        if (depth >= VR_HTABLE_MAX_CHAIN)
+            return NULL;
+
+        start = vr_htable_obucket_start(table, *next - 1);
+        next = &vr_htable_olink(table, *next - 1)->ol_next;
     }
 
-    tmp_hash = hash % table->oentries;
-    for(i = 0; i < table->oentries; i++) {
-        ent = vr_btable_get(table->otable, ((tmp_hash + i) % table->oentries));
-        ind = table->hentries + ((tmp_hash + i) % table->oentries);
-        if (table->is_valid_entry(htable, ent, ind) == false) {
-            if (index)
-                *index = ind;
-            return ent;
+    if (depth >= VR_HTABLE_MAX_CHAIN)
+        return NULL;
+
+    obucket = vr_htable_obucket_alloc(table, bucket);
+    if (obucket < 0)
+        return NULL;
+
+    /* the bucket is set up before lookups can get to it */
+    __sync_synchronize();
+    *next = obucket + 1;
+
+    ind = vr_htable_obucket_start(table, obucket);
+    vr_htable_mark_used(table, ind);
+    if (index)
+        *index = ind;
+
+    return vr_htable_entry(table, ind);
+}
+
+/*
+ * up to 'num' entries in use (and their indices), from the index in
+ * 'cursor' on, which is moved past them. the caller keeps the cursor
+ * between calls, and across dump requests. 0 at the end of the table.
+ *
+ * the entries that vr_find_free_hentry handed out are marked in a bitmap,
+ * so that the walk skips the parts of the table that were never used.
+ * the bits of entries that are found not in use anymore are cleared here
+ * (and are looked at once more, for an entry that is just being added),
+ * so a walk takes time in proportion to the entries in use
+ */
+unsigned int
+vr_htable_iter(vr_htable_t htable, unsigned int *cursor, vr_hentry_t *ents,
+        unsigned int *indices, unsigned int num)
+{
+    unsigned int i, bit, count = 0, entries;
+    uint64_t *word, bits, mask;
+    vr_hentry_t ent;
+    struct vr_htable *table = (struct vr_htable *)htable;
+
+    if (!table || !cursor)
+        return 0;
+
+    entries = table->hentries + table->oentries;
+    i = *cursor;
+    while (i < entries && count < num) {
+        word = (uint64_t *)vr_btable_get(table->used, i / VR_HTABLE_USED_BITS);
+        bits = *word >> (i % VR_HTABLE_USED_BITS);
+        if (!bits) {
+            i = (i / VR_HTABLE_USED_BITS + 1) * VR_HTABLE_USED_BITS;
+            continue;
         }
+
+        bit = __builtin_ctzll(bits);
+        i += bit;
+        if (i >= entries)
+            break;
+
+        ent = vr_htable_entry(table, i);
+        if (table->is_valid_entry(htable, ent, i) == true) {
+            ents[count] = ent;
+            if (indices)
+                indices[count] = i;
+            count++;
+        } else {
+            mask = 1ULL << (i % VR_HTABLE_USED_BITS);
+            (void)__sync_fetch_and_and(word, ~mask);
+            if (table->is_valid_entry(htable, ent, i) == true)
+                (void)__sync_fetch_and_or(word, mask);
+        }
+        i++;
     }
 
-    return NULL;
+    *cursor = i;
+    return count;
 }
 
 vr_hentry_t
@@ -88,55 +337,24 @@ vr_get_hentry_by_index(vr_htable_t htable, unsigned int index)
 {
     struct vr_htable *table = (struct vr_htable *)htable;
 
-    if (!table || index < 0)
+    if (!table)
         return NULL;
 
-    if (index < table->hentries)
-        return vr_btable_get(table->htable, index);
-
-    if (index < table->oentries)
-        return vr_btable_get(table->otable, (index - table->hentries));
-
-    return NULL;
+    return vr_htable_entry(table, index);
 }
 
 int
 vr_find_duplicate_hentry_index(vr_htable_t htable, vr_hentry_t hentry)
 {
-    unsigned int hash, tmp_hash, ind, i;
-    vr_hentry_t ent;
+    unsigned int ind;
     struct vr_htable *table = (struct vr_htable *)htable;
 
     if (!table || !hentry)
         return -1;
 
-    hash = vr_hash(hentry, table->key_size, 0);
-
-    /* Look into the hash table from hash, VR_HENTRIES_PER_BUCKET */
-    tmp_hash = hash % table->hentries;
-    tmp_hash &= ~(VR_HENTRIES_PER_BUCKET - 1);
-    for(i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
-        ind = tmp_hash + i;
-        ent = vr_btable_get(table->htable, ind);
-        if (table->is_valid_entry(htable, ent, ind) == false)
-            continue;
-        if ((ent == hentry) || (memcmp(ent, hentry, table->key_size) != 0)) 
-            continue;
+    if (__vr_find_hentry(table, hentry, vr_htable_bucket(table, hentry),
+                hentry, &ind))
         return ind;
-    }
-
-    /* Look into the complete over flow table starting from hash*/
-    tmp_hash = hash % table->oentries;
-    for(i = 0; i < table->oentries; i++) {
-        ind = table->hentries + ((tmp_hash + i) % table->oentries);
-        ent = vr_btable_get(table->otable, ((tmp_hash + i) % table->oentries));
-        if (table->is_valid_entry(htable, ent, ind) == false)
-            continue;
-        if ((ent == hentry) || (memcmp(ent, hentry, table->key_size) != 0))
-            continue;
-
-        return ind;
-    }
 
     /* No duplicate entry is found */
     return -1;
@@ -145,46 +363,44 @@ vr_find_duplicate_hentry_index(vr_htable_t htable, vr_hentry_t hentry)
 vr_hentry_t
 vr_find_hentry(vr_htable_t htable, void *key, unsigned int *index)
 {
-    unsigned int hash, tmp_hash, ind, i;
-    vr_hentry_t ent;
     struct vr_htable *table = (struct vr_htable *)htable;
 
     if (!table || !key)
         return NULL;
 
-    hash = vr_hash(key, table->key_size, 0);
+    return __vr_find_hentry(table, key, vr_htable_bucket(table, key), NULL,
+            index);
+}
 
-    /* Look into the hash table from hash, VR_HENTRIES_PER_BUCKET */
-    tmp_hash = hash % table->hentries;
-    tmp_hash &= ~(VR_HENTRIES_PER_BUCKET - 1);
-    for(i = 0; i < VR_HENTRIES_PER_BUCKET; i++) {
-        ind = tmp_hash + i;
-        ent = vr_btable_get(table->htable, ind);
-        if (table->is_valid_entry(htable, ent, ind) == false)
-            continue;
-        if (memcmp(ent, key, table->key_size) == 0) {
-            if (index)
-                *index = ind;
-            return ent;
-        }
-    }
+/*
+ * for lookups of a batch of keys: hash the key and prefetch its bucket,
+ * doing the same for the rest of the batch, and then look them up with
+ * vr_find_hentry_in_bucket and the returned bucket
+ */
+unsigned int
+vr_htable_prefetch(vr_htable_t htable, void *key)
+{
+    unsigned int bucket, start;
+    struct vr_htable *table = (struct vr_htable *)htable;
 
-    /* Look into the complete over flow table starting from hash*/
-    tmp_hash = hash % table->oentries;
-    for(i = 0; i < table->oentries; i++) {
-        ind = table->hentries + ((tmp_hash + i) % table->oentries);
-        ent = vr_btable_get(table->otable, ((tmp_hash + i) % table->oentries));
-        if (table->is_valid_entry(htable, ent, ind) == false)
-            continue;
-        if (memcmp(ent, key, table->key_size) == 0) {
-            if (index)
-                *index = ind;
-            return ent;
-        }
-    }
+    bucket = vr_htable_bucket(table, key);
+    start = bucket * VR_HENTRIES_PER_BUCKET;
+    vr_prefetch(vr_htable_entry(table, start));
+    vr_prefetch(vr_htable_entry(table, start + VR_HENTRIES_PER_BUCKET - 1));
+    vr_prefetch(vr_htable_ochain(table, bucket));
 
-    /* Entry not found */
-    return NULL;
+    return bucket;
+}
+
+vr_hentry_t
+vr_find_hentry_in_bucket(vr_htable_t htable, void *key, unsigned int bucket)
+{
+    struct vr_htable *table = (struct vr_htable *)htable;
+
+    if (!table || !key)
+        return NULL;
+
+    return __vr_find_hentry(table, key, bucket, NULL, NULL);
 }
 
 void
@@ -201,6 +417,15 @@ vr_htable_delete(vr_htable_t htable)
     if (table->otable)
         vr_btable_free(table->otable);
 
+    if (table->ochain)
+        vr_btable_free(table->ochain);
+
+    if (table->olinks)
+        vr_btable_free(table->olinks);
+
+    if (table->used)
+        vr_btable_free(table->used);
+
     vr_free(table);
 }
 
@@ -220,6 +445,12 @@ vr_htable_create(unsigned int entries, unsigned int oentries,
         return NULL;
     }
 
+    /* the overflow table is used in whole buckets */
+    if (oentries < VR_HENTRIES_PER_BUCKET) {
+        vr_module_error(-EINVAL, __FUNCTION__, __LINE__, oentries);
+        return NULL;
+    }
+
     table = vr_zalloc(sizeof(struct vr_htable));
     if (!table) {
         vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
@@ -230,13 +461,36 @@ vr_htable_create(unsigned int entries, unsigned int oentries,
     table->htable = vr_btable_alloc(entries, entry_size);
     if (!table->htable) {
         vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, entries);
-        return NULL;
+        goto fail;
     }
 
     table->otable = vr_btable_alloc(oentries, entry_size);
     if (!table->otable) {
         vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, oentries);
-        return NULL;
+        goto fail;
+    }
+
+    table->ochain = vr_btable_alloc(entries / VR_HENTRIES_PER_BUCKET,
+            sizeof(unsigned int));
+    if (!table->ochain) {
+        vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, entries);
+        goto fail;
+    }
+
+    table->obuckets = oentries / VR_HENTRIES_PER_BUCKET;
+    table->olinks = vr_btable_alloc(table->obuckets,
+            sizeof(struct vr_htable_olink));
+    if (!table->olinks) {
+        vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, oentries);
+        goto fail;
+    }
+
+    table->used = vr_btable_alloc((entries + oentries +
+                VR_HTABLE_USED_BITS - 1) / VR_HTABLE_USED_BITS,
+            sizeof(uint64_t));
+    if (!table->used) {
+        vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, entries);
+        goto fail;
     }
 
     table->hentries = entries;
@@ -246,4 +500,8 @@ vr_htable_create(unsigned int entries, unsigned int oentries,
     table->key_size = key_size;
     table->is_valid_entry = is_valid_entry;
     return (vr_htable_t)table;
+
+fail:
+    vr_htable_delete((vr_htable_t)table);
+    return NULL;
 }
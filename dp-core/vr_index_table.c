@@ -5,14 +5,31 @@
 #include <vr_os.h>
 #include <stdarg.h>
 
+/*
+ * readers (the datapath) walk the strides without any lock. set publishes
+ * a stride only after it is zeroed, and the data only after the caller
+ * built it, and del unlinks the strides that it frees and waits for the
+ * readers (vr_delay_op) before freeing them
+ */
+#define VR_ITABLE_MAX_STRIDES       32
+
+/* the stride layouts that have a lookup of their own, see vr_itable_get */
+#define VR_ITABLE_LAYOUT_ANY        0
+#define VR_ITABLE_LAYOUT_12_12      1
+#define VR_ITABLE_LAYOUT_8_8_8_8    2
+
 struct vr_itbl {
     unsigned int stride_cnt;
     unsigned int index_len;
+    unsigned int layout;
     unsigned int *stride_len;
     unsigned int *stride_shift;
     void **data;
 };
 
+#define VR_ITABLE_STRIDE_ID(table, index, i) \
+    (((index) >> (table)->stride_shift[(i)]) & ((table)->stride_len[(i)] - 1))
+
 static int
 vr_stride_empty(void **ptr, unsigned int cnt)
 {
@@ -50,55 +67,6 @@ get_page_shift(void)
 
 
 
-static int
-__vr_itable_del(struct vr_itbl *table, unsigned int index, 
-                        void **ptr, unsigned int cnt, void **old)
-{
-    unsigned int id;
-
-    if (cnt == table->stride_cnt-1) {
-        id = (index >> table->stride_shift[cnt]) & (table->stride_len[cnt] - 1); 
-        *old = ptr[id];
-
-        /* 
-         * IF an entry exists to delete, mark it null. If the whole
-         * stride is null, delete the stride itself
-         */
-        if (*old) {
-            ptr[id] = NULL;
-            if (vr_stride_empty(ptr, table->stride_len[cnt]) == 1) {
-                vr_free(ptr);
-                return 1;
-            }
-        }
-        return 0;
-    }
-    
-    if ((cnt < (table->stride_cnt - 1)) && ptr) {
-        id = (index >> table->stride_shift[cnt]) & (table->stride_len[cnt] - 1); 
-        if (ptr[id] && __vr_itable_del(table, index, (void **)(ptr[id]), 
-                                            (cnt+1), old) == 1) {
-
-            /* 
-             * If a later stride is deleted, check for the 
-             * earliter stride as well 
-             */
-            ptr[id] = NULL;
-            if (vr_stride_empty(ptr, table->stride_len[cnt]) == 1) {
-                vr_free(ptr);
-
-                /* If the stride deleted is first, mark the head null */
-                if (cnt == 0) {
-                    table->data = NULL;
-                }
-                return 1;
-            }
-
-        }
-    }
-
-    return 0;
-}
 
 static int 
 __vr_itable_dump(struct vr_itbl *table, vr_itable_trav_cb_t func, void **ptr, 
@@ -150,48 +118,30 @@ static void
 __vr_itable_exit(struct vr_itbl *table, vr_itable_del_cb_t func, 
                         void **ptr, unsigned int cnt, unsigned int index)
 {
-    unsigned int i, j;
+    unsigned int i;
 
     if (!ptr || cnt >= table->stride_cnt) {
         return;
     }
 
-    if (cnt == table->stride_cnt - 1) {
-
-        /* This handles the last stride which contain elements*/
-        for (j = 0; j < table->stride_len[cnt]; j++) {
-            if (ptr[j]) {
+    for (i = 0; i < table->stride_len[cnt]; i++) { 
+        if (!ptr[i])
+            continue;
 
-                /* Call the user function which might cleanup index entry */
-                if (func) {
-                    func((index | (j << table->stride_shift[cnt])), ptr[j]);
-                }
-                ptr[j] = NULL;
+        if (cnt == table->stride_cnt - 1) {
+            /* Call the user function which might cleanup index entry */
+            if (func) {
+                func((index | (i << table->stride_shift[cnt])), ptr[i]);
             }
-        }
-
-        /* All stride entries are delete invoked. Delete the stride now */
-        vr_free(ptr);
-        return;
-    }
-
-    for (i = 0; i < table->stride_len[cnt]; i++) { 
-        if (ptr[i]) {
+        } else {
             __vr_itable_exit(table, func, (void **)ptr[i], (cnt + 1), 
                     (index | (i << table->stride_shift[cnt])));
-
-            /* Upper strides are deleted. Delete the current */
-            ptr[i] = NULL;
-            vr_free(ptr[i]);
         }
+        ptr[i] = NULL;
     }
 
-    /* Destruct the head as well*/
-    if (cnt == 0) {
-        vr_free(table->data);
-        table->data = NULL;
-    }
-
+    /* All entries of the stride are gone. Delete the stride now */
+    vr_free(ptr);
     return;
 }
 
@@ -238,18 +188,95 @@ void *
 vr_itable_del(vr_itable_t t, unsigned int index)
 {
     struct vr_itbl *table = (struct vr_itbl *)t;
-    void *old = NULL;
+    void **ptr, **strides[VR_ITABLE_MAX_STRIDES];
+    void *old;
+    unsigned int id = 0;
+    int i;
 
     if (!table) {
         return NULL;
     }
 
-    __vr_itable_del(table, index, table->data, 0, &old);
+    ptr = table->data;
+    for (i = 0; i < (int)table->stride_cnt; i++) {
+        if (!ptr) {
+            return NULL;
+        }
+
+        strides[i] = ptr;
+        id = VR_ITABLE_STRIDE_ID(table, index, i);
+        if (i < (int)table->stride_cnt - 1) {
+            ptr = (void **)ptr[id];
+        }
+    }
+
+    old = ptr[id];
+    if (!old) {
+        return NULL;
+    }
+    ptr[id] = NULL;
+
+    /*
+     * the strides that are empty now, from the last one up. unlinking
+     * the first of them takes all of them away from the readers
+     */
+    for (i = table->stride_cnt - 1; i >= 0; i--) {
+        if (!vr_stride_empty(strides[i], table->stride_len[i])) {
+            break;
+        }
+    }
+
+    if (++i < (int)table->stride_cnt) {
+        if (i == 0) {
+            table->data = NULL;
+        } else {
+            strides[i - 1][VR_ITABLE_STRIDE_ID(table, index, i - 1)] = NULL;
+        }
+
+        vr_delay_op();
+        for (; i < (int)table->stride_cnt; i++) {
+            vr_free(strides[i]);
+        }
+    }
 
     /* Return the deleted value */
     return old;
 }
 
+/* vxlan vnids */
+static inline void *
+vr_itable_get_12_12(void **ptr, unsigned int index)
+{
+    ptr = (void **)ptr[(index >> 12) & 0xFFF];
+    if (!ptr) {
+        return NULL;
+    }
+
+    return ptr[index & 0xFFF];
+}
+
+/* flow indices (mirror meta data) */
+static inline void *
+vr_itable_get_8_8_8_8(void **ptr, unsigned int index)
+{
+    ptr = (void **)ptr[index >> 24];
+    if (!ptr) {
+        return NULL;
+    }
+
+    ptr = (void **)ptr[(index >> 16) & 0xFF];
+    if (!ptr) {
+        return NULL;
+    }
+
+    ptr = (void **)ptr[(index >> 8) & 0xFF];
+    if (!ptr) {
+        return NULL;
+    }
+
+    return ptr[index & 0xFF];
+}
+
 void *
 vr_itable_get(vr_itable_t t, unsigned int index)
 {
@@ -258,13 +285,24 @@ vr_itable_get(vr_itable_t t, unsigned int index)
     unsigned int i;
     unsigned int id;
 
-    if (!table) {
+    if (!table || !(ptr = table->data)) {
         return NULL;
     }
 
+    switch (table->layout) {
+    case VR_ITABLE_LAYOUT_12_12:
+        return vr_itable_get_12_12(ptr, index);
+
+    case VR_ITABLE_LAYOUT_8_8_8_8:
+        return vr_itable_get_8_8_8_8(ptr, index);
+
+    default:
+        break;
+    }
+
     /* Go till last stride as long as data exists */
-    for (i = 0, ptr = table->data; (i < table->stride_cnt) && ptr; i++) {
-        id = (index >> table->stride_shift[i]) & (table->stride_len[i] - 1); 
+    for (i = 0; (i < table->stride_cnt) && ptr; i++) {
+        id = VR_ITABLE_STRIDE_ID(table, index, i);
         ptr = (void **)(ptr[id]);
     }
 
@@ -282,7 +320,7 @@ vr_itable_set(vr_itable_t t, unsigned int index, void *data)
 {
     struct vr_itbl *table = (struct vr_itbl *)t;
     unsigned int id;
-    void **ptr;
+    void **ptr, **stride;
     void *old;
     unsigned int i;
 
@@ -297,32 +335,38 @@ vr_itable_set(vr_itable_t t, unsigned int index, void *data)
     }
 
     if (!table->data) {
-        table->data = vr_zalloc(table->stride_len[0] * sizeof(void *));
-        if (!table->data) {
+        stride = vr_zalloc(table->stride_len[0] * sizeof(void *));
+        if (!stride) {
             return VR_ITABLE_ERR_PTR;
         }
+        __sync_synchronize();
+        table->data = stride;
     }
     ptr = table->data;
 
     for (i = 0; i < table->stride_cnt - 1; i++) {
-        id = (index >> table->stride_shift[i]) & (table->stride_len[i] - 1); 
+        id = VR_ITABLE_STRIDE_ID(table, index, i);
 
         if (!ptr[id]) {
-            ptr[id] = vr_zalloc(table->stride_len[i + 1] * sizeof(void *));
+            stride = vr_zalloc(table->stride_len[i + 1] * sizeof(void *));
             /* To fix: We might return with some empty strides */
-            if (!ptr[id]) {
+            if (!stride) {
                 return VR_ITABLE_ERR_PTR;
             }
+            /* the readers should see the stride zeroed */
+            __sync_synchronize();
+            ptr[id] = stride;
         }
 
         ptr = (void **)ptr[id];
     }
 
     /* Store the data in the last stride */
-    id = (index >> table->stride_shift[i]) & (table->stride_len[i] - 1); 
+    id = VR_ITABLE_STRIDE_ID(table, index, i);
 
     /* Return the old data */
     old = ptr[id];
+    __sync_synchronize();
     ptr[id] = data;
     return old;
 }
@@ -342,6 +386,7 @@ vr_itable_delete(vr_itable_t t, vr_itable_del_cb_t func)
 
     /* Delete all entries and strides */
     __vr_itable_exit(table, func, table->data, 0, 0);
+    table->data = NULL;
 
     /* Free the table itself */
     vr_free(table->stride_len);
@@ -375,7 +420,7 @@ vr_itable_create(unsigned int index_len, unsigned int stride_cnt, ...)
     }
 
     /* Atleast two strides please.. */
-    if (stride_cnt < 2) {
+    if (stride_cnt < 2 || stride_cnt > VR_ITABLE_MAX_STRIDES) {
         goto fail;
     }
 
@@ -422,6 +467,16 @@ vr_itable_create(unsigned int index_len, unsigned int stride_cnt, ...)
         goto fail;
     }
 
+    if (index_len == 24 && stride_cnt == 2 &&
+            table->stride_len[0] == (0x1 << 12)) {
+        table->layout = VR_ITABLE_LAYOUT_12_12;
+    } else if (index_len == 32 && stride_cnt == 4 &&
+            table->stride_len[0] == (0x1 << 8) &&
+            table->stride_len[1] == (0x1 << 8) &&
+            table->stride_len[2] == (0x1 << 8)) {
+        table->layout = VR_ITABLE_LAYOUT_8_8_8_8;
+    }
+
     return (vr_itable_t)table;
 
 fail:
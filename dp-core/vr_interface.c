@@ -7,6 +7,8 @@
 #include "vr_message.h"
 #include "vr_sandesh.h"
 #include "vr_mirror.h"
+#include "vr_btable.h"
+#include "vr_vxlan.h"
 
 static struct vr_host_interface_ops *hif_ops;
 
@@ -19,9 +21,29 @@ extern unsigned int vr_l3_input(unsigned short, struct vr_packet *,
                                               struct vr_forwarding_md *);
 extern unsigned int vr_l2_input(unsigned short, struct vr_packet *, 
                                                struct vr_forwarding_md *);
+extern bool vr_l3_input_prepare(struct vr_packet *);
+extern struct vr_vrf_stats *(*vr_inet_vrf_stats)(unsigned short, unsigned int);
 
 #define MINIMUM(a, b) (((a) < (b)) ? (a) : (b))
 
+static inline void
+vr_vrf_stats_rx(unsigned short vrf, unsigned int cpu, unsigned int packets,
+        unsigned int bytes)
+{
+    struct vr_vrf_stats *stats;
+
+    if (!vr_inet_vrf_stats)
+        return;
+
+    stats = vr_inet_vrf_stats(vrf, cpu);
+    if (stats) {
+        stats->vrf_rx_packets += packets;
+        stats->vrf_rx_bytes += bytes;
+    }
+
+    return;
+}
+
 static inline struct vr_interface_stats *
 vif_get_stats(struct vr_interface *vif, unsigned short cpu)
 {
@@ -43,6 +65,107 @@ vif_discard_rx(struct vr_interface *vif, struct vr_packet *pkt,
     return 0;
 }
 
+/* see struct vr_vif_rate. with the bytes of this cpu, as for vif_stats */
+static bool
+vif_rate_refill(struct vr_vif_rate *rate, struct vr_vif_rate_cpu *rate_cpu,
+        unsigned int len)
+{
+    unsigned int sec, nsec, credit, new_credit, need, take;
+    uint64_t now, stamp, earned;
+
+    vr_get_mono_time(&sec, &nsec);
+    now = (uint64_t)sec * 1000 + nsec / 1000000;
+
+    /* only the cpu that moves the stamp forward adds the earned tokens */
+    stamp = rate->vrr_stamp;
+    if (now != stamp &&
+            __sync_bool_compare_and_swap(&rate->vrr_stamp, stamp, now)) {
+        earned = (now - stamp) * rate->vrr_rate / 8;
+        do {
+            credit = rate->vrr_credit;
+            if (earned >= rate->vrr_burst - credit)
+                new_credit = rate->vrr_burst;
+            else
+                new_credit = credit + earned;
+        } while (!__sync_bool_compare_and_swap(&rate->vrr_credit,
+                    credit, new_credit));
+    }
+
+    need = len - rate_cpu->vrc_tokens;
+    do {
+        credit = rate->vrr_credit;
+        if (credit < need)
+            return false;
+
+        take = rate->vrr_chunk < need ? need : rate->vrr_chunk;
+        take = MINIMUM(credit, take);
+    } while (!__sync_bool_compare_and_swap(&rate->vrr_credit,
+                credit, credit - take));
+
+    rate_cpu->vrc_tokens += take;
+
+    return true;
+}
+
+static bool
+vif_rate_conform(struct vr_vif_rate *rate, struct vr_packet *pkt)
+{
+    unsigned int len = pkt_len(pkt);
+    struct vr_vif_rate_cpu *rate_cpu;
+
+    rate_cpu = &rate->vrr_cpu[vr_get_cpu()];
+    if (rate_cpu->vrc_tokens < len &&
+            !vif_rate_refill(rate, rate_cpu, len))
+        return false;
+
+    rate_cpu->vrc_tokens -= len;
+
+    return true;
+}
+
+/* false if the packet was over the limit, and is gone */
+static bool
+vif_rate_rx(struct vr_interface *vif, struct vr_packet *pkt)
+{
+    struct vr_vif_rate *rate = vif->vif_rx_rate;
+    struct vr_interface_stats *stats;
+
+    if (!rate)
+        return true;
+
+    stats = vif_get_stats(vif, pkt->vp_cpu);
+    if (!vif_rate_conform(rate, pkt)) {
+        stats->vis_rx_exceed++;
+        vr_pfree(pkt, VP_DROP_INTERFACE_RATE_LIMIT);
+        return false;
+    }
+
+    stats->vis_rx_conform++;
+
+    return true;
+}
+
+static bool
+vif_rate_tx(struct vr_interface *vif, struct vr_packet *pkt)
+{
+    struct vr_vif_rate *rate = vif->vif_tx_rate;
+    struct vr_interface_stats *stats;
+
+    if (!rate)
+        return true;
+
+    stats = vif_get_stats(vif, pkt->vp_cpu);
+    if (!vif_rate_conform(rate, pkt)) {
+        stats->vis_tx_exceed++;
+        vr_pfree(pkt, VP_DROP_INTERFACE_RATE_LIMIT);
+        return false;
+    }
+
+    stats->vis_tx_conform++;
+
+    return true;
+}
+
 void
 vif_drop_pkt(struct vr_interface *vif, struct vr_packet *pkt, bool input)
 {
@@ -62,15 +185,17 @@ vif_drop_pkt(struct vr_interface *vif, struct vr_packet *pkt, bool input)
  * function depending on the protocols enabled on the VIF
  */
 static unsigned int
-vr_interface_input(unsigned short vrf, struct vr_interface *vif, struct vr_packet *pkt)
+vr_interface_demux(unsigned short vrf, struct vr_interface *vif,
+        struct vr_packet *pkt)
 {
     struct vr_forwarding_md fmd;
     unsigned int ret;
 
+    vr_vrf_stats_rx(vrf, pkt->vp_cpu, 1, pkt_len(pkt));
     vr_init_forwarding_md(&fmd);
 
     if (vif->vif_flags & VIF_FLAG_MIRROR_RX) {
-        fmd.fmd_dvrf = vif->vif_vrf;
+        vr_fmd_set_dvrf(&fmd, vif->vif_vrf);
         vr_mirror(vif->vif_router, vif->vif_mirror_id, pkt, &fmd);
     }
 
@@ -87,6 +212,154 @@ vr_interface_input(unsigned short vrf, struct vr_interface *vif, struct vr_packe
     return 0;
 }
 
+static unsigned int
+__vr_interface_input(unsigned short vrf, struct vr_interface *vif,
+        struct vr_packet *pkt)
+{
+    unsigned int ret;
+    uint64_t start = vr_perf_start();
+
+    ret = vr_interface_demux(vrf, vif, pkt);
+    vr_perf_end(VR_PERF_INTERFACE_INPUT, start, 1);
+
+    return ret;
+}
+
+static unsigned int
+vr_interface_input(unsigned short vrf, struct vr_interface *vif, struct vr_packet *pkt)
+{
+    if (!vif_rate_rx(vif, pkt))
+        return 0;
+
+    return __vr_interface_input(vrf, vif, pkt);
+}
+
+/*
+ * burst version of vr_interface_input. ipv4 packets are collected and
+ * handed to the flow lookup as one batch, while the rest take the per
+ * packet path. packets of a flow all take the same path, and hence their
+ * order is maintained
+ */
+static unsigned int
+vr_interface_input_burst(unsigned short vrf, struct vr_interface *vif,
+        struct vr_packet **pkts, unsigned int num_pkts)
+{
+    unsigned int i, num_ip = 0, num_vxlan = 0, bytes = 0;
+    unsigned short vrfs[VR_FLOW_BATCH_MAX];
+    struct vr_packet *ip_pkts[VR_FLOW_BATCH_MAX];
+    struct vr_packet *vxlan_pkts[VR_FLOW_BATCH_MAX];
+    struct vr_forwarding_md fmds[VR_FLOW_BATCH_MAX];
+
+    if (vif->vif_rx_rate) {
+        for (i = 0; i < num_pkts; i++) {
+            if (vif_rate_rx(vif, pkts[i]))
+                pkts[num_ip++] = pkts[i];
+        }
+
+        num_pkts = num_ip;
+        num_ip = 0;
+        if (!num_pkts)
+            return 0;
+    }
+
+    /* bridge only interfaces hand the whole burst to the bridge lookup */
+    if (!(vif->vif_flags & (VIF_FLAG_MIRROR_RX | VIF_FLAG_L3_ENABLED)) &&
+            (vif->vif_flags & VIF_FLAG_L2_ENABLED)) {
+        for (i = 0; i < num_pkts; i++) {
+            vrfs[i] = vrf;
+            vr_init_forwarding_md(&fmds[i]);
+            bytes += pkt_len(pkts[i]);
+        }
+        vr_vrf_stats_rx(vrf, pkts[0]->vp_cpu, num_pkts, bytes);
+        return vr_bridge_input_batch(vif->vif_router, vrfs, pkts, num_pkts,
+                fmds);
+    }
+
+    if ((vif->vif_flags & VIF_FLAG_MIRROR_RX) ||
+            !(vif->vif_flags & VIF_FLAG_L3_ENABLED)) {
+        for (i = 0; i < num_pkts; i++)
+            __vr_interface_input(vrf, vif, pkts[i]);
+        return num_pkts;
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        switch (vr_fabric_demux_burst(vif, pkts[i])) {
+        case VR_DEMUX_DONE:
+            continue;
+
+        case VR_DEMUX_VXLAN:
+            bytes += pkt_len(pkts[i]);
+            vxlan_pkts[num_vxlan++] = pkts[i];
+            continue;
+
+        default:
+            break;
+        }
+
+        if (!vr_l3_input_prepare(pkts[i])) {
+            __vr_interface_input(vrf, vif, pkts[i]);
+            continue;
+        }
+
+        vrfs[num_ip] = vrf;
+        vr_init_forwarding_md(&fmds[num_ip]);
+        bytes += pkt_len(pkts[i]);
+        ip_pkts[num_ip++] = pkts[i];
+    }
+
+    if (num_ip + num_vxlan)
+        vr_vrf_stats_rx(vrf, pkts[0]->vp_cpu, num_ip + num_vxlan, bytes);
+
+    if (num_vxlan) {
+        for (i = 0; i < num_vxlan; i++)
+            vr_init_forwarding_md(&fmds[num_ip + i]);
+        vr_vxlan_input_bulk(vif->vif_router, vxlan_pkts, num_vxlan,
+                fmds + num_ip);
+    }
+
+    if (num_ip)
+        vr_flow_inet_input_batch(vif->vif_router, vrfs, ip_pkts, num_ip,
+                VR_ETH_PROTO_IP, fmds);
+
+    return num_pkts;
+}
+
+/*
+ * vr_interface_rx_burst - receive a burst of packets, all from the same cpu,
+ * on an interface. the interface is looked at and its statistics updated
+ * once for the whole burst. interfaces that do anything other than plain
+ * ethernet receive, get the packets one by one through vif_rx
+ */
+unsigned int
+vr_interface_rx_burst(struct vr_interface *vif, struct vr_packet **pkts,
+        unsigned int num_pkts)
+{
+    unsigned int i, bytes = 0;
+    struct vr_interface_stats *stats;
+
+    if (!num_pkts)
+        return 0;
+
+    if (vif->vif_rx != eth_rx || vif_mode_xconnect(vif)) {
+        for (i = 0; i < num_pkts; i++)
+            vif->vif_rx(vif, pkts[i], VLAN_ID_INVALID);
+        return num_pkts;
+    }
+
+    for (i = 0; i < num_pkts; i++)
+        bytes += pkt_len(pkts[i]);
+
+    stats = vif_get_stats(vif, pkts[0]->vp_cpu);
+    stats->vis_ibytes += bytes;
+    stats->vis_ipackets += num_pkts;
+
+    for (i = 0; i < num_pkts; i += VR_FLOW_BATCH_MAX)
+        vr_interface_input_burst(vif->vif_vrf, vif, pkts + i,
+                MINIMUM(num_pkts - i, VR_FLOW_BATCH_MAX));
+
+    return num_pkts;
+}
+
 
 /*
  * in the rewrite case, we will assume the positive case of caller
@@ -227,6 +500,14 @@ free_pkt:
 #define AGENT_PKT_HEAD_SPACE (sizeof(struct vr_eth) + \
         sizeof(struct agent_hdr))
 
+#define AGENT_RING_HDR_SLOTS \
+    (VR_AGENT_RING_HDR_SIZE / VR_AGENT_RING_SLOT_SIZE)
+#define AGENT_RING_FRAME_MAX \
+    (VR_AGENT_RING_SLOT_SIZE - sizeof(struct vr_agent_ring_slot))
+
+/* trap packets to the agent in the packet rings. see struct vr_agent_ring */
+int vr_agent_rings = 0;
+
 static unsigned char *
 agent_set_rewrite(struct vr_interface *vif, struct vr_packet *pkt,
         unsigned char *rewrite, unsigned short len)
@@ -298,7 +579,8 @@ agent_rx(struct vr_interface *vif, struct vr_packet *pkt,
             agent_vif = vif;
         }
         pkt->vp_if = agent_vif;
-        vr_interface_input(ntohs(hdr->hdr_vrf), agent_vif, pkt);
+        /* the packet was rate limited when it came in the first time */
+        __vr_interface_input(ntohs(hdr->hdr_vrf), agent_vif, pkt);
     } else {
         vif = __vrouter_get_interface(vrouter_get(0), ntohs(hdr->hdr_ifindex));
         if (!vif) {
@@ -353,6 +635,103 @@ agent_trap_may_truncate(int trap_reason)
     }
 }
 
+static void
+agent_fill_hdr(struct agent_hdr *hdr, struct vr_packet *pkt,
+        struct agent_send_params *params)
+{
+    hdr->hdr_ifindex = htons(pkt->vp_if->vif_idx);
+    hdr->hdr_vrf = htons(params->trap_vrf);
+    hdr->hdr_cmd = htons(params->trap_reason);
+
+    switch (params->trap_reason) {
+    case AGENT_TRAP_FLOW_MISS:
+    case AGENT_TRAP_ECMP_RESOLVE:
+    case AGENT_TRAP_SOURCE_MISMATCH:
+    case AGENT_TRAP_FLOW_MISS_BATCH:
+    case AGENT_TRAP_MAC_LEARN_BATCH:
+        if (params->trap_param)
+            hdr->hdr_cmd_param = htonl(*(unsigned int *)(params->trap_param));
+        break;
+
+    case AGENT_TRAP_DIAG:
+        if (params->trap_param)
+            hdr->hdr_cmd_param = htonl(*(unsigned int *)(params->trap_param));
+        break;
+
+    default:
+        hdr->hdr_cmd_param = 0;
+        break;
+    }
+
+    return;
+}
+
+unsigned int
+vr_agent_ring_table_size(struct vrouter *router)
+{
+    if (!router->vr_agent_ring_table)
+        return 0;
+
+    return vr_btable_size(router->vr_agent_ring_table[0]) * vr_num_cpus;
+}
+
+/*
+ * write the frame that pkt0 would have carried into a slot of the current
+ * cpu's ring. only the current cpu writes to its ring. the packet is left
+ * with the caller
+ */
+static bool
+agent_ring_post(struct vr_interface *vif, struct vr_packet *pkt,
+        struct agent_send_params *params)
+{
+    uint32_t head;
+    unsigned int len = pkt_len(pkt);
+    unsigned char *frame;
+    struct agent_hdr *hdr;
+    struct vr_btable *table;
+    struct vr_agent_ring *ring;
+    struct vr_agent_ring_slot *slot;
+    struct vrouter *router = vif->vif_router;
+
+    if (!router->vr_agent_ring_table)
+        return false;
+
+    if (len > AGENT_RING_FRAME_MAX - AGENT_PKT_HEAD_SPACE) {
+        if (!agent_trap_may_truncate(params->trap_reason))
+            return false;
+        len = AGENT_RING_FRAME_MAX - AGENT_PKT_HEAD_SPACE;
+    }
+
+    table = router->vr_agent_ring_table[vr_get_cpu()];
+    ring = (struct vr_agent_ring *)vr_btable_get(table, 0);
+
+    head = ring->ar_head;
+    if (head - ring->ar_tail >= VR_AGENT_RING_SLOTS) {
+        ring->ar_overflows++;
+        return false;
+    }
+
+    slot = (struct vr_agent_ring_slot *)vr_btable_get(table,
+            AGENT_RING_HDR_SLOTS + (head % VR_AGENT_RING_SLOTS));
+    frame = (unsigned char *)(slot + 1);
+    if (vr_pcopy(frame + AGENT_PKT_HEAD_SPACE, pkt, 0, len) < 0)
+        return false;
+
+    memcpy(frame, vif->vif_rewrite, VR_ETHER_HLEN);
+    hdr = (struct agent_hdr *)(frame + VR_ETHER_HLEN);
+    hdr->hdr_nh = 0;
+    agent_fill_hdr(hdr, pkt, params);
+
+    slot->ars_len = AGENT_PKT_HEAD_SPACE + len;
+    slot->ars_frame_len = AGENT_PKT_HEAD_SPACE + pkt_len(pkt);
+
+    /* the slot has to be visible before the head moves */
+    __sync_synchronize();
+    ring->ar_head = head + 1;
+
+    return true;
+}
+
 static int
 agent_send(struct vr_interface *vif, struct vr_packet *pkt,
                 void *ifspecific)
@@ -367,6 +746,13 @@ agent_send(struct vr_interface *vif, struct vr_packet *pkt,
 
     vr_preset(pkt);
 
+    if (agent_ring_post(vif, pkt, params)) {
+        stats->vis_obytes += pkt_len(pkt) + AGENT_PKT_HEAD_SPACE;
+        stats->vis_opackets++;
+        vr_pfree(pkt, VP_DROP_DUPLICATED);
+        return 0;
+    }
+
     if (pkt_head_space(pkt) < AGENT_PKT_HEAD_SPACE) {
         len = pkt_len(pkt);
 
@@ -385,27 +771,7 @@ agent_send(struct vr_interface *vif, struct vr_packet *pkt,
     if (!hdr)
         goto drop;
 
-    hdr->hdr_ifindex = htons(pkt->vp_if->vif_idx);
-    hdr->hdr_vrf = htons(params->trap_vrf);
-    hdr->hdr_cmd = htons(params->trap_reason);
-
-    switch (params->trap_reason) {
-    case AGENT_TRAP_FLOW_MISS:
-    case AGENT_TRAP_ECMP_RESOLVE:
-    case AGENT_TRAP_SOURCE_MISMATCH:
-        if (params->trap_param)
-            hdr->hdr_cmd_param = htonl(*(unsigned int *)(params->trap_param));
-        break;
-
-    case AGENT_TRAP_DIAG:
-        if (params->trap_param)
-            hdr->hdr_cmd_param = htonl(*(unsigned int *)(params->trap_param));
-        break;
-
-    default:
-        hdr->hdr_cmd_param = 0;
-        break;
-    }
+    agent_fill_hdr(hdr, pkt, params);
 
     rewrite = pkt_push(pkt, VR_ETHER_HLEN);
     if (!rewrite)
@@ -476,6 +842,9 @@ vhost_tx(struct vr_interface *vif, struct vr_packet *pkt)
     int ret;
     struct vr_interface_stats *stats = vif_get_stats(vif, pkt->vp_cpu);
 
+    if (!vif_rate_tx(vif, pkt))
+        return 0;
+
     stats->vis_obytes += pkt_len(pkt);
     stats->vis_opackets++;
 
@@ -553,6 +922,9 @@ eth_rx(struct vr_interface *vif, struct vr_packet *pkt,
     if (vif_mode_xconnect(vif))
         pkt->vp_flags |= VP_FLAG_TO_ME;
 
+    if (vr_fabric_demux(vif, pkt))
+        return 0;
+
     return vr_interface_input(vif->vif_vrf, vif, pkt);
 }
 
@@ -569,12 +941,15 @@ eth_tx(struct vr_interface *vif, struct vr_packet *pkt)
      */
     if (((pkt->vp_flags & VP_FLAG_GRO) == 0) ||
              (vif->vif_type != VIF_TYPE_VIRTUAL)) {
+        if (!vif_rate_tx(vif, pkt))
+            return 0;
+
         stats->vis_obytes += pkt_len(pkt);
         stats->vis_opackets++;
     }
     if (vif->vif_flags & VIF_FLAG_MIRROR_TX) {
         vr_init_forwarding_md(&fmd);
-        fmd.fmd_dvrf = vif->vif_vrf;
+        vr_fmd_set_dvrf(&fmd, vif->vif_vrf);
         vr_mirror(vif->vif_router, vif->vif_mirror_id, pkt, &fmd);
     }
         
@@ -679,7 +1054,8 @@ vif_free(struct vr_interface *vif)
     if (!vif)
         return;
 
-    if (vif->vif_stats)
+    if (vif->vif_stats && (vif->vif_stats !=
+                vr_counters_vif_stats(vrouter_get(vif->vif_rid), vif->vif_idx)))
         vr_free(vif->vif_stats);
 
     if (vif->vif_vrf_table) {
@@ -687,6 +1063,11 @@ vif_free(struct vr_interface *vif)
         vif->vif_vrf_table = NULL;
     }
 
+    if (vif->vif_rx_rate)
+        vr_free(vif->vif_rx_rate);
+    if (vif->vif_tx_rate)
+        vr_free(vif->vif_tx_rate);
+
     vr_free(vif);
 
     return;
@@ -707,7 +1088,8 @@ __vrouter_get_interface(struct vrouter *router, unsigned int idx)
     if (!router || idx >= router->vr_max_interfaces)
         return NULL;
 
-    return router->vr_interfaces[idx];
+    return ((struct vr_interface **)
+            vr_replica(router->vr_interface_replicas))[idx];
 }
 
 struct vr_interface *
@@ -753,7 +1135,7 @@ vrouter_del_interface(struct vr_interface *vif)
     if (router->vr_interfaces[vif->vif_idx] != vif)
         return;
 
-    router->vr_interfaces[vif->vif_idx] = NULL;
+    vr_replicas_set(router->vr_interface_replicas, vif->vif_idx, NULL);
 
     switch (vif->vif_type) {
     case VIF_TYPE_AGENT:
@@ -831,7 +1213,7 @@ vrouter_add_interface(struct vr_interface *vif)
 
     vif->vif_router = router;
     vif->vif_users++;
-    router->vr_interfaces[vif->vif_idx] = vif;
+    vr_replicas_set(router->vr_interface_replicas, vif->vif_idx, vif);
 
     switch (vif->vif_type) {
     case VIF_TYPE_AGENT:
@@ -868,6 +1250,8 @@ vrouter_add_interface(struct vr_interface *vif)
 int
 vif_delete(struct vr_interface *vif)
 {
+    vr_notify(vrouter_get(vif->vif_rid), VR_NOTIFY_VIF_DOWN, vif->vif_idx, 0);
+
     if (drivers[vif->vif_type].drv_delete)
         drivers[vif->vif_type].drv_delete(vif);
 
@@ -909,11 +1293,109 @@ vif_set_flags(struct vr_interface *vif, vr_interface_req *req)
     return;
 }
 
+static int
+vif_set_steering(struct vr_interface *vif, vr_interface_req *req)
+{
+    unsigned int i;
+
+    if ((unsigned char)req->vifr_steer_policy >= VIF_STEER_MAX)
+        return -EINVAL;
+
+    if (req->vifr_steer_cpus_size > VIF_MAX_STEER_CPUS)
+        return -EINVAL;
+
+    if (req->vifr_steer_policy == VIF_STEER_CPUS &&
+            !req->vifr_steer_cpus_size)
+        return -EINVAL;
+
+    for (i = 0; i < req->vifr_steer_cpus_size; i++)
+        if ((unsigned int)req->vifr_steer_cpus[i] >= vr_num_cpus)
+            return -EINVAL;
+
+    /* hide the list from the datapath while it is being rewritten */
+    if (vif->vif_steer_ncpus) {
+        vif->vif_steer_ncpus = 0;
+        vr_delay_op();
+    }
+    for (i = 0; i < req->vifr_steer_cpus_size; i++)
+        vif->vif_steer_cpus[i] = req->vifr_steer_cpus[i];
+    vif->vif_steer_ncpus = req->vifr_steer_cpus_size;
+    vif->vif_steer_policy = req->vifr_steer_policy;
+
+    return 0;
+}
+
+static int
+__vif_set_rate(struct vr_vif_rate **ratep, int kbps, int burst)
+{
+    uint64_t bytes;
+    struct vr_vif_rate *rate = NULL, *old = *ratep;
+
+    if (kbps < 0 || burst < 0)
+        return -EINVAL;
+
+    if (kbps) {
+        if (!burst) {
+            bytes = (uint64_t)kbps * VIF_RATE_DEFAULT_BURST_MSECS / 8;
+            burst = bytes > 0x7fffffff ? 0x7fffffff : bytes;
+        }
+        if (burst < VIF_RATE_MIN_BURST)
+            burst = VIF_RATE_MIN_BURST;
+
+        /* the tokens a cpu takes are still accounted for */
+        if (old && old->vrr_rate == (unsigned int)kbps &&
+                old->vrr_burst == (unsigned int)burst)
+            return 0;
+
+        rate = vr_zalloc(sizeof(*rate) +
+                vr_num_cpus * sizeof(struct vr_vif_rate_cpu));
+        if (!rate)
+            return -ENOMEM;
+
+        rate->vrr_rate = kbps;
+        rate->vrr_burst = burst;
+        rate->vrr_credit = burst;
+        rate->vrr_chunk = burst / (4 * vr_num_cpus);
+    } else if (!old) {
+        return 0;
+    }
+
+    *ratep = rate;
+    if (old) {
+        vr_delay_op();
+        vr_free(old);
+    }
+
+    return 0;
+}
+
+static int
+vif_set_rate(struct vr_interface *vif, vr_interface_req *req)
+{
+    int ret;
+
+    ret = __vif_set_rate(&vif->vif_rx_rate, req->vifr_rx_rate,
+            req->vifr_rx_burst);
+    if (ret)
+        return ret;
+
+    return __vif_set_rate(&vif->vif_tx_rate, req->vifr_tx_rate,
+            req->vifr_tx_burst);
+}
+
 static int
 vr_interface_change(struct vr_interface *vif, vr_interface_req *req)
 {
     int ret = 0;
 
+    ret = vif_set_steering(vif, req);
+    if (ret)
+        return ret;
+
+    ret = vif_set_rate(vif, req);
+    if (ret)
+        return ret;
+
     if (req->vifr_flags & VIF_FLAG_SERVICE_IF &&
             !(vif->vif_flags & VIF_FLAG_SERVICE_IF)) {
         ret = vr_interface_service_enable(vif);
@@ -937,6 +1419,13 @@ vr_interface_change(struct vr_interface *vif, vr_interface_req *req)
     if (req->vifr_mtu)
         vif->vif_mtu = req->vifr_mtu;
 
+    if (req->vifr_headroom > 0)
+        vif->vif_headroom = req->vifr_headroom;
+
+    vif->vif_learn_nh_id = 0;
+    if (req->vifr_learn_nh_id > 0)
+        vif->vif_learn_nh_id = req->vifr_learn_nh_id;
+
     return 0;
 }
 
@@ -967,8 +1456,14 @@ vr_interface_add(vr_interface_req *req)
         goto generate_resp;
     }
 
-    vif->vif_stats = vr_zalloc(vr_num_cpus *
-            sizeof(struct vr_interface_stats));
+    /* the counters of a new interface start from 0, mmap-ed or not */
+    vif->vif_stats = vr_counters_vif_stats(router, req->vifr_idx);
+    if (vif->vif_stats)
+        memset(vif->vif_stats, 0,
+                vr_num_cpus * sizeof(struct vr_interface_stats));
+    else
+        vif->vif_stats = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_interface_stats));
     if (!vif->vif_stats) {
         ret = -ENOMEM;
         goto generate_resp;
@@ -986,9 +1481,22 @@ vr_interface_add(vr_interface_req *req)
 
     vif->vif_vrf = req->vifr_vrf;
     vif->vif_mtu = req->vifr_mtu;
+    vif->vif_headroom = VIF_DEFAULT_HEADROOM;
+    if (req->vifr_headroom > 0)
+        vif->vif_headroom = req->vifr_headroom;
     vif->vif_idx = req->vifr_idx;
     vif->vif_os_idx = req->vifr_os_idx;
     vif->vif_rid = req->vifr_rid;
+    if (req->vifr_learn_nh_id > 0)
+        vif->vif_learn_nh_id = req->vifr_learn_nh_id;
+
+    ret = vif_set_steering(vif, req);
+    if (ret)
+        goto generate_resp;
+
+    ret = vif_set_rate(vif, req);
+    if (ret)
+        goto generate_resp;
 
     if ((req->vifr_mac_size != sizeof(vif->vif_mac)) || !req->vifr_mac) {
         ret = -EINVAL;
@@ -1022,6 +1530,8 @@ vr_interface_add(vr_interface_req *req)
         }
     }
 
+    if (!ret)
+        vr_notify(router, VR_NOTIFY_VIF_UP, vif->vif_idx, 0);
 
 generate_resp:
     vr_send_response(ret);
@@ -1031,10 +1541,15 @@ generate_resp:
     return ret;
 }
 
+/*
+ * the counters are the sum of those of all the cpus, or, if core is not
+ * 0, those of cpu (core - 1) alone
+ */
 static void
-vr_interface_make_req(vr_interface_req *req, struct vr_interface *intf)
+vr_interface_make_req(vr_interface_req *req, struct vr_interface *intf,
+        unsigned int core)
 {
-    unsigned int i;
+    unsigned int i, first_cpu = 0, last_cpu = vr_num_cpus;
     struct vr_interface_stats *stats;
     struct vr_interface_settings settings;
 
@@ -1045,10 +1560,26 @@ vr_interface_make_req(vr_interface_req *req, struct vr_interface *intf)
     req->vifr_rid = intf->vif_rid;
     req->vifr_os_idx = intf->vif_os_idx;
     req->vifr_mtu = intf->vif_mtu;
+    req->vifr_headroom = intf->vif_headroom;
+    req->vifr_steer_policy = intf->vif_steer_policy;
+    if (req->vifr_steer_cpus) {
+        req->vifr_steer_cpus_size = intf->vif_steer_ncpus;
+        for (i = 0; i < intf->vif_steer_ncpus; i++)
+            req->vifr_steer_cpus[i] = intf->vif_steer_cpus[i];
+    }
     if (req->vifr_mac_size && req->vifr_mac)
         memcpy(req->vifr_mac, intf->vif_mac,
                 MINIMUM(req->vifr_mac_size, sizeof(intf->vif_mac)));
     req->vifr_ip = intf->vif_ip;
+    req->vifr_learn_nh_id = intf->vif_learn_nh_id;
+    if (intf->vif_rx_rate) {
+        req->vifr_rx_rate = intf->vif_rx_rate->vrr_rate;
+        req->vifr_rx_burst = intf->vif_rx_rate->vrr_burst;
+    }
+    if (intf->vif_tx_rate) {
+        req->vifr_tx_rate = intf->vif_tx_rate->vrr_rate;
+        req->vifr_tx_burst = intf->vif_tx_rate->vrr_burst;
+    }
 
     req->vifr_ref_cnt = intf->vif_users;
 
@@ -1058,8 +1589,21 @@ vr_interface_make_req(vr_interface_req *req, struct vr_interface *intf)
     req->vifr_obytes = 0;
     req->vifr_opackets = 0;
     req->vifr_oerrors = 0;
+    req->vifr_head_reallocs = 0;
+    req->vifr_rx_csum_hw = 0;
+    req->vifr_rx_csum_sw = 0;
+    req->vifr_rx_conform = 0;
+    req->vifr_rx_exceed = 0;
+    req->vifr_tx_conform = 0;
+    req->vifr_tx_exceed = 0;
+
+    if (core) {
+        first_cpu = core - 1;
+        last_cpu = core;
+    }
+    req->vifr_core = core;
 
-    for (i = 0; i < vr_num_cpus; i++) {
+    for (i = first_cpu; i < last_cpu; i++) {
         stats = vif_get_stats(intf, i);
         req->vifr_ibytes += stats->vis_ibytes;
         req->vifr_ipackets += stats->vis_ipackets;
@@ -1067,6 +1611,13 @@ vr_interface_make_req(vr_interface_req *req, struct vr_interface *intf)
         req->vifr_obytes += stats->vis_obytes;
         req->vifr_opackets += stats->vis_opackets;
         req->vifr_oerrors += stats->vis_oerrors;
+        req->vifr_head_reallocs += stats->vis_head_reallocs;
+        req->vifr_rx_csum_hw += stats->vis_rx_csum_hw;
+        req->vifr_rx_csum_sw += stats->vis_rx_csum_sw;
+        req->vifr_rx_conform += stats->vis_rx_conform;
+        req->vifr_rx_exceed += stats->vis_rx_exceed;
+        req->vifr_tx_conform += stats->vis_tx_conform;
+        req->vifr_tx_exceed += stats->vis_tx_exceed;
     }
 
     req->vifr_speed = -1;
@@ -1094,6 +1645,9 @@ vr_interface_req_get(void)
     if (req->vifr_mac)
         req->vifr_mac_size = VR_ETHER_ALEN;
 
+    req->vifr_steer_cpus = vr_zalloc(VIF_MAX_STEER_CPUS *
+            sizeof(*req->vifr_steer_cpus));
+
     return req;
 }
 
@@ -1107,6 +1661,9 @@ vr_interface_req_destroy(vr_interface_req *req)
     if (req->vifr_mac)
         vr_free(req->vifr_mac);
 
+    if (req->vifr_steer_cpus)
+        vr_free(req->vifr_steer_cpus);
+
     vr_free(req);
     return;
 }
@@ -1125,6 +1682,11 @@ vr_interface_get(vr_interface_req *req)
         goto generate_response;
     }
 
+    if (req->vifr_core < 0 || req->vifr_core > (int)vr_num_cpus) {
+        ret = -EINVAL;
+        goto generate_response;
+    }
+
     if ((unsigned int)req->vifr_idx >= router->vr_max_interfaces)
         vif = __vrouter_get_interface_os(router, req->vifr_os_idx);
     else
@@ -1137,7 +1699,7 @@ vr_interface_get(vr_interface_req *req)
             goto generate_response;
         }
 
-        vr_interface_make_req(resp, vif);
+        vr_interface_make_req(resp, vif, req->vifr_core);
     } else
         ret = -ENOENT;
 
@@ -1181,7 +1743,7 @@ vr_interface_dump(vr_interface_req *r)
             i < router->vr_max_interfaces; i++) {
         vif = router->vr_interfaces[i];
         if (vif) {
-            vr_interface_make_req(resp, vif);
+            vr_interface_make_req(resp, vif, 0);
             ret = vr_message_dump_object(dumper, VR_INTERFACE_OBJECT_ID, resp);
             if (ret <= 0)
                 break;
@@ -1202,6 +1764,7 @@ vr_interface_req_process(void *s_req)
     int ret;
     vr_interface_req *req = (vr_interface_req *)s_req;
 
+    vr_config_request(vrouter_get(req->vifr_rid), req->h_op);
     switch (req->h_op) {
     case SANDESH_OP_ADD:
         ret = vr_interface_add(req);
@@ -1291,11 +1854,15 @@ vif_vrf_table_set(struct vr_interface *vif, unsigned int vlan,
      * and the new entry is < 0
      */
     if (vif->vif_vrf_table[vlan] < 0) {
-        if (vrf >= 0)
+        if (vrf >= 0) {
             vif->vif_vrf_table_users++;
+            vif->vif_vrf_table_bmap[vlan / 64] |= (1ULL << (vlan % 64));
+        }
     } else {
-        if (vrf < 0)
+        if (vrf < 0) {
             vif->vif_vrf_table_users--;
+            vif->vif_vrf_table_bmap[vlan / 64] &= ~(1ULL << (vlan % 64));
+        }
     }
 
     vif->vif_vrf_table[vlan] = vrf;
@@ -1313,6 +1880,30 @@ vif_vrf_table_set(struct vr_interface *vif, unsigned int vlan,
     return 0;
 }
 
+/* the first vlan after the given one that has an entry, -1 if none */
+int
+vif_vrf_table_next(struct vr_interface *vif, int vlan)
+{
+    unsigned int word;
+    uint64_t bits;
+
+    if (!vif->vif_vrf_table || ++vlan >= VIF_VRF_TABLE_ENTRIES)
+        return -1;
+
+    if (vlan < 0)
+        vlan = 0;
+
+    word = vlan / 64;
+    bits = vif->vif_vrf_table_bmap[word] & (~0ULL << (vlan % 64));
+    while (!bits) {
+        if (++word >= VIF_VRF_TABLE_ENTRIES / 64)
+            return -1;
+        bits = vif->vif_vrf_table_bmap[word];
+    }
+
+    return word * 64 + __builtin_ctzll(bits);
+}
+
 
 /*
  * this makes sure that packets no longer enter the module when
@@ -1343,6 +1934,23 @@ vr_interface_shut(struct vrouter *router)
     return;
 }
 
+static void
+vr_agent_rings_free(struct vrouter *router)
+{
+    unsigned int i;
+
+    if (!router->vr_agent_ring_table)
+        return;
+
+    for (i = 0; i < vr_num_cpus; i++)
+        if (router->vr_agent_ring_table[i])
+            vr_btable_free(router->vr_agent_ring_table[i]);
+    vr_free(router->vr_agent_ring_table);
+    router->vr_agent_ring_table = NULL;
+
+    return;
+}
+
 void
 vr_interface_exit(struct vrouter *router, bool soft_reset)
 {
@@ -1364,7 +1972,11 @@ vr_interface_exit(struct vrouter *router, bool soft_reset)
         hif_ops = NULL;
     }
 
+    if (!soft_reset)
+        vr_agent_rings_free(router);
+
     if (!soft_reset && router->vr_interfaces) {
+        vr_replicas_free(router->vr_interface_replicas);
         vr_free(router->vr_interfaces);
         router->vr_interfaces = NULL;
         router->vr_max_interfaces = 0;
@@ -1377,6 +1989,7 @@ int
 vr_interface_init(struct vrouter *router)
 {
     int ret = 0;
+    unsigned int i;
     unsigned int table_memory = 0;
 
     if (!router->vr_interfaces) {
@@ -1387,6 +2000,32 @@ vr_interface_init(struct vrouter *router)
         if (!router->vr_interfaces && (ret = -ENOMEM))
             return vr_module_error(ret, __FUNCTION__,
                     __LINE__, table_memory);
+
+        ret = vr_replicas_alloc(router->vr_interface_replicas,
+                router->vr_interfaces, table_memory);
+        if (ret) {
+            vr_module_error(ret, __FUNCTION__, __LINE__, table_memory);
+            goto cleanup;
+        }
+    }
+
+    if (vr_agent_rings && !router->vr_agent_ring_table) {
+        router->vr_agent_ring_table = vr_zalloc(vr_num_cpus *
+                sizeof(struct vr_btable *));
+        if (!router->vr_agent_ring_table && (ret = -ENOMEM)) {
+            vr_module_error(ret, __FUNCTION__, __LINE__, 0);
+            goto cleanup;
+        }
+
+        for (i = 0; i < vr_num_cpus; i++) {
+            router->vr_agent_ring_table[i] =
+                vr_btable_alloc(VR_AGENT_RING_SPAN / VR_AGENT_RING_SLOT_SIZE,
+                        VR_AGENT_RING_SLOT_SIZE);
+            if (!router->vr_agent_ring_table[i] && (ret = -ENOMEM)) {
+                vr_module_error(ret, __FUNCTION__, __LINE__, i);
+                goto cleanup;
+            }
+        }
     }
 
     if (!hif_ops) {
@@ -1400,7 +2039,10 @@ vr_interface_init(struct vrouter *router)
     return 0;
 
 cleanup:
+    vr_agent_rings_free(router);
+
     if (router->vr_interfaces) {
+        vr_replicas_free(router->vr_interface_replicas);
         vr_free(router->vr_interfaces);
         router->vr_interfaces = NULL;
         router->vr_max_interfaces = 0;
@@ -29,6 +29,8 @@ struct vr_mcast_entry {
 
 #define VR_DEF_MCAST_ENTRIES          (1 * 1024)
 #define VR_DEF_MCAST_OENTRIES         (512)
+#define VR_MCAST_DUMP_BATCH           16
+#define VR_MCAST_BULK_MAX             32
 #define VR_MCAST_FLAG_VALID           1
 
 unsigned int vr_mcast_entries = VR_DEF_MCAST_ENTRIES;
@@ -193,29 +195,35 @@ __mcast_dump(struct vr_message_dumper *dumper)
 {
     struct vr_route_req *req = (struct vr_route_req *)(dumper->dump_req);
     struct vr_route_req resp;
+    struct vr_mcast_entry_key key;
     int ret;
     struct vr_mcast_entry *ent;
-    unsigned int i;
+    unsigned int i, n, index, cursor = 0;
+    vr_hentry_t ents[VR_MCAST_DUMP_BATCH];
+
+    /* resume right after the marker, instead of walking up to it */
+    if (dumper->dump_been_to_marker == 0) {
+        memset(&key, 0, sizeof(key));
+        key.src_ip = (unsigned int)req->rtr_req.rtr_src;
+        key.dst_ip = (unsigned int)req->rtr_req.rtr_prefix;
+        key.vrf_id = req->rtr_req.rtr_vrf_id;
+        if (!vr_find_hentry(vn_rtable, &key, &index))
+            return 0;
+        cursor = index + 1;
+        dumper->dump_been_to_marker = 1;
+    }
 
-    for(i = 0; i < (vr_mcast_entries + vr_mcast_oentries); i++) {
-        ent = (struct vr_mcast_entry *) vr_get_hentry_by_index(vn_rtable, i);
-        if (!ent)
-            continue;
-        if (ent->flags & VR_MCAST_FLAG_VALID) {
+    while ((n = vr_htable_iter(vn_rtable, &cursor, ents, NULL,
+                    VR_MCAST_DUMP_BATCH))) {
+        for (i = 0; i < n; i++) {
+            ent = (struct vr_mcast_entry *)ents[i];
             if (ent->key.vrf_id != req->rtr_req.rtr_vrf_id)
                 continue;
-            if (dumper->dump_been_to_marker == 0) {
-                if ((ent->key.src_ip == (unsigned int)req->rtr_req.rtr_src) &&
-                        (ent->key.dst_ip == (unsigned int)req->rtr_req.rtr_prefix) &&
-                        (ent->key.vrf_id == req->rtr_req.rtr_vrf_id)) {
-                    dumper->dump_been_to_marker = 1;
-                }
-            } else {
-                mcast_make_req(&resp, ent);
-                ret = vr_message_dump_object(dumper, VR_ROUTE_OBJECT_ID, &resp);
-                if (ret <= 0) 
-                    return ret;
-            }
+
+            mcast_make_req(&resp, ent);
+            ret = vr_message_dump_object(dumper, VR_ROUTE_OBJECT_ID, &resp);
+            if (ret <= 0)
+                return ret;
         }
     }
 
@@ -301,31 +309,93 @@ vr_l2_mcast_control_data_add(struct vr_packet *pkt)
     return true;
 }
 
-unsigned int
-vr_mcast_forward(struct vrouter *router, unsigned short vrf, 
-        struct vr_packet *pkt, struct vr_forwarding_md *fmd)
+static void
+mcast_pkt_key(unsigned short vrf, struct vr_packet *pkt,
+        struct vr_mcast_entry_key *key)
 {
-    struct vr_route_req rt;
-    struct vr_nexthop *nh;
     struct vr_ip *ip;
 
     pkt->vp_type = VP_TYPE_IP;
     ip = (struct vr_ip *)pkt_data(pkt);
 
-    rt.rtr_req.rtr_vrf_id = vrf;
-    rt.rtr_req.rtr_prefix_len = 32;
+    key->vrf_id = vrf;
     if (IS_MCAST_LINK_LOCAL(ip->ip_daddr) || IS_BCAST_IP(ip->ip_daddr)) {
-        rt.rtr_req.rtr_src = 0;
-        rt.rtr_req.rtr_prefix = 0xFFFFFFFF;
+        key->src_ip = 0;
+        key->dst_ip = 0xFFFFFFFF;
     } else {
-        rt.rtr_req.rtr_src = ip->ip_saddr;
-        rt.rtr_req.rtr_prefix = ip->ip_daddr;
+        key->src_ip = ip->ip_saddr;
+        key->dst_ip = ip->ip_daddr;
+    }
+
+    return;
+}
+
+/*
+ * the (S,G) entry of the packet, or the (*,G) entry of the group. there
+ * is no (*,G) for the source specific groups
+ */
+static struct vr_nexthop *
+mcast_pkt_nh(struct vr_mcast_entry_key *key, struct vr_mcast_entry *ent)
+{
+    if (!ent && key->src_ip && !IS_MCAST_SOURCE_SPECFIC(key->dst_ip)) {
+        key->src_ip = 0;
+        ent = vr_find_mcast_entry(key);
+    }
+
+    if (ent && ent->nh)
+        return ent->nh;
+
+    return ip4_default_nh;
+}
+
+unsigned int
+vr_mcast_forward(struct vrouter *router, unsigned short vrf, 
+        struct vr_packet *pkt, struct vr_forwarding_md *fmd)
+{
+    struct vr_mcast_entry_key key;
+
+    mcast_pkt_key(vrf, pkt, &key);
+    return nh_output(vrf, pkt, mcast_pkt_nh(&key, vr_find_mcast_entry(&key)),
+            fmd);
+}
+
+/*
+ * vr_mcast_forward for a burst of packets. the buckets of all the
+ * (S,G)s are fetched before the first of them is looked at
+ */
+void
+vr_mcast_forward_bulk(struct vrouter *router, unsigned short *vrfs,
+        struct vr_packet **pkts, unsigned int num_pkts,
+        struct vr_forwarding_md *fmds)
+{
+    unsigned int i;
+    unsigned int buckets[VR_MCAST_BULK_MAX];
+    struct vr_mcast_entry_key keys[VR_MCAST_BULK_MAX];
+    struct vr_mcast_entry *ent;
+
+    if (!vn_rtable) {
+        for (i = 0; i < num_pkts; i++)
+            vr_mcast_forward(router, vrfs[i], pkts[i], &fmds[i]);
+        return;
     }
 
-    nh = mcast_lookup(vrf, &rt, pkt);
-    if (!nh) {
-        nh = ip4_default_nh;
+    while (num_pkts > VR_MCAST_BULK_MAX) {
+        vr_mcast_forward_bulk(router, vrfs, pkts, VR_MCAST_BULK_MAX, fmds);
+        vrfs += VR_MCAST_BULK_MAX;
+        pkts += VR_MCAST_BULK_MAX;
+        fmds += VR_MCAST_BULK_MAX;
+        num_pkts -= VR_MCAST_BULK_MAX;
     }
 
-    return nh_output(vrf, pkt, nh, fmd);
+    for (i = 0; i < num_pkts; i++) {
+        mcast_pkt_key(vrfs[i], pkts[i], &keys[i]);
+        buckets[i] = vr_htable_prefetch(vn_rtable, &keys[i]);
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        ent = vr_find_hentry_in_bucket(vn_rtable, &keys[i], buckets[i]);
+        nh_output(vrfs[i], pkts[i], mcast_pkt_nh(&keys[i], ent), &fmds[i]);
+    }
+
+    return;
 }
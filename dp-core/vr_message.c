@@ -30,6 +30,12 @@ static struct vr_message_handler message_h = {
     .vm_trans           =   &default_transport,
 };
 
+/*
+ * how big a buffer dumps ask for. clients that receive in page sized
+ * buffers need this to be set to VR_MESSAGE_PAGE_SIZE
+ */
+int vr_dump_buf_size = VR_MESSAGE_DUMP_BUF_SIZE;
+
 void *
 vr_mtrans_alloc(unsigned int size)
 {
@@ -57,15 +63,95 @@ vr_message_request(struct vr_message *message)
 
     message_h.vm_proto->mproto_decode(message->vr_message_buf,
             message->vr_message_len, NULL, NULL);
+    vr_free_deferred_flush();
+
     return 0;
 }
 
+/*
+ * a request that carries many objects, one after the other (agent resync),
+ * each of which is processed as a request of its own. the status
+ * responses of the objects are folded into one response for the whole
+ * batch, the code of which is the number of objects that were processed,
+ * or the error of the first object that failed, after which the rest of
+ * the batch is not processed. objects (of gets) are sent as usual
+ */
+int
+vr_message_request_batch(struct vr_message *message)
+{
+    int ret;
+    struct vr_message_batch *batch = &message_h.vm_batch;
+
+    if (!message_h.vm_proto)
+        return 0;
+
+    batch->vb_active = true;
+    batch->vb_error = 0;
+    batch->vb_objects = 0;
+
+    message_h.vm_proto->mproto_decode(message->vr_message_buf,
+            message->vr_message_len, NULL, NULL);
+
+    batch->vb_active = false;
+    /* one grace period for all that the objects of the batch let go of */
+    vr_free_deferred_flush();
+    ret = batch->vb_error ? batch->vb_error : (int)batch->vb_objects;
+
+    return vr_send_response(ret);
+}
+
+/* whether the protocol should go on to the next object of the request */
+bool
+vr_message_batch_next(void)
+{
+    return message_h.vm_batch.vb_active && !message_h.vm_batch.vb_error;
+}
+
+/*
+ * every response, and a dump has two, needs a wrapper to be queued in.
+ * wrappers of sent responses are kept for the next ones instead of going
+ * back to the allocator, up to VR_MESSAGE_POOL_SIZE of them
+ */
+static struct vr_message *
+vr_message_alloc(void)
+{
+    struct vr_qelem *elem;
+    struct vr_message *message;
+
+    elem = vr_queue_dequeue(&message_h.vm_pool);
+    if (elem)
+        return CONTAINER_OF(vr_message_queue, struct vr_message, elem);
+
+    message = vr_zalloc(sizeof(*message));
+    if (!message)
+        return NULL;
+
+    if (message_h.vm_pool_allocated < VR_MESSAGE_POOL_SIZE) {
+        message->vr_message_pooled = true;
+        message_h.vm_pool_allocated++;
+    }
+
+    return message;
+}
+
+static void
+vr_message_pool_exit(void)
+{
+    struct vr_qelem *elem;
+
+    while ((elem = vr_queue_dequeue(&message_h.vm_pool)))
+        vr_free(CONTAINER_OF(vr_message_queue, struct vr_message, elem));
+    message_h.vm_pool_allocated = 0;
+
+    return;
+}
+
 static int
 vr_message_queue_response(char *buf, int len)
 {
     struct vr_message *response;
 
-    response = vr_zalloc(sizeof(*response));
+    response = vr_message_alloc();
     if (!response)
         return -ENOMEM;
 
@@ -101,7 +187,14 @@ vr_message_free(struct vr_message *message)
     if (message) {
         if (message->vr_message_buf)
             vr_mtrans_free(message->vr_message_buf);
-        vr_free(message);
+
+        if (message->vr_message_pooled) {
+            message->vr_message_buf = NULL;
+            message->vr_message_len = 0;
+            vr_queue_enqueue(&message_h.vm_pool, &message->vr_message_queue);
+        } else {
+            vr_free(message);
+        }
     }
 
     return;
@@ -144,6 +237,56 @@ request_fail:
     return ret;
 }
 
+/*
+ * a request of 'count' objects of a type, encoded one after the other in
+ * one buffer and processed as a batch. the response is that of the batch
+ */
+int
+vr_message_make_request_batch(unsigned int object_type, void **objects,
+        unsigned int count)
+{
+    char *buf = NULL;
+    int ret = 0;
+    unsigned int i, len = 0, off = 0;
+    struct vr_mproto *proto;
+    struct vr_mtransport *trans;
+    struct vr_message request;
+
+    proto = message_h.vm_proto;
+    trans = message_h.vm_trans;
+    if (!proto || !trans)
+        return 0;
+
+    if (!count)
+        return 0;
+
+    for (i = 0; i < count; i++)
+        len += proto->mproto_buf_len(object_type, objects[i]);
+
+    buf = trans->mtrans_alloc(len);
+    if (!buf)
+        return -ENOMEM;
+
+    for (i = 0; i < count; i++) {
+        ret = proto->mproto_encode(buf + off, len - off, object_type,
+                objects[i], VR_MESSAGE_TYPE_REQUEST);
+        if (ret < 0)
+            goto request_fail;
+        off += ret;
+    }
+
+    request.vr_message_buf = buf;
+    request.vr_message_len = off;
+
+    vr_message_request_batch(&request);
+    ret = off;
+
+request_fail:
+    trans->mtrans_free(buf);
+
+    return ret;
+}
+
 int
 vr_message_process_response(int (*cb)(void *, unsigned int, void *),
         void *cb_arg)
@@ -160,8 +303,6 @@ vr_message_process_response(int (*cb)(void *, unsigned int, void *),
     while ((response = vr_message_dequeue_response())) {
         proto->mproto_decode(response->vr_message_buf,
                 response->vr_message_len, cb, cb_arg);
-        if (response->vr_message_buf)
-            vr_mtrans_free(response->vr_message_buf);
         vr_message_free(response);
     }
 
@@ -181,6 +322,17 @@ vr_message_response(unsigned int object_type, void *object, int ret)
     if (!proto || !trans)
         return 0;
 
+    if (message_h.vm_batch.vb_active) {
+        if (ret < 0) {
+            message_h.vm_batch.vb_error = ret;
+        } else {
+            message_h.vm_batch.vb_objects++;
+        }
+
+        /* the status alone goes with the response of the batch */
+        if (!object)
+            return 0;
+    }
 
     len = proto->mproto_buf_len(object_type, object);
     len += proto->mproto_buf_len(VR_RESPONSE_OBJECT_ID, NULL);
@@ -204,6 +356,26 @@ response_fail:
     return ret;
 }
 
+/*
+ * a buffer of events of vr_notify, to whoever listens. the buffer is the
+ * transport's from now, whether it could be sent or not
+ */
+int
+vr_message_notify(char *buf, unsigned int len)
+{
+    struct vr_mtransport *trans = message_h.vm_trans;
+
+    if (!trans)
+        return -EOPNOTSUPP;
+
+    if (!trans->mtrans_notify) {
+        trans->mtrans_free(buf);
+        return -EOPNOTSUPP;
+    }
+
+    return trans->mtrans_notify(buf, len);
+}
+
 int
 vr_send_response(int code)
 {
@@ -223,6 +395,19 @@ vr_message_dump_object(void *arg, unsigned int object_type, void *object)
     if (!proto || !trans)
         return 0;
 
+    /*
+     * a dump is many requests, one per response, and lets requests that
+     * came in meanwhile (agent programming mostly) go ahead of the rest
+     * of it. the dump ends early, as if the buffer were full, and the
+     * client picks up from the marker as usual
+     */
+    if (trans->mtrans_busy && ((dumper->dump_num_dumped &
+                    ~VR_MESSAGE_DUMP_INCOMPLETE) >=
+                VR_MESSAGE_DUMP_MIN_OBJECTS) && trans->mtrans_busy()) {
+        dumper->dump_num_dumped |= VR_MESSAGE_DUMP_INCOMPLETE;
+        return -EAGAIN;
+    }
+
     ret = proto->mproto_encode(dumper->dump_buffer + dumper->dump_offset,
             dumper->dump_buf_len - dumper->dump_offset,
             object_type, object, VR_MESSAGE_TYPE_RESPONSE);
@@ -249,22 +434,38 @@ vr_message_dump_exit(void *context, int ret)
     if (!proto || !trans)
         return;
 
-    if (dumper)
-        ret = dumper->dump_num_dumped;
-
-    vr_send_response(ret);
+    if (!dumper) {
+        vr_send_response(ret);
+        return;
+    }
 
-    if (dumper) {
-        if (!dumper->dump_offset) {
-            if (dumper->dump_buffer)
-                trans->mtrans_free(dumper->dump_buffer);
-        } else
+    ret = dumper->dump_num_dumped;
+
+    /*
+     * the status goes in the room that was kept for it ahead of the
+     * objects, and the buffer leaves as it is. a status is of fixed
+     * length, so that it not fitting there is a bug of the protocol
+     */
+    if (dumper->dump_resp_len) {
+        if (proto->mproto_encode_response(dumper->dump_buffer,
+                    dumper->dump_resp_len, VR_NULL_OBJECT_ID, NULL, ret) ==
+                (int)dumper->dump_resp_len) {
             vr_message_queue_response(dumper->dump_buffer,
                     dumper->dump_offset);
-
-        vr_free(dumper);
+        } else {
+            trans->mtrans_free(dumper->dump_buffer);
+            vr_send_response(-ENOSPC);
+        }
+    } else {
+        vr_send_response(ret);
+        if (dumper->dump_offset)
+            vr_message_queue_response(dumper->dump_buffer,
+                    dumper->dump_offset);
+        else
+            trans->mtrans_free(dumper->dump_buffer);
     }
 
+    vr_free(dumper);
     return;
 }
 
@@ -272,6 +473,7 @@ struct vr_message_dumper *
 vr_message_dump_init(void *req)
 {
     char *buf;
+    int len, ret;
     struct vr_message_dumper *dumper;
     struct vr_mproto *proto;
     struct vr_mtransport *trans;
@@ -285,17 +487,41 @@ vr_message_dump_init(void *req)
     if (!dumper)
         return NULL;
 
-    buf = trans->mtrans_alloc(VR_MESSAGE_PAGE_SIZE);
+    /*
+     * the more objects a response carries, the fewer the round trips of
+     * a dump. large buffers are not always to be had in atomic context,
+     * and a page works just as well, only slower
+     */
+    len = vr_dump_buf_size;
+    if (len < VR_MESSAGE_PAGE_SIZE || len > VR_MESSAGE_DUMP_BUF_SIZE)
+        len = VR_MESSAGE_PAGE_SIZE;
+
+    buf = trans->mtrans_alloc(len);
+    if (!buf && len > VR_MESSAGE_PAGE_SIZE) {
+        len = VR_MESSAGE_PAGE_SIZE;
+        buf = trans->mtrans_alloc(len);
+    }
+
     if (!buf) {
         vr_free(dumper);
         return NULL;
     }
 
     dumper->dump_buffer = buf;
-    dumper->dump_buf_len = VR_MESSAGE_PAGE_SIZE;
-    dumper->dump_offset = 0;
+    dumper->dump_buf_len = len;
     dumper->dump_req = req;
 
+    /*
+     * keep room for the status at the head of the buffer, so that the
+     * status and the objects leave in one message that was encoded in
+     * place in the transport's buffer
+     */
+    ret = proto->mproto_encode_response(buf, len, VR_NULL_OBJECT_ID, NULL, 0);
+    if (ret < 0)
+        ret = 0;
+    dumper->dump_resp_len = ret;
+    dumper->dump_offset = ret;
+
     return dumper;
 }
 
@@ -318,8 +544,11 @@ vr_message_transport_register(struct vr_mtransport *trans)
 void
 vr_message_proto_unregister(struct vr_mproto *proto)
 {
-    if (message_h.vm_proto == proto)
+    if (message_h.vm_proto == proto) {
         message_h.vm_proto = NULL;
+        /* no more responses without a protocol to encode them */
+        vr_message_pool_exit();
+    }
 
     return;
 }
@@ -6,6 +6,9 @@
 #include "vr_sandesh.h"
 #include "vr_message.h"
 #include "vr_mirror.h"
+#include "vr_btable.h"
+
+extern unsigned int vr_flow_entries, vr_oflow_entries;
 
 static struct vr_mirror_entry *
 __vrouter_get_mirror(unsigned int rid, unsigned int index)
@@ -88,12 +91,37 @@ generate_resp:
     return ret;
 }
 
+static int
+vr_mirror_params_validate(vr_mirror_req *req)
+{
+    if (req->mirr_sample < 0 || req->mirr_rate < 0)
+        return -EINVAL;
+
+    if (req->mirr_snaplen && (req->mirr_snaplen < VR_MIRROR_MIN_SNAPLEN ||
+                req->mirr_snaplen > 0xFFFF))
+        return -EINVAL;
+
+    return 0;
+}
+
+static void
+vr_mirror_params_set(struct vr_mirror_entry *mirror, vr_mirror_req *req)
+{
+    mirror->mir_sample = req->mirr_sample;
+    mirror->mir_snaplen = req->mirr_snaplen;
+    mirror->mir_rate = req->mirr_rate;
+
+    return;
+}
+
 static int
 vr_mirror_change(struct vr_mirror_entry *mirror, vr_mirror_req *req,
         struct vr_nexthop *nh_new)
 {
     struct vr_nexthop *nh_old = mirror->mir_nh;
 
+    vr_mirror_params_set(mirror, req);
+
     if (mirror->mir_flags & VR_MIRROR_FLAG_MARKED_DELETE) {
         mirror->mir_flags &= ~VR_MIRROR_FLAG_MARKED_DELETE;
         mirror->mir_users++;
@@ -124,6 +152,9 @@ vr_mirror_add(vr_mirror_req *req)
         goto generate_resp;
     }
 
+    if ((ret = vr_mirror_params_validate(req)))
+        goto generate_resp;
+
     nh = vrouter_get_nexthop(req->mirr_rid, req->mirr_nhid);
     if (!nh)  {
         ret = -EINVAL;
@@ -135,9 +166,16 @@ vr_mirror_add(vr_mirror_req *req)
         vr_mirror_change(mirror, req, nh);
     } else {
         mirror = vr_zalloc(sizeof(*mirror));
+        if (!mirror) {
+            vrouter_put_nexthop(nh);
+            ret = -ENOMEM;
+            goto generate_resp;
+        }
+
         mirror->mir_users++;
         mirror->mir_nh = nh;
         mirror->mir_rid = req->mirr_rid;
+        vr_mirror_params_set(mirror, req);
         router->vr_mirrors[req->mirr_index] = mirror;
     }
 
@@ -159,6 +197,9 @@ vr_mirror_make_req(vr_mirror_req *req, struct vr_mirror_entry *mirror,
     req->mirr_users = mirror->mir_users;
     req->mirr_flags = mirror->mir_flags;
     req->mirr_rid = mirror->mir_rid;
+    req->mirr_sample = mirror->mir_sample;
+    req->mirr_snaplen = mirror->mir_snaplen;
+    req->mirr_rate = mirror->mir_rate;
     return;
 }
 
@@ -261,42 +302,108 @@ vr_mirror_meta_entry_destroy(unsigned int index, void *arg)
     struct vr_mirror_meta_entry *me = (struct vr_mirror_meta_entry *)arg;
     if (me && me != VR_ITABLE_ERR_PTR) {
         vr_delay_op();
-        if (me->mirror_md)
-            vr_free(me->mirror_md);
         vr_free(me);
     }
 
     return;
 }
 
+/*
+ * vr_mirror_md owns the meta data, and keeps it across a flow table
+ * resize, when the flow indices move around. the slots are a direct map
+ * from a flow index to the entry, for the datapath to not walk the itable
+ * for every mirrored packet. indices beyond the slots (flows that are in
+ * the table being resized to) are looked up in the itable
+ */
+static void
+vr_mirror_meta_slot_set(struct vrouter *router, unsigned int index,
+        struct vr_mirror_meta_entry *me)
+{
+    struct vr_mirror_meta_entry **slot;
+
+    if (!router->vr_mirror_md_slots)
+        return;
+
+    slot = (struct vr_mirror_meta_entry **)
+        vr_btable_get(router->vr_mirror_md_slots, index);
+    if (slot)
+        *slot = me;
+
+    return;
+}
+
+static struct vr_mirror_meta_entry *
+vr_mirror_meta_entry_get(struct vrouter *router, unsigned int index)
+{
+    struct vr_btable *slots = router->vr_mirror_md_slots;
+    struct vr_mirror_meta_entry **slot;
+
+    if (slots && index < vr_btable_entries(slots)) {
+        slot = (struct vr_mirror_meta_entry **)vr_btable_get(slots, index);
+        if (slot)
+            return *slot;
+    }
+
+    return (struct vr_mirror_meta_entry *)vr_itable_get(router->vr_mirror_md,
+            index);
+}
+
+static void
+vr_mirror_meta_slots_free(struct vrouter *router)
+{
+    struct vr_btable *slots = router->vr_mirror_md_slots;
+
+    if (slots) {
+        router->vr_mirror_md_slots = NULL;
+        vr_delay_op();
+        vr_btable_free(slots);
+    }
+
+    return;
+}
+
+/*
+ * the flow table is now 'entries' big. the meta data of all flows is
+ * out of the index space when this is called, and is attached back to
+ * the new indices afterwards, filling in the new slots
+ */
+void
+vr_mirror_meta_resize(struct vrouter *router, unsigned int entries)
+{
+    vr_mirror_meta_slots_free(router);
+    router->vr_mirror_md_slots = vr_btable_alloc(entries,
+            sizeof(struct vr_mirror_meta_entry *));
+
+    return;
+}
+
 int
 vr_mirror_meta_entry_set(struct vrouter *router, unsigned int index,
                          unsigned int mir_sip, unsigned short mir_sport, 
                          void *meta_data, unsigned int meta_data_len,
                          unsigned short mirror_vrf)
 {
-    char *buf;
     struct vr_mirror_meta_entry *me, *me_old;
 
-    me = vr_malloc(sizeof(*me));
+    me = vr_malloc(sizeof(*me) + meta_data_len);
     if (!me)
         return -ENOMEM;
 
-    buf = vr_malloc(meta_data_len);
-    if (!buf) {
-        vr_free(me);
-        return -ENOMEM;
-    }
-
-    memcpy(buf, meta_data, meta_data_len);
-    me->mirror_md = buf;
+    me->mirror_md = (void *)(me + 1);
+    memcpy(me->mirror_md, meta_data, meta_data_len);
     me->mirror_md_len = meta_data_len;
     me->mirror_sip = mir_sip;
     me->mirror_sport = mir_sport;
     me->mirror_vrf = mirror_vrf;
 
     me_old = vr_itable_set(router->vr_mirror_md, index, me);
-    if (me_old && me_old != VR_ITABLE_ERR_PTR)
+    if (me_old == VR_ITABLE_ERR_PTR) {
+        vr_free(me);
+        return -ENOMEM;
+    }
+
+    vr_mirror_meta_slot_set(router, index, me);
+    if (me_old)
         vr_mirror_meta_entry_destroy(index, (void *)me_old);
     
     return 0;
@@ -307,6 +414,7 @@ vr_mirror_meta_entry_del(struct vrouter *router, unsigned int index)
 {
     struct vr_mirror_meta_entry *me;
 
+    vr_mirror_meta_slot_set(router, index, NULL);
     me = vr_itable_del(router->vr_mirror_md, index);
     if (me)
         vr_mirror_meta_entry_destroy(index, (void *)me);
@@ -314,6 +422,70 @@ vr_mirror_meta_entry_del(struct vrouter *router, unsigned int index)
     return;
 }
 
+/*
+ * the pair below moves the meta data of a flow from one index to another,
+ * when the flow table renumbers its entries (online resize)
+ */
+struct vr_mirror_meta_entry *
+vr_mirror_meta_entry_detach(struct vrouter *router, unsigned int index)
+{
+    struct vr_mirror_meta_entry *me;
+
+    vr_mirror_meta_slot_set(router, index, NULL);
+    me = vr_itable_del(router->vr_mirror_md, index);
+    if (me == VR_ITABLE_ERR_PTR)
+        return NULL;
+
+    return me;
+}
+
+void
+vr_mirror_meta_entry_attach(struct vrouter *router, unsigned int index,
+        struct vr_mirror_meta_entry *me)
+{
+    struct vr_mirror_meta_entry *me_old;
+
+    if (!me)
+        return;
+
+    me_old = vr_itable_set(router->vr_mirror_md, index, me);
+    if (me_old == VR_ITABLE_ERR_PTR) {
+        vr_mirror_meta_entry_destroy(index, (void *)me);
+        return;
+    }
+
+    vr_mirror_meta_slot_set(router, index, me);
+    if (me_old)
+        vr_mirror_meta_entry_destroy(index, (void *)me_old);
+
+    return;
+}
+
+/* whether this packet is the one in mir_sample, and within mir_rate */
+static bool
+vr_mirror_sample(struct vr_mirror_entry *mirror)
+{
+    unsigned int sec, nsec;
+
+    if (mirror->mir_sample > 1 &&
+            (++mirror->mir_sample_count % mirror->mir_sample))
+        return false;
+
+    if (mirror->mir_rate) {
+        vr_get_mono_time(&sec, &nsec);
+        if (sec != mirror->mir_rate_sec) {
+            mirror->mir_rate_sec = sec;
+            mirror->mir_rate_count = 0;
+        }
+
+        if (mirror->mir_rate_count >= mirror->mir_rate)
+            return false;
+        mirror->mir_rate_count++;
+    }
+
+    return true;
+}
+
 int
 vr_mirror(struct vrouter *router, uint8_t mirror_id, 
           struct vr_packet *pkt, struct vr_forwarding_md *fmd)
@@ -323,62 +495,98 @@ vr_mirror(struct vrouter *router, uint8_t mirror_id,
     struct vr_pcap *pcap;
     struct vr_mirror_entry *mirror;
     struct vr_mirror_meta_entry *mme;
-    unsigned int captured_len;
+    unsigned int captured_len, orig_len, head_space;
     unsigned int mirror_md_len = 0;
-    unsigned char default_mme[2] = {0xff, 0x0};
-    void *mirror_md;
-    struct vr_nexthop *pkt_nh;
+    static const unsigned char default_mme[2] = {0xff, 0x0};
+    const void *mirror_md;
+    struct vr_nexthop *pkt_nh = NULL;
+    struct vr_packet *pkt_c;
+    unsigned short data, tail, len;
     bool reset;
 
     mirror = router->vr_mirrors[mirror_id];
     if (!mirror)
         return 0;
 
+    if ((mirror->mir_sample > 1 || mirror->mir_rate) &&
+            !vr_mirror_sample(mirror))
+        return 0;
+
     if (fmd->fmd_flow_index >= 0) {
-        mme = (struct vr_mirror_meta_entry *)vr_itable_get(router->vr_mirror_md,
-                                                           fmd->fmd_flow_index);
-        if (!mme)
+        mme = vr_mirror_meta_entry_get(router, fmd->fmd_flow_index);
+        if (!mme || mme == VR_ITABLE_ERR_PTR)
             return 0;
         mirror_md_len = mme->mirror_md_len;
         mirror_md = mme->mirror_md;
-        fmd->fmd_dvrf = mme->mirror_vrf;
+        vr_fmd_set_dvrf(fmd, mme->mirror_vrf);
     } else {
         mirror_md_len = sizeof(default_mme);
         mirror_md = default_mme;
     }
 
     nh = mirror->mir_nh;
-    pkt = vr_pclone(pkt);
-    if (!pkt)
-        return 0;
 
     /* If packet is from fabric, mirror it by adding the required L2
      * header. If not get the processed headers by resetting the packet
      * and mirror it
      */
     reset = true;
+    head_space = VR_MIRROR_PKT_HEAD_SPACE + mirror_md_len;
     if (pkt->vp_if && pkt->vp_if->vif_type == VIF_TYPE_PHYSICAL) {
         pkt_nh = pkt->vp_nh;
         if (pkt_nh && pkt_nh->nh_type == NH_ENCAP && pkt_nh->nh_dev &&
             pkt_nh->nh_dev->vif_set_rewrite && pkt_nh->nh_encap_len) {
-
             reset = false;
-            if (vr_pcow(pkt,  VR_MIRROR_PKT_HEAD_SPACE + mirror_md_len +
-                    pkt_nh->nh_encap_len)) 
-                goto fail;
-
-            if (!pkt_nh->nh_dev->vif_set_rewrite(pkt_nh->nh_dev, pkt, 
-                    pkt_nh->nh_data, pkt_nh->nh_encap_len))
-                goto fail;
+            head_space += pkt_nh->nh_encap_len;
         }
     }
 
-    if (reset) {
-        vr_preset(pkt);
-        if (vr_pcow(pkt,  VR_MIRROR_PKT_HEAD_SPACE + mirror_md_len))
-            goto fail;
+    if (vr_pclone_head) {
+        /*
+         * the clone copies only the headers, from where the reset puts
+         * them. the original goes on as it was
+         */
+        data = pkt->vp_data;
+        tail = pkt->vp_tail;
+        len = pkt->vp_len;
+        if (reset)
+            vr_preset(pkt);
+        pkt_c = vr_pclone_head(pkt, head_space, VR_MIRROR_PKT_HDR_LEN);
+        pkt->vp_data = data;
+        pkt->vp_tail = tail;
+        pkt->vp_len = len;
+        if (!pkt_c)
+            return 0;
+        pkt = pkt_c;
+    } else {
+        pkt = vr_pclone(pkt);
+        if (!pkt)
+            return 0;
+        if (reset)
+            vr_preset(pkt);
+    }
+
+    /*
+     * with a snaplen, only that much of the clone is copied, instead of
+     * the cow below copying all of it
+     */
+    orig_len = pkt_len(pkt);
+    if (mirror->mir_snaplen && orig_len > mirror->mir_snaplen) {
+        vr_pset_data(pkt, pkt->vp_data);
+        pkt_c = pkt_copy_head_space(pkt, 0, mirror->mir_snaplen, head_space);
+        vr_pfree(pkt, VP_DROP_DUPLICATED);
+        if (!pkt_c)
+            return 0;
+        pkt = pkt_c;
     }
 
+    if (!vr_pclone_head && vr_pcow(pkt, head_space))
+        goto fail;
+
+    if (!reset && !pkt_nh->nh_dev->vif_set_rewrite(pkt_nh->nh_dev, pkt,
+                pkt_nh->nh_data, pkt_nh->nh_encap_len))
+        goto fail;
+
 
     pkt->vp_flags |= VP_FLAG_FROM_DP;
     /* Set the GSO and partial checksum flag */
@@ -388,7 +596,8 @@ vr_mirror(struct vrouter *router, uint8_t mirror_id,
     if (!buf)
         goto fail;
 
-    captured_len = htonl(pkt_len(pkt));
+    captured_len = pkt_len(pkt);
+    orig_len += mirror_md_len;
     if (mirror_md_len) 
         memcpy(buf, mirror_md, mirror_md_len);
 
@@ -398,8 +607,8 @@ vr_mirror(struct vrouter *router, uint8_t mirror_id,
         if (!pcap)
             goto fail;
         
-        pcap->pcap_incl_len = captured_len;
-        pcap->pcap_orig_len = captured_len;
+        pcap->pcap_incl_len = htonl(captured_len);
+        pcap->pcap_orig_len = htonl(orig_len);
         
         /* Get the time stamp in seconds and nanoseconds*/
         vr_get_time(&pcap->pcap_ts_sec, &pcap->pcap_ts_usec);
@@ -432,6 +641,8 @@ vr_mirror_exit(struct vrouter *router, bool soft_reset)
         router->vr_mirror_md = NULL;
     }
 
+    vr_mirror_meta_slots_free(router);
+
     if (!soft_reset) {
         vr_free(router->vr_mirrors);
         router->vr_mirrors = NULL; 
@@ -463,6 +674,11 @@ vr_mirror_init(struct vrouter *router)
         }
     }
 
+    /* without the slots, the datapath looks the meta data up in the itable */
+    if (!router->vr_mirror_md_slots)
+        router->vr_mirror_md_slots = vr_btable_alloc(vr_flow_entries +
+                vr_oflow_entries, sizeof(struct vr_mirror_meta_entry *));
+
     return 0;
 
 cleanup:
@@ -8,21 +8,24 @@
 #include "vr_sandesh.h"
 #include "vr_mpls.h"
 
+unsigned int vr_mpls_labels = VR_MAX_LABELS;
+
 static struct vr_nexthop *
 vrouter_get_label(unsigned int rid, unsigned int label)
 {
     struct vrouter *router = vrouter_get(rid);
 
-    if (!router || label > router->vr_max_labels)
+    if (!router || label >= router->vr_max_labels)
         return NULL;
 
-    return router->vr_ilm[label];
+    return ((struct vr_nexthop **)vr_replica(router->vr_ilm_replicas))[label];
 }
 
 int
 vr_mpls_del(vr_mpls_req *req)
 {
     struct vrouter *router;
+    struct vr_nexthop *nh;
     int ret = 0;
 
     router = vrouter_get(req->mr_rid);
@@ -31,15 +34,16 @@ vr_mpls_del(vr_mpls_req *req)
         goto generate_resp;
     }
 
-    if (req->mr_label > (int)router->vr_max_labels) {
+    if (req->mr_label < 0 ||
+            (unsigned int)req->mr_label >= router->vr_max_labels) {
         ret = -EINVAL;
         goto generate_resp;
     }
 
-    if (router->vr_ilm[req->mr_label])
-        vrouter_put_nexthop(router->vr_ilm[req->mr_label]);
-
-    router->vr_ilm[req->mr_label] = NULL;
+    nh = router->vr_ilm[req->mr_label];
+    vr_replicas_set(router->vr_ilm_replicas, req->mr_label, NULL);
+    if (nh)
+        vrouter_put_nexthop(nh);
 
 generate_resp:
     vr_send_response(ret);
@@ -47,11 +51,66 @@ generate_resp:
     return ret;
 }
 
+/*
+ * the table of labels grows (doubles) online to take 'label', when the
+ * agent adds a label beyond it, so that the labels that are not used do
+ * not take memory. the new tables are a copy of the old ones, and take
+ * their place before vr_max_labels grows, so that a reader that sees the
+ * new size also sees a table as big. the old tables are gone once the
+ * readers are
+ */
+static int
+vr_mpls_grow(struct vrouter *router, unsigned int label)
+{
+    int ret, node;
+    unsigned int labels, memory;
+    struct vr_nexthop **ilm, **old_ilm;
+    void *replicas[VR_MAX_NUMA_NODES], *old_replicas[VR_MAX_NUMA_NODES];
+
+    labels = router->vr_max_labels ? router->vr_max_labels : VR_MAX_LABELS;
+    while (labels <= label)
+        labels *= 2;
+    if (labels > VR_MPLS_LABEL_SPACE)
+        labels = VR_MPLS_LABEL_SPACE;
+
+    memory = labels * sizeof(struct vr_nexthop *);
+    ilm = vr_zalloc(memory);
+    if (!ilm)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, memory);
+
+    if (router->vr_ilm)
+        memcpy(ilm, router->vr_ilm,
+                router->vr_max_labels * sizeof(struct vr_nexthop *));
+
+    ret = vr_replicas_alloc(replicas, ilm, memory);
+    if (ret) {
+        vr_free(ilm);
+        return vr_module_error(ret, __FUNCTION__, __LINE__, memory);
+    }
+
+    old_ilm = router->vr_ilm;
+    memcpy(old_replicas, router->vr_ilm_replicas, sizeof(old_replicas));
+
+    router->vr_ilm = ilm;
+    for (node = 0; node < VR_MAX_NUMA_NODES; node++)
+        router->vr_ilm_replicas[node] = replicas[node];
+    __sync_synchronize();
+    router->vr_max_labels = labels;
+
+    if (old_ilm) {
+        vr_delay_op();
+        vr_replicas_free(old_replicas);
+        vr_free(old_ilm);
+    }
+
+    return 0;
+}
+
 int
 vr_mpls_add(vr_mpls_req *req)
 {
     struct vrouter *router;
-    struct vr_nexthop *nh;
+    struct vr_nexthop *nh, *nh_old;
     int ret = 0;
 
     router = vrouter_get(req->mr_rid);
@@ -60,18 +119,27 @@ vr_mpls_add(vr_mpls_req *req)
         goto generate_resp;
     }
 
-    if ((unsigned int)req->mr_label > router->vr_max_labels) {
+    if (req->mr_label < 0 || req->mr_label >= VR_MPLS_LABEL_SPACE) {
         ret = -EINVAL;
         goto generate_resp;
     }
 
+    if ((unsigned int)req->mr_label >= router->vr_max_labels) {
+        ret = vr_mpls_grow(router, req->mr_label);
+        if (ret)
+            goto generate_resp;
+    }
+
     nh = vrouter_get_nexthop(req->mr_rid, req->mr_nhid);
     if (!nh)  {
         ret = -EINVAL;
         goto generate_resp;
     }
 
-    router->vr_ilm[req->mr_label] = nh;
+    nh_old = router->vr_ilm[req->mr_label];
+    vr_replicas_set(router->vr_ilm_replicas, req->mr_label, nh);
+    if (nh_old)
+        vrouter_put_nexthop(nh_old);
 
 generate_resp:
     vr_send_response(ret);
@@ -135,7 +203,8 @@ vr_mpls_get(vr_mpls_req *req)
     struct vrouter *router;
 
     router = vrouter_get(req->mr_rid);
-    if (!router || req->mr_label > (int)router->vr_max_labels) {
+    if (!router || req->mr_label < 0 ||
+            (unsigned int)req->mr_label >= router->vr_max_labels) {
         ret = -ENODEV;
     } else {
         nh = vrouter_get_label(req->mr_rid, req->mr_label);
@@ -158,6 +227,7 @@ vr_mpls_req_process(void *s_req)
 {
     vr_mpls_req *req = (vr_mpls_req *)s_req;
 
+    vr_config_request(vrouter_get(req->mr_rid), req->h_op);
     switch (req->h_op) {
     case SANDESH_OP_ADD:
         vr_mpls_add(req);
@@ -199,7 +269,7 @@ vr_mpls_tunnel_type(unsigned int label, unsigned int control_data, unsigned
         goto fail;
     }
 
-    nh = router->vr_ilm[label];
+    nh = ((struct vr_nexthop **)vr_replica(router->vr_ilm_replicas))[label];
     if(!nh) {
         res = VP_DROP_INVALID_NH;
         goto fail;
@@ -225,13 +295,16 @@ fail:
     return -1;
 }
 
+/*
+ * nh, when the caller already looked the label up (vr_fabric_demux), is
+ * the nexthop of the label
+ */
 int
-vr_mpls_input(struct vrouter *router, struct vr_packet *pkt,
-        struct vr_forwarding_md *fmd)
+vr_mpls_input_nh(struct vrouter *router, struct vr_packet *pkt,
+        struct vr_forwarding_md *fmd, struct vr_nexthop *nh)
 {
     unsigned int label;
     unsigned short vrf;
-    struct vr_nexthop *nh;
     unsigned char *data;
     struct vr_ip *ip;
     unsigned short drop_reason = 0;
@@ -257,7 +330,7 @@ vr_mpls_input(struct vrouter *router, struct vr_packet *pkt,
     }
 
     ip = (struct vr_ip *)pkt_network_header(pkt);
-    fmd->fmd_outer_src_ip = ip->ip_saddr;
+    vr_fmd_set_outer_src_ip(fmd, ip->ip_saddr);
 
     /* Store the TTL in packet. Will be used for multicast replication */
     pkt->vp_ttl = ttl;
@@ -273,12 +346,18 @@ vr_mpls_input(struct vrouter *router, struct vr_packet *pkt,
     pkt_set_network_header(pkt, pkt->vp_data);
     pkt_set_inner_network_header(pkt, pkt->vp_data);
 
-    nh = router->vr_ilm[label];
+    if (!nh)
+        nh = ((struct vr_nexthop **)vr_replica(router->vr_ilm_replicas))[label];
     if (!nh) {
         drop_reason = VP_DROP_INVALID_NH;
         goto dropit;
     }
 
+    /* an l3 label carries v6 as well as v4, told apart by the version */
+    if (nh->nh_family == AF_INET && pkt_head_len(pkt) &&
+            (*pkt_data(pkt) >> 4) == 6)
+        pkt->vp_type = VP_TYPE_IP6;
+
     /*
      * We are typically looking at interface nexthops, and hence we will
      * hit the vrf of the destination device. But, labels can also point
@@ -309,6 +388,13 @@ dropit:
     return 0;
 }
 
+int
+vr_mpls_input(struct vrouter *router, struct vr_packet *pkt,
+        struct vr_forwarding_md *fmd)
+{
+    return vr_mpls_input_nh(router, pkt, fmd, NULL);
+}
+
 void
 vr_mpls_exit(struct vrouter *router, bool soft_reset)
 {
@@ -320,11 +406,12 @@ vr_mpls_exit(struct vrouter *router, bool soft_reset)
     for (i = 0; i < router->vr_max_labels; i++) {
         if (router->vr_ilm[i]) {
             vrouter_put_nexthop(router->vr_ilm[i]);
-            router->vr_ilm[i] = NULL;
+            vr_replicas_set(router->vr_ilm_replicas, i, NULL);
         }
     }
 
     if (soft_reset == false) {
+        vr_replicas_free(router->vr_ilm_replicas);
         vr_free(router->vr_ilm);
         router->vr_ilm = NULL;
         router->vr_max_labels = 0;
@@ -336,15 +423,26 @@ vr_mpls_exit(struct vrouter *router, bool soft_reset)
 int
 vr_mpls_init(struct vrouter *router)
 {
-    int ilm_memory;
+    int ret, ilm_memory;
 
     if (!router->vr_ilm) {
-        router->vr_max_labels = VR_MAX_LABELS;
+        if (!vr_mpls_labels || vr_mpls_labels > VR_MPLS_LABEL_SPACE)
+            vr_mpls_labels = VR_MAX_LABELS;
+        router->vr_max_labels = vr_mpls_labels;
         ilm_memory = sizeof(struct vr_nexthop *) * router->vr_max_labels;
         router->vr_ilm = vr_zalloc(ilm_memory);
         if (!router->vr_ilm)
             return vr_module_error(-ENOMEM, __FUNCTION__,
                     __LINE__, ilm_memory);
+
+        ret = vr_replicas_alloc(router->vr_ilm_replicas, router->vr_ilm,
+                ilm_memory);
+        if (ret) {
+            vr_free(router->vr_ilm);
+            router->vr_ilm = NULL;
+            router->vr_max_labels = 0;
+            return vr_module_error(ret, __FUNCTION__, __LINE__, ilm_memory);
+        }
     }
 
     return 0;
@@ -8,6 +8,7 @@
 #include "vr_sandesh.h"
 #include "vr_mcast.h"
 #include "vr_bridge.h"
+#include "vr_hash.h"
 
 static int nh_discard(unsigned short, struct vr_packet *,
         struct vr_nexthop *, struct vr_forwarding_md *);
@@ -24,7 +25,8 @@ __vrouter_get_nexthop(struct vrouter *router, unsigned int index)
     if (!router || index >= router->vr_max_nexthops)
         return NULL;
 
-    return router->vr_nexthops[index];
+    return ((struct vr_nexthop **)
+            vr_replica(router->vr_nexthop_replicas))[index];
 }
 
 struct vr_nexthop *
@@ -41,32 +43,42 @@ vrouter_get_nexthop(unsigned int rid, unsigned int index)
     return nh;
 }
 
-void
-vrouter_put_nexthop(struct vr_nexthop *nh)
+/* after the grace period that vr_free_deferred_flush waited for */
+static void
+vrouter_free_nexthop(struct vr_deferred *vd)
 {
     int i;
+    struct vr_nexthop *nh = CONTAINER_OF(nh_deferred, struct vr_nexthop, vd);
+
+    /* If composite de-ref the internal nexthops */
+    if (nh->nh_type == NH_COMPOSITE) {
+        for (i = 0; i < nh->nh_component_cnt; i++) {
+            if (nh->nh_component_nh[i].cnh)
+                vrouter_put_nexthop(nh->nh_component_nh[i].cnh);
+        }
+
+        vr_free(nh->nh_component_nh);
+        if (nh->nh_ecmp_table)
+            vr_free(nh->nh_ecmp_table);
+    }
+    if (nh->nh_dev) {
+        vrouter_put_interface(nh->nh_dev);
+    }
+    vr_free(nh);
 
+    return;
+}
+
+void
+vrouter_put_nexthop(struct vr_nexthop *nh)
+{
     /* This function might get invoked with zero ref_cnt */
     if (nh->nh_users) {
         nh->nh_users--;
     }
 
-    if (!nh->nh_users ) {
-        vr_delay_op();
-        /* If composite de-ref the internal nexthops */
-        if (nh->nh_type == NH_COMPOSITE) {
-            for (i = 0; i < nh->nh_component_cnt; i++) {
-                if (nh->nh_component_nh[i].cnh)
-                    vrouter_put_nexthop(nh->nh_component_nh[i].cnh);
-            }
-
-            vr_free(nh->nh_component_nh);
-        }
-        if (nh->nh_dev) {
-            vrouter_put_interface(nh->nh_dev);
-        }
-        vr_free(nh);
-    }
+    if (!nh->nh_users)
+        vr_free_deferred(&nh->nh_deferred, vrouter_free_nexthop);
 
     return;
 }
@@ -88,7 +100,7 @@ vrouter_add_nexthop(struct vr_nexthop *nh)
         return 0;
  
     nh->nh_users++;
-    router->vr_nexthops[nh->nh_id] = nh;
+    vr_replicas_set(router->vr_nexthop_replicas, nh->nh_id, nh);
     return 0;
 }
 
@@ -101,7 +113,7 @@ nh_del(struct vr_nexthop *nh)
         return; 
 
     if (router->vr_nexthops[nh->nh_id]) {
-        router->vr_nexthops[nh->nh_id] = NULL;
+        vr_replicas_set(router->vr_nexthop_replicas, nh->nh_id, NULL);
     }
     vrouter_put_nexthop(nh);
 
@@ -220,10 +232,91 @@ nh_udp_tunnel_helper(struct vr_packet *pkt, unsigned short sport,
     return true;
 }
 
+/*
+ * the outer ip and udp/gre header of a tunnel nexthop, built once when the
+ * nexthop is added. length, id and checksum are left zero, and the sum of
+ * the words of the header is kept so that the checksum of a packet needs
+ * only the length and id added in
+ */
+static void
+nh_tunnel_hdr_build(unsigned char *hdr, __u16 *sum, unsigned char proto,
+        unsigned int sip, unsigned int dip, unsigned short sport,
+        unsigned short dport)
+{
+    struct vr_ip *ip = (struct vr_ip *)hdr;
+    struct vr_udp *udp;
+    struct vr_gre *gre;
+
+    memset(hdr, 0, NH_TUN_HDR_LEN);
+    ip->ip_version = 4;
+    ip->ip_hl = 5;
+    ip->ip_ttl = 64;
+    ip->ip_proto = proto;
+    ip->ip_saddr = sip;
+    ip->ip_daddr = dip;
+
+    if (proto == VR_IP_PROTO_UDP) {
+        udp = (struct vr_udp *)(ip + 1);
+        udp->udp_sport = sport;
+        udp->udp_dport = dport;
+    } else {
+        gre = (struct vr_gre *)(ip + 1);
+        gre->gre_proto = VR_GRE_PROTO_MPLS_NO;
+    }
+
+    *sum = ~vr_ip_csum(ip);
+    return;
+}
+
+/*
+ * push the outer header of a tunnel from the template of the nexthop. a
+ * zero sport keeps the source port of the template
+ */
+static struct vr_ip *
+nh_push_tunnel_hdr(struct vr_packet *pkt, unsigned char *hdr, __u16 sum,
+        unsigned short id, unsigned short sport)
+{
+    unsigned int csum, len = sizeof(struct vr_ip);
+    struct vr_ip *ip;
+    struct vr_udp *udp = NULL;
+
+    if (((struct vr_ip *)hdr)->ip_proto == VR_IP_PROTO_UDP)
+        len += sizeof(struct vr_udp);
+    else
+        len += sizeof(struct vr_gre);
+
+    ip = (struct vr_ip *)pkt_push(pkt, len);
+    if (!ip)
+        return NULL;
+
+    memcpy(ip, hdr, len);
+    ip->ip_id = id;
+    ip->ip_len = htons(pkt_len(pkt));
+
+    csum = sum + ip->ip_id + ip->ip_len;
+    csum = (csum >> 16) + (csum & 0xffff);
+    csum += (csum >> 16);
+    ip->ip_csum = ~csum;
+
+    if (ip->ip_proto == VR_IP_PROTO_UDP) {
+        udp = (struct vr_udp *)(ip + 1);
+        udp->udp_length = htons(pkt_len(pkt) - sizeof(struct vr_ip));
+        if (sport)
+            udp->udp_sport = sport;
+    }
+
+    pkt_set_network_header(pkt, pkt->vp_data);
+    return ip;
+}
+
+/*
+ * a vxlan tunnel nexthop passes itself in tun_nh, to push the outer header
+ * from its template
+ */
 static bool 
 nh_vxlan_tunnel_helper(unsigned short vrf, struct vr_packet *pkt, 
                        struct vr_forwarding_md *fmd, unsigned int sip,
-                       unsigned int dip)
+                       unsigned int dip, struct vr_nexthop *tun_nh)
 {
     unsigned short udp_src_port = VR_VXLAN_UDP_SRC_PORT;
     struct vr_vxlan *vxlanh;
@@ -255,6 +348,11 @@ nh_vxlan_tunnel_helper(unsigned short vrf, struct vr_packet *pkt,
     vxlanh->vxlan_vnid = htonl(fmd->fmd_label << VR_VXLAN_VNID_SHIFT);
     vxlanh->vxlan_flags = htonl(VR_VXLAN_IBIT);
 
+    if (tun_nh)
+        return nh_push_tunnel_hdr(pkt, tun_nh->nh_udp_tun_hdr,
+                tun_nh->nh_udp_tun_hdr_sum, htons(vr_generate_unique_ip_id()),
+                htons(udp_src_port)) != NULL;
+
     return nh_udp_tunnel_helper(pkt, htons(udp_src_port), 
                              htons(VR_VXLAN_UDP_DST_PORT), sip, dip);
 }
@@ -264,6 +362,19 @@ nh_mcast_clone(struct vr_packet *pkt, unsigned short head_room)
 {
     struct vr_packet *clone_pkt;
 
+    /*
+     * a private copy of the headers the replica may rewrite, the payload
+     * shared with the original
+     */
+    if (vr_pclone_head) {
+        clone_pkt = vr_pclone_head(pkt, head_room, VR_MCAST_PKT_HDR_LEN);
+        if (!clone_pkt)
+            return NULL;
+
+        clone_pkt->vp_ttl = pkt->vp_ttl;
+        return clone_pkt;
+    }
+
     /* Clone the packet */
     clone_pkt = vr_pclone(pkt);
     if (!clone_pkt) {
@@ -290,10 +401,11 @@ nh_composite_ecmp_validate_src(unsigned short vrf, struct vr_packet *pkt,
     struct vr_nexthop *cnh;
 
     /* the first few checks are straight forward */
-    if (!fmd || (uint8_t)fmd->fmd_ecmp_src_nh_index >= nh->nh_component_cnt)
+    if (!fmd ||
+            (uint8_t)vr_fmd_ecmp_src_nh_index(fmd) >= nh->nh_component_cnt)
         return NH_SOURCE_INVALID;
 
-    cnh = nh->nh_component_nh[fmd->fmd_ecmp_src_nh_index].cnh;
+    cnh = nh->nh_component_nh[vr_fmd_ecmp_src_nh_index(fmd)].cnh;
     if (cnh && !cnh->nh_validate_src)
         return NH_SOURCE_INVALID;
 
@@ -306,10 +418,10 @@ nh_composite_ecmp_validate_src(unsigned short vrf, struct vr_packet *pkt,
     if (!cnh ||
             (NH_SOURCE_INVALID == cnh->nh_validate_src(vrf, pkt, cnh, fmd))) {
         for (i = 0; i < nh->nh_component_cnt; i++) {
-            if (i == fmd->fmd_ecmp_src_nh_index)
+            if (i == vr_fmd_ecmp_src_nh_index(fmd))
                 continue;
 
-            cnh = nh->nh_component_nh[fmd->fmd_ecmp_src_nh_index].cnh;
+            cnh = nh->nh_component_nh[vr_fmd_ecmp_src_nh_index(fmd)].cnh;
             if (!cnh || !cnh->nh_validate_src)
                 continue;
 
@@ -329,6 +441,42 @@ nh_composite_ecmp_validate_src(unsigned short vrf, struct vr_packet *pkt,
     return NH_SOURCE_VALID;
 }
 
+/*
+ * pick the member of a hashing ecmp nexthop from the 5 tuple of the packet.
+ * a flow sticks to the member from then on, and the agent learns of the
+ * choice from the flow event ring
+ */
+static int
+nh_composite_ecmp_hash(unsigned short vrf, struct vr_packet *pkt,
+        struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
+{
+    unsigned int hash, ports = 0;
+    unsigned char member;
+    struct vr_ip *ip;
+    struct vr_forwarding_md def_fmd;
+
+    ip = (struct vr_ip *)pkt_network_header(pkt);
+    if (!vr_ip_fragment(ip) && (ip->ip_proto == VR_IP_PROTO_TCP ||
+                ip->ip_proto == VR_IP_PROTO_UDP))
+        ports = *(unsigned int *)pkt_transport_header(pkt, ip);
+
+    hash = vr_hash_3words(ip->ip_saddr, ip->ip_daddr, ports ^ ip->ip_proto,
+            VR_HASH_INITVAL);
+    member = nh->nh_ecmp_table[hash % NH_ECMP_TABLE_SIZE];
+
+    if (!fmd) {
+        vr_init_forwarding_md(&def_fmd);
+        fmd = &def_fmd;
+    }
+
+    vr_fmd_set_ecmp_nh_index(fmd, member);
+    fmd->fmd_label = nh->nh_component_nh[member].cnh_label;
+    if (fmd->fmd_flow_index >= 0)
+        vr_flow_ecmp_select(nh->nh_router, fmd->fmd_flow_index, member);
+
+    return nh_output(vrf, pkt, nh->nh_component_nh[member].cnh, fmd);
+}
+
 static int
 nh_composite_ecmp(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
@@ -342,18 +490,23 @@ nh_composite_ecmp(unsigned short vrf, struct vr_packet *pkt,
     if (stats)
         stats->vrf_ecmp_composites++;
 
-    if (!fmd || (uint8_t)fmd->fmd_ecmp_nh_index >= nh->nh_component_cnt)
+    if (nh->nh_ecmp_table && (!fmd || vr_fmd_ecmp_nh_index(fmd) < 0 ||
+                (uint8_t)vr_fmd_ecmp_nh_index(fmd) >= nh->nh_component_cnt ||
+                !nh->nh_component_nh[vr_fmd_ecmp_nh_index(fmd)].cnh))
+        return nh_composite_ecmp_hash(vrf, pkt, nh, fmd);
+
+    if (!fmd || (uint8_t)vr_fmd_ecmp_nh_index(fmd) >= nh->nh_component_cnt)
         goto drop;
 
-    if (fmd->fmd_ecmp_nh_index >= 0)
-        member_nh = nh->nh_component_nh[fmd->fmd_ecmp_nh_index].cnh;
+    if (vr_fmd_ecmp_nh_index(fmd) >= 0)
+        member_nh = nh->nh_component_nh[vr_fmd_ecmp_nh_index(fmd)].cnh;
 
     if (!member_nh) {
         vr_trap(pkt, vrf, AGENT_TRAP_ECMP_RESOLVE, &fmd->fmd_flow_index);
         return 0;
     }
 
-    fmd->fmd_label = nh->nh_component_nh[fmd->fmd_ecmp_nh_index].cnh_label;
+    fmd->fmd_label = nh->nh_component_nh[vr_fmd_ecmp_nh_index(fmd)].cnh_label;
     return nh_output(vrf, pkt, member_nh, fmd);
 
 drop:
@@ -398,6 +551,13 @@ nh_composite_mcast_validate_src(unsigned short vrf, struct vr_packet *pkt,
     for (i = 0; i < fabric_nh->nh_component_cnt; i++) {
         dir_nh = fabric_nh->nh_component_nh[i].cnh;
 
+        /* of a tree, what comes from an upstream of a member is valid */
+        if ((fabric_nh->nh_flags & NH_FLAG_COMPOSITE_TREE) &&
+                fabric_nh->nh_component_nh[i].cnh_src &&
+                vr_fmd_outer_src_ip(fmd) ==
+                fabric_nh->nh_component_nh[i].cnh_src)
+            return NH_SOURCE_VALID;
+
         if (dir_nh->nh_type != NH_TUNNEL)
             continue;
 
@@ -408,8 +568,8 @@ nh_composite_mcast_validate_src(unsigned short vrf, struct vr_packet *pkt,
             tun_dip = dir_nh->nh_udp_tun_dip;
 
         /* Dont forward to same source */
-        if (tun_dip && fmd->fmd_outer_src_ip && 
-                fmd->fmd_outer_src_ip == tun_dip)
+        if (tun_dip && vr_fmd_outer_src_ip(fmd) && 
+                vr_fmd_outer_src_ip(fmd) == tun_dip)
             return NH_SOURCE_VALID;
     }
 
@@ -444,6 +604,9 @@ nh_composite_mcast_l2(unsigned short vrf, struct vr_packet *pkt,
         }
     }
 
+    if (!vr_pclone_head && vr_pshare && nh->nh_component_cnt > 1)
+        vr_pshare(pkt, VR_MCAST_PKT_HDR_LEN);
+
     /* 
      * The packet can come to this nexthp either from Fabric or from VM.
      * Incase of Fabric, the packet would contain the Vxlan header and
@@ -539,6 +702,9 @@ nh_composite_mcast_l3(unsigned short vrf, struct vr_packet *pkt,
         }
     }
 
+    if (!vr_pclone_head && vr_pshare && nh->nh_component_cnt > 1)
+        vr_pshare(pkt, VR_MCAST_PKT_HDR_LEN);
+
     for (i = 0; i < nh->nh_component_cnt; i++) {
         dir_nh = nh->nh_component_nh[i].cnh;
         if (dir_nh->nh_type == NH_ENCAP) {
@@ -584,7 +750,7 @@ nh_composite_fabric(unsigned short vrf, struct vr_packet *pkt,
     struct vr_nexthop *dir_nh;
     unsigned short drop_reason;
     struct vr_packet *new_pkt;
-    unsigned int sip;
+    unsigned int sip, src = 0;
     int32_t label;
 
     drop_reason = VP_DROP_CLONED_ORIGINAL;
@@ -603,6 +769,15 @@ nh_composite_fabric(unsigned short vrf, struct vr_packet *pkt,
      * along with control inforation is in first buffer. So it can be
      * safely cow'd for the required length
      */
+    if (!vr_pclone_head && vr_pshare && nh->nh_component_cnt > 1)
+        vr_pshare(pkt, VR_MCAST_PKT_HDR_LEN);
+
+    /*
+     * of a tree, the members to send to are those of the upstream that
+     * the packet came from, or those of the local vms
+     */
+    if (pkt->vp_if->vif_type == VIF_TYPE_PHYSICAL)
+        src = vr_fmd_outer_src_ip(fmd);
 
     label = fmd->fmd_label;
     for (i = 0; i < nh->nh_component_cnt; i++) {
@@ -611,9 +786,13 @@ nh_composite_fabric(unsigned short vrf, struct vr_packet *pkt,
         if (dir_nh->nh_type != NH_TUNNEL)
             continue;
 
+        if ((nh->nh_flags & NH_FLAG_COMPOSITE_TREE) &&
+                nh->nh_component_nh[i].cnh_src != src)
+            continue;
+
         /* Dont forward to same source */
-        if (fmd->fmd_outer_src_ip && 
-                fmd->fmd_outer_src_ip == dir_nh->nh_gre_tun_dip) 
+        if (vr_fmd_outer_src_ip(fmd) && 
+                vr_fmd_outer_src_ip(fmd) == dir_nh->nh_gre_tun_dip) 
             continue;
 
         /* 
@@ -665,7 +844,7 @@ nh_composite_fabric(unsigned short vrf, struct vr_packet *pkt,
              */
             fmd->fmd_label = label;
             if (nh_vxlan_tunnel_helper(dir_nh->nh_dev->vif_vrf, 
-                                        new_pkt, fmd, sip, sip) == false) {
+                                        new_pkt, fmd, sip, sip, NULL) == false) {
                 vr_pfree(new_pkt, VP_DROP_PUSH);
                 break;
             }
@@ -808,11 +987,9 @@ nh_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
             goto send_fail;
     }
 
-    if (nh_udp_tunnel_helper(pkt, nh->nh_udp_tun_sport,
-                             nh->nh_udp_tun_dport, nh->nh_udp_tun_sip,
-                             nh->nh_udp_tun_dip) == false) {
+    if (!nh_push_tunnel_hdr(pkt, nh->nh_udp_tun_hdr, nh->nh_udp_tun_hdr_sum,
+                htons(vr_generate_unique_ip_id()), 0))
         goto send_fail;
-    }
 
     if (pkt_len(pkt) > ((1 << sizeof(ip->ip_len) * 8)))
         goto send_fail;
@@ -834,7 +1011,7 @@ nh_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
         stats->vrf_udp_tunnels++;
 
     vr_forward(vrouter_get(nh->nh_rid), 
-               (vrf == (unsigned short)-1) ? fmd->fmd_dvrf : vrf,
+               (vrf == (unsigned short)-1) ? vr_fmd_dvrf(fmd) : vrf,
                pkt, fmd);
 
     return 0;
@@ -851,6 +1028,7 @@ static int
 nh_vxlan_tunnel(unsigned short vrf, struct vr_packet *pkt, 
                    struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
 {
+    uint64_t start = vr_perf_start();
     struct vr_interface *vif;
     struct vr_vrf_stats *stats;
     unsigned short reason = VP_DROP_PUSH;
@@ -864,7 +1042,7 @@ nh_vxlan_tunnel(unsigned short vrf, struct vr_packet *pkt,
         return vr_forward(nh->nh_router, vrf, pkt, fmd);
 
     if (nh_vxlan_tunnel_helper(vrf, pkt, fmd, nh->nh_udp_tun_sip,
-                                            nh->nh_udp_tun_dip) == false) {
+                                            nh->nh_udp_tun_dip, nh) == false) {
         goto send_fail;
     }
 
@@ -883,6 +1061,7 @@ nh_vxlan_tunnel(unsigned short vrf, struct vr_packet *pkt,
         goto send_fail;
     }
 
+    vr_perf_end(VR_PERF_ENCAP, start, 1);
     vif->vif_tx(vif, pkt);
 
     return 0;
@@ -897,7 +1076,7 @@ static int
 nh_mpls_udp_tunnel_validate_src(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
 {
-    if (fmd->fmd_outer_src_ip == nh->nh_udp_tun_dip)
+    if (vr_fmd_outer_src_ip(fmd) == nh->nh_udp_tun_dip)
         return NH_SOURCE_VALID;
 
     return NH_SOURCE_INVALID;
@@ -911,6 +1090,7 @@ static int
 nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt, 
                    struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
 {
+    uint64_t start = vr_perf_start();
     unsigned char *tun_encap;
     struct vr_interface *vif;
     struct vr_vrf_stats *stats;
@@ -967,7 +1147,7 @@ nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
     if (nh_push_mpls_header(pkt, fmd->fmd_label) < 0)
         goto send_fail;
 
-    if (vr_perfs)
+    if (vr_perfs && pkt->vp_type != VP_TYPE_IP6)
         pkt->vp_flags |= VP_FLAG_GSO;
 
     /*
@@ -978,9 +1158,15 @@ nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
     else 
         pkt->vp_type = VP_TYPE_IPOIP;
 
-    if (nh_udp_tunnel_helper(pkt, htons(udp_src_port), 
-                             htons(VR_MPLS_OVER_UDP_DST_PORT),
-                             tun_sip, tun_dip) == false) {
+    if (vr_mudp) {
+        if (nh_udp_tunnel_helper(pkt, htons(udp_src_port),
+                                 htons(VR_MPLS_OVER_UDP_DST_PORT),
+                                 tun_sip, tun_dip) == false) {
+            goto send_fail;
+        }
+    } else if (!nh_push_tunnel_hdr(pkt, nh->nh_udp_tun_hdr,
+                nh->nh_udp_tun_hdr_sum, htons(vr_generate_unique_ip_id()),
+                htons(udp_src_port))) {
         goto send_fail;
     }
 
@@ -992,6 +1178,7 @@ nh_mpls_udp_tunnel(unsigned short vrf, struct vr_packet *pkt,
         goto send_fail;
     }
 
+    vr_perf_end(VR_PERF_ENCAP, start, 1);
     vif->vif_tx(vif, pkt);
 
     return 0;
@@ -1007,7 +1194,7 @@ static int
 nh_gre_tunnel_validate_src(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
 {
-    if (fmd->fmd_outer_src_ip == nh->nh_gre_tun_dip)
+    if (vr_fmd_outer_src_ip(fmd) == nh->nh_gre_tun_dip)
         return NH_SOURCE_VALID;
 
     return NH_SOURCE_INVALID;
@@ -1017,10 +1204,10 @@ static int
 nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
 {
+    uint64_t start = vr_perf_start();
     unsigned int id;
     int gre_head_space;
     unsigned short drop_reason = VP_DROP_INVALID_NH;
-    struct vr_gre *gre_hdr;
     struct vr_ip *ip;
     unsigned char *tun_encap;
     struct vr_interface *vif;
@@ -1051,10 +1238,10 @@ nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
         return vr_forward(nh->nh_router, vrf, pkt, fmd);
 
 
-    if (vr_perfs)
+    if (vr_perfs && pkt->vp_type != VP_TYPE_IP6)
         pkt->vp_flags |= VP_FLAG_GSO;
 
-    if (pkt->vp_type != VP_TYPE_L2) {
+    if (pkt->vp_type != VP_TYPE_L2 && pkt->vp_type != VP_TYPE_IP6) {
         ip = (struct vr_ip *)pkt_network_header(pkt);
         id = ip->ip_id;
     } else {
@@ -1076,38 +1263,17 @@ nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
     if (nh_push_mpls_header(pkt, fmd->fmd_label) < 0)
         goto send_fail;
 
-    gre_hdr = (struct vr_gre *)pkt_push(pkt, sizeof(struct vr_gre));
-    if (!gre_hdr) {
+    if (!nh_push_tunnel_hdr(pkt, nh->nh_gre_tun_hdr, nh->nh_gre_tun_hdr_sum,
+                id, 0)) {
         drop_reason = VP_DROP_PUSH;
         goto send_fail;
     }
 
-    gre_hdr->gre_flags = 0;
-    gre_hdr->gre_proto = VR_GRE_PROTO_MPLS_NO;
-
-    ip = (struct vr_ip *)pkt_push(pkt, sizeof(struct vr_ip));
-    if (!ip) {
-        drop_reason = VP_DROP_PUSH;
-        goto send_fail;
-    }
-    pkt_set_network_header(pkt, pkt->vp_data);
     if (pkt->vp_type == VP_TYPE_L2)
         pkt->vp_type = VP_TYPE_L2OIP;
     else 
         pkt->vp_type = VP_TYPE_IPOIP;
 
-    ip->ip_version = 4;
-    ip->ip_hl = 5;
-    ip->ip_tos = 0;
-    ip->ip_id = id;
-    ip->ip_frag_off = 0;
-    ip->ip_ttl = 64;
-    ip->ip_proto = VR_IP_PROTO_GRE;
-    ip->ip_saddr = nh->nh_gre_tun_sip;
-    ip->ip_daddr = nh->nh_gre_tun_dip;
-    ip->ip_len = htons(pkt_len(pkt));
-    /* checksum will be calculated in linux_xmit_segment */
-
     /* slap l2 header */
     vif = nh->nh_dev;
     tun_encap = vif->vif_set_rewrite(vif, pkt, nh->nh_data,
@@ -1116,6 +1282,7 @@ nh_gre_tunnel(unsigned short vrf, struct vr_packet *pkt,
         drop_reason = VP_DROP_PUSH;
         goto send_fail;
     }
+    vr_perf_end(VR_PERF_ENCAP, start, 1);
     vif->vif_tx(vif, pkt);
     return 0;
 
@@ -1129,6 +1296,9 @@ int
 nh_output(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *fmd)
 {
+    int ret;
+    uint64_t start;
+    struct vr_vrf_stats *stats;
     struct vr_nexthop *src_nh = NULL;
     struct vr_ip *ip;
     bool need_flow_lookup = false;
@@ -1168,9 +1338,25 @@ nh_output(unsigned short vrf, struct vr_packet *pkt,
                         pkt, VR_ETH_PROTO_IP, fmd);
             }
         }
+    } else if (pkt->vp_type == VP_TYPE_IP6) {
+        /* there are no ipv6 flows to apply the policy with */
+        if (nh->nh_flags & NH_FLAG_POLICY_ENABLED) {
+            vr_pfree(pkt, VP_DROP_FLOW_INVALID_PROTOCOL);
+            return 0;
+        }
+    }
+
+    stats = vr_inet_vrf_stats(vrf, pkt->vp_cpu);
+    if (stats) {
+        stats->vrf_tx_packets++;
+        stats->vrf_tx_bytes += pkt_len(pkt);
     }
 
-    return nh->nh_reach_nh(vrf, pkt, nh, fmd);
+    start = vr_perf_start();
+    ret = nh->nh_reach_nh(vrf, pkt, nh, fmd);
+    vr_perf_end(VR_PERF_NH_OUTPUT + nh->nh_type, start, 1);
+
+    return ret;
 }
 
 static int
@@ -1254,19 +1440,26 @@ static int
 nh_encap_l3_unicast(unsigned short vrf, struct vr_packet *pkt,
         struct vr_nexthop *nh, struct vr_forwarding_md *md)
 {
+    bool ip6 = (pkt->vp_type == VP_TYPE_IP6);
+    unsigned char *head;
     struct vr_interface *vif;
     struct vr_vrf_stats *stats;
-    struct vr_ip *ip;
+    struct vr_ip *ip = NULL;
 
     stats = vr_inet_vrf_stats(vrf, pkt->vp_cpu);
     if (stats)
         stats->vrf_encaps++;
 
     vif = nh->nh_dev;
-    pkt->vp_type = VP_TYPE_IP;
-    ip = (struct vr_ip *)pkt_network_header(pkt);
-    if (ip->ip_csum == VR_DIAG_IP_CSUM) {
+    if (ip6) {
+        /* the gro path knows only of v4 */
         pkt->vp_flags &= ~VP_FLAG_GRO;
+    } else {
+        pkt->vp_type = VP_TYPE_IP;
+        ip = (struct vr_ip *)pkt_network_header(pkt);
+        if (ip->ip_csum == VR_DIAG_IP_CSUM) {
+            pkt->vp_flags &= ~VP_FLAG_GRO;
+        }
     }
 
     /*
@@ -1293,17 +1486,22 @@ nh_encap_l3_unicast(unsigned short vrf, struct vr_packet *pkt,
             pkt_pull(pkt, VR_MPLS_HDR_LEN);
         }
     } else {
-        if (!vif->vif_set_rewrite(vif, pkt, nh->nh_data,
-                nh->nh_encap_len)) {
+        head = vif->vif_set_rewrite(vif, pkt, nh->nh_data, nh->nh_encap_len);
+        if (!head) {
             vr_pfree(pkt, VP_DROP_REWRITE_FAIL);
             return 0;
         }
+
+        /* the rewrite is of the v4 ethernet header, that ends in the type */
+        if (ip6 && nh->nh_encap_len >= VR_ETHER_HLEN)
+            *(unsigned short *)(head + nh->nh_encap_len - 2) =
+                htons(VR_ETH_PROTO_IP6);
     }
 
     /*
      * Look if this is the Diag packet to trap to agent
      */
-    if (ip->ip_csum == VR_DIAG_IP_CSUM) {
+    if (ip && ip->ip_csum == VR_DIAG_IP_CSUM) {
         pkt->vp_if = vif;
         vr_pset_data(pkt, pkt->vp_data);
         return vr_trap(pkt, vrf, AGENT_TRAP_DIAG, &vif->vif_idx);
@@ -1359,9 +1557,92 @@ nh_vxlan_vrf_add(struct vr_nexthop *nh, vr_nexthop_req *req)
     return 0;
 }
 
+/*
+ * the maglev table of a hashing ecmp nexthop. each member has its own
+ * permutation of the slots, derived from its nexthop and label, and the
+ * members take turns claiming the next free slot of their permutation,
+ * heavier members taking more turns. the members end up spread evenly
+ * over the table, and a change in the members moves few flows of the rest
+ */
+static int
+nh_ecmp_table_build(struct vr_nexthop *nh)
+{
+    unsigned int i, slot, filled = 0, members = 0, max_weight = 0;
+    unsigned int *state, *offset, *skip, *next, *credit, cnt;
+    unsigned char *table;
+    struct vr_component_nh *cnh;
+
+    cnt = nh->nh_component_cnt;
+    if (cnt > NH_ECMP_HASH_MAX_MEMBERS)
+        return -EINVAL;
+
+    for (i = 0; i < cnt; i++) {
+        cnh = &nh->nh_component_nh[i];
+        if (!cnh->cnh || !cnh->cnh_weight)
+            continue;
+        members++;
+        if (cnh->cnh_weight > max_weight)
+            max_weight = cnh->cnh_weight;
+    }
+
+    /* nothing to hash to. flows are resolved by the agent */
+    if (!members)
+        return 0;
+
+    table = vr_malloc(NH_ECMP_TABLE_SIZE);
+    if (!table)
+        return -ENOMEM;
+    memset(table, 0xff, NH_ECMP_TABLE_SIZE);
+
+    state = vr_zalloc(4 * cnt * sizeof(unsigned int));
+    if (!state) {
+        vr_free(table);
+        return -ENOMEM;
+    }
+    offset = state;
+    skip = offset + cnt;
+    next = skip + cnt;
+    credit = next + cnt;
+
+    for (i = 0; i < cnt; i++) {
+        cnh = &nh->nh_component_nh[i];
+        if (!cnh->cnh)
+            continue;
+        offset[i] = vr_hash_2words(cnh->cnh->nh_id, cnh->cnh_label,
+                VR_HASH_INITVAL) % NH_ECMP_TABLE_SIZE;
+        skip[i] = vr_hash_2words(cnh->cnh->nh_id, cnh->cnh_label,
+                ~VR_HASH_INITVAL) % (NH_ECMP_TABLE_SIZE - 1) + 1;
+    }
+
+    while (filled < NH_ECMP_TABLE_SIZE) {
+        for (i = 0; i < cnt && filled < NH_ECMP_TABLE_SIZE; i++) {
+            cnh = &nh->nh_component_nh[i];
+            if (!cnh->cnh || !cnh->cnh_weight)
+                continue;
+
+            credit[i] += cnh->cnh_weight;
+            while (credit[i] >= max_weight && filled < NH_ECMP_TABLE_SIZE) {
+                credit[i] -= max_weight;
+                do {
+                    slot = (offset[i] + next[i]++ * skip[i]) %
+                        NH_ECMP_TABLE_SIZE;
+                } while (table[slot] != 0xff);
+                table[slot] = i;
+                filled++;
+            }
+        }
+    }
+
+    vr_free(state);
+    nh->nh_ecmp_table = table;
+
+    return 0;
+}
+
 static int 
 nh_composite_add(struct vr_nexthop *nh, vr_nexthop_req *req)
 {
+    int ret;
     unsigned int i;
     struct vr_nexthop *tmp_nh;
 
@@ -1377,9 +1658,23 @@ nh_composite_add(struct vr_nexthop *nh, vr_nexthop_req *req)
         nh->nh_component_cnt = 0;
     }
 
+    if (nh->nh_ecmp_table) {
+        vr_free(nh->nh_ecmp_table);
+        nh->nh_ecmp_table = NULL;
+    }
+
     if ((req->nhr_nh_list_size < 0) || (req->nhr_nh_list_size != req->nhr_label_list_size))
         return -EINVAL;
 
+    if (req->nhr_weight_list_size &&
+            req->nhr_weight_list_size != req->nhr_nh_list_size)
+        return -EINVAL;
+
+    if ((req->nhr_flags & NH_FLAG_COMPOSITE_TREE) &&
+            (!(req->nhr_flags & NH_FLAG_COMPOSITE_FABRIC) ||
+             req->nhr_src_list_size != req->nhr_nh_list_size))
+        return -EINVAL;
+
     /* Nh list of size 0 is valid */
     if (req->nhr_nh_list_size == 0)
         return 0;
@@ -1393,6 +1688,12 @@ nh_composite_add(struct vr_nexthop *nh, vr_nexthop_req *req)
     for (i = 0; i < req->nhr_nh_list_size; i++) {
         nh->nh_component_nh[i].cnh = vrouter_get_nexthop(req->nhr_rid, req->nhr_nh_list[i]);
         nh->nh_component_nh[i].cnh_label = req->nhr_label_list[i];
+        if (req->nhr_weight_list_size)
+            nh->nh_component_nh[i].cnh_weight = req->nhr_weight_list[i];
+        else
+            nh->nh_component_nh[i].cnh_weight = 1;
+        if (req->nhr_flags & NH_FLAG_COMPOSITE_TREE)
+            nh->nh_component_nh[i].cnh_src = req->nhr_src_list[i];
     }
     nh->nh_component_cnt = req->nhr_nh_list_size;
 
@@ -1436,6 +1737,11 @@ nh_composite_add(struct vr_nexthop *nh, vr_nexthop_req *req)
         nh->nh_reach_nh = nh_composite_mcast_l2;
         nh->nh_validate_src = nh_composite_mcast_validate_src;
     } else if (req->nhr_flags & NH_FLAG_COMPOSITE_ECMP) {
+        if (req->nhr_flags & NH_FLAG_COMPOSITE_ECMP_HASH) {
+            ret = nh_ecmp_table_build(nh);
+            if (ret)
+                return ret;
+        }
         nh->nh_reach_nh = nh_composite_ecmp;
         nh->nh_validate_src = nh_composite_ecmp_validate_src;
     } else if (req->nhr_flags & NH_FLAG_COMPOSITE_FABRIC) {
@@ -1460,6 +1766,8 @@ nh_tunnel_add(struct vr_nexthop *nh, vr_nexthop_req *req)
         nh->nh_gre_tun_sip = req->nhr_tun_sip;
         nh->nh_gre_tun_dip = req->nhr_tun_dip;
         nh->nh_gre_tun_encap_len = req->nhr_encap_size;
+        nh_tunnel_hdr_build(nh->nh_gre_tun_hdr, &nh->nh_gre_tun_hdr_sum,
+                VR_IP_PROTO_GRE, req->nhr_tun_sip, req->nhr_tun_dip, 0, 0);
         nh->nh_reach_nh = nh_gre_tunnel;
         nh->nh_validate_src = nh_gre_tunnel_validate_src;
     } else if (nh->nh_flags & NH_FLAG_TUNNEL_UDP) {
@@ -1468,17 +1776,27 @@ nh_tunnel_add(struct vr_nexthop *nh, vr_nexthop_req *req)
         nh->nh_udp_tun_sport = req->nhr_tun_sport;
         nh->nh_udp_tun_dport = req->nhr_tun_dport;
         nh->nh_udp_tun_encap_len = req->nhr_encap_size;
+        nh_tunnel_hdr_build(nh->nh_udp_tun_hdr, &nh->nh_udp_tun_hdr_sum,
+                VR_IP_PROTO_UDP, req->nhr_tun_sip, req->nhr_tun_dip,
+                req->nhr_tun_sport, req->nhr_tun_dport);
         nh->nh_reach_nh = nh_udp_tunnel;
     } else if (nh->nh_flags & NH_FLAG_TUNNEL_UDP_MPLS) {
         nh->nh_udp_tun_sip = req->nhr_tun_sip;
         nh->nh_udp_tun_dip = req->nhr_tun_dip;
         nh->nh_udp_tun_encap_len = req->nhr_encap_size;
+        nh_tunnel_hdr_build(nh->nh_udp_tun_hdr, &nh->nh_udp_tun_hdr_sum,
+                VR_IP_PROTO_UDP, req->nhr_tun_sip, req->nhr_tun_dip,
+                htons(VR_MPLS_OVER_UDP_SRC_PORT),
+                htons(VR_MPLS_OVER_UDP_DST_PORT));
         nh->nh_reach_nh = nh_mpls_udp_tunnel;
         nh->nh_validate_src = nh_mpls_udp_tunnel_validate_src;
     } else if (nh->nh_flags & NH_FLAG_TUNNEL_VXLAN) {
         nh->nh_udp_tun_sip = req->nhr_tun_sip;
         nh->nh_udp_tun_dip = req->nhr_tun_dip;
         nh->nh_udp_tun_encap_len = req->nhr_encap_size;
+        nh_tunnel_hdr_build(nh->nh_udp_tun_hdr, &nh->nh_udp_tun_hdr_sum,
+                VR_IP_PROTO_UDP, req->nhr_tun_sip, req->nhr_tun_dip,
+                htons(VR_VXLAN_UDP_SRC_PORT), htons(VR_VXLAN_UDP_DST_PORT));
         nh->nh_reach_nh = nh_vxlan_tunnel;
     } else {
         return -EINVAL;
@@ -1736,6 +2054,29 @@ vr_nexthop_make_req(vr_nexthop_req *req, struct vr_nexthop *nh)
 
                 req->nhr_label_list[i] = nh->nh_component_nh[i].cnh_label;
             }
+
+            if (nh->nh_flags & NH_FLAG_COMPOSITE_ECMP_HASH) {
+                req->nhr_weight_list_size = nh->nh_component_cnt;
+                req->nhr_weight_list = vr_zalloc(req->nhr_nh_list_size *
+                        sizeof(unsigned int));
+                if (!req->nhr_weight_list)
+                    return -ENOMEM;
+
+                for (i = 0; i < req->nhr_nh_list_size; i++)
+                    req->nhr_weight_list[i] =
+                        nh->nh_component_nh[i].cnh_weight;
+            }
+
+            if (nh->nh_flags & NH_FLAG_COMPOSITE_TREE) {
+                req->nhr_src_list_size = nh->nh_component_cnt;
+                req->nhr_src_list = vr_zalloc(req->nhr_nh_list_size *
+                        sizeof(unsigned int));
+                if (!req->nhr_src_list)
+                    return -ENOMEM;
+
+                for (i = 0; i < req->nhr_nh_list_size; i++)
+                    req->nhr_src_list[i] = nh->nh_component_nh[i].cnh_src;
+            }
         }
 
         break;
@@ -1825,6 +2166,18 @@ vr_nexthop_req_destroy(vr_nexthop_req *req)
         req->nhr_label_list_size = 0;
     }
 
+    if (req->nhr_weight_list_size && req->nhr_weight_list) {
+        vr_free(req->nhr_weight_list);
+        req->nhr_weight_list = NULL;
+        req->nhr_weight_list_size = 0;
+    }
+
+    if (req->nhr_src_list_size && req->nhr_src_list) {
+        vr_free(req->nhr_src_list);
+        req->nhr_src_list = NULL;
+        req->nhr_src_list_size = 0;
+    }
+
     vr_free(req);
     return;
 }
@@ -1915,6 +2268,7 @@ vr_nexthop_req_process(void *s_req)
     int ret;
     vr_nexthop_req *req = (vr_nexthop_req *)s_req;
 
+    vr_config_request(vrouter_get(req->nhr_rid), req->h_op);
     switch (req->h_op) {
     case SANDESH_OP_ADD:
         ret = vr_nexthop_add(req);
@@ -1961,6 +2315,7 @@ nh_table_exit(struct vrouter *router, bool soft_reset)
 
 
     if (soft_reset == false) {
+        vr_replicas_free(router->vr_nexthop_replicas);
         router->vr_nexthops = NULL;
         /* Make the default nh point to NULL */
         ip4_default_nh = NULL;
@@ -2002,6 +2357,13 @@ nh_table_init(struct vrouter *router)
         if (!router->vr_nexthops)
             return vr_module_error(-ENOMEM, __FUNCTION__,
                     __LINE__, table_memory);
+
+        ret = vr_replicas_alloc(router->vr_nexthop_replicas,
+                router->vr_nexthops, table_memory);
+        if (ret) {
+            vr_module_error(ret, __FUNCTION__, __LINE__, table_memory);
+            goto init_fail;
+        }
     }
 
     if (!ip4_default_nh) {
@@ -2015,6 +2377,7 @@ nh_table_init(struct vrouter *router)
     return 0;
 
 init_fail:
+    vr_replicas_free(router->vr_nexthop_replicas);
     if (router->vr_nexthops)
         vr_free(router->vr_nexthops);
 
@@ -0,0 +1,239 @@
+/*
+ * vr_notify.c -- change notifications of the datapath, published on a
+ * multicast group instead of being found out by dumps
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#include <vr_os.h>
+#include "vr_message.h"
+#include "vr_notify.h"
+
+#define VR_NOTIFY_SLOTS                 256
+/* slots, plus the events that the flush makes up on its own */
+#define VR_NOTIFY_MAX_EVENTS            (VR_NOTIFY_SLOTS + \
+        VR_NOTIFY_TABLE_MAX + VP_DROP_MAX + 1)
+
+#define VR_NOTIFY_SLOT_FREE             0
+#define VR_NOTIFY_SLOT_BUSY             1
+#define VR_NOTIFY_SLOT_READY            2
+
+/* milliseconds between two messages, 0 to not publish at all */
+unsigned int vr_notify_msecs = 0;
+/* drops of a reason in one period that make for an event, 0 for none */
+unsigned int vr_notify_drop_threshold = 0;
+
+struct vr_notify_slot {
+    int vns_state;
+    struct vr_notify_event vns_event;
+};
+
+/*
+ * events are posted from any cpu into a ring of slots, the same way flow
+ * misses are batched. a slot is claimed, written and then marked ready,
+ * and the flush takes only the ready ones. events that find their slot
+ * taken are counted as lost. tables that were full and drops that went
+ * over the threshold are reported once a period, and not per packet
+ */
+struct vr_notify {
+    unsigned int vn_head;
+    unsigned int vn_lost;
+    unsigned int vn_table_full;
+    struct vr_timer *vn_timer;
+    /* the drop counters as of the last flush, once vn_drops_valid */
+    bool vn_drops_valid;
+    uint64_t vn_drops[VP_DROP_MAX];
+    struct vr_notify_slot vn_slots[VR_NOTIFY_SLOTS];
+};
+
+void
+vr_notify(struct vrouter *router, unsigned short type, unsigned int index,
+        uint64_t value)
+{
+    unsigned int slot;
+    struct vr_notify *notify;
+    struct vr_notify_slot *vns;
+
+    if (!router || !(notify = router->vr_notify))
+        return;
+
+    slot = __sync_fetch_and_add(&notify->vn_head, 1) % VR_NOTIFY_SLOTS;
+    vns = &notify->vn_slots[slot];
+    if (!__sync_bool_compare_and_swap(&vns->vns_state,
+                VR_NOTIFY_SLOT_FREE, VR_NOTIFY_SLOT_BUSY)) {
+        (void)__sync_fetch_and_add(&notify->vn_lost, 1);
+        return;
+    }
+
+    vns->vns_event.vne_type = type;
+    vns->vns_event.vne_rid = 0;
+    vns->vns_event.vne_index = index;
+    vns->vns_event.vne_value = value;
+    __sync_synchronize();
+    vns->vns_state = VR_NOTIFY_SLOT_READY;
+
+    return;
+}
+
+/* cheap enough for the packet path, as it is only a bit till the flush */
+void
+vr_notify_table_full(struct vrouter *router, unsigned int table)
+{
+    struct vr_notify *notify;
+
+    if (!router || !(notify = router->vr_notify) ||
+            (table >= VR_NOTIFY_TABLE_MAX))
+        return;
+
+    if (!(notify->vn_table_full & (1 << table)))
+        (void)__sync_fetch_and_or(&notify->vn_table_full, 1 << table);
+
+    return;
+}
+
+static unsigned int
+vr_notify_drops(struct vrouter *router, struct vr_notify *notify,
+        struct vr_notify_event *events)
+{
+    unsigned int cpu, reason, count = 0;
+    uint64_t total, drops;
+
+    if (!vr_notify_drop_threshold || !router->vr_pdrop_stats)
+        return 0;
+
+    for (reason = 0; reason < VP_DROP_MAX; reason++) {
+        total = 0;
+        for (cpu = 0; cpu < vr_num_cpus; cpu++)
+            total += router->vr_pdrop_stats[cpu][reason];
+
+        drops = total - notify->vn_drops[reason];
+        notify->vn_drops[reason] = total;
+        if (!notify->vn_drops_valid || (drops < vr_notify_drop_threshold))
+            continue;
+
+        events[count].vne_type = VR_NOTIFY_DROP_THRESHOLD;
+        events[count].vne_rid = 0;
+        events[count].vne_index = reason;
+        events[count].vne_value = drops;
+        count++;
+    }
+    notify->vn_drops_valid = true;
+
+    return count;
+}
+
+static void
+vr_notify_flush(void *arg)
+{
+    char *buf;
+    unsigned int i, count = 0, full, lost;
+    struct vrouter *router = (struct vrouter *)arg;
+    struct vr_notify *notify = router->vr_notify;
+    struct vr_notify_event *events;
+
+    if (!notify)
+        return;
+
+    buf = vr_mtrans_alloc(VR_NOTIFY_MAX_EVENTS *
+            sizeof(struct vr_notify_event));
+    /* the events wait for the next period */
+    if (!buf)
+        return;
+
+    events = (struct vr_notify_event *)buf;
+    for (i = 0; i < VR_NOTIFY_SLOTS; i++) {
+        if (notify->vn_slots[i].vns_state != VR_NOTIFY_SLOT_READY)
+            continue;
+
+        __sync_synchronize();
+        events[count++] = notify->vn_slots[i].vns_event;
+        notify->vn_slots[i].vns_state = VR_NOTIFY_SLOT_FREE;
+    }
+
+    full = __sync_lock_test_and_set(&notify->vn_table_full, 0);
+    for (i = 0; i < VR_NOTIFY_TABLE_MAX; i++) {
+        if (!(full & (1 << i)))
+            continue;
+
+        events[count].vne_type = VR_NOTIFY_TABLE_FULL;
+        events[count].vne_rid = 0;
+        events[count].vne_index = i;
+        events[count].vne_value = 0;
+        count++;
+    }
+
+    count += vr_notify_drops(router, notify, events + count);
+
+    lost = __sync_lock_test_and_set(&notify->vn_lost, 0);
+    if (lost) {
+        events[count].vne_type = VR_NOTIFY_LOST;
+        events[count].vne_rid = 0;
+        events[count].vne_index = 0;
+        events[count].vne_value = lost;
+        count++;
+    }
+
+    if (!count) {
+        vr_mtrans_free(buf);
+        return;
+    }
+
+    vr_message_notify(buf, count * sizeof(struct vr_notify_event));
+    return;
+}
+
+void
+vr_notify_exit(struct vrouter *router, bool soft_reset)
+{
+    struct vr_notify *notify = router->vr_notify;
+
+    if (!notify)
+        return;
+
+    if (notify->vn_timer) {
+        vr_delete_timer(notify->vn_timer);
+        vr_free(notify->vn_timer);
+        notify->vn_timer = NULL;
+    }
+
+    /* what the modules that went away before had to say */
+    vr_notify_flush(router);
+
+    router->vr_notify = NULL;
+    vr_delay_op();
+    vr_free(notify);
+
+    return;
+}
+
+int
+vr_notify_init(struct vrouter *router)
+{
+    struct vr_notify *notify;
+
+    if (router->vr_notify || !vr_notify_msecs)
+        return 0;
+
+    notify = vr_zalloc(sizeof(*notify));
+    if (!notify)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__,
+                sizeof(*notify));
+
+    notify->vn_timer = vr_zalloc(sizeof(*notify->vn_timer));
+    if (!notify->vn_timer) {
+        vr_free(notify);
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    router->vr_notify = notify;
+
+    notify->vn_timer->vt_timer = vr_notify_flush;
+    notify->vn_timer->vt_vr_arg = router;
+    notify->vn_timer->vt_msecs = vr_notify_msecs;
+    if (vr_create_timer(notify->vn_timer)) {
+        vr_free(notify->vn_timer);
+        notify->vn_timer = NULL;
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, 0);
+    }
+
+    return 0;
+}
@@ -13,17 +13,21 @@ pkt_reset(struct vr_packet *pkt)
     pkt->vp_tail = pkt->vp_data;
     pkt->vp_len = 0;
     pkt->vp_network_h = pkt->vp_data;
+    pkt->vp_transport_h = 0;
 
     return;
 }
 
+/*
+ * copy len bytes, from off, of a packet into a new packet that has
+ * head_space bytes in front for the headers to be pushed
+ */
 struct vr_packet *
-pkt_copy(struct vr_packet *pkt, unsigned short off, unsigned short len)
+pkt_copy_head_space(struct vr_packet *pkt, unsigned short off,
+        unsigned short len, unsigned short head_space)
 {
     struct vr_packet *pkt_c;
-    unsigned short head_space;
 
-    head_space = sizeof(struct vr_eth) + sizeof(struct agent_hdr);
     pkt_c = vr_palloc(head_space + len);
     if (!pkt_c)
         return pkt_c;
@@ -40,7 +44,15 @@ pkt_copy(struct vr_packet *pkt, unsigned short off, unsigned short len)
     pkt_c->vp_flags = pkt->vp_flags;
     pkt_c->vp_cpu = pkt->vp_cpu;
     pkt_c->vp_network_h = 0;
+    pkt_c->vp_transport_h = 0;
 
     return pkt_c;
 }
 
+struct vr_packet *
+pkt_copy(struct vr_packet *pkt, unsigned short off, unsigned short len)
+{
+    return pkt_copy_head_space(pkt, off, len,
+            sizeof(struct vr_eth) + sizeof(struct agent_hdr));
+}
+
@@ -0,0 +1,177 @@
+/*
+ * vr_perf.c -- accounting of the cycles of the stages of the datapath,
+ * for when the time of a packet has to be looked into
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#include <vr_os.h>
+#include "vr_message.h"
+#include "vr_sandesh.h"
+
+struct vr_perf_stage *vr_perf_stages;
+int vr_perf_enabled = 0;
+
+static void
+vr_perf_reset(void)
+{
+    if (vr_perf_stages)
+        memset(vr_perf_stages, 0, vr_num_cpus * VR_PERF_MAX *
+                sizeof(struct vr_perf_stage));
+
+    return;
+}
+
+/* turning it on starts from 0 */
+static int
+vr_perf_enable(bool enable)
+{
+    unsigned int size;
+
+    if (vr_perf_enabled) {
+        vr_perf_enabled = 0;
+        /* stages that are still adding up */
+        vr_delay_op();
+    }
+
+    if (!enable)
+        return 0;
+
+    if (!vr_get_cycles)
+        return -EOPNOTSUPP;
+
+    if (!vr_perf_stages) {
+        size = vr_num_cpus * VR_PERF_MAX * sizeof(struct vr_perf_stage);
+        vr_perf_stages = vr_zalloc(size);
+        if (!vr_perf_stages)
+            return -ENOMEM;
+    } else {
+        vr_perf_reset();
+    }
+
+    __sync_synchronize();
+    vr_perf_enabled = 1;
+
+    return 0;
+}
+
+static void
+vr_perf_make_req(vr_perf_req *resp, unsigned int stage)
+{
+    unsigned int cpu;
+    struct vr_perf_stage *vps;
+
+    memset(resp, 0, sizeof(*resp));
+    resp->vpr_stage = stage;
+    resp->vpr_enable = vr_perf_enabled;
+    if (!vr_perf_stages)
+        return;
+
+    for (cpu = 0; cpu < vr_num_cpus; cpu++) {
+        vps = &vr_perf_stages[cpu * VR_PERF_MAX + stage];
+        resp->vpr_cycles += vps->vps_cycles;
+        resp->vpr_packets += vps->vps_packets;
+        resp->vpr_calls += vps->vps_calls;
+    }
+
+    return;
+}
+
+static void
+vr_perf_get(vr_perf_req *req)
+{
+    int ret = 0;
+    vr_perf_req resp;
+
+    if ((unsigned short)req->vpr_stage >= VR_PERF_MAX) {
+        ret = -EINVAL;
+    } else {
+        vr_perf_make_req(&resp, req->vpr_stage);
+    }
+
+    vr_message_response(VR_PERF_OBJECT_ID, ret ? NULL : &resp, ret);
+    return;
+}
+
+/* the stages that were reached, after the marker */
+static void
+vr_perf_dump(vr_perf_req *req)
+{
+    int ret = 0;
+    unsigned int stage;
+    vr_perf_req resp;
+    struct vr_message_dumper *dumper;
+
+    dumper = vr_message_dump_init(req);
+    if (!dumper && (ret = -ENOMEM))
+        goto generate_response;
+
+    for (stage = req->vpr_marker + 1; stage < VR_PERF_MAX; stage++) {
+        vr_perf_make_req(&resp, stage);
+        if (!resp.vpr_calls)
+            continue;
+
+        ret = vr_message_dump_object(dumper, VR_PERF_OBJECT_ID, &resp);
+        if (ret <= 0)
+            break;
+    }
+
+generate_response:
+    vr_message_dump_exit(dumper, ret);
+    return;
+}
+
+void
+vr_perf_req_process(void *s_req)
+{
+    int ret;
+    vr_perf_req *req = (vr_perf_req *)s_req;
+
+    switch (req->h_op) {
+    case SANDESH_OP_ADD:
+        ret = vr_perf_enable(req->vpr_enable != 0);
+        vr_send_response(ret);
+        break;
+
+    case SANDESH_OP_DELETE:
+        vr_perf_reset();
+        vr_send_response(0);
+        break;
+
+    case SANDESH_OP_GET:
+        vr_perf_get(req);
+        break;
+
+    case SANDESH_OP_DUMP:
+        vr_perf_dump(req);
+        break;
+
+    default:
+        vr_send_response(-EOPNOTSUPP);
+        break;
+    }
+
+    return;
+}
+
+void
+vr_perf_exit(struct vrouter *router, bool soft_reset)
+{
+    vr_perf_enable(false);
+    if (soft_reset) {
+        vr_perf_reset();
+        return;
+    }
+
+    if (vr_perf_stages) {
+        vr_free(vr_perf_stages);
+        vr_perf_stages = NULL;
+    }
+
+    return;
+}
+
+int
+vr_perf_init(struct vrouter *router)
+{
+    return 0;
+}
@@ -7,22 +7,81 @@
 #include "vr_mpls.h"
 #include "vr_vxlan.h"
 #include "vr_mcast.h"
+#include "vr_hash.h"
 
 extern struct vr_nexthop *(*vr_inet_route_lookup)(unsigned int,
                 struct vr_route_req *, struct vr_packet *);
+extern void (*vr_inet_route_lookup_bulk)(struct vr_route_req *,
+                struct vr_nexthop **, unsigned int);
+extern struct vr_vrf_stats *(*vr_inet_vrf_stats)(unsigned short,
+                unsigned int);
+extern unsigned int (*vr_inet_vrf_gen)(unsigned int);
+extern struct vr_nexthop *(*vr_inet6_route_lookup)(unsigned int,
+                struct vr_route_req *, struct vr_packet *);
 extern int vr_mpls_input(struct vrouter *, struct vr_packet *,
         struct vr_forwarding_md *);
+extern int vr_mpls_input_nh(struct vrouter *, struct vr_packet *,
+        struct vr_forwarding_md *, struct vr_nexthop *);
+
+/* packets that vr_ip_input_bulk looks up together */
+#define VR_IP_INPUT_BULK_MAX    32
+
+/*
+ * the answers of vr_should_proxy that needed a route lookup, direct mapped
+ * on the vrf and the ip asked for. an entry is valid while ac_gen is the
+ * generation of the route table of ac_vrf, and is written the way the
+ * entries of the flow nexthop cache are: a writer owns it while ac_gen is
+ * VR_ARP_CACHE_BUSY, and readers read ac_gen before and after the rest
+ */
+#define VR_ARP_CACHE_SIZE       1024
+#define VR_ARP_CACHE_BUSY       0xffffffffU
+
+struct vr_arp_cache {
+    uint32_t ac_gen;
+    uint32_t ac_ip;
+    uint16_t ac_vrf;
+    uint8_t ac_proxy;
+};
+
+/*
+ * ids of the headers that the datapath builds (tunnels, fragments). each
+ * cpu counts on a line of its own, and takes the ids that are its index
+ * modulo the number of counters in use, so that no two cpus hand out the
+ * same id, and no id goes from one cpu to another. cpus past the last
+ * counter share one, and the worst a race there does is an id that is
+ * handed out twice
+ */
+#define VR_IP_ID_CPUS           64
 
-static unsigned short vr_ip_id;
+struct vr_ip_id {
+    unsigned short vii_next;
+} __attribute__((aligned(64)));
+
+static struct vr_ip_id vr_ip_ids[VR_IP_ID_CPUS];
+static unsigned int vr_ip_id_stride;
 
 unsigned short
 vr_generate_unique_ip_id()
 {
-    vr_ip_id++;
-    if (!vr_ip_id)
-        vr_ip_id++;
+    unsigned int cpu, stride = vr_ip_id_stride;
+    unsigned short id;
+    struct vr_ip_id *vii;
+
+    if (!stride) {
+        /* a power of two, that the ids of each cpu wrap around with */
+        for (stride = 1; stride < vr_num_cpus && stride < VR_IP_ID_CPUS;
+                stride <<= 1)
+            ;
+        vr_ip_id_stride = stride;
+    }
+
+    cpu = vr_get_cpu() & (stride - 1);
+    vii = &vr_ip_ids[cpu];
+    do {
+        id = (unsigned short)(++vii->vii_next * stride + cpu);
+    } while (!id);
 
-    return vr_ip_id;
+    return id;
 }
 
 struct vr_nexthop *
@@ -71,6 +130,69 @@ vr_forward(struct vrouter *router, unsigned short vrf,
     return nh_output(vrf, pkt, nh, fmd);
 }
 
+/*
+ * route an ipv6 packet, of a vrf that has an ipv6 table, by the longest
+ * match of its destination. there are no ipv6 flows, and so packets from
+ * interfaces with policy, link local and multicast packets (neighbour
+ * discovery among them), and those whose route is to a nexthop that
+ * cannot carry them are not taken, and the caller bridges them as before.
+ * returns 0 if the packet was taken
+ */
+int
+vr_inet6_forward(struct vrouter *router, unsigned short vrf,
+        struct vr_packet *pkt, struct vr_forwarding_md *fmd)
+{
+    struct vr_ip6 *ip6;
+    struct vr_nexthop *nh;
+    struct vr_route_req rt;
+    struct vr_forwarding_md rt_fmd;
+
+    if (!vr_inet6_route_lookup ||
+            (pkt->vp_if->vif_flags & VIF_FLAG_POLICY_ENABLED) ||
+            pkt_head_len(pkt) < sizeof(struct vr_ip6))
+        return 1;
+
+    ip6 = (struct vr_ip6 *)pkt_data(pkt);
+    if (ip6->ip6_dst[0] == 0xff ||
+            (ip6->ip6_dst[0] == 0xfe && (ip6->ip6_dst[1] & 0xc0) == 0x80))
+        return 1;
+
+    memset(&rt, 0, sizeof(rt));
+    rt.rtr_req.rtr_vrf_id = vrf;
+    rt.rtr_req.rtr_prefix6 = (int8_t *)ip6->ip6_dst;
+    rt.rtr_req.rtr_prefix6_size = VR_IP6_ADDRESS_LEN;
+    rt.rtr_req.rtr_prefix_len = VR_IP6_ADDRESS_LEN * 8;
+
+    nh = vr_inet6_route_lookup(vrf, &rt, pkt);
+    if (!nh)
+        return 1;
+
+    switch (nh->nh_type) {
+    case NH_DISCARD:
+    case NH_ENCAP:
+        break;
+
+    case NH_TUNNEL:
+        if (nh->nh_flags & (NH_FLAG_TUNNEL_GRE | NH_FLAG_TUNNEL_UDP_MPLS) &&
+                rt.rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)
+            break;
+        return 1;
+
+    default:
+        return 1;
+    }
+
+    if (!fmd) {
+        vr_init_forwarding_md(&rt_fmd);
+        fmd = &rt_fmd;
+    }
+    if (rt.rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)
+        fmd->fmd_label = rt.rtr_req.rtr_label;
+
+    pkt->vp_type = VP_TYPE_IP6;
+    return nh_output(vrf, pkt, nh, fmd);
+}
+
 /*
  * vr_udp_input - handle incoming UDP packets. If the UDP destination
  * port is for MPLS over UDP or VXLAN, decap the packet and forward the inner
@@ -290,6 +412,188 @@ drop_pkt:
     return 0;
 }
 
+/*
+ * the mpls part of vr_fabric_demux, for a packet at its udp/gre header
+ * ('hdr_len' long), whose label the demux found to be 'nh'. this is
+ * vr_udp_input/vr_gre_input and vr_mpls_input in one, with the headers
+ * that the demux already looked at not looked at again. returns 1 if the
+ * packet was not handled, like those
+ */
+static int
+vr_fabric_mpls_input(struct vrouter *router, struct vr_packet *pkt,
+        struct vr_ip *ip, unsigned char proto, unsigned short hdr_len,
+        struct vr_nexthop *nh)
+{
+    int encap_type, ret = PKT_RET_SLOW_PATH;
+    unsigned short reason;
+    struct vr_forwarding_md fmd;
+
+    if (vr_perfp && vr_pull_inner_headers_fast) {
+        if (!vr_pull_inner_headers_fast(proto == VR_IP_PROTO_UDP ? ip : NULL,
+                    pkt, proto, vr_mpls_tunnel_type, &ret, &encap_type))
+            return 1;
+
+        if (ret == PKT_RET_ERROR) {
+            vr_pfree(pkt, VP_DROP_CKSUM_ERR);
+            return 0;
+        }
+    }
+
+    /* the fast pull also strips the udp/gre header */
+    if (ret != PKT_RET_FAST_PATH) {
+        if (vr_pull_inner_headers) {
+            if (!vr_pull_inner_headers(proto == VR_IP_PROTO_UDP ? ip : NULL,
+                        pkt, proto, &reason, vr_mpls_tunnel_type)) {
+                vr_pfree(pkt, reason);
+                return 0;
+            }
+        }
+        pkt_pull(pkt, hdr_len);
+    }
+
+    vr_init_forwarding_md(&fmd);
+    vr_mpls_input_nh(router, pkt, &fmd, nh);
+
+    return 0;
+}
+
+/*
+ * vr_fabric_demux - early demux of tunneled packets received on the fabric
+ * interface. untagged mpls over udp/gre and vxlan packets, sent to our own
+ * address and carrying a label/vnid that we know of, are handed straight
+ * to the tunnel input, skipping the l3 input and the outer route lookup
+ * that would have anyway ended in the receive nexthop. returns VR_DEMUX_DONE
+ * if the packet was consumed, VR_DEMUX_NONE if it was left untouched for
+ * the regular path. with 'burst', vxlan packets are instead left at their
+ * vxlan header for vr_vxlan_input_bulk (VR_DEMUX_VXLAN)
+ */
+static int
+__vr_fabric_demux(struct vr_interface *vif, struct vr_packet *pkt, bool burst)
+{
+    unsigned char *data = pkt_data(pkt);
+    unsigned int label, vnid;
+    unsigned short dport = 0, reason, hdr_len;
+    unsigned short *gre_hdr;
+    struct vr_ip *ip;
+    struct vr_udp *udph;
+    struct vr_vxlan *vxlan;
+    struct vr_vrf_stats *stats;
+    struct vr_forwarding_md fmd;
+    struct vr_nexthop *nh = NULL;
+    struct vrouter *router = vif->vif_router;
+    int ret;
+
+    if (!vr_fabric_early_demux || !router->vr_host_if)
+        return VR_DEMUX_NONE;
+
+    if (vif->vif_type != VIF_TYPE_PHYSICAL || vif_mode_xconnect(vif) ||
+            (vif->vif_flags & (VIF_FLAG_MIRROR_RX | VIF_FLAG_POLICY_ENABLED)) ||
+            !(vif->vif_flags & VIF_FLAG_L3_ENABLED))
+        return VR_DEMUX_NONE;
+
+    if (pkt_head_len(pkt) < VR_ETHER_HLEN + sizeof(struct vr_ip) +
+            sizeof(struct vr_udp) + sizeof(struct vr_vxlan))
+        return VR_DEMUX_NONE;
+
+    if (ntohs(*(unsigned short *)(data + VR_ETHER_PROTO_OFF)) !=
+            VR_ETH_PROTO_IP)
+        return VR_DEMUX_NONE;
+
+    ip = (struct vr_ip *)(data + VR_ETHER_HLEN);
+    if (ip->ip_version != 4 || ip->ip_hl != 5 || vr_ip_fragment(ip) ||
+            (ip->ip_proto != VR_IP_PROTO_UDP &&
+             ip->ip_proto != VR_IP_PROTO_GRE))
+        return VR_DEMUX_NONE;
+
+    if (ip->ip_daddr != router->vr_host_if->vif_ip)
+        return VR_DEMUX_NONE;
+
+    if (ip->ip_proto == VR_IP_PROTO_GRE) {
+        /* the basic header only, no checksum or key */
+        gre_hdr = (unsigned short *)(ip + 1);
+        if (gre_hdr[0] || gre_hdr[1] != VR_GRE_PROTO_MPLS_NO)
+            return VR_DEMUX_NONE;
+
+        hdr_len = VR_GRE_BASIC_HDR_LEN;
+        label = ntohl(*(unsigned int *)(gre_hdr + 2)) >> VR_MPLS_LABEL_SHIFT;
+        if (label >= router->vr_max_labels ||
+                !(nh = ((struct vr_nexthop **)
+                        vr_replica(router->vr_ilm_replicas))[label]))
+            return VR_DEMUX_NONE;
+        goto demux;
+    }
+
+    udph = (struct vr_udp *)(ip + 1);
+    hdr_len = sizeof(struct vr_udp);
+    dport = ntohs(udph->udp_dport);
+    if (dport == VR_MPLS_OVER_UDP_DST_PORT) {
+        label = ntohl(*(unsigned int *)(udph + 1)) >> VR_MPLS_LABEL_SHIFT;
+        if (label >= router->vr_max_labels ||
+                !(nh = ((struct vr_nexthop **)
+                        vr_replica(router->vr_ilm_replicas))[label]))
+            return VR_DEMUX_NONE;
+    } else if (dport == VR_VXLAN_UDP_DST_PORT) {
+        vxlan = (struct vr_vxlan *)(udph + 1);
+        vnid = ntohl(vxlan->vxlan_vnid) >> VR_VXLAN_VNID_SHIFT;
+        if (ntohl(vxlan->vxlan_flags) != VR_VXLAN_IBIT ||
+                !vr_vxlan_nh(router, vnid))
+            return VR_DEMUX_NONE;
+    } else {
+        return VR_DEMUX_NONE;
+    }
+
+demux:
+    pkt_pull(pkt, VR_ETHER_HLEN);
+    pkt_set_network_header(pkt, pkt->vp_data);
+    pkt_set_inner_network_header(pkt, pkt->vp_data);
+    pkt_pull(pkt, sizeof(struct vr_ip));
+
+    stats = vr_inet_vrf_stats(vif->vif_vrf, pkt->vp_cpu);
+    if (stats)
+        stats->vrf_receives++;
+
+    if (burst && dport == VR_VXLAN_UDP_DST_PORT) {
+        /* what vr_udp_input does, short of the vxlan input */
+        if (vr_pull_inner_headers) {
+            if (!vr_pull_inner_headers(ip, pkt, VR_IP_PROTO_UDP,
+                        &reason, vr_mpls_tunnel_type)) {
+                vr_pfree(pkt, reason);
+                return VR_DEMUX_DONE;
+            }
+        }
+
+        pkt_pull(pkt, sizeof(struct vr_udp));
+        return VR_DEMUX_VXLAN;
+    }
+
+    if (nh) {
+        ret = vr_fabric_mpls_input(router, pkt, ip, ip->ip_proto, hdr_len, nh);
+    } else {
+        vr_init_forwarding_md(&fmd);
+        ret = vr_udp_input(ip, router, pkt, &fmd);
+    }
+
+    if (ret) {
+        /* the tunnel input did not want it. restore and take the long way */
+        pkt_push(pkt, sizeof(struct vr_ip) + VR_ETHER_HLEN);
+        return VR_DEMUX_NONE;
+    }
+
+    return VR_DEMUX_DONE;
+}
+
+bool
+vr_fabric_demux(struct vr_interface *vif, struct vr_packet *pkt)
+{
+    return __vr_fabric_demux(vif, pkt, false) == VR_DEMUX_DONE;
+}
+
+int
+vr_fabric_demux_burst(struct vr_interface *vif, struct vr_packet *pkt)
+{
+    return __vr_fabric_demux(vif, pkt, true);
+}
+
 int
 vr_ip_input(struct vrouter *router, unsigned short vrf, 
         struct vr_packet *pkt, struct vr_forwarding_md *fmd)
@@ -307,6 +611,80 @@ corrupt_pkt:
     return 0;
 }
 
+/*
+ * vr_ip_input for a burst of packets, with the route lookups of all the
+ * unicast packets of the burst done together (see mtrie_lookup_bulk)
+ */
+void
+vr_ip_input_bulk(struct vrouter *router, unsigned short *vrfs,
+        struct vr_packet **pkts, unsigned int num_pkts,
+        struct vr_forwarding_md *fmds)
+{
+    unsigned int i, num_lookups = 0, num_mcast = 0;
+    struct vr_ip *ip;
+    struct vr_packet *pkt;
+    struct vr_packet *mcast_pkts[VR_IP_INPUT_BULK_MAX];
+    unsigned short mcast_vrfs[VR_IP_INPUT_BULK_MAX];
+    struct vr_forwarding_md mcast_fmds[VR_IP_INPUT_BULK_MAX];
+    struct vr_route_req rts[VR_IP_INPUT_BULK_MAX];
+    struct vr_nexthop *nhs[VR_IP_INPUT_BULK_MAX];
+    unsigned char lookup_index[VR_IP_INPUT_BULK_MAX];
+
+    if (!vr_inet_route_lookup_bulk) {
+        for (i = 0; i < num_pkts; i++)
+            vr_ip_input(router, vrfs[i], pkts[i], &fmds[i]);
+        return;
+    }
+
+    while (num_pkts > VR_IP_INPUT_BULK_MAX) {
+        vr_ip_input_bulk(router, vrfs, pkts, VR_IP_INPUT_BULK_MAX, fmds);
+        vrfs += VR_IP_INPUT_BULK_MAX;
+        pkts += VR_IP_INPUT_BULK_MAX;
+        fmds += VR_IP_INPUT_BULK_MAX;
+        num_pkts -= VR_IP_INPUT_BULK_MAX;
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        pkt = pkts[i];
+        ip = (struct vr_ip *)pkt_data(pkt);
+        if (ip->ip_version != 4 || ip->ip_hl < 5) {
+            vr_pfree(pkt, VP_DROP_INVALID_PROTOCOL);
+            continue;
+        }
+
+        if (pkt->vp_flags & VP_FLAG_MULTICAST) {
+            mcast_pkts[num_mcast] = pkt;
+            mcast_vrfs[num_mcast] = vrfs[i];
+            mcast_fmds[num_mcast++] = fmds[i];
+            continue;
+        }
+
+        rts[num_lookups].rtr_req.rtr_vrf_id = vrfs[i];
+        rts[num_lookups].rtr_req.rtr_prefix = ntohl(ip->ip_daddr);
+        rts[num_lookups].rtr_req.rtr_prefix_len = 32;
+        rts[num_lookups].rtr_req.rtr_nh_id = 0;
+        rts[num_lookups].rtr_req.rtr_label_flags = 0;
+        lookup_index[num_lookups++] = i;
+    }
+
+    if (num_mcast)
+        vr_mcast_forward_bulk(router, mcast_vrfs, mcast_pkts, num_mcast,
+                mcast_fmds);
+
+    vr_inet_route_lookup_bulk(rts, nhs, num_lookups);
+
+    for (i = 0; i < num_lookups; i++) {
+        pkt = pkts[lookup_index[i]];
+        pkt->vp_type = VP_TYPE_IP;
+        if (rts[i].rtr_req.rtr_label_flags & VR_RT_LABEL_VALID_FLAG)
+            fmds[lookup_index[i]].fmd_label = rts[i].rtr_req.rtr_label;
+
+        nh_output(vrfs[lookup_index[i]], pkt, nhs[i], &fmds[lookup_index[i]]);
+    }
+
+    return;
+}
+
 void
 vr_ip_update_csum(struct vr_packet *pkt, unsigned int ip_inc, unsigned int inc)
 {
@@ -320,10 +698,10 @@ vr_ip_update_csum(struct vr_packet *pkt, unsigned int ip_inc, unsigned int inc)
     ip->ip_csum = vr_ip_csum(ip);
 
     if (ip->ip_proto == VR_IP_PROTO_TCP) {
-        tcp = (struct vr_tcp *)((unsigned char *)ip + ip->ip_hl * 4);
+        tcp = (struct vr_tcp *)pkt_transport_header(pkt, ip);
         csump = &tcp->tcp_csum;
     } else if (ip->ip_proto == VR_IP_PROTO_UDP) {
-        udp = (struct vr_udp *)((unsigned char *)ip + ip->ip_hl * 4);
+        udp = (struct vr_udp *)pkt_transport_header(pkt, ip);
         csump = &udp->udp_csum;
     } else {
         return;
@@ -412,8 +790,13 @@ bool
 vr_should_proxy(struct vr_interface *vif, unsigned int dip,
         unsigned int sip)
 {
+    bool proxy;
+    unsigned int gen = 0, cache_gen = 0, cache_ip;
+    unsigned short cache_vrf;
     struct vr_route_req rt;
     struct vr_nexthop *nh;
+    struct vrouter *router;
+    struct vr_arp_cache *cache = NULL;
 
     /*
      * vr should proxy for all arp requests from VM and from
@@ -456,6 +839,27 @@ vr_should_proxy(struct vr_interface *vif, unsigned int dip,
      * - requests from vhost to a VM that has an IP in the fabric and
      *   in the same system
      */
+    router = vif->vif_router;
+    if (router && router->vr_arp_cache && vr_inet_vrf_gen) {
+        /* the generation has to be read before the lookup */
+        gen = vr_inet_vrf_gen(vif->vif_vrf);
+        if (gen) {
+            cache = &router->vr_arp_cache[vr_hash_2words(dip, vif->vif_vrf,
+                    0) & (VR_ARP_CACHE_SIZE - 1)];
+            cache_gen = cache->ac_gen;
+            if (cache_gen == gen) {
+                __sync_synchronize();
+                cache_ip = cache->ac_ip;
+                cache_vrf = cache->ac_vrf;
+                proxy = cache->ac_proxy;
+                __sync_synchronize();
+                if (cache->ac_gen == cache_gen && cache_ip == dip &&
+                        cache_vrf == vif->vif_vrf)
+                    return proxy;
+            }
+        }
+    }
+
     rt.rtr_req.rtr_vrf_id = vif->vif_vrf;
     rt.rtr_req.rtr_prefix = ntohl(dip);
     rt.rtr_req.rtr_prefix_len = 32;
@@ -463,13 +867,51 @@ vr_should_proxy(struct vr_interface *vif, unsigned int dip,
     rt.rtr_req.rtr_label_flags = 0;
 
     nh = vr_inet_route_lookup(vif->vif_vrf, &rt, NULL);
-    if (!nh)
-        return false;
+    proxy = nh && (rt.rtr_req.rtr_label_flags & VR_RT_HOSTED_FLAG);
+
+    if (cache && cache_gen != VR_ARP_CACHE_BUSY &&
+            __sync_bool_compare_and_swap(&cache->ac_gen, cache_gen,
+                VR_ARP_CACHE_BUSY)) {
+        cache->ac_ip = dip;
+        cache->ac_vrf = vif->vif_vrf;
+        cache->ac_proxy = proxy;
+        __sync_synchronize();
+        cache->ac_gen = gen;
+    }
 
-    if (rt.rtr_req.rtr_label_flags & VR_RT_HOSTED_FLAG)
-        return true;
+    return proxy;
+}
 
-    return false;
+void
+vr_arp_cache_exit(struct vrouter *router, bool soft_reset)
+{
+    if (!router->vr_arp_cache)
+        return;
+
+    if (soft_reset) {
+        memset(router->vr_arp_cache, 0,
+                VR_ARP_CACHE_SIZE * sizeof(struct vr_arp_cache));
+        return;
+    }
+
+    vr_free(router->vr_arp_cache);
+    router->vr_arp_cache = NULL;
+
+    return;
+}
+
+int
+vr_arp_cache_init(struct vrouter *router)
+{
+    if (router->vr_arp_cache)
+        return 0;
+
+    router->vr_arp_cache = vr_zalloc(VR_ARP_CACHE_SIZE *
+            sizeof(struct vr_arp_cache));
+    if (!router->vr_arp_cache)
+        return -ENOMEM;
+
+    return 0;
 }
 
 int
@@ -10,6 +10,8 @@
 static struct rtable_fspec rtable_families[];
 extern int mtrie4_algo_init(struct vr_rtable *, struct rtable_fspec *);
 extern void mtrie4_algo_deinit(struct vr_rtable *, struct rtable_fspec *);
+extern int mtrie6_algo_init(struct vr_rtable *, struct rtable_fspec *);
+extern void mtrie6_algo_deinit(struct vr_rtable *, struct rtable_fspec *);
 extern int mcast_algo_init(struct vr_rtable *, struct rtable_fspec *);
 extern void mcast_algo_deinit(struct vr_rtable *, struct rtable_fspec *);
 extern int bridge_table_init(struct vr_rtable *, struct rtable_fspec *);
@@ -24,6 +26,8 @@ vr_get_family(unsigned int family)
         return &rtable_families[0];
     case AF_BRIDGE:
         return &rtable_families[1];
+    case AF_INET6:
+        return &rtable_families[2];
 
     default:
         return NULL;
@@ -32,6 +36,90 @@ vr_get_family(unsigned int family)
     return NULL;
 }
 
+/*
+ * a batch of routes of one vrf, all to be added or all to be deleted (as
+ * per h_op), with the routes in the rtr_bulk_* lists and everything else
+ * common to the batch taken from the request itself. the response carries
+ * the first error, if any
+ */
+static int
+vr_route_bulk(vr_route_req *req)
+{
+    int ret = 0;
+    unsigned int i, count;
+    int *errors = NULL;
+    struct rtable_fspec *fs;
+    struct vr_route_req *rts = NULL;
+
+    count = req->rtr_bulk_prefix_size;
+    fs = vr_get_family(req->rtr_family);
+    if (!fs || !fs->route_bulk) {
+        ret = -ENOENT;
+        goto generate_response;
+    }
+
+    if (count > VR_ROUTE_MAX_BULK_ENTRIES ||
+            req->rtr_bulk_prefix_len_size != count ||
+            req->rtr_bulk_nh_id_size != count ||
+            (req->rtr_bulk_label_size && req->rtr_bulk_label_size != count) ||
+            (req->rtr_bulk_label_flags_size &&
+             req->rtr_bulk_label_flags_size != count) ||
+            (req->rtr_bulk_replace_plen_size &&
+             req->rtr_bulk_replace_plen_size != count)) {
+        ret = -EINVAL;
+        goto generate_response;
+    }
+
+    rts = vr_zalloc(count * sizeof(*rts));
+    errors = vr_zalloc(count * sizeof(int));
+    if (!rts || !errors) {
+        ret = -ENOMEM;
+        goto generate_response;
+    }
+
+    for (i = 0; i < count; i++) {
+        rts[i].rtr_req = *req;
+        rts[i].rtr_req.rtr_mac = NULL;
+        rts[i].rtr_req.rtr_mac_size = 0;
+        rts[i].rtr_req.rtr_bulk_prefix = NULL;
+        rts[i].rtr_req.rtr_bulk_prefix_size = 0;
+        rts[i].rtr_req.rtr_bulk_prefix_len = NULL;
+        rts[i].rtr_req.rtr_bulk_prefix_len_size = 0;
+        rts[i].rtr_req.rtr_bulk_nh_id = NULL;
+        rts[i].rtr_req.rtr_bulk_nh_id_size = 0;
+        rts[i].rtr_req.rtr_bulk_label = NULL;
+        rts[i].rtr_req.rtr_bulk_label_size = 0;
+        rts[i].rtr_req.rtr_bulk_label_flags = NULL;
+        rts[i].rtr_req.rtr_bulk_label_flags_size = 0;
+        rts[i].rtr_req.rtr_bulk_replace_plen = NULL;
+        rts[i].rtr_req.rtr_bulk_replace_plen_size = 0;
+
+        rts[i].rtr_req.rtr_prefix = req->rtr_bulk_prefix[i];
+        rts[i].rtr_req.rtr_prefix_len = req->rtr_bulk_prefix_len[i];
+        rts[i].rtr_req.rtr_nh_id = req->rtr_bulk_nh_id[i];
+        if (req->rtr_bulk_label_size)
+            rts[i].rtr_req.rtr_label = req->rtr_bulk_label[i];
+        if (req->rtr_bulk_label_flags_size)
+            rts[i].rtr_req.rtr_label_flags = req->rtr_bulk_label_flags[i];
+        if (req->rtr_bulk_replace_plen_size)
+            rts[i].rtr_req.rtr_replace_plen = req->rtr_bulk_replace_plen[i];
+    }
+
+    ret = fs->route_bulk(fs, rts, count, errors);
+    for (i = 0; !ret && i < count; i++)
+        ret = errors[i];
+
+generate_response:
+    if (rts)
+        vr_free(rts);
+    if (errors)
+        vr_free(errors);
+
+    vr_send_response(ret);
+
+    return ret;
+}
+
 int
 vr_route_delete(vr_route_req *req)
 {
@@ -102,7 +190,10 @@ vr_route_get(vr_route_req *req)
         goto generate_response;
     } else {
 
-        rtable = vr_get_inet_table(router, req->rtr_rt_type);
+        if (req->rtr_family == AF_INET6)
+            rtable = router->vr_inet6_rtable;
+        else
+            rtable = vr_get_inet_table(router, req->rtr_rt_type);
         if (!rtable) {
             ret = -ENOENT;
             goto generate_response;
@@ -135,6 +226,8 @@ vr_route_dump(vr_route_req *req)
             rtable = vr_get_inet_table(router, req->rtr_rt_type);
         } else if (req->rtr_family == AF_BRIDGE) {
             rtable = router->vr_bridge_rtable;
+        } else if (req->rtr_family == AF_INET6) {
+            rtable = router->vr_inet6_rtable;
         }
 
         if (!rtable) {
@@ -158,13 +251,20 @@ vr_route_req_process(void *s_req)
 {
     vr_route_req *req = (vr_route_req *)s_req;
 
+    vr_config_request(vrouter_get(req->rtr_rid), req->h_op);
     switch (req->h_op) {
     case SANDESH_OP_ADD:
-        vr_route_add(req);
+        if (req->rtr_bulk_prefix_size)
+            vr_route_bulk(req);
+        else
+            vr_route_add(req);
         break;
 
     case SANDESH_OP_DELETE:
-        vr_route_delete(req);
+        if (req->rtr_bulk_prefix_size)
+            vr_route_bulk(req);
+        else
+            vr_route_delete(req);
         break;
 
     case SANDESH_OP_GET:
@@ -340,6 +440,46 @@ inet_route_del(struct rtable_fspec *fs, struct vr_route_req *req)
     return rtable->algo_del(rtable, req);
 }
 
+/*
+ * the checks of inet_route_add and inet_route_del for all the routes of a
+ * batch. routes that fail them are marked in 'errors' and left out by the
+ * algorithm
+ */
+int
+inet_route_bulk(struct rtable_fspec *fs, struct vr_route_req *reqs,
+        unsigned int count, int *errors)
+{
+    unsigned int i, pmask;
+    struct vr_rtable *rtable;
+    struct vrouter *router;
+    struct vr_route_req *req;
+
+    router = vrouter_get(reqs[0].rtr_req.rtr_rid);
+    if (!router)
+        return -EINVAL;
+
+    rtable = vr_get_inet_table(router, reqs[0].rtr_req.rtr_rt_type);
+    if (!rtable || !rtable->algo_bulk ||
+            (unsigned int)reqs[0].rtr_req.rtr_vrf_id >= fs->rtb_max_vrfs)
+        return -EINVAL;
+
+    for (i = 0; i < count; i++) {
+        req = &reqs[i];
+        if ((unsigned int)(req->rtr_req.rtr_prefix_len) > VR_INET_MAX_PLEN) {
+            errors[i] = -EINVAL;
+            continue;
+        }
+
+        if (req->rtr_req.rtr_prefix_len) {
+            pmask = ~((1 << (32 - req->rtr_req.rtr_prefix_len)) - 1);
+            req->rtr_req.rtr_prefix &= pmask;
+        } else
+            req->rtr_req.rtr_prefix = 0;
+    }
+
+    return rtable->algo_bulk(rtable, reqs, count, errors);
+}
+
 static void
 inet_rtb_family_deinit(struct rtable_fspec *fs, struct vrouter *router)
 {
@@ -393,6 +533,102 @@ inet_rtb_family_init(struct rtable_fspec *fs, struct vrouter *router)
     return 0;
 }
 
+#define VR_INET6_MAX_PLEN   128
+
+/*
+ * an ipv6 route is in rtr_prefix6, of 16 bytes in network byte order,
+ * with rtr_prefix_len of up to 128
+ */
+static int
+inet6_route_check(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    unsigned int i, plen = req->rtr_req.rtr_prefix_len;
+    uint8_t *prefix = (uint8_t *)req->rtr_req.rtr_prefix6;
+
+    if ((unsigned int)req->rtr_req.rtr_vrf_id >= fs->rtb_max_vrfs ||
+            plen > VR_INET6_MAX_PLEN || !prefix ||
+            req->rtr_req.rtr_prefix6_size != VR_INET6_MAX_PLEN / 8)
+        return -EINVAL;
+
+    for (i = 0; i < VR_INET6_MAX_PLEN / 8; i++) {
+        if (plen >= (i + 1) * 8)
+            continue;
+        if (plen > i * 8)
+            prefix[i] &= 0xff << (8 - (plen - i * 8));
+        else
+            prefix[i] = 0;
+    }
+
+    return 0;
+}
+
+int
+inet6_route_add(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    int ret;
+    struct vrouter *router;
+
+    router = vrouter_get(req->rtr_req.rtr_rid);
+    if (!router || !router->vr_inet6_rtable)
+        return -EINVAL;
+
+    if ((ret = inet6_route_check(fs, req)))
+        return ret;
+
+    return router->vr_inet6_rtable->algo_add(router->vr_inet6_rtable, req);
+}
+
+int
+inet6_route_del(struct rtable_fspec *fs, struct vr_route_req *req)
+{
+    int ret;
+    struct vrouter *router;
+
+    router = vrouter_get(req->rtr_req.rtr_rid);
+    if (!router || !router->vr_inet6_rtable)
+        return -EINVAL;
+
+    if ((ret = inet6_route_check(fs, req)))
+        return ret;
+
+    return router->vr_inet6_rtable->algo_del(router->vr_inet6_rtable, req);
+}
+
+static int
+inet6_rtb_family_init(struct rtable_fspec *fs, struct vrouter *router)
+{
+    int ret;
+    struct vr_rtable *table;
+
+    if (router->vr_inet6_rtable)
+        return vr_module_error(-EEXIST, __FUNCTION__, __LINE__, 0);
+
+    table = vr_zalloc(sizeof(struct vr_rtable));
+    if (!table)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, RT_UCAST);
+
+    ret = fs->algo_init[RT_UCAST](table, fs);
+    if (ret) {
+        vr_free(table);
+        return vr_module_error(ret, __FUNCTION__, __LINE__, RT_UCAST);
+    }
+
+    router->vr_inet6_rtable = table;
+    return 0;
+}
+
+static void
+inet6_rtb_family_deinit(struct rtable_fspec *fs, struct vrouter *router)
+{
+    if (router->vr_inet6_rtable) {
+        fs->algo_deinit[RT_UCAST](router->vr_inet6_rtable, fs);
+        vr_free(router->vr_inet6_rtable);
+    }
+
+    router->vr_inet6_rtable = NULL;
+    return;
+}
+
 int
 bridge_entry_add(struct rtable_fspec *fs, struct vr_route_req *req)
 {
@@ -475,6 +711,7 @@ static struct rtable_fspec rtable_families[] = {
         .rtb_family_deinit              =   inet_rtb_family_deinit,
         .route_add                      =   inet_route_add,
         .route_del                      =   inet_route_del,
+        .route_bulk                     =   inet_route_bulk,
         .algo_init[RT_UCAST]            =   mtrie4_algo_init,
         .algo_deinit[RT_UCAST]          =   mtrie4_algo_deinit,
         .algo_init[RT_MCAST]            =   mcast_algo_init,
@@ -489,6 +726,16 @@ static struct rtable_fspec rtable_families[] = {
         .route_del                      =   bridge_entry_del,
         .algo_init[RT_UCAST]            =   bridge_table_init,
         .algo_deinit[RT_UCAST]          =   bridge_table_deinit,
+    },
+    {
+        .rtb_family                     =   AF_INET6,
+        .rtb_max_vrfs                   =   VR_MAX_VRFS,
+        .rtb_family_init                =   inet6_rtb_family_init,
+        .rtb_family_deinit              =   inet6_rtb_family_deinit,
+        .route_add                      =   inet6_route_add,
+        .route_del                      =   inet6_route_del,
+        .algo_init[RT_UCAST]            =   mtrie6_algo_init,
+        .algo_deinit[RT_UCAST]          =   mtrie6_algo_deinit,
     }
 };
 
@@ -503,6 +750,8 @@ vr_fib_exit(struct vrouter *router, bool soft_reset)
         fs->rtb_family_deinit(fs, router);
     }
 
+    vr_arp_cache_exit(router, soft_reset);
+
     return;
 }
 
@@ -524,6 +773,13 @@ vr_fib_init(struct vrouter *router)
         }
     }
 
+    ret = vr_arp_cache_init(router);
+    if (ret) {
+        vr_module_error(ret, __FUNCTION__, __LINE__, 0);
+        fs = &rtable_families[i];
+        goto exit_init;
+    }
+
     return 0;
 
 exit_init:
@@ -56,6 +56,19 @@ struct sandesh_object_md sandesh_md[] = {
         .obj_len                =       4 * sizeof(vr_vxlan_req),
         .obj_type_string        =       "vr_vxlan_req",
     },
+    [VR_PERF_OBJECT_ID]     =   {
+        .obj_len                =       4 * sizeof(vr_perf_req),
+        .obj_type_string        =       "vr_perf_req",
+    },
+    [VR_DROP_CAPTURE_OBJECT_ID]     =   {
+        .obj_len                =       4 * sizeof(vr_drop_capture_req) +
+                                        VR_DROP_CAPTURE_BYTES,
+        .obj_type_string        =       "vr_drop_capture_req",
+    },
+    [VR_VROUTER_OPS_OBJECT_ID]     =   {
+        .obj_len                =       4 * sizeof(vrouter_ops),
+        .obj_type_string        =       "vrouter_ops",
+    },
 };
 
 static unsigned int
@@ -112,9 +125,19 @@ static int
 sandesh_proto_decode(char *buf, unsigned int len,
         int (*cb)(void *, unsigned int, void *), void *cb_arg)
 {
-    int ret = 0;
+    int ret = 0, decoded;
+
+    /* the objects of a batch request are one after the other */
+    do {
+        decoded = sandesh_decode((unsigned char *)buf, len,
+                vr_find_sandesh_info, &ret);
+        if (decoded <= 0 || ret)
+            break;
+
+        buf += decoded;
+        len -= decoded;
+    } while (len && vr_message_batch_next());
 
-    sandesh_decode((unsigned char *)buf, len, vr_find_sandesh_info, &ret);
     return ret;
 }
 
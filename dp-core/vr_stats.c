@@ -6,6 +6,45 @@
  */
 #include <vr_os.h>
 #include "vr_message.h"
+#include "vr_btable.h"
+
+/*
+ * keep the drop and interface counters where collectors can read them
+ * through the mmap-ed flow memory. see struct vr_counters_hdr
+ */
+int vr_counters_mmap = 0;
+
+/* see vr_drop_capture */
+int vr_drop_capture_enabled = 0;
+
+struct vr_drop_record {
+    /* 0 for a record that was never filled */
+    unsigned int vdr_sec;
+    unsigned int vdr_usec;
+    unsigned short vdr_reason;
+    unsigned short vdr_vif;
+    unsigned short vdr_vrf;
+    unsigned short vdr_len;
+    unsigned int vdr_nh;
+    unsigned int vdr_pkt_len;
+    uint8_t vdr_data[VR_DROP_CAPTURE_BYTES];
+};
+
+struct vr_drop_ring {
+    unsigned int vdg_head;
+    /* drops of the reason looked at, to pick the 1 in vdc_sample */
+    unsigned int vdg_seen;
+    /* the second, and the records taken in it */
+    unsigned int vdg_sec;
+    unsigned int vdg_taken;
+    struct vr_drop_record vdg_records[VR_DROP_CAPTURE_RECORDS];
+};
+
+/* per-cpu, allocated when the capture is first turned on */
+static struct vr_drop_ring *vr_drop_rings;
+static int vr_drop_capture_filter = -1;
+static unsigned int vr_drop_capture_sample = 1;
+static unsigned int vr_drop_capture_rate = 10;
 
 static void
 vr_drop_stats_fill_response(vr_drop_stats_req *response,
@@ -57,6 +96,9 @@ vr_drop_stats_fill_response(vr_drop_stats_req *response,
     response->vds_invalid_vnid = stats->vds_invalid_vnid;
     response->vds_frag_err = stats->vds_frag_err;
     response->vds_invalid_source = stats->vds_invalid_source;
+    response->vds_flow_queue_pool_empty = stats->vds_flow_queue_pool_empty;
+    response->vds_flow_miss_rate_limit = stats->vds_flow_miss_rate_limit;
+    response->vds_interface_rate_limit = stats->vds_interface_rate_limit;
 
     return;
 }
@@ -124,6 +166,12 @@ vr_drop_stats_get(void)
         stats->vds_invalid_vnid += stats_block->vds_invalid_vnid;
         stats->vds_frag_err += stats_block->vds_frag_err;
         stats->vds_invalid_source += stats_block->vds_invalid_source;
+        stats->vds_flow_queue_pool_empty +=
+            stats_block->vds_flow_queue_pool_empty;
+        stats->vds_flow_miss_rate_limit +=
+            stats_block->vds_flow_miss_rate_limit;
+        stats->vds_interface_rate_limit +=
+            stats_block->vds_interface_rate_limit;
     }
 
     vr_drop_stats_fill_response(&response, stats);
@@ -146,6 +194,93 @@ vr_drop_stats_req_process(void *s_req)
     return;
 }
 
+unsigned int
+vr_counters_table_size(struct vrouter *router)
+{
+    if (!router->vr_counters_table)
+        return 0;
+
+    return vr_btable_size(router->vr_counters_table);
+}
+
+static struct vr_counters_hdr *
+vr_counters_hdr(struct vrouter *router)
+{
+    if (!router->vr_counters_table)
+        return NULL;
+
+    return (struct vr_counters_hdr *)
+        vr_btable_get_address(router->vr_counters_table, 0);
+}
+
+/* the counters of interface 'index', if they are in the table */
+struct vr_interface_stats *
+vr_counters_vif_stats(struct vrouter *router, unsigned int index)
+{
+    struct vr_counters_hdr *hdr;
+
+    if (!router || !(hdr = vr_counters_hdr(router)) ||
+            (index >= hdr->vch_interfaces))
+        return NULL;
+
+    return (struct vr_interface_stats *)
+        vr_btable_get_address(router->vr_counters_table,
+                hdr->vch_vif_offset + index * hdr->vch_vif_span);
+}
+
+static void
+vr_counters_exit(struct vrouter *router)
+{
+    if (router->vr_counters_table) {
+        vr_btable_free(router->vr_counters_table);
+        router->vr_counters_table = NULL;
+    }
+
+    return;
+}
+
+/*
+ * the blocks of interfaces have a span of a power of 2, and start at a
+ * multiple of it, so that none crosses the partitions of the btable
+ */
+static int
+vr_counters_init(struct vrouter *router)
+{
+    unsigned int span, offset, size;
+    struct vr_counters_hdr *hdr;
+
+    if (router->vr_counters_table || !vr_counters_mmap)
+        return 0;
+
+    span = 64;
+    while (span < vr_num_cpus * sizeof(struct vr_interface_stats))
+        span <<= 1;
+
+    offset = VR_COUNTERS_HDR_SIZE + vr_num_cpus * VR_COUNTERS_DROP_SPAN;
+    offset = (offset + span - 1) & ~(span - 1);
+    size = offset + VR_MAX_INTERFACES * span;
+    size = (size + VR_COUNTERS_HDR_SIZE - 1) & ~(VR_COUNTERS_HDR_SIZE - 1);
+
+    router->vr_counters_table = vr_btable_alloc(size / VR_COUNTERS_HDR_SIZE,
+            VR_COUNTERS_HDR_SIZE);
+    if (!router->vr_counters_table)
+        return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, size);
+
+    hdr = vr_counters_hdr(router);
+    hdr->vch_cpus = vr_num_cpus;
+    hdr->vch_drop_offset = VR_COUNTERS_HDR_SIZE;
+    hdr->vch_drop_span = VR_COUNTERS_DROP_SPAN;
+    hdr->vch_drop_reasons = VP_DROP_MAX;
+    hdr->vch_vif_offset = offset;
+    hdr->vch_vif_span = span;
+    hdr->vch_vif_stats_size = sizeof(struct vr_interface_stats);
+    hdr->vch_interfaces = VR_MAX_INTERFACES;
+    __sync_synchronize();
+    hdr->vch_version = VR_COUNTERS_VERSION;
+
+    return 0;
+}
+
 static void
 vr_pkt_drop_stats_exit(struct vrouter *router)
 {
@@ -157,12 +292,14 @@ vr_pkt_drop_stats_exit(struct vrouter *router)
     for (i = 0; i < vr_num_cpus; i++) {
         if (!router->vr_pdrop_stats[i])
             break;
-        vr_free(router->vr_pdrop_stats[i]);
+        if (!router->vr_counters_table)
+            vr_free(router->vr_pdrop_stats[i]);
         router->vr_pdrop_stats[i] = NULL;
     }
 
     vr_free(router->vr_pdrop_stats);
     router->vr_pdrop_stats = NULL;
+    vr_counters_exit(router);
 
     return;
 }
@@ -184,8 +321,18 @@ vr_pkt_drop_stats_init(struct vrouter *router)
         goto cleanup;
     }
 
+    if (vr_counters_init(router))
+        goto cleanup;
+
     size = VP_DROP_MAX * sizeof(uint64_t);
     for (i = 0; i < vr_num_cpus; i++) {
+        if (router->vr_counters_table) {
+            router->vr_pdrop_stats[i] = (uint64_t *)
+                vr_btable_get_address(router->vr_counters_table,
+                        VR_COUNTERS_HDR_SIZE + i * VR_COUNTERS_DROP_SPAN);
+            continue;
+        }
+
         router->vr_pdrop_stats[i] = vr_zalloc(size);
         if (!router->vr_pdrop_stats[i]) {
             vr_module_error(-ENOMEM, __FUNCTION__,
@@ -217,9 +364,204 @@ vr_pkt_drop_stats_reset(struct vrouter *router)
     return;
 }
 
+/*
+ * called from the pfree of the host while the capture is on. takes 1 in
+ * vr_drop_capture_sample drops (of vr_drop_capture_filter, if set), and not
+ * more than vr_drop_capture_rate of them a second, per cpu. the oldest
+ * record gives way. records are read as they are, without a lock, and a
+ * record that is rewritten while it is read can come out mixed
+ */
+void
+vr_drop_capture(struct vrouter *router, struct vr_packet *pkt,
+        unsigned short reason)
+{
+    unsigned int sec, nsec, len;
+    struct vr_drop_ring *ring;
+    struct vr_drop_record *rec;
+    struct vr_interface *vif = pkt->vp_if;
+    struct vr_nexthop *nh = pkt->vp_nh;
+
+    if (!vr_drop_rings)
+        return;
+
+    if ((vr_drop_capture_filter >= 0) && (reason != vr_drop_capture_filter))
+        return;
+
+    ring = &vr_drop_rings[vr_get_cpu()];
+    if (ring->vdg_seen++ % vr_drop_capture_sample)
+        return;
+
+    vr_get_time(&sec, &nsec);
+    if (sec != ring->vdg_sec) {
+        ring->vdg_sec = sec;
+        ring->vdg_taken = 0;
+    }
+
+    if (ring->vdg_taken >= vr_drop_capture_rate)
+        return;
+    ring->vdg_taken++;
+
+    rec = &ring->vdg_records[ring->vdg_head++ % VR_DROP_CAPTURE_RECORDS];
+    rec->vdr_sec = sec;
+    rec->vdr_usec = nsec / 1000;
+    rec->vdr_reason = reason;
+    rec->vdr_vif = vif ? vif->vif_idx : -1;
+    rec->vdr_vrf = nh ? nh->nh_vrf : (vif ? vif->vif_vrf : -1);
+    rec->vdr_nh = nh ? nh->nh_id : -1;
+    rec->vdr_pkt_len = pkt_len(pkt);
+
+    len = pkt_head_len(pkt);
+    if (len > VR_DROP_CAPTURE_BYTES)
+        len = VR_DROP_CAPTURE_BYTES;
+    memcpy(rec->vdr_data, pkt_data(pkt), len);
+    rec->vdr_len = len;
+
+    return;
+}
+
+static void
+vr_drop_capture_reset(void)
+{
+    if (vr_drop_rings)
+        memset(vr_drop_rings, 0, vr_num_cpus * sizeof(struct vr_drop_ring));
+
+    return;
+}
+
+/* turning it on starts with empty rings */
+static int
+vr_drop_capture_enable(vr_drop_capture_req *req)
+{
+    if (vr_drop_capture_enabled) {
+        vr_drop_capture_enabled = 0;
+        /* drops that are still being recorded */
+        vr_delay_op();
+    }
+
+    if (!req->vdc_enable)
+        return 0;
+
+    if (req->vdc_filter >= VP_DROP_MAX)
+        return -EINVAL;
+
+    if (!vr_drop_rings) {
+        vr_drop_rings = vr_zalloc(vr_num_cpus * sizeof(struct vr_drop_ring));
+        if (!vr_drop_rings)
+            return -ENOMEM;
+    } else {
+        vr_drop_capture_reset();
+    }
+
+    vr_drop_capture_filter = req->vdc_filter;
+    vr_drop_capture_sample = req->vdc_sample > 0 ? req->vdc_sample : 1;
+    if (req->vdc_rate > 0)
+        vr_drop_capture_rate = req->vdc_rate;
+
+    __sync_synchronize();
+    vr_drop_capture_enabled = 1;
+
+    return 0;
+}
+
+/* the records after the marker, which is cpu * VR_DROP_CAPTURE_RECORDS + slot */
+static void
+vr_drop_capture_dump(vr_drop_capture_req *req)
+{
+    int ret = 0;
+    unsigned int index;
+    vr_drop_capture_req resp;
+    struct vr_drop_record *rec;
+    struct vr_message_dumper *dumper;
+
+    dumper = vr_message_dump_init(req);
+    if (!dumper && (ret = -ENOMEM))
+        goto generate_response;
+
+    if (!vr_drop_rings)
+        goto generate_response;
+
+    for (index = req->vdc_marker + 1;
+            index < vr_num_cpus * VR_DROP_CAPTURE_RECORDS; index++) {
+        rec = &vr_drop_rings[index / VR_DROP_CAPTURE_RECORDS].
+            vdg_records[index % VR_DROP_CAPTURE_RECORDS];
+        if (!rec->vdr_sec)
+            continue;
+
+        memset(&resp, 0, sizeof(resp));
+        resp.vdc_enable = vr_drop_capture_enabled;
+        resp.vdc_filter = vr_drop_capture_filter;
+        resp.vdc_index = index;
+        resp.vdc_cpu = index / VR_DROP_CAPTURE_RECORDS;
+        resp.vdc_reason = rec->vdr_reason;
+        resp.vdc_vif = rec->vdr_vif;
+        resp.vdc_vrf = rec->vdr_vrf;
+        resp.vdc_nh = rec->vdr_nh;
+        resp.vdc_sec = rec->vdr_sec;
+        resp.vdc_usec = rec->vdr_usec;
+        resp.vdc_pkt_len = rec->vdr_pkt_len;
+        resp.vdc_data = (int8_t *)rec->vdr_data;
+        resp.vdc_data_size = rec->vdr_len;
+
+        ret = vr_message_dump_object(dumper, VR_DROP_CAPTURE_OBJECT_ID, &resp);
+        if (ret <= 0)
+            break;
+    }
+
+generate_response:
+    vr_message_dump_exit(dumper, ret);
+    return;
+}
+
+void
+vr_drop_capture_req_process(void *s_req)
+{
+    vr_drop_capture_req *req = (vr_drop_capture_req *)s_req;
+
+    switch (req->h_op) {
+    case SANDESH_OP_ADD:
+        vr_send_response(vr_drop_capture_enable(req));
+        break;
+
+    case SANDESH_OP_DELETE:
+        vr_drop_capture_reset();
+        vr_send_response(0);
+        break;
+
+    case SANDESH_OP_DUMP:
+        vr_drop_capture_dump(req);
+        break;
+
+    default:
+        vr_send_response(-EOPNOTSUPP);
+        break;
+    }
+
+    return;
+}
+
+static void
+vr_drop_capture_exit(bool soft_reset)
+{
+    vr_drop_capture_enabled = 0;
+    if (soft_reset) {
+        vr_delay_op();
+        vr_drop_capture_reset();
+        return;
+    }
+
+    if (vr_drop_rings) {
+        vr_delay_op();
+        vr_free(vr_drop_rings);
+        vr_drop_rings = NULL;
+    }
+
+    return;
+}
+
 void
 vr_stats_exit(struct vrouter *router, bool soft_reset)
 {
+    vr_drop_capture_exit(soft_reset);
     if (soft_reset) {
         vr_pkt_drop_stats_reset(router);
         return;
@@ -28,15 +28,18 @@ vr_vrf_assign_dump(vr_vrf_assign_req *req)
     }
 
     memcpy(&resp, req, sizeof(resp));
-    for (i = req->var_marker + 1; i < VIF_VRF_TABLE_ENTRIES; i++) {
+    resp.var_vlan_list = NULL;
+    resp.var_vlan_list_size = 0;
+    resp.var_vrf_list = NULL;
+    resp.var_vrf_list_size = 0;
+    /* only the vlans that have an entry */
+    for (i = vif_vrf_table_next(vif, req->var_marker); i >= 0;
+            i = vif_vrf_table_next(vif, i)) {
         resp.var_vlan_id = i;
         ret = vif_vrf_table_get(vif, &resp);
         if (ret)
             break;
 
-        if (resp.var_vif_vrf == -1)
-            continue;
-
         ret = vr_message_dump_object(dumper, VR_VRF_ASSIGN_OBJECT_ID, &resp);
         if (ret <= 0)
             break;
@@ -71,6 +74,53 @@ exit_get:
     return 0;
 }
 
+/*
+ * a request sets one vlan (var_vlan_id), var_vlan_count vlans from
+ * var_vlan_id on to the same vrf, or the vlans of var_vlan_list to the
+ * vrfs at the same position of var_vrf_list (to var_vif_vrf if the vrf
+ * list is not there, as for a delete). the request is checked as a whole
+ * before any entry is changed
+ */
+static int
+vr_vrf_assign_set_bulk(struct vr_interface *vif, vr_vrf_assign_req *req)
+{
+    int ret;
+    unsigned int i, vlan, count;
+
+    if (req->var_vlan_list_size) {
+        if (!req->var_vlan_list || (req->var_vrf_list_size &&
+                    req->var_vrf_list_size != req->var_vlan_list_size))
+            return -EINVAL;
+
+        for (i = 0; i < req->var_vlan_list_size; i++)
+            if ((unsigned short)req->var_vlan_list[i] >= VIF_VRF_TABLE_ENTRIES)
+                return -EINVAL;
+
+        for (i = 0; i < req->var_vlan_list_size; i++) {
+            ret = vif_vrf_table_set(vif, (unsigned short)req->var_vlan_list[i],
+                    req->var_vrf_list_size ? req->var_vrf_list[i] :
+                    req->var_vif_vrf);
+            if (ret)
+                return ret;
+        }
+
+        return 0;
+    }
+
+    vlan = (unsigned short)req->var_vlan_id;
+    count = req->var_vlan_count > 0 ? req->var_vlan_count : 1;
+    if (vlan + count > VIF_VRF_TABLE_ENTRIES)
+        return -EINVAL;
+
+    for (i = 0; i < count; i++) {
+        ret = vif_vrf_table_set(vif, vlan + i, req->var_vif_vrf);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
 static int
 vr_vrf_assign_set(vr_vrf_assign_req *req)
 {
@@ -83,7 +133,7 @@ vr_vrf_assign_set(vr_vrf_assign_req *req)
         goto exit_set;
     }
 
-    ret = vif_vrf_table_set(vif, req->var_vlan_id, req->var_vif_vrf);
+    ret = vr_vrf_assign_set_bulk(vif, req);
 exit_set:
     if (vif)
         vrouter_put_interface(vif);
@@ -113,6 +163,7 @@ vr_vrf_assign_req_process(void *s_req)
 
     case SANDESH_OP_DELETE:
         req->var_vif_vrf = -1;
+        req->var_vrf_list_size = 0;
         ret = vr_vrf_assign_set(req);
         break;
 
@@ -7,44 +7,127 @@
 #include "vr_message.h"
 #include "vr_sandesh.h"
 #include "vr_vxlan.h"
+#include "vr_bridge.h"
 
-int
-vr_vxlan_input(struct vrouter *router, struct vr_packet *pkt, 
-                                struct vr_forwarding_md *fmd)
+unsigned int vr_vxlan_vnids = VR_DEF_VXLAN_VNIDS;
+
+/*
+ * the itable holds all the vnids (and the references to their nexthops).
+ * the vnids below vr_max_vnids are also in vr_vnids, replicated on every
+ * node, which the datapath reads with one load
+ */
+static inline struct vr_nexthop *
+__vr_vxlan_nh(struct vrouter *router, unsigned int vnid)
+{
+    if (vnid < router->vr_max_vnids)
+        return ((struct vr_nexthop **)
+                vr_replica(router->vr_vnid_replicas))[vnid];
+
+    return (struct vr_nexthop *)vr_itable_get(router->vr_vxlan_table, vnid);
+}
+
+struct vr_nexthop *
+vr_vxlan_nh(struct vrouter *router, unsigned int vnid)
+{
+    return __vr_vxlan_nh(router, vnid);
+}
+
+/* strips the vxlan header, and returns the nexthop of the vnid */
+static struct vr_nexthop *
+vr_vxlan_decap(struct vrouter *router, struct vr_packet *pkt,
+        unsigned short *vrf)
 {
     struct vr_vxlan *vxlan;
     unsigned int vnid;
     struct vr_nexthop *nh;
-    unsigned short vrf;
 
     vxlan = (struct vr_vxlan *)pkt_data(pkt);
-    if (ntohl(vxlan->vxlan_flags) != VR_VXLAN_IBIT)
-        goto fail;
+    if (ntohl(vxlan->vxlan_flags) != VR_VXLAN_IBIT) {
+        vr_pfree(pkt, VP_DROP_INVALID_VNID);
+        return NULL;
+    }
 
     vnid = ntohl(vxlan->vxlan_vnid) >> VR_VXLAN_VNID_SHIFT;
     if (!pkt_pull(pkt, sizeof(struct vr_vxlan))) {
         vr_pfree(pkt, VP_DROP_PULL);
-        return 0;
+        return NULL;
     }
 
-    nh = (struct vr_nexthop *)vr_itable_get(router->vr_vxlan_table, vnid); 
-    if (nh) {
-        if (nh->nh_vrf >= 0) {
-            vrf = nh->nh_vrf;
-        } else if (nh->nh_dev) {
-            vrf = nh->nh_dev->vif_vrf;
-        } else {
-            vrf = pkt->vp_if->vif_vrf;
-        }
+    nh = __vr_vxlan_nh(router, vnid);
+    if (!nh) {
+        vr_pfree(pkt, VP_DROP_INVALID_VNID);
+        return NULL;
+    }
 
-        return nh_output(vrf, pkt, nh, fmd);
+    if (nh->nh_vrf >= 0) {
+        *vrf = nh->nh_vrf;
+    } else if (nh->nh_dev) {
+        *vrf = nh->nh_dev->vif_vrf;
+    } else {
+        *vrf = pkt->vp_if->vif_vrf;
     }
 
-fail:
-    vr_pfree(pkt, VP_DROP_INVALID_VNID);
+    return nh;
+}
+
+int
+vr_vxlan_input(struct vrouter *router, struct vr_packet *pkt, 
+                                struct vr_forwarding_md *fmd)
+{
+    struct vr_nexthop *nh;
+    unsigned short vrf;
+
+    nh = vr_vxlan_decap(router, pkt, &vrf);
+    if (nh)
+        return nh_output(vrf, pkt, nh, fmd);
+
     return 0;
 }
 
+/*
+ * vr_vxlan_input for a burst of packets, each at its vxlan header. the
+ * frames of bridged vnids are handed to the bridge lookup as one batch
+ */
+void
+vr_vxlan_input_bulk(struct vrouter *router, struct vr_packet **pkts,
+        unsigned int num_pkts, struct vr_forwarding_md *fmds)
+{
+    unsigned int i, num_l2 = 0;
+    unsigned short vrf;
+    unsigned short vrfs[VR_FLOW_BATCH_MAX];
+    struct vr_packet *l2_pkts[VR_FLOW_BATCH_MAX];
+    struct vr_forwarding_md l2_fmds[VR_FLOW_BATCH_MAX];
+    struct vr_nexthop *nh;
+
+    while (num_pkts > VR_FLOW_BATCH_MAX) {
+        vr_vxlan_input_bulk(router, pkts, VR_FLOW_BATCH_MAX, fmds);
+        pkts += VR_FLOW_BATCH_MAX;
+        fmds += VR_FLOW_BATCH_MAX;
+        num_pkts -= VR_FLOW_BATCH_MAX;
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+        nh = vr_vxlan_decap(router, pkts[i], &vrf);
+        if (!nh)
+            continue;
+
+        /* what nh_vxlan_vrf would have done, for one frame */
+        if (nh->nh_type == NH_VXLAN_VRF) {
+            vrfs[num_l2] = nh->nh_vrf;
+            l2_fmds[num_l2] = fmds[i];
+            l2_pkts[num_l2++] = pkts[i];
+            continue;
+        }
+
+        nh_output(vrf, pkts[i], nh, &fmds[i]);
+    }
+
+    if (num_l2)
+        vr_bridge_input_batch(router, vrfs, l2_pkts, num_l2, l2_fmds);
+
+    return;
+}
+
 static void
 vr_vxlan_make_req(vr_vxlan_req *req, struct vr_nexthop *nh, unsigned int vnid)
 {
@@ -103,7 +186,7 @@ vr_vxlan_get(vr_vxlan_req *req)
     if (!router) {
         ret = -ENODEV;
     } else {
-        nh = (struct vr_nexthop *)vr_itable_get(router->vr_vxlan_table, req->vxlanr_vnid); 
+        nh = vr_vxlan_nh(router, req->vxlanr_vnid);
         if (!nh)
             ret = -ENOENT;
     }
@@ -131,6 +214,9 @@ vr_vxlan_del(vr_vxlan_req *req)
         goto generate_resp;
     }
 
+    if ((unsigned int)req->vxlanr_vnid < router->vr_max_vnids)
+        vr_replicas_set(router->vr_vnid_replicas, req->vxlanr_vnid, NULL);
+
     nh = vr_itable_del(router->vr_vxlan_table, req->vxlanr_vnid);
     if (nh)
         vrouter_put_nexthop(nh);
@@ -160,15 +246,19 @@ vr_vxlan_add(vr_vxlan_req *req)
     }
     
     nh_old = vr_itable_set(router->vr_vxlan_table, req->vxlanr_vnid, nh);
-    if (nh_old) {
-        if (nh_old == VR_ITABLE_ERR_PTR) {
-            ret = -EINVAL;
-        } else {
-            /* If there is any old nexthop, remove the reference */
-            vrouter_put_nexthop(nh_old);
-        }
+    if (nh_old == VR_ITABLE_ERR_PTR) {
+        vrouter_put_nexthop(nh);
+        ret = -EINVAL;
+        goto generate_resp;
     }
 
+    if ((unsigned int)req->vxlanr_vnid < router->vr_max_vnids)
+        vr_replicas_set(router->vr_vnid_replicas, req->vxlanr_vnid, nh);
+
+    /* If there is any old nexthop, remove the reference */
+    if (nh_old)
+        vrouter_put_nexthop(nh_old);
+
 generate_resp:
     vr_send_response(ret);
     return ret;
@@ -179,6 +269,7 @@ vr_vxlan_req_process(void *s_req)
 {
     vr_vxlan_req *req = (vr_vxlan_req *)s_req;
 
+    vr_config_request(vrouter_get(req->vxlanr_rid), req->h_op);
     switch(req->h_op) {
     case SANDESH_OP_ADD:
         vr_vxlan_add(req);
@@ -216,6 +307,14 @@ vr_vxlan_destroy(unsigned int index, void *arg)
 void
 vr_vxlan_exit(struct vrouter *router, bool soft_reset)
 {
+    if (router->vr_vnids) {
+        router->vr_max_vnids = 0;
+        vr_delay_op();
+        vr_replicas_free(router->vr_vnid_replicas);
+        vr_free(router->vr_vnids);
+        router->vr_vnids = NULL;
+    }
+
     /* Delete the complete index table, irrespective of soft_reset */
     vr_itable_delete(router->vr_vxlan_table, vr_vxlan_destroy);
     router->vr_vxlan_table = NULL;
@@ -224,6 +323,9 @@ vr_vxlan_exit(struct vrouter *router, bool soft_reset)
 int
 vr_vxlan_init(struct vrouter *router)
 {
+    int ret;
+    unsigned int memory;
+
     /* Create an index table with two strides of 12 bits each */
     if (!router->vr_vxlan_table) {
         router->vr_vxlan_table = vr_itable_create(24, 2, 12, 12);
@@ -232,5 +334,25 @@ vr_vxlan_init(struct vrouter *router)
             return -ENOMEM;
         }
     }
+
+    if (!router->vr_vnids && vr_vxlan_vnids) {
+        if (vr_vxlan_vnids > (1 << 24))
+            vr_vxlan_vnids = 1 << 24;
+
+        memory = vr_vxlan_vnids * sizeof(struct vr_nexthop *);
+        router->vr_vnids = vr_zalloc(memory);
+        if (!router->vr_vnids)
+            return vr_module_error(-ENOMEM, __FUNCTION__, __LINE__, memory);
+
+        ret = vr_replicas_alloc(router->vr_vnid_replicas, router->vr_vnids,
+                memory);
+        if (ret) {
+            vr_free(router->vr_vnids);
+            router->vr_vnids = NULL;
+            return vr_module_error(ret, __FUNCTION__, __LINE__, memory);
+        }
+        router->vr_max_vnids = vr_vxlan_vnids;
+    }
+
     return 0;
 }
@@ -8,10 +8,15 @@
 #include <vr_os.h>
 #include <linux/version.h>
 #include "vr_sandesh.h"
+#include "vr_message.h"
 
 static struct vrouter router;
 struct host_os *vrouter_host;
 
+/* set by the host before vrouter_init. see vr_keyed_hash */
+__u32 vr_hash_seed;
+unsigned int vr_hash_engine = VR_HASH_ENGINE_JENKINS;
+
 extern struct host_os *vrouter_get_host(void);
 extern int vr_stats_init(struct vrouter *);
 extern void vr_stats_exit(struct vrouter *, bool);
@@ -35,6 +40,16 @@ static struct vr_module modules[] = {
         .init           =       vr_stats_init,
         .exit           =       vr_stats_exit,
     },
+    {
+        .mod_name       =       "Notify",
+        .init           =       vr_notify_init,
+        .exit           =       vr_notify_exit,
+    },
+    {
+        .mod_name       =       "Perf",
+        .init           =       vr_perf_init,
+        .exit           =       vr_perf_exit,
+    },
     {
         .mod_name       =       "Interface",
         .init           =       vr_interface_init,
@@ -94,6 +109,18 @@ int vr_mudp = 0;
 int vr_from_vm_mss_adj = 1; /* adjust TCP MSS on packets from VM */
 int vr_to_vm_mss_adj = 1;   /* adjust TCP MSS on packet sent to VM */
 
+/*
+ * keep a copy of the nexthop, label and interface tables on every numa
+ * node, so that packets read only local memory for them
+ */
+int vr_numa_replicas = 0;
+
+/*
+ * hand tunneled packets from the fabric straight to the tunnel input, without
+ * the outer route lookup
+ */
+int vr_fabric_early_demux = 1;
+
 /*
  * Following sysctls are to enable RPS. Based on empirical results,
  * performing RPS immediately after packets arrive on a physical interface
@@ -192,6 +219,110 @@ vr_module_debug_dump(void)
     return;
 }
 
+/*
+ * set up the copies of 'table', of 'size' bytes. without vr_numa_replicas,
+ * or a host that cannot allocate on a node, the table is the only copy
+ */
+int
+vr_replicas_alloc(void **replicas, void *table, unsigned int size)
+{
+    int node, nodes;
+
+    memset(replicas, 0, sizeof(void *) * VR_MAX_NUMA_NODES);
+    replicas[0] = table;
+
+    if (!vr_numa_replicas || !vr_node_zalloc || !vr_num_nodes)
+        return 0;
+
+    nodes = vr_num_nodes();
+    if (nodes > VR_MAX_NUMA_NODES)
+        nodes = VR_MAX_NUMA_NODES;
+
+    for (node = 1; node < nodes; node++) {
+        replicas[node] = vr_node_zalloc(size, node);
+        if (!replicas[node]) {
+            vr_replicas_free(replicas);
+            return -ENOMEM;
+        }
+        memcpy(replicas[node], table, size);
+    }
+
+    return 0;
+}
+
+/* copy 0 is the table itself, and stays with its owner */
+void
+vr_replicas_free(void **replicas)
+{
+    int node;
+
+    for (node = 1; node < VR_MAX_NUMA_NODES; node++) {
+        if (replicas[node]) {
+            vr_free(replicas[node]);
+            replicas[node] = NULL;
+        }
+    }
+    replicas[0] = NULL;
+
+    return;
+}
+
+void
+vr_replicas_set(void **replicas, unsigned int index, void *value)
+{
+    int node;
+
+    for (node = 0; node < VR_MAX_NUMA_NODES; node++)
+        if (replicas[node])
+            ((void **)replicas[node])[index] = value;
+
+    return;
+}
+
+/*
+ * objects that the datapath may still be using when the last reference
+ * goes. they are queued from any context, and freed together after one
+ * grace period from that of the requests, instead of each one waiting for
+ * its own. what a free queues in turn (the members of a composite
+ * nexthop) goes with the next round
+ */
+static struct vr_deferred *vr_deferred_head;
+
+void
+vr_free_deferred(struct vr_deferred *vd, void (*free_cb)(struct vr_deferred *))
+{
+    struct vr_deferred *head;
+
+    vd->vd_free = free_cb;
+    do {
+        head = vr_deferred_head;
+        vd->vd_next = head;
+    } while (!__sync_bool_compare_and_swap(&vr_deferred_head, head, vd));
+
+    return;
+}
+
+/* at the end of each request, and in between the exits of the modules */
+void
+vr_free_deferred_flush(void)
+{
+    struct vr_deferred *vd, *next;
+
+    while ((vd = vr_deferred_head)) {
+        vd = __sync_lock_test_and_set(&vr_deferred_head, NULL);
+        if (!vd)
+            break;
+
+        vr_delay_op();
+        for (; vd; vd = next) {
+            next = vd->vd_next;
+            vd->vd_free(vd);
+        }
+    }
+
+    return;
+}
+
 struct vrouter *
 vrouter_get(unsigned int vr_id)
 {
@@ -209,6 +340,7 @@ vrouter_exit(bool soft_reset)
 
     for (i = VR_NUM_MODULES - 1; i >= 0; --i) {
         modules[i].exit(&router, soft_reset);
+        vr_free_deferred_flush();
     }
 
     return;
@@ -254,12 +386,20 @@ vrouter_ops_process(void *s_req)
 {
     int ret;
 
-    vrouter_ops *ops = (vrouter_ops *)s_req;
+    vrouter_ops *ops = (vrouter_ops *)s_req, resp;
 
     switch (ops->h_op) {
     case SANDESH_OP_RESET:
         ret = vrouter_soft_reset();        
         break;
+
+    case SANDESH_OP_GET:
+        memset(&resp, 0, sizeof(resp));
+        resp.h_op = SANDESH_OP_GET;
+        resp.vo_config_gen = router.vr_config_gen;
+        vr_message_response(VR_VROUTER_OPS_OBJECT_ID, &resp, 0);
+        return;
+
     default:
         ret = -EOPNOTSUPP;
     }
@@ -1,21 +1,6 @@
 #include "ulinux.h"
 
-void add_timer(struct dummy_timer_list *dummy)
-{
-	return;
-}
-
-void init_timer(struct dummy_timer_list *dummy)
-{
-	return;
-}
-
 time_t get_time()
 {
 	return time(NULL);
 }
-
-void ulinux_timer(unsigned long data)
-{
-	return;
-}
@@ -3,6 +3,7 @@
  *
  * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
  */
+#define _GNU_SOURCE
 #include <sys/socket.h>
 
 #include "vr_os.h"
@@ -37,69 +38,199 @@ struct hif_interface_md {
     },
 };
 
+/*
+ * packets that dp-core sends while an io thread works on a received burst
+ * are held here, and go out with one hif_tx_burst per interface at the
+ * end of it
+ */
+struct hif_tx_burst {
+    bool htb_active;
+    unsigned int htb_count;
+    struct vr_hinterface *htb_hif[HIF_TX_BURST];
+    struct vr_hpacket *htb_hpkt[HIF_TX_BURST];
+};
+
+static __thread struct hif_tx_burst hif_tx_burst;
+
+static void
+hif_tx_flush(void)
+{
+    unsigned int i, start, num;
+    struct vr_hinterface *hif;
+    struct hif_tx_burst *htb = &hif_tx_burst;
+
+    for (start = 0; start < htb->htb_count; start += num) {
+        hif = htb->htb_hif[start];
+        for (num = 0; start + num < htb->htb_count &&
+                htb->htb_hif[start + num] == hif; num++)
+            ;
+        hif->hif_tx_burst(hif, htb->htb_hpkt + start, num);
+    }
+
+    for (i = 0; i < htb->htb_count; i++) {
+        htb->htb_hif[i] = NULL;
+        htb->htb_hpkt[i] = NULL;
+    }
+    htb->htb_count = 0;
+
+    return;
+}
+
 static void
-vr_netif_rx(struct vr_hinterface *hif, struct vr_hpacket *hpkt)
+vr_netif_rx(struct vr_hinterface *hif, struct vr_packet **pkts,
+        unsigned int num_pkts)
 {
+    unsigned int i;
     struct vr_interface *vif = hif->hif_vif;
 
-    if (vif)
-        vif->vif_rx(vif, &hpkt->hp_packet, VLAN_ID_INVALID);
-    else
-        vr_hpacket_pool_free(hpkt);
+    if (vif) {
+        vr_interface_rx_burst(vif, pkts, num_pkts);
+    } else {
+        for (i = 0; i < num_pkts; i++)
+            vr_hpacket_free(VR_PACKET_TO_HPACKET(pkts[i]));
+    }
 
     return;
 }
 
-static int
-hif_udp_rx(void *arg)
+/* hands a received burst to dp-core, and sends what came out of it */
+void
+vr_hif_rx_burst(struct vr_hinterface *hif, struct vr_packet **pkts,
+        unsigned int num_pkts)
 {
-    int ret = 0;
-    struct vr_hinterface *hif = (struct vr_hinterface *)arg;
-    struct vr_hpacket *hpkt;
-    struct vr_packet *pkt;
+    hif_tx_burst.htb_active = true;
+    vr_netif_rx(hif, pkts, num_pkts);
+    hif_tx_burst.htb_active = false;
+    hif_tx_flush();
 
-    hpkt = vr_hpacket_pool_alloc(hif->hif_pkt_pool);
-    if (!hpkt)
-        assert(!hpkt);
+    return;
+}
 
-    ret = read(hif->hif_fd, hpkt_data(hpkt), hpkt_size(hpkt));
-    if (ret > 0) {
-        hpkt->hp_tail += ret;
-        pkt = &hpkt->hp_packet;
-        pkt->vp_len = ret;
-        pkt->vp_tail = hpkt->hp_tail;
-        pkt->vp_if = hif->hif_vif;
-        vr_netif_rx(hif, hpkt);
-    } else {
-        vr_hpacket_pool_free(hpkt);
+static unsigned int
+hif_udp_iov(struct vr_hpacket *hpkt, struct iovec *iov, unsigned int max)
+{
+    unsigned int i = 0;
+
+    while (hpkt && i < max) {
+        iov[i].iov_base = pkt_data(&hpkt->hp_packet);
+        iov[i].iov_len = pkt_head_len(&hpkt->hp_packet);
+        i++;
+        hpkt = hpkt->hp_next;
     }
 
-    return ret;
+    /* does not fit */
+    if (hpkt)
+        return 0;
+
+    return i;
 }
 
 static unsigned int
 hif_udp_tx(struct vr_hinterface *hif, struct vr_hpacket *hpkt)
 {
-    int i = 0;
+    unsigned int num_iovs;
     struct msghdr msg;
-    struct vr_hpacket *hpkt_tmp = hpkt;
     struct iovec msg_iov[64];
 
-    bzero(&msg, sizeof(msg));
-    msg.msg_iov = msg_iov;
-    while (hpkt_tmp && i < 64) {
-        msg_iov[i].iov_base = hpkt_data(hpkt);
-        msg_iov[i].iov_len = hpkt->hp_packet.vp_len;
-        i++;
-        hpkt_tmp = hpkt_tmp->hp_next;
+    num_iovs = hif_udp_iov(hpkt, msg_iov, 64);
+    if (num_iovs) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = msg_iov;
+        msg.msg_iovlen = num_iovs;
+        sendmsg(hif->hif_fd, &msg, 0);
     }
 
-    msg.msg_iovlen = i;
-    sendmsg(hif->hif_fd, &msg, 0);
     vr_hpacket_free(hpkt);
     return 0;
 }
 
+/* chains that do not fit HIF_TX_IOV_MAX go out on their own */
+static unsigned int
+hif_udp_tx_burst(struct vr_hinterface *hif, struct vr_hpacket **hpkts,
+        unsigned int num)
+{
+    int ret;
+    unsigned int i, num_msgs = 0, sent;
+    struct vr_hpacket *sent_hpkts[HIF_TX_BURST];
+    struct mmsghdr msgs[HIF_TX_BURST];
+    struct iovec iovs[HIF_TX_BURST][HIF_TX_IOV_MAX];
+
+    for (i = 0; i < num && i < HIF_TX_BURST; i++) {
+        memset(&msgs[num_msgs], 0, sizeof(msgs[num_msgs]));
+        msgs[num_msgs].msg_hdr.msg_iov = iovs[num_msgs];
+        msgs[num_msgs].msg_hdr.msg_iovlen = hif_udp_iov(hpkts[i],
+                iovs[num_msgs], HIF_TX_IOV_MAX);
+        if (!msgs[num_msgs].msg_hdr.msg_iovlen) {
+            hif_udp_tx(hif, hpkts[i]);
+            continue;
+        }
+        sent_hpkts[num_msgs++] = hpkts[i];
+    }
+
+    for (sent = 0; sent < num_msgs; sent += ret) {
+        ret = sendmmsg(hif->hif_fd, msgs + sent, num_msgs - sent, 0);
+        if (ret <= 0)
+            break;
+    }
+
+    for (i = 0; i < num_msgs; i++)
+        vr_hpacket_free(sent_hpkts[i]);
+
+    return 0;
+}
+
+static int
+hif_udp_rx(void *arg)
+{
+    int ret = 0;
+    unsigned int i, num_hpkts;
+    struct vr_hinterface *hif = (struct vr_hinterface *)arg;
+    struct vr_hpacket *hpkt, *hpkts[HIF_RX_BURST];
+    struct vr_packet *pkt, *pkts[HIF_RX_BURST];
+    struct mmsghdr msgs[HIF_RX_BURST];
+    struct iovec iovs[HIF_RX_BURST];
+
+    num_hpkts = vr_hpacket_pool_get_bulk(hif->hif_pkt_pool, hpkts,
+            HIF_RX_BURST);
+    if (!num_hpkts)
+        return -ENOMEM;
+
+    for (i = 0; i < num_hpkts; i++) {
+        hpkt = hpkts[i];
+        iovs[i].iov_base = hpkt_data(hpkt);
+        iovs[i].iov_len = hpkt->hp_end - hpkt->hp_data;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    ret = recvmmsg(hif->hif_fd, msgs, num_hpkts, MSG_DONTWAIT, NULL);
+    if (ret < 0)
+        ret = 0;
+
+    if ((unsigned int)ret < num_hpkts)
+        vr_hpacket_pool_put_bulk(hif->hif_pkt_pool, hpkts + ret,
+                num_hpkts - ret);
+
+    if (!ret)
+        return 0;
+
+    for (i = 0; i < (unsigned int)ret; i++) {
+        hpkt = hpkts[i];
+        hpkt->hp_tail = hpkt->hp_data + msgs[i].msg_len;
+        pkt = &hpkt->hp_packet;
+        pkt->vp_len = msgs[i].msg_len;
+        pkt->vp_tail = hpkt->hp_tail;
+        pkt->vp_if = hif->hif_vif;
+        pkt->vp_cpu = vr_get_cpu();
+        pkts[i] = pkt;
+    }
+
+    vr_hif_rx_burst(hif, pkts, ret);
+
+    return ret;
+}
+
 int
 vr_hif_udp_create(struct vr_hinterface *hif, unsigned int vif_type)
 {
@@ -138,8 +269,10 @@ vr_hif_udp_create(struct vr_hinterface *hif, unsigned int vif_type)
     hif->hif_vif_type = vif_type;
     hif->hif_fd = sock;
     hif->hif_tx = hif_udp_tx;
+    hif->hif_tx_burst = hif_udp_tx_burst;
     hif->hif_rx = hif_udp_rx;
-    hif->hif_pkt_pool = vr_hpacket_pool_create(100, 2000);
+    hif->hif_pkt_pool = vr_hpacket_pool_create(HIF_PKT_POOL_SIZE,
+            HIF_PKT_SIZE);
     if (!hif->hif_pkt_pool)
         goto cleanup;
 
@@ -176,9 +309,28 @@ vr_hif_udp_destroy(struct vr_hinterface *hif)
     return;
 }
 
-struct vr_hinterface *
-vr_hinterface_create(unsigned int index, unsigned int hif_type,
-        unsigned int vif_type)
+static unsigned int
+hif_null_tx(struct vr_hinterface *hif, struct vr_hpacket *hpkt)
+{
+    vr_hpacket_free(hpkt);
+    return 0;
+}
+
+static unsigned int
+hif_null_tx_burst(struct vr_hinterface *hif, struct vr_hpacket **hpkts,
+        unsigned int num)
+{
+    unsigned int i;
+
+    for (i = 0; i < num; i++)
+        vr_hpacket_free(hpkts[i]);
+
+    return 0;
+}
+
+static struct vr_hinterface *
+__vr_hinterface_create(unsigned int index, unsigned int hif_type,
+        unsigned int vif_type, const char *name)
 {
     int ret;
     struct vr_hinterface *hif;
@@ -201,6 +353,25 @@ vr_hinterface_create(unsigned int index, unsigned int hif_type,
 
         break;
 
+    case HIF_TYPE_RING:
+        if (!name)
+            goto cleanup;
+
+        ret = vr_hif_ring_create(hif, vif_type, name);
+        if (ret)
+            goto cleanup;
+
+        break;
+
+    case HIF_TYPE_NULL:
+        if (vif_type >= VIF_TYPE_MAX)
+            goto cleanup;
+
+        hif->hif_vif_type = vif_type;
+        hif->hif_tx = hif_null_tx;
+        hif->hif_tx_burst = hif_null_tx_burst;
+        break;
+
     default:
         goto cleanup;
     }
@@ -218,6 +389,21 @@ cleanup:
     return NULL;
 }
 
+struct vr_hinterface *
+vr_hinterface_create(unsigned int index, unsigned int hif_type,
+        unsigned int vif_type)
+{
+    return __vr_hinterface_create(index, hif_type, vif_type, NULL);
+}
+
+/* an interface that polls the rings of the device 'name' */
+struct vr_hinterface *
+vr_hinterface_create_ring(unsigned int index, unsigned int vif_type,
+        const char *name)
+{
+    return __vr_hinterface_create(index, HIF_TYPE_RING, vif_type, name);
+}
+
 void
 vr_hinterface_destroy(struct vr_hinterface *hif)
 {
@@ -226,6 +412,14 @@ vr_hinterface_destroy(struct vr_hinterface *hif)
         vr_hif_udp_destroy(hif);
         break;
 
+    case HIF_TYPE_RING:
+        vr_hif_ring_destroy(hif);
+        break;
+
+    case HIF_TYPE_NULL:
+        free(hif);
+        break;
+
     default:
         assert(0);
         break;
@@ -289,12 +483,21 @@ vr_lib_interface_tx(struct vr_interface *vif, struct vr_packet *pkt)
 {
     struct vr_hinterface *hif = (struct vr_hinterface *)vif->vif_os;
     struct vr_hpacket *hpkt = VR_PACKET_TO_HPACKET(pkt);
+    struct hif_tx_burst *htb = &hif_tx_burst;
 
     if (!hif) {
         vr_hpacket_free(hpkt);
         return 0;
     }
 
+    if (htb->htb_active && hif->hif_tx_burst) {
+        htb->htb_hif[htb->htb_count] = hif;
+        htb->htb_hpkt[htb->htb_count] = hpkt;
+        if (++htb->htb_count == HIF_TX_BURST)
+            hif_tx_flush();
+        return 0;
+    }
+
     return hif->hif_tx(hif, hpkt);
 }
 
@@ -1,123 +1,450 @@
 /*
- * vr_host_io.c -- simplistic io scheduler
+ * vr_host_io.c -- io scheduler. every io thread waits on an epoll set of its
+ *                 own, with the fds that were given to it, and runs the
+ *                 callbacks of the fds that are ready
  *
  * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
  */
+#define _GNU_SOURCE
+#include <stdlib.h>
 #include <string.h>
-#include <poll.h>
+#include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
 
-#define VR_MAX_IO_CBS      256
+#include "host/vr_host.h"
 
+#define VR_IO_EVENTS        64
+#define VR_IO_CBS_CHUNK     256
+#define VR_IO_MAX_CHUNKS    256
+#define VR_IO_POLL_MAX      32
+#define VR_IO_TURNS_IDLE    UINT64_MAX
+
+extern unsigned int vr_num_cpus;
+
+/*
+ * callbacks are by fd, in chunks of VR_IO_CBS_CHUNK fds that are allocated
+ * as they are needed, and never move or go away while the threads run. an
+ * event that was already collected for an fd that went away finds a slot
+ * with io_fd < 0, and is ignored
+ */
 struct vr_io_cb {
     int io_fd;
+    unsigned int io_thread;
     int (*io_process)(void *);
     void *io_arg;
-} vr_io_cbs[VR_MAX_IO_CBS];
+};
+
+/*
+ * pollers are run on every turn of their thread, which then does not wait
+ * in epoll. a thread that already waits sees a new poller only once it
+ * wakes up, and hence pollers are best registered before vr_host_io
+ */
+struct vr_io_poll {
+    int (*iop_process)(void *);
+    void *iop_arg;
+};
+
+/*
+ * a thread is done with whatever it looked at before, once it has finished
+ * a turn, or if it was waiting in epoll with nothing to do
+ */
+struct vr_io_thread {
+    int iot_epfd;
+    unsigned int iot_index;
+    unsigned int iot_fds;
+    unsigned int iot_num_polls;
+    volatile bool iot_idle;
+    volatile uint64_t iot_turns;
+    pthread_t iot_thread;
+    struct vr_io_poll iot_polls[VR_IO_POLL_MAX];
+};
+
+static struct vr_io_cb *vr_io_cbs[VR_IO_MAX_CHUNKS];
+static pthread_mutex_t vr_io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vr_io_thread *vr_io_threads;
+static unsigned int vr_io_num_threads;
 
-unsigned int pollfd_to_cb[VR_MAX_IO_CBS];
-struct pollfd vr_io_pollfds[VR_MAX_IO_CBS];
-unsigned int vr_io_n_pollfds;
+/* the io thread that runs the caller, which is what dp-core sees as the cpu */
+static __thread unsigned int vr_io_thread_index;
+
+unsigned int
+vr_host_io_cpu(void)
+{
+    return vr_io_thread_index;
+}
+
+unsigned int
+vr_host_io_num_threads(void)
+{
+    return vr_io_num_threads;
+}
 
+/* turns has to have room for vr_host_io_num_threads entries */
 void
-vr_host_io_unregister(int fd)
+vr_host_io_snapshot(uint64_t *turns)
 {
-    int i;
-    struct pollfd *pfd;
+    unsigned int i;
 
-    for (i = 0; i < VR_MAX_IO_CBS; i++) {
-        pfd = &vr_io_pollfds[i];
-        if (pfd->fd == fd) {
-            memcpy((char *)pfd, (char *)(pfd + 1),
-                    (vr_io_n_pollfds - (i + 1)) * sizeof(struct pollfd));
-            memcpy((char *)&pollfd_to_cb[i], (char *)&pollfd_to_cb[i + 1],
-                        (vr_io_n_pollfds - (i + 1)) * sizeof(unsigned int));
+    __sync_synchronize();
+    for (i = 0; i < vr_io_num_threads; i++) {
+        if (vr_io_threads[i].iot_idle)
+            turns[i] = VR_IO_TURNS_IDLE;
+        else
+            turns[i] = vr_io_threads[i].iot_turns;
+    }
 
-            vr_io_n_pollfds--;
+    return;
+}
 
-            bzero((char *)&pollfd_to_cb[vr_io_n_pollfds],
-                    (VR_MAX_IO_CBS - vr_io_n_pollfds) * sizeof(unsigned int));
-            bzero((char *)&vr_io_pollfds[vr_io_n_pollfds],
-                    (VR_MAX_IO_CBS - vr_io_n_pollfds) * sizeof(struct pollfd));
-            break;
+bool
+vr_host_io_quiesced(const uint64_t *turns)
+{
+    unsigned int i;
+
+    for (i = 0; i < vr_io_num_threads; i++) {
+        if (turns[i] != VR_IO_TURNS_IDLE &&
+                turns[i] == vr_io_threads[i].iot_turns)
+            return false;
+    }
+
+    return true;
+}
+
+static inline struct vr_io_cb *
+vr_host_io_cb(unsigned int fd)
+{
+    struct vr_io_cb *chunk;
+
+    if (fd >= VR_IO_MAX_CHUNKS * VR_IO_CBS_CHUNK)
+        return NULL;
+
+    chunk = vr_io_cbs[fd / VR_IO_CBS_CHUNK];
+    if (!chunk)
+        return NULL;
+
+    return &chunk[fd % VR_IO_CBS_CHUNK];
+}
+
+static struct vr_io_cb *
+vr_host_io_cb_alloc(unsigned int fd)
+{
+    unsigned int i;
+    struct vr_io_cb *chunk;
+
+    if (fd >= VR_IO_MAX_CHUNKS * VR_IO_CBS_CHUNK)
+        return NULL;
+
+    if (!vr_io_cbs[fd / VR_IO_CBS_CHUNK]) {
+        chunk = calloc(VR_IO_CBS_CHUNK, sizeof(*chunk));
+        if (!chunk)
+            return NULL;
+
+        for (i = 0; i < VR_IO_CBS_CHUNK; i++)
+            chunk[i].io_fd = -1;
+        __sync_synchronize();
+        vr_io_cbs[fd / VR_IO_CBS_CHUNK] = chunk;
+    }
+
+    return vr_host_io_cb(fd);
+}
+
+void
+vr_host_io_unregister(unsigned int fd)
+{
+    struct vr_io_cb *io_cb;
+
+    pthread_mutex_lock(&vr_io_lock);
+    io_cb = vr_host_io_cb(fd);
+    if (!io_cb || io_cb->io_fd < 0)
+        goto exit_unregister;
+
+    epoll_ctl(vr_io_threads[io_cb->io_thread].iot_epfd, EPOLL_CTL_DEL, fd,
+            NULL);
+    vr_io_threads[io_cb->io_thread].iot_fds--;
+    io_cb->io_fd = -1;
+
+exit_unregister:
+    pthread_mutex_unlock(&vr_io_lock);
+    return;
+}
+
+/* on the thread that has the least fds, the first one on a tie */
+static unsigned int
+vr_host_io_pick_thread(void)
+{
+    unsigned int i, thread = 0;
+
+    for (i = 1; i < vr_io_num_threads; i++) {
+        if (vr_io_threads[i].iot_fds < vr_io_threads[thread].iot_fds)
+            thread = i;
+    }
+
+    return thread;
+}
+
+/* on the thread that has the least pollers, the first one on a tie */
+static unsigned int
+vr_host_io_pick_poll_thread(void)
+{
+    unsigned int i, thread = 0;
+
+    for (i = 1; i < vr_io_num_threads; i++) {
+        if (vr_io_threads[i].iot_num_polls <
+                vr_io_threads[thread].iot_num_polls)
+            thread = i;
+    }
+
+    return thread;
+}
+
+void
+vr_host_io_poll_unregister(int (*cb)(void *), void *arg)
+{
+    unsigned int i, j;
+    struct vr_io_thread *iot;
+
+    pthread_mutex_lock(&vr_io_lock);
+    for (i = 0; i < vr_io_num_threads; i++) {
+        iot = &vr_io_threads[i];
+        for (j = 0; j < iot->iot_num_polls; j++) {
+            if (iot->iot_polls[j].iop_process == cb &&
+                    iot->iot_polls[j].iop_arg == arg) {
+                /* the slot stays, since the thread may be looking at it */
+                iot->iot_polls[j].iop_process = NULL;
+                goto exit_unregister;
+            }
         }
     }
 
+exit_unregister:
+    pthread_mutex_unlock(&vr_io_lock);
     return;
 }
 
 int
-vr_host_io_register(unsigned int fd, int (*cb)(void *), void *arg)
+vr_host_io_poll_register(int (*cb)(void *), void *arg, int thread)
 {
-    int i;
-    struct vr_io_cb *io_cb;
-    struct pollfd *pfd;
-
-    if (vr_io_n_pollfds >= VR_MAX_IO_CBS)
-        return -ENOSPC;
-
-    for (i = 0; i < VR_MAX_IO_CBS; i++) {
-        io_cb = &vr_io_cbs[i];
-        if (io_cb->io_fd < 0) {
-            io_cb->io_fd = fd;
-            io_cb->io_process = cb;
-            io_cb->io_arg = arg;
-            pollfd_to_cb[vr_io_n_pollfds] = i;
+    int ret = 0;
+    unsigned int i;
+    struct vr_io_thread *iot;
+
+    if (!vr_io_threads || !cb)
+        return -EINVAL;
+
+    pthread_mutex_lock(&vr_io_lock);
+    if (thread < 0 || (unsigned int)thread >= vr_io_num_threads)
+        thread = vr_host_io_pick_poll_thread();
+    iot = &vr_io_threads[thread];
+
+    for (i = 0; i < iot->iot_num_polls; i++) {
+        if (!iot->iot_polls[i].iop_process)
             break;
-        }
     }
 
-    if (i == VR_MAX_IO_CBS)
-        return -ENOSPC;
+    if (i == VR_IO_POLL_MAX) {
+        ret = -ENOSPC;
+        goto exit_register;
+    }
 
-    /* setup the pollfd */
-    pfd = &vr_io_pollfds[vr_io_n_pollfds++];
-    pfd->fd = fd;
-    pfd->events = POLLIN;
-    pfd->revents = 0;
+    iot->iot_polls[i].iop_arg = arg;
+    __sync_synchronize();
+    iot->iot_polls[i].iop_process = cb;
+    if (i == iot->iot_num_polls) {
+        __sync_synchronize();
+        iot->iot_num_polls++;
+    }
 
-    return 0;
+exit_register:
+    pthread_mutex_unlock(&vr_io_lock);
+    return ret;
 }
 
 int
-vr_host_io_init(void)
+vr_host_io_register_on(unsigned int fd, int (*cb)(void *), void *arg,
+        int thread)
 {
-    int i;
+    int ret = 0;
+    struct epoll_event event;
     struct vr_io_cb *io_cb;
 
-    for (i = 0; i < VR_MAX_IO_CBS; i++) {
-        io_cb = &vr_io_cbs[i];
-        io_cb->io_fd  = -1;
+    if (!vr_io_threads)
+        return -EINVAL;
+
+    pthread_mutex_lock(&vr_io_lock);
+    io_cb = vr_host_io_cb_alloc(fd);
+    if (!io_cb) {
+        ret = -ENOMEM;
+        goto exit_register;
     }
 
-    return 0;
+    if (io_cb->io_fd >= 0) {
+        ret = -EEXIST;
+        goto exit_register;
+    }
+
+    if (thread < 0 || (unsigned int)thread >= vr_io_num_threads)
+        thread = vr_host_io_pick_thread();
+
+    io_cb->io_thread = thread;
+    io_cb->io_process = cb;
+    io_cb->io_arg = arg;
+    __sync_synchronize();
+    io_cb->io_fd = fd;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(vr_io_threads[thread].iot_epfd, EPOLL_CTL_ADD, fd,
+                &event) < 0) {
+        ret = -errno;
+        io_cb->io_fd = -1;
+        goto exit_register;
+    }
+
+    vr_io_threads[thread].iot_fds++;
+
+exit_register:
+    pthread_mutex_unlock(&vr_io_lock);
+    return ret;
 }
 
 int
-vr_host_io(void)
+vr_host_io_register(unsigned int fd, int (*cb)(void *), void *arg)
 {
-    int ret, processed = 0;
-    unsigned int i;
-    struct pollfd *p_pfd;
+    return vr_host_io_register_on(fd, cb, arg, -1);
+}
+
+static void
+vr_host_io_set_affinity(struct vr_io_thread *iot)
+{
+    cpu_set_t cpus;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_cpus <= 1)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(iot->iot_index % num_cpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    return;
+}
+
+static void *
+vr_host_io_thread(void *arg)
+{
+    int i, ret, timeout;
+    int (*process)(void *);
     struct vr_io_cb *io_cb;
+    struct vr_io_thread *iot = (struct vr_io_thread *)arg;
+    struct epoll_event events[VR_IO_EVENTS];
+
+    vr_io_thread_index = iot->iot_index;
+    vr_host_io_set_affinity(iot);
 
     while (true) {
-        ret = poll(vr_io_pollfds, vr_io_n_pollfds, -1);
-        if (ret < 0)
-            return ret;
-
-        for (i = 0; i < vr_io_n_pollfds; i++) {
-            p_pfd = &vr_io_pollfds[i];
-            if (p_pfd->revents & POLLIN) {
-                io_cb = &vr_io_cbs[pollfd_to_cb[i]];
-                io_cb->io_process(io_cb->io_arg);
-            }
+        timeout = iot->iot_num_polls ? 0 : -1;
+        if (timeout < 0) {
+            iot->iot_idle = true;
+            __sync_synchronize();
+        }
+        ret = epoll_wait(iot->iot_epfd, events, VR_IO_EVENTS, timeout);
+        iot->iot_idle = false;
+        __sync_synchronize();
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < ret; i++) {
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                continue;
 
-            if (++processed == ret)
-                break;
+            io_cb = vr_host_io_cb(events[i].data.fd);
+            if (!io_cb || io_cb->io_fd != events[i].data.fd)
+                continue;
+
+            io_cb->io_process(io_cb->io_arg);
         }
+
+        for (i = 0; i < (int)iot->iot_num_polls; i++) {
+            process = iot->iot_polls[i].iop_process;
+            if (process)
+                process(iot->iot_polls[i].iop_arg);
+        }
+
+        __sync_synchronize();
+        iot->iot_turns++;
+    }
+
+    return NULL;
+}
+
+/*
+ * the threads are what dp-core sees as cpus, and hence are to be set before
+ * vrouter is initialized
+ */
+int
+vr_host_io_init(unsigned int threads)
+{
+    unsigned int i;
+
+    if (vr_io_threads)
+        return 0;
+
+    if (!threads)
+        threads = 1;
+
+    vr_io_threads = calloc(threads, sizeof(*vr_io_threads));
+    if (!vr_io_threads)
+        return -ENOMEM;
+
+    for (i = 0; i < threads; i++) {
+        vr_io_threads[i].iot_index = i;
+        vr_io_threads[i].iot_epfd = epoll_create1(0);
+        if (vr_io_threads[i].iot_epfd < 0)
+            goto cleanup;
     }
 
+    vr_io_num_threads = threads;
+    vr_num_cpus = threads;
+
     return 0;
+
+cleanup:
+    while (i--)
+        close(vr_io_threads[i].iot_epfd);
+    free(vr_io_threads);
+    vr_io_threads = NULL;
+
+    return -ENOMEM;
+}
+
+/* runs the first io thread in the caller, and does not return */
+int
+vr_host_io(void)
+{
+    int ret;
+    unsigned int i;
+
+    if (!vr_io_threads)
+        return -EINVAL;
+
+    for (i = 1; i < vr_io_num_threads; i++) {
+        ret = pthread_create(&vr_io_threads[i].iot_thread, NULL,
+                vr_host_io_thread, &vr_io_threads[i]);
+        if (ret)
+            return -ret;
+    }
+
+    vr_host_io_thread(&vr_io_threads[0]);
+
+    return -errno;
 }
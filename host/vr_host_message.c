@@ -11,7 +11,8 @@
 
 /*
  * we need a way to identify the type of the object, and the type of
- * the message (request/response)
+ * the message (request/response). a buffer can hold many of these, one
+ * after the other, each object padded to DIET_ALIGN
  */
 struct diet_message {
     /* m_type = REQUEST | RESPONSE */
@@ -19,10 +20,14 @@ struct diet_message {
     unsigned int m_id;
     /* m_oid = VR_*_OBJECT_ID */
     unsigned int m_oid;
+    /* the length of the object, without the padding */
+    unsigned int m_len;
     /* finally, the object itself */
     char m_object[0];
 };
 
+#define DIET_ALIGN(len)         (((len) + 7) & ~7U)
+
 struct diet_object_md {
     /* 
      * when encoded, how much length will this object take. since encode
@@ -32,6 +37,8 @@ struct diet_object_md {
     unsigned int obj_len;
     /* depending on the object, we need a method to copy */
     int (*obj_copy)(char *, unsigned int, void *);
+    /* points the fields of a decoded object at where they were copied */
+    void (*obj_fixup)(void *);
     /* the request and the response callbacks */
     void (*obj_request)(void *);
     int (*obj_response)(struct diet_message *, void *,
@@ -40,6 +47,8 @@ struct diet_object_md {
 
 int diet_interface_object_copy(char *, unsigned int, void *);
 int diet_nexthop_object_copy(char *, unsigned int, void *);
+void diet_interface_object_fixup(void *);
+void diet_nexthop_object_fixup(void *);
 int diet_mpls_object_copy(char *, unsigned int, void *);
 int diet_route_object_copy(char *, unsigned int, void *);
 int diet_response_object_copy(char *, unsigned int, void *);
@@ -56,6 +65,7 @@ struct diet_object_md diet_md[] = {
                                         VR_ETHER_ALEN, 
 
         .obj_copy               =       diet_interface_object_copy,
+        .obj_fixup              =       diet_interface_object_fixup,
         .obj_request            =       vr_interface_req_process,
         .obj_response           =       diet_object_response,
     },
@@ -64,6 +74,7 @@ struct diet_object_md diet_md[] = {
                                         VR_ETHER_HLEN, 
 
         .obj_copy               =       diet_nexthop_object_copy,
+        .obj_fixup              =       diet_nexthop_object_fixup,
         .obj_request            =       vr_nexthop_req_process,
         .obj_response           =       diet_object_response,
     },
@@ -133,6 +144,15 @@ diet_nexthop_object_copy(char *dst, unsigned int buf_len, void *object)
     return total_len;
 }
 
+void
+diet_nexthop_object_fixup(void *object)
+{
+    vr_nexthop_req *req = (vr_nexthop_req *)object;
+
+    req->nhr_encap = req->nhr_encap_size ? (signed char *)(req + 1) : NULL;
+    return;
+}
+
 int
 diet_interface_object_copy(char *dst, unsigned int buf_len, void *object)
 {
@@ -156,6 +176,15 @@ diet_interface_object_copy(char *dst, unsigned int buf_len, void *object)
     return total_len;
 }
 
+void
+diet_interface_object_fixup(void *object)
+{
+    vr_interface_req *req = (vr_interface_req *)object;
+
+    req->vifr_mac = req->vifr_mac_size ? (signed char *)(req + 1) : NULL;
+    return;
+}
+
 int
 diet_response_object_copy(char *dst, unsigned int len, void *object)
 {
@@ -198,25 +227,26 @@ static int
 diet_encode(char *buf, unsigned int len,
         unsigned int object_type, void *object, unsigned int message_type)
 {
-    unsigned int encode_length = 0;
+    int ret;
     struct diet_message *hdr;
 
     if (!object)
         return 0;
 
-    encode_length += diet_object_buf_len(object_type, object);
-    if (len < encode_length)
+    if (len < diet_object_buf_len(object_type, object))
         return -ENOSPC;
 
     hdr = (struct diet_message *)buf;
     hdr->m_type = message_type;
     hdr->m_id = 0;
     hdr->m_oid = object_type;
-    encode_length = diet_object_copy((char *)(hdr + 1), len - sizeof(hdr),
+    ret = diet_object_copy((char *)(hdr + 1), len - sizeof(*hdr),
             object_type, object);
-    encode_length += sizeof(*hdr);
+    if (ret < 0)
+        return ret;
+    hdr->m_len = ret;
 
-    return encode_length;
+    return sizeof(*hdr) + DIET_ALIGN(ret);
 }
 
 static int
@@ -249,35 +279,65 @@ diet_encode_response(char *buf, unsigned int len,
 }
 
 
+/* the length that the object took in the buffer, or an error */
 static int
-diet_object_decode(struct diet_message *hdr,
+diet_object_decode(struct diet_message *hdr, unsigned int len,
         int (*cb)(void *, unsigned int, void *), void *cb_arg)
 {
-    int ret = 0;
-
-    if (hdr->m_type == VR_MESSAGE_TYPE_REQUEST)
-        diet_md[hdr->m_oid].obj_request(hdr + 1);
-    else
-        ret = diet_md[hdr->m_oid].obj_response(hdr, hdr + 1, cb, cb_arg);
+    int ret;
+    struct diet_object_md *md;
+
+    if (hdr->m_oid >= sizeof(diet_md) / sizeof(diet_md[0]))
+        return -EINVAL;
+    if (hdr->m_len > len - sizeof(*hdr))
+        return -EINVAL;
+
+    md = &diet_md[hdr->m_oid];
+    if (md->obj_fixup)
+        md->obj_fixup(hdr + 1);
+
+    if (hdr->m_type == VR_MESSAGE_TYPE_REQUEST) {
+        if (!md->obj_request)
+            return -EOPNOTSUPP;
+        md->obj_request(hdr + 1);
+    } else {
+        if (!md->obj_response)
+            return -EOPNOTSUPP;
+        ret = md->obj_response(hdr, hdr + 1, cb, cb_arg);
+        if (ret < 0)
+            return ret;
+    }
 
-    return ret;
+    return DIET_ALIGN(hdr->m_len);
 }
 
+/*
+ * objects are decoded one after the other till the end of the buffer.
+ * the objects of a request go on only in a batch, as with sandesh
+ */
 static int
 diet_decode(char *buf, unsigned int len,
         int (*cb)(void *, unsigned int, void *), void *cb_arg)
 {
-    int ret, processed;
+    int ret;
+    unsigned int processed;
     struct diet_message *hdr;
 
-    while (len) {
+    while (len >= sizeof(*hdr)) {
         hdr = (struct diet_message *)buf;
-        ret = diet_object_decode(hdr, cb, cb_arg);
-        if (ret <= 0)
+        ret = diet_object_decode(hdr, len, cb, cb_arg);
+        if (ret < 0)
             return ret;
+
         processed = sizeof(*hdr) + ret;
+        if (processed > len)
+            processed = len;
         len -= processed;
         buf += processed;
+
+        if (hdr->m_type == VR_MESSAGE_TYPE_REQUEST &&
+                !vr_message_batch_next())
+            break;
     }
 
     return 0;
@@ -295,7 +355,7 @@ diet_object_buf_len(unsigned int obj_type, void *object)
 
     len = sizeof(struct diet_message);
     if (obj_type == VR_RESPONSE_OBJECT_ID || object)
-        len += diet_md[obj_type].obj_len;
+        len += DIET_ALIGN(diet_md[obj_type].obj_len);
     return len;
 }
 
@@ -79,6 +79,28 @@ vr_send(unsigned int obj_type, void *object, unsigned int len)
     return request_i->req_ret;
 }
 
+/*
+ * 'count' objects of a type in one request. the result is the number of
+ * objects that were processed, or the error of the first that failed
+ */
+int
+vr_send_batch(unsigned int obj_type, void **objects, unsigned int count)
+{
+    int ret;
+    struct request *request_i = &requests[0];
+
+    bzero(request_i, sizeof(*request_i));
+    request_i->req_obj_type = obj_type;
+    vr_queue_init(&request_i->req_responses);
+
+    ret = vr_message_make_request_batch(obj_type, objects, count);
+    if (ret < 0)
+        return ret;
+    vr_message_process_response(&vr_process_response, request_i);
+
+    return request_i->req_ret;
+}
+
 void *
 vr_recv(void)
 {
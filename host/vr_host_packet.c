@@ -3,11 +3,19 @@
  *
  * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
  */
+#include <sys/mman.h>
+
 #include "vr_os.h"
 #include "vr_proto.h"
 #include "vrouter.h"
+#include "host/vr_host.h"
 #include "host/vr_host_packet.h"
 
+#define VR_HPACKET_HUGE_PAGE_SIZE   (2 * 1024 * 1024)
+#define VR_HPACKET_ALIGN(len)       (((len) + 63) & ~63)
+
+extern unsigned int vr_num_cpus;
+
 int
 vr_hpacket_copy(unsigned char *dst, struct vr_hpacket *hpkt_src,
         unsigned int offset, unsigned int len)
@@ -43,35 +51,42 @@ vr_hpacket_copy(unsigned char *dst, struct vr_hpacket *hpkt_src,
 }
 
 
+static void
+vr_hpacket_put(struct vr_hpacket *hpkt)
+{
+    if (hpkt->hp_pool) {
+        vr_hpacket_pool_free(hpkt);
+    } else {
+        free(hpkt->hp_head);
+        free(hpkt);
+    }
+
+    return;
+}
+
+/*
+ * the buffer goes back with the packet it came with, when its last user
+ * lets go of it. till then, that packet is held with the buffer
+ */
 void
 vr_hpacket_free(struct vr_hpacket *hpkt)
 {
     struct vr_hpacket_tail *hpkt_tail;
-    struct vr_hpacket *hpkt_next;
+    struct vr_hpacket *hpkt_next, *hpkt_owner;
 
     while (hpkt) {
         hpkt_next = hpkt->hp_next;
         hpkt_tail = (struct vr_hpacket_tail *)hpkt_end(hpkt);
-        hpkt_tail->hp_users--;
+        hpkt_owner = hpkt_tail->hp_owner;
         if (hpkt->hp_flags & VR_HPACKET_FLAGS_CLONED) {
-            if (!hpkt_tail->hp_users)
-                free(hpkt->hp_head);
             free(hpkt);
+            if (!--hpkt_tail->hp_users)
+                vr_hpacket_put(hpkt_owner);
             return;
         }
 
-        if (hpkt->hp_pool) {
-            if (hpkt_tail->hp_users) {
-                hpkt->hp_head = malloc(hpkt->hp_end +
-                        sizeof(struct vr_hpacket_tail));
-                hpkt_tail = (struct vr_hpacket_tail *)hpkt_end(hpkt);
-                hpkt_tail->hp_users = 1;
-            }
-            vr_hpacket_pool_free(hpkt);
-        } else {
-            free(hpkt->hp_head);
-            free(hpkt);
-        }
+        if (!--hpkt_tail->hp_users)
+            vr_hpacket_put(hpkt_owner);
 
         hpkt = hpkt_next;
     }
@@ -79,34 +94,74 @@ vr_hpacket_free(struct vr_hpacket *hpkt)
     return;
 }
 
+static void
+vr_hpacket_reset(struct vr_hpacket *hpkt)
+{
+    struct vr_hpacket_tail *hpkt_tail;
+    struct vr_packet *pkt;
+
+    hpkt->hp_next = NULL;
+    hpkt->hp_tail = hpkt->hp_data;
+    hpkt->hp_len = 0;
+    hpkt->hp_flags = 0;
+    hpkt_tail = (struct vr_hpacket_tail *)hpkt_end(hpkt);
+    hpkt_tail->hp_users = 1;
+
+    pkt = &hpkt->hp_packet;
+    pkt->vp_head = hpkt->hp_head;
+    pkt->vp_data = hpkt->hp_data;
+    pkt->vp_tail = hpkt->hp_tail;
+    pkt->vp_end = hpkt->hp_end;
+    pkt->vp_len = 0;
+    pkt->vp_if = NULL;
+
+    return;
+}
+
+static void
+vr_hpacket_init(struct vr_hpacket *hpkt, unsigned char *head,
+        unsigned int size, struct vr_hpacket_pool *pool)
+{
+    struct vr_hpacket_tail *hpkt_tail;
+
+    memset(hpkt, 0, sizeof(*hpkt));
+    hpkt->hp_head = head;
+    hpkt->hp_data = VR_HPACKET_HEAD_SPACE;
+    hpkt->hp_end = VR_HPACKET_HEAD_SPACE + size;
+    hpkt->hp_pool = pool;
+    hpkt_tail = (struct vr_hpacket_tail *)hpkt_end(hpkt);
+    hpkt_tail->hp_owner = hpkt;
+    vr_hpacket_reset(hpkt);
+
+    return;
+}
+
+static struct vr_hpacket_pool *vr_hpacket_lib_pool;
+
 struct vr_hpacket *
 vr_hpacket_alloc(unsigned int size)
 {
     struct vr_hpacket *hpkt;
-    struct vr_hpacket_tail *hpkt_tail;
-    struct vr_packet *pkt;
+    unsigned char *head;
+
+    if (vr_hpacket_lib_pool && size <= vr_hpacket_lib_pool->pool_psize) {
+        hpkt = vr_hpacket_pool_alloc(vr_hpacket_lib_pool);
+        if (hpkt)
+            return hpkt;
+    }
 
     hpkt = (struct vr_hpacket *)malloc(sizeof(*hpkt));
     if (!hpkt)
         return NULL;
 
-    hpkt->hp_head = malloc(size + VR_HPACKET_HEAD_SPACE +
+    head = malloc(size + VR_HPACKET_HEAD_SPACE +
             sizeof(struct vr_hpacket_tail));
-    if (!hpkt->hp_head) {
+    if (!head) {
         free(hpkt);
         return NULL;
     }
 
-    hpkt->hp_data = hpkt->hp_tail = VR_HPACKET_HEAD_SPACE;
-    hpkt->hp_end = size - 1;
-    hpkt_tail = (struct vr_hpacket_tail *)hpkt_end(hpkt);
-    hpkt_tail->hp_users = 1;
-    pkt = &hpkt->hp_packet;
-    pkt->vp_head = hpkt->hp_head;
-    pkt->vp_data = hpkt->hp_data;
-    pkt->vp_end = hpkt->hp_end;
-    pkt->vp_len = 0;
-    pkt->vp_if = NULL;
+    vr_hpacket_init(hpkt, head, size, NULL);
 
     return hpkt;
 }
@@ -131,57 +186,164 @@ vr_hpacket_clone(struct vr_hpacket *hpkt)
     return hpkt_c;
 }
 
+static inline struct vr_hpacket_cache *
+vr_hpacket_pool_cache(struct vr_hpacket_pool *pool)
+{
+    unsigned int cpu = vr_host_io_cpu();
+
+    if (cpu >= pool->pool_num_caches)
+        return NULL;
+
+    return &pool->pool_caches[cpu];
+}
+
+static unsigned int
+__vr_hpacket_pool_get(struct vr_hpacket_pool *pool, struct vr_hpacket **hpkts,
+        unsigned int num)
+{
+    unsigned int i;
+
+    pthread_spin_lock(&pool->pool_lock);
+    for (i = 0; i < num && pool->pool_head; i++) {
+        hpkts[i] = pool->pool_head;
+        pool->pool_head = hpkts[i]->hp_next;
+    }
+    pthread_spin_unlock(&pool->pool_lock);
+
+    return i;
+}
+
+static void
+__vr_hpacket_pool_put(struct vr_hpacket_pool *pool, struct vr_hpacket **hpkts,
+        unsigned int num)
+{
+    unsigned int i;
+
+    if (!num)
+        return;
+
+    for (i = 0; i < num - 1; i++)
+        hpkts[i]->hp_next = hpkts[i + 1];
+
+    pthread_spin_lock(&pool->pool_lock);
+    hpkts[num - 1]->hp_next = pool->pool_head;
+    pool->pool_head = hpkts[0];
+    pthread_spin_unlock(&pool->pool_lock);
+
+    return;
+}
+
+unsigned int
+vr_hpacket_pool_get_bulk(struct vr_hpacket_pool *pool,
+        struct vr_hpacket **hpkts, unsigned int num)
+{
+    unsigned int i, got = 0;
+    struct vr_hpacket_cache *cache = vr_hpacket_pool_cache(pool);
+
+    if (!cache) {
+        got = __vr_hpacket_pool_get(pool, hpkts, num);
+    } else {
+        while (got < num) {
+            if (!cache->hpc_count) {
+                cache->hpc_count = __vr_hpacket_pool_get(pool,
+                        cache->hpc_hpkts, VR_HPACKET_CACHE_BULK);
+                if (!cache->hpc_count)
+                    break;
+            }
+            hpkts[got++] = cache->hpc_hpkts[--cache->hpc_count];
+        }
+    }
+
+    for (i = 0; i < got; i++)
+        vr_hpacket_reset(hpkts[i]);
+
+    return got;
+}
+
+/* all the packets have to be of the same pool */
+void
+vr_hpacket_pool_put_bulk(struct vr_hpacket_pool *pool,
+        struct vr_hpacket **hpkts, unsigned int num)
+{
+    unsigned int i;
+    struct vr_hpacket_cache *cache = vr_hpacket_pool_cache(pool);
+
+    if (!cache) {
+        __vr_hpacket_pool_put(pool, hpkts, num);
+        return;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (cache->hpc_count == VR_HPACKET_CACHE_SIZE) {
+            cache->hpc_count -= VR_HPACKET_CACHE_BULK;
+            __vr_hpacket_pool_put(pool, cache->hpc_hpkts + cache->hpc_count,
+                    VR_HPACKET_CACHE_BULK);
+        }
+        cache->hpc_hpkts[cache->hpc_count++] = hpkts[i];
+    }
+
+    return;
+}
+
 struct vr_hpacket *
 vr_hpacket_pool_alloc(struct vr_hpacket_pool *pool)
 {
     struct vr_hpacket *hpkt;
-    struct vr_packet *pkt;
 
-    hpkt = pool->pool_head;
-    pool->pool_head = hpkt->hp_next;
-    hpkt->hp_next = NULL;
-    pkt = &hpkt->hp_packet;
-    pkt->vp_data = hpkt->hp_data;
+    if (!vr_hpacket_pool_get_bulk(pool, &hpkt, 1))
+        return NULL;
+
     return hpkt;
 }
 
 void
 vr_hpacket_pool_free(struct vr_hpacket *hpkt)
 {
-    struct vr_hpacket_pool *pool = hpkt->hp_pool;
-    struct vr_packet *pkt;
-
-    hpkt->hp_next = pool->pool_head;
-    pool->pool_head = hpkt;
-    pkt = &hpkt->hp_packet;
-    pkt->vp_data = hpkt->hp_data;
-    pkt->vp_len = 0;
-    pkt->vp_if = NULL;
-
+    vr_hpacket_pool_put_bulk(hpkt->hp_pool, &hpkt, 1);
     return;
 }
 
 void
 vr_hpacket_pool_destroy(struct vr_hpacket_pool *pool)
 {
-    struct vr_hpacket *hpkt, *n_hpkt;
-
-    hpkt = pool->pool_head;
-    while (hpkt) {
-        n_hpkt = hpkt->hp_next;
-        hpkt->hp_next = NULL;
-        hpkt->hp_pool = NULL;
-        vr_hpacket_free(hpkt);
-        hpkt = n_hpkt;
-    }
+    if (pool->pool_mem)
+        munmap(pool->pool_mem, pool->pool_mem_len);
+    if (pool->pool_caches)
+        free(pool->pool_caches);
+    pthread_spin_destroy(&pool->pool_lock);
+    vr_free(pool);
 
     return;
 }
 
+/*
+ * all the headers and buffers of a pool are in one mapping, of huge pages
+ * when the system has them to give
+ */
+static void *
+vr_hpacket_pool_map(size_t *len)
+{
+    void *mem;
+    size_t map_len = (*len + VR_HPACKET_HUGE_PAGE_SIZE - 1) &
+        ~((size_t)VR_HPACKET_HUGE_PAGE_SIZE - 1);
+
+    mem = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED)
+        mem = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    *len = map_len;
+    return mem;
+}
+
 struct vr_hpacket_pool *
 vr_hpacket_pool_create(unsigned int pool_size, unsigned int psize)
 {
-    unsigned int i;
+    unsigned int i, hdr_size, buf_size;
+    unsigned char *bufs;
     struct vr_hpacket_pool *pool;
     struct vr_hpacket *hpkt;
 
@@ -190,28 +352,66 @@ vr_hpacket_pool_create(unsigned int pool_size, unsigned int psize)
 
     pool = vr_zalloc(sizeof(*pool));
     if (!pool)
+        return NULL;
+    pthread_spin_init(&pool->pool_lock, PTHREAD_PROCESS_PRIVATE);
+    pool->pool_size = pool_size;
+    pool->pool_psize = psize;
+
+    pool->pool_num_caches = vr_num_cpus;
+    if (posix_memalign((void **)&pool->pool_caches,
+                __alignof__(struct vr_hpacket_cache),
+                vr_num_cpus * sizeof(struct vr_hpacket_cache))) {
+        pool->pool_caches = NULL;
+        goto cleanup;
+    }
+    memset(pool->pool_caches, 0,
+            vr_num_cpus * sizeof(struct vr_hpacket_cache));
+
+    hdr_size = VR_HPACKET_ALIGN(sizeof(struct vr_hpacket));
+    buf_size = VR_HPACKET_ALIGN(VR_HPACKET_HEAD_SPACE + psize +
+            sizeof(struct vr_hpacket_tail));
+    pool->pool_mem_len = (size_t)pool_size * (hdr_size + buf_size);
+    pool->pool_mem = vr_hpacket_pool_map(&pool->pool_mem_len);
+    if (!pool->pool_mem)
         goto cleanup;
 
+    bufs = (unsigned char *)pool->pool_mem + (size_t)pool_size * hdr_size;
     for (i = 0; i < pool_size; i++) {
-        hpkt = vr_hpacket_alloc(psize);
-        if (!hpkt)
-            goto cleanup;
-
-        if (!pool->pool_head)
-            pool->pool_head = hpkt;
-        else {
-            hpkt->hp_next = pool->pool_head->hp_next;
-            pool->pool_head->hp_next = hpkt;
-        }
-        hpkt->hp_pool = pool;
+        hpkt = (struct vr_hpacket *)((unsigned char *)pool->pool_mem +
+                (size_t)i * hdr_size);
+        vr_hpacket_init(hpkt, bufs + (size_t)i * buf_size, psize, pool);
+        hpkt->hp_next = pool->pool_head;
+        pool->pool_head = hpkt;
     }
 
     return pool;
 
 cleanup:
-    if (pool)
-        vr_hpacket_pool_destroy(pool);
-
+    vr_hpacket_pool_destroy(pool);
     return NULL;
 }
 
+void
+vr_hpacket_lib_exit(void)
+{
+    if (vr_hpacket_lib_pool) {
+        vr_hpacket_pool_destroy(vr_hpacket_lib_pool);
+        vr_hpacket_lib_pool = NULL;
+    }
+
+    return;
+}
+
+int
+vr_hpacket_lib_init(void)
+{
+    if (vr_hpacket_lib_pool)
+        return 0;
+
+    vr_hpacket_lib_pool = vr_hpacket_pool_create(VR_HPACKET_LIB_POOL_SIZE,
+            VR_HPACKET_LIB_PSIZE);
+    if (!vr_hpacket_lib_pool)
+        return -ENOMEM;
+
+    return 0;
+}
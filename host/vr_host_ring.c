@@ -0,0 +1,282 @@
+/*
+ * vr_host_ring.c -- host interfaces that poll the packet rings of a device
+ *                   that the kernel maps to user space, in place of going
+ *                   through the socket layer for every packet
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <pthread.h>
+
+#include "vr_os.h"
+#include "vrouter.h"
+#include "host/vr_host.h"
+#include "host/vr_host_packet.h"
+#include "host/vr_host_interface.h"
+
+#define HIF_RING_FRAME_SIZE     2048
+#define HIF_RING_BLOCK_SIZE     (1 << 16)
+#define HIF_RING_FRAMES         4096
+
+/* where the packet goes in a tx frame */
+#define HIF_RING_TX_DATA        (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+struct hif_ring {
+    int hr_fd;
+    unsigned char *hr_map;
+    size_t hr_map_len;
+    unsigned char *hr_rx_ring;
+    unsigned char *hr_tx_ring;
+    unsigned int hr_rx_next;
+    unsigned int hr_tx_next;
+    /* the rx ring is only polled by one thread. tx is from any of them */
+    pthread_spinlock_t hr_tx_lock;
+};
+
+static inline struct tpacket2_hdr *
+hif_ring_frame(unsigned char *ring, unsigned int index)
+{
+    return (struct tpacket2_hdr *)(ring + index * HIF_RING_FRAME_SIZE);
+}
+
+static int
+hif_ring_rx(void *arg)
+{
+    unsigned int num_pkts = 0, len;
+    struct vr_hinterface *hif = (struct vr_hinterface *)arg;
+    struct hif_ring *hr = (struct hif_ring *)hif->hif_priv;
+    struct tpacket2_hdr *hdr;
+    struct vr_hpacket *hpkt;
+    struct vr_packet *pkt, *pkts[HIF_RX_BURST];
+
+    while (num_pkts < HIF_RX_BURST) {
+        hdr = hif_ring_frame(hr->hr_rx_ring, hr->hr_rx_next);
+        if (!(hdr->tp_status & TP_STATUS_USER))
+            break;
+
+        /* the frame stays in the ring till there are packets again */
+        hpkt = vr_hpacket_pool_alloc(hif->hif_pkt_pool);
+        if (!hpkt)
+            break;
+
+        __sync_synchronize();
+        len = hdr->tp_snaplen;
+        if (len > (unsigned int)(hpkt->hp_end - hpkt->hp_data)) {
+            vr_hpacket_pool_free(hpkt);
+        } else {
+            memcpy(hpkt_data(hpkt), (unsigned char *)hdr + hdr->tp_mac, len);
+            hpkt->hp_tail = hpkt->hp_data + len;
+            pkt = &hpkt->hp_packet;
+            pkt->vp_len = len;
+            pkt->vp_tail = hpkt->hp_tail;
+            pkt->vp_if = hif->hif_vif;
+            pkt->vp_cpu = vr_get_cpu();
+            pkts[num_pkts++] = pkt;
+        }
+
+        __sync_synchronize();
+        hdr->tp_status = TP_STATUS_KERNEL;
+        hr->hr_rx_next = (hr->hr_rx_next + 1) % HIF_RING_FRAMES;
+    }
+
+    if (num_pkts)
+        vr_hif_rx_burst(hif, pkts, num_pkts);
+
+    return num_pkts;
+}
+
+/* with the tx lock held */
+static bool
+hif_ring_tx_frame(struct hif_ring *hr, struct vr_hpacket *hpkt)
+{
+    unsigned int len = 0, head_len;
+    unsigned char *data;
+    struct tpacket2_hdr *hdr;
+    struct vr_hpacket *hpkt_tmp;
+
+    hdr = hif_ring_frame(hr->hr_tx_ring, hr->hr_tx_next);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE)
+        return false;
+
+    data = (unsigned char *)hdr + HIF_RING_TX_DATA;
+    for (hpkt_tmp = hpkt; hpkt_tmp; hpkt_tmp = hpkt_tmp->hp_next) {
+        head_len = pkt_head_len(&hpkt_tmp->hp_packet);
+        if (len + head_len > HIF_RING_FRAME_SIZE - HIF_RING_TX_DATA)
+            return false;
+
+        memcpy(data + len, pkt_data(&hpkt_tmp->hp_packet), head_len);
+        len += head_len;
+    }
+
+    hdr->tp_len = len;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    hr->hr_tx_next = (hr->hr_tx_next + 1) % HIF_RING_FRAMES;
+
+    return true;
+}
+
+/* packets that find the ring full are dropped, as a nic would */
+static unsigned int
+hif_ring_tx_burst(struct vr_hinterface *hif, struct vr_hpacket **hpkts,
+        unsigned int num)
+{
+    unsigned int i;
+    bool queued = false;
+    struct hif_ring *hr = (struct hif_ring *)hif->hif_priv;
+
+    pthread_spin_lock(&hr->hr_tx_lock);
+    for (i = 0; i < num; i++) {
+        if (hif_ring_tx_frame(hr, hpkts[i]))
+            queued = true;
+    }
+    pthread_spin_unlock(&hr->hr_tx_lock);
+
+    /* one kick for the burst */
+    if (queued)
+        send(hr->hr_fd, NULL, 0, MSG_DONTWAIT);
+
+    for (i = 0; i < num; i++)
+        vr_hpacket_free(hpkts[i]);
+
+    return 0;
+}
+
+static unsigned int
+hif_ring_tx(struct vr_hinterface *hif, struct vr_hpacket *hpkt)
+{
+    return hif_ring_tx_burst(hif, &hpkt, 1);
+}
+
+static void
+hif_ring_free(struct hif_ring *hr)
+{
+    if (hr->hr_map)
+        munmap(hr->hr_map, hr->hr_map_len);
+    if (hr->hr_fd >= 0)
+        close(hr->hr_fd);
+    pthread_spin_destroy(&hr->hr_tx_lock);
+    free(hr);
+
+    return;
+}
+
+int
+vr_hif_ring_create(struct vr_hinterface *hif, unsigned int vif_type,
+        const char *name)
+{
+    int ret, opt;
+    unsigned int ifindex;
+    struct hif_ring *hr;
+    struct tpacket_req req;
+    struct sockaddr_ll sll;
+
+    if (vif_type >= VIF_TYPE_MAX)
+        return -EINVAL;
+
+    ifindex = if_nametoindex(name);
+    if (!ifindex)
+        return -ENODEV;
+
+    hr = calloc(1, sizeof(*hr));
+    if (!hr)
+        return -ENOMEM;
+    pthread_spin_init(&hr->hr_tx_lock, PTHREAD_PROCESS_PRIVATE);
+
+    hr->hr_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (hr->hr_fd < 0) {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    opt = TPACKET_V2;
+    if (setsockopt(hr->hr_fd, SOL_PACKET, PACKET_VERSION, &opt,
+                sizeof(opt)) < 0) {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    /* not all kernels have it, and it is only a shortcut */
+    opt = 1;
+    setsockopt(hr->hr_fd, SOL_PACKET, PACKET_QDISC_BYPASS, &opt, sizeof(opt));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = HIF_RING_BLOCK_SIZE;
+    req.tp_frame_size = HIF_RING_FRAME_SIZE;
+    req.tp_frame_nr = HIF_RING_FRAMES;
+    req.tp_block_nr = (HIF_RING_FRAMES * HIF_RING_FRAME_SIZE) /
+        HIF_RING_BLOCK_SIZE;
+    if (setsockopt(hr->hr_fd, SOL_PACKET, PACKET_RX_RING, &req,
+                sizeof(req)) < 0 ||
+            setsockopt(hr->hr_fd, SOL_PACKET, PACKET_TX_RING, &req,
+                sizeof(req)) < 0) {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    /* the rx ring, and then the tx ring */
+    hr->hr_map_len = 2 * (size_t)req.tp_block_nr * req.tp_block_size;
+    hr->hr_map = mmap(NULL, hr->hr_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, hr->hr_fd, 0);
+    if (hr->hr_map == MAP_FAILED) {
+        hr->hr_map = NULL;
+        ret = -errno;
+        goto cleanup;
+    }
+    hr->hr_rx_ring = hr->hr_map;
+    hr->hr_tx_ring = hr->hr_map + hr->hr_map_len / 2;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(hr->hr_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    hif->hif_vif_type = vif_type;
+    hif->hif_fd = hr->hr_fd;
+    hif->hif_priv = hr;
+    hif->hif_tx = hif_ring_tx;
+    hif->hif_tx_burst = hif_ring_tx_burst;
+    hif->hif_rx = hif_ring_rx;
+    hif->hif_pkt_pool = vr_hpacket_pool_create(HIF_PKT_POOL_SIZE,
+            HIF_PKT_SIZE);
+    if (!hif->hif_pkt_pool) {
+        ret = -ENOMEM;
+        goto cleanup;
+    }
+
+    ret = vr_host_io_poll_register(hif_ring_rx, hif, -1);
+    if (ret < 0)
+        goto cleanup;
+
+    return 0;
+
+cleanup:
+    if (hif->hif_pkt_pool) {
+        vr_hpacket_pool_destroy(hif->hif_pkt_pool);
+        hif->hif_pkt_pool = NULL;
+    }
+    hif->hif_priv = NULL;
+    hif_ring_free(hr);
+
+    return ret;
+}
+
+void
+vr_hif_ring_destroy(struct vr_hinterface *hif)
+{
+    vr_host_io_poll_unregister(hif_ring_rx, hif);
+    hif_ring_free((struct hif_ring *)hif->hif_priv);
+    free(hif);
+
+    return;
+}
@@ -0,0 +1,574 @@
+/*
+ * vr_host_timer.c -- timers and deferred work, when dp-core runs as a
+ *                    library. timers are kept in a hierarchical wheel that
+ *                    a timerfd on the first io thread turns, and work is
+ *                    queued per io thread. there is a bound on what is run
+ *                    in one turn of a thread, so that packets do not wait
+ *                    behind it
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "vr_os.h"
+#include "vrouter.h"
+#include "host/vr_host.h"
+
+#define VR_HTIMER_TICK_MSECS    10
+#define VR_HTIMER_LEVEL_BITS    6
+#define VR_HTIMER_SLOTS         (1 << VR_HTIMER_LEVEL_BITS)
+#define VR_HTIMER_SLOT_MASK     (VR_HTIMER_SLOTS - 1)
+#define VR_HTIMER_LEVELS        4
+#define VR_HTIMER_MAX_TICKS     \
+    ((1ULL << (VR_HTIMER_LEVELS * VR_HTIMER_LEVEL_BITS)) - 1)
+
+/* timers, defers and work items that are run in one turn */
+#define VR_HTIMER_RUN_MAX       32
+#define VR_HDEFER_RUN_MAX       32
+#define VR_HWORK_RUN_MAX        32
+
+struct vr_htimer {
+    struct vr_htimer *ht_next;
+    struct vr_htimer **ht_pprev;
+    uint64_t ht_expires;
+    /* deleted while it ran, and by the callback itself */
+    bool ht_orphan;
+    struct vr_timer *ht_vtimer;
+};
+
+struct vr_hwork {
+    struct vr_hwork *hw_next;
+    void (*hw_fn)(void *);
+    void *hw_arg;
+};
+
+struct vr_hwork_queue {
+    int hwq_fd;
+    pthread_mutex_t hwq_lock;
+    struct vr_hwork *hwq_head;
+    struct vr_hwork **hwq_tail;
+};
+
+/*
+ * a defer is run once every io thread has let go of what it looked at. the
+ * turns of the threads are kept after the user data, in the same allocation
+ */
+struct vr_hdefer {
+    struct vr_hdefer *hd_next;
+    vr_defer_cb hd_cb;
+    struct vrouter *hd_router;
+    uint64_t *hd_turns;
+    /* the user data, as vr_get_defer_data gave it out */
+    char hd_data[0];
+};
+
+static pthread_mutex_t vr_htimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vr_htimer_cond = PTHREAD_COND_INITIALIZER;
+static struct vr_htimer *vr_htimer_wheel[VR_HTIMER_LEVELS][VR_HTIMER_SLOTS];
+/* timers whose time has come, and that wait for a turn to be run */
+static struct vr_htimer *vr_htimer_expired;
+static struct vr_htimer *vr_htimer_running;
+static pthread_t vr_htimer_thread;
+/* in ticks, since vr_htimer_base */
+static uint64_t vr_htimer_now;
+static uint64_t vr_htimer_base;
+static int vr_htimer_fd = -1;
+
+static struct vr_hdefer *vr_hdefer_head;
+static struct vr_hdefer **vr_hdefer_tail = &vr_hdefer_head;
+
+static struct vr_hwork_queue *vr_hwork_queues;
+static unsigned int vr_hwork_num_queues;
+
+static uint64_t
+vr_htimer_msecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t
+vr_htimer_ticks(unsigned int msecs)
+{
+    uint64_t ticks = (msecs + VR_HTIMER_TICK_MSECS - 1) / VR_HTIMER_TICK_MSECS;
+
+    return ticks ? ticks : 1;
+}
+
+static void
+vr_htimer_link(struct vr_htimer **head, struct vr_htimer *ht)
+{
+    ht->ht_next = *head;
+    if (*head)
+        (*head)->ht_pprev = &ht->ht_next;
+    *head = ht;
+    ht->ht_pprev = head;
+
+    return;
+}
+
+static void
+vr_htimer_unlink(struct vr_htimer *ht)
+{
+    if (!ht->ht_pprev)
+        return;
+
+    *ht->ht_pprev = ht->ht_next;
+    if (ht->ht_next)
+        ht->ht_next->ht_pprev = ht->ht_pprev;
+    ht->ht_next = NULL;
+    ht->ht_pprev = NULL;
+
+    return;
+}
+
+/* with the timer lock held, as all that touches the wheel */
+static void
+vr_htimer_queue(struct vr_htimer *ht)
+{
+    unsigned int level, slot;
+    uint64_t delta;
+
+    if (ht->ht_expires <= vr_htimer_now)
+        ht->ht_expires = vr_htimer_now + 1;
+
+    delta = ht->ht_expires - vr_htimer_now;
+    if (delta > VR_HTIMER_MAX_TICKS) {
+        delta = VR_HTIMER_MAX_TICKS;
+        ht->ht_expires = vr_htimer_now + delta;
+    }
+
+    for (level = 0; level < VR_HTIMER_LEVELS - 1; level++) {
+        if (delta < (1ULL << ((level + 1) * VR_HTIMER_LEVEL_BITS)))
+            break;
+    }
+
+    slot = (ht->ht_expires >> (level * VR_HTIMER_LEVEL_BITS)) &
+        VR_HTIMER_SLOT_MASK;
+    vr_htimer_link(&vr_htimer_wheel[level][slot], ht);
+
+    return;
+}
+
+/*
+ * moves the wheel by a tick. a level is cascaded into the lower ones when
+ * the levels below it wrap around
+ */
+static void
+vr_htimer_tick(void)
+{
+    unsigned int level, slot;
+    struct vr_htimer *ht;
+
+    vr_htimer_now++;
+    for (level = 1; level < VR_HTIMER_LEVELS; level++) {
+        if ((vr_htimer_now >> ((level - 1) * VR_HTIMER_LEVEL_BITS)) &
+                VR_HTIMER_SLOT_MASK)
+            break;
+
+        slot = (vr_htimer_now >> (level * VR_HTIMER_LEVEL_BITS)) &
+            VR_HTIMER_SLOT_MASK;
+        while ((ht = vr_htimer_wheel[level][slot])) {
+            vr_htimer_unlink(ht);
+            vr_htimer_queue(ht);
+        }
+    }
+
+    slot = vr_htimer_now & VR_HTIMER_SLOT_MASK;
+    while ((ht = vr_htimer_wheel[0][slot])) {
+        vr_htimer_unlink(ht);
+        vr_htimer_link(&vr_htimer_expired, ht);
+    }
+
+    return;
+}
+
+static void
+vr_hdefer_free(struct vr_hdefer *hd)
+{
+    free(hd);
+    return;
+}
+
+/* with the timer lock held. returns the defers that can be run */
+static struct vr_hdefer *
+vr_hdefer_ready(void)
+{
+    unsigned int num = 0;
+    struct vr_hdefer *hd, *ready = NULL, **ready_tail = &ready;
+
+    while ((hd = vr_hdefer_head) && num < VR_HDEFER_RUN_MAX) {
+        if (!vr_host_io_quiesced(hd->hd_turns))
+            break;
+
+        vr_hdefer_head = hd->hd_next;
+        if (!vr_hdefer_head)
+            vr_hdefer_tail = &vr_hdefer_head;
+
+        hd->hd_next = NULL;
+        *ready_tail = hd;
+        ready_tail = &hd->hd_next;
+        num++;
+    }
+
+    return ready;
+}
+
+static int
+vr_htimer_run(void *arg)
+{
+    unsigned int run = 0;
+    uint64_t expirations, target;
+    struct vr_htimer *ht;
+    struct vr_timer *vtimer;
+    struct vr_hdefer *hd, *hd_next;
+
+    if (read(vr_htimer_fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN)
+        return -errno;
+
+    target = (vr_htimer_msecs() - vr_htimer_base) / VR_HTIMER_TICK_MSECS;
+
+    pthread_mutex_lock(&vr_htimer_lock);
+    vr_htimer_thread = pthread_self();
+    while (run < VR_HTIMER_RUN_MAX) {
+        if (!vr_htimer_expired) {
+            if (vr_htimer_now >= target)
+                break;
+            vr_htimer_tick();
+            continue;
+        }
+
+        ht = vr_htimer_expired;
+        vr_htimer_unlink(ht);
+        vr_htimer_running = ht;
+        vtimer = ht->ht_vtimer;
+        pthread_mutex_unlock(&vr_htimer_lock);
+
+        vtimer->vt_timer(vtimer->vt_vr_arg);
+
+        pthread_mutex_lock(&vr_htimer_lock);
+        vr_htimer_running = NULL;
+        if (ht->ht_orphan) {
+            free(ht);
+        } else if (ht->ht_vtimer) {
+            /* timers of dp-core are periodic */
+            ht->ht_expires = vr_htimer_now +
+                vr_htimer_ticks(ht->ht_vtimer->vt_msecs);
+            vr_htimer_queue(ht);
+        }
+        pthread_cond_broadcast(&vr_htimer_cond);
+        run++;
+    }
+
+    hd = vr_hdefer_ready();
+    pthread_mutex_unlock(&vr_htimer_lock);
+
+    for (; hd; hd = hd_next) {
+        hd_next = hd->hd_next;
+        hd->hd_cb(hd->hd_router, hd->hd_data);
+        vr_hdefer_free(hd);
+    }
+
+    return run;
+}
+
+int
+vr_host_timer_add(struct vr_timer *vtimer)
+{
+    struct vr_htimer *ht;
+
+    ht = calloc(1, sizeof(*ht));
+    if (!ht)
+        return -ENOMEM;
+
+    ht->ht_vtimer = vtimer;
+    vtimer->vt_os_arg = (void *)ht;
+
+    pthread_mutex_lock(&vr_htimer_lock);
+    ht->ht_expires = vr_htimer_now + vr_htimer_ticks(vtimer->vt_msecs);
+    vr_htimer_queue(ht);
+    pthread_mutex_unlock(&vr_htimer_lock);
+
+    return 0;
+}
+
+/*
+ * does not return till the callback is done, unless it is the callback
+ * that deletes the timer, in which case the timer is freed once it is
+ */
+void
+vr_host_timer_del(struct vr_timer *vtimer)
+{
+    struct vr_htimer *ht = (struct vr_htimer *)vtimer->vt_os_arg;
+
+    if (!ht)
+        return;
+
+    pthread_mutex_lock(&vr_htimer_lock);
+    vr_htimer_unlink(ht);
+    ht->ht_vtimer = NULL;
+    if (vr_htimer_running == ht &&
+            pthread_equal(vr_htimer_thread, pthread_self())) {
+        ht->ht_orphan = true;
+        ht = NULL;
+    } else {
+        while (vr_htimer_running == ht)
+            pthread_cond_wait(&vr_htimer_cond, &vr_htimer_lock);
+    }
+    pthread_mutex_unlock(&vr_htimer_lock);
+
+    if (ht)
+        free(ht);
+    vtimer->vt_os_arg = NULL;
+
+    return;
+}
+
+static int
+vr_hwork_run(void *arg)
+{
+    unsigned int run;
+    uint64_t count = 1;
+    bool pending;
+    struct vr_hwork_queue *hwq = (struct vr_hwork_queue *)arg;
+    struct vr_hwork *hw;
+
+    if (read(hwq->hwq_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -errno;
+
+    for (run = 0; run < VR_HWORK_RUN_MAX; run++) {
+        pthread_mutex_lock(&hwq->hwq_lock);
+        hw = hwq->hwq_head;
+        if (hw) {
+            hwq->hwq_head = hw->hw_next;
+            if (!hwq->hwq_head)
+                hwq->hwq_tail = &hwq->hwq_head;
+        }
+        pthread_mutex_unlock(&hwq->hwq_lock);
+        if (!hw)
+            break;
+
+        hw->hw_fn(hw->hw_arg);
+        free(hw);
+    }
+
+    /* the rest waits for the next turn */
+    pthread_mutex_lock(&hwq->hwq_lock);
+    pending = (hwq->hwq_head != NULL);
+    pthread_mutex_unlock(&hwq->hwq_lock);
+    if (pending) {
+        count = 1;
+        if (write(hwq->hwq_fd, &count, sizeof(count)) < 0)
+            return -errno;
+    }
+
+    return run;
+}
+
+/* without io threads to run it on, the work is done in the caller */
+void
+vr_host_work_schedule(unsigned int cpu, void (*fn)(void *), void *arg)
+{
+    uint64_t count = 1;
+    struct vr_hwork *hw;
+    struct vr_hwork_queue *hwq;
+
+    if (!vr_hwork_queues) {
+        fn(arg);
+        return;
+    }
+
+    hw = calloc(1, sizeof(*hw));
+    if (!hw)
+        return;
+    hw->hw_fn = fn;
+    hw->hw_arg = arg;
+
+    if (cpu >= vr_hwork_num_queues)
+        cpu = 0;
+    hwq = &vr_hwork_queues[cpu];
+
+    pthread_mutex_lock(&hwq->hwq_lock);
+    *hwq->hwq_tail = hw;
+    hwq->hwq_tail = &hw->hw_next;
+    pthread_mutex_unlock(&hwq->hwq_lock);
+
+    if (write(hwq->hwq_fd, &count, sizeof(count)) < 0)
+        return;
+
+    return;
+}
+
+void *
+vr_host_get_defer_data(unsigned int len)
+{
+    unsigned int data_len;
+    struct vr_hdefer *hd;
+
+    if (!len)
+        return NULL;
+
+    data_len = (len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    hd = calloc(1, sizeof(*hd) + data_len +
+            vr_host_io_num_threads() * sizeof(uint64_t));
+    if (!hd)
+        return NULL;
+    hd->hd_turns = (uint64_t *)(hd->hd_data + data_len);
+
+    return hd->hd_data;
+}
+
+void
+vr_host_put_defer_data(void *data)
+{
+    if (!data)
+        return;
+
+    vr_hdefer_free(CONTAINER_OF(hd_data, struct vr_hdefer, data));
+    return;
+}
+
+void
+vr_host_defer(struct vrouter *router, vr_defer_cb user_cb, void *data)
+{
+    unsigned int threads = vr_host_io_num_threads();
+    struct vr_hdefer *hd = CONTAINER_OF(hd_data, struct vr_hdefer, data);
+
+    hd->hd_cb = user_cb;
+    hd->hd_router = router;
+
+    /* nobody else can be looking */
+    if (vr_htimer_fd < 0 || !threads) {
+        user_cb(router, data);
+        vr_hdefer_free(hd);
+        return;
+    }
+
+    vr_host_io_snapshot(hd->hd_turns);
+
+    pthread_mutex_lock(&vr_htimer_lock);
+    *vr_hdefer_tail = hd;
+    vr_hdefer_tail = &hd->hd_next;
+    pthread_mutex_unlock(&vr_htimer_lock);
+
+    return;
+}
+
+void
+vr_host_timer_exit(void)
+{
+    unsigned int i;
+    struct vr_hwork *hw;
+
+    if (vr_htimer_fd >= 0) {
+        vr_host_io_unregister(vr_htimer_fd);
+        close(vr_htimer_fd);
+        vr_htimer_fd = -1;
+    }
+
+    if (vr_hwork_queues) {
+        for (i = 0; i < vr_hwork_num_queues; i++) {
+            if (vr_hwork_queues[i].hwq_fd >= 0) {
+                vr_host_io_unregister(vr_hwork_queues[i].hwq_fd);
+                close(vr_hwork_queues[i].hwq_fd);
+            }
+
+            while ((hw = vr_hwork_queues[i].hwq_head)) {
+                vr_hwork_queues[i].hwq_head = hw->hw_next;
+                free(hw);
+            }
+            pthread_mutex_destroy(&vr_hwork_queues[i].hwq_lock);
+        }
+
+        free(vr_hwork_queues);
+        vr_hwork_queues = NULL;
+        vr_hwork_num_queues = 0;
+    }
+
+    return;
+}
+
+/*
+ * needs the io threads, and hence vr_host_io_init, to have been done.
+ * without them, timers do not run and work is done in the caller, as it
+ * used to
+ */
+int
+vr_host_timer_init(void)
+{
+    int ret;
+    unsigned int i, threads = vr_host_io_num_threads();
+    struct itimerspec its;
+
+    if (!threads)
+        return 0;
+
+    vr_hwork_queues = calloc(threads, sizeof(*vr_hwork_queues));
+    if (!vr_hwork_queues)
+        return -ENOMEM;
+    vr_hwork_num_queues = threads;
+
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&vr_hwork_queues[i].hwq_lock, NULL);
+        vr_hwork_queues[i].hwq_tail = &vr_hwork_queues[i].hwq_head;
+        vr_hwork_queues[i].hwq_fd = eventfd(0, EFD_NONBLOCK);
+        if (vr_hwork_queues[i].hwq_fd < 0) {
+            ret = -errno;
+            goto cleanup;
+        }
+
+        ret = vr_host_io_register_on(vr_hwork_queues[i].hwq_fd, vr_hwork_run,
+                &vr_hwork_queues[i], i);
+        if (ret) {
+            close(vr_hwork_queues[i].hwq_fd);
+            vr_hwork_queues[i].hwq_fd = -1;
+            goto cleanup;
+        }
+    }
+
+    vr_htimer_base = vr_htimer_msecs();
+    vr_htimer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (vr_htimer_fd < 0) {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = VR_HTIMER_TICK_MSECS * 1000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(vr_htimer_fd, 0, &its, NULL) < 0) {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    ret = vr_host_io_register_on(vr_htimer_fd, vr_htimer_run, NULL, 0);
+    if (ret)
+        goto cleanup;
+
+    return 0;
+
+cleanup:
+    if (vr_htimer_fd >= 0) {
+        close(vr_htimer_fd);
+        vr_htimer_fd = -1;
+    }
+    /* the queues that did not get their eventfd */
+    for (; i < threads; i++)
+        vr_hwork_queues[i].hwq_fd = -1;
+    vr_host_timer_exit();
+
+    return ret;
+}
@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include "vr_message.h"
 #include "vr_sandesh.h"
+#include "host/vr_host.h"
 #include "host/vr_host_packet.h"
 #include "ulinux.h"
 
@@ -27,26 +28,14 @@ extern int vr_diet_message_proto_init(void);
 static int
 vr_lib_create_timer(struct vr_timer *vtimer)
 {
-    struct dummy_timer_list *timer;
-
-    timer = vr_zalloc(sizeof(*timer));
-    if (!timer)
-        return -1;
-    init_timer(timer);
-
-    vtimer->vt_os_arg = (void *)timer;
-    timer->data = (unsigned long)vtimer;
-    timer->function = ulinux_timer;
-    timer->expires = get_time() + vtimer->vt_msecs;
-    add_timer(timer);
-
-    return 0;
+    return vr_host_timer_add(vtimer);
 }
 
 static void
 vr_lib_delete_timer(struct vr_timer *vtimer)
 {
-	vr_free(vtimer->vt_os_arg);
+    vr_host_timer_del(vtimer);
+    return;
 }
 
 static void *
@@ -200,15 +189,73 @@ vr_lib_get_time(unsigned int *sec, unsigned int *nsec)
     return;
 }
 
+/*
+ * the time stamp counter where there is one. elsewhere, nanoseconds stand
+ * in for cycles
+ */
+static uint64_t
+vr_lib_get_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 static unsigned int
 vr_lib_get_cpu(void)
 {
-    return 0;
+    return vr_host_io_cpu();
+}
+
+static void
+vr_lib_get_mono_time(unsigned int *sec, unsigned int *nsec)
+{
+    struct timespec ts;
+
+    *sec = *nsec = 0;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return;
+
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+
+    return;
 }
 
 static void
 vr_lib_schedule_work(unsigned int cpu, void (*fn)(void *), void *arg)
 {
+    vr_host_work_schedule(cpu, fn, arg);
+    return;
+}
+
+static void
+vr_lib_defer(struct vrouter *router, vr_defer_cb user_cb, void *data)
+{
+    vr_host_defer(router, user_cb, data);
+    return;
+}
+
+static void *
+vr_lib_get_defer_data(unsigned int len)
+{
+    return vr_host_get_defer_data(len);
+}
+
+static void
+vr_lib_put_defer_data(void *data)
+{
+    vr_host_put_defer_data(data);
     return;
 }
 
@@ -234,7 +281,12 @@ struct host_os vr_lib_host = {
     .hos_get_cpu            =       vr_lib_get_cpu,
     .hos_schedule_work      =       vr_lib_schedule_work,
     .hos_delay_op           =       vr_lib_delay_op,
+    .hos_defer              =       vr_lib_defer,
+    .hos_get_defer_data     =       vr_lib_get_defer_data,
+    .hos_put_defer_data     =       vr_lib_put_defer_data,
     .hos_get_time           =       vr_lib_get_time,
+    .hos_get_mono_time      =       vr_lib_get_mono_time,
+    .hos_get_cycles         =       vr_lib_get_cycles,
 	.hos_page_alloc			=		vr_lib_page_alloc,
 	.hos_page_free			=		vr_lib_page_free,
 	.hos_create_timer		=		vr_lib_create_timer,
@@ -297,6 +349,8 @@ vrouter_host_exit(void)
 {
     vr_message_exit();
     vrouter_exit(false);
+    vr_hpacket_lib_exit();
+    vr_host_timer_exit();
 
     return;
 }
@@ -306,13 +360,35 @@ vrouter_host_init(unsigned int message_proto)
 {
     int ret;
 
+    struct timeval tv;
+
     if (vr_host_inited)
         return 0;
 
-    ret = vrouter_init();
+    /* the library has no need for a strong seed */
+    gettimeofday(&tv, NULL);
+    vr_hash_seed = tv.tv_sec ^ tv.tv_usec ^ ((unsigned int)getpid() << 16);
+#if defined(__x86_64__) || defined(__i386__)
+    if (vr_hash_engine == VR_HASH_ENGINE_CRC32 &&
+            !__builtin_cpu_supports("sse4.2"))
+        vr_hash_engine = VR_HASH_ENGINE_JENKINS;
+#endif
+
+    /* before vrouter_init, which starts timers and may schedule work */
+    ret = vr_host_timer_init();
     if (ret)
         return ret;
 
+    ret = vrouter_init();
+    if (ret) {
+        vr_host_timer_exit();
+        return ret;
+    }
+
+    ret = vr_hpacket_lib_init();
+    if (ret)
+        goto init_fail;
+
     ret = vr_message_init(message_proto);
     if (ret)
         goto init_fail;
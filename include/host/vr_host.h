@@ -6,12 +6,36 @@
 #ifndef __VR_HOST_H__
 #define __VR_HOST_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+struct vrouter;
+struct vr_timer;
+
 int vr_send(unsigned int, void *, unsigned int);
+int vr_send_batch(unsigned int, void **, unsigned int);
 void *vr_recv(void);
 void vr_free_req(void *);
 void vr_host_io_unregister(unsigned int);
-void vr_host_io_init(void);
+int vr_host_io_init(unsigned int);
 int vr_host_io_register(unsigned int, int (*)(void *), void *);
+int vr_host_io_register_on(unsigned int, int (*)(void *), void *, int);
+unsigned int vr_host_io_cpu(void);
+int vr_host_io_poll_register(int (*)(void *), void *, int);
+void vr_host_io_poll_unregister(int (*)(void *), void *);
+unsigned int vr_host_io_num_threads(void);
+void vr_host_io_snapshot(uint64_t *);
+bool vr_host_io_quiesced(const uint64_t *);
 int vr_host_io(void);
 
+int vr_host_timer_init(void);
+void vr_host_timer_exit(void);
+int vr_host_timer_add(struct vr_timer *);
+void vr_host_timer_del(struct vr_timer *);
+void vr_host_work_schedule(unsigned int, void (*)(void *), void *);
+void vr_host_defer(struct vrouter *,
+        void (*)(struct vrouter *, void *), void *);
+void *vr_host_get_defer_data(unsigned int);
+void vr_host_put_defer_data(void *);
+
 #endif /* __VR_HOST_H__ */
@@ -33,10 +33,22 @@
 #define HIF_DESTINATION_UDP_PORT_START      60000
 
 #define HIF_TYPE_UDP                        1
+#define HIF_TYPE_RING                       2
+/* a sink, for interfaces whose packets nobody reads */
+#define HIF_TYPE_NULL                       3
+
+/* packets taken in, and sent out, in one go */
+#define HIF_RX_BURST                        32
+#define HIF_TX_BURST                        32
+#define HIF_TX_IOV_MAX                      8
+
+#define HIF_PKT_POOL_SIZE                   1024
+#define HIF_PKT_SIZE                        2000
 
 struct vr_hpacket;
 struct vr_hpacket_pool;
 struct vr_interface;
+struct vr_packet;
 
 struct vr_hinterface {
     int hif_index;
@@ -47,16 +59,26 @@ struct vr_hinterface {
     struct vr_interface *hif_vif;
     struct vr_hpacket_pool *hif_pkt_pool;
     unsigned int (*hif_tx)(struct vr_hinterface *, struct vr_hpacket *);
+    unsigned int (*hif_tx_burst)(struct vr_hinterface *,
+            struct vr_hpacket **, unsigned int);
     int (*hif_rx)(void *);
+    /* state of the type of the interface */
+    void *hif_priv;
 };
 
 struct vr_hinterface *hif_table[HIF_MAX_INTERFACES];
 
 struct vr_hinterface *vr_hinterface_create(unsigned int, unsigned int,
                 unsigned int);
+struct vr_hinterface *vr_hinterface_create_ring(unsigned int, unsigned int,
+                const char *);
 struct vr_hinterface *vr_hinterface_get(unsigned int);
 void vr_hinterface_put(struct vr_hinterface *);
 void vr_hinterface_delete(struct vr_hinterface *);
+void vr_hif_rx_burst(struct vr_hinterface *, struct vr_packet **,
+                unsigned int);
+int vr_hif_ring_create(struct vr_hinterface *, unsigned int, const char *);
+void vr_hif_ring_destroy(struct vr_hinterface *);
 
 
 
@@ -6,14 +6,40 @@
 #ifndef __VR_HOST_PACKET_H__
 #define __VR_HOST_PACKET_H__
 
+#include <pthread.h>
+
 /*
  * invariably, VR will push headers and it makes sense to have
  * a reasonable header space
  */
 #define VR_HPACKET_HEAD_SPACE       64
 
+/*
+ * every io thread keeps a cache of packets of each pool, and goes to the
+ * shared list of the pool only VR_HPACKET_CACHE_BULK packets at a time
+ */
+#define VR_HPACKET_CACHE_SIZE       64
+#define VR_HPACKET_CACHE_BULK       32
+
+/* the packets that are not in a pool, and have to fit the library pool */
+#define VR_HPACKET_LIB_POOL_SIZE    1024
+#define VR_HPACKET_LIB_PSIZE        2048
+
+struct vr_hpacket_cache {
+    unsigned int hpc_count;
+    struct vr_hpacket *hpc_hpkts[VR_HPACKET_CACHE_SIZE];
+} __attribute__((aligned(64)));
+
 struct vr_hpacket_pool {
+    pthread_spinlock_t pool_lock;
     struct vr_hpacket *pool_head;
+    unsigned int pool_size;
+    unsigned int pool_psize;
+    unsigned int pool_num_caches;
+    struct vr_hpacket_cache *pool_caches;
+    /* headers and buffers of all the packets, in one mapping */
+    void *pool_mem;
+    size_t pool_mem_len;
 };
 
 #define VR_HPACKET_FLAGS_CLONED     0x1
@@ -80,6 +106,8 @@ hpkt_head_len(struct vr_hpacket *hpkt)
  */
 struct vr_hpacket_tail {
     unsigned int hp_users;
+    /* the packet that the buffer came with, freed with the last user */
+    struct vr_hpacket *hp_owner;
 } __attribute__((packed));
 
 int vr_hpacket_copy(unsigned char *, struct vr_hpacket *,
@@ -89,8 +117,14 @@ struct vr_hpacket *vr_hpacket_alloc(unsigned int);
 struct vr_hpacket *vr_hpacket_clone(struct vr_hpacket *);
 struct vr_hpacket *vr_hpacket_pool_alloc(struct vr_hpacket_pool *);
 void vr_hpacket_pool_free(struct vr_hpacket *);
+unsigned int vr_hpacket_pool_get_bulk(struct vr_hpacket_pool *,
+        struct vr_hpacket **, unsigned int);
+void vr_hpacket_pool_put_bulk(struct vr_hpacket_pool *,
+        struct vr_hpacket **, unsigned int);
 struct vr_hpacket_pool *vr_hpacket_pool_create(unsigned int, unsigned int);
 void vr_hpacket_pool_destroy(struct vr_hpacket_pool *);
+int vr_hpacket_lib_init(void);
+void vr_hpacket_lib_exit(void);
 
 
 #endif /* __VR_HOST_PACKET_H__ */
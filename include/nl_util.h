@@ -12,7 +12,8 @@ extern "C" {
 
 #include "vnsw_utils.h"
 #define NL_RESP_DEFAULT_SIZE        512
-#define NL_MSG_DEFAULT_SIZE         4096
+/* big enough for the largest response of a dump */
+#define NL_MSG_DEFAULT_SIZE         (64 * 1024)
 
 #define NL_MSG_TYPE_ERROR           0
 #define NL_MSG_TYPE_DONE            1
@@ -84,6 +85,8 @@ extern void nl_update_nlh(struct nl_client *);
 extern int nl_build_genlh(struct nl_client *, __u8, __u8);
 extern int nl_build_if_create_msg(struct nl_client *cl, struct vn_if *ifp, __u8 ack);
 extern int nl_build_header(struct nl_client *cl, unsigned char **buf, __u32 *buf_len);
+extern int nl_build_batch_header(struct nl_client *cl, unsigned char **buf,
+        __u32 *buf_len);
 extern void nl_update_header(struct nl_client *cl, int data_len);
 extern int nl_build_family_name_attr(struct nl_client *cl, char *family);
 extern int nl_build_get_family_id(struct nl_client *cl, char *family);
@@ -7,27 +7,5 @@ struct list_head {
 	struct list_head *next, *prev;
 };
 
-struct dummy_timer_list {
-        /*
- * All fields that change during normal runtime grouped to the
- * same cacheline
- */
-	struct list_head entry;
-	unsigned long expires;
-	struct tvec_base *base;
-
-	void (*function)(unsigned long);
-	unsigned long data;
-
-	int slack;
-
-	int start_pid;
-	void *start_site;
-	char start_comm[16];
-};
-
 time_t get_time(void);
-void add_timer(struct dummy_timer_list *);
-void init_timer(struct dummy_timer_list *);
-void ulinux_timer(unsigned long);
 #endif
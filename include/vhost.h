@@ -11,11 +11,22 @@ extern "C" {
 
 #define VHOST_KIND  "vhost"
 
+#define VHOST_MAX_QUEUES    16
+
 #ifdef __KERNEL__
+struct vhost_queue {
+    unsigned long vq_tx_packets;
+    unsigned long vq_tx_bytes;
+    unsigned long vq_tx_dropped;
+    unsigned long vq_rx_packets;
+    unsigned long vq_rx_bytes;
+} ____cacheline_aligned_in_smp;
+
 struct vhost_priv {
     struct net_device *vp_dev;
     struct vrouter *vp_router;
     struct vr_interface *vp_vifp;
+    struct vhost_queue vp_queues[VHOST_MAX_QUEUES];
 };
 
 #endif /* __KERNEL__ */
@@ -40,6 +40,13 @@ struct ip4_bucket_entry {
 #define entry_long_i    entry_data.long_i
 
 struct ip4_bucket {
+    /* entries that point to the bucket. more than 1 only when shared */
+    unsigned int bkt_refcnt;
+    unsigned int bkt_hash;
+    unsigned char bkt_level;
+    /* in the table of shared buckets */
+    unsigned char bkt_shared;
+    struct ip4_bucket *bkt_next;
     struct ip4_bucket_entry bkt_data[0];
 };
 
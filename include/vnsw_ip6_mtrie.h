@@ -0,0 +1,63 @@
+/*
+ * vnsw_ip6_mtrie.h --
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#ifndef __VNSW_IP6_MTRIE_H__
+#define __VNSW_IP6_MTRIE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "vr_defs.h"
+
+struct ip6_bucket;
+
+/*
+ * as in the ipv4 mtrie, the least significant bit of the pointer tells
+ * whether an entry points to a bucket or to a nexthop
+ */
+struct ip6_bucket_entry {
+    union {
+        struct vr_nexthop *nexthop_p;
+        struct ip6_bucket *bucket_p;
+        unsigned long      long_i;
+    } ip6e_data;
+
+    unsigned int ip6e_prefix_len:8;
+    unsigned int ip6e_label_flags:4;
+    unsigned int ip6e_label:20;
+};
+
+#define ip6e_nh_p       ip6e_data.nexthop_p
+#define ip6e_long_i     ip6e_data.long_i
+
+#define IP6_PREFIX_LEN          128
+#define IP6_ADDR_LEN            (IP6_PREFIX_LEN / 8)
+
+/*
+ * Ip6Mtrie
+ *
+ * a byte of the address at every level, so that a lookup of a /64 (what
+ * most ipv6 subnets are) ends at the eighth level, and a bucket is of the
+ * same size as a bucket of the ipv4 mtrie
+ */
+#define IP6_BUCKET_BITS         8
+#define IP6_BUCKET_SIZE         (1 << IP6_BUCKET_BITS)
+#define IP6_BUCKET_LEVELS       (IP6_PREFIX_LEN / IP6_BUCKET_BITS)
+
+struct ip6_bucket {
+    /* a bucket out of the table is freed after the lookups move on */
+    struct vr_deferred bkt_deferred;
+    struct ip6_bucket_entry bkt_data[IP6_BUCKET_SIZE];
+};
+
+struct ip6_mtrie {
+    struct ip6_bucket_entry root;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __VNSW_IP6_MTRIE_H__ */
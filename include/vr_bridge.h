@@ -32,10 +32,30 @@
 
 #define VR_BE_FLAG_VALID                 0x01
 #define VR_BE_FLAG_LABEL_VALID           0x02
+/* learnt by the datapath, and aged by it */
+#define VR_BE_FLAG_LEARNT                0x04
+
+/*
+ * the payload of AGENT_TRAP_MAC_LEARN_BATCH is a list of these (as many
+ * as hdr_cmd_param), for the macs that the datapath learnt, or moved to
+ * another interface, and the ones it aged out. in network order
+ */
+#define VR_BRIDGE_MAC_LEARNT             1
+#define VR_BRIDGE_MAC_AGED               2
+
+struct vr_bridge_mac_event {
+    uint8_t bme_mac[VR_ETHER_ALEN];
+    uint16_t bme_vrf;
+    uint16_t bme_ifindex;
+    uint16_t bme_event;
+} __attribute__((packed));
 
 
 unsigned int
 vr_bridge_input(struct vrouter *, unsigned short , struct vr_packet *, 
                             struct vr_forwarding_md *);
+unsigned int
+vr_bridge_input_batch(struct vrouter *, unsigned short *, struct vr_packet **,
+        unsigned int, struct vr_forwarding_md *);
 
 #endif
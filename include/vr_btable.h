@@ -6,29 +6,46 @@
 #ifndef __VR_BTABLE_H__
 #define __VR_BTABLE_H__
 
-#define VR_MAX_BTABLE_ENTRIES   8
-#define VR_SINGLE_ALLOC_LIMIT   (4  * 1024 * 1024)
-#define VR_KNOWN_BIG_MEM_LIMIT  (32 * 1024 * 1024)
+/* 64K partitions of 4M, i.e 256G */
+#define VR_MAX_BTABLE_ENTRIES   (64 * 1024)
+#define VR_SINGLE_ALLOC_SHIFT   22
+#define VR_SINGLE_ALLOC_LIMIT   (1UL << VR_SINGLE_ALLOC_SHIFT)
 
 struct vr_btable_partition {
-    unsigned int vb_offset;
+    uint64_t vb_offset;
     unsigned int vb_mem_size;
 };
 
+/* partitions are allocated when first written to. see vr_btable_fill */
+#define VR_BTABLE_FLAG_LAZY     0x1
+
+/*
+ * every partition but the last holds the same power of two number of
+ * entries, so that an entry is found by a shift and a mask
+ */
 struct vr_btable {
     unsigned int    vb_entries;
     unsigned short    vb_esize;
-    unsigned short    vb_partitions;
-    void *vb_mem[VR_MAX_BTABLE_ENTRIES];
-    struct vr_btable_partition vb_table_info[VR_MAX_BTABLE_ENTRIES];
+    unsigned short    vb_shift;
+    unsigned int    vb_partitions;
+    /* the partitions are spread evenly over these many numa nodes */
+    unsigned int    vb_nodes;
+    unsigned int    vb_flags;
+    void **vb_mem;
+    struct vr_btable_partition *vb_table_info;
 };
 
 struct vr_btable_partition *vr_btable_get_partition(struct vr_btable *,
         unsigned int);
-void *vr_btable_get_address(struct vr_btable *, unsigned int);
+void *vr_btable_get_address(struct vr_btable *, uint64_t);
 
 void vr_btable_free(struct vr_btable *);
 struct vr_btable *vr_btable_alloc(unsigned int, unsigned int);
+struct vr_btable *vr_btable_alloc_lazy(unsigned int, unsigned int);
+struct vr_btable *vr_btable_alloc_lazy_nodes(unsigned int, unsigned int,
+        unsigned int);
+void *vr_btable_fill(struct vr_btable *, unsigned int);
+int vr_btable_prefault(struct vr_btable *);
 
 static inline unsigned int
 vr_btable_entries(struct vr_btable *table)
@@ -36,23 +53,27 @@ vr_btable_entries(struct vr_btable *table)
     return table->vb_entries;
 }
 
-static inline unsigned int
+static inline uint64_t
 vr_btable_size(struct vr_btable *table)
 {
-    return table->vb_entries * table->vb_esize;
+    return (uint64_t)table->vb_entries * table->vb_esize;
 }
 
 static inline void *
 vr_btable_get(struct vr_btable *table, unsigned int entry)
 {
-    unsigned int t_index, t_offset;
+    unsigned int t_index;
+    unsigned long t_offset;
 
     if (entry >= table->vb_entries)
         return NULL;
 
-    t_index = (entry * table->vb_esize) / VR_SINGLE_ALLOC_LIMIT;
-    t_offset = (entry * table->vb_esize) % VR_SINGLE_ALLOC_LIMIT;
-    if (t_index >= table->vb_partitions)
+    t_index = entry >> table->vb_shift;
+    t_offset = (unsigned long)(entry & ((1U << table->vb_shift) - 1)) *
+        table->vb_esize;
+
+    /* a partition of a lazy table that nobody wrote to yet */
+    if (!table->vb_mem[t_index])
         return NULL;
 
     return (table->vb_mem[t_index] + t_offset);
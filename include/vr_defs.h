@@ -29,7 +29,9 @@
 #define AGENT_TRAP_DIAG             8
 #define AGENT_TRAP_ECMP_RESOLVE     9
 #define AGENT_TRAP_SOURCE_MISMATCH  10
-#define MAX_AGENT_HDR_COMMANDS      11
+#define AGENT_TRAP_FLOW_MISS_BATCH  11
+#define AGENT_TRAP_MAC_LEARN_BATCH  12
+#define MAX_AGENT_HDR_COMMANDS      13
 
 enum rt_type{
     RT_UCAST = 0,
@@ -56,4 +58,10 @@ struct vr_list_head {
         struct vr_list_node *node_p;
 };
 
+/* an object that waits, with others, for the datapath to let go of it */
+struct vr_deferred {
+    struct vr_deferred *vd_next;
+    void (*vd_free)(struct vr_deferred *);
+};
+
 #endif /* __VR_DEFS_H__ */
@@ -99,10 +99,94 @@ struct vr_flow_stats {
     uint8_t  flow_packets_oflow;
 } __attribute__((packed));
 
+/*
+ * format of the flow table, as seen by the readers of the mmap-ed memory.
+ * in the INLINE format, the statistics are part of the flow entry. in the
+ * SPLIT format, fe_stats is left untouched and the statistics are kept in
+ * per-cpu arrays (a struct vr_flow_cpu_stats per entry) that follow the
+ * flow and the overflow tables in the mmap-ed memory, one array after the
+ * other. each cpu writes only its own array, and readers add up the arrays
+ * (fr_ftable_stats_cpus of them, fr_ftable_stats_size bytes in total). The
+ * split keeps the writes of the forwarding path away from the cache lines
+ * that the lookups read. The format is reported in fr_ftable_version.
+ */
+#define VR_FLOW_TABLE_FORMAT_INLINE     1
+#define VR_FLOW_TABLE_FORMAT_SPLIT      2
+
+struct vr_flow_cpu_stats {
+    uint64_t fcs_bytes;
+    uint64_t fcs_packets;
+};
+
+#define VR_FLOW_STATS_SLOT_SIZE         sizeof(struct vr_flow_cpu_stats)
+
+/*
+ * flow events. with vr_flow_events set, the datapath reports flow misses,
+ * ECMP resolve requests and the flows that it evicts as records in
+ * per-cpu rings, instead of trapping packets to the agent. the rings
+ * follow the statistics tables in the mmap-ed memory (fr_ftable_event_size
+ * bytes in total, VR_FLOW_EVENT_RING_SPAN bytes per cpu). each ring starts
+ * with a struct vr_flow_event_ring and the records start at
+ * VR_FLOW_EVENT_RING_HDR_SIZE. the datapath moves fer_head after a record
+ * is written and the agent moves fer_tail after a record is read. the key
+ * of the flow is in the flow entry, and the packets of a missed flow stay
+ * queued in the entry till the agent sets the action. when a ring is full,
+ * the datapath falls back to trapping the packet
+ */
+#define VR_FLOW_EVENT_MISS              1
+#define VR_FLOW_EVENT_EVICT             2
+#define VR_FLOW_EVENT_ECMP_RESOLVE      3
+/* the datapath hashed the flow to an ecmp member on its own */
+#define VR_FLOW_EVENT_ECMP_SELECT       4
+/*
+ * the datapath picked a source nat port for the flow and set up the
+ * reverse flow (fev_param) on its own
+ */
+#define VR_FLOW_EVENT_SNAT_BIND         5
+
+struct vr_flow_event {
+    uint16_t fev_type;
+    uint16_t fev_vrf;
+    uint32_t fev_index;
+    /* interface the packet came in on, for a miss or a resolve */
+    uint32_t fev_ifindex;
+    /*
+     * reverse flow of an evicted flow, -1 if none. the member picked for
+     * an ecmp select. the reverse flow of a snat bind
+     */
+    uint32_t fev_param;
+};
+
+struct vr_flow_event_ring {
+    uint32_t fer_head;
+    /* events that did not fit and went as trapped packets */
+    uint32_t fer_overflows;
+    uint8_t fer_pad[56];
+    /* written by the agent, in a cache line of its own */
+    uint32_t fer_tail;
+};
+
+#define VR_FLOW_EVENT_RING_HDR_SIZE     4096
+#define VR_FLOW_EVENT_RING_RECORDS      4096
+#define VR_FLOW_EVENT_RING_SPAN         (VR_FLOW_EVENT_RING_HDR_SIZE + \
+        VR_FLOW_EVENT_RING_RECORDS * sizeof(struct vr_flow_event))
+
+/*
+ * changes of the flow table, for readers that want to look at only what
+ * changed since they last looked. a uint32_t counter per group of
+ * VR_FLOW_CHANGE_GROUP entries (of the flow and the overflow tables, in
+ * the order of the flow index) goes up after an entry of the group is
+ * set up, changed or reset. the counters follow the counters table in the
+ * mmap-ed memory (fr_ftable_changes_size bytes). a reader reads the
+ * counter of a group before its entries, and has to look at the group
+ * again once the counter is not what it read. statistics do not count as
+ * changes
+ */
+#define VR_FLOW_CHANGE_GROUP            64
+
 struct vr_dummy_flow_entry {
     struct vr_flow_stats fe_stats;
-     /* not used. if you are in need of a byte, please use this field */
-    uint8_t fe_dummy;
+    uint8_t fe_offload;
     struct vr_list_head fe_hold_list;
     struct vr_flow_key fe_key;
     unsigned short fe_action;
@@ -113,6 +197,11 @@ struct vr_dummy_flow_entry {
     uint8_t fe_mirror_id;
     uint8_t fe_sec_mirror_id;
     int8_t fe_ecmp_nh_index;
+    uint32_t fe_hold_stamp;
+    uint8_t fe_tcp_flags;
+    uint8_t fe_rate_flags;
+    uint16_t fe_rate_window;
+    uint32_t fe_rate_bytes;
 } __attribute__((packed));
 
 #define VR_FLOW_ENTRY_PACK (64 - sizeof(struct vr_dummy_flow_entry))
@@ -120,8 +209,8 @@ struct vr_dummy_flow_entry {
 /* do not change. any field positions as it might lead to incompatibility */
 struct vr_flow_entry {
     struct vr_flow_stats fe_stats;
-    /* not used. if you are in need of a byte, please use this field */
-    uint8_t fe_dummy;
+    /* non zero while the flow is offloaded. see vr_flow_offload_register */
+    uint8_t fe_offload;
     struct vr_list_head fe_hold_list;
     struct vr_flow_key fe_key;
     unsigned short fe_action;
@@ -132,11 +221,29 @@ struct vr_flow_entry {
     uint8_t fe_mirror_id;
     uint8_t fe_sec_mirror_id;
     int8_t fe_ecmp_nh_index;
+    /* usecs, when the entry went to HOLD */
+    uint32_t fe_hold_stamp;
+    /* VR_FLOW_TCP_*, what this direction of a tcp flow has seen */
+    uint8_t fe_tcp_flags;
+    /*
+     * the sampled rate of the flow (see vr_flow_elephant_rate): bytes seen
+     * in the second fe_rate_window, and VR_FLOW_RATE_* of the last second
+     */
+    uint8_t fe_rate_flags;
+    uint16_t fe_rate_window;
+    uint32_t fe_rate_bytes;
     unsigned char fe_pack[VR_FLOW_ENTRY_PACK];
 } __attribute__((packed));
 
 #define VR_FLOW_PROTO_SHIFT             16
 
+#define VR_FLOW_TCP_SYN                 0x01
+#define VR_FLOW_TCP_FIN                 0x02
+#define VR_FLOW_TCP_RST                 0x04
+
+/* the flow went over vr_flow_elephant_rate in the last second */
+#define VR_FLOW_RATE_ELEPHANT           0x01
+
 #define VR_UDP_DHCP_SPORT   (17 << 16 | htons(67))
 #define VR_UDP_DHCP_CPORT   (17 << 16 | htons(68))
 #define VR_UDP_DNS_SPORT    (17 << 16 | htons(53))
@@ -144,6 +251,26 @@ struct vr_flow_entry {
 
 #define VR_DNS_SERVER_PORT  htons(53)
 
+/* entries in one FLOW_OP_FLOW_BULK_SET request */
+#define VR_FLOW_MAX_BULK_ENTRIES        1024
+
+/* maximum number of packets that vr_flow_inet_input_batch handles at once */
+#define VR_FLOW_BATCH_MAX               32
+
+/*
+ * log2 buckets of the usecs that flows spend in HOLD, waiting for the agent.
+ * bucket n counts [2^n, 2^(n + 1)), the last one everything above
+ */
+#define VR_FLOW_SETUP_BUCKETS           24
+
+/*
+ * log2 buckets of the entries that a lookup (that found the flow) or an
+ * insert went over, from the first entry of the first candidate bucket.
+ * bucket n counts [2^n, 2^(n + 1)). the main table takes the first 8,
+ * the overflow table the rest
+ */
+#define VR_FLOW_PROBE_BUCKETS           6
+
 struct vr_flow_md {
     struct vrouter *flmd_router;
     unsigned int flmd_index;
@@ -158,10 +285,79 @@ extern int vr_flow_init(struct vrouter *);
 extern void vr_flow_exit(struct vrouter *, bool);
 extern unsigned int vr_flow_inet_input(struct vrouter *, unsigned short, 
         struct vr_packet *, unsigned short, struct vr_forwarding_md *);
+extern unsigned int vr_flow_inet_input_batch(struct vrouter *,
+        unsigned short *, struct vr_packet **, unsigned int, unsigned short,
+        struct vr_forwarding_md *);
 extern inline unsigned int
 vr_flow_bypass(struct vrouter *, struct vr_flow_key *, struct vr_packet *, unsigned int *);
 void *vr_flow_get_va(struct vrouter *, uint64_t);
 unsigned int vr_flow_table_size(struct vrouter *);
 unsigned int vr_oflow_table_size(struct vrouter *);
+unsigned int vr_flow_stats_table_size(struct vrouter *);
+unsigned int vr_flow_resize_table_size(struct vrouter *);
+unsigned int vr_flow_event_table_size(struct vrouter *);
+unsigned int vr_flow_changes_table_size(struct vrouter *);
+void vr_flow_get_stats(struct vrouter *, struct vr_flow_entry *,
+        unsigned int, struct vr_flow_stats *);
+void vr_flow_ecmp_select(struct vrouter *, int, unsigned int);
+
+/*
+ * what an offload engine (a nic that forwards flows on its own, programmed
+ * through tc flower and the like) is given for an established flow: the
+ * match, the action, the rewrite of nat flows and the nexthop (a tunnel or
+ * a local interface) with the label the packets go out with
+ */
+struct vr_flow_offload {
+    struct vr_flow_key fo_key;
+    unsigned short fo_action;
+    /* the nat flags of the flow, VR_FLOW_FLAG_NAT_MASK */
+    unsigned short fo_flags;
+    unsigned int fo_nat_sip;
+    unsigned int fo_nat_dip;
+    unsigned short fo_nat_sport;
+    unsigned short fo_nat_dport;
+    unsigned short fo_vrf;
+    unsigned int fo_nh_id;
+    int fo_label;
+};
+
+/*
+ * an add replaces what the engine has for the index. stats and del give
+ * the packets and bytes forwarded since the last call
+ */
+struct vr_flow_offload_ops {
+    int (*foo_add)(struct vrouter *, unsigned int,
+            const struct vr_flow_offload *);
+    void (*foo_del)(struct vrouter *, unsigned int, uint64_t *, uint64_t *);
+    int (*foo_stats)(struct vrouter *, unsigned int, uint64_t *, uint64_t *);
+};
+
+/*
+ * warm restart. the flow table does not outlive the module, and hence the
+ * established flows are saved ("flow --save") before the module goes, and
+ * given back with FLOW_OP_FLOW_TABLE_RESTORE (fr_restore is an array of
+ * the records below) once the new module is in and the agent programmed
+ * the interfaces and nexthops again. the new table has a hash key, and
+ * hence indices, of its own: a flow and its reverse flow are in the same
+ * request, one after the other, the first with VR_FLOW_SAVED_PAIR. flows
+ * in hold, the mirror settings and the statistics are not saved
+ */
+#define VR_FLOW_SAVED_MAGIC         0x76666c77
+#define VR_FLOW_SAVED_PAIR          0x1
+
+struct vr_flow_saved {
+    struct vr_flow_key fsv_key;
+    uint16_t fsv_action;
+    uint16_t fsv_flags;
+    uint16_t fsv_dvrf;
+    uint8_t fsv_tcp_flags;
+    uint8_t fsv_saved_flags;
+    uint32_t fsv_src_nh_index;
+    int32_t fsv_ecmp_nh_index;
+};
+
+extern int vr_flow_offload_register(struct vrouter *,
+        struct vr_flow_offload_ops *);
+extern void vr_flow_offload_unregister(struct vrouter *);
 
 #endif /* __VR_FLOW_H__ */
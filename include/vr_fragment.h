@@ -19,8 +19,42 @@ struct vr_fragment {
     unsigned short f_sport;
     unsigned short f_dport;
     uint64_t f_time;
+    /* next entry (index + 1) in the expiry wheel slot, 0 for the last */
+    unsigned int f_next;
+    /* set while the entry is linked in the expiry wheel */
+    unsigned char f_wheel;
+    unsigned char f_state;
 } __attribute__((packed));
 
+#define VR_FRAG_STATE_FREE      0
+/* claimed by an insert, and being written */
+#define VR_FRAG_STATE_BUSY      1
+#define VR_FRAG_STATE_ACTIVE    2
+
+/*
+ * non-head fragments that come in before their head fragment are held in a
+ * small per-cpu queue till the head fragment records the ports, or till
+ * the fragment timeout
+ */
+#define VR_FRAG_HOLD_ENTRIES    16
+
+#define VR_FRAG_HOLD_FREE       0
+#define VR_FRAG_HOLD_BUSY       1
+#define VR_FRAG_HOLD_READY      2
+
+struct vr_fragment_hold {
+    struct vr_packet *fh_pkt;
+    struct vr_fragment_key fh_key;
+    unsigned short fh_proto;
+    unsigned char fh_state;
+    uint64_t fh_time;
+    struct vr_forwarding_md fh_fmd;
+};
+
+struct vr_fragment_queue {
+    struct vr_fragment_hold vfq_holds[VR_FRAG_HOLD_ENTRIES];
+};
+
 #define f_sip f_key.fk_sip
 #define f_dip f_key.fk_dip
 #define f_id  f_key.fk_id
@@ -33,5 +67,7 @@ struct vr_fragment *vr_fragment_get(struct vrouter *, unsigned short,
 int vr_fragment_add(struct vrouter *, unsigned short, struct vr_ip *,
                 unsigned short, unsigned short);
 void vr_fragment_del(struct vr_fragment *);
+int vr_fragment_enqueue(struct vrouter *, unsigned short, struct vr_packet *,
+        unsigned short, struct vr_forwarding_md *);
 
 #endif /* __VR_FRAGMENT_H__ */
@@ -14,10 +14,18 @@ extern "C" {
 enum vnsw_nl_attrs {
     NL_ATTR_UNSPEC,
     NL_ATTR_VR_MESSAGE_PROTOCOL,
+    /* a list of struct vr_notify_event */
+    NL_ATTR_VR_NOTIFY,
     NL_ATTR_MAX
 };
 
 #define SANDESH_REQUEST     1
+/* many sandesh objects in one attribute, with one response for all */
+#define SANDESH_REQUEST_BATCH   2
+/* events of the datapath, on the VR_GENL_EVENTS_GROUP multicast group */
+#define VR_NOTIFY_EVENTS        3
+
+#define VR_GENL_EVENTS_GROUP    "events"
 
 #ifdef __cplusplus
 }
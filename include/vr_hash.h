@@ -189,4 +189,75 @@ static inline __u32 vr_hash_1word(__u32 a, __u32 initval)
 	return vr_hash_3words(a, 0, 0, initval);
 }
 
+/*
+ * the hash of the flow, bridge and fragment tables. the seed is random,
+ * picked once when the module loads, so that bucket placement cannot be
+ * predicted from outside. the engine is picked at init too: the Jenkins
+ * hash above, or the CRC32C instruction of the cpu, which is cheaper but
+ * linear (keys that collide with one seed collide with every seed), and
+ * hence not as resistant to crafted collisions.
+ */
+#define VR_HASH_ENGINE_JENKINS  0
+#define VR_HASH_ENGINE_CRC32    1
+
+extern __u32 vr_hash_seed;
+extern unsigned int vr_hash_engine;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VR_HASH_HAVE_CRC32      1
+
+static inline __u32 __vr_crc32_word(__u32 crc, __u32 word)
+{
+    __asm__("crc32l %1, %0" : "+r" (crc) : "rm" (word));
+    return crc;
+}
+
+static inline __u32 __vr_crc32_byte(__u32 crc, __u8 byte)
+{
+    __asm__("crc32b %1, %0" : "+r" (crc) : "rm" (byte));
+    return crc;
+}
+#elif defined(__aarch64__)
+#define VR_HASH_HAVE_CRC32      1
+
+static inline __u32 __vr_crc32_word(__u32 crc, __u32 word)
+{
+    __asm__(".arch_extension crc\n\tcrc32cw %w0, %w0, %w1"
+            : "+r" (crc) : "r" (word));
+    return crc;
+}
+
+static inline __u32 __vr_crc32_byte(__u32 crc, __u8 byte)
+{
+    __asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1"
+            : "+r" (crc) : "r" (byte));
+    return crc;
+}
+#endif
+
+#ifdef VR_HASH_HAVE_CRC32
+static inline __u32 vr_hash_crc32(const void *key, __u32 length,
+        __u32 initval)
+{
+    __u32 crc = initval;
+    const __u8 *k = key;
+
+    for (; length >= 4; length -= 4, k += 4)
+        crc = __vr_crc32_word(crc, __get_unaligned_word(k));
+    for (; length; length--, k++)
+        crc = __vr_crc32_byte(crc, *k);
+
+    return crc;
+}
+#endif
+
+static inline __u32 vr_keyed_hash(const void *key, __u32 length)
+{
+#ifdef VR_HASH_HAVE_CRC32
+    if (vr_hash_engine == VR_HASH_ENGINE_CRC32)
+        return vr_hash_crc32(key, length, vr_hash_seed);
+#endif
+    return vr_hash(key, length, vr_hash_seed);
+}
+
 #endif /* _VR_HASH_H */
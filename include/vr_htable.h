@@ -19,6 +19,10 @@ int vr_find_duplicate_hentry_index(vr_htable_t , vr_hentry_t );
 vr_hentry_t vr_get_hentry_by_index(vr_htable_t , unsigned int );
 vr_hentry_t vr_find_free_hentry(vr_htable_t , void *, unsigned int *);
 void vr_htable_trav(vr_htable_t , unsigned int , htable_trav_cb , void *);
+unsigned int vr_htable_prefetch(vr_htable_t , void *);
+vr_hentry_t vr_find_hentry_in_bucket(vr_htable_t , void *, unsigned int );
+unsigned int vr_htable_iter(vr_htable_t , unsigned int *, vr_hentry_t *,
+        unsigned int *, unsigned int );
 
 
 #endif
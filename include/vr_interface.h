@@ -42,8 +42,29 @@
 
 
 #define VIF_VRF_TABLE_ENTRIES       1024
+/*
+ * head room asked of the host stack for packets of an interface when the
+ * agent does not say: an outer l2 header with a vlan tag, ip, udp and an
+ * mpls label or vxlan header
+ */
+#define VIF_DEFAULT_HEADROOM        64
 #define VIF_VRF_INVALID             ((unsigned short)-1)
 
+/*
+ * how the host spreads the packets of an interface over the cpus. the
+ * default is left to the global r1/r3 and q1/q3 knobs
+ */
+#define VIF_STEER_DEFAULT           0
+/* process the packet on the cpu it was received on */
+#define VIF_STEER_SAME_CORE         1
+/* another core of the same numa node, not a hyperthread of this one */
+#define VIF_STEER_NODE              2
+/* one of the cpus in vif_steer_cpus */
+#define VIF_STEER_CPUS              3
+#define VIF_STEER_MAX               4
+
+#define VIF_MAX_STEER_CPUS          16
+
 #define vif_mode_xconnect(vif)      (vif->vif_flags & VIF_FLAG_XCONNECT)
 
 struct vr_interface_stats {
@@ -53,6 +74,41 @@ struct vr_interface_stats {
     uint64_t vis_obytes;
     uint64_t vis_opackets;
     uint64_t vis_oerrors;
+    /* packets whose head had to be reallocated to push headers */
+    uint64_t vis_head_reallocs;
+    /* decapsulated packets whose checksum the nic / we verified */
+    uint64_t vis_rx_csum_hw;
+    uint64_t vis_rx_csum_sw;
+    /* packets within and over the rate limits of the interface */
+    uint64_t vis_rx_conform;
+    uint64_t vis_rx_exceed;
+    uint64_t vis_tx_conform;
+    uint64_t vis_tx_exceed;
+};
+
+/*
+ * rate limit of the packets an interface receives or sends. the tokens
+ * (bytes) are earned in a bucket that all cpus share, from where a cpu
+ * takes them in chunks of vrr_chunk to a bucket of its own. the shared
+ * bucket is hence touched once every few packets, and the tokens go to
+ * the cpus that have the traffic. packets that find no tokens are dropped
+ */
+#define VIF_RATE_MIN_BURST          16384
+/* of the rate, when the agent does not give the burst */
+#define VIF_RATE_DEFAULT_BURST_MSECS 10
+
+struct vr_vif_rate_cpu {
+    unsigned int vrc_tokens;
+} __attribute__((aligned(64)));
+
+struct vr_vif_rate {
+    /* kilobits per second and bytes */
+    unsigned int vrr_rate;
+    unsigned int vrr_burst;
+    unsigned int vrr_chunk;
+    unsigned int vrr_credit;
+    uint64_t vrr_stamp;
+    struct vr_vif_rate_cpu vrr_cpu[0];
 };
 
 struct vr_packet;
@@ -63,6 +119,41 @@ struct agent_send_params {
     void *trap_param;
 };
 
+/*
+ * agent packet rings. with vr_agent_rings set, packets trapped to the agent
+ * are written into per-cpu rings instead of being sent over pkt0. the rings
+ * follow the flow event rings in the mmap-ed flow memory
+ * (fr_ftable_agent_ring_size bytes in total, VR_AGENT_RING_SPAN bytes per
+ * cpu). each ring starts with a struct vr_agent_ring and the slots start at
+ * VR_AGENT_RING_HDR_SIZE. a slot is a struct vr_agent_ring_slot followed by
+ * the frame as pkt0 would have carried it, i.e. the ethernet rewrite, the
+ * agent_hdr and the packet. the datapath moves ar_head after a slot is
+ * written and the agent moves ar_tail after a slot is read. packets that do
+ * not fit in a slot, or find the ring full, are sent over pkt0
+ */
+struct vr_agent_ring {
+    uint32_t ar_head;
+    /* packets that found the ring full and went over pkt0 */
+    uint32_t ar_overflows;
+    uint8_t ar_pad[56];
+    /* written by the agent, in a cache line of its own */
+    uint32_t ar_tail;
+};
+
+struct vr_agent_ring_slot {
+    /* bytes of the frame in the slot */
+    uint16_t ars_len;
+    /* bytes of the frame before truncation */
+    uint16_t ars_frame_len;
+    uint32_t ars_pad;
+};
+
+#define VR_AGENT_RING_HDR_SIZE          4096
+#define VR_AGENT_RING_SLOT_SIZE         2048
+#define VR_AGENT_RING_SLOTS             512
+#define VR_AGENT_RING_SPAN              (VR_AGENT_RING_HDR_SIZE + \
+        VR_AGENT_RING_SLOTS * VR_AGENT_RING_SLOT_SIZE)
+
 struct vr_interface {
     unsigned short vif_type;
     unsigned short vif_vrf;
@@ -71,15 +162,26 @@ struct vr_interface {
 
     unsigned int vif_flags;
     unsigned int vif_idx;
-    unsigned int vif_users;
     unsigned int vif_os_idx;
 
     uint8_t vif_mirror_id;
+    unsigned short vif_headroom;
+    /* head room of the os device before we raised it */
+    unsigned short vif_os_headroom;
+    unsigned char vif_steer_policy;
+    unsigned char vif_steer_ncpus;
+    unsigned short vif_steer_cpus[VIF_MAX_STEER_CPUS];
 
     struct vrouter *vif_router;
     struct vr_interface *vif_parent;
     struct vr_interface *vif_bridge;
     struct vr_interface_stats *vif_stats;
+    /* flow-miss trap token bucket */
+    unsigned int vif_miss_credit;
+    uint64_t vif_miss_stamp;
+    /* NULL when not rate limited */
+    struct vr_vif_rate *vif_rx_rate;
+    struct vr_vif_rate *vif_tx_rate;
 
     unsigned short vif_vrf_table_users;
     /*
@@ -88,6 +190,8 @@ struct vr_interface {
      * entries is also vital for table_users calculation.
      */
     short *vif_vrf_table;
+    /* the vlans that have an entry in vif_vrf_table, for the dump */
+    uint64_t vif_vrf_table_bmap[VIF_VRF_TABLE_ENTRIES / 64];
 
     void *vif_os;
     int (*vif_send)(struct vr_interface *, struct vr_packet *, void *);
@@ -107,10 +211,14 @@ struct vr_interface {
     unsigned char vif_mac[VR_ETHER_ALEN];
     unsigned char vif_name[VR_INTERFACE_NAME_LEN];
     unsigned int  vif_ip;
+    /* nexthop of the macs learnt on the interface, 0 to not learn */
+    unsigned int vif_learn_nh_id;
 #ifdef __KERNEL__
-    struct napi_struct vr_napi;
-    struct sk_buff_head vr_skb_inputq;
+    /* per cpu gro input queues, for packets going to the vm */
+    struct vr_gro_queue __percpu *vr_gro_queues;
 #endif
+    /* control plane references, as for nh_users */
+    unsigned int vif_users __attribute__((aligned(64)));
 };
 
 struct vr_interface_settings {
@@ -143,7 +251,11 @@ extern void vif_set_xconnect(struct vr_interface *);
 extern void vif_remove_xconnect(struct vr_interface *);
 extern int vif_xconnect(struct vr_interface *, struct vr_packet *);
 extern void vif_drop_pkt(struct vr_interface *, struct vr_packet *, bool);
+extern unsigned int vr_agent_ring_table_size(struct vrouter *);
+extern unsigned int vr_interface_rx_burst(struct vr_interface *,
+        struct vr_packet **, unsigned int);
 extern int vif_vrf_table_get(struct vr_interface *, vr_vrf_assign_req *);
 extern int vif_vrf_table_set(struct vr_interface *, unsigned int, short);
+extern int vif_vrf_table_next(struct vr_interface *, int);
 
 #endif /* __VR_INTERFACE_H__ */
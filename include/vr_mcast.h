@@ -29,7 +29,9 @@
 
 unsigned int vr_mcast_forward(struct vrouter *, unsigned short,
         struct vr_packet *, struct vr_forwarding_md *);
-    
+void vr_mcast_forward_bulk(struct vrouter *, unsigned short *,
+        struct vr_packet **, unsigned int, struct vr_forwarding_md *);
+
 bool vr_l2_mcast_control_data_add(struct vr_packet *);
 
 #endif /* __VR_MCAST_H__ */
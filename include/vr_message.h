@@ -27,8 +27,25 @@
 #define VR_VRF_STATS_OBJECT_ID          9
 #define VR_DROP_STATS_OBJECT_ID         10
 #define VR_VXLAN_OBJECT_ID              11
+#define VR_PERF_OBJECT_ID               12
+#define VR_DROP_CAPTURE_OBJECT_ID       13
+#define VR_VROUTER_OPS_OBJECT_ID        14
 
 #define VR_MESSAGE_PAGE_SIZE            (4096 - 128)
+/*
+ * the largest buffer a dump fills before it responds. the length of the
+ * netlink attribute that carries it is 16 bits, and hence the headroom
+ */
+#define VR_MESSAGE_DUMP_BUF_SIZE        (64 * 1024 - 256)
+/*
+ * objects a dump puts in a response before it gives way to waiting
+ * requests, so that dumps still make progress under a stream of requests
+ */
+#define VR_MESSAGE_DUMP_MIN_OBJECTS     16
+/* response wrappers that are kept around for reuse */
+#define VR_MESSAGE_POOL_SIZE            64
+/* levels of the walk that a dumper can keep the position of */
+#define VR_MESSAGE_DUMP_CURSOR_LEVELS   16
 
 struct vr_mproto {
     unsigned int mproto_type;
@@ -44,18 +61,35 @@ struct vr_mproto {
 struct vr_mtransport {
     char    *(*mtrans_alloc)(unsigned int);
     void    (*mtrans_free)(char *);
+    /* publishes a buffer (from mtrans_alloc) of events, and frees it */
+    int     (*mtrans_notify)(char *, unsigned int);
+    /* whether requests are waiting for the one in progress to finish */
+    bool    (*mtrans_busy)(void);
 };
 
 struct vr_message {
     char *vr_message_buf;
     unsigned int vr_message_len;
     struct vr_qelem vr_message_queue;
+    /* goes back to the pool, rather than to the allocator, when freed */
+    bool vr_message_pooled;
+};
+
+/* the state of a request of many objects, see vr_message_request_batch */
+struct vr_message_batch {
+    bool vb_active;
+    int vb_error;
+    unsigned int vb_objects;
 };
 
 struct vr_message_handler {
     struct vr_mproto *vm_proto;
     struct vr_mtransport *vm_trans;
     struct vr_qhead vm_response_queue;
+    struct vr_message_batch vm_batch;
+    /* wrappers of responses that were sent, and the number allocated */
+    struct vr_qhead vm_pool;
+    unsigned int vm_pool_allocated;
 };
 
 struct vr_message_dumper {
@@ -67,6 +101,8 @@ struct vr_message_dumper {
     unsigned int dump_buf_len;
     unsigned int dump_resp_len;
     unsigned int dump_offset;
+    /* where a table walk is, for tables that walk in levels */
+    unsigned int dump_cursor[VR_MESSAGE_DUMP_CURSOR_LEVELS];
 };
 
 
@@ -78,10 +114,14 @@ struct vr_message_dumper *vr_message_dump_init(void *);
 void vr_message_dump_exit(void *, int);
 
 int vr_message_request(struct vr_message *);
+int vr_message_request_batch(struct vr_message *);
+bool vr_message_batch_next(void);
 int vr_message_response(unsigned int, void *, int);
 int vr_message_make_request(unsigned int, void *);
+int vr_message_make_request_batch(unsigned int, void **, unsigned int);
 int vr_message_process_response(int (*)(void *, unsigned int, void *), void *);
 int vr_message_dump_object(void *, unsigned int, void *);
+int vr_message_notify(char *, unsigned int);
 void *vr_mtrans_alloc(unsigned int);
 void vr_mtrans_free(void *);
 
@@ -17,8 +17,25 @@ struct vr_mirror_entry {
     unsigned int mir_flags:12;
     unsigned int mir_rid;
     struct vr_nexthop *mir_nh;
+    /* mirror one in mir_sample packets, all if 0 */
+    unsigned int mir_sample;
+    /* bytes of a packet that are mirrored, all if 0 */
+    unsigned int mir_snaplen;
+    /* packets mirrored in a second at most, no limit if 0 */
+    unsigned int mir_rate;
+    /*
+     * updated without atomics from all cpus. a lost update only moves
+     * the sample or the limit by a packet
+     */
+    unsigned int mir_sample_count;
+    unsigned int mir_rate_sec;
+    unsigned int mir_rate_count;
 };
 
+/* the ethernet header, at least, is mirrored */
+#define VR_MIRROR_MIN_SNAPLEN           VR_ETHER_HLEN
+
+/* allocated with the meta data following it, that mirror_md points to */
 struct vr_mirror_meta_entry {
     void *mirror_md;
     unsigned int mirror_md_len;
@@ -38,5 +55,10 @@ extern int vr_mirror_meta_entry_set(struct vrouter *, unsigned int,
         void *, unsigned int,
         unsigned short);
 extern void vr_mirror_meta_entry_del(struct vrouter *, unsigned int);
+extern struct vr_mirror_meta_entry *vr_mirror_meta_entry_detach(
+        struct vrouter *, unsigned int);
+extern void vr_mirror_meta_entry_attach(struct vrouter *, unsigned int,
+        struct vr_mirror_meta_entry *);
+extern void vr_mirror_meta_resize(struct vrouter *, unsigned int);
 
 #endif /* __VR_MIRROR_H__ */
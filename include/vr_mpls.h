@@ -10,6 +10,8 @@
 #define VR_MPLS_HDR_LEN             4
 #define VR_MAX_UCAST_LABELS         1024
 #define VR_MAX_LABELS               5120
+/* what the table of labels can grow to, the 20 bits of a label */
+#define VR_MPLS_LABEL_SPACE         (1 << 20)
 #define VR_MPLS_STACK_BIT           (0x1 << 8)
 
 #define VR_MPLS_OVER_UDP_DST_PORT   51234
@@ -10,6 +10,8 @@
 extern "C" {
 #endif
 
+#include "vr_defs.h"
+
 #define NH_TABLE_ENTRIES                65536
 #define NH_DISCARD_ID                   0
 
@@ -42,6 +44,20 @@ enum nexthop_type {
 #define NH_FLAG_COMPOSITE_FABRIC            0x0400
 #define NH_FLAG_COMPOSITE_MULTI_PROTO       0x0800
 #define NH_FLAG_TUNNEL_VXLAN                0x1000
+/* ecmp members are picked in the datapath by hashing the flow */
+#define NH_FLAG_COMPOSITE_ECMP_HASH         0x2000
+/*
+ * members of a fabric composite are sent to only for packets from their
+ * source (cnh_src), so that the agent can lay out replication trees
+ */
+#define NH_FLAG_COMPOSITE_TREE              0x4000
+
+/* a prime, much larger than the members of an ecmp nexthop */
+#define NH_ECMP_TABLE_SIZE                  1021
+#define NH_ECMP_HASH_MAX_MEMBERS            127
+
+/* outer ip and udp header, the longest tunnel header template */
+#define NH_TUN_HDR_LEN                      28
 
 #define NH_SOURCE_INVALID                   0
 #define NH_SOURCE_VALID                     1
@@ -53,6 +69,9 @@ struct vr_forwarding_md;
 
 struct vr_component_nh {
     int cnh_label;
+    unsigned int cnh_weight;
+    /* of a tree: the outer source ip of the upstream, 0 for local vms */
+    unsigned int cnh_src;
     struct vr_nexthop *cnh;
 };
 
@@ -68,7 +87,6 @@ struct vr_nexthop {
     int             nh_vrf;
     unsigned int    nh_id;
     unsigned int    nh_rid;
-    unsigned int    nh_users;
     union {
         struct {
             __u16           encap_len;
@@ -79,6 +97,8 @@ struct vr_nexthop {
             unsigned int    tun_sip;
             unsigned int    tun_dip;
             __u16           tun_encap_len;
+            __u16           tun_hdr_sum;
+            __u8            tun_hdr[NH_TUN_HDR_LEN];
          } nh_gre_tun;
 
          struct {
@@ -87,11 +107,15 @@ struct vr_nexthop {
             unsigned short  tun_sport;
             unsigned short  tun_dport;
             __u16           tun_encap_len;
+            __u16           tun_hdr_sum;
+            __u8            tun_hdr[NH_TUN_HDR_LEN];
          } nh_udp_tun;
 
          struct {
             unsigned short cnt;
             struct vr_component_nh *component;
+            /* member index per slot, for NH_FLAG_COMPOSITE_ECMP_HASH */
+            unsigned char *ecmp_table;
          } nh_composite;
 
     } nh_u;
@@ -108,7 +132,14 @@ struct vr_nexthop {
                                        struct vr_forwarding_md *);
     struct vr_interface *nh_dev;
     void                (*nh_destructor)(struct vr_nexthop *);
-    __u8                nh_data[0];
+    /*
+     * references are taken and dropped by the control plane only. the
+     * datapath uses nexthops without them, relying on vr_delay_op before
+     * a nexthop is freed, so keep the count away from what it reads
+     */
+    unsigned int        nh_users __attribute__((aligned(64)));
+    struct vr_deferred  nh_deferred;
+    __u8                nh_data[0] __attribute__((aligned(64)));
 };
 
 #define nh_encap_family         nh_u.nh_encap.encap_family
@@ -121,8 +152,13 @@ struct vr_nexthop {
 #define nh_udp_tun_dport        nh_u.nh_udp_tun.tun_dport
 #define nh_gre_tun_encap_len    nh_u.nh_gre_tun.tun_encap_len
 #define nh_udp_tun_encap_len    nh_u.nh_udp_tun.tun_encap_len
+#define nh_gre_tun_hdr          nh_u.nh_gre_tun.tun_hdr
+#define nh_gre_tun_hdr_sum      nh_u.nh_gre_tun.tun_hdr_sum
+#define nh_udp_tun_hdr          nh_u.nh_udp_tun.tun_hdr
+#define nh_udp_tun_hdr_sum      nh_u.nh_udp_tun.tun_hdr_sum
 #define nh_component_cnt        nh_u.nh_composite.cnt
 #define nh_component_nh         nh_u.nh_composite.component
+#define nh_ecmp_table           nh_u.nh_composite.ecmp_table
 
 extern int vr_nexthop_init(struct vrouter *);
 extern void vr_nexthop_exit(struct vrouter *, bool);
@@ -0,0 +1,48 @@
+/*
+ * vr_notify.h -- change notifications of the datapath
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#ifndef __VR_NOTIFY_H__
+#define __VR_NOTIFY_H__
+
+/*
+ * with vr_notify_msecs set, the datapath collects the changes below and
+ * publishes them every vr_notify_msecs, as one message on the "events"
+ * multicast group of the vrouter genetlink family. the NL_ATTR_VR_NOTIFY
+ * attribute of the message is a list of struct vr_notify_event, in host
+ * order
+ */
+#define VR_NOTIFY_VIF_UP                1
+#define VR_NOTIFY_VIF_DOWN              2
+/* deleted by the agent */
+#define VR_NOTIFY_FLOW_DELETE           3
+/* aged out by the datapath */
+#define VR_NOTIFY_FLOW_EVICT            4
+/* vne_index is the VR_NOTIFY_TABLE_* that had no room for an entry */
+#define VR_NOTIFY_TABLE_FULL            5
+/* vne_index is the drop reason, and vne_value the drops of the period */
+#define VR_NOTIFY_DROP_THRESHOLD        6
+/* vne_value events did not fit in the message, and were lost */
+#define VR_NOTIFY_LOST                  7
+
+#define VR_NOTIFY_TABLE_FLOW            0
+#define VR_NOTIFY_TABLE_BRIDGE          1
+#define VR_NOTIFY_TABLE_MAX             2
+
+struct vr_notify_event {
+    uint16_t vne_type;
+    uint16_t vne_rid;
+    uint32_t vne_index;
+    uint64_t vne_value;
+} __attribute__((packed));
+
+struct vrouter;
+
+extern int vr_notify_init(struct vrouter *);
+extern void vr_notify_exit(struct vrouter *, bool);
+extern void vr_notify(struct vrouter *, unsigned short, unsigned int,
+        uint64_t);
+extern void vr_notify_table_full(struct vrouter *, unsigned int);
+
+#endif /* __VR_NOTIFY_H__ */
@@ -20,6 +20,7 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/list.h>
+#include <linux/prefetch.h>
 #include <linux/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
@@ -36,6 +37,7 @@
 
 #define vr_printf(format, arg...)   printk(format, ##arg)
 #define ASSERT(x) BUG_ON(!(x));
+#define vr_prefetch(x)              prefetch(x)
 
 #else /* __KERNEL */
 
@@ -50,6 +52,7 @@
 
 #define vr_printf(format, arg...)   printf(format, ##arg)
 #define ASSERT(x) assert((x));
+#define vr_prefetch(x)              __builtin_prefetch((x))
 
 typedef __signed__ char __s8;
 typedef unsigned char __u8;
@@ -77,6 +80,8 @@ typedef unsigned int __u32;
 #include <vr_packet.h>
 #include <vr_mirror.h>
 #include <vr_vxlan.h>
+#include <vr_notify.h>
+#include <vr_perf.h>
 
 extern int vrouter_dbg;
 
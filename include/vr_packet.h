@@ -129,7 +129,10 @@
 #define VP_DROP_INVALID_VNID                39
 #define VP_DROP_FRAGMENTS                   40
 #define VP_DROP_INVALID_SOURCE              41
-#define VP_DROP_MAX                         42
+#define VP_DROP_FLOW_QUEUE_POOL_EMPTY       42
+#define VP_DROP_FLOW_MISS_RATE_LIMIT        43
+#define VP_DROP_INTERFACE_RATE_LIMIT        44
+#define VP_DROP_MAX                         45
 
 struct vr_drop_stats {
     uint64_t vds_discard;
@@ -174,6 +177,9 @@ struct vr_drop_stats {
     uint64_t vds_invalid_vnid;
     uint64_t vds_frag_err;
     uint64_t vds_invalid_source;
+    uint64_t vds_flow_queue_pool_empty;
+    uint64_t vds_flow_miss_rate_limit;
+    uint64_t vds_interface_rate_limit;
 };
 
 /*
@@ -191,6 +197,8 @@ struct vr_packet {
     unsigned short vp_network_h;
     unsigned short vp_flags;
     unsigned short vp_inner_network_h;
+    /* transport header of the ip header at vp_network_h, 0 if not parsed */
+    unsigned short vp_transport_h;
     unsigned char vp_cpu;
     unsigned char vp_type;
     unsigned char vp_ttl;
@@ -206,9 +214,20 @@ struct vr_packet_node {
 extern void pkt_reset(struct vr_packet *);
 extern struct vr_packet *pkt_copy(struct vr_packet *, unsigned short,
         unsigned short);
+extern struct vr_packet *pkt_copy_head_space(struct vr_packet *,
+        unsigned short, unsigned short, unsigned short);
 extern int vr_trap(struct vr_packet *, unsigned short, unsigned short, void *);
 extern int vr_myip(struct vr_interface *, unsigned int);
+extern bool vr_fabric_demux(struct vr_interface *, struct vr_packet *);
+extern int vr_fabric_demux_burst(struct vr_interface *, struct vr_packet *);
+
+/* what vr_fabric_demux_burst did with the packet */
+#define VR_DEMUX_NONE           0
+#define VR_DEMUX_DONE           1
+#define VR_DEMUX_VXLAN          2
 extern bool vr_should_proxy(struct vr_interface *, unsigned int, unsigned int);
+extern int vr_arp_cache_init(struct vrouter *);
+extern void vr_arp_cache_exit(struct vrouter *, bool);
 
 struct vr_eth {
     unsigned char eth_dmac[VR_ETHER_ALEN];
@@ -228,6 +247,7 @@ struct vr_vlan_hdr {
 
 #define VR_ETH_PROTO_ARP        0x806
 #define VR_ETH_PROTO_IP         0x800
+#define VR_ETH_PROTO_IP6        0x86DD
 #define VR_ETH_PROTO_VLAN       0x8100
 
 #define VR_DIAG_IP_CSUM         0xffff
@@ -277,6 +297,18 @@ struct vr_ip {
     unsigned int ip_daddr;
 } __attribute__((packed));
 
+#define VR_IP6_ADDRESS_LEN      16
+
+struct vr_ip6 {
+    /* version, traffic class and flow label */
+    unsigned int ip6_flow;
+    unsigned short ip6_plen;
+    unsigned char ip6_nxt;
+    unsigned char ip6_hlim;
+    unsigned char ip6_src[VR_IP6_ADDRESS_LEN];
+    unsigned char ip6_dst[VR_IP6_ADDRESS_LEN];
+} __attribute__((packed));
+
 static inline bool
 vr_ip_fragment_tail(struct vr_ip *iph)
 {
@@ -345,6 +377,13 @@ vr_incremental_diff(unsigned int oldval, unsigned int newval,
     return;
 }
 
+/* in the byte at VR_TCP_FLAGS_OFFSET of the tcp header */
+#define VR_TCP_FLAGS_OFFSET         13
+#define VR_TCP_FLAG_FIN             0x01
+#define VR_TCP_FLAG_SYN             0x02
+#define VR_TCP_FLAG_RST             0x04
+#define VR_TCP_FLAG_ACK             0x10
+
 struct vr_tcp {
     unsigned short tcp_sport;
     unsigned short tcp_dport;
@@ -405,6 +444,12 @@ struct vr_vxlan {
  * highest for head space */
 #define VR_MIRROR_PKT_HEAD_SPACE    (VR_UDP_HEAD_SPACE + sizeof(struct vr_pcap) + \
                                      VR_MPLS_HDR_LEN + sizeof(struct vr_udp))
+/*
+ * what a mirrored packet gets a private copy of, when the host can clone
+ * just the headers: l2 and 64 bytes past it. the rest is shared
+ */
+#define VR_MIRROR_PKT_HDR_LEN       (sizeof(struct vr_eth) + \
+                                     sizeof(struct vr_vlan_hdr) + 64)
 
 /*
  * Mcast packet adds the following before replicating
@@ -437,6 +482,16 @@ struct vr_vxlan {
                                       VR_VXLAN_HDR_LEN + \
                                         VR_L2_MCAST_CTRL_DATA_LEN)
 
+/*
+ * headers a multicast replica may pull or rewrite, and hence needs a private
+ * copy of: the vxlan header and control word, and 64 bytes of the inner
+ * frame past its l2 header. the payload past it is shared by the replicas
+ */
+#define VR_MCAST_PKT_HDR_LEN        (VR_VXLAN_HDR_LEN + \
+                                        VR_L2_MCAST_CTRL_DATA_LEN + \
+                                        sizeof(struct vr_eth) + \
+                                        sizeof(struct vr_vlan_hdr) + 64)
+
 
 extern unsigned short vr_ip_csum(struct vr_ip *);
 extern unsigned short vr_generate_unique_ip_id(void);
@@ -451,9 +506,22 @@ extern unsigned short vr_ip_partial_csum(struct vr_ip *);
  * degradation, if so used. please also watch what you are doing with
  * this variable
  */
+/* which of the cold fields of the forwarding metadata have been set */
+#define FMD_VALID_ECMP_NH           0x01
+#define FMD_VALID_ECMP_SRC_NH       0x02
+#define FMD_VALID_DVRF              0x04
+#define FMD_VALID_OUTER_SRC_IP      0x08
+
+/*
+ * the fields every packet uses come first and are set by
+ * vr_init_forwarding_md. the rest are for a minority of packets (ecmp,
+ * mirroring, packets from a tunnel) and are valid only once set, reading
+ * as their defaults till then. use the accessors below for them
+ */
 struct vr_forwarding_md {
     int32_t fmd_flow_index;
     int32_t fmd_label;
+    uint8_t fmd_valid;
     int8_t fmd_ecmp_nh_index;
     int8_t fmd_ecmp_src_nh_index;
     int16_t fmd_dvrf;
@@ -464,11 +532,66 @@ static inline void
 vr_init_forwarding_md(struct vr_forwarding_md *fmd)
 {
     fmd->fmd_flow_index = -1;
-    fmd->fmd_ecmp_nh_index = -1;
-    fmd->fmd_ecmp_src_nh_index = -1;
     fmd->fmd_label = -1;
-    fmd->fmd_dvrf = -1;
-    fmd->fmd_outer_src_ip = 0;
+    fmd->fmd_valid = 0;
+    return;
+}
+
+static inline int8_t
+vr_fmd_ecmp_nh_index(const struct vr_forwarding_md *fmd)
+{
+    return (fmd->fmd_valid & FMD_VALID_ECMP_NH) ? fmd->fmd_ecmp_nh_index : -1;
+}
+
+static inline void
+vr_fmd_set_ecmp_nh_index(struct vr_forwarding_md *fmd, int8_t index)
+{
+    fmd->fmd_ecmp_nh_index = index;
+    fmd->fmd_valid |= FMD_VALID_ECMP_NH;
+    return;
+}
+
+static inline int8_t
+vr_fmd_ecmp_src_nh_index(const struct vr_forwarding_md *fmd)
+{
+    return (fmd->fmd_valid & FMD_VALID_ECMP_SRC_NH) ?
+        fmd->fmd_ecmp_src_nh_index : -1;
+}
+
+static inline void
+vr_fmd_set_ecmp_src_nh_index(struct vr_forwarding_md *fmd, int8_t index)
+{
+    fmd->fmd_ecmp_src_nh_index = index;
+    fmd->fmd_valid |= FMD_VALID_ECMP_SRC_NH;
+    return;
+}
+
+static inline int16_t
+vr_fmd_dvrf(const struct vr_forwarding_md *fmd)
+{
+    return (fmd->fmd_valid & FMD_VALID_DVRF) ? fmd->fmd_dvrf : -1;
+}
+
+static inline void
+vr_fmd_set_dvrf(struct vr_forwarding_md *fmd, int16_t vrf)
+{
+    fmd->fmd_dvrf = vrf;
+    fmd->fmd_valid |= FMD_VALID_DVRF;
+    return;
+}
+
+static inline uint32_t
+vr_fmd_outer_src_ip(const struct vr_forwarding_md *fmd)
+{
+    return (fmd->fmd_valid & FMD_VALID_OUTER_SRC_IP) ?
+        fmd->fmd_outer_src_ip : 0;
+}
+
+static inline void
+vr_fmd_set_outer_src_ip(struct vr_forwarding_md *fmd, uint32_t ip)
+{
+    fmd->fmd_outer_src_ip = ip;
+    fmd->fmd_valid |= FMD_VALID_OUTER_SRC_IP;
     return;
 }
 
@@ -519,6 +642,7 @@ static inline void
 pkt_set_network_header(struct vr_packet *pkt, unsigned short off)
 {
     pkt->vp_network_h = off;
+    pkt->vp_transport_h = 0;
     return;
 }
 
@@ -538,6 +662,36 @@ pkt_network_header(struct vr_packet *pkt)
     
 }
 
+/*
+ * the first stage that parses the ip header (flow lookup) caches where the
+ * ports are, so that nat, checksum update and ecmp hashing do not have to
+ * parse it again. only unfragmented packets with linear ports are cached.
+ */
+static inline void
+pkt_set_transport_header(struct vr_packet *pkt, struct vr_ip *ip)
+{
+    unsigned int off = pkt->vp_network_h + (ip->ip_hl * 4);
+
+    if ((unsigned char *)ip == pkt->vp_head + pkt->vp_network_h &&
+            vr_ip_transport_header_valid(ip) &&
+            off + sizeof(unsigned int) <= pkt->vp_tail)
+        pkt->vp_transport_h = off;
+    else
+        pkt->vp_transport_h = 0;
+
+    return;
+}
+
+static inline unsigned char *
+pkt_transport_header(struct vr_packet *pkt, struct vr_ip *ip)
+{
+    if (pkt->vp_transport_h &&
+            (unsigned char *)ip == pkt->vp_head + pkt->vp_network_h)
+        return pkt->vp_head + pkt->vp_transport_h;
+
+    return (unsigned char *)ip + (ip->ip_hl * 4);
+}
+
 static inline unsigned char *
 pkt_pull(struct vr_packet *pkt, unsigned int len)
 {
@@ -0,0 +1,68 @@
+/*
+ * vr_perf.h -- where the cycles of the datapath go
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#ifndef __VR_PERF_H__
+#define __VR_PERF_H__
+
+/*
+ * stages whose cycles are accounted, per cpu, while accounting is on. the
+ * cycles of a stage include those of the stages it calls into (the nh
+ * output of a tunnel includes its encapsulation and the tx). the output
+ * of a nexthop is accounted by nexthop type, VR_PERF_NH_OUTPUT + nh_type
+ */
+#define VR_PERF_INTERFACE_INPUT         0
+#define VR_PERF_FLOW_LOOKUP             1
+#define VR_PERF_MTRIE_LOOKUP            2
+#define VR_PERF_PULL_INNER_HEADERS      3
+#define VR_PERF_ENCAP                   4
+#define VR_PERF_IF_TX                   5
+#define VR_PERF_NH_OUTPUT               6
+#define VR_PERF_MAX                     (VR_PERF_NH_OUTPUT + NH_MAX)
+
+struct vr_perf_stage {
+    uint64_t vps_cycles;
+    uint64_t vps_packets;
+    uint64_t vps_calls;
+};
+
+/* per cpu arrays of VR_PERF_MAX stages, allocated when first turned on */
+extern struct vr_perf_stage *vr_perf_stages;
+extern int vr_perf_enabled;
+
+/*
+ * a stage starts with a timestamp, which is 0 when accounting is off, and
+ * ends with the stage adding up the cycles since. off, it is a branch
+ */
+static inline uint64_t
+vr_perf_start(void)
+{
+    if (__builtin_expect(!vr_perf_enabled, 1))
+        return 0;
+
+    return vr_get_cycles();
+}
+
+static inline void
+vr_perf_end(unsigned int stage, uint64_t start, unsigned int packets)
+{
+    struct vr_perf_stage *vps;
+
+    if (__builtin_expect(!start, 1))
+        return;
+
+    vps = &vr_perf_stages[vr_get_cpu() * VR_PERF_MAX + stage];
+    vps->vps_cycles += vr_get_cycles() - start;
+    vps->vps_packets += packets;
+    vps->vps_calls++;
+
+    return;
+}
+
+struct vrouter;
+
+extern int vr_perf_init(struct vrouter *);
+extern void vr_perf_exit(struct vrouter *, bool);
+
+#endif /* __VR_PERF_H__ */
@@ -11,7 +11,11 @@ extern "C" {
 #endif
 
 #define VR_NUM_ROUTES_PER_DUMP  20
+/* routes in one bulk route request */
+#define VR_ROUTE_MAX_BULK_ENTRIES   256
 #define VR_MAX_VRFS             4096
+/* the most vrfs that a vrf stats dump of vsr_top returns */
+#define VR_VRF_STATS_TOP_MAX    64
 
 #define METADATA_IP_SUBNET      0xA9FE0000 /* link local subnet (169.254.0.0/16) */
 #define METADATA_IP_MASK        (0xFFFF << 16)
@@ -41,6 +45,14 @@ struct vr_vrf_stats {
     uint64_t vrf_gre_mpls_tunnels;
     uint64_t vrf_l2_encaps;
     uint64_t vrf_encaps;
+    /* packets that came in to, and went out of, the vrf */
+    uint64_t vrf_rx_packets;
+    uint64_t vrf_rx_bytes;
+    uint64_t vrf_tx_packets;
+    uint64_t vrf_tx_bytes;
+    /* sampled lookups, by the level at which they ended (root first) */
+    uint64_t vrf_lookup_depth[5];
+    unsigned int vrf_lookup_sample;
 };
 
 struct vr_route {
@@ -58,6 +70,8 @@ struct vr_route {
 struct vr_rtable {
     int (*algo_add)(struct vr_rtable *, struct vr_route_req *);
     int (*algo_del)(struct vr_rtable *, struct vr_route_req *);
+    int (*algo_bulk)(struct vr_rtable *, struct vr_route_req *,
+            unsigned int, int *);
     struct vr_nexthop *(*algo_lookup)(unsigned int, struct vr_route_req *,
             struct vr_packet *);
     int (*algo_get)(unsigned int, struct vr_route_req *);
@@ -81,6 +95,8 @@ struct rtable_fspec {
 
     int (*route_add)(struct rtable_fspec *, struct vr_route_req *);
     int (*route_del)(struct rtable_fspec *, struct vr_route_req *);
+    int (*route_bulk)(struct rtable_fspec *, struct vr_route_req *,
+            unsigned int, int *);
     int (*route_dump)(struct rtable_fspec *, struct vr_route_req *);
 
     algo_init_decl algo_init[RT_MAX];
@@ -7,15 +7,20 @@
 #define __VR_VXLAN_H__
 
 #define VR_VXLAN_VNID_SHIFT             8
+#define VR_DEF_VXLAN_VNIDS              (16 * 1024)
 
 struct vrouter;
 struct vr_forwarding_md;
 struct vr_packet;
+struct vr_nexthop;
 
 extern int vr_vxlan_init(struct vrouter *);
 extern void vr_vxlan_exit(struct vrouter *, bool);
 extern int vr_vxlan_input(struct vrouter *, struct vr_packet *, 
                                     struct vr_forwarding_md *);
+extern void vr_vxlan_input_bulk(struct vrouter *, struct vr_packet **,
+        unsigned int, struct vr_forwarding_md *);
+extern struct vr_nexthop *vr_vxlan_nh(struct vrouter *, unsigned int);
 
 
 
@@ -34,6 +34,8 @@ extern int vr_perfr1, vr_perfr2, vr_perfr3;
 extern int vr_perfq1, vr_perfq2, vr_perfq3;
 extern int vr_from_vm_mss_adj;
 extern int vr_to_vm_mss_adj;
+extern int vr_numa_replicas;
+extern int vr_fabric_early_demux;
 extern int hashrnd_inited;
 extern __u32 vr_hashrnd;
 
@@ -45,6 +47,50 @@ extern __u32 vr_hashrnd;
 typedef void(*vr_defer_cb)(struct vrouter *router, void *user_data);
 
 struct vr_ip;
+struct vr_flow_resize;
+struct vr_flow_aging;
+struct vr_flow_hold_pool;
+struct vr_flow_miss_batch;
+struct vr_notify;
+struct vr_flow_cache;
+struct vr_flow_setup_stats;
+struct vr_flow_probe_stats;
+
+/*
+ * counters in mmap-ed memory. with vr_counters_mmap set, the per-cpu drop
+ * counters and the per-cpu counters of every interface are kept in one
+ * table, which follows the agent rings in the mmap-ed flow memory
+ * (fr_ftable_counters_size bytes). the table starts with this header, and
+ * the layout is of vch_version. the drop counters of a cpu are an array
+ * of vch_drop_reasons uint64_t (by VP_DROP_*), and those of an interface
+ * are an array of vch_cpus struct vr_interface_stats, at vch_vif_offset +
+ * vif index * vch_vif_span. counters of an interface are reset when it
+ * is added. readers do not synchronize with the datapath
+ */
+#define VR_COUNTERS_VERSION             1
+#define VR_COUNTERS_HDR_SIZE            4096
+#define VR_COUNTERS_DROP_SPAN           512
+
+struct vr_counters_hdr {
+    uint32_t vch_version;
+    uint32_t vch_cpus;
+    uint32_t vch_drop_offset;
+    uint32_t vch_drop_span;
+    uint32_t vch_drop_reasons;
+    uint32_t vch_vif_offset;
+    uint32_t vch_vif_span;
+    uint32_t vch_vif_stats_size;
+    uint32_t vch_interfaces;
+};
+
+/*
+ * drop capture. while on, sampled drops leave the first bytes of the packet
+ * and where it was dropped (interface, vrf, nexthop) in a per-cpu ring of
+ * the last VR_DROP_CAPTURE_RECORDS, dumped with vr_drop_capture_req. the
+ * host calls vr_drop_capture() from its pfree, only when it is on
+ */
+#define VR_DROP_CAPTURE_RECORDS         64
+#define VR_DROP_CAPTURE_BYTES           64
 
 struct vr_timer {
     void (*vt_timer)(void *);
@@ -102,6 +148,16 @@ struct host_os {
                                         (*is_label_l2)(unsigned int,
                                             unsigned int, unsigned short *), 
                                         int *, int *);
+    int  (*hos_pshare)(struct vr_packet *, unsigned short);
+    struct vr_packet *(*hos_pclone_head)(struct vr_packet *, unsigned short,
+            unsigned short);
+    int  (*hos_get_node)(void);
+    int  (*hos_num_nodes)(void);
+    void *(*hos_node_zalloc)(unsigned int, int);
+    /* as hos_page_alloc, on the memory of a node. freed by hos_page_free */
+    void *(*hos_node_page_alloc)(unsigned int, int);
+    /* a cheap, monotonic counter of the cpu, for vr_perf */
+    uint64_t (*hos_get_cycles)(void);
 };
 
 #define vr_malloc                       vrouter_host->hos_malloc
@@ -139,6 +195,20 @@ struct host_os {
 #define vr_pull_inner_headers_fast      vrouter_host->hos_pull_inner_headers_fast
 #define vr_get_udp_src_port             vrouter_host->hos_get_udp_src_port
 #define vr_pkt_from_vm_tcp_mss_adj      vrouter_host->hos_pkt_from_vm_tcp_mss_adj
+#define vr_pshare                       vrouter_host->hos_pshare
+#define vr_pclone_head                  vrouter_host->hos_pclone_head
+#define vr_get_node                     vrouter_host->hos_get_node
+#define vr_num_nodes                    vrouter_host->hos_num_nodes
+#define vr_node_zalloc                  vrouter_host->hos_node_zalloc
+#define vr_node_page_alloc              vrouter_host->hos_node_page_alloc
+#define vr_get_cycles                   vrouter_host->hos_get_cycles
+
+/*
+ * copies of a table of pointers the datapath reads for every packet, one on
+ * the memory of every numa node when vr_numa_replicas is set. copy 0 is
+ * the table itself. the control plane writes all of them
+ */
+#define VR_MAX_NUMA_NODES               8
 
 struct vrouter {
     unsigned int vr_num_if;
@@ -148,8 +218,10 @@ struct vrouter {
 
     unsigned int vr_max_interfaces;
     struct vr_interface **vr_interfaces;
+    void *vr_interface_replicas[VR_MAX_NUMA_NODES];
     unsigned int vr_max_nexthops;
     struct vr_nexthop **vr_nexthops;
+    void *vr_nexthop_replicas[VR_MAX_NUMA_NODES];
     struct vr_rtable *vr_inet_rtable;
     struct vr_rtable *vr_inet6_rtable;
     struct vr_rtable *vr_inet_mcast_rtable;
@@ -157,27 +229,72 @@ struct vrouter {
 
     struct vr_btable *vr_flow_table;
     struct vr_btable *vr_oflow_table;
+    struct vr_btable *vr_flow_tags;
+    struct vr_btable *vr_oflow_tags;
+    /* one table per cpu, in the SPLIT flow table format */
+    struct vr_btable **vr_flow_stats_table;
+    struct vr_btable **vr_flow_event_table;
+    /* one ring per cpu of the packets trapped to the agent */
+    struct vr_btable **vr_agent_ring_table;
+    /* non-NULL while the flow table is being resized */
+    struct vr_flow_resize *vr_flow_resize;
+    /* last hit time of every flow entry, when flows are aged in the kernel */
+    struct vr_btable *vr_flow_hits;
+    /* see VR_FLOW_CHANGE_GROUP */
+    struct vr_btable *vr_flow_changes;
+    struct vr_flow_aging *vr_flow_aging;
+    struct vr_flow_offload_state *vr_flow_offload;
+    /* source nat rules, see vr_flow_snat_setup */
+    struct vr_flow_snat **vr_flow_snat;
+    /* per cpu pools of the nodes that hold packets of HOLD flows */
+    struct vr_flow_hold_pool *vr_flow_hold_pool;
+    struct vr_flow_miss_batch *vr_flow_miss_batch;
+    /* per-cpu, see vr_flow_cache_lookup */
+    struct vr_flow_cache *vr_flow_cache;
+    unsigned int vr_flow_cache_gen;
+    /* per-cpu, flow setup latency and hold queue overflows */
+    struct vr_flow_setup_stats *vr_flow_setup_stats;
+    /* per-cpu, probe lengths of the flow table lookups and inserts */
+    struct vr_flow_probe_stats *vr_flow_probe_stats;
+    struct vr_btable *vr_flow_nh_cache;
+    /* see vr_should_proxy */
+    struct vr_arp_cache *vr_arp_cache;
     struct vr_flow_table_info *vr_flow_table_info;
     unsigned int vr_flow_table_info_size;
 
     unsigned int vr_max_labels;
     struct vr_nexthop **vr_ilm;
+    void *vr_ilm_replicas[VR_MAX_NUMA_NODES];
 
     unsigned int vr_max_mirror_indices;
     struct vr_mirror_entry **vr_mirrors;
     vr_itable_t vr_mirror_md;
+    struct vr_btable *vr_mirror_md_slots;
     vr_itable_t vr_vxlan_table;
+    /* a direct map of the vnids below vr_max_vnids, see vr_vxlan.c */
+    unsigned int vr_max_vnids;
+    struct vr_nexthop **vr_vnids;
+    void *vr_vnid_replicas[VR_MAX_NUMA_NODES];
 
     struct vr_btable *vr_fragment_table;
     struct vr_btable *vr_fragment_otable;
     struct vr_timer *vr_fragment_table_scanner;
     struct vr_timer *vr_fragment_otable_scanner;
+    /* per cpu queues of fragments that came before their head */
+    struct vr_fragment_queue *vr_fragment_queue;
+    unsigned int vr_fragment_held;
 
     uint64_t **vr_pdrop_stats;
+    /* the memory of the counters, when mmap-ed. see vr_counters_hdr */
+    struct vr_btable *vr_counters_table;
+    /* changes waiting to be published, see vr_notify.c */
+    struct vr_notify *vr_notify;
 
     struct vr_interface *vr_agent_if;
     struct vr_interface *vr_host_if;
     struct vr_interface *vr_eth_if;
+    /* see vr_config_request */
+    unsigned int vr_config_gen;
 };
 
 extern struct host_os *vrouter_host;
@@ -185,6 +302,49 @@ extern struct host_os *vrouter_host;
 extern struct vrouter *vrouter_get(unsigned int);
 extern int vrouter_init(void);
 extern int vr_module_error(int, const char *, int, int);
+extern int vr_replicas_alloc(void **, void *, unsigned int);
+extern unsigned int vr_counters_table_size(struct vrouter *);
+extern struct vr_interface_stats *vr_counters_vif_stats(struct vrouter *,
+        unsigned int);
+extern int vr_drop_capture_enabled;
+extern void vr_drop_capture(struct vrouter *, struct vr_packet *,
+        unsigned short);
+extern void vr_replicas_free(void **);
+extern void vr_replicas_set(void **, unsigned int, void *);
+extern void vr_free_deferred(struct vr_deferred *,
+        void (*)(struct vr_deferred *));
+extern void vr_free_deferred_flush(void);
+
+/*
+ * a request that adds or deletes an interface, a nexthop, a label, a
+ * route or a vxlan mapping moves the generation of the forwarding state.
+ * a snapshot (vrsnap) is consistent if the generation (of a GET of
+ * vrouter_ops) did not move while its dumps went on
+ */
+static inline void
+vr_config_request(struct vrouter *router, int op)
+{
+    if (op == SANDESH_OP_ADD || op == SANDESH_OP_DELETE)
+        router->vr_config_gen++;
+
+    return;
+}
+
+/* the copy of a replicated table on the memory of this cpu */
+static inline void *
+vr_replica(void **replicas)
+{
+    int node;
+
+    if (!replicas[1])
+        return replicas[0];
+
+    node = vr_get_node();
+    if (node < 0 || node >= VR_MAX_NUMA_NODES || !replicas[node])
+        return replicas[0];
+
+    return replicas[node];
+}
 
 #ifdef __cplusplus
 }
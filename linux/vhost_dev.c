@@ -18,8 +18,20 @@
 #include "vr_packet.h"
 
 extern int linux_to_vr(struct vr_interface *, struct sk_buff *);
+extern int vr_vhost_queues;
 static bool vhost_drv_inited;
 
+/* per queue counters, as shown by ethtool -S */
+static const char vhost_queue_stat_names[][ETH_GSTRING_LEN - 8] = {
+    "tx_packets",
+    "tx_bytes",
+    "tx_dropped",
+    "rx_packets",
+    "rx_bytes",
+};
+
+#define VHOST_QUEUE_STATS   ARRAY_SIZE(vhost_queue_stat_names)
+
 static void vhost_ethtool_get_info(struct net_device *netdev,
 	struct ethtool_drvinfo *info)
 {
@@ -29,9 +41,60 @@ static void vhost_ethtool_get_info(struct net_device *netdev,
 	strcpy(info->bus_info, "N/A");
 }
 
+static int
+vhost_ethtool_get_sset_count(struct net_device *dev, int sset)
+{
+    if (sset != ETH_SS_STATS)
+        return -EOPNOTSUPP;
+
+    return dev->real_num_tx_queues * VHOST_QUEUE_STATS;
+}
+
+static void
+vhost_ethtool_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    unsigned int i, j;
+
+    if (sset != ETH_SS_STATS)
+        return;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        for (j = 0; j < VHOST_QUEUE_STATS; j++) {
+            snprintf(data, ETH_GSTRING_LEN, "queue_%u_%s", i,
+                    vhost_queue_stat_names[j]);
+            data += ETH_GSTRING_LEN;
+        }
+    }
+
+    return;
+}
+
+static void
+vhost_ethtool_get_stats(struct net_device *dev,
+        struct ethtool_stats *stats, u64 *data)
+{
+    unsigned int i;
+    struct vhost_priv *vp = netdev_priv(dev);
+    struct vhost_queue *vq;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        vq = &vp->vp_queues[i];
+        *data++ = vq->vq_tx_packets;
+        *data++ = vq->vq_tx_bytes;
+        *data++ = vq->vq_tx_dropped;
+        *data++ = vq->vq_rx_packets;
+        *data++ = vq->vq_rx_bytes;
+    }
+
+    return;
+}
+
 static const struct ethtool_ops vhost_ethtool_ops = {
 	.get_drvinfo	= vhost_ethtool_get_info,
 	.get_link		= ethtool_op_get_link,
+	.get_sset_count	= vhost_ethtool_get_sset_count,
+	.get_strings	= vhost_ethtool_get_strings,
+	.get_ethtool_stats	= vhost_ethtool_get_stats,
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39)) && defined(CONFIG_XEN)
 	.get_tso		= ethtool_op_get_tso,
 	.set_tso		= ethtool_op_set_tso,
@@ -39,6 +102,24 @@ static const struct ethtool_ops vhost_ethtool_ops = {
 #endif
 };
 
+/*
+ * one queue per online cpu, unless the vr_vhost_queues module parameter
+ * says otherwise
+ */
+static unsigned int
+vhost_num_queues(void)
+{
+    unsigned int queues = vr_vhost_queues;
+
+    if (!queues)
+        queues = num_online_cpus();
+
+    if (queues > VHOST_MAX_QUEUES)
+        queues = VHOST_MAX_QUEUES;
+
+    return queues;
+}
+
 unsigned int
 vhost_get_ip(struct vr_interface *vif)
 {
@@ -64,10 +145,34 @@ vhost_dev_destructor(struct net_device *dev)
     return;
 }
 
+/*
+ * pin every tx queue to a cpu, so that a cpu always transmits on the
+ * same queue and never contends for another cpu's queue lock
+ */
+static void
+vhost_dev_set_xps(struct net_device *dev)
+{
+#if defined(CONFIG_XPS) && (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
+    unsigned int i = 0;
+    int cpu;
+
+    if (dev->real_num_tx_queues == 1)
+        return;
+
+    for_each_online_cpu(cpu) {
+        netif_set_xps_queue(dev, cpumask_of(cpu),
+                i++ % dev->real_num_tx_queues);
+    }
+#endif
+
+    return;
+}
+
 static int
 vhost_dev_open(struct net_device *dev)
 {
-    netif_start_queue(dev);
+    vhost_dev_set_xps(dev);
+    netif_tx_start_all_queues(dev);
 
     return 0;
 }
@@ -75,11 +180,38 @@ vhost_dev_open(struct net_device *dev)
 static int
 vhost_dev_stop(struct net_device *dev)
 {
-    netif_stop_queue(dev);
+    netif_tx_stop_all_queues(dev);
 
     return 0;
 }
 
+static struct net_device_stats *
+vhost_dev_get_stats(struct net_device *dev)
+{
+    unsigned int i;
+    unsigned long tx_packets = 0, tx_bytes = 0, tx_dropped = 0;
+    unsigned long rx_packets = 0, rx_bytes = 0;
+    struct vhost_priv *vp = netdev_priv(dev);
+    struct vhost_queue *vq;
+
+    for (i = 0; i < dev->real_num_tx_queues; i++) {
+        vq = &vp->vp_queues[i];
+        tx_packets += vq->vq_tx_packets;
+        tx_bytes += vq->vq_tx_bytes;
+        tx_dropped += vq->vq_tx_dropped;
+        rx_packets += vq->vq_rx_packets;
+        rx_bytes += vq->vq_rx_bytes;
+    }
+
+    dev->stats.tx_packets = tx_packets;
+    dev->stats.tx_bytes = tx_bytes;
+    dev->stats.tx_dropped = tx_dropped;
+    dev->stats.rx_packets = rx_packets;
+    dev->stats.rx_bytes = rx_bytes;
+
+    return &dev->stats;
+}
+
 static int
 vhost_dev_set_mac_address(struct net_device *dev, void *addr)
 {
@@ -118,20 +250,53 @@ vhost_if_add(struct vr_interface *vif)
     return;
 }
 
+static struct net_device_ops vhost_dev_ops;
+
+/*
+ * a packet from vrouter to the host. the receive queue is picked by the
+ * cpu, the same way the transmit queues are mapped
+ */
+void
+vhost_dev_rx(struct net_device *dev, struct sk_buff *skb)
+{
+    unsigned int queue = 0;
+    struct vhost_priv *vp = netdev_priv(dev);
+    struct vhost_queue *vq;
+
+    if (dev->netdev_ops != &vhost_dev_ops) {
+        (void)__sync_fetch_and_add(&dev->stats.rx_bytes, skb->len);
+        (void)__sync_fetch_and_add(&dev->stats.rx_packets, 1);
+        return;
+    }
+
+    if (dev->real_num_tx_queues > 1) {
+        queue = smp_processor_id() % dev->real_num_tx_queues;
+        skb_record_rx_queue(skb, queue);
+    }
+
+    vq = &vp->vp_queues[queue];
+    (void)__sync_fetch_and_add(&vq->vq_rx_packets, 1);
+    (void)__sync_fetch_and_add(&vq->vq_rx_bytes, skb->len);
+
+    return;
+}
+
 netdev_tx_t
 vhost_dev_xmit(struct sk_buff *skb, struct net_device *dev)
 {
     struct vhost_priv *vp;
+    struct vhost_queue *vq;
     struct vr_interface *vifp;
 
     vp = netdev_priv(dev);
+    vq = &vp->vp_queues[skb_get_queue_mapping(skb)];
     vifp = vp->vp_vifp;
     if (!vifp) {
-        (void)__sync_fetch_and_add(&dev->stats.tx_dropped, 1);
+        (void)__sync_fetch_and_add(&vq->vq_tx_dropped, 1);
         kfree_skb(skb);
     } else {
-        (void)__sync_fetch_and_add(&dev->stats.tx_packets, 1);
-        (void)__sync_fetch_and_add(&dev->stats.tx_bytes, skb->len);
+        (void)__sync_fetch_and_add(&vq->vq_tx_packets, 1);
+        (void)__sync_fetch_and_add(&vq->vq_tx_bytes, skb->len);
         linux_to_vr(vifp, skb);
     }
 
@@ -143,6 +308,7 @@ static struct net_device_ops vhost_dev_ops = {
     .ndo_stop               =       vhost_dev_stop,
     .ndo_start_xmit         =       vhost_dev_xmit,
     .ndo_set_mac_address    =       vhost_dev_set_mac_address,
+    .ndo_get_stats          =       vhost_dev_get_stats,
 };
 
 void
@@ -155,8 +321,8 @@ vhost_setup(struct net_device *dev)
     dev->needed_headroom = sizeof(struct vr_eth) + sizeof(struct agent_hdr);
     dev->netdev_ops = &vhost_dev_ops;
     dev->destructor = vhost_dev_destructor;
+    dev->ethtool_ops = &vhost_ethtool_ops;
 #ifdef CONFIG_XEN
-	SET_ETHTOOL_OPS(dev, &vhost_ethtool_ops);
 	dev->features |= NETIF_F_GRO;
 #endif
     return;
@@ -186,6 +352,18 @@ vhost_validate(struct nlattr *tb[], struct nlattr *data[])
     return 0;
 }
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+static int
+vhost_get_tx_queues(struct net *net, struct nlattr *tb[],
+        unsigned int *num_tx_queues, unsigned int *real_num_tx_queues)
+{
+    *num_tx_queues = vhost_num_queues();
+    *real_num_tx_queues = *num_tx_queues;
+
+    return 0;
+}
+#endif
+
 static int
 vhost_notifier(struct notifier_block * __unused,
         unsigned long event, void *arg)
@@ -211,6 +389,14 @@ static struct rtnl_link_ops vhost_link_ops = {
     .setup      =   vhost_setup,
     .validate   =   vhost_validate,
     .dellink    =   vhost_dellink,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38))
+    .get_num_tx_queues  =   vhost_num_queues,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+    .get_num_rx_queues  =   vhost_num_queues,
+#endif
+#else
+    .get_tx_queues      =   vhost_get_tx_queues,
+#endif
 };
 
 
@@ -10,6 +10,7 @@
 #include <linux/netlink.h>
 #include <linux/genetlink.h>
 #include <linux/version.h>
+#include <linux/mutex.h>
 
 #include <net/genetlink.h>
 
@@ -20,19 +21,52 @@
 
 static int netlink_trans_request(struct sk_buff *, struct genl_info *);
 
+/*
+ * requests are taken in parallel by genetlink and serialized here, so
+ * that the waiting ones can be counted, and dumps can give way to them.
+ * kernels without parallel_ops serialize in genetlink, and then none
+ * are ever seen waiting
+ */
+static DEFINE_MUTEX(vr_genetlink_mutex);
+static atomic_t vr_genetlink_waiting = ATOMIC_INIT(0);
+
 static struct genl_ops vrouter_genl_ops[] = {
     {
         .cmd        =   SANDESH_REQUEST,
         .doit       =   netlink_trans_request,
     },
+    {
+        .cmd        =   SANDESH_REQUEST_BATCH,
+        .doit       =   netlink_trans_request,
+    },
 };
 
+/* where the events of vr_notify are published */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0))
+static struct genl_multicast_group vrouter_genl_events = {
+    .name       =   VR_GENL_EVENTS_GROUP,
+};
+#else
+static const struct genl_multicast_group vrouter_genl_groups[] = {
+    {
+        .name   =   VR_GENL_EVENTS_GROUP,
+    },
+};
+#endif
+
 struct genl_family vrouter_genl_family = {
     .id         =   GENL_ID_GENERATE,
     .name       =   "vrouter",
     .version    =   1,
     .maxattr    =   NL_ATTR_MAX,
     .netnsok    =   true,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0))
+    .parallel_ops   =   true,
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+    .mcgrps     =   vrouter_genl_groups,
+    .n_mcgrps   =   ARRAY_SIZE(vrouter_genl_groups),
+#endif
 };
 
 #define NETLINK_RESPONSE_HEADER_LEN       (NLMSG_HDRLEN + GENL_HDRLEN + \
@@ -42,16 +76,18 @@ struct genl_family vrouter_genl_family = {
 #define NETLINK_SKB(buf)                  *(struct sk_buff **)((char *)buf - \
                                             NETLINK_RESPONSE_HEADER_LEN) 
 
+/*
+ * messages are encoded in place, right after the room kept for the
+ * netlink headers, and the skb leaves as it is. alloc_skb accounts for
+ * the shared info itself, and adding it here again would push a dump
+ * buffer of VR_MESSAGE_DUMP_BUF_SIZE to twice the allocation
+ */
 static char *
 netlink_trans_alloc(unsigned int size)
 {
     struct sk_buff *skb;
-    int len;
 
-    len = NETLINK_RESPONSE_HEADER_LEN;
-    len += SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
-
-    skb = alloc_skb(size + len, GFP_ATOMIC);
+    skb = alloc_skb(size + NETLINK_RESPONSE_HEADER_LEN, GFP_ATOMIC);
     if (!skb)
         return NULL;
 
@@ -94,10 +130,17 @@ netlink_trans_request(struct sk_buff *in_skb, struct genl_info *info)
     if (!aap || !(nla = aap[NL_ATTR_VR_MESSAGE_PROTOCOL]))
         return -EINVAL;
 
+    atomic_inc(&vr_genetlink_waiting);
+    mutex_lock(&vr_genetlink_mutex);
+    atomic_dec(&vr_genetlink_waiting);
+
     request.vr_message_buf = nla_data(nla);
     request.vr_message_len = nla_len(nla);
 
-    vr_message_request(&request);
+    if (info->genlhdr->cmd == SANDESH_REQUEST_BATCH)
+        vr_message_request_batch(&request);
+    else
+        vr_message_request(&request);
 
     multi_flag = 0;
     while ((response = vr_message_dequeue_response())) {
@@ -134,20 +177,68 @@ netlink_trans_request(struct sk_buff *in_skb, struct genl_info *info)
 
     if (multi_flag) {
         skb = alloc_skb(NLMSG_HDRLEN, GFP_ATOMIC);
-        if (!skb)
-            return 0;
-
-        __nlmsg_put(skb, netlink_id, nlh->nlmsg_seq, NLMSG_DONE, 0, 0);
-        netlink_unicast(in_skb->sk, skb, netlink_id, MSG_DONTWAIT);
+        if (skb) {
+            __nlmsg_put(skb, netlink_id, nlh->nlmsg_seq, NLMSG_DONE, 0, 0);
+            netlink_unicast(in_skb->sk, skb, netlink_id, MSG_DONTWAIT);
+        }
     }
 
+    mutex_unlock(&vr_genetlink_mutex);
 
     return 0;
 }
 
+/*
+ * the events go out in place, the same way responses do, to every socket
+ * that joined the group. no one listening is not an error of ours
+ */
+static int
+netlink_trans_notify(char *buf, unsigned int len)
+{
+    int ret;
+    unsigned int msg_len;
+    struct sk_buff *skb;
+    struct nlmsghdr *nlh;
+    struct genlmsghdr *genlh;
+    struct nlattr *nla;
+
+    skb = netlink_skb(buf);
+    if (!skb)
+        return -EINVAL;
+
+    msg_len = NLMSG_ALIGN(len + GENL_HDRLEN + NLA_HDRLEN);
+    nlh = __nlmsg_put(skb, 0, 0, vrouter_genl_family.id, msg_len, 0);
+    genlh = nlmsg_data(nlh);
+    genlh->cmd = VR_NOTIFY_EVENTS;
+    genlh->version = vrouter_genl_family.version;
+    genlh->reserved = 0;
+
+    nla = (struct nlattr *)((char *)genlh + GENL_HDRLEN);
+    nla->nla_len = NLA_HDRLEN + len;
+    nla->nla_type = NL_ATTR_VR_NOTIFY;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0))
+    ret = genlmsg_multicast(skb, 0, vrouter_genl_events.id, GFP_ATOMIC);
+#else
+    ret = genlmsg_multicast(&vrouter_genl_family, skb, 0, 0, GFP_ATOMIC);
+#endif
+    if (ret == -ESRCH)
+        ret = 0;
+
+    return ret;
+}
+
+static bool
+netlink_trans_busy(void)
+{
+    return atomic_read(&vr_genetlink_waiting) > 0;
+}
+
 static struct vr_mtransport netlink_transport = {
     .mtrans_alloc              =       netlink_trans_alloc,
     .mtrans_free               =       netlink_trans_free,
+    .mtrans_notify             =       netlink_trans_notify,
+    .mtrans_busy               =       netlink_trans_busy,
 };
 
 
@@ -168,6 +259,16 @@ vr_genetlink_init(void)
     if (ret)
         return ret;
 
-    return genl_register_family_with_ops(&vrouter_genl_family, vrouter_genl_ops,
+    ret = genl_register_family_with_ops(&vrouter_genl_family, vrouter_genl_ops,
         ARRAY_SIZE(vrouter_genl_ops));
+    if (ret)
+        return ret;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0))
+    ret = genl_register_mc_group(&vrouter_genl_family, &vrouter_genl_events);
+    if (ret)
+        genl_unregister_family(&vrouter_genl_family);
+#endif
+
+    return ret;
 }
@@ -13,7 +13,12 @@
 #include <linux/if_vlan.h>
 #include <linux/if_arp.h>
 #include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
 #include <linux/jhash.h>
+#include <linux/cpu.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39))
 #include <linux/if_bridge.h>
@@ -31,6 +36,7 @@ extern int vhost_init(void);
 extern void vhost_exit(void);
 extern void vhost_if_add(struct vr_interface *);
 extern void vhost_if_del(struct net_device *dev);
+extern void vhost_dev_rx(struct net_device *, struct sk_buff *);
 
 static int vr_napi_poll(struct napi_struct *, int);
 static rx_handler_result_t pkt_gro_dev_rx_handler(struct sk_buff **);
@@ -47,6 +53,57 @@ typedef struct vr_rps_ {
     unsigned short vif_rid;
 } vr_rps_t;
 
+extern int vr_rx_burst;
+extern int vr_tx_burst;
+extern int vr_fabric_gro;
+extern int vr_flow_shard_node(unsigned int, unsigned int, unsigned short,
+        unsigned short, unsigned char);
+extern bool vr_flow_is_elephant(unsigned int, unsigned int, unsigned short,
+        unsigned short, unsigned char);
+extern int vr_udp_tunnel_gso;
+
+/*
+ * each virtual interface has a gro queue and napi context per cpu, so that
+ * cpus delivering to the same vm do not contend on one queue, and gro for
+ * a flow happens on the cpu the flow was received on
+ */
+struct vr_gro_queue {
+    struct napi_struct gq_napi;
+    struct sk_buff_head gq_skbq;
+    struct vr_interface *gq_vif;
+};
+
+/*
+ * when vr_rx_burst is set, the rx handler only queues the packets on a per
+ * cpu queue, and a napi poll on the same cpu hands them to dp-core in
+ * bursts of packets received on the same interface. since both run in
+ * softirq context on the owning cpu, the queue needs no lock.
+ */
+struct vr_rx_burstq {
+    struct napi_struct rb_napi;
+    struct sk_buff_head rb_skbq;
+};
+
+static DEFINE_PER_CPU(struct vr_rx_burstq, vr_rx_burstqs);
+
+/*
+ * with vr_tx_burst also set, packets that a receive burst sends out of a
+ * physical interface are held on a per cpu queue until dp-core is done
+ * with the burst, and then handed to the driver together, with xmit_more
+ * on all but the last of them, so that the nic doorbell is rung and the
+ * queue lock is taken once per burst. the burst goes around the qdisc
+ * (and the packet taps) of the device, as pktgen does.
+ */
+#define VR_TX_BURST_MAX     (2 * VR_FLOW_BATCH_MAX)
+
+struct vr_tx_burstq {
+    struct sk_buff_head tb_skbq;
+    struct net_device *tb_dev;
+    int tb_active;
+};
+
+static DEFINE_PER_CPU(struct vr_tx_burstq, vr_tx_burstqs);
+
 /*
  *  pkt_gro_dev - this is a device used to do receive offload on packets
  *  destined over a TAP interface to a VM.
@@ -129,8 +186,12 @@ linux_if_rx(struct vr_interface *vif, struct vr_packet *pkt)
         goto exit_rx;
     }
 
-    (void)__sync_fetch_and_add(&dev->stats.rx_bytes, skb->len);
-    (void)__sync_fetch_and_add(&dev->stats.rx_packets, 1);
+    if (vif_is_vhost(vif)) {
+        vhost_dev_rx(dev, skb);
+    } else {
+        (void)__sync_fetch_and_add(&dev->stats.rx_bytes, skb->len);
+        (void)__sync_fetch_and_add(&dev->stats.rx_packets, 1);
+    }
 
     /* this is only needed for mirroring */
     if ((pkt->vp_flags & VP_FLAG_FROM_DP) &&
@@ -237,15 +298,118 @@ linux_inet_fragment(struct vr_interface *vif, struct sk_buff *skb,
     return linux_xmit_segments(vif, segs, type);
 }
 
+/*
+ * vr_tx_burst_flush - hand the held packets to the driver, on the tx queue
+ * of this cpu. whatever the driver does not take (the queue is stopped,
+ * or full) goes through dev_queue_xmit, in order
+ */
+static void
+vr_tx_burst_flush(struct vr_tx_burstq *tbq)
+{
+    struct sk_buff *skb;
+    struct net_device *dev = tbq->tb_dev;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0))
+    int cpu = smp_processor_id();
+    u16 queue;
+    netdev_tx_t rc;
+    struct netdev_queue *txq;
+
+    if (!dev || skb_queue_empty(&tbq->tb_skbq))
+        goto flush_rest;
+
+    queue = cpu % dev->real_num_tx_queues;
+    txq = netdev_get_tx_queue(dev, queue);
+
+    __netif_tx_lock(txq, cpu);
+    while ((skb = skb_peek(&tbq->tb_skbq))) {
+        if (netif_xmit_frozen_or_stopped(txq))
+            break;
+
+        __skb_unlink(skb, &tbq->tb_skbq);
+        skb_set_queue_mapping(skb, queue);
+        rc = netdev_start_xmit(skb, dev, txq,
+                !skb_queue_empty(&tbq->tb_skbq));
+        if (!dev_xmit_complete(rc)) {
+            __skb_queue_head(&tbq->tb_skbq, skb);
+            break;
+        }
+    }
+    __netif_tx_unlock(txq);
+
+flush_rest:
+#endif
+    while ((skb = __skb_dequeue(&tbq->tb_skbq)))
+        dev_queue_xmit(skb);
+
+    tbq->tb_dev = NULL;
+    return;
+}
+
+/*
+ * vr_tx_burst_hold - hold skb for the flush at the end of the burst, if
+ * one is on, and if skb needs nothing of dev_queue_xmit (segmentation,
+ * checksum or vlan tag in software). returns true if skb was held
+ */
+static bool
+vr_tx_burst_hold(struct sk_buff *skb)
+{
+    struct net_device *dev = skb->dev;
+    struct vr_tx_burstq *tbq = this_cpu_ptr(&vr_tx_burstqs);
+
+    if (!tbq->tb_active)
+        return false;
+
+    if (skb_is_gso(skb) || (skb->vlan_tci & VLAN_TAG_PRESENT))
+        return false;
+
+    if (skb->ip_summed == CHECKSUM_PARTIAL &&
+            !(dev->features & (NETIF_F_IP_CSUM | NETIF_F_HW_CSUM)))
+        return false;
+
+    if ((tbq->tb_dev && tbq->tb_dev != dev) ||
+            skb_queue_len(&tbq->tb_skbq) >= VR_TX_BURST_MAX)
+        vr_tx_burst_flush(tbq);
+
+    tbq->tb_dev = dev;
+    __skb_queue_tail(&tbq->tb_skbq, skb);
+
+    return true;
+}
+
+static void
+vr_tx_burst_start(void)
+{
+    if (vr_tx_burst)
+        this_cpu_ptr(&vr_tx_burstqs)->tb_active = 1;
+
+    return;
+}
+
+static void
+vr_tx_burst_end(void)
+{
+    struct vr_tx_burstq *tbq = this_cpu_ptr(&vr_tx_burstqs);
+
+    tbq->tb_active = 0;
+    vr_tx_burst_flush(tbq);
+
+    return;
+}
+
 static int
 linux_xmit(struct vr_interface *vif, struct sk_buff *skb,
         unsigned short type)
 {
     unsigned short proto = ntohs(skb->protocol);
 
-    if (vif->vif_type != VIF_TYPE_PHYSICAL ||
-            skb->len <= skb->dev->mtu + skb->dev->hard_header_len)
+    if (vif->vif_type != VIF_TYPE_PHYSICAL)
+        return dev_queue_xmit(skb);
+
+    if (skb->len <= skb->dev->mtu + skb->dev->hard_header_len) {
+        if (vr_tx_burst_hold(skb))
+            return 0;
         return dev_queue_xmit(skb);
+    }
 
     if (proto == ETH_P_IP)
         return linux_inet_fragment(vif, skb, type);
@@ -346,9 +510,92 @@ linux_xmit_segments(struct vr_interface *vif, struct sk_buff *segs,
     return err;
 }
 
+#ifdef NETIF_F_GSO_UDP_TUNNEL
+/*
+ * linux_gso_tunnel_xmit - hand a tcp gso packet tunneled in udp (mpls over
+ * udp or vxlan) to a nic that can segment udp tunnels. the inner offsets
+ * are set for the nic, and the outer headers are made to look like that of
+ * one large packet, which the nic fixes up per segment. returns 0 if the
+ * packet went out, non zero if it has to be segmented in software.
+ */
+static int
+linux_gso_tunnel_xmit(struct vr_interface *vif, struct sk_buff *skb,
+        unsigned short type)
+{
+    unsigned int outer_off = ETH_HLEN, inner_mac_off;
+    struct vr_ip *iph;
+    struct udphdr *udph;
+    struct net_device *ndev = (struct net_device *)vif->vif_os;
+
+    if (!vr_udp_tunnel_gso)
+        return -EOPNOTSUPP;
+
+    if (type != VP_TYPE_IPOIP && type != VP_TYPE_L2OIP)
+        return -EOPNOTSUPP;
+
+    if (!(ndev->features & NETIF_F_GSO_UDP_TUNNEL) ||
+            !(ndev->hw_enc_features & NETIF_F_TSO))
+        return -EOPNOTSUPP;
+
+    if (!(skb_shinfo(skb)->gso_type & SKB_GSO_TCPV4) ||
+            (skb->ip_summed != CHECKSUM_PARTIAL))
+        return -EOPNOTSUPP;
+
+    if (!pskb_may_pull(skb, outer_off + sizeof(struct vr_ip)))
+        return -EOPNOTSUPP;
+
+    iph = (struct vr_ip *)(skb->data + outer_off);
+    if (iph->ip_proto != VR_IP_PROTO_UDP)
+        return -EOPNOTSUPP;
+
+    if (!pskb_may_pull(skb, outer_off + (iph->ip_hl * 4) +
+                sizeof(struct udphdr)))
+        return -EOPNOTSUPP;
+    iph = (struct vr_ip *)(skb->data + outer_off);
+
+    /*
+     * network and transport headers of the skb are those of the inner
+     * packet. they become the inner headers, and the outer ones take
+     * their place. mpls over udp has no inner l2 header
+     */
+    inner_mac_off = skb_network_offset(skb);
+    if (type == VP_TYPE_L2OIP)
+        inner_mac_off -= ETH_HLEN;
+
+    skb->encapsulation = 1;
+    skb_set_inner_mac_header(skb, inner_mac_off);
+    skb_set_inner_network_header(skb, skb_network_offset(skb));
+    skb_set_inner_transport_header(skb, skb_transport_offset(skb));
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0))
+    skb_set_inner_protocol(skb, (type == VP_TYPE_L2OIP) ?
+            htons(ETH_P_TEB) : htons(ETH_P_IP));
+#endif
+
+    skb_set_network_header(skb, outer_off);
+    skb_set_transport_header(skb, outer_off + (iph->ip_hl * 4));
+    skb_reset_mac_len(skb);
+
+    iph->ip_len = htons(skb->len - outer_off);
+    iph->ip_id = htons(vr_generate_unique_ip_id());
+    iph->ip_csum = 0;
+    iph->ip_csum = ip_fast_csum(iph, iph->ip_hl);
+
+    /* the nic does not fill the outer udp checksum for SKB_GSO_UDP_TUNNEL */
+    udph = udp_hdr(skb);
+    udph->len = htons(skb->len - skb_transport_offset(skb));
+    udph->check = 0;
+
+    skb_shinfo(skb)->gso_type |= SKB_GSO_UDP_TUNNEL;
+
+    dev_queue_xmit(skb);
+    return 0;
+}
+#endif
+
 /*
  * linux_gso_xmit - perform segmentation of the inner packet in software
- * and send each segment out the wire after fixing the outer header.
+ * and send each segment out the wire after fixing the outer header. udp
+ * tunneled packets go to the nic unsegmented, if the nic can do it.
  */
 static void
 linux_gso_xmit(struct vr_interface *vif, struct sk_buff *skb,
@@ -396,6 +643,11 @@ linux_gso_xmit(struct vr_interface *vif, struct sk_buff *skb,
             skb_shinfo(skb)->gso_size &= ~7;
     }
 
+#ifdef NETIF_F_GSO_UDP_TUNNEL
+    if (!linux_gso_tunnel_xmit(vif, skb, type))
+        return;
+#endif
+
     segs = skb_gso_segment(skb, features);
     kfree_skb(skb);
     if ((IS_ERR(segs)) || (segs == NULL)) {
@@ -407,8 +659,164 @@ linux_gso_xmit(struct vr_interface *vif, struct sk_buff *skb,
     return;
 }
 
+/*
+ * cpus (a cpu list, as in "4-7,12") that take only the packets of the
+ * elephant flows, when the flow table tracks the flow rates. the other
+ * flows are not steered to these cpus
+ */
+char *vr_elephant_cpus;
+
 #ifdef CONFIG_RPS
 
+static cpumask_t vr_elephant_cpumask;
+
+/*
+ * the steering candidates of each cpu: the online cpus on the same NUMA
+ * node, minus the cpu itself and its hyperthreads, and minus the elephant
+ * cpus. the online elephant cpus are in a row of their own. the table is
+ * built when the module loads and rebuilt on cpu hotplug, so that picking
+ * a cpu for a packet is an index into it. rows are nr_cpu_ids wide.
+ */
+struct vr_steer_table {
+    unsigned short *st_ncpus;
+    unsigned short *st_cpus;
+    unsigned short st_elephant_ncpus;
+    unsigned short *st_elephant_cpus;
+};
+
+static struct vr_steer_table *vr_steer_table;
+static DEFINE_MUTEX(vr_steer_table_lock);
+
+static struct vr_steer_table *
+linux_steer_table_build(void)
+{
+    unsigned int cpu, next, num_cpus;
+    unsigned int size;
+    struct vr_steer_table *st;
+
+    size = sizeof(*st) + (nr_cpu_ids * (nr_cpu_ids + 2) *
+            sizeof(unsigned short));
+    st = vmalloc(size);
+    if (!st)
+        return NULL;
+    memset(st, 0, size);
+
+    st->st_ncpus = (unsigned short *)(st + 1);
+    st->st_cpus = st->st_ncpus + nr_cpu_ids;
+    st->st_elephant_cpus = st->st_cpus + (nr_cpu_ids * nr_cpu_ids);
+
+    for_each_cpu(cpu, &vr_elephant_cpumask) {
+        if (cpu_online(cpu))
+            st->st_elephant_cpus[st->st_elephant_ncpus++] = cpu;
+    }
+
+    for_each_online_cpu(cpu) {
+        num_cpus = 0;
+        for_each_cpu(next, cpumask_of_node(cpu_to_node(cpu))) {
+            if (!cpu_online(next) ||
+                    cpumask_test_cpu(next, cpu_sibling_mask(cpu)))
+                continue;
+            if (st->st_elephant_ncpus &&
+                    cpumask_test_cpu(next, &vr_elephant_cpumask))
+                continue;
+            st->st_cpus[(cpu * nr_cpu_ids) + num_cpus++] = next;
+        }
+        st->st_ncpus[cpu] = num_cpus;
+    }
+
+    return st;
+}
+
+static void
+linux_steer_table_rebuild(void)
+{
+    struct vr_steer_table *st, *old;
+
+    st = linux_steer_table_build();
+    /* if we cannot get memory, the old table is still a sane choice */
+    if (!st)
+        return;
+
+    mutex_lock(&vr_steer_table_lock);
+    old = vr_steer_table;
+    rcu_assign_pointer(vr_steer_table, st);
+    mutex_unlock(&vr_steer_table_lock);
+
+    if (old) {
+        synchronize_rcu();
+        vfree(old);
+    }
+
+    return;
+}
+
+static int
+linux_steer_cpu_callback(struct notifier_block *nb, unsigned long action,
+        void *hcpu)
+{
+    switch (action & ~CPU_TASKS_FROZEN) {
+    case CPU_ONLINE:
+    case CPU_DEAD:
+        linux_steer_table_rebuild();
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_OK;
+}
+
+static struct notifier_block vr_steer_cpu_nb = {
+    .notifier_call      =       linux_steer_cpu_callback,
+};
+
+static void
+linux_steer_exit(void)
+{
+    unregister_hotcpu_notifier(&vr_steer_cpu_nb);
+    if (vr_steer_table) {
+        synchronize_rcu();
+        vfree(vr_steer_table);
+        vr_steer_table = NULL;
+    }
+
+    return;
+}
+
+static void
+linux_steer_init(void)
+{
+    cpumask_clear(&vr_elephant_cpumask);
+    if (vr_elephant_cpus && cpulist_parse(vr_elephant_cpus,
+                &vr_elephant_cpumask)) {
+        printk("vrouter: bad list of elephant cpus %s\n", vr_elephant_cpus);
+        cpumask_clear(&vr_elephant_cpumask);
+    }
+
+    get_online_cpus();
+    linux_steer_table_rebuild();
+    register_hotcpu_notifier(&vr_steer_cpu_nb);
+    put_online_cpus();
+
+    return;
+}
+
+/*
+ * scale the rx hash of the packet to an index between 0 and (num - 1)
+ */
+static inline unsigned int
+linux_rxhash_index(struct sk_buff *skb, unsigned int num)
+{
+    __u32 rxhash = skb_get_rxhash(skb);
+
+#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,32)) 
+    return ((u32)rxhash * num) >> 16;
+#else
+    return ((u64)rxhash * num) >> 32;
+#endif
+}
+
 /*
  * linux_get_rxq - get a receive queue for the packet on an interface that
  * has RPS enabled. The receive queue is picked such that it is different
@@ -419,44 +827,233 @@ linux_gso_xmit(struct vr_interface *vif, struct sk_buff *skb,
  * on the same NUMA node as the  current core (to minimize memory access
  * latency across NUMA nodes), except that hyper-threads of the current
  * and previous core are excluded as choices for the next CPU to process the
- * packet.
+ * packet. The candidates of the current core come from the steering table.
  */
 static void
 linux_get_rxq(struct sk_buff *skb, u16 *rxq, unsigned int curr_cpu,
               unsigned int prev_cpu)
 {
-    unsigned int next_cpu;
-    int numa_node = cpu_to_node(curr_cpu);
-    const struct cpumask *node_cpumask = cpumask_of_node(numa_node);
-    struct cpumask noht_cpumask;
-    unsigned int num_cpus, cpu, count = 0;
-    __u32 rxhash;
+    unsigned int i, next_cpu, num_cpus = 0;
+    unsigned short *cpus = NULL;
+    struct vr_steer_table *st;
+
+    *rxq = curr_cpu;
+
+    rcu_read_lock();
+    st = rcu_dereference(vr_steer_table);
+    if (st && (curr_cpu < nr_cpu_ids)) {
+        num_cpus = st->st_ncpus[curr_cpu];
+        cpus = &st->st_cpus[curr_cpu * nr_cpu_ids];
+    }
 
     /*
-     * We are running in softirq context, so CPUs can't be offlined
-     * underneath us. So, it is safe to use the NUMA node CPU bitmaps.
-     * Clear the bits corresponding to the current core and its hyperthreads
-     * in the node CPU mask.
+     * Not enough CPU cores available in this NUMA node. Continue
+     * processing the packet on the same CPU core.
      */
-    cpumask_andnot(&noht_cpumask, node_cpumask, cpu_sibling_mask(curr_cpu));
+    if (!num_cpus)
+        goto exit_rxq;
+
+    next_cpu = linux_rxhash_index(skb, num_cpus);
 
     /*
-     * If the previous CPU is specified, clear the bits corresponding to
-     * that core and its hyperthreads in the CPU mask.
+     * If the previous CPU is specified, move on from the hyperthreads of
+     * that core, if that is where the hash landed.
      */
     if (prev_cpu && (prev_cpu <= nr_cpu_ids)) {
-        cpumask_andnot(&noht_cpumask, &noht_cpumask,
-                       cpu_sibling_mask(prev_cpu-1));
+        for (i = 0; i < num_cpus; i++) {
+            if (!cpumask_test_cpu(cpus[next_cpu],
+                        cpu_sibling_mask(prev_cpu - 1)))
+                break;
+
+            if (++next_cpu == num_cpus)
+                next_cpu = 0;
+        }
+
+        if (i == num_cpus)
+            goto exit_rxq;
     }
 
-    num_cpus = cpumask_weight(&noht_cpumask);
+    *rxq = cpus[next_cpu];
+
+exit_rxq:
+    rcu_read_unlock();
+    return;
+}
+
+/*
+ * linux_flow_ports - the ip header at the network header of skb and the
+ * (network order) ports of the (inner) ip packet, 0 for packets other than
+ * unfragmented tcp and udp. NULL if the packet is not one that we can tell
+ */
+static struct iphdr *
+linux_flow_ports(struct sk_buff *skb, unsigned short *sport,
+        unsigned short *dport)
+{
+    unsigned char *hdr = skb_network_header(skb);
+    struct iphdr *iph = (struct iphdr *)hdr;
+    __be16 *ports;
+
+    *sport = *dport = 0;
+    if (hdr < skb->head || hdr + sizeof(*iph) > skb_tail_pointer(skb))
+        return NULL;
+
+    if (iph->version != 4)
+        return NULL;
+
+    if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) &&
+            !(iph->frag_off & htons(IP_MF | IP_OFFSET))) {
+        ports = (__be16 *)(hdr + (iph->ihl * 4));
+        if ((unsigned char *)(ports + 2) > skb_tail_pointer(skb))
+            return NULL;
+        *sport = ports[0];
+        *dport = ports[1];
+    }
+
+    return iph;
+}
+
+/*
+ * linux_flow_node - the numa node that keeps the flow of the (inner) ip
+ * packet at the network header of skb, when the flow table is sharded
+ * per node. -1 otherwise, or if the packet is not one that we can tell
+ */
+static int
+linux_flow_node(struct sk_buff *skb)
+{
+    unsigned short sport, dport;
+    struct iphdr *iph;
+
+    iph = linux_flow_ports(skb, &sport, &dport);
+    if (!iph)
+        return -1;
+
+    return vr_flow_shard_node(iph->saddr, iph->daddr, sport, dport,
+            iph->protocol);
+}
+
+/*
+ * linux_get_elephant_rxq - if the (inner) ip packet at the network header
+ * of skb is of an elephant flow, and there are elephant cpus, the receive
+ * queue of one of them. returns 1 if the packet is to be steered to *rxq
+ */
+static int
+linux_get_elephant_rxq(struct sk_buff *skb, u16 *rxq)
+{
+    int ret = 0;
+    unsigned short sport, dport;
+    struct iphdr *iph;
+    struct vr_steer_table *st;
+
+    iph = linux_flow_ports(skb, &sport, &dport);
+    if (!iph || !vr_flow_is_elephant(iph->saddr, iph->daddr, sport, dport,
+                iph->protocol))
+        return 0;
+
+    rcu_read_lock();
+    st = rcu_dereference(vr_steer_table);
+    if (st && st->st_elephant_ncpus) {
+        *rxq = st->st_elephant_cpus[linux_rxhash_index(skb,
+                st->st_elephant_ncpus)];
+        ret = 1;
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+ * linux_get_flow_rxq - as linux_get_rxq, but on the node of the flow of
+ * the packet when the flow table is sharded, so that the flow lookups of
+ * both the directions of a flow are on the memory of the local node
+ */
+static void
+linux_get_flow_rxq(struct sk_buff *skb, u16 *rxq, unsigned int curr_cpu,
+        unsigned int prev_cpu)
+{
+    int node;
+    unsigned int cpu, count = 0, next_cpu;
+
+    node = linux_flow_node(skb);
+    if (node < 0 || node >= nr_node_ids || node == cpu_to_node(curr_cpu)) {
+        linux_get_rxq(skb, rxq, curr_cpu, prev_cpu);
+        return;
+    }
+
+    for_each_cpu(cpu, cpumask_of_node(node)) {
+        if (cpu_online(cpu))
+            count++;
+    }
+
+    if (!count) {
+        linux_get_rxq(skb, rxq, curr_cpu, prev_cpu);
+        return;
+    }
+
+    next_cpu = linux_rxhash_index(skb, count);
+    for_each_cpu(cpu, cpumask_of_node(node)) {
+        if (!cpu_online(cpu))
+            continue;
+        if (!next_cpu--)
+            break;
+    }
+
+    *rxq = (cpu < nr_cpu_ids) ? cpu : curr_cpu;
+    return;
+}
+
+/*
+ * linux_steer_rxq - pick the receive queue for a packet of vif as per the
+ * steering policy of the vif. vifs without a policy of their own go by
+ * the global knobs that are passed in (perfr to enable, perfq to pin the
+ * queue). returns 1 if the packet is to be steered to *rxq, 0 if it is to
+ * stay on this core. inner is set when the network header of skb is that
+ * of the packet of the vm, so that the node of its flow can be picked, and
+ * the packets of elephant flows go to the elephant cpus.
+ */
+static int
+linux_steer_rxq(struct vr_interface *vif, struct sk_buff *skb, int perfr,
+        int perfq, unsigned int prev_cpu, bool inner, u16 *rxq)
+{
+    unsigned int num_cpus;
+
+    switch (vif->vif_steer_policy) {
+    case VIF_STEER_SAME_CORE:
+        return 0;
+
+    case VIF_STEER_NODE:
+        if (inner && linux_get_elephant_rxq(skb, rxq))
+            return 1;
+
+        if (inner)
+            linux_get_flow_rxq(skb, rxq, vr_get_cpu(), prev_cpu);
+        else
+            linux_get_rxq(skb, rxq, vr_get_cpu(), prev_cpu);
+        return 1;
+
+    case VIF_STEER_CPUS:
+        num_cpus = vif->vif_steer_ncpus;
+        if (!num_cpus)
+            return 0;
+
+        *rxq = vif->vif_steer_cpus[linux_rxhash_index(skb, num_cpus)];
+        return 1;
+
+    default:
+        if (!perfr)
+            return 0;
+
+        if (perfq)
+            *rxq = perfq;
+        else if (inner && linux_get_elephant_rxq(skb, rxq))
+            return 1;
+        else if (inner)
+            linux_get_flow_rxq(skb, rxq, vr_get_cpu(), prev_cpu);
+        else
+            linux_get_rxq(skb, rxq, vr_get_cpu(), prev_cpu);
+        return 1;
+    }
+}
 
-    if (num_cpus) {
-        rxhash = skb_get_rxhash(skb);
-#if (LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,32)) 
-        next_cpu = ((u32)rxhash * num_cpus) >> 16;
-#else
-        next_cpu = ((u64)rxhash * num_cpus) >> 32;
 #endif
 
         /*
@@ -493,13 +1090,14 @@ linux_get_rxq(struct sk_buff *skb, u16 *rxq, unsigned int curr_cpu,
 #endif
 
 /*
- * linux_enqueue_pkt_for_gro - enqueue packet on a list of skbs and schedule a
- * NAPI event on the NAPI structure of the vif.
+ * linux_enqueue_pkt_for_gro - enqueue packet on the vif's list of skbs for
+ * the current cpu and schedule a NAPI event on the matching NAPI structure.
  *
  */
 void
 linux_enqueue_pkt_for_gro(struct sk_buff *skb, struct vr_interface *vif)
 {
+    struct vr_gro_queue *gq;
 #ifdef CONFIG_RPS
     u16 rxq;
     unsigned int curr_cpu = 0;
@@ -507,16 +1105,13 @@ linux_enqueue_pkt_for_gro(struct sk_buff *skb, struct vr_interface *vif)
 
     /*
      * vr_perfr1 only takes effect if vr_perfr3 is not set. Also, if we are
-     * coming here after RPS (skb->dev is pkt_rps_dev), vr_perfr1 is a no-op
+     * coming here after RPS (skb->dev is pkt_rps_dev), vr_perfr1 (or the
+     * steering policy of the vif) is a no-op
      */
-    if (vr_perfr1 && (!vr_perfr3) && (skb->dev != pkt_rps_dev)) {
+    if ((skb->dev != pkt_rps_dev) &&
+            linux_steer_rxq(vif, skb, vr_perfr1 && (!vr_perfr3),
+                vr_perfq1, 0, true, &rxq)) {
         curr_cpu = vr_get_cpu();
-        if (vr_perfq1) {
-            rxq = vr_perfq1;
-        } else {
-            linux_get_rxq(skb, &rxq, curr_cpu, 0);
-        }
-
         skb_record_rx_queue(skb, rxq);
         /*
          * Store current CPU in rxhash of skb
@@ -548,7 +1143,7 @@ linux_enqueue_pkt_for_gro(struct sk_buff *skb, struct vr_interface *vif)
              */
             prev_cpu = vr_skb_get_rxhash(skb);
             vr_skb_set_rxhash(skb, 0);   
-            linux_get_rxq(skb, &rxq, vr_get_cpu(),
+            linux_get_flow_rxq(skb, &rxq, vr_get_cpu(),
                           (vr_perfr1 || vr_perfr3) ? 
                               prev_cpu+1 : 0);
         }
@@ -562,8 +1157,9 @@ linux_enqueue_pkt_for_gro(struct sk_buff *skb, struct vr_interface *vif)
 
     skb->dev = pkt_gro_dev;
 
-    skb_queue_tail(&vif->vr_skb_inputq, skb);
-    napi_schedule(&vif->vr_napi);
+    gq = per_cpu_ptr(vif->vr_gro_queues, vr_get_cpu());
+    skb_queue_tail(&gq->gq_skbq, skb);
+    napi_schedule(&gq->gq_napi);
 
     return;
 }
@@ -647,7 +1243,7 @@ static void __skb_dump_info(const char *prefix, const struct sk_buff *skb,
 #endif
 
 static int
-linux_if_tx(struct vr_interface *vif, struct vr_packet *pkt)
+__linux_if_tx(struct vr_interface *vif, struct vr_packet *pkt)
 {
     struct net_device *dev = (struct net_device *)vif->vif_os;
     struct sk_buff *skb = vp_os_packet(pkt);
@@ -750,6 +1346,18 @@ linux_if_tx(struct vr_interface *vif, struct vr_packet *pkt)
     return 0;
 }
 
+static int
+linux_if_tx(struct vr_interface *vif, struct vr_packet *pkt)
+{
+    int ret;
+    uint64_t start = vr_perf_start();
+
+    ret = __linux_if_tx(vif, pkt);
+    vr_perf_end(VR_PERF_IF_TX, start, 1);
+
+    return ret;
+}
+
 inline struct vr_packet *
 linux_get_packet(struct sk_buff *skb, struct vr_interface *vif)
 {
@@ -778,6 +1386,7 @@ linux_get_packet(struct sk_buff *skb, struct vr_interface *vif)
     pkt->vp_len = skb_headlen(skb);
     pkt->vp_if = vif;
     pkt->vp_network_h = pkt->vp_inner_network_h = 0;
+    pkt->vp_transport_h = 0;
     pkt->vp_nh = NULL;
     pkt->vp_flags = 0;
     if (skb->ip_summed == CHECKSUM_PARTIAL)
@@ -869,6 +1478,452 @@ vr_post_rps_outer_get_phys_dev(struct sk_buff *skb)
     return dev;
 }
 
+/*
+ * vr_rx_burst_enqueue - queue a packet for the burst receive. the interface
+ * is stored in the skb the same way as for RPS, since the vr_packet is
+ * made only when the burst is handed to dp-core
+ */
+static void
+vr_rx_burst_enqueue(struct sk_buff *skb, struct vr_interface *vif)
+{
+    struct vr_rx_burstq *rbq = this_cpu_ptr(&vr_rx_burstqs);
+
+    ((vr_rps_t *)skb->cb)->vif_idx = vif->vif_idx;
+    ((vr_rps_t *)skb->cb)->vif_rid = vif->vif_rid;
+
+    __skb_queue_tail(&rbq->rb_skbq, skb);
+    napi_schedule(&rbq->rb_napi);
+
+    return;
+}
+
+/*
+ * with vr_fabric_gro also set, the receive burst merges a train of tcp
+ * segments of one inner flow, that come in the same tunnel (mplsogre,
+ * mplsoudp or vxlan) from the fabric, into one gso packet, before dp-core
+ * sees them. the packet is then decapsulated, and its label and flow
+ * looked up, once for the train. segments are merged under the rules of
+ * the gro of the kernel: no ip options or fragments, only ack (and psh),
+ * same ack, window and tcp options, in sequence, and all but the last of
+ * the size of the first. the nic has to have checked the checksums.
+ */
+#define VR_FGRO_MAX_SEGS        44
+#define VR_FGRO_PULL_LEN        160
+
+struct vr_fgro {
+    struct sk_buff *fg_head;
+    struct sk_buff *fg_last;
+    struct vr_interface *fg_vif;
+    /* of the inner ip header, and of the tcp payload, from skb->data */
+    unsigned short fg_inner_off;
+    unsigned short fg_hdr_len;
+    unsigned short fg_mss;
+    unsigned short fg_segs;
+    unsigned int fg_next_seq;
+    bool fg_psh;
+    bool fg_closed;
+};
+
+/*
+ * vr_fgro_parse - find the inner tcp segment of a tunneled packet, with
+ * skb->data at the outer ip header. returns the length of the payload of
+ * the segment, -1 if the packet is not one that can be merged
+ */
+static int
+vr_fgro_parse(struct sk_buff *skb, unsigned short *inner_off,
+        unsigned short *hdr_len)
+{
+    unsigned int off, pull_len, thlen;
+    unsigned char *data;
+    struct iphdr *oiph, *iph;
+    struct udphdr *udph;
+    struct vr_gre *greh;
+    struct tcphdr *tcph;
+
+    if (skb->ip_summed != CHECKSUM_UNNECESSARY || skb_cloned(skb) ||
+            skb_is_gso(skb) || skb_has_frag_list(skb))
+        return -1;
+
+    pull_len = min(skb->len, (unsigned int)VR_FGRO_PULL_LEN);
+    if (!pskb_may_pull(skb, pull_len))
+        return -1;
+
+    data = skb->data;
+    oiph = (struct iphdr *)data;
+    if (pull_len < sizeof(*oiph) + sizeof(*udph) || oiph->version != 4 ||
+            oiph->ihl != 5 || (oiph->frag_off & htons(IP_MF | IP_OFFSET)) ||
+            ntohs(oiph->tot_len) != skb->len)
+        return -1;
+
+    off = sizeof(*oiph);
+    if (oiph->protocol == IPPROTO_UDP) {
+        udph = (struct udphdr *)(data + off);
+        off += sizeof(*udph);
+        if (udph->dest == htons(VR_VXLAN_UDP_DST_PORT)) {
+            off += sizeof(struct vr_vxlan);
+            if (off + ETH_HLEN + sizeof(*iph) > pull_len ||
+                    ((struct ethhdr *)(data + off))->h_proto !=
+                    htons(ETH_P_IP))
+                return -1;
+            off += ETH_HLEN;
+            goto inner_ip;
+        } else if (udph->dest != htons(VR_MPLS_OVER_UDP_DST_PORT)) {
+            return -1;
+        }
+    } else if (oiph->protocol == IPPROTO_GRE) {
+        greh = (struct vr_gre *)(data + off);
+        if (greh->gre_flags || greh->gre_proto != VR_GRE_PROTO_MPLS_NO)
+            return -1;
+        off += sizeof(*greh);
+    } else {
+        return -1;
+    }
+
+    /* only l3 labels, that carry the ip packet right after the label */
+    if (off + VR_MPLS_HDR_LEN + sizeof(*iph) > pull_len ||
+            !(ntohl(*(__be32 *)(data + off)) & VR_MPLS_STACK_BIT))
+        return -1;
+    off += VR_MPLS_HDR_LEN;
+
+inner_ip:
+    iph = (struct iphdr *)(data + off);
+    if (iph->version != 4 || iph->ihl != 5 || iph->protocol != IPPROTO_TCP ||
+            (iph->frag_off & htons(IP_MF | IP_OFFSET)) ||
+            ntohs(iph->tot_len) != skb->len - off)
+        return -1;
+    *inner_off = off;
+    off += sizeof(*iph);
+
+    if (off + sizeof(*tcph) > pull_len)
+        return -1;
+    tcph = (struct tcphdr *)(data + off);
+    thlen = tcph->doff * 4;
+    if (thlen < sizeof(*tcph) || off + thlen > pull_len)
+        return -1;
+
+    if (!tcph->ack || tcph->syn || tcph->fin || tcph->rst || tcph->urg ||
+            tcph->cwr || tcph->ece)
+        return -1;
+    off += thlen;
+
+    /* pure acks go as they are */
+    if (skb->len <= off)
+        return -1;
+
+    *hdr_len = off;
+    return skb->len - off;
+}
+
+/*
+ * whether the headers of skb are those of the head of the train, but for
+ * what changes from one segment to the next (lengths, ids, checksums and
+ * sequence numbers, and the psh flag)
+ */
+static bool
+vr_fgro_match(struct vr_fgro *fg, struct sk_buff *skb)
+{
+    unsigned char *h = fg->fg_head->data, *s = skb->data;
+    unsigned int i, o, t = fg->fg_inner_off + sizeof(struct iphdr);
+    struct iphdr *hiph = (struct iphdr *)h, *siph = (struct iphdr *)s;
+
+    /* the outer ip header */
+    if (hiph->tos != siph->tos || hiph->ttl != siph->ttl ||
+            hiph->protocol != siph->protocol ||
+            hiph->saddr != siph->saddr || hiph->daddr != siph->daddr)
+        return false;
+
+    /* the tunnel header and the label, past the length of a udp header */
+    o = sizeof(struct iphdr);
+    if (hiph->protocol == IPPROTO_UDP) {
+        if (memcmp(h + o, s + o, 4))
+            return false;
+        o += sizeof(struct udphdr);
+    }
+    if (memcmp(h + o, s + o, fg->fg_inner_off - o))
+        return false;
+
+    /* the inner ip header */
+    hiph = (struct iphdr *)(h + fg->fg_inner_off);
+    siph = (struct iphdr *)(s + fg->fg_inner_off);
+    if (hiph->tos != siph->tos || hiph->ttl != siph->ttl ||
+            hiph->saddr != siph->saddr || hiph->daddr != siph->daddr)
+        return false;
+
+    /* ports, then ack, then all of the rest but the flags and checksum */
+    if (memcmp(h + t, s + t, 4) || memcmp(h + t + 8, s + t + 8, 5) ||
+            ((h[t + 13] ^ s[t + 13]) & ~0x08) ||
+            memcmp(h + t + 14, s + t + 14, 2))
+        return false;
+
+    for (i = t + 18; i < fg->fg_hdr_len; i++) {
+        if (h[i] != s[i])
+            return false;
+    }
+
+    return true;
+}
+
+/* returns true if skb was added to the train of fg */
+static bool
+vr_fgro_merge(struct vr_fgro *fg, struct sk_buff *skb,
+        struct vr_interface *vif)
+{
+    int len;
+    unsigned short inner_off, hdr_len;
+    struct tcphdr *tcph;
+
+    if (!fg->fg_head || fg->fg_closed || fg->fg_vif != vif)
+        return false;
+
+    len = vr_fgro_parse(skb, &inner_off, &hdr_len);
+    if (len < 0 || inner_off != fg->fg_inner_off ||
+            hdr_len != fg->fg_hdr_len || len > fg->fg_mss ||
+            fg->fg_head->len + len > 0xFFFF)
+        return false;
+
+    tcph = (struct tcphdr *)(skb->data + inner_off + sizeof(struct iphdr));
+    if (ntohl(tcph->seq) != fg->fg_next_seq || !vr_fgro_match(fg, skb))
+        return false;
+
+    fg->fg_next_seq += len;
+    fg->fg_psh |= tcph->psh;
+    fg->fg_segs++;
+    /* a short segment, or one that is pushed, ends the train */
+    if (len < fg->fg_mss || tcph->psh || fg->fg_segs == VR_FGRO_MAX_SEGS)
+        fg->fg_closed = true;
+
+    skb_pull(skb, hdr_len);
+    skb->next = NULL;
+    if (fg->fg_last == fg->fg_head)
+        skb_shinfo(fg->fg_head)->frag_list = skb;
+    else
+        fg->fg_last->next = skb;
+    fg->fg_last = skb;
+
+    fg->fg_head->len += skb->len;
+    fg->fg_head->data_len += skb->len;
+    fg->fg_head->truesize += skb->truesize;
+
+    return true;
+}
+
+/* returns true if skb now heads the train of fg */
+static bool
+vr_fgro_start(struct vr_fgro *fg, struct sk_buff *skb,
+        struct vr_interface *vif)
+{
+    int len;
+    struct tcphdr *tcph;
+
+    len = vr_fgro_parse(skb, &fg->fg_inner_off, &fg->fg_hdr_len);
+    if (len < 0)
+        return false;
+
+    tcph = (struct tcphdr *)(skb->data + fg->fg_inner_off +
+            sizeof(struct iphdr));
+    if (tcph->psh)
+        return false;
+
+    fg->fg_head = fg->fg_last = skb;
+    fg->fg_vif = vif;
+    fg->fg_mss = len;
+    fg->fg_segs = 1;
+    fg->fg_next_seq = ntohl(tcph->seq) + len;
+    fg->fg_psh = false;
+    fg->fg_closed = false;
+
+    return true;
+}
+
+/*
+ * vr_fgro_flush - end the train of fg. a train of more than one segment
+ * becomes a tcp gso packet, the headers of which have the lengths of the
+ * whole, and the checksum of which is left to whoever segments it, or to
+ * the vm
+ */
+static struct sk_buff *
+vr_fgro_flush(struct vr_fgro *fg, struct vr_interface **vifp)
+{
+    unsigned int tcplen;
+    struct sk_buff *skb = fg->fg_head;
+    struct iphdr *iph;
+    struct udphdr *udph;
+    struct tcphdr *tcph;
+    struct skb_shared_info *sinfo;
+
+    if (!skb)
+        return NULL;
+
+    fg->fg_head = fg->fg_last = NULL;
+    *vifp = fg->fg_vif;
+    if (fg->fg_segs == 1)
+        return skb;
+
+    iph = (struct iphdr *)skb->data;
+    iph->tot_len = htons(skb->len);
+    iph->check = 0;
+    iph->check = ip_fast_csum((unsigned char *)iph, iph->ihl);
+    if (iph->protocol == IPPROTO_UDP) {
+        udph = (struct udphdr *)(skb->data + sizeof(*iph));
+        udph->len = htons(skb->len - sizeof(*iph));
+        udph->check = 0;
+    }
+
+    iph = (struct iphdr *)(skb->data + fg->fg_inner_off);
+    iph->tot_len = htons(skb->len - fg->fg_inner_off);
+    iph->check = 0;
+    iph->check = ip_fast_csum((unsigned char *)iph, iph->ihl);
+
+    tcph = (struct tcphdr *)(skb->data + fg->fg_inner_off + sizeof(*iph));
+    tcph->psh = fg->fg_psh;
+    tcplen = skb->len - fg->fg_inner_off - sizeof(*iph);
+    tcph->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, tcplen,
+            IPPROTO_TCP, 0);
+
+    skb->ip_summed = CHECKSUM_PARTIAL;
+    skb->csum_start = skb_headroom(skb) + fg->fg_inner_off + sizeof(*iph);
+    skb->csum_offset = offsetof(struct tcphdr, check);
+
+    sinfo = skb_shinfo(skb);
+    sinfo->gso_size = fg->fg_mss;
+    sinfo->gso_type = SKB_GSO_TCPV4;
+    sinfo->gso_segs = fg->fg_segs;
+
+    return skb;
+}
+
+/* the packets of a receive burst, of the same interface */
+struct vr_rx_burst {
+    struct vr_interface *rb_vif;
+    unsigned int rb_num;
+    struct vr_packet *rb_pkts[VR_FLOW_BATCH_MAX];
+};
+
+/* the packets that the burst sends to the fabric go out together */
+static void
+vr_rx_burst_process(struct vr_interface *vif, struct vr_packet **pkts,
+        unsigned int num_pkts)
+{
+    vr_tx_burst_start();
+    vr_interface_rx_burst(vif, pkts, num_pkts);
+    vr_tx_burst_end();
+
+    return;
+}
+
+static void
+vr_rx_burst_add(struct vr_rx_burst *rb, struct sk_buff *skb,
+        struct vr_interface *vif)
+{
+    struct vr_packet *pkt;
+
+    if ((vif != rb->rb_vif) || (rb->rb_num == VR_FLOW_BATCH_MAX)) {
+        if (rb->rb_num)
+            vr_rx_burst_process(rb->rb_vif, rb->rb_pkts, rb->rb_num);
+        rb->rb_num = 0;
+        rb->rb_vif = vif;
+    }
+
+    skb_push(skb, ETH_HLEN);
+    pkt = linux_get_packet(skb, vif);
+    if (pkt)
+        rb->rb_pkts[rb->rb_num++] = pkt;
+
+    return;
+}
+
+static int
+vr_rx_burst_poll(struct napi_struct *napi, int budget)
+{
+    int quota = 0;
+    struct sk_buff *skb, *train;
+    struct vrouter *router;
+    struct vr_packet *pkt;
+    struct vr_interface *vif, *train_vif;
+    struct vr_rx_burstq *rbq;
+    struct vr_rx_burst rb = { .rb_vif = NULL, .rb_num = 0 };
+    struct vr_fgro fg = { .fg_head = NULL };
+
+    rbq = container_of(napi, struct vr_rx_burstq, rb_napi);
+
+    while ((quota < budget) && (skb = __skb_dequeue(&rbq->rb_skbq))) {
+        quota++;
+
+        vif = NULL;
+        router = vrouter_get(((vr_rps_t *)skb->cb)->vif_rid);
+        if (router)
+            vif = __vrouter_get_interface(router,
+                    ((vr_rps_t *)skb->cb)->vif_idx);
+        if (!vif || !vif->vif_os) {
+            pkt = linux_get_packet(skb, NULL);
+            if (pkt)
+                vr_pfree(pkt, VP_DROP_MISC);
+            continue;
+        }
+
+        if (vr_fabric_gro && (vif->vif_type == VIF_TYPE_PHYSICAL)) {
+            if (vr_fgro_merge(&fg, skb, vif))
+                continue;
+            if ((train = vr_fgro_flush(&fg, &train_vif)))
+                vr_rx_burst_add(&rb, train, train_vif);
+            if (vr_fgro_start(&fg, skb, vif))
+                continue;
+        } else if ((train = vr_fgro_flush(&fg, &train_vif))) {
+            vr_rx_burst_add(&rb, train, train_vif);
+        }
+
+        vr_rx_burst_add(&rb, skb, vif);
+    }
+
+    if ((train = vr_fgro_flush(&fg, &train_vif)))
+        vr_rx_burst_add(&rb, train, train_vif);
+
+    if (rb.rb_num)
+        vr_rx_burst_process(rb.rb_vif, rb.rb_pkts, rb.rb_num);
+
+    if (quota < budget) {
+        napi_complete(napi);
+        return quota;
+    }
+
+    return budget;
+}
+
+static void
+vr_rx_burst_exit(void)
+{
+    int cpu;
+    struct vr_rx_burstq *rbq;
+
+    for_each_possible_cpu(cpu) {
+        rbq = &per_cpu(vr_rx_burstqs, cpu);
+        napi_disable(&rbq->rb_napi);
+        netif_napi_del(&rbq->rb_napi);
+        __skb_queue_purge(&rbq->rb_skbq);
+        __skb_queue_purge(&per_cpu(vr_tx_burstqs, cpu).tb_skbq);
+    }
+
+    return;
+}
+
+static void
+vr_rx_burst_init(void)
+{
+    int cpu;
+    struct vr_rx_burstq *rbq;
+
+    for_each_possible_cpu(cpu) {
+        rbq = &per_cpu(vr_rx_burstqs, cpu);
+        __skb_queue_head_init(&rbq->rb_skbq);
+        __skb_queue_head_init(&per_cpu(vr_tx_burstqs, cpu).tb_skbq);
+        netif_napi_add(pkt_gro_dev, &rbq->rb_napi, vr_rx_burst_poll,
+                VR_FLOW_BATCH_MAX);
+        napi_enable(&rbq->rb_napi);
+    }
+
+    return;
+}
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39))
 rx_handler_result_t
 linux_rx_handler(struct sk_buff **pskb)
@@ -913,19 +1968,15 @@ linux_rx_handler(struct sk_buff **pskb)
 
 #ifdef CONFIG_RPS
     /*
-     * Send the packet to another CPU core if vr_perfr3 is set. The new
-     * CPU core is chosen based on a hash of the outer header. This only needs
-     * to be done for packets arriving on a physical interface. Also, we
-     * only need to do this if RPS hasn't already happened.
+     * Send the packet to another CPU core if vr_perfr3 is set, or if the
+     * steering policy of the interface says so. The new CPU core is chosen
+     * based on a hash of the outer header. This only needs to be done for
+     * packets arriving on a physical interface. Also, we only need to do
+     * this if RPS hasn't already happened.
      */
-    if (vr_perfr3 && (!rpsdev) && (vif->vif_type == VIF_TYPE_PHYSICAL)) {
+    if ((!rpsdev) && (vif->vif_type == VIF_TYPE_PHYSICAL) &&
+            linux_steer_rxq(vif, skb, vr_perfr3, vr_perfq3, 0, false, &rxq)) {
         curr_cpu = vr_get_cpu();
-        if (vr_perfq3) {
-            rxq = vr_perfq3;
-        } else {
-            linux_get_rxq(skb, &rxq, curr_cpu, 0);
-        }
-
         skb_record_rx_queue(skb, rxq);
         vr_skb_set_rxhash(skb, curr_cpu);
         skb->dev = pkt_rps_dev;
@@ -941,6 +1992,11 @@ linux_rx_handler(struct sk_buff **pskb)
     }
 #endif
 
+    if (vr_rx_burst && !(skb->vlan_tci & VLAN_TAG_PRESENT)) {
+        vr_rx_burst_enqueue(skb, vif);
+        return RX_HANDLER_CONSUMED;
+    }
+
     skb_push(skb, ETH_HLEN);
 
     pkt = linux_get_packet(skb, vif);
@@ -997,7 +2053,7 @@ vr_interface_bridge_hook(struct net_bridge_port *port, struct sk_buff *skb)
         pkt_gro_dev_rx_handler(&skb);
         return NULL;
     } else if (skb->dev == pkt_rps_dev) {
-        if (!vr_perfr3) {
+        if (!((vr_rps_t *)skb->cb)->vif_idx) {
             pkt_rps_dev_rx_handler(&skb);
             return NULL;
         }
@@ -1194,20 +2250,63 @@ linux_if_tx_csum_offload(struct net_device *dev)
     return 0;
 }
 
+static void
+linux_if_gro_queues_free(struct vr_interface *vif)
+{
+    int cpu;
+    struct vr_gro_queue *gq;
+
+    if (!vif->vr_gro_queues)
+        return;
+
+    for_each_possible_cpu(cpu) {
+        gq = per_cpu_ptr(vif->vr_gro_queues, cpu);
+        napi_disable(&gq->gq_napi);
+        netif_napi_del(&gq->gq_napi);
+        skb_queue_purge(&gq->gq_skbq);
+    }
+
+    free_percpu(vif->vr_gro_queues);
+    vif->vr_gro_queues = NULL;
+
+    return;
+}
+
+static int
+linux_if_gro_queues_alloc(struct vr_interface *vif)
+{
+    int cpu;
+    struct vr_gro_queue *gq;
+
+    vif->vr_gro_queues = alloc_percpu(struct vr_gro_queue);
+    if (!vif->vr_gro_queues)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        gq = per_cpu_ptr(vif->vr_gro_queues, cpu);
+        gq->gq_vif = vif;
+        skb_queue_head_init(&gq->gq_skbq);
+        netif_napi_add(pkt_gro_dev, &gq->gq_napi, vr_napi_poll, 64);
+        napi_enable(&gq->gq_napi);
+    }
+
+    return 0;
+}
+
 static int
 linux_if_del(struct vr_interface *vif)
 {
     if (vif_is_vhost(vif))
         vhost_if_del((struct net_device *)vif->vif_os);
 
-    if (vif->vif_type == VIF_TYPE_VIRTUAL) {
-        napi_disable(&vif->vr_napi);
-        netif_napi_del(&vif->vr_napi);
-        skb_queue_purge(&vif->vr_skb_inputq);
-    }
+    if (vif->vif_type == VIF_TYPE_VIRTUAL)
+        linux_if_gro_queues_free(vif);
 
-    if (vif->vif_os)
+    if (vif->vif_os) {
+        ((struct net_device *)vif->vif_os)->needed_headroom =
+            vif->vif_os_headroom;
         dev_put((struct net_device *)vif->vif_os);
+    }
 
     vif->vif_os = NULL;
     vif->vif_os_idx = 0;
@@ -1218,13 +2317,31 @@ linux_if_del(struct vr_interface *vif)
 static int
 linux_if_add(struct vr_interface *vif)
 {
+    int ret;
     struct net_device *dev;
 
+    if (vif->vif_type == VIF_TYPE_VIRTUAL) {
+        ret = linux_if_gro_queues_alloc(vif);
+        if (ret)
+            return ret;
+    }
+
     if (vif->vif_os_idx) {
         dev = dev_get_by_index(&init_net, vif->vif_os_idx);
-        if (!dev)
+        if (!dev) {
+            linux_if_gro_queues_free(vif);
             return -ENODEV;
+        }
         vif->vif_os = (void *)dev;
+
+        /*
+         * have the stack leave room in front of the packets it builds for
+         * the device, so that the headers we push need no new head
+         */
+        vif->vif_os_headroom = dev->needed_headroom;
+        if (dev->needed_headroom < vif->vif_headroom)
+            dev->needed_headroom = vif->vif_headroom;
+
         if (vif->vif_type == VIF_TYPE_PHYSICAL) {
             if (linux_if_tx_csum_offload(dev)) {
                 vif->vif_flags |= VIF_FLAG_TX_CSUM_OFFLOAD;
@@ -1235,12 +2352,6 @@ linux_if_add(struct vr_interface *vif)
     if (vif_is_vhost(vif))
         vhost_if_add(vif);
 
-    if (vif->vif_type == VIF_TYPE_VIRTUAL) {
-        skb_queue_head_init(&vif->vr_skb_inputq);
-        netif_napi_add(pkt_gro_dev, &vif->vr_napi, vr_napi_poll, 64);
-        napi_enable(&vif->vr_napi);
-    }
-
     return 0;
 }
 
@@ -1381,7 +2492,7 @@ pkt_gro_dev_rx_handler(struct sk_buff **pskb)
         return RX_HANDLER_CONSUMED;
     }
 
-    nh = router->vr_ilm[label];
+    nh = ((struct vr_nexthop **)vr_replica(router->vr_ilm_replicas))[label];
     if (!nh) {
         kfree_skb(skb);
         return RX_HANDLER_CONSUMED;
@@ -1423,7 +2534,14 @@ pkt_rps_dev_rx_handler(struct sk_buff **pskb)
     struct vr_interface *vif;
     struct vrouter *router = vrouter_get(0);  
 
-    if (vr_perfr3) {
+    /*
+     * If RPS was scheduled earlier on the inner headers (vr_perfr1 or the
+     * steering policy of the virtual interface), the vif_idx in skb->cb
+     * is 0. If it is non-zero, RPS was done on the outer header of a
+     * packet from the physical interface (vr_perfr3 or the policy of the
+     * physical interface), and the packet is yet to be received.
+     */
+    if (((vr_rps_t *)skb->cb)->vif_idx) {
 #if (LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,32))
         ASSERT(0);
 #else
@@ -1433,18 +2551,6 @@ pkt_rps_dev_rx_handler(struct sk_buff **pskb)
 
     pkt = (struct vr_packet *)skb->cb;
 
-    /*
-     * If RPS was scheduled earlier because of vr_perfr1 being set, the
-     * vif_idx in skb->cb should be 0. If it is non-zero, RPS was scheduled
-     * because of vr_perfr3 being set earlier (and now vr_perfr3 has been
-     * cleared). Drop the packet in this corner case.
-     */
-    if (((vr_rps_t *)skb->cb)->vif_idx) {
-        vr_pfree(pkt, VP_DROP_MISC);
-
-        return RX_HANDLER_CONSUMED;
-    }
-
     label = ntohl(*((unsigned int *) skb_mac_header(skb)));
     label >>= VR_MPLS_LABEL_SHIFT;
 
@@ -1454,7 +2560,7 @@ pkt_rps_dev_rx_handler(struct sk_buff **pskb)
         return RX_HANDLER_CONSUMED;
     }
 
-    nh = router->vr_ilm[label];
+    nh = ((struct vr_nexthop **)vr_replica(router->vr_ilm_replicas))[label];
     if (!nh) {
         vr_pfree(pkt, VP_DROP_INVALID_NH);
         return RX_HANDLER_CONSUMED;
@@ -1472,18 +2578,13 @@ pkt_rps_dev_rx_handler(struct sk_buff **pskb)
 }
 
 /*
- * vif_from_napi - given a NAPI structure, return the corresponding vif
+ * gro_queue_from_napi - given a NAPI structure, return the corresponding
+ * gro queue
  */
-static struct vr_interface *
-vif_from_napi(struct napi_struct *napi)
+static struct vr_gro_queue *
+gro_queue_from_napi(struct napi_struct *napi)
 {
-    int offset;
-    struct vr_interface *vif;
-
-    offset = offsetof(struct vr_interface, vr_napi);
-    vif = (struct vr_interface *) (((char *)napi) - offset);
-
-    return vif;
+    return container_of(napi, struct vr_gro_queue, gq_napi);
 }
 
 /*
@@ -1494,12 +2595,12 @@ static int
 vr_napi_poll(struct napi_struct *napi, int budget)
 {
     struct sk_buff *skb;
-    struct vr_interface *vif;
+    struct vr_gro_queue *gq;
     int quota = 0;
 
-    vif = vif_from_napi(napi);
+    gq = gro_queue_from_napi(napi);
 
-    while ((skb = skb_dequeue(&vif->vr_skb_inputq))) {
+    while ((skb = skb_dequeue(&gq->gq_skbq))) {
         vr_skb_set_rxhash(skb, 0);
 
         napi_gro_receive(napi, skb);
@@ -1565,7 +2666,11 @@ vr_host_interface_exit(void)
 {
     vhost_exit();
     unregister_netdevice_notifier(&host_if_nb);
+#ifdef CONFIG_RPS
+    linux_steer_exit();
+#endif
     if (pkt_gro_dev) {
+        vr_rx_burst_exit();
         linux_pkt_dev_free();
     }
 
@@ -1608,6 +2713,10 @@ vr_host_interface_init(void)
     br_handle_frame_hook = vr_interface_bridge_hook;
 #endif
 
+#ifdef CONFIG_RPS
+    linux_steer_init();
+#endif
+    vr_rx_burst_init();
     vhost_init();
 
     return &vr_linux_interface_ops;
@@ -19,6 +19,11 @@
 #define MEM_DEV_NUM_DEVS        1
 
 short vr_flow_major = -1;
+/*
+ * map all of the requested range at mmap time, so that walks of the flow
+ * table by the agent do not take a fault for every page
+ */
+int vr_flow_mmap_populate = 0;
 static dev_t mem_dev;
 struct cdev *mem_cdev;
 
@@ -28,14 +33,45 @@ mem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
     struct vrouter *router = (struct vrouter *)vma->vm_private_data;
     struct page *page;
     pgoff_t offset;
+    void *va;
 
     offset = vmf->pgoff;
-    page = virt_to_page(vr_flow_get_va(router, offset << PAGE_SHIFT));
+    va = vr_flow_get_va(router, offset << PAGE_SHIFT);
+    if (!va)
+        return VM_FAULT_SIGBUS;
+
+    page = virt_to_page(va);
     get_page(page);
     vmf->page = page;
     return 0;
 }
 
+/*
+ * the pages are inserted with a reference each (as from the fault handler),
+ * so that a table that is freed after a resize stays valid till unmap
+ */
+static int
+mem_dev_populate(struct vrouter *router, struct vm_area_struct *vma)
+{
+    int ret;
+    void *va;
+    unsigned long addr;
+    uint64_t offset = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+
+    for (addr = vma->vm_start; addr < vma->vm_end;
+            addr += PAGE_SIZE, offset += PAGE_SIZE) {
+        va = vr_flow_get_va(router, offset);
+        if (!va)
+            return -EINVAL;
+
+        ret = vm_insert_page(vma, addr, virt_to_page(va));
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
 static struct vm_operations_struct mem_vm_ops = {
     .fault     =   mem_fault,
 };
@@ -51,7 +87,10 @@ mem_dev_mmap(struct file *fp, struct vm_area_struct *vma)
 
     size = vma->vm_end - vma->vm_start;
     flow_table_size = vr_flow_table_size(router) +
-        vr_oflow_table_size(router);
+        vr_oflow_table_size(router) + vr_flow_resize_table_size(router) +
+        vr_flow_stats_table_size(router) + vr_flow_event_table_size(router) +
+        vr_agent_ring_table_size(router) + vr_counters_table_size(router) +
+        vr_flow_changes_table_size(router);
     if (size > flow_table_size)
         return -EINVAL;
 
@@ -63,6 +102,9 @@ mem_dev_mmap(struct file *fp, struct vm_area_struct *vma)
     vma->vm_private_data = (void *)router;
     vma->vm_ops = &mem_vm_ops;
 
+    if (vr_flow_mmap_populate)
+        return mem_dev_populate(router, vma);
+
     return 0;
 }
 
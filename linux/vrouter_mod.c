@@ -13,10 +13,16 @@
 #include <linux/netdevice.h>
 #include <linux/cpumask.h>
 #include <linux/time.h>
+#include <linux/timex.h>
 #include <linux/highmem.h>
 #include <linux/version.h>
 #include <linux/if_vlan.h>
 #include <linux/icmp.h>
+#if defined(CONFIG_X86)
+#include <asm/cpufeature.h>
+#elif defined(CONFIG_ARM64)
+#include <asm/hwcap.h>
+#endif
 
 #include "vr_packet.h"
 #include "vr_sandesh.h"
@@ -41,7 +47,53 @@ int hashrnd_inited = 0;
 
 extern int vr_flow_entries;
 extern int vr_oflow_entries;
+extern int vr_flow_stats_split;
+extern int vr_flow_tcp_idle_timeout;
+extern int vr_flow_udp_idle_timeout;
+extern int vr_flow_other_idle_timeout;
+extern int vr_flow_tcp_closed_timeout;
+extern int vr_flow_miss_trap_rate;
+extern int vr_flow_miss_trap_burst;
+extern int vr_flow_miss_coalesce_msecs;
+extern int vr_flow_events;
+extern int vr_agent_rings;
+extern int vr_fragment_timeout;
+extern int vr_bridge_learning;
+extern int vr_bridge_aging_secs;
+extern int vr_bridge_vrf_entries;
+extern int vr_vxlan_vnids;
+extern int vr_mpls_labels;
+extern int vr_dump_buf_size;
+extern int vr_notify_msecs;
+extern int vr_notify_drop_threshold;
+extern int vr_counters_mmap;
+extern int vr_flow_mmap_populate;
+extern int vr_flow_cache_enable;
+extern int vr_flow_nh_cache_enable;
+extern int vr_flow_offload_packets;
+extern int vr_flow_prefault;
+extern int vr_flow_paired;
+extern int vr_flow_elephant_rate;
+extern char *vr_elephant_cpus;
+extern int vr_mtrie_share_buckets;
+extern int vr_mtrie_depth_sample;
+extern int vr_hash_engine;
+extern int vr_numa_replicas;
+extern int vr_flow_shards;
 int vrouter_dbg;
+/* the range outer udp source ports are picked from */
+int vr_udp_src_port_start = VR_MUDP_PORT_RANGE_START;
+int vr_udp_src_port_end = VR_MUDP_PORT_RANGE_END;
+/* hand packets from the rx handler to dp-core in bursts */
+int vr_rx_burst = 0;
+/* and send the packets of a burst that go to the fabric together */
+int vr_tx_burst = 0;
+/* and merge the tcp segments of a flow that come in a tunnel, first */
+int vr_fabric_gro = 0;
+/* let nics that can, segment the gso packets we tunnel in udp */
+int vr_udp_tunnel_gso = 1;
+/* tx/rx queues of vhost0, 0 for one per online cpu */
+int vr_vhost_queues = 0;
 
 extern struct vr_packet *linux_get_packet(struct sk_buff *,
         struct vr_interface *);
@@ -82,6 +134,24 @@ lh_zalloc(unsigned int size)
     return kzalloc(size, GFP_ATOMIC);
 }
 
+static void *
+lh_node_zalloc(unsigned int size, int node)
+{
+    return kzalloc_node(size, GFP_KERNEL, node);
+}
+
+static int
+lh_get_node(void)
+{
+    return numa_node_id();
+}
+
+static int
+lh_num_nodes(void)
+{
+    return nr_node_ids;
+}
+
 static void
 lh_free(void *mem)
 {
@@ -106,6 +176,24 @@ lh_page_alloc(unsigned int size)
     return (void *)__get_free_pages(GFP_ATOMIC | __GFP_ZERO | __GFP_COMP, order);
 }
 
+static void *
+lh_node_page_alloc(unsigned int size, int node)
+{
+    struct page *page;
+
+    if (size & (PAGE_SIZE - 1)) {
+        size += PAGE_SIZE;
+        size &= ~(PAGE_SIZE - 1);
+    }
+
+    page = alloc_pages_node(node, GFP_ATOMIC | __GFP_ZERO | __GFP_COMP,
+            get_order(size));
+    if (!page)
+        return NULL;
+
+    return page_address(page);
+}
+
 static void
 lh_page_free(void *address, unsigned int size)
 {
@@ -149,6 +237,7 @@ lh_pexpand_head(struct vr_packet *pkt, unsigned int hspace)
     if (!skb)
         return NULL;
 
+    lh_count_head_realloc(pkt);
     if (pskb_expand_head(skb, hspace, 0, GFP_ATOMIC))
         return NULL;
 
@@ -159,10 +248,23 @@ lh_pexpand_head(struct vr_packet *pkt, unsigned int hspace)
 
     pkt->vp_network_h += hspace;
     pkt->vp_inner_network_h += hspace;
+    if (pkt->vp_transport_h)
+        pkt->vp_transport_h += hspace;
 
     return pkt;
 }
 
+static void
+lh_count_head_realloc(struct vr_packet *pkt)
+{
+    struct vr_interface *vif = pkt->vp_if;
+
+    if (vif && vif->vif_stats)
+        vif->vif_stats[pkt->vp_cpu & VR_CPU_MASK].vis_head_reallocs++;
+
+    return;
+}
+
 static struct vr_packet *
 lh_palloc_head(struct vr_packet *pkt, unsigned int size)
 {
@@ -177,6 +279,7 @@ lh_palloc_head(struct vr_packet *pkt, unsigned int size)
     skb_set_tail_pointer(skb, pkt->vp_len);
     skb->len = pkt->vp_len + skb->data_len;
 
+    lh_count_head_realloc(pkt);
     skb_head = alloc_skb(size, GFP_ATOMIC);
     if (!skb_head)
         return NULL;
@@ -255,8 +358,11 @@ lh_pfree(struct vr_packet *pkt, unsigned short reason)
     if (!skb)
         return;
 
-    if (router)
+    if (router) {
         ((uint64_t *)(router->vr_pdrop_stats[pkt->vp_cpu]))[reason]++;
+        if (vr_drop_capture_enabled)
+            vr_drop_capture(router, pkt, reason);
+    }
 
     kfree_skb(skb);
     return;
@@ -322,6 +428,12 @@ lh_get_cpu(void)
     return cpu;
 }
 
+static uint64_t
+lh_get_cycles(void)
+{
+    return get_cycles();
+}
+
 static void
 lh_get_mono_time(unsigned int *sec, unsigned int *nsec)
 {
@@ -476,6 +588,9 @@ lh_pcow(struct vr_packet *pkt, unsigned short head_room)
     skb_set_tail_pointer(skb, pkt_head_len(pkt));
 
     old_off = skb->network_header;
+    if (skb_cloned(skb) || skb_headroom(skb) < head_room)
+        lh_count_head_realloc(pkt);
+
     if (skb_cow(skb, head_room)) 
         return -ENOMEM;
 
@@ -487,16 +602,155 @@ lh_pcow(struct vr_packet *pkt, unsigned short head_room)
     pkt->vp_len = skb_headlen(skb);
     pkt->vp_network_h += (skb->network_header - old_off);
     pkt->vp_inner_network_h  += (skb->network_header - old_off);
+    if (pkt->vp_transport_h)
+        pkt->vp_transport_h += (skb->network_header - old_off);
 
     return 0;
 }
 
+/*
+ * move the linear data of a packet past its first hdr_len bytes to a page
+ * fragment, so that clones of the packet share the payload and cowing a
+ * clone copies only the headers
+ */
+static int
+lh_pshare(struct vr_packet *pkt, unsigned short hdr_len)
+{
+    unsigned int len;
+    struct page *page;
+    struct sk_buff *skb = vp_os_packet(pkt);
+
+    if (pkt_head_len(pkt) <= hdr_len)
+        return 0;
+
+    /* the payload is in fragments already */
+    if (skb_shinfo(skb)->nr_frags || skb_has_frag_list(skb))
+        return 0;
+
+    len = pkt_head_len(pkt) - hdr_len;
+    if (len > PAGE_SIZE || skb_cloned(skb))
+        return -EINVAL;
+
+    page = alloc_page(GFP_ATOMIC);
+    if (!page)
+        return -ENOMEM;
+
+    memcpy(page_address(page), pkt_data(pkt) + hdr_len, len);
+    skb_fill_page_desc(skb, 0, page, 0, len);
+
+    pkt->vp_tail -= len;
+    pkt->vp_len -= len;
+
+    skb->data = pkt_data(pkt);
+    skb_set_tail_pointer(skb, pkt_head_len(pkt));
+    skb->len = pkt_head_len(pkt) + len;
+    skb->data_len = len;
+    skb->truesize += PAGE_SIZE;
+
+    return 0;
+}
+
+/*
+ * where an offset of the original packet lands in a header clone of it: in
+ * the copied headers, or past vp_end in the clone on the frag list
+ */
+static unsigned short
+lh_pclone_head_off(struct vr_packet *pkt, struct vr_packet *npkt,
+        unsigned short off, unsigned short copy_len)
+{
+    if (off < pkt->vp_data + copy_len)
+        return off - pkt->vp_data + npkt->vp_data;
+
+    return npkt->vp_end + off;
+}
+
+/*
+ * a clone of the packet that has a private copy of its first hdr_len bytes,
+ * with at least head_room in front of them, and that shares the rest with
+ * the original through a clone on its frag list. replicating a packet to
+ * rewrite its headers then costs the same whatever the size of the packet.
+ * the original is not touched
+ */
+static struct vr_packet *
+lh_pclone_head(struct vr_packet *pkt, unsigned short head_room,
+        unsigned short hdr_len)
+{
+    unsigned int copy_len, rest;
+    struct sk_buff *skb, *skb_head, *skb_c;
+    struct vr_packet *npkt;
+
+    skb = vp_os_packet(pkt);
+    if (!skb)
+        return NULL;
+
+    copy_len = pkt_head_len(pkt);
+    if (copy_len > hdr_len)
+        copy_len = hdr_len;
+    rest = pkt_len(pkt) - copy_len;
+
+    /* as a cow would, keep whatever head room the packet had */
+    if (head_room < pkt->vp_data)
+        head_room = pkt->vp_data;
+
+    skb_head = alloc_skb(head_room + copy_len, GFP_ATOMIC);
+    if (!skb_head)
+        return NULL;
+
+    skb_reserve(skb_head, head_room);
+    memcpy(skb_put(skb_head, copy_len), pkt_data(pkt), copy_len);
+
+    if (rest) {
+        skb_c = skb_clone(skb, GFP_ATOMIC);
+        if (!skb_c) {
+            kfree_skb(skb_head);
+            return NULL;
+        }
+
+        skb_c->data = pkt_data(pkt) + copy_len;
+        skb_set_tail_pointer(skb_c, pkt_head_len(pkt) - copy_len);
+        skb_c->len = rest;
+
+        skb_frag_list_init(skb_head);
+        skb_frag_add_head(skb_head, skb_c);
+        skb_head->len += rest;
+        skb_head->data_len = rest;
+        skb_head->truesize += skb_c->truesize;
+    }
+
+    skb_head->protocol = skb->protocol;
+    skb_shinfo(skb_head)->gso_type = skb_shinfo(skb)->gso_type;
+    skb_shinfo(skb_head)->gso_size = skb_shinfo(skb)->gso_size;
+    skb_shinfo(skb_head)->gso_segs = skb_shinfo(skb)->gso_segs;
+    skb_head->ip_summed = skb->ip_summed;
+    skb_head->csum = skb->csum;
+
+    npkt = linux_get_packet(skb_head, pkt->vp_if);
+    if (!npkt)
+        return NULL;
+
+    npkt->vp_nh = pkt->vp_nh;
+    npkt->vp_flags = pkt->vp_flags;
+    npkt->vp_type = pkt->vp_type;
+    npkt->vp_ttl = pkt->vp_ttl;
+    npkt->vp_network_h = lh_pclone_head_off(pkt, npkt, pkt->vp_network_h,
+            copy_len);
+    npkt->vp_inner_network_h = lh_pclone_head_off(pkt, npkt,
+            pkt->vp_inner_network_h, copy_len);
+    if (pkt->vp_transport_h)
+        npkt->vp_transport_h = lh_pclone_head_off(pkt, npkt,
+                pkt->vp_transport_h, copy_len);
+
+    return npkt;
+}
+
 /*
  * lh_get_udp_src_port - return a source port for the outer UDP header.
  * The source port is based on a hash of the inner IP source/dest addresses,
- * vrf (and inner TCP/UDP ports in the future). The label from fmd
- * will be used in the future to detect whether it is a L2/L3 packet.
- * Returns 0 on error, valid source port otherwise.
+ * vrf and the flow of the packet: its flow index if it has one, which also
+ * covers fragments tracked by vr_fragment, the inner TCP/UDP ports
+ * otherwise. The label from fmd will be used in the future to detect
+ * whether it is a L2/L3 packet. Returns 0 on error, valid source port
+ * otherwise.
  */
 static __u16
 lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
@@ -504,11 +758,10 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
 {
     struct sk_buff *skb = vp_os_packet(pkt);
     unsigned int pull_len;
-    __u32 ip_src, ip_dst, hashval, port_range;
+    __u32 ip_src, ip_dst, hashval, port_range, l4 = 0;
     struct iphdr *iph;
     __u32 *data;
     __u16 port;
-    int32_t flow_index = 0;
 
 
     if (hashrnd_inited == 0) {
@@ -549,6 +802,15 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
         hashval = vr_hash(data, ETH_HLEN, vr_hashrnd);
         /* Include the VRF to calculate the hash */
         hashval = vr_hash_2words(hashval, vrf, vr_hashrnd);
+    } else if (pkt->vp_type == VP_TYPE_IP6) {
+        /* the source and destination addresses follow the first 8 bytes */
+        if (pkt_head_len(pkt) < sizeof(struct vr_ip6))
+            goto error;
+
+        data = (unsigned int *)(skb->head + pkt->vp_data +
+                offsetof(struct vr_ip6, ip6_src));
+        hashval = vr_hash(data, 2 * VR_IP6_ADDRESS_LEN, vr_hashrnd);
+        hashval = vr_hash_2words(hashval, vrf, vr_hashrnd);
     } else {
 
 
@@ -573,19 +835,34 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
         ip_dst = iph->daddr;
 
         /*
-         * FIXME - The hash should include the ports in the inner packet if it is
-         * TCP/UDP. However, if the inner packet is a fragment, it may not have
-         * the L4 header if it is not the first fragment. To handle this case, 
-         * we will use the flow table index as an input to the hash if it is
-         * valid. In the future, we will implement an overflow hash table to 
-         * deal with IP fragments. When that happens, we will set the flow table
-         * index appropriately when an IP fragment is detected and it will
-         * be used as an input to jhash_3words() below.
+         * the flow index is the same for all the packets of a flow,
+         * fragments included, so use it when there is one. without it,
+         * only the first fragment has the ports, so leave them out of the
+         * hash of fragments
          */
         if (fmd->fmd_flow_index != -1) {
-            flow_index = fmd->fmd_flow_index;
+            l4 = fmd->fmd_flow_index;
+        } else if (!(iph->frag_off & htons(IP_MF | IP_OFFSET)) &&
+                (iph->protocol == IPPROTO_TCP ||
+                 iph->protocol == IPPROTO_UDP)) {
+            pull_len = (iph->ihl * 4) + sizeof(__u32);
+            if ((pkt->vp_data + pull_len) > pkt->vp_tail) {
+                if (pkt->vp_tail != skb->tail)
+                    goto error;
+                pull_len += pkt->vp_data;
+                pull_len -= skb_headroom(skb);
+                if (!pskb_may_pull(skb, pull_len))
+                    goto error;
+                iph = (struct iphdr *)(skb->head + pkt->vp_data);
+            }
+
+            l4 = *(__u32 *)((unsigned char *)iph + (iph->ihl * 4));
+        } else {
+            l4 = iph->protocol;
         }
+
         hashval = jhash_3words(ip_src, ip_dst, vrf, vr_hashrnd);
+        hashval = jhash_2words(hashval, l4, vr_hashrnd);
     }
 
     lh_reset_skb_fields(pkt);
@@ -594,7 +871,7 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
      * Convert the hash value to a value in the port range that we want
      * for dynamic UDP ports
      */
-    port_range = VR_MUDP_PORT_RANGE_END - VR_MUDP_PORT_RANGE_START;
+    port_range = vr_udp_src_port_end - vr_udp_src_port_start;
     port = (__u16) (((u64) hashval * port_range) >> 32);
 
     if (port > port_range) {
@@ -604,7 +881,7 @@ lh_get_udp_src_port(struct vr_packet *pkt, struct vr_forwarding_md *fmd,
         port = 0;
     }
 
-    return (port + VR_MUDP_PORT_RANGE_START);
+    return (port + vr_udp_src_port_start);
 
 error:
     lh_reset_skb_fields(pkt);
@@ -821,6 +1098,56 @@ lh_csum_verify(struct sk_buff *skb, struct vr_ip *iph)
     return 0;
 }
 
+static void
+lh_count_rx_csum(struct vr_packet *pkt, bool hw)
+{
+    struct vr_interface *vif = pkt->vp_if;
+
+    if (!vif || !vif->vif_stats)
+        return;
+
+    if (hw)
+        vif->vif_stats[pkt->vp_cpu & VR_CPU_MASK].vis_rx_csum_hw++;
+    else
+        vif->vif_stats[pkt->vp_cpu & VR_CPU_MASK].vis_rx_csum_sw++;
+
+    return;
+}
+
+/*
+ * lh_csum_hw_verify_udp - see whether what the NIC did is enough to verify
+ * the outer UDP checksum of a tunneled packet. With CHECKSUM_COMPLETE, the
+ * NIC gives the sum of the packet from the outer IP header on. A valid IP
+ * header sums to zero, so that is also the sum of the UDP datagram, and
+ * the checksum can be verified without summing the payload again. Returns
+ * 0 if the checksum is ok, 1 if it is bad, and -1 if it has to be verified
+ * in software.
+ */
+static int
+lh_csum_hw_verify_udp(struct sk_buff *skb, struct vr_ip *outer_iph)
+{
+    unsigned int ip_len;
+
+    if (skb_csum_unnecessary(skb))
+        return 0;
+
+    if (skb->ip_summed != CHECKSUM_COMPLETE || !outer_iph ||
+            ((unsigned char *)outer_iph != skb_network_header(skb)))
+        return -1;
+
+    ip_len = ntohs(outer_iph->ip_len);
+    if ((ip_len != skb_tail_pointer(skb) + skb->data_len -
+                (unsigned char *)outer_iph) ||
+            ip_fast_csum(outer_iph, outer_iph->ip_hl))
+        return -1;
+
+    if (csum_tcpudp_magic(outer_iph->ip_saddr, outer_iph->ip_daddr,
+                ip_len - (outer_iph->ip_hl * 4), IPPROTO_UDP, skb->csum))
+        return 1;
+
+    return 0;
+}
+
 /*
  * lh_csum_verify_udp - verifies checksum of skb containing a UDP datagram.
  * Returns 0 if checksum is ok, non-zero otherwise.
@@ -898,7 +1225,7 @@ lh_pull_inner_headers_fast_udp(struct vr_ip *outer_iph,
     struct tcphdr *tcph = NULL;
     bool thdr_valid = false;
     unsigned int label, control_data;
-    int pkt_type;
+    int pkt_type, csum_ret;
     struct vr_eth *eth = NULL;
 
     pkt_headlen = pkt_head_len(pkt);
@@ -1051,19 +1378,27 @@ lh_pull_inner_headers_fast_udp(struct vr_ip *outer_iph,
      * header is UDP, it is expected that it contains a valid checksum, so
      * we don't need to verify the inner packet's checksum.
      */
-    if (iph && !skb_csum_unnecessary(skb)) {
-        skb_pull_len = pkt_data(pkt) - skb->data;
-
-        skb_pull(skb, skb_pull_len);
-        if (lh_csum_verify_udp(skb, outer_iph)) {
+    if (iph) {
+        csum_ret = lh_csum_hw_verify_udp(skb, outer_iph);
+        if (csum_ret > 0)
             goto cksum_err;
+
+        if (csum_ret < 0) {
+            skb_pull_len = pkt_data(pkt) - skb->data;
+
+            skb_pull(skb, skb_pull_len);
+            if (lh_csum_verify_udp(skb, outer_iph)) {
+                goto cksum_err;
+            }
+            /*
+             * Restore the skb back to its original state. This is required
+             * as packets that get trapped to the agent assume that the skb
+             * is unchanged from the time it is received by vrouter.
+             */
+            skb_push(skb, skb_pull_len);
         }
-        /*
-         * Restore the skb back to its original state. This is required as
-         * packets that get trapped to the agent assume that the skb is
-         * unchanged from the time it is received by vrouter.
-         */
-        skb_push(skb, skb_pull_len);
+
+        lh_count_rx_csum(pkt, !csum_ret);
     }
 
     pkt_pull(pkt, hdr_len);
@@ -1350,7 +1685,11 @@ lh_pull_inner_headers_fast_gre(struct vr_packet *pkt, int
             }
 
             skb->ip_summed = CHECKSUM_UNNECESSARY;
+            lh_count_rx_csum(pkt, false);
         }
+    } else if (iph && (iph->ip_proto == VR_IP_PROTO_TCP) &&
+            skb_csum_unnecessary(skb)) {
+        lh_count_rx_csum(pkt, true);
     }
 
     /* What we handled is only GRE header, so pull 
@@ -1413,15 +1752,19 @@ lh_pull_inner_headers_fast(struct vr_ip *iph, struct vr_packet *pkt,
                                                 unsigned short *),
                            int *ret, int *encap_type)
 {
+    int pulled = 0;
+    uint64_t start = vr_perf_start();
+
     if (proto == VR_IP_PROTO_GRE) {
-        return lh_pull_inner_headers_fast_gre(pkt, tunnel_type_cb, ret,
+        pulled = lh_pull_inner_headers_fast_gre(pkt, tunnel_type_cb, ret,
                 encap_type);
     } else if (proto == VR_IP_PROTO_UDP) {
-        return lh_pull_inner_headers_fast_udp(iph, pkt, tunnel_type_cb,
+        pulled = lh_pull_inner_headers_fast_udp(iph, pkt, tunnel_type_cb,
                 ret, encap_type);
     }
+    vr_perf_end(VR_PERF_PULL_INNER_HEADERS, start, 1);
 
-    return 0;
+    return pulled;
 }
 
 /*
@@ -1430,12 +1773,12 @@ lh_pull_inner_headers_fast(struct vr_ip *iph, struct vr_packet *pkt,
  * as required. 
  */
 static int
-lh_pull_inner_headers(struct vr_ip *outer_iph, struct vr_packet *pkt,
+__lh_pull_inner_headers(struct vr_ip *outer_iph, struct vr_packet *pkt,
                       unsigned short ip_proto, unsigned short *reason,
                       int (*tunnel_type_cb)(unsigned int, unsigned int,
                           unsigned short *))
 {
-    int pull_len, hlen, hoff, ret;
+    int pull_len, hlen, hoff, ret, csum_ret;
     struct sk_buff *skb = vp_os_packet(pkt); 
     struct vr_ip *iph;
     struct tcphdr *tcph = NULL;
@@ -1571,20 +1914,29 @@ lh_pull_inner_headers(struct vr_ip *outer_iph, struct vr_packet *pkt,
              * GRO requires that checksum has been verified). For all other protocols,
              * we will let the guest verify the checksum.
              */
-            if (!skb_csum_unnecessary(skb)) {
+            if (skb_csum_unnecessary(skb)) {
+                lh_count_rx_csum(pkt, true);
+            } else {
                 if (outer_iph && outer_iph->ip_proto == VR_IP_PROTO_UDP) {
-                    skb_pull_len = pkt_data(pkt) - skb->data;
-
-                    skb_pull(skb, skb_pull_len);
-                    if (lh_csum_verify_udp(skb, outer_iph)) {
+                    csum_ret = lh_csum_hw_verify_udp(skb, outer_iph);
+                    if (csum_ret > 0)
                         goto cksum_err;
+
+                    if (csum_ret < 0) {
+                        skb_pull_len = pkt_data(pkt) - skb->data;
+
+                        skb_pull(skb, skb_pull_len);
+                        if (lh_csum_verify_udp(skb, outer_iph)) {
+                            goto cksum_err;
+                        }
+                        /*
+                         * Restore the skb back to its original state. This is required as
+                         * p ackets that get trapped to the agent assume that the skb is
+                         * unchanged from the time it is received by vrouter.
+                         */
+                        skb_push(skb, skb_pull_len);
                     }
-                    /*
-                     * Restore the skb back to its original state. This is required as
-                     * p ackets that get trapped to the agent assume that the skb is
-                     * unchanged from the time it is received by vrouter.
-                     */
-                    skb_push(skb, skb_pull_len);
+                    lh_count_rx_csum(pkt, !csum_ret);
                     if (tcph && vr_to_vm_mss_adj) {
                         lh_adjust_tcp_mss(tcph, skb);
                     }
@@ -1596,6 +1948,7 @@ lh_pull_inner_headers(struct vr_ip *outer_iph, struct vr_packet *pkt,
                         if (lh_csum_verify(skb, iph)) {
                             goto cksum_err;
                         }
+                        lh_count_rx_csum(pkt, false);
                         skb_push(skb, tcpoff);
                         if (vr_to_vm_mss_adj) {
                             lh_adjust_tcp_mss(tcph, skb);
@@ -1664,6 +2017,22 @@ cksum_err:
     return 0;
 }
 
+static int
+lh_pull_inner_headers(struct vr_ip *outer_iph, struct vr_packet *pkt,
+                      unsigned short ip_proto, unsigned short *reason,
+                      int (*tunnel_type_cb)(unsigned int, unsigned int,
+                          unsigned short *))
+{
+    int ret;
+    uint64_t start = vr_perf_start();
+
+    ret = __lh_pull_inner_headers(outer_iph, pkt, ip_proto, reason,
+            tunnel_type_cb);
+    vr_perf_end(VR_PERF_PULL_INNER_HEADERS, start, 1);
+
+    return ret;
+}
+
 static void *
 lh_data_at_offset(struct vr_packet *pkt, unsigned short off)
 {
@@ -1800,6 +2169,13 @@ struct host_os linux_host = {
     .hos_pull_inner_headers_fast    =       lh_pull_inner_headers_fast,
     .hos_get_udp_src_port           =       lh_get_udp_src_port,
     .hos_pkt_from_vm_tcp_mss_adj    =       lh_pkt_from_vm_tcp_mss_adj,
+    .hos_pshare                     =       lh_pshare,
+    .hos_pclone_head                =       lh_pclone_head,
+    .hos_get_node                   =       lh_get_node,
+    .hos_num_nodes                  =       lh_num_nodes,
+    .hos_node_zalloc                =       lh_node_zalloc,
+    .hos_node_page_alloc            =       lh_node_page_alloc,
+    .hos_get_cycles                 =       lh_get_cycles,
 };
     
 struct host_os *
@@ -1939,6 +2315,48 @@ static ctl_table vrouter_table[] =
         .mode           = 0644,
         .proc_handler   = proc_dointvec,
     },
+    {
+        .procname       = "fabric_early_demux",
+        .data           = &vr_fabric_early_demux,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec,
+    },
+    {
+        .procname       = "rx_burst",
+        .data           = &vr_rx_burst,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec,
+    },
+    {
+        .procname       = "tx_burst",
+        .data           = &vr_tx_burst,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec,
+    },
+    {
+        .procname       = "fabric_gro",
+        .data           = &vr_fabric_gro,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec,
+    },
+    {
+        .procname       = "elephant_rate",
+        .data           = &vr_flow_elephant_rate,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec,
+    },
+    {
+        .procname       = "udp_tunnel_gso",
+        .data           = &vr_udp_tunnel_gso,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec,
+    },
     {}
 };
 
@@ -1980,6 +2398,17 @@ vrouter_linux_exit(void)
     return;
 }
 
+static bool
+lh_cpu_has_crc32(void)
+{
+#if defined(CONFIG_X86)
+    return boot_cpu_has(X86_FEATURE_XMM4_2);
+#elif defined(CONFIG_ARM64)
+    return elf_hwcap & HWCAP_CRC32;
+#else
+    return false;
+#endif
+}
 
 static int __init
 vrouter_linux_init(void)
@@ -1994,6 +2423,20 @@ vrouter_linux_init(void)
         return -1;
     }
 
+    get_random_bytes(&vr_hash_seed, sizeof(vr_hash_seed));
+    if (vr_udp_src_port_start <= 0 || vr_udp_src_port_end > 65535 ||
+            vr_udp_src_port_start >= vr_udp_src_port_end) {
+        printk("vrouter: bad udp source port range %d-%d, using %d-%d\n",
+                vr_udp_src_port_start, vr_udp_src_port_end,
+                VR_MUDP_PORT_RANGE_START, VR_MUDP_PORT_RANGE_END);
+        vr_udp_src_port_start = VR_MUDP_PORT_RANGE_START;
+        vr_udp_src_port_end = VR_MUDP_PORT_RANGE_END;
+    }
+    if (vr_hash_engine == VR_HASH_ENGINE_CRC32 && !lh_cpu_has_crc32()) {
+        printk("vrouter: no CRC32 instruction, using the Jenkins hash\n");
+        vr_hash_engine = VR_HASH_ENGINE_JENKINS;
+    }
+
     ret = vrouter_init();
     if (ret)
         return ret;
@@ -2017,6 +2460,76 @@ init_fail:
 
 module_param(vr_flow_entries, int, 0);
 module_param(vr_oflow_entries, int, 0);
+module_param(vr_flow_stats_split, int, 0);
+MODULE_PARM_DESC(vr_flow_stats_split, "Set 1 to keep flow statistics in a separate table, default value is 0");
+module_param(vr_flow_tcp_idle_timeout, int, 0);
+MODULE_PARM_DESC(vr_flow_tcp_idle_timeout, "Seconds after which idle TCP flows are removed, 0 (default) leaves aging to the agent");
+module_param(vr_flow_udp_idle_timeout, int, 0);
+MODULE_PARM_DESC(vr_flow_udp_idle_timeout, "Seconds after which idle UDP flows are removed, 0 (default) leaves aging to the agent");
+module_param(vr_flow_other_idle_timeout, int, 0);
+MODULE_PARM_DESC(vr_flow_other_idle_timeout, "Seconds after which other idle flows are removed, 0 (default) leaves aging to the agent");
+module_param(vr_flow_tcp_closed_timeout, int, 0);
+MODULE_PARM_DESC(vr_flow_tcp_closed_timeout, "Seconds after which TCP flows that saw a RST, or a FIN in both directions, are removed, 0 (default) to age them as other TCP flows");
+module_param(vr_flow_miss_trap_rate, int, 0);
+MODULE_PARM_DESC(vr_flow_miss_trap_rate, "Flow miss traps per second allowed per interface, 0 (default) for no limit");
+module_param(vr_flow_miss_trap_burst, int, 0);
+MODULE_PARM_DESC(vr_flow_miss_trap_burst, "Flow miss traps an interface can send in a burst, default value is 32");
+module_param(vr_flow_miss_coalesce_msecs, int, 0);
+MODULE_PARM_DESC(vr_flow_miss_coalesce_msecs, "Milliseconds over which flow misses are batched into one trap, 0 (default) traps every miss");
+module_param(vr_flow_events, int, 0);
+MODULE_PARM_DESC(vr_flow_events, "Set 1 to report flow misses to the agent in mmap-ed event rings, default value is 0");
+module_param(vr_fragment_timeout, int, 0);
+MODULE_PARM_DESC(vr_fragment_timeout, "Seconds to hold a fragment entry after its last fragment, default value is 1");
+module_param(vr_bridge_learning, int, 0);
+MODULE_PARM_DESC(vr_bridge_learning, "Set 1 to learn the source macs of frames from interfaces with a learn nexthop, default value is 0");
+module_param(vr_bridge_aging_secs, int, 0);
+MODULE_PARM_DESC(vr_bridge_aging_secs, "Seconds after which a learnt mac that was not seen is removed, default value is 300");
+module_param(vr_bridge_vrf_entries, int, 0);
+MODULE_PARM_DESC(vr_bridge_vrf_entries, "Entries of a bridge table of each vrf, 0 (default) for one table of all vrfs");
+module_param(vr_vxlan_vnids, int, 0);
+MODULE_PARM_DESC(vr_vxlan_vnids, "Vxlan vnids below which the vnid table is a direct map, 0 to disable (default 16K)");
+module_param(vr_mpls_labels, int, 0);
+MODULE_PARM_DESC(vr_mpls_labels, "Labels that the mpls table starts with, it grows online as the agent adds higher labels (default 5120)");
+module_param(vr_dump_buf_size, int, 0);
+MODULE_PARM_DESC(vr_dump_buf_size, "Bytes of objects a dump response carries, 3968 for clients that receive in 4K buffers (default 65280)");
+module_param(vr_notify_msecs, int, 0);
+MODULE_PARM_DESC(vr_notify_msecs, "Milliseconds between change notifications on the events multicast group, 0 (default) to not publish them");
+module_param(vr_notify_drop_threshold, int, 0);
+MODULE_PARM_DESC(vr_notify_drop_threshold, "Drops of a reason in one notification period that are reported as an event, default value is 0 (never)");
+module_param(vr_counters_mmap, int, 0);
+MODULE_PARM_DESC(vr_counters_mmap, "Set 1 to keep the drop and interface counters in the mmap-ed flow memory, for collectors to read, default value is 0");
+module_param(vr_agent_rings, int, 0);
+MODULE_PARM_DESC(vr_agent_rings, "Set 1 to trap packets to the agent in mmap-ed packet rings instead of over pkt0, default value is 0");
+module_param(vr_hash_engine, int, 0);
+MODULE_PARM_DESC(vr_hash_engine, "Hash of the flow and bridge tables, 0 (default) for Jenkins and 1 for the cpu's CRC32C");
+module_param(vr_flow_cache_enable, int, 0);
+MODULE_PARM_DESC(vr_flow_cache_enable, "Set 1 to look up recently hit flows in a per-cpu cache first, default value is 0");
+module_param(vr_flow_nh_cache_enable, int, 0);
+MODULE_PARM_DESC(vr_flow_nh_cache_enable, "Set 1 to remember the route lookup result of forwarded flows, default value is 0");
+module_param(vr_flow_offload_packets, int, 0);
+MODULE_PARM_DESC(vr_flow_offload_packets, "Packets a flow has to have seen before it is handed to a registered offload engine, 0 to not offload, default value is 1000");
+module_param(vr_flow_prefault, int, 0);
+MODULE_PARM_DESC(vr_flow_prefault, "Set 1 to allocate all of the flow table at load time, instead of a part at a time when first used, default value is 0");
+module_param(vr_flow_paired, int, 0);
+MODULE_PARM_DESC(vr_flow_paired, "Set 1 to put a flow and its reverse flow in the same bucket of the flow table, default value is 0");
+module_param(vr_elephant_cpus, charp, 0);
+MODULE_PARM_DESC(vr_elephant_cpus, "List of cpus (as in 4-7,12) that take only the packets of the flows over the elephant_rate sysctl, default is none");
+module_param(vr_mtrie_share_buckets, int, 0);
+MODULE_PARM_DESC(vr_mtrie_share_buckets, "Set 1 to store identical route table buckets of all vrfs once, default value is 0");
+module_param(vr_mtrie_depth_sample, int, 0);
+MODULE_PARM_DESC(vr_mtrie_depth_sample, "Record the route lookup depth of one in these many lookups, default value is 0 (off)");
+module_param(vr_flow_mmap_populate, int, 0);
+MODULE_PARM_DESC(vr_flow_mmap_populate, "Set 1 to map the whole flow table when the agent maps it, instead of a page at a time on fault, default value is 0");
+module_param(vr_numa_replicas, int, 0);
+MODULE_PARM_DESC(vr_numa_replicas, "Set 1 to keep a copy of the nexthop, label and interface tables on every NUMA node, default value is 0");
+module_param(vr_flow_shards, int, 0);
+MODULE_PARM_DESC(vr_flow_shards, "Set 1 to split the flow table into a part per NUMA node, and steer the packets of a flow to its node, default value is 0");
+module_param(vr_udp_src_port_start, int, 0);
+MODULE_PARM_DESC(vr_udp_src_port_start, "First outer UDP source port of MPLSoUDP and VXLAN tunnels, default value is 49152");
+module_param(vr_udp_src_port_end, int, 0);
+MODULE_PARM_DESC(vr_udp_src_port_end, "Last outer UDP source port of MPLSoUDP and VXLAN tunnels, default value is 65535");
+module_param(vr_vhost_queues, int, 0);
+MODULE_PARM_DESC(vr_vhost_queues, "Number of tx/rx queues of the vhost interface, up to 16, default value is 0 (one per online cpu)");
 module_param(vrouter_dbg, int, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(vrouter_dbg, "Set 1 for pkt dumping and 0 to disable, default value is 0");
 
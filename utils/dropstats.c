@@ -35,7 +35,12 @@
 static struct nl_client *cl;
 static int resp_code;
 static vr_drop_stats_req stats_req;
-static int help_set;
+static vr_drop_capture_req capture_req;
+static int help_set, capture_set, capture_on_set, capture_off_set;
+static int reason_set, sample_set, rate_set;
+static int capture_reason = -1, capture_sample = 1, capture_rate;
+static int capture_marker = -1;
+static bool capture_printed;
 
 void
 vr_drop_stats_req_process(void *s_req)
@@ -79,6 +84,12 @@ vr_drop_stats_req_process(void *s_req)
             stats->vds_flow_invalid_protocol);
     printf("Flow Queue Limit Exceeded     %" PRIu64 "\n",
             stats->vds_flow_queue_limit_exceeded);
+    printf("Flow Queue Pool Empty         %" PRIu64 "\n",
+            stats->vds_flow_queue_pool_empty);
+    printf("Flow Miss Rate Limited        %" PRIu64 "\n",
+            stats->vds_flow_miss_rate_limit);
+    printf("Interface Rate Limited        %" PRIu64 "\n",
+            stats->vds_interface_rate_limit);
     printf("\n");
 
 
@@ -161,6 +172,27 @@ vr_response_process(void *s)
 }
 
 
+void
+vr_drop_capture_req_process(void *s_req)
+{
+    int i;
+    vr_drop_capture_req *req = (vr_drop_capture_req *)s_req;
+
+    capture_marker = req->vdc_index;
+    capture_printed = true;
+
+    printf("%u.%06u cpu %d reason %d vif %d vrf %d nh %d len %d\n",
+            req->vdc_sec, req->vdc_usec, req->vdc_cpu, req->vdc_reason,
+            req->vdc_vif, req->vdc_vrf, req->vdc_nh, req->vdc_pkt_len);
+    for (i = 0; i < req->vdc_data_size; i++) {
+        printf("%02x%s", (unsigned char)req->vdc_data[i],
+                ((i % 16) == 15) ? "\n" : " ");
+    }
+    printf("%s\n", (i % 16) ? "\n" : "");
+
+    return;
+}
+
 static vr_drop_stats_req *
 vr_build_drop_stats_request(void)
 {
@@ -200,6 +232,33 @@ vr_build_netlink_request(vr_drop_stats_req *req)
     return 0;
 }
 
+static int
+vr_build_capture_request(vr_drop_capture_req *req)
+{
+    int ret, error = 0, attr_len;
+
+    ret = nl_build_nlh(cl, cl->cl_genl_family_id, NLM_F_REQUEST);
+    if (ret)
+        return ret;
+
+    ret = nl_build_genlh(cl, SANDESH_REQUEST, 0);
+    if (ret)
+        return ret;
+
+    attr_len = nl_get_attr_hdr_size();
+    ret = sandesh_encode(req, "vr_drop_capture_req", vr_find_sandesh_info,
+                             (nl_get_buf_ptr(cl) + attr_len),
+                             (nl_get_buf_len(cl) - attr_len), &error);
+
+    if ((ret <= 0) || error)
+        return -1;
+
+    nl_build_attr(cl, ret, NL_ATTR_VR_MESSAGE_PROTOCOL);
+    nl_update_nlh(cl);
+
+    return 0;
+}
+
 static int
 vr_send_one_message(void)
 {
@@ -245,23 +304,104 @@ vr_get_drop_stats(void)
     return 0;
 }
 
+static int
+vr_drop_capture(void)
+{
+    int ret;
+
+    do {
+        memset(&capture_req, 0, sizeof(capture_req));
+        if (capture_on_set || capture_off_set) {
+            capture_req.h_op = SANDESH_OP_ADD;
+            capture_req.vdc_enable = capture_on_set;
+            capture_req.vdc_filter = capture_reason;
+            capture_req.vdc_sample = capture_sample;
+            capture_req.vdc_rate = capture_rate;
+        } else {
+            capture_req.h_op = SANDESH_OP_DUMP;
+            capture_req.vdc_marker = capture_marker;
+        }
+
+        ret = vr_build_capture_request(&capture_req);
+        if (ret < 0)
+            return ret;
+
+        resp_code = 0;
+        vr_send_one_message();
+    } while ((capture_req.h_op == SANDESH_OP_DUMP) &&
+            (resp_code & VR_MESSAGE_DUMP_INCOMPLETE));
+
+    if ((capture_req.h_op == SANDESH_OP_DUMP) && !capture_printed)
+        printf("No dropped packets have been captured\n");
+
+    return 0;
+}
+
 enum opt_index {
     HELP_OPT_INDEX,
+    CAPTURE_OPT_INDEX,
+    CAPTURE_ON_OPT_INDEX,
+    CAPTURE_OFF_OPT_INDEX,
+    REASON_OPT_INDEX,
+    SAMPLE_OPT_INDEX,
+    RATE_OPT_INDEX,
     MAX_OPT_INDEX,
 };
 
 static struct option long_options[] = {
-    [HELP_OPT_INDEX]    =   {"help",    no_argument,        &help_set,      1},
-    [MAX_OPT_INDEX]     =   {"NULL",    0,                  0,              0},
+    [HELP_OPT_INDEX]        =   {"help",        no_argument,        &help_set,          1},
+    [CAPTURE_OPT_INDEX]     =   {"capture",     no_argument,        &capture_set,       1},
+    [CAPTURE_ON_OPT_INDEX]  =   {"capture-on",  no_argument,        &capture_on_set,    1},
+    [CAPTURE_OFF_OPT_INDEX] =   {"capture-off", no_argument,        &capture_off_set,   1},
+    [REASON_OPT_INDEX]      =   {"reason",      required_argument,  &reason_set,        1},
+    [SAMPLE_OPT_INDEX]      =   {"sample",      required_argument,  &sample_set,        1},
+    [RATE_OPT_INDEX]        =   {"rate",        required_argument,  &rate_set,          1},
+    [MAX_OPT_INDEX]         =   {"NULL",        0,                  0,                  0},
 };
 
 static void
 Usage()
 {
     printf("Usage: drop_stats [--help]\n");
+    printf("       drop_stats --capture\n");
+    printf("       drop_stats --capture-on [--reason=<drop reason>]\n");
+    printf("                  [--sample=<1 in n drops>] [--rate=<drops/sec>]\n");
+    printf("       drop_stats --capture-off\n");
+    printf("\n");
+    printf("--capture\t shows the dropped packets captured, per cpu\n");
+    printf("--capture-on\t captures sampled dropped packets, of every reason\n");
+    printf("\t\t or only of --reason, 1 in --sample, at most --rate a second\n");
+    printf("\t\t per cpu\n");
     exit(-EINVAL);
 }
 
+static void
+parse_long_opts(int opt_index, char *opt_arg)
+{
+    errno = 0;
+    switch (opt_index) {
+    case REASON_OPT_INDEX:
+        capture_reason = strtoul(opt_arg, NULL, 0);
+        break;
+
+    case SAMPLE_OPT_INDEX:
+        capture_sample = strtoul(opt_arg, NULL, 0);
+        break;
+
+    case RATE_OPT_INDEX:
+        capture_rate = strtoul(opt_arg, NULL, 0);
+        break;
+
+    default:
+        break;
+    }
+
+    if (errno)
+        Usage();
+
+    return;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -272,6 +412,7 @@ main(int argc, char *argv[])
                         long_options, &option_index)) >= 0)) {
         switch (opt) {
         case 0:
+            parse_long_opts(option_index, optarg);
             break;
 
         default:
@@ -293,6 +434,9 @@ main(int argc, char *argv[])
         return -1;
     }
 
+    if (capture_set || capture_on_set || capture_off_set)
+        return vr_drop_capture();
+
     vr_get_drop_stats();
 
     return 0;
@@ -43,10 +43,18 @@
 #define TABLE_FLAG_VALID        0x1
 #define MEM_DEV                 "/dev/flow"
 
-static int dvrf_set, mir_set;
-static unsigned short dvrf;
+/* records in a FLOW_OP_FLOW_TABLE_RESTORE request */
+#define FLOW_RESTORE_BATCH      64
+
+static int dvrf_set, mir_set, resize_set, save_set, restore_set;
+static int watch_set, vrf_set, ip_set, action_set, elephant_set;
+static char *save_file, *restore_file;
+static unsigned int resize_entries, watch_msecs;
+static unsigned short dvrf, filter_vrf, filter_action;
+static unsigned int filter_ip;
 static int flow_index, list, flow_cmd, mirror = -1;
 static int rate;
+static int setup_stats;
 
 struct flow_table {
     struct vr_flow_entry *ft_entries;
@@ -54,6 +62,30 @@ struct flow_table {
     u_int64_t ft_span;
     unsigned int ft_num_entries;
     unsigned int ft_flags;
+    unsigned int ft_version;
+    unsigned int ft_stats_cpus;
+    u_int64_t ft_stats_span;
+    char *ft_stats;
+    u_int64_t ft_cache_hits;
+    u_int64_t ft_cache_misses;
+    u_int64_t ft_hold_latency[VR_FLOW_SETUP_BUCKETS];
+    u_int64_t ft_hold_queue_overflows;
+    u_int64_t ft_lookup_probes[VR_FLOW_PROBE_BUCKETS];
+    u_int64_t ft_insert_probes[VR_FLOW_PROBE_BUCKETS];
+    u_int64_t ft_oflow_inserts;
+    u_int64_t ft_insert_fails;
+    unsigned int ft_main_entries;
+    unsigned int ft_main_used;
+    unsigned int ft_oflow_used;
+    unsigned int ft_oflow_entries;
+    /* the change counters of the groups of entries, if the kernel has them */
+    u_int32_t *ft_changes;
+    unsigned int ft_groups;
+    /* shard n is the n'th 1/ft_shards of the entries (before overflow) */
+    unsigned int ft_shards;
+    /* the counters and the entries as of the last scan */
+    u_int32_t *ft_seen;
+    struct vr_flow_entry *ft_copy;
 } main_table;
 
 int mem_fd;
@@ -67,115 +99,355 @@ flow_get(unsigned int flow_index)
     return &main_table.ft_entries[flow_index];
 }
 
+/* in the SPLIT format, add up the per-cpu counters */
 static void
-dump_table(struct flow_table *ft)
+flow_stats_get(struct flow_table *ft, unsigned int flow_index,
+        u_int64_t *bytes, u_int64_t *packets)
 {
-    unsigned int i, j, fi, need_flag_print = 0;
-    struct vr_flow_entry *fe;
-    char action, flag_string[sizeof(fe->fe_flags) * 8 + 32];
-    struct in_addr in_src, in_dest;
+    unsigned int cpu;
+    struct vr_flow_stats *stats;
+    struct vr_flow_cpu_stats *cpu_stats;
+
+    if (ft->ft_version != VR_FLOW_TABLE_FORMAT_SPLIT || !ft->ft_stats) {
+        stats = &ft->ft_entries[flow_index].fe_stats;
+        *bytes = ((u_int64_t)stats->flow_bytes_oflow << 32) |
+            stats->flow_bytes;
+        *packets = ((u_int64_t)stats->flow_packets_oflow << 32) |
+            stats->flow_packets;
+        return;
+    }
+
+    *bytes = *packets = 0;
+    for (cpu = 0; cpu < ft->ft_stats_cpus; cpu++) {
+        cpu_stats = (struct vr_flow_cpu_stats *)(ft->ft_stats +
+                (cpu * ft->ft_stats_span) +
+                (flow_index * VR_FLOW_STATS_SLOT_SIZE));
+        *bytes += cpu_stats->fcs_bytes;
+        *packets += cpu_stats->fcs_packets;
+    }
+
+    return;
+}
+
+/* active, and in the view that the filter options ask for */
+static bool
+flow_match(struct vr_flow_entry *fe)
+{
+    if (!(fe->fe_flags & VR_FLOW_FLAG_ACTIVE))
+        return false;
+
+    if (vrf_set && fe->fe_key.key_vrf_id != filter_vrf)
+        return false;
+
+    if (ip_set && fe->fe_key.key_src_ip != filter_ip &&
+            fe->fe_key.key_dest_ip != filter_ip)
+        return false;
+
+    if (action_set && fe->fe_action != filter_action)
+        return false;
+
+    if (elephant_set && !(fe->fe_rate_flags & VR_FLOW_RATE_ELEPHANT))
+        return false;
+
+    return true;
+}
+
+/* what a listing shows, other than the statistics */
+static bool
+flow_entry_differs(struct vr_flow_entry *a, struct vr_flow_entry *b)
+{
+    return memcmp(&a->fe_key, &b->fe_key, sizeof(a->fe_key)) ||
+        a->fe_action != b->fe_action || a->fe_flags != b->fe_flags ||
+        a->fe_rflow != b->fe_rflow || a->fe_dvrf != b->fe_dvrf ||
+        a->fe_src_nh_index != b->fe_src_nh_index ||
+        a->fe_ecmp_nh_index != b->fe_ecmp_nh_index ||
+        a->fe_mirror_id != b->fe_mirror_id ||
+        a->fe_sec_mirror_id != b->fe_sec_mirror_id ||
+        a->fe_rate_flags != b->fe_rate_flags;
+}
+
+/*
+ * call 'fn' with the old and the new copy of each entry that changed since
+ * the last scan. with the change counters of the kernel, only the groups
+ * whose counter moved are read, and the rest of the table is not touched
+ */
+static void
+flow_scan(struct flow_table *ft, void (*fn)(struct flow_table *,
+            unsigned int, struct vr_flow_entry *, struct vr_flow_entry *))
+{
+    unsigned int g, i, end, groups;
+    u_int32_t gen;
+    struct vr_flow_entry fe;
+
+    if (!ft->ft_copy) {
+        ft->ft_copy = calloc(ft->ft_num_entries, sizeof(*ft->ft_copy));
+        ft->ft_seen = calloc(ft->ft_groups + 1, sizeof(*ft->ft_seen));
+        if (!ft->ft_copy || !ft->ft_seen) {
+            printf("flow table: %s\n", strerror(ENOMEM));
+            exit(ENOMEM);
+        }
+    }
 
+    groups = (ft->ft_num_entries + VR_FLOW_CHANGE_GROUP - 1) /
+        VR_FLOW_CHANGE_GROUP;
+    for (g = 0; g < groups; g++) {
+        /* entries past the counters (of a resize) are always read */
+        if (ft->ft_changes && g < ft->ft_groups) {
+            gen = ft->ft_changes[g];
+            if (gen == ft->ft_seen[g])
+                continue;
+            ft->ft_seen[g] = gen;
+            /* the counter before the entries */
+            __sync_synchronize();
+        }
+
+        end = (g + 1) * VR_FLOW_CHANGE_GROUP;
+        if (end > ft->ft_num_entries)
+            end = ft->ft_num_entries;
+        for (i = g * VR_FLOW_CHANGE_GROUP; i < end; i++) {
+            memcpy(&fe, &ft->ft_entries[i], sizeof(fe));
+            if (!flow_entry_differs(&ft->ft_copy[i], &fe))
+                continue;
+
+            fn(ft, i, &ft->ft_copy[i], &fe);
+            memcpy(&ft->ft_copy[i], &fe, sizeof(fe));
+        }
+    }
+
+    return;
+}
+
+static void
+dump_table_header(struct flow_table *ft)
+{
     printf("Flow table\n\n");
+    if (ft->ft_shards > 1)
+        printf("Sharded across %u NUMA nodes\n\n", ft->ft_shards);
+    if (ft->ft_cache_hits || ft->ft_cache_misses)
+        printf("Flow cache hits %llu, misses %llu\n\n",
+                (unsigned long long)ft->ft_cache_hits,
+                (unsigned long long)ft->ft_cache_misses);
     printf(" Index              Source:Port           Destination:Port    \tProto(V)\n");
     printf("-----------------------------------------------------------------");
     printf("--------\n");
-    for (i = 0; i < ft->ft_num_entries; i++) {
-        bzero(flag_string, sizeof(flag_string));
-        need_flag_print = 0;
-        fe = (struct vr_flow_entry *)((char *)ft->ft_entries + (i * sizeof(*fe)));
-        if (fe->fe_flags & VR_FLOW_FLAG_ACTIVE) {
-            in_src.s_addr = fe->fe_key.key_src_ip;
-            in_dest.s_addr = fe->fe_key.key_dest_ip;
-            printf("%6d", i);
-            if (fe->fe_rflow >= 0)
-                printf("<=>%-6d", fe->fe_rflow);
-            else
-                printf("         ");
-
-            printf("   %12s:%-5d    ", inet_ntoa(in_src),
-                    ntohs(fe->fe_key.key_src_port));
-            printf("%16s:%-5d    %d (%d",
-                    inet_ntoa(in_dest),
-                    ntohs(fe->fe_key.key_dst_port),
-                    fe->fe_key.key_proto,
-                    fe->fe_key.key_vrf_id);
-
-            if (fe->fe_rflow >= 0 && fe->fe_flags & VR_FLOW_FLAG_VRFT)
-                printf("->%d", fe->fe_dvrf);
-
-            printf(")\n");
-
-            switch (fe->fe_action) {
-            case VR_FLOW_ACTION_HOLD:
-                action = 'H';
-                break;
 
-            case VR_FLOW_ACTION_FORWARD:
-                action = 'F';
-                break;
+    return;
+}
 
-            case VR_FLOW_ACTION_DROP:
-                action = 'D';
-                break;
+static void
+dump_entry(struct flow_table *ft, unsigned int i, struct vr_flow_entry *fe)
+{
+    unsigned int j, fi, need_flag_print = 0;
+    u_int64_t bytes, packets;
+    char action, flag_string[sizeof(fe->fe_flags) * 8 + 32];
+    struct in_addr in_src, in_dest;
 
-            case VR_FLOW_ACTION_NAT:
-                action = 'N';
-                need_flag_print = 1;
-                fi = 0;
-                for (j = 0; (j < (sizeof(fe->fe_flags) * 8)) &&
-                        fi < sizeof(flag_string); j++)
-                    switch ((1 << j) & fe->fe_flags) {
-                    case VR_FLOW_FLAG_SNAT:
-                        flag_string[fi++] = 'S';
-                        break;
-                    case VR_FLOW_FLAG_DNAT:
-                        flag_string[fi++] = 'D';
-                        break;
-                    case VR_FLOW_FLAG_SPAT:
-                        flag_string[fi++] = 'P';
-                        flag_string[fi++] = 's';
-                        break;
-                    case VR_FLOW_FLAG_DPAT:
-                        flag_string[fi++] = 'P';
-                        flag_string[fi++] = 'd';
-                    }
+    bzero(flag_string, sizeof(flag_string));
+    in_src.s_addr = fe->fe_key.key_src_ip;
+    in_dest.s_addr = fe->fe_key.key_dest_ip;
+    printf("%6d", i);
+    if (fe->fe_rflow >= 0)
+        printf("<=>%-6d", fe->fe_rflow);
+    else
+        printf("         ");
 
-                break;
+    printf("   %12s:%-5d    ", inet_ntoa(in_src),
+            ntohs(fe->fe_key.key_src_port));
+    printf("%16s:%-5d    %d (%d",
+            inet_ntoa(in_dest),
+            ntohs(fe->fe_key.key_dst_port),
+            fe->fe_key.key_proto,
+            fe->fe_key.key_vrf_id);
 
-            default:
-                action = 'U';
-            }
+    if (fe->fe_rflow >= 0 && fe->fe_flags & VR_FLOW_FLAG_VRFT)
+        printf("->%d", fe->fe_dvrf);
+
+    printf(")\n");
+
+    switch (fe->fe_action) {
+    case VR_FLOW_ACTION_HOLD:
+        action = 'H';
+        break;
 
-            printf("\t\t\t(");
-            printf("Action:%c", action);
-            if (need_flag_print)
-                printf("(%s)", flag_string);
-
-            printf(", ");
-            if (fe->fe_ecmp_nh_index >= 0)
-                printf("E:%d, ", fe->fe_ecmp_nh_index);
-
-            printf("S(nh):%u, ", fe->fe_src_nh_index);
-            printf(" Statistics:%d/%d", fe->fe_stats.flow_packets,
-                    fe->fe_stats.flow_bytes);
-            if (fe->fe_flags & VR_FLOW_FLAG_MIRROR) {
-                printf(" Mirror Index :");
-                if (fe->fe_mirror_id < VR_MAX_MIRROR_INDICES)
-                    printf(" %d", fe->fe_mirror_id);
-                if (fe->fe_sec_mirror_id < VR_MAX_MIRROR_INDICES)
-                    printf(", %d", fe->fe_sec_mirror_id);
+    case VR_FLOW_ACTION_FORWARD:
+        action = 'F';
+        break;
+
+    case VR_FLOW_ACTION_DROP:
+        action = 'D';
+        break;
+
+    case VR_FLOW_ACTION_NAT:
+        action = 'N';
+        need_flag_print = 1;
+        fi = 0;
+        for (j = 0; (j < (sizeof(fe->fe_flags) * 8)) &&
+                fi < sizeof(flag_string); j++)
+            switch ((1 << j) & fe->fe_flags) {
+            case VR_FLOW_FLAG_SNAT:
+                flag_string[fi++] = 'S';
+                break;
+            case VR_FLOW_FLAG_DNAT:
+                flag_string[fi++] = 'D';
+                break;
+            case VR_FLOW_FLAG_SPAT:
+                flag_string[fi++] = 'P';
+                flag_string[fi++] = 's';
+                break;
+            case VR_FLOW_FLAG_DPAT:
+                flag_string[fi++] = 'P';
+                flag_string[fi++] = 'd';
             }
-            printf(")\n\n");
-        }
+
+        break;
+
+    default:
+        action = 'U';
     }
 
+    printf("\t\t\t(");
+    printf("Action:%c", action);
+    if (need_flag_print)
+        printf("(%s)", flag_string);
+
+    printf(", ");
+    if (fe->fe_ecmp_nh_index >= 0)
+        printf("E:%d, ", fe->fe_ecmp_nh_index);
+
+    printf("S(nh):%u, ", fe->fe_src_nh_index);
+    flow_stats_get(ft, i, &bytes, &packets);
+    printf(" Statistics:%llu/%llu", (unsigned long long)packets,
+            (unsigned long long)bytes);
+    if (fe->fe_rate_flags & VR_FLOW_RATE_ELEPHANT)
+        printf(" Elephant");
+    if (fe->fe_flags & VR_FLOW_FLAG_MIRROR) {
+        printf(" Mirror Index :");
+        if (fe->fe_mirror_id < VR_MAX_MIRROR_INDICES)
+            printf(" %d", fe->fe_mirror_id);
+        if (fe->fe_sec_mirror_id < VR_MAX_MIRROR_INDICES)
+            printf(", %d", fe->fe_sec_mirror_id);
+    }
+    printf(")\n\n");
+
+    return;
+}
+
+static void
+dump_table(struct flow_table *ft)
+{
+    unsigned int i;
+    struct vr_flow_entry *fe;
+
+    dump_table_header(ft);
+    for (i = 0; i < ft->ft_num_entries; i++) {
+        fe = (struct vr_flow_entry *)((char *)ft->ft_entries + (i * sizeof(*fe)));
+        if (flow_match(fe))
+            dump_entry(ft, i, fe);
+    }
+
+    return;
+}
+
+/* in a watch, the entries that came, changed or went */
+static void
+flow_watch_entry(struct flow_table *ft, unsigned int i,
+        struct vr_flow_entry *old, struct vr_flow_entry *fe)
+{
+    if (flow_match(fe))
+        dump_entry(ft, i, fe);
+    else if (flow_match(old))
+        printf("%6d removed\n\n", i);
+
     return;
 }
 
 static void
 flow_list(void)
 {
-    dump_table(&main_table);
+    struct flow_table *ft = &main_table;
+
+    if (!watch_set) {
+        dump_table(ft);
+        return;
+    }
+
+    /* the first scan has all of the table as new */
+    dump_table_header(ft);
+    while (1) {
+        flow_scan(ft, flow_watch_entry);
+        fflush(stdout);
+        usleep(watch_msecs * 1000);
+    }
+}
+
+static void
+flow_setup_stats(void)
+{
+    unsigned int i;
+    struct flow_table *ft = &main_table;
+
+    printf("Flow setup latency (time in HOLD)\n\n");
+    printf("%16s %16s\n", "Usecs", "Flows");
+    for (i = 0; i < VR_FLOW_SETUP_BUCKETS; i++) {
+        if (!ft->ft_hold_latency[i])
+            continue;
+
+        if (i == VR_FLOW_SETUP_BUCKETS - 1)
+            printf("%15u+ ", 1U << i);
+        else
+            printf("%16u ", i ? 1U << i : 0);
+        printf("%16llu\n", (unsigned long long)ft->ft_hold_latency[i]);
+    }
+
+    printf("\nHold queue overflows %llu\n",
+            (unsigned long long)ft->ft_hold_queue_overflows);
+
+    /* older kernels do not report the probes */
+    if (!ft->ft_oflow_entries)
+        return;
+
+    printf("\nFlow table in use %u of %u, overflow table %u of %u\n",
+            ft->ft_main_used, ft->ft_main_entries, ft->ft_oflow_used,
+            ft->ft_oflow_entries);
+    printf("Inserts to the overflow table %llu, with no room %llu\n",
+            (unsigned long long)ft->ft_oflow_inserts,
+            (unsigned long long)ft->ft_insert_fails);
+
+    printf("\nFlow table probes (entries looked at)\n\n");
+    printf("%16s %16s %16s\n", "Probes", "Lookups", "Inserts");
+    for (i = 0; i < VR_FLOW_PROBE_BUCKETS; i++) {
+        if (!ft->ft_lookup_probes[i] && !ft->ft_insert_probes[i])
+            continue;
+
+        if (i == VR_FLOW_PROBE_BUCKETS - 1)
+            printf("%15u+ ", 1U << i);
+        else
+            printf("%16u ", 1U << i);
+        printf("%16llu %16llu\n", (unsigned long long)ft->ft_lookup_probes[i],
+                (unsigned long long)ft->ft_insert_probes[i]);
+    }
+
+    return;
+}
+
+static int rate_active_entries, rate_total_entries;
+
+static void
+flow_rate_account(struct flow_table *ft, unsigned int i,
+        struct vr_flow_entry *old, struct vr_flow_entry *fe)
+{
+    if (flow_match(old)) {
+        rate_total_entries--;
+        if (old->fe_action != VR_FLOW_ACTION_HOLD)
+            rate_active_entries--;
+    }
+
+    if (flow_match(fe)) {
+        rate_total_entries++;
+        if (fe->fe_action != VR_FLOW_ACTION_HOLD)
+            rate_active_entries++;
+    }
+
     return;
 }
 
@@ -183,8 +455,6 @@ static void
 flow_rate(void)
 {
     struct flow_table *ft = &main_table;
-    unsigned int i;
-    struct vr_flow_entry *fe;
     struct timeval now;
     struct timeval last_time;
     int active_entries = 0;
@@ -196,18 +466,15 @@ flow_rate(void)
     int total_rate;
 
     gettimeofday(&last_time, NULL);
+    /* the counts move by what changed, instead of by a walk of the table */
+    flow_scan(ft, flow_rate_account);
+    prev_active_entries = rate_active_entries;
+    prev_total_entries = rate_total_entries;
     while (1) {
-        active_entries = 0;
-        total_entries = 0;
         usleep(500000);
-        for (i = 0; i < ft->ft_num_entries; i++) {
-            fe = (struct vr_flow_entry *)((char *)ft->ft_entries + (i * sizeof(*fe)));
-            if (fe->fe_flags & VR_FLOW_FLAG_ACTIVE) {
-                total_entries++;
-                if (fe->fe_action != VR_FLOW_ACTION_HOLD)
-                    active_entries++;
-            }
-        }
+        flow_scan(ft, flow_rate_account);
+        active_entries = rate_active_entries;
+        total_entries = rate_total_entries;
         gettimeofday(&now, NULL);
         /* calc time difference and rate */
         diff_ms = (now.tv_sec - last_time.tv_sec) * 1000;
@@ -244,6 +511,8 @@ int
 flow_table_map(vr_flow_req *req)
 {
     int ret;
+    unsigned int i;
+    size_t map_size;
     struct flow_table *ft = &main_table;
 
     if (req->fr_ftable_dev < 0)
@@ -262,7 +531,14 @@ flow_table_map(vr_flow_req *req)
         exit(errno);
     }
 
-    ft->ft_entries = (struct vr_flow_entry *)mmap(NULL, req->fr_ftable_size,
+    /* the change counters are at the end, after all of the other tables */
+    map_size = (size_t)req->fr_ftable_size + req->fr_ftable_stats_size;
+    if (req->fr_ftable_changes_size)
+        map_size += (size_t)req->fr_ftable_event_size +
+            req->fr_ftable_agent_ring_size + req->fr_ftable_counters_size +
+            req->fr_ftable_changes_size;
+
+    ft->ft_entries = (struct vr_flow_entry *)mmap(NULL, map_size,
             PROT_READ, MAP_SHARED, mem_fd, 0);
     if (ft->ft_entries == MAP_FAILED) {
         printf("flow table: %s\n", strerror(errno));
@@ -271,6 +547,39 @@ flow_table_map(vr_flow_req *req)
 
     ft->ft_span = req->fr_ftable_size;
     ft->ft_num_entries = ft->ft_span / sizeof(struct vr_flow_entry);
+    /* older kernels do not report the format; statistics are inline */
+    ft->ft_version = req->fr_ftable_version;
+    if (req->fr_ftable_stats_size) {
+        ft->ft_stats = (char *)ft->ft_entries + ft->ft_span;
+        ft->ft_stats_cpus = req->fr_ftable_stats_cpus;
+        if (!ft->ft_stats_cpus)
+            ft->ft_stats_cpus = 1;
+        ft->ft_stats_span = req->fr_ftable_stats_size / ft->ft_stats_cpus;
+    }
+    if (req->fr_ftable_changes_size) {
+        ft->ft_changes = (u_int32_t *)((char *)ft->ft_entries + map_size -
+                req->fr_ftable_changes_size);
+        ft->ft_groups = req->fr_ftable_changes_size / sizeof(u_int32_t);
+    }
+    ft->ft_shards = req->fr_ftable_shards;
+    ft->ft_cache_hits = req->fr_cache_hits;
+    ft->ft_cache_misses = req->fr_cache_misses;
+    for (i = 0; i < req->fr_hold_latency_size &&
+            i < VR_FLOW_SETUP_BUCKETS; i++)
+        ft->ft_hold_latency[i] = req->fr_hold_latency[i];
+    ft->ft_hold_queue_overflows = req->fr_hold_queue_overflows;
+    for (i = 0; i < req->fr_lookup_probes_size &&
+            i < VR_FLOW_PROBE_BUCKETS; i++)
+        ft->ft_lookup_probes[i] = req->fr_lookup_probes[i];
+    for (i = 0; i < req->fr_insert_probes_size &&
+            i < VR_FLOW_PROBE_BUCKETS; i++)
+        ft->ft_insert_probes[i] = req->fr_insert_probes[i];
+    ft->ft_oflow_inserts = req->fr_oflow_inserts;
+    ft->ft_insert_fails = req->fr_insert_fails;
+    ft->ft_main_entries = req->fr_ftable_entries;
+    ft->ft_main_used = req->fr_ftable_used;
+    ft->ft_oflow_used = req->fr_oflow_used;
+    ft->ft_oflow_entries = req->fr_oflow_entries;
     return ft->ft_num_entries;
 }
 
@@ -349,6 +658,16 @@ flow_table_get(void)
     return make_flow_req(&flow_req);
 }
 
+static int
+flow_table_resize(unsigned int entries)
+{
+    memset(&flow_req, 0, sizeof(flow_req));
+    flow_req.fr_op = FLOW_OP_FLOW_TABLE_RESIZE;
+    flow_req.fr_ftable_entries = entries;
+
+    return make_flow_req(&flow_req);
+}
+
 static int
 flow_table_setup(void)
 {
@@ -417,12 +736,167 @@ flow_validate(int flow_index, char action)
     return;
 }
 
+struct flow_saved_hdr {
+    u_int32_t fsh_magic;
+    u_int32_t fsh_record_size;
+    u_int32_t fsh_records;
+};
+
+static void
+flow_save_entry(struct vr_flow_entry *fe, struct vr_flow_saved *saved,
+        bool pair)
+{
+    memset(saved, 0, sizeof(*saved));
+    saved->fsv_key = fe->fe_key;
+    saved->fsv_action = fe->fe_action;
+    saved->fsv_flags = fe->fe_flags;
+    saved->fsv_dvrf = fe->fe_dvrf;
+    saved->fsv_tcp_flags = fe->fe_tcp_flags;
+    saved->fsv_src_nh_index = fe->fe_src_nh_index;
+    saved->fsv_ecmp_nh_index = fe->fe_ecmp_nh_index;
+    if (pair)
+        saved->fsv_saved_flags |= VR_FLOW_SAVED_PAIR;
+
+    return;
+}
+
+static bool
+flow_savable(struct vr_flow_entry *fe)
+{
+    return (fe->fe_flags & VR_FLOW_FLAG_ACTIVE) &&
+        fe->fe_action != VR_FLOW_ACTION_HOLD;
+}
+
+/* the established flows, with a flow and its reverse flow side by side */
+static int
+flow_table_save(const char *file)
+{
+    unsigned int i, rindex;
+    char *saved_map;
+    FILE *fp;
+    struct flow_table *ft = &main_table;
+    struct flow_saved_hdr hdr;
+    struct vr_flow_saved saved[2];
+    struct vr_flow_entry *fe, *rfe;
+
+    saved_map = calloc(ft->ft_num_entries, 1);
+    if (!saved_map)
+        return -ENOMEM;
+
+    fp = fopen(file, "w");
+    if (!fp) {
+        perror(file);
+        free(saved_map);
+        return -errno;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.fsh_magic = VR_FLOW_SAVED_MAGIC;
+    hdr.fsh_record_size = sizeof(struct vr_flow_saved);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    for (i = 0; i < ft->ft_num_entries; i++) {
+        fe = flow_get(i);
+        if (saved_map[i] || !flow_savable(fe))
+            continue;
+
+        rfe = NULL;
+        rindex = fe->fe_rflow;
+        if ((fe->fe_flags & VR_RFLOW_VALID) && rindex < ft->ft_num_entries &&
+                rindex != i && !saved_map[rindex]) {
+            rfe = flow_get(rindex);
+            if (!flow_savable(rfe) || rfe->fe_rflow != (int)i)
+                rfe = NULL;
+        }
+
+        flow_save_entry(fe, &saved[0], rfe != NULL);
+        saved_map[i] = 1;
+        if (rfe) {
+            flow_save_entry(rfe, &saved[1], false);
+            saved_map[rindex] = 1;
+        }
+
+        if (fwrite(saved, sizeof(saved[0]), rfe ? 2 : 1, fp) !=
+                (rfe ? 2 : 1)) {
+            perror(file);
+            break;
+        }
+        hdr.fsh_records += rfe ? 2 : 1;
+    }
+
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fclose(fp);
+    free(saved_map);
+
+    printf("%u flow entries saved to %s\n", hdr.fsh_records, file);
+    return 0;
+}
+
+static int
+flow_table_restore_batch(struct vr_flow_saved *saved, unsigned int num)
+{
+    memset(&flow_req, 0, sizeof(flow_req));
+    flow_req.fr_op = FLOW_OP_FLOW_TABLE_RESTORE;
+    flow_req.fr_restore = (int8_t *)saved;
+    flow_req.fr_restore_size = num * sizeof(*saved);
+
+    return make_flow_req(&flow_req);
+}
+
+static int
+flow_table_restore(const char *file)
+{
+    int ret = 0;
+    unsigned int num = 0;
+    FILE *fp;
+    struct flow_saved_hdr hdr;
+    struct vr_flow_saved saved[FLOW_RESTORE_BATCH];
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        return -errno;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            hdr.fsh_magic != VR_FLOW_SAVED_MAGIC ||
+            hdr.fsh_record_size != sizeof(struct vr_flow_saved)) {
+        printf("%s: not a flow table saved by this version\n", file);
+        fclose(fp);
+        return -EINVAL;
+    }
+
+    while (fread(&saved[num], sizeof(saved[0]), 1, fp) == 1) {
+        num++;
+        /* a pair does not get split over two requests */
+        if (saved[num - 1].fsv_saved_flags & VR_FLOW_SAVED_PAIR)
+            continue;
+
+        if (num >= FLOW_RESTORE_BATCH - 1) {
+            ret = flow_table_restore_batch(saved, num);
+            if (ret < 0)
+                break;
+            num = 0;
+        }
+    }
+
+    if (ret >= 0 && num)
+        ret = flow_table_restore_batch(saved, num);
+
+    fclose(fp);
+    return ret;
+}
+
 static void
 Usage(void)
 {
     printf("flow [-f flow_index][-d flow_index][-i flow_index][-t flow_index]\n");
     printf("     [--mirror=mirror table index]\n");
-    printf("     [-l]\n");
+    printf("     [--resize=number of flow entries]\n");
+    printf("     [--save=file][--restore=file]\n");
+    printf("     [-l [--watch=msecs]][-r][-s]\n");
+    printf("     [--vrf=vrf][--ip=address][--action=F|D|H|N][--elephants]\n");
     printf("\n");
 
     printf("-f <flow_index>\t Set forward action for flow at flow_index <flow_index>\n");
@@ -431,7 +905,15 @@ Usage(void)
     printf("\t\t --dvrf=destination VRF to send the packet to,\n");
     printf("--mirror\tmirror index to mirror to\n");
     printf("-l\t\t List all flows\n");
+    printf("--watch\t\twith -l, list the flows that changed, every msecs\n");
+    printf("--vrf, --ip, --action\tlist or count only the matching flows\n");
+    printf("--elephants\tlist or count only the flows over the elephant rate\n");
     printf("-r\t\t Start dumping flow setup rate\n");
+    printf("-s, --stats\t Show the flow setup latency, hold queue overflows,\n");
+    printf("\t\t table occupancy and probe lengths\n");
+    printf("--resize\tgrow the flow table to the given number of entries\n");
+    printf("--save\t\tsave the established flows to a file, before a module reload\n");
+    printf("--restore\tset the flows of a saved file up again, after the reload\n");
 
     exit(-EINVAL);
 }
@@ -439,19 +921,41 @@ Usage(void)
 enum opt_flow_index {
     DVRF_OPT_INDEX,
     MIRROR_OPT_INDEX,
+    RESIZE_OPT_INDEX,
+    SAVE_OPT_INDEX,
+    RESTORE_OPT_INDEX,
+    WATCH_OPT_INDEX,
+    VRF_OPT_INDEX,
+    IP_OPT_INDEX,
+    ACTION_OPT_INDEX,
+    ELEPHANT_OPT_INDEX,
+    STATS_OPT_INDEX,
     MAX_OPT_INDEX
 };
 
 static struct option long_options[] = {
     [DVRF_OPT_INDEX]    = {"dvrf", required_argument, &dvrf_set, 1},
     [MIRROR_OPT_INDEX]  = {"mirror", required_argument, &mir_set, 1},
+    [RESIZE_OPT_INDEX]  = {"resize", required_argument, &resize_set, 1},
+    [SAVE_OPT_INDEX]    = {"save", required_argument, &save_set, 1},
+    [RESTORE_OPT_INDEX] = {"restore", required_argument, &restore_set, 1},
+    [WATCH_OPT_INDEX]   = {"watch", required_argument, &watch_set, 1},
+    [VRF_OPT_INDEX]     = {"vrf", required_argument, &vrf_set, 1},
+    [IP_OPT_INDEX]      = {"ip", required_argument, &ip_set, 1},
+    [ACTION_OPT_INDEX]  = {"action", required_argument, &action_set, 1},
+    [ELEPHANT_OPT_INDEX] = {"elephants", no_argument, &elephant_set, 1},
+    [STATS_OPT_INDEX]   = {"stats", no_argument, &setup_stats, 1},
     [MAX_OPT_INDEX]     = { NULL,  0,                 0        , 0}
 };
 
 static void
 validate_options(void)
 {
-    if (!flow_index && !list && !rate)
+    if (!flow_index && !list && !rate && !setup_stats && !resize_set &&
+            !save_set && !restore_set)
+        Usage();
+
+    if (watch_set && !list)
         Usage();
 
     return;
@@ -474,6 +978,60 @@ parse_long_opts(int opt_flow_index, char *opt_arg)
             Usage();
         break;
 
+    case RESIZE_OPT_INDEX:
+        resize_entries = strtoul(opt_arg, NULL, 0);
+        if (errno || !resize_entries)
+            Usage();
+        break;
+
+    case SAVE_OPT_INDEX:
+        save_file = opt_arg;
+        break;
+
+    case RESTORE_OPT_INDEX:
+        restore_file = opt_arg;
+        break;
+
+    case WATCH_OPT_INDEX:
+        watch_msecs = strtoul(opt_arg, NULL, 0);
+        if (errno || !watch_msecs)
+            Usage();
+        break;
+
+    case VRF_OPT_INDEX:
+        filter_vrf = strtoul(opt_arg, NULL, 0);
+        if (errno)
+            Usage();
+        break;
+
+    case IP_OPT_INDEX:
+        if (inet_pton(AF_INET, opt_arg, &filter_ip) != 1)
+            Usage();
+        break;
+
+    case ACTION_OPT_INDEX:
+        switch (opt_arg[0]) {
+        case 'F':
+            filter_action = VR_FLOW_ACTION_FORWARD;
+            break;
+        case 'D':
+            filter_action = VR_FLOW_ACTION_DROP;
+            break;
+        case 'H':
+            filter_action = VR_FLOW_ACTION_HOLD;
+            break;
+        case 'N':
+            filter_action = VR_FLOW_ACTION_NAT;
+            break;
+        default:
+            Usage();
+        }
+        break;
+
+    case ELEPHANT_OPT_INDEX:
+    case STATS_OPT_INDEX:
+        break;
+
     default:
         Usage();
     }
@@ -488,7 +1046,7 @@ main(int argc, char *argv[])
     int ret;
     int option_index;
 
-    while ((opt = getopt_long(argc, argv, "d:f:i:lr",
+    while ((opt = getopt_long(argc, argv, "d:f:i:lrs",
                     long_options, &option_index)) >= 0) {
         switch (opt) {
         case 'f':
@@ -505,6 +1063,11 @@ main(int argc, char *argv[])
         case 'r':
             rate = 1;
             break;
+
+        case 's':
+            setup_stats = 1;
+            break;
+
         case 0:
             parse_long_opts(option_index, optarg);
             break;
@@ -520,14 +1083,25 @@ main(int argc, char *argv[])
     if (ret < 0)
         return ret;
 
+    if (resize_set)
+        return flow_table_resize(resize_entries);
+
+    if (restore_set)
+        return flow_table_restore(restore_file);
+
     ret = flow_table_get();
     if (ret < 0)
         return ret;
 
+    if (save_set)
+        return flow_table_save(save_file);
+
     if (list)
         flow_list();
     else if (rate)
         flow_rate();
+    else if (setup_stats)
+        flow_setup_stats();
     else
         flow_validate(flow_index, flow_cmd);
 
@@ -35,6 +35,7 @@ static struct nl_client *cl;
 static bool dump_pending = false;
 static int dump_marker = -1;
 static int op;
+static int32_t mirror_sample, mirror_snaplen, mirror_rate;
 
 void
 vr_mirror_req_process(void *s_req)
@@ -46,6 +47,8 @@ vr_mirror_req_process(void *s_req)
    printf("       Nhid  : %d\n", req->mirr_nhid);
    printf("       flags : %x\n", req->mirr_flags);
    printf("       Ref   : %d\n", req->mirr_users);
+   printf("       Sample: %d Snaplen: %d Rate: %d\n", req->mirr_sample,
+           req->mirr_snaplen, req->mirr_rate);
 
    if (op == 4)
        dump_marker = req->mirr_index;
@@ -76,10 +79,14 @@ vr_mirror_op(int opt, uint32_t index, uint32_t nh_id)
     struct nl_response *resp;
 
 op_retry:
+    memset(&mirror_req, 0, sizeof(mirror_req));
 
     if (opt == 1) {
         mirror_req.h_op = SANDESH_OP_ADD;
         mirror_req.mirr_nhid = nh_id;
+        mirror_req.mirr_sample = mirror_sample;
+        mirror_req.mirr_snaplen = mirror_snaplen;
+        mirror_req.mirr_rate = mirror_rate;
     } else if (opt == 2) {
         mirror_req.h_op = SANDESH_OP_DELETE;
     } else if (opt == 3) {
@@ -141,7 +148,10 @@ usage()
            "       d - delete\n"
            "       g - get\n"
            "       n - <nhop_id>\n"
-           "       m - <mirror index>\n");
+           "       m - <mirror index>\n"
+           "       s - <mirror one in these many packets>\n"
+           "       l - <bytes of a packet to mirror>\n"
+           "       r - <packets to mirror in a second, at most>\n");
                       
 
 }
@@ -169,7 +179,7 @@ int main(int argc, char *argv[])
 
     nh_id = 0;
     index = -1;
-    while ((opt = getopt(argc, argv, "bcdgn:m:")) != -1) {
+    while ((opt = getopt(argc, argv, "bcdgn:m:s:l:r:")) != -1) {
             switch (opt) {
             case 'c':
                 op = 1;
@@ -189,6 +199,15 @@ int main(int argc, char *argv[])
             case 'm':
                 index = atoi(optarg);
                 break;
+            case 's':
+                mirror_sample = atoi(optarg);
+                break;
+            case 'l':
+                mirror_snaplen = atoi(optarg);
+                break;
+            case 'r':
+                mirror_rate = atoi(optarg);
+                break;
             case '?':
             default:
                 usage();
@@ -188,6 +188,11 @@ nh_flags(uint16_t flags, uint8_t type, char *ptr)
                 strcat(ptr, "Multi Proto, ");
             break;
 
+        case NH_FLAG_COMPOSITE_TREE:
+            if (type == NH_COMPOSITE)
+                strcat(ptr, "Tree, ");
+            break;
+
         case NH_FLAG_MCAST:
             strcat(ptr, "Multicast, ");
             break;
@@ -267,6 +272,10 @@ vr_nexthop_req_process(void *s_req)
             printf(" %d", req->nhr_nh_list[i]);
             if (req->nhr_label_list[i] >= 0)
                 printf("(%d)", req->nhr_label_list[i]);
+            if (req->nhr_src_list_size > i && req->nhr_src_list[i]) {
+                a.s_addr = req->nhr_src_list[i];
+                printf("[from %s]", inet_ntoa(a));
+            }
         }
         printf("\n");
     }
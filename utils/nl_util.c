@@ -43,6 +43,8 @@ extern void vr_vrf_assign_req_process(void *s_req) __attribute__((weak));
 extern void vr_vrf_stats_req_process(void *s_req) __attribute__((weak));
 extern void vr_drop_stats_req_process(void *s_req) __attribute__((weak));
 extern void vr_vxlan_req_process(void *s_req) __attribute__((weak));
+extern void vr_perf_req_process(void *s_req) __attribute__((weak));
+extern void vr_drop_capture_req_process(void *s_req) __attribute__((weak));
 
 void
 vrouter_ops_process(void *s_req) 
@@ -118,6 +120,18 @@ vr_vxlan_req_process(void *s_req)
     return;
 }
 
+void
+vr_perf_req_process(void *s_req)
+{
+    return;
+}
+
+void
+vr_drop_capture_req_process(void *s_req)
+{
+    return;
+}
+
 struct nl_response *
 nl_parse_gen_ctrl(struct nl_client *cl)
 {
@@ -203,8 +217,9 @@ nl_build_sandesh_attr_without_attr_len(struct nl_client *cl)
     return 0;
 }
 
-int
-nl_build_header(struct nl_client *cl, unsigned char **buf, __u32 *buf_len)
+static int
+__nl_build_header(struct nl_client *cl, __u8 cmd, unsigned char **buf,
+        __u32 *buf_len)
 {
     int ret;
 
@@ -218,7 +233,7 @@ nl_build_header(struct nl_client *cl, unsigned char **buf, __u32 *buf_len)
     if (ret)
         return ret;
 
-    ret = nl_build_genlh(cl, SANDESH_REQUEST, 0);
+    ret = nl_build_genlh(cl, cmd, 0);
     if (ret)
         return ret;
 
@@ -232,6 +247,25 @@ nl_build_header(struct nl_client *cl, unsigned char **buf, __u32 *buf_len)
     return 0;
 }
 
+int
+nl_build_header(struct nl_client *cl, unsigned char **buf, __u32 *buf_len)
+{
+    return __nl_build_header(cl, SANDESH_REQUEST, buf, buf_len);
+}
+
+/*
+ * the header of a batch request. the caller encodes the objects one after
+ * the other from buf on, and passes their total length to nl_update_header.
+ * the response code is the number of objects processed, or the error of
+ * the first one that failed
+ */
+int
+nl_build_batch_header(struct nl_client *cl, unsigned char **buf,
+        __u32 *buf_len)
+{
+    return __nl_build_header(cl, SANDESH_REQUEST_BATCH, buf, buf_len);
+}
+
 void
 nl_update_header(struct nl_client *cl, int data_len)
 {
@@ -15,11 +15,15 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <asm/types.h>
+#include <time.h>
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/if_ether.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
 
 #include <net/if.h>
 #include <net/ethernet.h>
@@ -41,6 +45,10 @@
 #define XEN_LL_TYPE_STRING      "xenll"
 #define GATEWAY_TYPE_STRING     "gateway"
 
+/* as many cpus as the kernel keeps counters of (VR_CPU_MASK) */
+#define VIF_RATE_MAX_CPUS       256
+#define VIF_RATE_MAX_QUEUE_STATS 256
+
 static struct nl_client *cl;
 static char flag_string[32], if_name[IFNAMSIZ];
 static int if_kindex = -1, vrf_id, vr_ifindex = -1;
@@ -50,6 +58,7 @@ static int vr_ifflags;
 static int add_set, create_set, get_set, list_set;
 static int kindex_set, type_set, help_set, set_set, vlan_set;
 static int vrf_set, mac_set, delete_set, mode_set, policy_set;
+static int rate_set, interval_set;
 
 static unsigned int vr_op, vr_if_type;
 static bool ignore_error = false, dump_pending = false;
@@ -59,6 +68,29 @@ static int dump_marker = -1, var_marker = -1;
 static int8_t vr_ifmac[6];
 static struct ether_addr *mac_opt;
 
+/*
+ * --rate: the counters of each cpu and, of the os device, those of each
+ * queue, as of the last two samples. counters[0] is the sum
+ */
+struct vif_rate_counters {
+    uint64_t vrc_ipackets;
+    uint64_t vrc_ibytes;
+    uint64_t vrc_opackets;
+    uint64_t vrc_obytes;
+};
+
+static unsigned int rate_interval = 1000, rate_core, rate_cpus;
+static int rate_resp_code, rate_os_idx;
+static struct vif_rate_counters rate_cur[VIF_RATE_MAX_CPUS + 1];
+static struct vif_rate_counters rate_prev[VIF_RATE_MAX_CPUS + 1];
+
+static unsigned int rate_nqstats;
+static unsigned int rate_qstat_index[VIF_RATE_MAX_QUEUE_STATS];
+static char rate_qstat_name[VIF_RATE_MAX_QUEUE_STATS][ETH_GSTRING_LEN];
+static uint64_t rate_qstat_cur[VIF_RATE_MAX_QUEUE_STATS];
+static uint64_t rate_qstat_prev[VIF_RATE_MAX_QUEUE_STATS];
+static struct ethtool_stats *rate_ethtool_stats;
+
 static void Usage(void);
 
 static char *
@@ -111,6 +143,21 @@ vr_get_if_type(char *type_str)
     return 0;
 }
 
+static char *
+vr_get_if_steer_string(int policy)
+{
+    switch (policy) {
+    case VIF_STEER_SAME_CORE:
+        return "Same core";
+    case VIF_STEER_NODE:
+        return "Node";
+    case VIF_STEER_CPUS:
+        return "Cpus";
+    default:
+        return "Default";
+    }
+}
+
 static char *
 vr_if_flags(int flags)
 {
@@ -151,11 +198,21 @@ void
 vr_interface_req_process(void *s)
 {
     char name[50];
+    unsigned int i;
     vr_interface_req *req = (vr_interface_req *)s;
 
     if (add_set)
         vr_ifindex = req->vifr_idx;
 
+    if (rate_set) {
+        rate_os_idx = req->vifr_os_idx;
+        rate_cur[rate_core].vrc_ipackets = req->vifr_ipackets;
+        rate_cur[rate_core].vrc_ibytes = req->vifr_ibytes;
+        rate_cur[rate_core].vrc_opackets = req->vifr_opackets;
+        rate_cur[rate_core].vrc_obytes = req->vifr_obytes;
+        return;
+    }
+
     if (!get_set && !list_set)
         return;
 
@@ -181,6 +238,24 @@ vr_interface_req_process(void *s)
     printf("\tTX packets:%" PRId64 "  bytes:%" PRId64 " errors:%" PRId64 "\n",
             req->vifr_opackets,
             req->vifr_obytes, req->vifr_oerrors);
+    printf("\tHeadroom:%d Head reallocs:%" PRId64 "\n", req->vifr_headroom,
+            req->vifr_head_reallocs);
+    printf("\tRX checksums hw:%" PRId64 " sw:%" PRId64 "\n",
+            req->vifr_rx_csum_hw, req->vifr_rx_csum_sw);
+    printf("\tSteering:%s", vr_get_if_steer_string(req->vifr_steer_policy));
+    for (i = 0; i < req->vifr_steer_cpus_size; i++)
+        printf("%s%d", i ? "," : " Cpus:", req->vifr_steer_cpus[i]);
+    printf("\n");
+    if (req->vifr_learn_nh_id)
+        printf("\tLearn NH:%d\n", req->vifr_learn_nh_id);
+    if (req->vifr_rx_rate)
+        printf("\tRX rate:%dkbps burst:%d conform:%" PRId64 " exceed:%"
+                PRId64 "\n", req->vifr_rx_rate, req->vifr_rx_burst,
+                req->vifr_rx_conform, req->vifr_rx_exceed);
+    if (req->vifr_tx_rate)
+        printf("\tTX rate:%dkbps burst:%d conform:%" PRId64 " exceed:%"
+                PRId64 "\n", req->vifr_tx_rate, req->vifr_tx_burst,
+                req->vifr_tx_conform, req->vifr_tx_exceed);
     printf("\n");
 
     if (list_set)
@@ -201,6 +276,7 @@ vr_response_process(void *s)
 {
     vr_response *resp = (vr_response *)s;
 
+    rate_resp_code = resp->resp_code;
     if (resp->resp_code < 0 && !ignore_error)
         printf("%s\n", strerror(-resp->resp_code));
 
@@ -404,6 +480,237 @@ op_retry:
     return 0;
 }
 
+/*
+ * the per queue counters of the os device, from the statistics its driver
+ * reports to ethtool: those with 'queue' in their names (queue_0_rx_packets,
+ * rx_queue_0_bytes, and the like), in packets or bytes
+ */
+static void
+vr_intf_rate_queues_init(void)
+{
+    int fd;
+    unsigned int i, n;
+    char name[IFNAMSIZ], *stat;
+    struct ifreq ifr;
+    struct ethtool_drvinfo drvinfo;
+    struct ethtool_gstrings *strings;
+
+    if (!rate_os_idx || !if_indextoname(rate_os_idx, name))
+        return;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
+
+    memset(&drvinfo, 0, sizeof(drvinfo));
+    drvinfo.cmd = ETHTOOL_GDRVINFO;
+    ifr.ifr_data = (void *)&drvinfo;
+    if (ioctl(fd, SIOCETHTOOL, &ifr) < 0 || !drvinfo.n_stats)
+        goto exit_init;
+
+    n = drvinfo.n_stats;
+    strings = calloc(1, sizeof(*strings) + n * ETH_GSTRING_LEN);
+    rate_ethtool_stats = calloc(1, sizeof(*rate_ethtool_stats) +
+            n * sizeof(uint64_t));
+    if (!strings || !rate_ethtool_stats)
+        goto exit_strings;
+
+    strings->cmd = ETHTOOL_GSTRINGS;
+    strings->string_set = ETH_SS_STATS;
+    strings->len = n;
+    ifr.ifr_data = (void *)strings;
+    if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+        goto exit_strings;
+
+    rate_ethtool_stats->n_stats = n;
+    for (i = 0; i < n && rate_nqstats < VIF_RATE_MAX_QUEUE_STATS; i++) {
+        stat = (char *)strings->data + i * ETH_GSTRING_LEN;
+        stat[ETH_GSTRING_LEN - 1] = '\0';
+        if (!strstr(stat, "queue") ||
+                (!strstr(stat, "packets") && !strstr(stat, "bytes")))
+            continue;
+
+        rate_qstat_index[rate_nqstats] = i;
+        strcpy(rate_qstat_name[rate_nqstats], stat);
+        rate_nqstats++;
+    }
+
+exit_strings:
+    free(strings);
+exit_init:
+    close(fd);
+    return;
+}
+
+static void
+vr_intf_rate_queues_sample(void)
+{
+    int fd;
+    unsigned int i;
+    char name[IFNAMSIZ];
+    struct ifreq ifr;
+
+    if (!rate_nqstats || !if_indextoname(rate_os_idx, name))
+        return;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
+    rate_ethtool_stats->cmd = ETHTOOL_GSTATS;
+    ifr.ifr_data = (void *)rate_ethtool_stats;
+    if (ioctl(fd, SIOCETHTOOL, &ifr) >= 0)
+        for (i = 0; i < rate_nqstats; i++)
+            rate_qstat_cur[i] =
+                rate_ethtool_stats->data[rate_qstat_index[i]];
+
+    close(fd);
+    return;
+}
+
+/* the counters of cpu (core - 1), or of all if core is 0, in rate_cur */
+static int
+vr_intf_rate_get(unsigned int core)
+{
+    int ret;
+    vr_interface_req intf_req;
+
+    memset(&intf_req, 0, sizeof(intf_req));
+    intf_req.h_op = SANDESH_OP_GET;
+    intf_req.vifr_idx = vr_ifindex;
+    intf_req.vifr_core = core;
+
+    rate_core = core;
+    rate_resp_code = 0;
+    ret = vr_intf_send_msg(&intf_req, "vr_interface_req");
+    if (ret < 0)
+        return ret;
+
+    return rate_resp_code < 0 ? rate_resp_code : 0;
+}
+
+static int
+vr_intf_rate_sample(void)
+{
+    int ret;
+    unsigned int core;
+
+    for (core = 0; core <= rate_cpus; core++)
+        if ((ret = vr_intf_rate_get(core)) < 0)
+            return ret;
+
+    vr_intf_rate_queues_sample();
+
+    return 0;
+}
+
+static uint64_t
+vr_intf_rate_of(uint64_t cur, uint64_t prev, uint64_t usecs)
+{
+    if (!usecs || cur < prev)
+        return 0;
+
+    return ((cur - prev) * 1000000) / usecs;
+}
+
+static void
+vr_intf_rate_show_counters(const char *name, struct vif_rate_counters *cur,
+        struct vif_rate_counters *prev, uint64_t usecs)
+{
+    printf("%-8s %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n",
+            name,
+            vr_intf_rate_of(cur->vrc_ipackets, prev->vrc_ipackets, usecs),
+            vr_intf_rate_of(cur->vrc_ibytes, prev->vrc_ibytes, usecs),
+            vr_intf_rate_of(cur->vrc_opackets, prev->vrc_opackets, usecs),
+            vr_intf_rate_of(cur->vrc_obytes, prev->vrc_obytes, usecs));
+    return;
+}
+
+static void
+vr_intf_rate_show(uint64_t usecs)
+{
+    char name[IFNAMSIZ], core[16];
+    unsigned int i;
+
+    printf("vif0/%d\tOS: %s\tInterval: %" PRIu64 "ms\n", vr_ifindex,
+            rate_os_idx && if_indextoname(rate_os_idx, name) ? name : "NULL",
+            usecs / 1000);
+    printf("%-8s %14s %14s %14s %14s\n", "Core", "RX pkts/s",
+            "RX bytes/s", "TX pkts/s", "TX bytes/s");
+    vr_intf_rate_show_counters("Total", &rate_cur[0], &rate_prev[0], usecs);
+    for (i = 1; i <= rate_cpus; i++) {
+        snprintf(core, sizeof(core), "%u", i - 1);
+        vr_intf_rate_show_counters(core, &rate_cur[i], &rate_prev[i], usecs);
+    }
+
+    if (rate_nqstats) {
+        printf("%-32s %14s\n", "Queue", "Per second");
+        for (i = 0; i < rate_nqstats; i++)
+            printf("%-32s %14" PRIu64 "\n", rate_qstat_name[i],
+                    vr_intf_rate_of(rate_qstat_cur[i], rate_qstat_prev[i],
+                        usecs));
+    }
+    printf("\n");
+
+    return;
+}
+
+static uint64_t
+vr_intf_rate_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * the rates at which the interface receives and sends, on each cpu and on
+ * each queue of its os device, every interval, until interrupted
+ */
+static int
+vr_intf_rate(void)
+{
+    int ret;
+    uint64_t now, then;
+
+    if ((ret = vr_intf_rate_get(0)) < 0)
+        return ret;
+
+    /* as many cpus as the kernel accepts a core of */
+    ignore_error = true;
+    for (rate_cpus = 0; rate_cpus < VIF_RATE_MAX_CPUS; rate_cpus++)
+        if (vr_intf_rate_get(rate_cpus + 1) < 0)
+            break;
+    ignore_error = false;
+
+    vr_intf_rate_queues_init();
+
+    then = vr_intf_rate_now();
+    if ((ret = vr_intf_rate_sample()) < 0)
+        return ret;
+
+    while (1) {
+        memcpy(rate_prev, rate_cur, sizeof(rate_cur));
+        memcpy(rate_qstat_prev, rate_qstat_cur, sizeof(rate_qstat_cur));
+        usleep(rate_interval * 1000);
+
+        now = vr_intf_rate_now();
+        if ((ret = vr_intf_rate_sample()) < 0)
+            return ret;
+
+        vr_intf_rate_show(now - then);
+        then = now;
+    }
+
+    return 0;
+}
+
 static void
 Usage()
 {
@@ -415,6 +722,7 @@ Usage()
     printf("\t   [--get <intf_id>][--kernel]\n");
     printf("\t   [--set <intf_id> --vlan <vlan_id> --vrf <vrf_id>]\n");
     printf("\t   [--list]\n");
+    printf("\t   [--rate <intf_id> [--interval <msecs>]]\n");
     printf("\t   [--help]\n");
 
     exit(0);
@@ -435,6 +743,8 @@ enum if_opt_index {
     TYPE_OPT_INDEX,
     SET_OPT_INDEX,
     VLAN_OPT_INDEX,
+    RATE_OPT_INDEX,
+    INTERVAL_OPT_INDEX,
     HELP_OPT_INDEX,
 };
 
@@ -452,6 +762,8 @@ static struct option long_options[] = {
     [TYPE_OPT_INDEX]    =   {"type",    required_argument,  &type_set,      1},
     [SET_OPT_INDEX]     =   {"set",     required_argument,  &set_set,       1},
     [VLAN_OPT_INDEX]    =   {"vlan",    required_argument,  &vlan_set,      1},
+    [RATE_OPT_INDEX]    =   {"rate",    required_argument,  &rate_set,      1},
+    [INTERVAL_OPT_INDEX] =  {"interval", required_argument, &interval_set,  1},
     [HELP_OPT_INDEX]    =   {"help",    no_argument,        &help_set,      1},
 };
 
@@ -531,6 +843,19 @@ parse_long_opts(int option_index, char *opt_arg)
             Usage();
         break;
 
+    case RATE_OPT_INDEX:
+        vr_op = SANDESH_OP_GET;
+        vr_ifindex = strtoul(opt_arg, NULL, 0);
+        if (errno)
+            Usage();
+        break;
+
+    case INTERVAL_OPT_INDEX:
+        rate_interval = strtoul(opt_arg, NULL, 0);
+        if (errno || !rate_interval)
+            Usage();
+        break;
+
     default:
         break;
     }
@@ -562,6 +887,15 @@ validate_options(void)
         return;
     }
 
+    if (interval_set && !rate_set)
+        Usage();
+
+    if (rate_set) {
+        if (sum_opt > 1 + interval_set)
+            Usage();
+        return;
+    }
+
     if ((delete_set || list_set)) {
         if (sum_opt > 1)
             Usage();
@@ -687,6 +1021,9 @@ main(int argc, char *argv[])
         ignore_error = false;
     }
 
+    if (rate_set)
+        return vr_intf_rate();
+
     vr_intf_op(vr_op);
 
     return 0;
@@ -33,13 +33,15 @@
 #include "nl_util.h"
 #include "vr_mpls.h"
 #include "vr_defs.h"
+#include "vr_route.h"
 
 static struct nl_client *cl;
 static int resp_code;
 static vr_vrf_stats_req stats_req;
 static unsigned int stats_op;
 static int vrf = -1;
-static int get_set, dump_set;
+static int get_set, dump_set, top_set;
+static int top;
 static int verbose_set, help_set;
 static bool dump_pending = false;
 
@@ -63,6 +65,17 @@ vr_vrf_stats_req_process(void *s_req)
             stats->vsr_udp_mpls_tunnels, stats->vsr_gre_mpls_tunnels);
     printf("L2 Encaps %" PRIu64 ", Encaps %" PRIu64 "\n",
             stats->vsr_l2_encaps, stats->vsr_encaps);
+    printf("Buckets L0 %d, L1 %d, L2 %d, L3 %d, Shared %d, Bytes %" PRIu64
+            "\n", stats->vsr_l0_buckets, stats->vsr_l1_buckets,
+            stats->vsr_l2_buckets, stats->vsr_l3_buckets,
+            stats->vsr_shared_buckets, stats->vsr_bucket_bytes);
+    printf("Sampled Lookups Root %" PRIu64 ", L0 %" PRIu64 ", L1 %" PRIu64
+            ", L2 %" PRIu64 ", L3 %" PRIu64 "\n", stats->vsr_root_hits,
+            stats->vsr_l0_hits, stats->vsr_l1_hits, stats->vsr_l2_hits,
+            stats->vsr_l3_hits);
+    printf("Rx Packets %" PRIu64 ", Rx Bytes %" PRIu64 ", Tx Packets %" PRIu64
+            ", Tx Bytes %" PRIu64 "\n", stats->vsr_rx_packets,
+            stats->vsr_rx_bytes, stats->vsr_tx_packets, stats->vsr_tx_bytes);
 
     printf("\n");
     return;
@@ -103,6 +116,7 @@ vr_build_vrf_stats_request(void)
         break;
 
     case SANDESH_OP_DUMP:
+        stats_req.vsr_top = top;
         break;
 
     default:
@@ -180,7 +194,8 @@ vr_stats_dump(void)
 static void
 vr_do_stats_op(void)
 {
-    if (stats_op == SANDESH_OP_DUMP)
+    /* the busiest vrfs come in one go, and are not continued */
+    if (stats_op == SANDESH_OP_DUMP && !top)
         vr_stats_dump();
     else
         vr_send_one_message();
@@ -210,6 +225,7 @@ vr_stats_op(void)
 enum opt_index {
     GET_OPT_INDEX,
     DUMP_OPT_INDEX,
+    TOP_OPT_INDEX,
     VERBOSE_OPT_INDEX,
     HELP_OPT_INDEX,
     MAX_OPT_INDEX
@@ -218,6 +234,7 @@ enum opt_index {
 static struct option long_options[] = {
     [GET_OPT_INDEX]     =   {"get",     required_argument,  &get_set,       1},
     [DUMP_OPT_INDEX]    =   {"dump",    no_argument,        &dump_set,      1},
+    [TOP_OPT_INDEX]     =   {"top",     required_argument,  &top_set,       1},
     [VERBOSE_OPT_INDEX] =   {"verbose", no_argument,        &verbose_set,   1},
     [HELP_OPT_INDEX]    =   {"help",    no_argument,        &help_set,      1},
     [MAX_OPT_INDEX]     =   {"NULL",    0,                  0,              0},
@@ -228,6 +245,7 @@ Usage()
 {
     printf("Usage: vrfstats --get <vrf>\n");
     printf("                --dump --verbose\n");
+    printf("                --top <n>, the n vrfs that moved the most bytes\n");
     printf("                --help\n");
 
     exit(-EINVAL);
@@ -250,6 +268,13 @@ parse_long_opts(int opt_index, char *opt_arg)
         stats_op = SANDESH_OP_DUMP;
         break;
 
+    case TOP_OPT_INDEX:
+        top = strtol(opt_arg, NULL, 0);
+        if (errno || top <= 0 || top > VR_VRF_STATS_TOP_MAX)
+            Usage();
+        stats_op = SANDESH_OP_DUMP;
+        break;
+
     default:
         break;
     }
@@ -263,7 +288,7 @@ validate_options(void)
 {
     int options;
 
-    options = get_set + dump_set + verbose_set + help_set;
+    options = get_set + dump_set + top_set + verbose_set + help_set;
 
     if (!options)
         Usage();
@@ -0,0 +1,248 @@
+/*
+ *  vrperf.c -- turn on, reset and display the per stage cycle accounting
+ *              of the datapath
+ *
+ *  Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <asm/types.h>
+
+#include <linux/netlink.h>
+
+#include <net/if.h>
+
+#include "vr_types.h"
+#include "vr_message.h"
+#include "vr_genetlink.h"
+#include "nl_util.h"
+
+#define VRPERF_OP_ENABLE        1
+#define VRPERF_OP_DISABLE       2
+#define VRPERF_OP_RESET         3
+#define VRPERF_OP_DUMP          4
+
+/* has to agree with vr_perf.h and the nexthop types of vr_nexthop.h */
+static const char *stage_names[] = {
+    "Interface Input",
+    "Flow Lookup",
+    "Mtrie Lookup",
+    "Pull Inner Headers",
+    "Encap",
+    "Interface Tx",
+};
+
+static const char *nh_names[] = {
+    "Dead",
+    "Receive",
+    "Encap",
+    "Tunnel",
+    "Resolve",
+    "Discard",
+    "Composite",
+    "Vxlan Vrf",
+};
+
+#define VRPERF_NUM_STAGES   (sizeof(stage_names) / sizeof(stage_names[0]))
+#define VRPERF_NUM_NHS      (sizeof(nh_names) / sizeof(nh_names[0]))
+
+static struct nl_client *cl;
+static bool dump_pending = false;
+static bool header_printed = false;
+static int op;
+static int dump_marker = -1;
+
+static void
+vrperf_print_stage(vr_perf_req *req)
+{
+    char name[32];
+    unsigned int stage = req->vpr_stage;
+    uint64_t cycles = req->vpr_cycles, packets = req->vpr_packets;
+
+    if (stage < VRPERF_NUM_STAGES)
+        snprintf(name, sizeof(name), "%s", stage_names[stage]);
+    else if (stage - VRPERF_NUM_STAGES < VRPERF_NUM_NHS)
+        snprintf(name, sizeof(name), "NH Output %s",
+                nh_names[stage - VRPERF_NUM_STAGES]);
+    else
+        snprintf(name, sizeof(name), "Stage %u", stage);
+
+    if (!header_printed) {
+        printf("Accounting %s\n\n", req->vpr_enable ? "On" : "Off");
+        printf("%-24s %16s %16s %20s %12s\n", "Stage", "Calls", "Packets",
+                "Cycles", "Cycles/Pkt");
+        header_printed = true;
+    }
+
+    printf("%-24s %16" PRIu64 " %16" PRIu64 " %20" PRIu64 " %12" PRIu64 "\n",
+            name, (uint64_t)req->vpr_calls, packets, cycles,
+            packets ? cycles / packets : 0);
+
+    return;
+}
+
+void
+vr_perf_req_process(void *s_req)
+{
+    vr_perf_req *req = (vr_perf_req *)s_req;
+
+    vrperf_print_stage(req);
+    dump_marker = req->vpr_stage;
+
+    return;
+}
+
+void
+vr_response_process(void *s)
+{
+    vr_response *resp = (vr_response *)s;
+
+    if (resp->resp_code < 0) {
+        printf("Error %s in kernel operation\n", strerror(-resp->resp_code));
+        dump_pending = false;
+        return;
+    }
+
+    if (op == VRPERF_OP_DUMP) {
+        if (resp->resp_code & VR_MESSAGE_DUMP_INCOMPLETE)
+            dump_pending = true;
+        else
+            dump_pending = false;
+    }
+
+    return;
+}
+
+static int
+vrperf_op(void)
+{
+    vr_perf_req req;
+    int ret, error, attr_len;
+    struct nl_response *resp;
+
+op_retry:
+    memset(&req, 0, sizeof(req));
+    switch (op) {
+    case VRPERF_OP_ENABLE:
+    case VRPERF_OP_DISABLE:
+        req.h_op = SANDESH_OP_ADD;
+        req.vpr_enable = (op == VRPERF_OP_ENABLE);
+        break;
+
+    case VRPERF_OP_RESET:
+        req.h_op = SANDESH_OP_DELETE;
+        break;
+
+    case VRPERF_OP_DUMP:
+        req.h_op = SANDESH_OP_DUMP;
+        req.vpr_marker = dump_marker;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    ret = nl_build_nlh(cl, cl->cl_genl_family_id, NLM_F_REQUEST);
+    if (ret)
+        return ret;
+
+    ret = nl_build_genlh(cl, SANDESH_REQUEST, 0);
+    if (ret)
+        return ret;
+
+    attr_len = nl_get_attr_hdr_size();
+
+    error = 0;
+    ret = sandesh_encode(&req, "vr_perf_req", vr_find_sandesh_info,
+                             (nl_get_buf_ptr(cl) + attr_len),
+                             (nl_get_buf_len(cl) - attr_len), &error);
+    if ((ret <= 0) || error)
+        return ret;
+
+    nl_build_attr(cl, ret, NL_ATTR_VR_MESSAGE_PROTOCOL);
+    nl_update_nlh(cl);
+
+    ret = nl_sendmsg(cl);
+    while ((ret = nl_recvmsg(cl)) > 0) {
+        resp = nl_parse_reply(cl);
+        if (resp->nl_op == SANDESH_REQUEST) {
+            sandesh_decode(resp->nl_data, resp->nl_len, vr_find_sandesh_info,
+                    &ret);
+        }
+    }
+
+    if (dump_pending)
+        goto op_retry;
+
+    if (op == VRPERF_OP_DUMP && !header_printed)
+        printf("No stage has been accounted\n");
+
+    return 0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: vrperf [-e | -d | -r | -s]\n"
+           "       -e - turn accounting on (resets the counters)\n"
+           "       -d - turn accounting off\n"
+           "       -r - reset the counters\n"
+           "       -s - show the counters (default)\n");
+
+    return;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ret, opt;
+
+    op = VRPERF_OP_DUMP;
+    while ((opt = getopt(argc, argv, "edrsh")) != -1) {
+        switch (opt) {
+        case 'e':
+            op = VRPERF_OP_ENABLE;
+            break;
+
+        case 'd':
+            op = VRPERF_OP_DISABLE;
+            break;
+
+        case 'r':
+            op = VRPERF_OP_RESET;
+            break;
+
+        case 's':
+            op = VRPERF_OP_DUMP;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            usage();
+            exit(0);
+        }
+    }
+
+    cl = nl_register_client();
+    if (!cl)
+        exit(1);
+
+    ret = nl_socket(cl, NETLINK_GENERIC);
+    if (ret <= 0)
+        exit(1);
+
+    if (vrouter_get_family_id(cl) <= 0)
+        return -1;
+
+    return vrperf_op();
+}
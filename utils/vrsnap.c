@@ -0,0 +1,657 @@
+/*
+ * vrsnap.c -- snapshot of the forwarding state of the vrouter (interfaces,
+ * nexthops, labels, vxlan mappings and routes), and restore of it in bulk
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <asm/types.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <net/if.h>
+
+#include "vr_types.h"
+#include "vr_message.h"
+#include "vr_nexthop.h"
+#include "vr_route.h"
+#include "vr_defs.h"
+#include "vr_genetlink.h"
+#include "nl_util.h"
+
+/*
+ * the file is a struct vrsnap_hdr, and then the records, each a struct
+ * vrsnap_record followed by the sandesh encoding (as an ADD) of the
+ * object. the records are in the order in which they can be added back:
+ * interfaces, nexthops with composite nexthops last, labels, vxlan
+ * mappings and routes. vsh_config_gen is the generation of the forwarding
+ * state (see vr_config_request) that all of the records are of
+ */
+#define VRSNAP_MAGIC            0x76736e70
+#define VRSNAP_VERSION          1
+/* dumps that are to be made again, if the state changes under them */
+#define VRSNAP_TRIES            5
+/* what a batch request carries, short of the 16 bit attribute length */
+#define VRSNAP_BATCH_BYTES      (60 * 1024)
+#define VRSNAP_OBJECT_BYTES     (64 * 1024)
+
+struct vrsnap_hdr {
+    uint32_t vsh_magic;
+    uint32_t vsh_version;
+    uint32_t vsh_config_gen;
+    uint32_t vsh_records;
+};
+
+struct vrsnap_record {
+    uint16_t vsr_type;
+    uint16_t vsr_pad;
+    uint32_t vsr_len;
+};
+
+enum vrsnap_part {
+    VRSNAP_INTERFACES,
+    VRSNAP_NEXTHOPS,
+    VRSNAP_COMPOSITES,
+    VRSNAP_LABELS,
+    VRSNAP_VXLANS,
+    VRSNAP_ROUTES,
+    VRSNAP_PARTS
+};
+
+struct vrsnap_buf {
+    unsigned char *vb_data;
+    size_t vb_len;
+    size_t vb_size;
+    unsigned int vb_records;
+};
+
+static struct nl_client *cl;
+static int resp_code;
+static uint32_t config_gen;
+static int save_set, restore_set;
+static char *save_file, *restore_file;
+
+static struct vrsnap_buf parts[VRSNAP_PARTS];
+static unsigned char object_buf[VRSNAP_OBJECT_BYTES];
+static bool snap_error;
+
+/* where the dump that is going on is at */
+static int marker;
+static unsigned int rt_marker, rt_marker_plen, rt_marker_src;
+static uint8_t rt_marker_mac[6];
+
+static void
+vrsnap_add(enum vrsnap_part part, unsigned int type, void *obj,
+        const char *name)
+{
+    int len, error = 0;
+    size_t need;
+    struct vrsnap_record rec;
+    struct vrsnap_buf *vb = &parts[part];
+
+    len = sandesh_encode(obj, name, vr_find_sandesh_info, object_buf,
+            sizeof(object_buf), &error);
+    if (len <= 0 || error) {
+        snap_error = true;
+        return;
+    }
+
+    need = vb->vb_len + sizeof(rec) + len;
+    if (need > vb->vb_size) {
+        vb->vb_size = need * 2;
+        vb->vb_data = realloc(vb->vb_data, vb->vb_size);
+        if (!vb->vb_data) {
+            snap_error = true;
+            return;
+        }
+    }
+
+    rec.vsr_type = type;
+    rec.vsr_pad = 0;
+    rec.vsr_len = len;
+    memcpy(vb->vb_data + vb->vb_len, &rec, sizeof(rec));
+    memcpy(vb->vb_data + vb->vb_len + sizeof(rec), object_buf, len);
+    vb->vb_len = need;
+    vb->vb_records++;
+
+    return;
+}
+
+void
+vrouter_ops_process(void *s_req)
+{
+    vrouter_ops *ops = (vrouter_ops *)s_req;
+
+    config_gen = ops->vo_config_gen;
+    return;
+}
+
+void
+vr_interface_req_process(void *s_req)
+{
+    vr_interface_req *req = (vr_interface_req *)s_req;
+
+    marker = req->vifr_idx;
+    req->h_op = SANDESH_OP_ADD;
+    vrsnap_add(VRSNAP_INTERFACES, VR_INTERFACE_OBJECT_ID, req,
+            "vr_interface_req");
+    return;
+}
+
+void
+vr_nexthop_req_process(void *s_req)
+{
+    vr_nexthop_req *req = (vr_nexthop_req *)s_req;
+
+    marker = req->nhr_id;
+    req->h_op = SANDESH_OP_ADD;
+    /* the members of a composite nexthop have to be there before it */
+    vrsnap_add(req->nhr_type == NH_COMPOSITE ? VRSNAP_COMPOSITES :
+            VRSNAP_NEXTHOPS, VR_NEXTHOP_OBJECT_ID, req, "vr_nexthop_req");
+    return;
+}
+
+void
+vr_mpls_req_process(void *s_req)
+{
+    vr_mpls_req *req = (vr_mpls_req *)s_req;
+
+    marker = req->mr_label;
+    req->h_op = SANDESH_OP_ADD;
+    vrsnap_add(VRSNAP_LABELS, VR_MPLS_OBJECT_ID, req, "vr_mpls_req");
+    return;
+}
+
+void
+vr_vxlan_req_process(void *s_req)
+{
+    vr_vxlan_req *req = (vr_vxlan_req *)s_req;
+
+    marker = req->vxlanr_vnid;
+    req->h_op = SANDESH_OP_ADD;
+    vrsnap_add(VRSNAP_VXLANS, VR_VXLAN_OBJECT_ID, req, "vr_vxlan_req");
+    return;
+}
+
+void
+vr_route_req_process(void *s_req)
+{
+    vr_route_req *req = (vr_route_req *)s_req;
+
+    rt_marker = req->rtr_prefix;
+    rt_marker_plen = req->rtr_prefix_len;
+    rt_marker_src = req->rtr_src;
+    if (req->rtr_mac && req->rtr_mac_size >= 6)
+        memcpy(rt_marker_mac, req->rtr_mac, 6);
+
+    req->h_op = SANDESH_OP_ADD;
+    /* of a bridge entry, that is where the dump was, and not part of it */
+    if (req->rtr_family == AF_BRIDGE)
+        req->rtr_prefix = 0;
+    vrsnap_add(VRSNAP_ROUTES, VR_ROUTE_OBJECT_ID, req, "vr_route_req");
+    return;
+}
+
+void
+vr_response_process(void *s)
+{
+    vr_response *resp = (vr_response *)s;
+
+    resp_code = resp->resp_code;
+    return;
+}
+
+static int
+vrsnap_recv(void)
+{
+    int ret;
+    struct nl_response *resp;
+
+    resp_code = 0;
+    ret = nl_sendmsg(cl);
+    if (ret <= 0)
+        return -EIO;
+
+    while ((ret = nl_recvmsg(cl)) > 0) {
+        resp = nl_parse_reply(cl);
+        if (resp->nl_op == SANDESH_REQUEST)
+            sandesh_decode(resp->nl_data, resp->nl_len,
+                    vr_find_sandesh_info, &ret);
+    }
+
+    return resp_code;
+}
+
+static int
+vrsnap_request(void *obj, const char *name)
+{
+    int ret, error = 0, attr_len;
+
+    ret = nl_build_nlh(cl, cl->cl_genl_family_id, NLM_F_REQUEST);
+    if (ret)
+        return ret;
+
+    ret = nl_build_genlh(cl, SANDESH_REQUEST, 0);
+    if (ret)
+        return ret;
+
+    attr_len = nl_get_attr_hdr_size();
+    ret = sandesh_encode(obj, name, vr_find_sandesh_info,
+            (nl_get_buf_ptr(cl) + attr_len),
+            (nl_get_buf_len(cl) - attr_len), &error);
+    if ((ret <= 0) || error)
+        return -EINVAL;
+
+    nl_build_attr(cl, ret, NL_ATTR_VR_MESSAGE_PROTOCOL);
+    nl_update_nlh(cl);
+
+    return vrsnap_recv();
+}
+
+static int
+vrsnap_get_gen(uint32_t *gen)
+{
+    int ret;
+    vrouter_ops ops;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.h_op = SANDESH_OP_GET;
+    ret = vrsnap_request(&ops, "vrouter_ops");
+    if (ret < 0)
+        return ret;
+
+    *gen = config_gen;
+    return 0;
+}
+
+/* the dump goes on for as long as the kernel says that there is more */
+static bool
+vrsnap_dump_more(int ret)
+{
+    return ret >= 0 && (ret & VR_MESSAGE_DUMP_INCOMPLETE);
+}
+
+static int
+vrsnap_dump_tables(void)
+{
+    int ret;
+    vr_interface_req vif_req;
+    vr_nexthop_req nh_req;
+    vr_mpls_req mpls_req;
+    vr_vxlan_req vxlan_req;
+
+    marker = -1;
+    do {
+        memset(&vif_req, 0, sizeof(vif_req));
+        vif_req.h_op = SANDESH_OP_DUMP;
+        vif_req.vifr_marker = marker;
+        ret = vrsnap_request(&vif_req, "vr_interface_req");
+    } while (vrsnap_dump_more(ret));
+    if (ret < 0)
+        return ret;
+
+    marker = -1;
+    do {
+        memset(&nh_req, 0, sizeof(nh_req));
+        nh_req.h_op = SANDESH_OP_DUMP;
+        nh_req.nhr_marker = marker;
+        ret = vrsnap_request(&nh_req, "vr_nexthop_req");
+    } while (vrsnap_dump_more(ret));
+    if (ret < 0)
+        return ret;
+
+    marker = -1;
+    do {
+        memset(&mpls_req, 0, sizeof(mpls_req));
+        mpls_req.h_op = SANDESH_OP_DUMP;
+        mpls_req.mr_marker = marker;
+        ret = vrsnap_request(&mpls_req, "vr_mpls_req");
+    } while (vrsnap_dump_more(ret));
+    if (ret < 0)
+        return ret;
+
+    marker = 0;
+    do {
+        memset(&vxlan_req, 0, sizeof(vxlan_req));
+        vxlan_req.h_op = SANDESH_OP_DUMP;
+        vxlan_req.vxlanr_vnid = marker;
+        ret = vrsnap_request(&vxlan_req, "vr_vxlan_req");
+    } while (vrsnap_dump_more(ret));
+
+    return ret < 0 ? ret : 0;
+}
+
+static int
+vrsnap_dump_routes(unsigned int vrf, int family, unsigned int type)
+{
+    int ret;
+    vr_route_req rt_req;
+
+    rt_marker = rt_marker_plen = rt_marker_src = 0;
+    memset(rt_marker_mac, 0, sizeof(rt_marker_mac));
+    do {
+        memset(&rt_req, 0, sizeof(rt_req));
+        rt_req.h_op = SANDESH_OP_DUMP;
+        rt_req.rtr_family = family;
+        rt_req.rtr_rt_type = type;
+        rt_req.rtr_vrf_id = vrf;
+        rt_req.rtr_marker = rt_marker;
+        rt_req.rtr_marker_plen = rt_marker_plen;
+        rt_req.rtr_src = rt_marker_src;
+        rt_req.rtr_mac = (int8_t *)rt_marker_mac;
+        rt_req.rtr_mac_size = sizeof(rt_marker_mac);
+        ret = vrsnap_request(&rt_req, "vr_route_req");
+    } while (vrsnap_dump_more(ret));
+
+    /* vrfs that have no table of the kind */
+    if (ret == -ENOENT)
+        ret = 0;
+
+    return ret;
+}
+
+static void
+vrsnap_reset(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < VRSNAP_PARTS; i++) {
+        parts[i].vb_len = 0;
+        parts[i].vb_records = 0;
+    }
+    snap_error = false;
+
+    return;
+}
+
+static int
+vrsnap_dump(void)
+{
+    int ret;
+    unsigned int vrf;
+
+    vrsnap_reset();
+    ret = vrsnap_dump_tables();
+    if (ret < 0)
+        return ret;
+
+    for (vrf = 0; vrf < VR_MAX_VRFS; vrf++) {
+        if ((ret = vrsnap_dump_routes(vrf, AF_INET, RT_UCAST)) < 0 ||
+                (ret = vrsnap_dump_routes(vrf, AF_INET, RT_MCAST)) < 0 ||
+                (ret = vrsnap_dump_routes(vrf, AF_BRIDGE, RT_UCAST)) < 0)
+            return ret;
+    }
+
+    return snap_error ? -ENOMEM : 0;
+}
+
+static int
+vrsnap_save(const char *file)
+{
+    int ret;
+    unsigned int i, try;
+    uint32_t gen, gen_after;
+    FILE *fp;
+    struct vrsnap_hdr hdr;
+
+    /* the dumps are of one generation, or they are made again */
+    for (try = 0; try < VRSNAP_TRIES; try++) {
+        if ((ret = vrsnap_get_gen(&gen)) < 0 ||
+                (ret = vrsnap_dump()) < 0 ||
+                (ret = vrsnap_get_gen(&gen_after)) < 0) {
+            printf("vrsnap: %s\n", strerror(-ret));
+            return ret;
+        }
+
+        if (gen == gen_after)
+            break;
+    }
+
+    if (try == VRSNAP_TRIES) {
+        printf("vrsnap: the forwarding state kept changing\n");
+        return -EAGAIN;
+    }
+
+    fp = fopen(file, "w");
+    if (!fp) {
+        perror(file);
+        return -errno;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.vsh_magic = VRSNAP_MAGIC;
+    hdr.vsh_version = VRSNAP_VERSION;
+    hdr.vsh_config_gen = gen;
+    for (i = 0; i < VRSNAP_PARTS; i++)
+        hdr.vsh_records += parts[i].vb_records;
+
+    ret = 0;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        ret = -EIO;
+    for (i = 0; !ret && i < VRSNAP_PARTS; i++) {
+        if (parts[i].vb_len &&
+                fwrite(parts[i].vb_data, parts[i].vb_len, 1, fp) != 1)
+            ret = -EIO;
+    }
+
+    if (fclose(fp) || ret) {
+        perror(file);
+        return -EIO;
+    }
+
+    printf("%u objects of generation %u saved to %s\n", hdr.vsh_records,
+            gen, file);
+    return 0;
+}
+
+/* one object of a batch that failed, on its own */
+static int
+vrsnap_restore_one(unsigned char *obj, unsigned int len)
+{
+    int ret;
+    unsigned char *buf;
+    uint32_t buf_len;
+
+    if ((ret = nl_build_header(cl, &buf, &buf_len)))
+        return ret;
+
+    if (len > buf_len)
+        return -ENOSPC;
+
+    memcpy(buf, obj, len);
+    nl_update_header(cl, len);
+
+    return vrsnap_recv();
+}
+
+/*
+ * the records in [start, end) of 'data', as one batch. if an object
+ * fails, the batch stops there, and the objects go one by one instead,
+ * so that one that cannot be added (say, of an interface that is gone)
+ * does not keep the rest out
+ */
+static unsigned int
+vrsnap_restore_batch(unsigned char *data, size_t start, size_t end,
+        unsigned int num)
+{
+    int ret;
+    size_t off;
+    unsigned int failed = 0;
+    unsigned char *buf;
+    uint32_t buf_len, len = 0;
+    struct vrsnap_record *rec;
+
+    if ((ret = nl_build_batch_header(cl, &buf, &buf_len)))
+        return num;
+
+    for (off = start; off < end; off += sizeof(*rec) + rec->vsr_len) {
+        rec = (struct vrsnap_record *)(data + off);
+        memcpy(buf + len, data + off + sizeof(*rec), rec->vsr_len);
+        len += rec->vsr_len;
+    }
+    nl_update_header(cl, len);
+
+    ret = vrsnap_recv();
+    if (ret == (int)num)
+        return 0;
+
+    for (off = start; off < end; off += sizeof(*rec) + rec->vsr_len) {
+        rec = (struct vrsnap_record *)(data + off);
+        if (vrsnap_restore_one(data + off + sizeof(*rec),
+                    rec->vsr_len) < 0)
+            failed++;
+    }
+
+    return failed;
+}
+
+static int
+vrsnap_restore(const char *file)
+{
+    long size;
+    size_t off, start, batch_len;
+    unsigned int num, records = 0, failed = 0;
+    uint16_t type = 0;
+    unsigned char *data;
+    FILE *fp;
+    struct vrsnap_hdr hdr;
+    struct vrsnap_record *rec;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        return -errno;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            hdr.vsh_magic != VRSNAP_MAGIC ||
+            hdr.vsh_version != VRSNAP_VERSION) {
+        printf("%s: not a snapshot of this version\n", file);
+        fclose(fp);
+        return -EINVAL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp) - sizeof(hdr);
+    fseek(fp, sizeof(hdr), SEEK_SET);
+    data = malloc(size > 0 ? size : 1);
+    if (!data || (size > 0 && fread(data, size, 1, fp) != 1)) {
+        printf("%s: %s\n", file, data ? "short read" : strerror(ENOMEM));
+        free(data);
+        fclose(fp);
+        return -EIO;
+    }
+    fclose(fp);
+
+    /* batches of one kind of object, so that the order is kept */
+    start = off = 0;
+    num = 0;
+    batch_len = 0;
+    while (off + sizeof(*rec) <= (size_t)size) {
+        rec = (struct vrsnap_record *)(data + off);
+        if (off + sizeof(*rec) + rec->vsr_len > (size_t)size ||
+                rec->vsr_len > VRSNAP_BATCH_BYTES)
+            break;
+
+        if (num && (rec->vsr_type != type ||
+                    batch_len + rec->vsr_len > VRSNAP_BATCH_BYTES)) {
+            failed += vrsnap_restore_batch(data, start, off, num);
+            start = off;
+            num = 0;
+            batch_len = 0;
+        }
+
+        type = rec->vsr_type;
+        batch_len += rec->vsr_len;
+        num++;
+        records++;
+        off += sizeof(*rec) + rec->vsr_len;
+    }
+
+    if (num)
+        failed += vrsnap_restore_batch(data, start, off, num);
+    free(data);
+
+    printf("%u of %u objects of generation %u restored from %s\n",
+            records - failed, hdr.vsh_records, hdr.vsh_config_gen, file);
+    return failed ? -EINVAL : 0;
+}
+
+static void
+Usage(void)
+{
+    printf("vrsnap [--save=file][--restore=file]\n");
+    printf("\n");
+    printf("--save\t\tsave the interfaces, nexthops, labels, vxlan mappings\n");
+    printf("\t\tand routes, as of one generation of the forwarding state\n");
+    printf("--restore\tadd the objects of a saved snapshot back, in bulk\n");
+
+    exit(-EINVAL);
+}
+
+enum opt_index {
+    SAVE_OPT_INDEX,
+    RESTORE_OPT_INDEX,
+    MAX_OPT_INDEX
+};
+
+static struct option long_options[] = {
+    [SAVE_OPT_INDEX]    = {"save", required_argument, &save_set, 1},
+    [RESTORE_OPT_INDEX] = {"restore", required_argument, &restore_set, 1},
+    [MAX_OPT_INDEX]     = { NULL,  0,                 0        , 0}
+};
+
+int
+main(int argc, char *argv[])
+{
+    int opt, ret, option_index;
+
+    while ((opt = getopt_long(argc, argv, "", long_options,
+                    &option_index)) >= 0) {
+        switch (opt) {
+        case 0:
+            if (option_index == SAVE_OPT_INDEX)
+                save_file = optarg;
+            else if (option_index == RESTORE_OPT_INDEX)
+                restore_file = optarg;
+            else
+                Usage();
+            break;
+
+        default:
+            Usage();
+        }
+    }
+
+    if (save_set == restore_set)
+        Usage();
+
+    cl = nl_register_client();
+    if (!cl)
+        return -ENOMEM;
+
+    ret = nl_socket(cl, NETLINK_GENERIC);
+    if (ret <= 0)
+        return -EIO;
+
+    ret = vrouter_get_family_id(cl);
+    if (ret <= 0)
+        return -EIO;
+
+    if (save_set)
+        return vrsnap_save(save_file);
+
+    return vrsnap_restore(restore_file);
+}
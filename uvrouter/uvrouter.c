@@ -4,6 +4,7 @@
  * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "vr_types.h"
@@ -22,6 +23,8 @@ extern int vrouter_host_init(unsigned int);
 
 static char *uvr_agent_buffer;
 static int uvr_agent_fd = -1;
+/* the device whose rings the physical interface polls, if any */
+static const char *uvr_physical_name;
 
 static int
 uvrouter_agent_rx(void *arg)
@@ -73,8 +76,12 @@ uvrouter_interface_init(void)
     if (!agent_hif)
         return -1;
 
-    eth_hif = vr_hinterface_create(HIF_PHYSICAL_INTERFACE_INDEX, HIF_TYPE_UDP,
-            VIF_TYPE_PHYSICAL);
+    if (uvr_physical_name)
+        eth_hif = vr_hinterface_create_ring(HIF_PHYSICAL_INTERFACE_INDEX,
+                VIF_TYPE_PHYSICAL, uvr_physical_name);
+    else
+        eth_hif = vr_hinterface_create(HIF_PHYSICAL_INTERFACE_INDEX,
+                HIF_TYPE_UDP, VIF_TYPE_PHYSICAL);
     if (!eth_hif)
         goto cleanup;
 
@@ -127,7 +134,8 @@ uvrouter_agent_sock_init(void)
     if (ret < 0)
         goto cleanup;
 
-    ret = vr_host_io_register(uvr_agent_fd, uvrouter_agent_rx, NULL);
+    /* the message layer is not made for more than one thread */
+    ret = vr_host_io_register_on(uvr_agent_fd, uvrouter_agent_rx, NULL, 0);
     if (ret)
         goto cleanup;
 
@@ -141,13 +149,35 @@ cleanup:
 int
 main(int argc, const char *argv[])
 {
-    int ret;
+    int ret, opt;
+    unsigned int threads = 1;
+
+    while ((opt = getopt(argc, (char * const *)argv, "t:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'p':
+            uvr_physical_name = optarg;
+            break;
+
+        default:
+            fprintf(stderr,
+                    "Usage: uvrouter [-t <io threads>] [-p <device>]\n");
+            return -1;
+        }
+    }
 
     /* daemonize... */
     if (daemon(0, 0) < 0) {
         return -1;
 	}
-    vr_host_io_init();
+
+    /* the io threads are the cpus of the vrouter */
+    ret = vr_host_io_init(threads);
+    if (ret)
+        return ret;
 
     /* init the vrouter */
     ret = vrouter_host_init(VR_MPROTO_SANDESH);
@@ -0,0 +1,799 @@
+/*
+ * vrbench.c -- drives bursts of synthetic packets through the datapath of
+ *              the vrouter library, and reports the packet rate, the
+ *              cycles per packet and the cycles of the datapath stages
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "vr_types.h"
+#include "vr_os.h"
+#include "vr_message.h"
+#include "vrouter.h"
+#include "vr_packet.h"
+#include "vr_perf.h"
+
+#include "host/vr_host.h"
+#include "host/vr_host_packet.h"
+#include "host/vr_host_interface.h"
+
+extern int vrouter_host_init(unsigned int);
+extern void vrouter_host_exit(void);
+
+extern void vr_interface_req_process(void *);
+extern void vr_nexthop_req_process(void *);
+extern void vr_route_req_process(void *);
+extern void vr_mpls_req_process(void *);
+extern void vr_flow_req_process(void *);
+extern void vr_perf_req_process(void *);
+
+#define VRB_PKT_SIZE            2000
+#define VRB_PKT_MAX_LEN         256
+#define VRB_PAYLOAD_LEN         64
+
+#define VRB_BURST_MAX           HIF_RX_BURST
+#define VRB_MAX_VMS             HIF_NUM_VIRTUAL_INTERFACES
+
+/* the topology */
+#define VRB_FABRIC_VRF          0
+#define VRB_VM_VRF              1
+
+#define VRB_FABRIC_VIF          0
+#define VRB_VHOST_VIF           1
+/* the vms, the first of which sends */
+#define VRB_VM_VIF(i)           (2 + (i))
+
+#define VRB_RCV_NH              1
+#define VRB_VM_NH(i)            (10 + (i))
+#define VRB_MPLS_NH             60
+#define VRB_VXLAN_NH            61
+#define VRB_ECMP_NH             62
+#define VRB_MCAST_NH            63
+
+#define VRB_LABEL               16
+#define VRB_VNID                100
+
+/* addresses in host order */
+#define VRB_FABRIC_IP           0x0a010101      /* 10.1.1.1 */
+#define VRB_REMOTE_IP           0x0a010102      /* 10.1.1.2 */
+#define VRB_VM_IP(i)            (0xc0a80001 + (i)) /* 192.168.0.1 + i */
+#define VRB_REMOTE_PREFIX       0xc0a80100      /* 192.168.1.0/24 */
+#define VRB_ECMP_PREFIX         0xc0a80200      /* 192.168.2.0/24 */
+#define VRB_MCAST_GROUP         0xef010101      /* 239.1.1.1 */
+
+#define VRB_SPORT               10000
+#define VRB_DPORT               20000
+
+enum vrb_scenario {
+    VRB_L3,
+    VRB_FLOW_HIT,
+    VRB_FLOW_MISS,
+    VRB_MPLS_UDP_DECAP,
+    VRB_MPLS_UDP_ENCAP,
+    VRB_VXLAN_ENCAP,
+    VRB_MCAST,
+    VRB_ECMP,
+    VRB_MAX_SCENARIO,
+};
+
+static const char *vrb_scenario_names[VRB_MAX_SCENARIO] = {
+    [VRB_L3]                =   "l3",
+    [VRB_FLOW_HIT]          =   "flow-hit",
+    [VRB_FLOW_MISS]         =   "flow-miss",
+    [VRB_MPLS_UDP_DECAP]    =   "mpls-udp-decap",
+    [VRB_MPLS_UDP_ENCAP]    =   "mpls-udp-encap",
+    [VRB_VXLAN_ENCAP]       =   "vxlan-encap",
+    [VRB_MCAST]             =   "mcast",
+    [VRB_ECMP]              =   "ecmp",
+};
+
+static const char *vrb_stage_names[VR_PERF_NH_OUTPUT] = {
+    [VR_PERF_INTERFACE_INPUT]       =   "interface input",
+    [VR_PERF_FLOW_LOOKUP]           =   "flow lookup",
+    [VR_PERF_MTRIE_LOOKUP]          =   "mtrie lookup",
+    [VR_PERF_PULL_INNER_HEADERS]    =   "pull inner headers",
+    [VR_PERF_ENCAP]                 =   "encap",
+    [VR_PERF_IF_TX]                 =   "interface tx",
+};
+
+static const char *vrb_nh_names[NH_MAX] = {
+    [NH_DEAD]                       =   "dead",
+    [NH_RCV]                        =   "receive",
+    [NH_ENCAP]                      =   "encap",
+    [NH_TUNNEL]                     =   "tunnel",
+    [NH_RESOLVE]                    =   "resolve",
+    [NH_DISCARD]                    =   "discard",
+    [NH_COMPOSITE]                  =   "composite",
+    [NH_VXLAN_VRF]                  =   "vxlan vrf",
+};
+
+static unsigned int vrb_scenario = VRB_L3;
+static unsigned long vrb_packets = 10000000;
+static unsigned int vrb_burst = VRB_BURST_MAX;
+static unsigned int vrb_fanout = 4;
+static unsigned int vrb_flows = 1024;
+static bool vrb_stages = true;
+
+static struct vrouter *vrb_router;
+static struct vr_hinterface *vrb_rx_hif;
+
+/* the packet of the scenario, and where in it the ports are */
+static unsigned char vrb_template[VRB_PKT_MAX_LEN];
+static unsigned int vrb_template_len;
+static unsigned int vrb_ports_off;
+
+static unsigned char vrb_router_mac[VR_ETHER_ALEN] = {
+    0x00, 0x00, 0x5e, 0x00, 0x01, 0x00 };
+static unsigned char vrb_remote_mac[VR_ETHER_ALEN] = {
+    0x00, 0x00, 0x5e, 0x00, 0x02, 0x00 };
+
+static void
+vrbench_vm_mac(unsigned int vm, unsigned char *mac)
+{
+    mac[0] = 0x02;
+    mac[1] = mac[2] = mac[3] = 0;
+    mac[4] = (vm >> 8) & 0xff;
+    mac[5] = vm & 0xff;
+
+    return;
+}
+
+/*
+ * the requests are handed to the handlers that the message layer would
+ * have decoded them to. the responses are of no interest, and whether an
+ * object made it is checked by looking it up
+ */
+static void
+vrbench_drain(void)
+{
+    struct vr_message *response;
+
+    while ((response = vr_message_dequeue_response()))
+        vr_message_free(response);
+
+    return;
+}
+
+static int
+vrbench_interface(unsigned int idx, unsigned int type, unsigned int os_idx,
+        unsigned int vrf, unsigned int flags, unsigned char *mac,
+        unsigned int ip)
+{
+    char name[16];
+    vr_interface_req req;
+
+    if (!vr_hinterface_create(os_idx, HIF_TYPE_NULL, type))
+        return -ENOMEM;
+
+    snprintf(name, sizeof(name), "vrb%u", idx);
+
+    memset(&req, 0, sizeof(req));
+    req.h_op = SANDESH_OP_ADD;
+    req.vifr_idx = idx;
+    req.vifr_type = type;
+    req.vifr_os_idx = os_idx;
+    req.vifr_vrf = vrf;
+    req.vifr_flags = flags;
+    req.vifr_mtu = 1514;
+    req.vifr_ip = htonl(ip);
+    req.vifr_name = name;
+    req.vifr_mac = (int8_t *)mac;
+    req.vifr_mac_size = VR_ETHER_ALEN;
+    vr_interface_req_process(&req);
+    vrbench_drain();
+
+    if (!__vrouter_get_interface(vrb_router, idx))
+        return -EINVAL;
+
+    return 0;
+}
+
+static void
+vrbench_eth(unsigned char *buf, unsigned char *dmac, unsigned char *smac)
+{
+    struct vr_eth *eth = (struct vr_eth *)buf;
+
+    memcpy(eth->eth_dmac, dmac, VR_ETHER_ALEN);
+    memcpy(eth->eth_smac, smac, VR_ETHER_ALEN);
+    eth->eth_proto = htons(VR_ETH_PROTO_IP);
+
+    return;
+}
+
+static int
+vrbench_nexthop(vr_nexthop_req *req)
+{
+    req->h_op = SANDESH_OP_ADD;
+    req->nhr_flags |= NH_FLAG_VALID;
+    vr_nexthop_req_process(req);
+    vrbench_drain();
+
+    if (!__vrouter_get_nexthop(vrb_router, req->nhr_id))
+        return -EINVAL;
+
+    return 0;
+}
+
+static int
+vrbench_encap_nexthop(unsigned int id, unsigned int vm)
+{
+    unsigned char encap[VR_ETHER_HLEN], mac[VR_ETHER_ALEN];
+    vr_nexthop_req req;
+
+    vrbench_vm_mac(vm, mac);
+    vrbench_eth(encap, mac, vrb_router_mac);
+
+    memset(&req, 0, sizeof(req));
+    req.nhr_type = NH_ENCAP;
+    req.nhr_family = AF_INET;
+    req.nhr_id = id;
+    req.nhr_vrf = VRB_VM_VRF;
+    req.nhr_encap_oif_id = VRB_VM_VIF(vm);
+    req.nhr_encap = (int8_t *)encap;
+    req.nhr_encap_size = sizeof(encap);
+
+    return vrbench_nexthop(&req);
+}
+
+static int
+vrbench_tunnel_nexthop(unsigned int id, unsigned int flags)
+{
+    unsigned char encap[VR_ETHER_HLEN];
+    vr_nexthop_req req;
+
+    vrbench_eth(encap, vrb_remote_mac, vrb_router_mac);
+
+    memset(&req, 0, sizeof(req));
+    req.nhr_type = NH_TUNNEL;
+    req.nhr_family = AF_INET;
+    req.nhr_id = id;
+    req.nhr_flags = flags;
+    req.nhr_vrf = VRB_FABRIC_VRF;
+    req.nhr_encap_oif_id = VRB_FABRIC_VIF;
+    req.nhr_tun_sip = htonl(VRB_FABRIC_IP);
+    req.nhr_tun_dip = htonl(VRB_REMOTE_IP);
+    req.nhr_encap = (int8_t *)encap;
+    req.nhr_encap_size = sizeof(encap);
+
+    return vrbench_nexthop(&req);
+}
+
+/* a composite of the nexthops of vms 1 to vrb_fanout */
+static int
+vrbench_composite_nexthop(unsigned int id, unsigned int flags)
+{
+    unsigned int i;
+    int nhs[VRB_MAX_VMS], labels[VRB_MAX_VMS], weights[VRB_MAX_VMS];
+    vr_nexthop_req req;
+
+    for (i = 0; i < vrb_fanout; i++) {
+        nhs[i] = VRB_VM_NH(i + 1);
+        labels[i] = 0;
+        weights[i] = 1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nhr_type = NH_COMPOSITE;
+    req.nhr_family = AF_INET;
+    req.nhr_id = id;
+    req.nhr_flags = flags;
+    req.nhr_vrf = VRB_VM_VRF;
+    req.nhr_nh_list = nhs;
+    req.nhr_nh_list_size = vrb_fanout;
+    req.nhr_label_list = labels;
+    req.nhr_label_list_size = vrb_fanout;
+    req.nhr_weight_list = weights;
+    req.nhr_weight_list_size = vrb_fanout;
+
+    return vrbench_nexthop(&req);
+}
+
+static void
+vrbench_route(unsigned int type, unsigned int vrf, unsigned int src,
+        unsigned int prefix, unsigned int plen, unsigned int nh, int label)
+{
+    vr_route_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.h_op = SANDESH_OP_ADD;
+    req.rtr_family = AF_INET;
+    req.rtr_rt_type = type;
+    req.rtr_vrf_id = vrf;
+    req.rtr_src = src;
+    req.rtr_prefix = prefix;
+    req.rtr_prefix_len = plen;
+    req.rtr_nh_id = nh;
+    if (label >= 0) {
+        req.rtr_label_flags = VR_RT_LABEL_VALID_FLAG;
+        req.rtr_label = label;
+    }
+    vr_route_req_process(&req);
+    vrbench_drain();
+
+    return;
+}
+
+static void
+vrbench_label(unsigned int label, unsigned int nh)
+{
+    vr_mpls_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.h_op = SANDESH_OP_ADD;
+    req.mr_label = label;
+    req.mr_nhid = nh;
+    vr_mpls_req_process(&req);
+    vrbench_drain();
+
+    return;
+}
+
+/* a forward flow for each of the source ports the packets cycle through */
+static int
+vrbench_flows(void)
+{
+    unsigned int i;
+    vr_flow_req req;
+
+    for (i = 0; i < vrb_flows; i++) {
+        memset(&req, 0, sizeof(req));
+        req.fr_op = FLOW_OP_FLOW_SET;
+        req.fr_index = -1;
+        req.fr_flags = VR_FLOW_FLAG_ACTIVE;
+        req.fr_action = VR_FLOW_ACTION_FORWARD;
+        req.fr_flow_sip = htonl(VRB_VM_IP(0));
+        req.fr_flow_dip = htonl(VRB_VM_IP(1));
+        req.fr_flow_sport = htons(VRB_SPORT + i);
+        req.fr_flow_dport = htons(VRB_DPORT);
+        req.fr_flow_proto = VR_IP_PROTO_UDP;
+        req.fr_flow_vrf = VRB_VM_VRF;
+        req.fr_ecmp_nh_index = -1;
+        req.fr_src_nh_index = VRB_VM_NH(0);
+        req.fr_rindex = -1;
+        vr_flow_req_process(&req);
+        vrbench_drain();
+
+        if (req.fr_index < 0)
+            return -ENOSPC;
+    }
+
+    return 0;
+}
+
+static int
+vrbench_topology(void)
+{
+    int ret;
+    unsigned int i, vms, flags;
+    unsigned char mac[VR_ETHER_ALEN];
+    vr_nexthop_req rcv;
+
+    ret = vrbench_interface(VRB_FABRIC_VIF, VIF_TYPE_PHYSICAL,
+            HIF_PHYSICAL_INTERFACE_INDEX, VRB_FABRIC_VRF, VIF_FLAG_L3_ENABLED,
+            vrb_router_mac, 0);
+    if (ret)
+        return ret;
+
+    ret = vrbench_interface(VRB_VHOST_VIF, VIF_TYPE_HOST,
+            HIF_VHOST_INTERFACE_INDEX, VRB_FABRIC_VRF, VIF_FLAG_L3_ENABLED,
+            vrb_router_mac, VRB_FABRIC_IP);
+    if (ret)
+        return ret;
+
+    flags = VIF_FLAG_L3_ENABLED;
+    if (vrb_scenario == VRB_FLOW_HIT || vrb_scenario == VRB_FLOW_MISS)
+        flags |= VIF_FLAG_POLICY_ENABLED;
+
+    /* the sender, and the vms it sends to */
+    vms = vrb_fanout + 1;
+    for (i = 0; i < vms; i++) {
+        vrbench_vm_mac(i, mac);
+        ret = vrbench_interface(VRB_VM_VIF(i), VIF_TYPE_VIRTUAL,
+                HIF_VIRTUAL_INTERFACE_INDEX_START + i, VRB_VM_VRF, flags,
+                mac, 0);
+        if (ret)
+            return ret;
+
+        ret = vrbench_encap_nexthop(VRB_VM_NH(i), i);
+        if (ret)
+            return ret;
+
+        vrbench_route(RT_UCAST, VRB_VM_VRF, 0, VRB_VM_IP(i), 32,
+                VRB_VM_NH(i), -1);
+    }
+
+    memset(&rcv, 0, sizeof(rcv));
+    rcv.nhr_type = NH_RCV;
+    rcv.nhr_family = AF_INET;
+    rcv.nhr_id = VRB_RCV_NH;
+    rcv.nhr_vrf = VRB_FABRIC_VRF;
+    rcv.nhr_encap_oif_id = VRB_VHOST_VIF;
+    ret = vrbench_nexthop(&rcv);
+    if (ret)
+        return ret;
+    vrbench_route(RT_UCAST, VRB_FABRIC_VRF, 0, VRB_FABRIC_IP, 32,
+            VRB_RCV_NH, -1);
+
+    switch (vrb_scenario) {
+    case VRB_FLOW_HIT:
+        ret = vrbench_flows();
+        break;
+
+    case VRB_MPLS_UDP_DECAP:
+        vrbench_label(VRB_LABEL, VRB_VM_NH(1));
+        break;
+
+    case VRB_MPLS_UDP_ENCAP:
+        ret = vrbench_tunnel_nexthop(VRB_MPLS_NH, NH_FLAG_TUNNEL_UDP_MPLS);
+        if (!ret)
+            vrbench_route(RT_UCAST, VRB_VM_VRF, 0, VRB_REMOTE_PREFIX, 24,
+                    VRB_MPLS_NH, VRB_LABEL);
+        break;
+
+    case VRB_VXLAN_ENCAP:
+        ret = vrbench_tunnel_nexthop(VRB_VXLAN_NH, NH_FLAG_TUNNEL_VXLAN);
+        if (!ret)
+            vrbench_route(RT_UCAST, VRB_VM_VRF, 0, VRB_REMOTE_PREFIX, 24,
+                    VRB_VXLAN_NH, VRB_VNID);
+        break;
+
+    case VRB_MCAST:
+        ret = vrbench_composite_nexthop(VRB_MCAST_NH,
+                NH_FLAG_COMPOSITE_L3 | NH_FLAG_MCAST);
+        /* the multicast table is keyed in network order */
+        if (!ret)
+            vrbench_route(RT_MCAST, VRB_VM_VRF, htonl(VRB_VM_IP(0)),
+                    htonl(VRB_MCAST_GROUP), 32, VRB_MCAST_NH, -1);
+        break;
+
+    case VRB_ECMP:
+        ret = vrbench_composite_nexthop(VRB_ECMP_NH,
+                NH_FLAG_COMPOSITE_ECMP | NH_FLAG_COMPOSITE_ECMP_HASH);
+        if (!ret)
+            vrbench_route(RT_UCAST, VRB_VM_VRF, 0, VRB_ECMP_PREFIX, 24,
+                    VRB_ECMP_NH, -1);
+        break;
+
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+/* an ip/udp header and payload at buf, returning the length of it all */
+static unsigned int
+vrbench_ip_udp(unsigned char *buf, unsigned int sip, unsigned int dip,
+        unsigned short sport, unsigned short dport, unsigned int payload)
+{
+    struct vr_ip *ip = (struct vr_ip *)buf;
+    struct vr_udp *udp = (struct vr_udp *)(ip + 1);
+    unsigned int len = sizeof(*ip) + sizeof(*udp) + payload;
+
+    memset(buf, 0, len);
+    ip->ip_version = 4;
+    ip->ip_hl = 5;
+    ip->ip_len = htons(len);
+    ip->ip_ttl = 64;
+    ip->ip_proto = VR_IP_PROTO_UDP;
+    ip->ip_saddr = htonl(sip);
+    ip->ip_daddr = htonl(dip);
+    ip->ip_csum = vr_ip_csum(ip);
+
+    udp->udp_sport = htons(sport);
+    udp->udp_dport = htons(dport);
+    udp->udp_length = htons(sizeof(*udp) + payload);
+
+    return len;
+}
+
+static void
+vrbench_template(void)
+{
+    unsigned int dip, len = 0;
+    unsigned int *label;
+    unsigned char mac[VR_ETHER_ALEN];
+
+    switch (vrb_scenario) {
+    case VRB_MPLS_UDP_DECAP:
+        vrbench_eth(vrb_template, vrb_router_mac, vrb_remote_mac);
+        len = VR_ETHER_HLEN;
+        len += vrbench_ip_udp(vrb_template + len, VRB_REMOTE_IP,
+                VRB_FABRIC_IP, VR_MPLS_OVER_UDP_SRC_PORT,
+                VR_MPLS_OVER_UDP_DST_PORT, sizeof(*label) +
+                sizeof(struct vr_ip) + sizeof(struct vr_udp) +
+                VRB_PAYLOAD_LEN);
+        label = (unsigned int *)(vrb_template + len);
+        *label = htonl((VRB_LABEL << VR_MPLS_LABEL_SHIFT) |
+                VR_MPLS_STACK_BIT | 64);
+        len += sizeof(*label);
+        vrb_ports_off = len + sizeof(struct vr_ip);
+        len += vrbench_ip_udp(vrb_template + len, VRB_VM_IP(0) + 0x100,
+                VRB_VM_IP(1), VRB_SPORT, VRB_DPORT, VRB_PAYLOAD_LEN);
+        vrb_template_len = len;
+        return;
+
+    case VRB_MPLS_UDP_ENCAP:
+    case VRB_VXLAN_ENCAP:
+        dip = VRB_REMOTE_PREFIX + 1;
+        break;
+
+    case VRB_MCAST:
+        dip = VRB_MCAST_GROUP;
+        break;
+
+    case VRB_ECMP:
+        dip = VRB_ECMP_PREFIX + 1;
+        break;
+
+    default:
+        dip = VRB_VM_IP(1);
+        break;
+    }
+
+    vrbench_vm_mac(0, mac);
+    vrbench_eth(vrb_template, vrb_router_mac, mac);
+    len = VR_ETHER_HLEN;
+    vrb_ports_off = len + sizeof(struct vr_ip);
+    len += vrbench_ip_udp(vrb_template + len, VRB_VM_IP(0), dip, VRB_SPORT,
+            VRB_DPORT, VRB_PAYLOAD_LEN);
+    vrb_template_len = len;
+
+    return;
+}
+
+/*
+ * the packets of a flow hit cycle through the programmed flows, those of
+ * a miss each have ports of their own
+ */
+static struct vr_packet *
+vrbench_packet(unsigned long seq)
+{
+    unsigned short *ports;
+    struct vr_hpacket *hpkt;
+    struct vr_packet *pkt;
+
+    hpkt = vr_hpacket_alloc(VRB_PKT_SIZE);
+    if (!hpkt)
+        return NULL;
+
+    memcpy(hpkt_data(hpkt), vrb_template, vrb_template_len);
+    ports = (unsigned short *)(hpkt_data(hpkt) + vrb_ports_off);
+    if (vrb_scenario == VRB_FLOW_MISS) {
+        ports[0] = htons(seq & 0xffff);
+        ports[1] = htons((seq >> 16) & 0xffff);
+    } else {
+        ports[0] = htons(VRB_SPORT + seq % vrb_flows);
+    }
+
+    hpkt->hp_tail = hpkt->hp_data + vrb_template_len;
+    pkt = &hpkt->hp_packet;
+    pkt->vp_len = vrb_template_len;
+    pkt->vp_tail = hpkt->hp_tail;
+    pkt->vp_if = vrb_rx_hif->hif_vif;
+    pkt->vp_cpu = vr_get_cpu();
+
+    return pkt;
+}
+
+static void
+vrbench_perf(bool enable)
+{
+    vr_perf_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.h_op = SANDESH_OP_ADD;
+    req.vpr_enable = enable;
+    vr_perf_req_process(&req);
+    vrbench_drain();
+
+    return;
+}
+
+static uint64_t
+vrbench_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+vrbench_tx_packets(void)
+{
+    unsigned int i;
+    uint64_t packets = 0;
+    struct vr_interface *vif;
+
+    for (i = 0; i < vrb_router->vr_max_interfaces; i++) {
+        vif = __vrouter_get_interface(vrb_router, i);
+        if (vif)
+            packets += vif->vif_stats[0].vis_opackets;
+    }
+
+    return packets;
+}
+
+static void
+vrbench_report(unsigned long sent, uint64_t cycles, uint64_t nsecs)
+{
+    unsigned int i;
+    struct vr_perf_stage *vps;
+
+    printf("%s: %lu packets of %u bytes, bursts of %u\n",
+            vrb_scenario_names[vrb_scenario], sent, vrb_template_len,
+            vrb_burst);
+    printf("%-24s %12.0f\n", "packets/sec",
+            nsecs ? (double)sent * 1000000000 / nsecs : 0);
+    printf("%-24s %12.1f\n", "cycles/packet",
+            sent ? (double)cycles / sent : 0);
+    printf("%-24s %12lu\n", "packets out",
+            (unsigned long)vrbench_tx_packets());
+
+    if (!vrb_stages || !vr_perf_stages)
+        return;
+
+    /* a stage includes the stages it calls into */
+    printf("\n%-24s %12s %12s %12s\n", "stage", "packets", "calls",
+            "cycles/pkt");
+    for (i = 0; i < VR_PERF_MAX; i++) {
+        vps = &vr_perf_stages[i];
+        if (!vps->vps_calls)
+            continue;
+
+        if (i < VR_PERF_NH_OUTPUT)
+            printf("%-24s", vrb_stage_names[i]);
+        else
+            printf("nh output %-14s", vrb_nh_names[i - VR_PERF_NH_OUTPUT]);
+        printf(" %12lu %12lu %12.1f\n", (unsigned long)vps->vps_packets,
+                (unsigned long)vps->vps_calls, vps->vps_packets ?
+                (double)vps->vps_cycles / vps->vps_packets : 0);
+    }
+
+    return;
+}
+
+static void
+vrbench_run(void)
+{
+    unsigned int num;
+    unsigned long seq = 0;
+    uint64_t start, start_ns, cycles = 0, nsecs = 0;
+    struct vr_packet *pkts[VRB_BURST_MAX];
+
+    while (seq < vrb_packets) {
+        for (num = 0; num < vrb_burst && seq < vrb_packets; num++) {
+            pkts[num] = vrbench_packet(seq++);
+            if (!pkts[num])
+                break;
+        }
+
+        if (!num) {
+            fprintf(stderr, "vrbench: out of packets\n");
+            break;
+        }
+
+        /* only the datapath is timed, not making of the packets */
+        start_ns = vrbench_nsecs();
+        start = vr_get_cycles();
+        vr_hif_rx_burst(vrb_rx_hif, pkts, num);
+        cycles += vr_get_cycles() - start;
+        nsecs += vrbench_nsecs() - start_ns;
+    }
+
+    vrbench_report(seq, cycles, nsecs);
+
+    return;
+}
+
+static void
+usage(void)
+{
+    unsigned int i;
+
+    fprintf(stderr, "Usage: vrbench [-s <scenario>] [-n <packets>] "
+            "[-b <burst>] [-f <fanout>] [-F <flows>] [-q]\n");
+    fprintf(stderr, "scenarios:");
+    for (i = 0; i < VRB_MAX_SCENARIO; i++)
+        fprintf(stderr, " %s", vrb_scenario_names[i]);
+    fprintf(stderr, "\n");
+
+    return;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    int ret, opt;
+    unsigned int i;
+
+    while ((opt = getopt(argc, (char * const *)argv, "s:n:b:f:F:q")) != -1) {
+        switch (opt) {
+        case 's':
+            for (i = 0; i < VRB_MAX_SCENARIO; i++)
+                if (!strcmp(optarg, vrb_scenario_names[i]))
+                    break;
+            if (i == VRB_MAX_SCENARIO) {
+                usage();
+                return -1;
+            }
+            vrb_scenario = i;
+            break;
+
+        case 'n':
+            vrb_packets = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'b':
+            vrb_burst = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'f':
+            vrb_fanout = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'F':
+            vrb_flows = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'q':
+            vrb_stages = false;
+            break;
+
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (!vrb_burst || vrb_burst > VRB_BURST_MAX)
+        vrb_burst = VRB_BURST_MAX;
+    if (!vrb_fanout || vrb_fanout >= VRB_MAX_VMS)
+        vrb_fanout = VRB_MAX_VMS - 1;
+    if (!vrb_flows)
+        vrb_flows = 1;
+
+    /*
+     * no io threads. the benchmark is the only thread, the one cpu of
+     * the vrouter, and the work the datapath schedules is done inline
+     */
+    ret = vrouter_host_init(VR_MPROTO_SANDESH);
+    if (ret) {
+        fprintf(stderr, "vrbench: vrouter init failed (%d)\n", ret);
+        return ret;
+    }
+
+    vrb_router = vrouter_get(0);
+    ret = vrbench_topology();
+    if (ret) {
+        fprintf(stderr, "vrbench: setting up %s failed (%d)\n",
+                vrb_scenario_names[vrb_scenario], ret);
+        goto exit;
+    }
+
+    if (vrb_scenario == VRB_MPLS_UDP_DECAP)
+        vrb_rx_hif = hif_table[HIF_PHYSICAL_INTERFACE_INDEX];
+    else
+        vrb_rx_hif = hif_table[HIF_VIRTUAL_INTERFACE_INDEX_START];
+
+    vrbench_template();
+    if (vrb_stages)
+        vrbench_perf(true);
+
+    vrbench_run();
+
+    if (vrb_stages)
+        vrbench_perf(false);
+
+exit:
+    vrouter_host_exit();
+
+    return ret;
+}
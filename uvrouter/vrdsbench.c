@@ -0,0 +1,646 @@
+/*
+ * vrdsbench.c -- insert, lookup and delete throughput and latency of the
+ *                tables of dp-core: the mtrie, the flow table, the hash
+ *                table, the index table and the big table
+ *
+ * Copyright (c) 2013 Juniper Networks, Inc. All rights reserved.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "vr_types.h"
+#include "vr_os.h"
+#include "vr_message.h"
+#include "vrouter.h"
+#include "vr_htable.h"
+#include "vr_btable.h"
+#include "vr_index_table.h"
+
+extern int vrouter_host_init(unsigned int);
+extern void vrouter_host_exit(void);
+extern void vr_flow_req_process(void *);
+extern struct vr_flow_entry *vr_find_flow(struct vrouter *,
+        struct vr_flow_key *, unsigned int *);
+
+extern unsigned int vr_flow_entries;
+extern unsigned int vr_oflow_entries;
+
+/* the latencies kept of every run, from which the percentiles come */
+#define VRD_MAX_SAMPLES         (1024 * 1024)
+
+/* a bijection of 32 bits, for keys that are distinct and spread out */
+#define VRD_SCRAMBLE(i)         ((unsigned int)(i) * 2654435761U)
+
+#define VRD_ITABLE_BITS         24
+/* the flow table is looked at in buckets of as many entries */
+#define VRD_FLOW_BUCKET         4U
+
+enum vrd_table {
+    VRD_MTRIE,
+    VRD_FLOW,
+    VRD_HTABLE,
+    VRD_ITABLE,
+    VRD_BTABLE,
+    VRD_MAX_TABLE,
+};
+
+static const char *vrd_table_names[VRD_MAX_TABLE] = {
+    [VRD_MTRIE]     =   "mtrie",
+    [VRD_FLOW]      =   "flow",
+    [VRD_HTABLE]    =   "htable",
+    [VRD_ITABLE]    =   "itable",
+    [VRD_BTABLE]    =   "btable",
+};
+
+static unsigned int vrd_tables = (1 << VRD_MAX_TABLE) - 1;
+static unsigned long vrd_lookups = 1000000;
+static double vrd_load = 0.75;
+
+static unsigned int vrd_routes = 100000;
+static unsigned int vrd_vrfs = 1000;
+static unsigned int vrd_flows = 1024 * 1024;
+static unsigned int vrd_macs = 64 * 1024;
+static unsigned int vrd_indices = 64 * 1024;
+static unsigned int vrd_bentries = 1024 * 1024;
+static unsigned int vrd_besize = 64;
+
+static struct vrouter *vrd_router;
+static uint32_t *vrd_samples;
+static uint64_t vrd_rand_state = 88172645463325252ULL;
+
+/* the results are json, an object per line */
+static const char *vrd_table;
+static unsigned long vrd_entries;
+
+static inline uint64_t
+vrd_rand(void)
+{
+    vrd_rand_state ^= vrd_rand_state << 13;
+    vrd_rand_state ^= vrd_rand_state >> 7;
+    vrd_rand_state ^= vrd_rand_state << 17;
+
+    return vrd_rand_state;
+}
+
+static uint64_t
+vrd_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+vrd_sample_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static inline uint32_t
+vrd_percentile(unsigned long num, double pct)
+{
+    return vrd_samples[(unsigned long)((num - 1) * pct)];
+}
+
+/*
+ * every op is timed, and every step'th latency kept. the latencies
+ * include the reading of the cycle counter
+ */
+static void
+vrd_run(const char *op, unsigned long ops, int (*fn)(unsigned long))
+{
+    unsigned long i, num = 0, step, failed = 0;
+    uint64_t start, cycles, nsecs, total = 0;
+
+    if (!ops)
+        return;
+
+    step = ops / VRD_MAX_SAMPLES + 1;
+    nsecs = vrd_nsecs();
+    for (i = 0; i < ops; i++) {
+        start = vr_get_cycles();
+        if (fn(i))
+            failed++;
+        cycles = vr_get_cycles() - start;
+        total += cycles;
+        if (!(i % step))
+            vrd_samples[num++] = cycles > UINT32_MAX ? UINT32_MAX : cycles;
+    }
+    nsecs = vrd_nsecs() - nsecs;
+
+    qsort(vrd_samples, num, sizeof(vrd_samples[0]), vrd_sample_cmp);
+    printf("{\"table\":\"%s\",\"op\":\"%s\",\"entries\":%lu,\"load\":%.2f,"
+            "\"ops\":%lu,\"failed\":%lu,\"mops\":%.3f,\"ns_per_op\":%.1f,"
+            "\"cycles_per_op\":%.1f,\"p50\":%u,\"p90\":%u,\"p99\":%u,"
+            "\"p999\":%u,\"max\":%u}\n", vrd_table, op, vrd_entries,
+            vrd_load, ops, failed, nsecs ? (double)ops * 1000 / nsecs : 0,
+            (double)nsecs / ops, (double)total / ops,
+            vrd_percentile(num, 0.5), vrd_percentile(num, 0.9),
+            vrd_percentile(num, 0.99), vrd_percentile(num, 0.999),
+            vrd_samples[num - 1]);
+    fflush(stdout);
+
+    return;
+}
+
+/*
+ * the mtrie. vrd_routes consecutive /24s in each of vrd_vrfs vrfs, all
+ * to the discard nexthop, as the agent would add them
+ */
+static struct vr_rtable *vrd_rtable;
+
+static void
+vrd_mtrie_route(unsigned long i, struct vr_route_req *rt)
+{
+    memset(rt, 0, sizeof(*rt));
+    rt->rtr_req.rtr_vrf_id = i / vrd_routes;
+    rt->rtr_req.rtr_family = AF_INET;
+    rt->rtr_req.rtr_prefix = 0x0a000000 + ((i % vrd_routes) << 8);
+    rt->rtr_req.rtr_prefix_len = 24;
+    rt->rtr_req.rtr_nh_id = NH_DISCARD_ID;
+
+    return;
+}
+
+static int
+vrd_mtrie_add(unsigned long i)
+{
+    struct vr_route_req rt;
+
+    vrd_mtrie_route(i, &rt);
+    return vrd_rtable->algo_add(vrd_rtable, &rt);
+}
+
+static int
+vrd_mtrie_lookup(unsigned long i)
+{
+    uint64_t r = vrd_rand();
+    struct vr_route_req rt;
+
+    vrd_mtrie_route(r % vrd_entries, &rt);
+    rt.rtr_req.rtr_prefix |= (r >> 32) & 0xff;
+    rt.rtr_req.rtr_prefix_len = 32;
+
+    return vrd_rtable->algo_lookup(rt.rtr_req.rtr_vrf_id, &rt, NULL) ?
+        0 : -ENOENT;
+}
+
+static int
+vrd_mtrie_del(unsigned long i)
+{
+    struct vr_route_req rt;
+
+    vrd_mtrie_route(i, &rt);
+    return vrd_rtable->algo_del(vrd_rtable, &rt);
+}
+
+static void
+vrd_mtrie_run(void)
+{
+    vrd_rtable = vrd_router->vr_inet_rtable;
+    if (!vrd_rtable)
+        return;
+
+    if (vrd_vrfs > vrd_rtable->algo_max_vrfs)
+        vrd_vrfs = vrd_rtable->algo_max_vrfs;
+    vrd_entries = (unsigned long)vrd_routes * vrd_vrfs;
+
+    vrd_run("insert", vrd_entries, vrd_mtrie_add);
+    vrd_run("lookup", vrd_lookups, vrd_mtrie_lookup);
+    vrd_run("delete", vrd_entries, vrd_mtrie_del);
+
+    return;
+}
+
+/*
+ * the flow table, sized for vrd_flows at vrd_load. flows are set and
+ * reset with the requests of the agent, and looked up as the datapath
+ * does
+ */
+static unsigned int *vrd_flow_index;
+
+static void
+vrd_flow_key(unsigned long i, struct vr_flow_key *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->key_src_ip = htonl(0x0a000000 + (i >> 16));
+    key->key_dest_ip = htonl(0xc0a80001);
+    key->key_src_port = htons(i & 0xffff);
+    key->key_dst_port = htons(80);
+    key->key_proto = VR_IP_PROTO_TCP;
+    key->key_vrf_id = i % 256;
+
+    return;
+}
+
+static int
+vrd_flow_set(unsigned long i, bool active)
+{
+    struct vr_flow_key key;
+    struct vr_message *response;
+    vr_flow_req req;
+
+    vrd_flow_key(i, &key);
+
+    memset(&req, 0, sizeof(req));
+    req.fr_op = FLOW_OP_FLOW_SET;
+    req.fr_index = active ? -1 : (int)vrd_flow_index[i];
+    req.fr_flags = active ? VR_FLOW_FLAG_ACTIVE : 0;
+    req.fr_action = VR_FLOW_ACTION_FORWARD;
+    req.fr_flow_sip = key.key_src_ip;
+    req.fr_flow_dip = key.key_dest_ip;
+    req.fr_flow_sport = key.key_src_port;
+    req.fr_flow_dport = key.key_dst_port;
+    req.fr_flow_proto = key.key_proto;
+    req.fr_flow_vrf = key.key_vrf_id;
+    req.fr_ecmp_nh_index = -1;
+    req.fr_rindex = -1;
+    vr_flow_req_process(&req);
+
+    while ((response = vr_message_dequeue_response()))
+        vr_message_free(response);
+
+    if (req.fr_index < 0)
+        return -ENOSPC;
+    vrd_flow_index[i] = req.fr_index;
+
+    return 0;
+}
+
+static int
+vrd_flow_add(unsigned long i)
+{
+    return vrd_flow_set(i, true);
+}
+
+static int
+vrd_flow_lookup(unsigned long i)
+{
+    unsigned int index;
+    struct vr_flow_key key;
+
+    vrd_flow_key(vrd_rand() % vrd_entries, &key);
+    return vr_find_flow(vrd_router, &key, &index) ? 0 : -ENOENT;
+}
+
+static int
+vrd_flow_del(unsigned long i)
+{
+    return vrd_flow_set(i, false);
+}
+
+static void
+vrd_flow_run(void)
+{
+    vrd_flow_index = calloc(vrd_flows, sizeof(*vrd_flow_index));
+    if (!vrd_flow_index)
+        return;
+
+    vrd_entries = vrd_flows;
+    vrd_run("insert", vrd_entries, vrd_flow_add);
+    vrd_run("lookup", vrd_lookups, vrd_flow_lookup);
+    vrd_run("delete", vrd_entries, vrd_flow_del);
+
+    free(vrd_flow_index);
+    vrd_flow_index = NULL;
+
+    return;
+}
+
+/* the hash table, with entries as those of the bridge table */
+struct vrd_hentry {
+    unsigned char he_mac[VR_ETHER_ALEN];
+    unsigned short he_vrf;
+    unsigned int he_valid;
+    unsigned int he_data;
+};
+
+static vr_htable_t vrd_htable;
+
+static bool
+vrd_hentry_valid(vr_htable_t table, vr_hentry_t ent, unsigned int index)
+{
+    return ent && ((struct vrd_hentry *)ent)->he_valid;
+}
+
+static void
+vrd_hentry_key(unsigned long i, struct vrd_hentry *key)
+{
+    unsigned int word = VRD_SCRAMBLE(i);
+
+    key->he_mac[0] = 0x02;
+    key->he_mac[1] = 0;
+    memcpy(&key->he_mac[2], &word, sizeof(word));
+    key->he_vrf = i % 64;
+
+    return;
+}
+
+static int
+vrd_htable_add(unsigned long i)
+{
+    struct vrd_hentry key, *ent;
+
+    vrd_hentry_key(i, &key);
+    ent = vr_find_free_hentry(vrd_htable, &key, NULL);
+    if (!ent)
+        return -ENOSPC;
+
+    memcpy(ent, &key, offsetof(struct vrd_hentry, he_valid));
+    ent->he_data = i;
+    ent->he_valid = 1;
+
+    return 0;
+}
+
+static int
+vrd_htable_lookup(unsigned long i)
+{
+    struct vrd_hentry key;
+
+    vrd_hentry_key(vrd_rand() % vrd_entries, &key);
+    return vr_find_hentry(vrd_htable, &key, NULL) ? 0 : -ENOENT;
+}
+
+static int
+vrd_htable_del(unsigned long i)
+{
+    struct vrd_hentry key, *ent;
+
+    vrd_hentry_key(i, &key);
+    ent = vr_find_hentry(vrd_htable, &key, NULL);
+    if (!ent)
+        return -ENOENT;
+    ent->he_valid = 0;
+
+    return 0;
+}
+
+static void
+vrd_htable_run(void)
+{
+    unsigned int entries, oentries;
+
+    /* in buckets of 4 */
+    entries = ((unsigned int)(vrd_macs / vrd_load) + 3) & ~3;
+    oentries = ((entries / 8) + 3) & ~3;
+    if (oentries < 4)
+        oentries = 4;
+
+    vrd_htable = vr_htable_create(entries, oentries,
+            sizeof(struct vrd_hentry), offsetof(struct vrd_hentry, he_valid),
+            vrd_hentry_valid);
+    if (!vrd_htable)
+        return;
+
+    vrd_entries = vrd_macs;
+    vrd_run("insert", vrd_entries, vrd_htable_add);
+    vrd_run("lookup", vrd_lookups, vrd_htable_lookup);
+    vrd_run("delete", vrd_entries, vrd_htable_del);
+
+    vr_htable_delete(vrd_htable);
+    vrd_htable = NULL;
+
+    return;
+}
+
+/* the index table, laid out as the one of the vxlan vnids */
+static vr_itable_t vrd_itable;
+
+static inline unsigned int
+vrd_itable_index(unsigned long i)
+{
+    return VRD_SCRAMBLE(i) & ((1 << VRD_ITABLE_BITS) - 1);
+}
+
+static int
+vrd_itable_set(unsigned long i)
+{
+    void *old;
+
+    old = vr_itable_set(vrd_itable, vrd_itable_index(i), (void *)(i + 1));
+    return old == VR_ITABLE_ERR_PTR ? -ENOMEM : 0;
+}
+
+static int
+vrd_itable_get(unsigned long i)
+{
+    return vr_itable_get(vrd_itable,
+            vrd_itable_index(vrd_rand() % vrd_entries)) ? 0 : -ENOENT;
+}
+
+static int
+vrd_itable_del(unsigned long i)
+{
+    return vr_itable_del(vrd_itable, vrd_itable_index(i)) ? 0 : -ENOENT;
+}
+
+static void
+vrd_itable_run(void)
+{
+    vrd_itable = vr_itable_create(VRD_ITABLE_BITS, 2, 12, 12);
+    if (!vrd_itable)
+        return;
+
+    if (vrd_indices > (1 << VRD_ITABLE_BITS))
+        vrd_indices = 1 << VRD_ITABLE_BITS;
+
+    vrd_entries = vrd_indices;
+    vrd_run("insert", vrd_entries, vrd_itable_set);
+    vrd_run("lookup", vrd_lookups, vrd_itable_get);
+    vrd_run("delete", vrd_entries, vrd_itable_del);
+
+    vr_itable_delete(vrd_itable, NULL);
+    vrd_itable = NULL;
+
+    return;
+}
+
+/* the big table only looks up, in order and at random */
+static struct vr_btable *vrd_btable;
+static volatile unsigned char vrd_sink;
+
+static int
+vrd_btable_seq(unsigned long i)
+{
+    unsigned char *ent;
+
+    ent = vr_btable_get(vrd_btable, i % vrd_entries);
+    if (!ent)
+        return -ENOENT;
+    vrd_sink = *ent;
+
+    return 0;
+}
+
+static int
+vrd_btable_random(unsigned long i)
+{
+    unsigned char *ent;
+
+    ent = vr_btable_get(vrd_btable, vrd_rand() % vrd_entries);
+    if (!ent)
+        return -ENOENT;
+    vrd_sink = *ent;
+
+    return 0;
+}
+
+static void
+vrd_btable_run(void)
+{
+    vrd_btable = vr_btable_alloc(vrd_bentries, vrd_besize);
+    if (!vrd_btable)
+        return;
+
+    vrd_entries = vrd_bentries;
+    vrd_run("lookup-seq", vrd_lookups, vrd_btable_seq);
+    vrd_run("lookup", vrd_lookups, vrd_btable_random);
+
+    vr_btable_free(vrd_btable);
+    vrd_btable = NULL;
+
+    return;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: vrdsbench [-t <table>] [-o <lookups>] "
+            "[-l <load factor>]\n"
+            "\t[-r <routes per vrf>] [-v <vrfs>] [-F <flows>] "
+            "[-m <macs>]\n"
+            "\t[-i <indices>] [-b <btable entries>] [-e <entry size>]\n"
+            "tables: mtrie flow htable itable btable\n");
+
+    return;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    int ret, opt;
+    unsigned int i, entries;
+
+    while ((opt = getopt(argc, (char * const *)argv,
+                    "t:o:l:r:v:F:m:i:b:e:")) != -1) {
+        switch (opt) {
+        case 't':
+            for (i = 0; i < VRD_MAX_TABLE; i++)
+                if (!strcmp(optarg, vrd_table_names[i]))
+                    break;
+            if (i == VRD_MAX_TABLE) {
+                usage();
+                return -1;
+            }
+            vrd_tables = 1 << i;
+            break;
+
+        case 'o':
+            vrd_lookups = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'l':
+            vrd_load = strtod(optarg, NULL);
+            break;
+
+        case 'r':
+            vrd_routes = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'v':
+            vrd_vrfs = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'F':
+            vrd_flows = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'm':
+            vrd_macs = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'i':
+            vrd_indices = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'b':
+            vrd_bentries = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'e':
+            vrd_besize = strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (vrd_load <= 0 || vrd_load > 1 || !vrd_routes || !vrd_vrfs ||
+            !vrd_flows || !vrd_macs || !vrd_indices || !vrd_bentries ||
+            !vrd_besize) {
+        usage();
+        return -1;
+    }
+
+    /* the flow table is sized before the vrouter comes up */
+    entries = (unsigned int)(vrd_flows / vrd_load);
+    vr_flow_entries = (entries + VRD_FLOW_BUCKET - 1) &
+        ~(VRD_FLOW_BUCKET - 1);
+    vr_oflow_entries = vr_flow_entries / 64;
+
+    vrd_samples = malloc(VRD_MAX_SAMPLES * sizeof(*vrd_samples));
+    if (!vrd_samples)
+        return -ENOMEM;
+
+    ret = vrouter_host_init(VR_MPROTO_SANDESH);
+    if (ret) {
+        fprintf(stderr, "vrdsbench: vrouter init failed (%d)\n", ret);
+        free(vrd_samples);
+        return ret;
+    }
+    vrd_router = vrouter_get(0);
+
+    for (i = 0; i < VRD_MAX_TABLE; i++) {
+        if (!(vrd_tables & (1 << i)))
+            continue;
+
+        vrd_table = vrd_table_names[i];
+        switch (i) {
+        case VRD_MTRIE:
+            vrd_mtrie_run();
+            break;
+
+        case VRD_FLOW:
+            vrd_flow_run();
+            break;
+
+        case VRD_HTABLE:
+            vrd_htable_run();
+            break;
+
+        case VRD_ITABLE:
+            vrd_itable_run();
+            break;
+
+        case VRD_BTABLE:
+            vrd_btable_run();
+            break;
+        }
+    }
+
+    vrouter_host_exit();
+    free(vrd_samples);
+
+    return 0;
+}